@@ -0,0 +1,117 @@
+#include "Benchmark.h"
+#include "luna/State.h"
+#include "luna/Table.h"
+#include "luna/String.h"
+#include "luna/LibAPI.h"
+#include <tuple>
+#include <algorithm>
+#include <vector>
+
+namespace
+{
+    // Script callback called by host
+    const char *kCallback = "function callback(a, b) return a * b + 1 end";
+
+    luna::Value GetGlobal(luna::State &state, const char *name)
+    {
+        luna::Value key(state.GetString(name));
+        return state.GetGlobal()->table_->GetValue(key);
+    }
+
+    double Add(double a, double b)
+    {
+        return a + b;
+    }
+
+    int AddByStackAPI(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(2, luna::ValueT_Number, luna::ValueT_Number))
+            return 0;
+
+        api.PushNumber(api.GetNumber(0) + api.GetNumber(1));
+        return 1;
+    }
+
+    // Script loop which calls c function 'add' 'iterations' times
+    void RunAddLoop(luna::State &state, std::size_t iterations)
+    {
+        auto loop = "local s = 0 for i = 1, " + std::to_string(iterations) +
+                    " do s = add(s, i) end";
+        state.DoString(loop);
+    }
+} // namespace
+
+BENCHMARK(call_script_by_stack_api)
+{
+    luna::State state;
+    state.DoString(kCallback);
+    auto callback = GetGlobal(state, "callback");
+
+    StartTimer();
+    luna::StackAPI api(&state);
+    double sum = 0.0;
+    for (std::size_t i = 0; i < iterations; ++i)
+    {
+        api.PushValue(callback);
+        api.PushNumber(i);
+        api.PushNumber(2);
+        api.Call(2, 1);
+        sum += api.GetNumber(-1);
+        api.Pop(1);
+    }
+    KeepValue(sum);
+}
+
+BENCHMARK(call_script_typed)
+{
+    luna::State state;
+    state.DoString(kCallback);
+    auto callback = GetGlobal(state, "callback");
+
+    StartTimer();
+    double sum = 0.0;
+    for (std::size_t i = 0; i < iterations; ++i)
+        sum += state.Call<double>(callback, i, 2);
+    KeepValue(sum);
+}
+
+BENCHMARK(call_script_batch)
+{
+    luna::State state;
+    state.DoString(kCallback);
+    auto callback = GetGlobal(state, "callback");
+
+    // Batches of events are reused to keep them in cache
+    const std::size_t batch = 1024;
+    std::vector<std::tuple<double, double>> args;
+    for (std::size_t i = 0; i < batch; ++i)
+        args.push_back(std::make_tuple(i, 2));
+    std::vector<double> results(batch);
+
+    StartTimer();
+    double sum = 0.0;
+    for (std::size_t i = 0; i < iterations; i += batch)
+    {
+        auto count = std::min(batch, iterations - i);
+        state.CallBatch(callback, args.data(), count, results.data());
+        sum += results[count - 1];
+    }
+    KeepValue(sum);
+}
+
+BENCHMARK(call_cfunc_by_stack_api)
+{
+    luna::State state;
+    luna::Library lib(&state);
+    lib.RegisterFunc("add", AddByStackAPI);
+    RunAddLoop(state, iterations);
+}
+
+BENCHMARK(call_cfunc_bound)
+{
+    luna::State state;
+    luna::Library lib(&state);
+    lib.RegisterFunc("add", LUNA_FUNCTION(Add));
+    RunAddLoop(state, iterations);
+}
@@ -0,0 +1,74 @@
+#include "Benchmark.h"
+#include "luna/GC.h"
+#include "luna/Table.h"
+
+namespace
+{
+    void StoreTable(luna::GC &gc, luna::Table *table, double key,
+                    luna::Table *value_table)
+    {
+        luna::Value k;
+        k.type_ = luna::ValueT_Number;
+        k.num_ = key;
+
+        luna::Value v;
+        v.type_ = luna::ValueT_Table;
+        v.table_ = value_table;
+
+        table->SetValue(k, v);
+        CHECK_BARRIER_VALUE(gc, table, v);
+    }
+} // namespace
+
+BENCHMARK(gc_alloc_young_garbage)
+{
+    // All new tables die young, cost of minor GC is included
+    luna::GC gc;
+    auto root = [](luna::GCObjectVisitor *) { };
+    gc.SetRootTraveller(root, root);
+
+    for (std::size_t i = 0; i < iterations; ++i)
+    {
+        gc.NewTable();
+        gc.CheckGC();
+    }
+}
+
+BENCHMARK(gc_alloc_survivors)
+{
+    // One of 8 new tables survives, major GCs run as heap grows
+    luna::GC gc;
+    auto old = gc.NewTable(luna::GCGen2);
+    auto root = [old](luna::GCObjectVisitor *v) { old->Accept(v); };
+    gc.SetRootTraveller(root, root);
+
+    for (std::size_t i = 0; i < iterations; ++i)
+    {
+        auto table = gc.NewTable();
+        if (i % 8 == 0)
+            StoreTable(gc, old, i / 8 + 1, table);
+        gc.CheckGC();
+    }
+}
+
+BENCHMARK(gc_full_100k_tables)
+{
+    // Full GC of 100k alive tables in a tree
+    luna::GC gc;
+    auto old = gc.NewTable(luna::GCGen2);
+    auto root = [old](luna::GCObjectVisitor *v) { old->Accept(v); };
+    gc.SetRootTraveller(root, root);
+
+    for (int i = 0; i < 1000; ++i)
+    {
+        auto node = gc.NewTable();
+        StoreTable(gc, old, i + 1, node);
+        for (int j = 0; j < 99; ++j)
+            StoreTable(gc, node, j + 1, gc.NewTable());
+    }
+    gc.FullGC();
+
+    StartTimer();
+    for (std::size_t i = 0; i < iterations; ++i)
+        gc.FullGC();
+}
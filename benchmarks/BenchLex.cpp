@@ -0,0 +1,45 @@
+#include "Benchmark.h"
+#include "luna/Lex.h"
+#include "luna/State.h"
+#include "luna/String.h"
+#include <string>
+
+namespace
+{
+    // Source which has all kinds of tokens
+    const char *kSource =
+        "-- comment of function\n"
+        "local function update(bodies, dt)\n"
+        "    for i = 1, #bodies do\n"
+        "        local b = bodies[i]\n"
+        "        b.x = b.x + dt * b.vx * 0.5e-3\n"
+        "        b.name = \"body\" .. i .. 'th'\n"
+        "        if b.x >= 100 and b.y ~= 0x1F then b.vx = -b.vx end\n"
+        "    end\n"
+        "    return [[long string]], {1, 2, 3; x = 4}\n"
+        "end\n";
+} // namespace
+
+BENCHMARK(lexer_throughput)
+{
+    // About 1MB of source
+    std::string source;
+    while (source.size() < 1024 * 1024)
+        source += kSource;
+    SetBytesPerIteration(source.size());
+
+    luna::State state;
+    luna::String name("bench");
+
+    StartTimer();
+    std::size_t tokens = 0;
+    for (std::size_t i = 0; i < iterations; ++i)
+    {
+        luna::Lexer lexer(&state, &name, source.data(),
+                          source.data() + source.size());
+        luna::TokenDetail token;
+        while (lexer.GetToken(&token) != luna::Token_EOF)
+            ++tokens;
+    }
+    KeepValue(tokens);
+}
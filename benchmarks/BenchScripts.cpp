@@ -0,0 +1,60 @@
+#include "Benchmark.h"
+#include "luna/State.h"
+#include "luna/Exception.h"
+#include "luna/LibBase.h"
+#include "luna/LibMath.h"
+#include "luna/LibString.h"
+#include "luna/LibTable.h"
+#include <stdio.h>
+
+namespace
+{
+    // Benchmark which runs script 'name'.lua in scripts directory once
+    // in each iteration, a new State is created for each run
+    class ScriptBenchmark : public BenchmarkBase
+    {
+    public:
+        explicit ScriptBenchmark(const char *name)
+            : script_(name)
+        {
+            name_ = std::string("script_") + name;
+            SetFixedIterations(1);
+        }
+
+    protected:
+        virtual void Run(std::size_t iterations)
+        {
+            auto path = GetScriptsDir() + "/" + script_ + ".lua";
+            for (std::size_t i = 0; i < iterations; ++i)
+            {
+                luna::State state;
+                lib::base::RegisterLibBase(&state);
+                lib::math::RegisterLibMath(&state);
+                lib::string::RegisterLibString(&state);
+                lib::table::RegisterLibTable(&state);
+
+                try
+                {
+                    state.DoModule(path);
+                }
+                catch (const luna::OpenFileFail &exp)
+                {
+                    printf("can not open file %s\n", exp.What().c_str());
+                }
+                catch (const luna::Exception &exp)
+                {
+                    printf("%s\n", exp.What().c_str());
+                }
+            }
+        }
+
+    private:
+        std::string script_;
+    };
+
+    ScriptBenchmark binary_trees("binary_trees");
+    ScriptBenchmark fib("fib");
+    ScriptBenchmark nbody("nbody");
+    ScriptBenchmark pairs("pairs");
+    ScriptBenchmark string_build("string_build");
+} // namespace
@@ -0,0 +1,45 @@
+#include "Benchmark.h"
+#include "luna/State.h"
+#include "luna/String.h"
+#include <string>
+#include <vector>
+
+namespace
+{
+    std::vector<std::string> GetNames(std::size_t count)
+    {
+        std::vector<std::string> names;
+        for (std::size_t i = 0; i < count; ++i)
+            names.push_back("name_" + std::to_string(i));
+        return names;
+    }
+} // namespace
+
+BENCHMARK(string_intern_existing)
+{
+    luna::State state;
+    auto names = GetNames(1024);
+    for (const auto &name : names)
+        state.GetString(name);
+
+    StartTimer();
+    std::size_t length = 0;
+    for (std::size_t i = 0; i < iterations; ++i)
+        length += state.GetString(names[i % names.size()])->GetLength();
+    KeepValue(length);
+}
+
+BENCHMARK(string_intern_new)
+{
+    // New strings are garbage, GC collects them as usual
+    luna::State state;
+    auto names = GetNames(iterations);
+
+    StartTimer();
+    for (std::size_t i = 0; i < iterations; ++i)
+    {
+        state.GetString(names[i]);
+        if (i % 1024 == 0)
+            state.CheckRunGC();
+    }
+}
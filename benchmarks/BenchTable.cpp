@@ -0,0 +1,93 @@
+#include "Benchmark.h"
+#include "luna/State.h"
+#include "luna/Table.h"
+#include "luna/String.h"
+#include <string>
+#include <vector>
+
+namespace
+{
+    // Count of keys in benchmark tables
+    const std::size_t kKeyCount = 1024;
+
+    luna::Value NumberValue(double num)
+    {
+        luna::Value value;
+        value.type_ = luna::ValueT_Number;
+        value.num_ = num;
+        return value;
+    }
+
+    // Get values of 'keys' from 'table' in turn
+    double GetValues(luna::Table &table, const std::vector<luna::Value> &keys,
+                     std::size_t iterations)
+    {
+        double sum = 0.0;
+        for (std::size_t i = 0; i < iterations; ++i)
+            sum += table.GetValue(keys[i % keys.size()]).num_;
+        return sum;
+    }
+} // namespace
+
+BENCHMARK(table_get_array_key)
+{
+    luna::Table table;
+    std::vector<luna::Value> keys;
+    for (std::size_t i = 1; i <= kKeyCount; ++i)
+    {
+        keys.push_back(NumberValue(i));
+        table.SetValue(keys.back(), NumberValue(i));
+    }
+
+    StartTimer();
+    KeepValue(GetValues(table, keys, iterations));
+}
+
+BENCHMARK(table_get_number_key)
+{
+    luna::Table table;
+    std::vector<luna::Value> keys;
+    for (std::size_t i = 1; i <= kKeyCount; ++i)
+    {
+        keys.push_back(NumberValue(i + 0.5));
+        table.SetValue(keys.back(), NumberValue(i));
+    }
+
+    StartTimer();
+    KeepValue(GetValues(table, keys, iterations));
+}
+
+BENCHMARK(table_get_string_key)
+{
+    luna::State state;
+    luna::Table table;
+    std::vector<luna::Value> keys;
+    for (std::size_t i = 1; i <= kKeyCount; ++i)
+    {
+        keys.push_back(luna::Value(state.GetString("key" + std::to_string(i))));
+        table.SetValue(keys.back(), NumberValue(i));
+    }
+
+    StartTimer();
+    KeepValue(GetValues(table, keys, iterations));
+}
+
+BENCHMARK(table_set_array_key)
+{
+    luna::Table table;
+    for (std::size_t i = 0; i < iterations; ++i)
+        table.SetValue(NumberValue(i % kKeyCount + 1), NumberValue(i));
+    KeepValue(table.ArraySize());
+}
+
+BENCHMARK(table_set_new_key)
+{
+    // Each table grows to kKeyCount keys of hash part
+    std::size_t count = 0;
+    while (count < iterations)
+    {
+        luna::Table table;
+        for (std::size_t i = 0; i < kKeyCount && count < iterations; ++i, ++count)
+            table.SetValue(NumberValue(i + 0.5), NumberValue(i));
+    }
+}
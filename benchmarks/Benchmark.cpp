@@ -0,0 +1,233 @@
+#include "Benchmark.h"
+#include <algorithm>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace
+{
+    std::string g_scripts_dir = BENCHMARK_SCRIPTS_DIR;
+    volatile double g_sink;
+
+    // Result of all repetitions of one benchmark
+    struct Result
+    {
+        std::string name_;
+        std::size_t iterations_;
+        // Nanoseconds per iteration of each repetition, sorted
+        std::vector<double> ns_;
+        std::size_t bytes_per_iteration_;
+
+        double Median() const
+        { return ns_[ns_.size() / 2]; }
+
+        double MBPerSecond() const
+        { return bytes_per_iteration_ * 1000.0 / Median(); }
+    };
+
+    // Escape 'str' as JSON string
+    std::string JsonString(const std::string &str)
+    {
+        std::string json = "\"";
+        for (auto c : str)
+        {
+            if (c == '"' || c == '\\')
+                json.push_back('\\');
+            json.push_back(c);
+        }
+        json.push_back('"');
+        return json;
+    }
+} // namespace
+
+class BenchmarkManager
+{
+public:
+    BenchmarkManager(const BenchmarkManager&) = delete;
+    void operator = (const BenchmarkManager&) = delete;
+
+    static BenchmarkManager& GetInstance()
+    {
+        static BenchmarkManager instance;
+        return instance;
+    }
+
+    void AddBenchmark(BenchmarkBase *bench)
+    {
+        all_.push_back(bench);
+    }
+
+    // Run benchmarks whose names contain 'filter', each benchmark runs
+    // 'repetitions' times, and each repetition takes 'min_ms' at least
+    // unless its iterations are fixed
+    std::vector<Result> RunAll(const std::string &filter,
+                               int repetitions, double min_ms)
+    {
+        std::vector<Result> results;
+        for (auto bench : all_)
+        {
+            if (bench->GetName().find(filter) == std::string::npos)
+                continue;
+
+            Result result;
+            result.name_ = bench->GetName();
+            result.iterations_ = Calibrate(bench, min_ms * 1e6);
+            result.bytes_per_iteration_ = bench->GetBytesPerIteration();
+            for (int i = 0; i < repetitions; ++i)
+                result.ns_.push_back(bench->Measure(result.iterations_) /
+                                     result.iterations_);
+            std::sort(result.ns_.begin(), result.ns_.end());
+
+            printf("%-32s %12zu %14.1f ns", result.name_.c_str(),
+                   result.iterations_, result.Median());
+            if (result.bytes_per_iteration_ != 0)
+                printf(" %10.1f MB/s", result.MBPerSecond());
+            printf("\n");
+            fflush(stdout);
+
+            results.push_back(result);
+        }
+        return results;
+    }
+
+private:
+    BenchmarkManager() { }
+
+    // Get iterations which take 'min_ns' at least
+    std::size_t Calibrate(BenchmarkBase *bench, double min_ns)
+    {
+        if (bench->GetFixedIterations() != 0)
+            return bench->GetFixedIterations();
+
+        std::size_t iterations = 1;
+        for (;;)
+        {
+            auto ns = bench->Measure(iterations);
+            if (ns >= min_ns)
+                return iterations;
+
+            // Grow by 10 times at most, and 20% more than estimation
+            auto estimate = ns > 0.0 ? min_ns / ns * 1.2 : 10.0;
+            iterations = static_cast<std::size_t>(
+                iterations * std::min(std::max(estimate, 1.5), 10.0));
+        }
+    }
+
+    std::vector<BenchmarkBase *> all_;
+};
+
+BenchmarkBase::BenchmarkBase()
+    : bytes_per_iteration_(0), fixed_iterations_(0), stopped_(false)
+{
+    BenchmarkManager::GetInstance().AddBenchmark(this);
+}
+
+double BenchmarkBase::Measure(std::size_t iterations)
+{
+    stopped_ = false;
+    StartTimer();
+    Run(iterations);
+    if (!stopped_)
+        StopTimer();
+    return std::chrono::duration<double, std::nano>(stop_ - start_).count();
+}
+
+void BenchmarkBase::StopTimer()
+{
+    stop_ = std::chrono::steady_clock::now();
+    stopped_ = true;
+}
+
+const std::string & GetScriptsDir()
+{
+    return g_scripts_dir;
+}
+
+void KeepValue(double value)
+{
+    g_sink = value;
+}
+
+void WriteJson(FILE *file, const std::vector<Result> &results, int repetitions)
+{
+    fprintf(file, "{\n  \"context\": {\n");
+#ifdef LUNA_NAN_BOXING
+    fprintf(file, "    \"nan_boxing\": true,\n");
+#else
+    fprintf(file, "    \"nan_boxing\": false,\n");
+#endif // LUNA_NAN_BOXING
+    fprintf(file, "    \"repetitions\": %d\n  },\n", repetitions);
+
+    fprintf(file, "  \"benchmarks\": [");
+    for (std::size_t i = 0; i < results.size(); ++i)
+    {
+        const auto &result = results[i];
+        fprintf(file, "%s\n    {\n", i == 0 ? "" : ",");
+        fprintf(file, "      \"name\": %s,\n", JsonString(result.name_).c_str());
+        fprintf(file, "      \"iterations\": %zu,\n", result.iterations_);
+        fprintf(file, "      \"ns_per_iteration\": %.3f,\n", result.Median());
+        fprintf(file, "      \"min_ns_per_iteration\": %.3f,\n", result.ns_.front());
+        fprintf(file, "      \"max_ns_per_iteration\": %.3f", result.ns_.back());
+        if (result.bytes_per_iteration_ != 0)
+            fprintf(file, ",\n      \"mb_per_second\": %.3f", result.MBPerSecond());
+        fprintf(file, "\n    }");
+    }
+    fprintf(file, "\n  ]\n}\n");
+}
+
+void Usage(const char *program)
+{
+    printf("usage: %s [--filter name] [--json file] [--repetitions n] "
+           "[--min-time ms] [--scripts dir]\n", program);
+}
+
+int main(int argc, const char **argv)
+{
+    std::string filter;
+    const char *json = nullptr;
+    int repetitions = 5;
+    double min_ms = 200.0;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (i + 1 == argc)
+        {
+            Usage(argv[0]);
+            return 1;
+        }
+
+        if (strcmp(argv[i], "--filter") == 0)
+            filter = argv[++i];
+        else if (strcmp(argv[i], "--json") == 0)
+            json = argv[++i];
+        else if (strcmp(argv[i], "--repetitions") == 0)
+            repetitions = std::max(atoi(argv[++i]), 1);
+        else if (strcmp(argv[i], "--min-time") == 0)
+            min_ms = atof(argv[++i]);
+        else if (strcmp(argv[i], "--scripts") == 0)
+            g_scripts_dir = argv[++i];
+        else
+        {
+            Usage(argv[0]);
+            return 1;
+        }
+    }
+
+    auto results = BenchmarkManager::GetInstance().RunAll(filter, repetitions, min_ms);
+
+    if (json)
+    {
+        auto file = fopen(json, "w");
+        if (!file)
+        {
+            printf("%s: can not open file %s\n", argv[0], json);
+            return 1;
+        }
+
+        WriteJson(file, results, repetitions);
+        fclose(file);
+    }
+
+    return 0;
+}
@@ -0,0 +1,79 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <string>
+#include <chrono>
+#include <cstddef>
+
+class BenchmarkBase
+{
+public:
+    BenchmarkBase();
+    virtual ~BenchmarkBase() { }
+
+    BenchmarkBase(const BenchmarkBase&) = delete;
+    void operator = (const BenchmarkBase&) = delete;
+
+    std::string GetName() const
+    { return name_; }
+
+    // Bytes processed by one iteration, 0 when throughput is not reported
+    std::size_t GetBytesPerIteration() const
+    { return bytes_per_iteration_; }
+
+    // Iterations of each repetition, 0 when iterations are calibrated
+    std::size_t GetFixedIterations() const
+    { return fixed_iterations_; }
+
+    // Run 'iterations' iterations, return timed nanoseconds
+    double Measure(std::size_t iterations);
+
+protected:
+    virtual void Run(std::size_t iterations) = 0;
+
+    // Restart timer after setup in Run, timer starts before Run
+    void StartTimer()
+    { start_ = std::chrono::steady_clock::now(); }
+
+    // Stop timer before teardown in Run, timer stops after Run
+    void StopTimer();
+
+    void SetBytesPerIteration(std::size_t bytes)
+    { bytes_per_iteration_ = bytes; }
+
+    void SetFixedIterations(std::size_t iterations)
+    { fixed_iterations_ = iterations; }
+
+    std::string name_;
+
+private:
+    std::size_t bytes_per_iteration_;
+    std::size_t fixed_iterations_;
+    std::chrono::steady_clock::time_point start_;
+    std::chrono::steady_clock::time_point stop_;
+    bool stopped_;
+};
+
+// Directory of script benchmarks
+const std::string & GetScriptsDir();
+
+// Keep 'value' computed by benchmark from being optimized out
+void KeepValue(double value);
+
+#define BENCHMARK(bench_name)                               \
+    class Benchmark_##bench_name : public BenchmarkBase     \
+    {                                                       \
+    public:                                                 \
+        Benchmark_##bench_name();                           \
+    protected:                                              \
+        virtual void Run(std::size_t iterations);           \
+    } bench_##bench_name##obj;                              \
+                                                            \
+    Benchmark_##bench_name::Benchmark_##bench_name()        \
+    {                                                       \
+        name_ = #bench_name;                                \
+    }                                                       \
+                                                            \
+    void Benchmark_##bench_name::Run(std::size_t iterations)
+
+#endif // BENCHMARK_H
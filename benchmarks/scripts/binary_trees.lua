@@ -0,0 +1,28 @@
+-- Allocation of short-lived and long-lived trees
+local function make_tree(depth)
+    if depth == 0 then
+        return {}
+    end
+    depth = depth - 1
+    return { make_tree(depth), make_tree(depth) }
+end
+
+local function check_tree(tree)
+    if not tree[1] then
+        return 1
+    end
+    return 1 + check_tree(tree[1]) + check_tree(tree[2])
+end
+
+local max_depth = 14
+local long_lived = make_tree(max_depth)
+local checks = 0
+
+for depth = 4, max_depth, 2 do
+    local iterations = 2 ^ (max_depth - depth + 4)
+    for i = 1, iterations do
+        checks = checks + check_tree(make_tree(depth))
+    end
+end
+
+checks = checks + check_tree(long_lived)
@@ -0,0 +1,78 @@
+-- Floating point arithmetic and table fields
+local sqrt = math.sqrt
+local pi = math.pi
+local solar_mass = 4 * pi * pi
+local days_per_year = 365.24
+
+local bodies = {
+    { x = 0, y = 0, z = 0, vx = 0, vy = 0, vz = 0, mass = solar_mass },
+    {
+        x = 4.84143144246472090e+00,
+        y = -1.16032004402742839e+00,
+        z = -1.03622044471123109e-01,
+        vx = 1.66007664274403694e-03 * days_per_year,
+        vy = 7.69901118419740425e-03 * days_per_year,
+        vz = -6.90460016972063023e-05 * days_per_year,
+        mass = 9.54791938424326609e-04 * solar_mass,
+    },
+    {
+        x = 8.34336671824457987e+00,
+        y = 4.12479856412430479e+00,
+        z = -4.03523417114321381e-01,
+        vx = -2.76742510726862411e-03 * days_per_year,
+        vy = 4.99852801234917238e-03 * days_per_year,
+        vz = 2.30417297573763929e-05 * days_per_year,
+        mass = 2.85885980666130812e-04 * solar_mass,
+    },
+    {
+        x = 1.28943695621391310e+01,
+        y = -1.51111514016986312e+01,
+        z = -2.23307578892655734e-01,
+        vx = 2.96460137564761618e-03 * days_per_year,
+        vy = 2.37847173959480950e-03 * days_per_year,
+        vz = -2.96589568540237556e-05 * days_per_year,
+        mass = 4.36624404335156298e-05 * solar_mass,
+    },
+    {
+        x = 1.53796971148509165e+01,
+        y = -2.59193146099879641e+01,
+        z = 1.79258772950371181e-01,
+        vx = 2.68067772490389322e-03 * days_per_year,
+        vy = 1.62824170038242295e-03 * days_per_year,
+        vz = -9.51592254519715870e-05 * days_per_year,
+        mass = 5.15138902046611451e-05 * solar_mass,
+    },
+}
+
+local function advance(bodies, count, dt)
+    for i = 1, count do
+        local bi = bodies[i]
+        local bix, biy, biz, bimass = bi.x, bi.y, bi.z, bi.mass
+        local bivx, bivy, bivz = bi.vx, bi.vy, bi.vz
+        for j = i + 1, count do
+            local bj = bodies[j]
+            local dx, dy, dz = bix - bj.x, biy - bj.y, biz - bj.z
+            local distance2 = dx * dx + dy * dy + dz * dz
+            local distance = sqrt(distance2)
+            local mag = dt / (distance2 * distance)
+            local bim, bjm = bimass * mag, bj.mass * mag
+            bivx = bivx - dx * bjm
+            bivy = bivy - dy * bjm
+            bivz = bivz - dz * bjm
+            bj.vx = bj.vx + dx * bim
+            bj.vy = bj.vy + dy * bim
+            bj.vz = bj.vz + dz * bim
+        end
+        bi.vx = bivx
+        bi.vy = bivy
+        bi.vz = bivz
+        bi.x = bix + dt * bivx
+        bi.y = biy + dt * bivy
+        bi.z = biz + dt * bivz
+    end
+end
+
+local count = #bodies
+for i = 1, 100000 do
+    advance(bodies, count, 0.01)
+end
@@ -0,0 +1,17 @@
+-- Iteration of array and hash tables by ipairs and pairs
+local array = {}
+local hash = {}
+for i = 1, 10000 do
+    array[i] = i
+    hash["key" .. i] = i
+end
+
+local sum = 0
+for n = 1, 100 do
+    for i, v in ipairs(array) do
+        sum = sum + v
+    end
+    for k, v in pairs(hash) do
+        sum = sum + v
+    end
+end
@@ -0,0 +1,16 @@
+-- String concatenation, formatting, table.concat and string library
+local parts = {}
+for i = 1, 100000 do
+    parts[#parts + 1] = "item" .. i .. ":" .. string.format("%d", i * 2)
+end
+local joined = table.concat(parts, ",")
+
+local s = ""
+for i = 1, 5000 do
+    s = s .. string.sub(joined, i, i + 3)
+end
+
+local count = 0
+for i = 1, 20 do
+    count = count + string.len(string.upper(joined) .. s)
+end
@@ -0,0 +1,28 @@
+#include "Allocator.h"
+#include <new>
+
+namespace
+{
+    class DefaultAllocator : public luna::Allocator
+    {
+    public:
+        virtual void * Alloc(std::size_t size)
+        {
+            return ::operator new(size);
+        }
+
+        virtual void Free(void *ptr, std::size_t size)
+        {
+            ::operator delete(ptr);
+        }
+    };
+} // namespace
+
+namespace luna
+{
+    Allocator * Allocator::GetDefault()
+    {
+        static DefaultAllocator allocator;
+        return &allocator;
+    }
+} // namespace luna
@@ -0,0 +1,28 @@
+#ifndef ALLOCATOR_H
+#define ALLOCATOR_H
+
+#include <cstddef>
+
+namespace luna
+{
+    // Allocator of GC heap memory of a State, which includes pages of
+    // GC objects and memory owned by GC objects, e.g. string buffers and
+    // table slots. Free could be called in the background sweeper thread
+    // when background sweep is enabled.
+    class Allocator
+    {
+    public:
+        virtual ~Allocator() { }
+
+        // Alloc 'size' bytes, throw std::bad_alloc when it fails
+        virtual void * Alloc(std::size_t size) = 0;
+
+        // Free memory allocated by Alloc with the same 'size'
+        virtual void Free(void *ptr, std::size_t size) = 0;
+
+        // Get allocator of global operator new and delete
+        static Allocator * GetDefault();
+    };
+} // namespace luna
+
+#endif // ALLOCATOR_H
@@ -0,0 +1,62 @@
+#include "Arena.h"
+
+namespace luna
+{
+    Arena::Arena(Allocator *allocator)
+        : allocator_(allocator ? allocator : Allocator::GetDefault()),
+          free_lists_(), page_current_(nullptr), page_end_(nullptr)
+    {
+    }
+
+    Arena::~Arena()
+    {
+        for (auto page : pages_)
+            allocator_->Free(page, kPageSize);
+    }
+
+    void * Arena::Alloc(std::size_t size)
+    {
+        if (size > kMaxBlockSize)
+            return allocator_->Alloc(size);
+
+        auto size_class = SizeClass(size);
+        auto block = free_lists_[size_class];
+        if (block)
+        {
+            free_lists_[size_class] = block->next_;
+            return block;
+        }
+
+        return AllocFromPage((size_class + 1) * kAlignment);
+    }
+
+    void Arena::Free(void *ptr, std::size_t size)
+    {
+        if (size > kMaxBlockSize)
+        {
+            allocator_->Free(ptr, size);
+            return ;
+        }
+
+        auto size_class = SizeClass(size);
+        auto block = static_cast<FreeBlock *>(ptr);
+        block->next_ = free_lists_[size_class];
+        free_lists_[size_class] = block;
+    }
+
+    void * Arena::AllocFromPage(std::size_t block_size)
+    {
+        if (static_cast<std::size_t>(page_end_ - page_current_) < block_size)
+        {
+            // The rest space of current page is discarded
+            auto page = static_cast<char *>(allocator_->Alloc(kPageSize));
+            pages_.push_back(page);
+            page_current_ = page;
+            page_end_ = page + kPageSize;
+        }
+
+        void *block = page_current_;
+        page_current_ += block_size;
+        return block;
+    }
+} // namespace luna
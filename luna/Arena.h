@@ -0,0 +1,57 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "Allocator.h"
+#include <vector>
+#include <stddef.h>
+
+namespace luna
+{
+    // Arena allocator with size class free lists, memory of small blocks
+    // is carved from big pages and reused through free lists, pages are
+    // released when arena is destroyed. Pages and big blocks are from
+    // 'allocator', the default allocator when it is nullptr.
+    class Arena
+    {
+    public:
+        explicit Arena(Allocator *allocator = nullptr);
+        ~Arena();
+
+        Arena(const Arena&) = delete;
+        void operator = (const Arena&) = delete;
+
+        // Alloc memory block which has 'size' bytes at least
+        void * Alloc(std::size_t size);
+
+        // Free memory block allocated by Alloc with the same 'size'
+        void Free(void *ptr, std::size_t size);
+
+    private:
+        struct FreeBlock
+        {
+            FreeBlock *next_;
+        };
+
+        static const std::size_t kAlignment = 16;
+        static const std::size_t kMaxBlockSize = 512;
+        static const std::size_t kSizeClassCount = kMaxBlockSize / kAlignment;
+        static const std::size_t kPageSize = 64 * 1024;
+
+        static std::size_t SizeClass(std::size_t size)
+        { return (size + kAlignment - 1) / kAlignment - 1; }
+
+        // Alloc new block from current page
+        void * AllocFromPage(std::size_t block_size);
+
+        Allocator *allocator_;
+        // Free block lists of all size classes
+        FreeBlock *free_lists_[kSizeClassCount];
+        // All pages
+        std::vector<char *> pages_;
+        // Free space of current page
+        char *page_current_;
+        char *page_end_;
+    };
+} // namespace luna
+
+#endif // ARENA_H
@@ -0,0 +1,392 @@
+#include "Bytecode.h"
+#include "State.h"
+#include "Function.h"
+#include "Exception.h"
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+
+namespace
+{
+    const char kSignature[] = "\x1bLuna";
+    const std::size_t kSignatureSize = sizeof(kSignature) - 1;
+
+    // Bump it when the layout of chunk changes
+    const unsigned char kVersion = 2;
+
+    // Count of opcodes, chunk dumped with other opcodes is rejected
+    const unsigned char kOpTypeCount = luna::OpType_SetTableK + 1;
+
+    // Check byte order and number format of the platform
+    const uint32_t kCheckInt = 0x12345678;
+    const double kCheckNumber = 370.5;
+
+    // Header: signature, version, opcode count, sizeof(Instruction),
+    // check integer and check number
+    const std::size_t kHeaderSize = kSignatureSize + 3 +
+        sizeof(kCheckInt) + sizeof(kCheckNumber);
+
+    // Alignment of instruction arrays in chunk
+    const std::size_t kAlignment = sizeof(uint32_t);
+
+    // Const value type tags in chunk
+    enum ConstType
+    {
+        ConstType_Nil,
+        ConstType_Bool,
+        ConstType_Number,
+        ConstType_String,
+    };
+
+    class BytecodeWriter
+    {
+    public:
+        BytecodeWriter() { }
+
+        std::string Dump(luna::Function *function)
+        {
+            buffer_.append(kSignature, kSignatureSize);
+            WriteByte(kVersion);
+            WriteByte(kOpTypeCount);
+            WriteByte(sizeof(luna::Instruction));
+            WriteRaw(&kCheckInt, sizeof(kCheckInt));
+            WriteRaw(&kCheckNumber, sizeof(kCheckNumber));
+            WriteFunction(function);
+            return std::move(buffer_);
+        }
+
+    private:
+        void WriteRaw(const void *data, std::size_t size)
+        {
+            buffer_.append(static_cast<const char *>(data), size);
+        }
+
+        void WriteByte(unsigned char byte)
+        {
+            buffer_.push_back(static_cast<char>(byte));
+        }
+
+        void WriteInt(int i)
+        {
+            uint32_t u = static_cast<uint32_t>(i);
+            WriteRaw(&u, sizeof(u));
+        }
+
+        // Align instructions and lines in chunk, then they can be used in
+        // place when chunk is mapped into memory
+        void WriteAlignment()
+        {
+            while (buffer_.size() % kAlignment != 0)
+                WriteByte(0);
+        }
+
+        void WriteString(const luna::String *str)
+        {
+            WriteInt(str->GetLength());
+            WriteRaw(str->GetCStr(), str->GetLength());
+        }
+
+        void WriteConst(const luna::Value &value)
+        {
+            switch (value.type_)
+            {
+                case luna::ValueT_Nil:
+                    WriteByte(ConstType_Nil);
+                    break;
+                case luna::ValueT_Bool:
+                    WriteByte(ConstType_Bool);
+                    WriteByte(value.bvalue_ ? 1 : 0);
+                    break;
+                case luna::ValueT_Number:
+                    {
+                        double num = value.num_;
+                        WriteByte(ConstType_Number);
+                        WriteRaw(&num, sizeof(num));
+                    }
+                    break;
+                case luna::ValueT_String:
+                    WriteByte(ConstType_String);
+                    WriteString(value.str_);
+                    break;
+                default:
+                    assert(!"const value of function is not a literal");
+                    break;
+            }
+        }
+
+        void WriteFunction(luna::Function *function)
+        {
+            WriteInt(function->GetLine());
+            WriteInt(function->FixedArgCount());
+            WriteByte(function->HasVararg() ? 1 : 0);
+            WriteInt(function->GetMaxRegisterCount());
+
+            std::size_t size = function->OpCodeSize();
+            auto opcodes = function->GetOpCodes();
+            WriteInt(size);
+            WriteAlignment();
+            for (std::size_t i = 0; i < size; ++i)
+                WriteInt(opcodes[i].opcode_);
+            for (std::size_t i = 0; i < size; ++i)
+                WriteInt(function->GetInstructionLine(i));
+
+            std::size_t count = function->GetConstValueCount();
+            WriteInt(count);
+            for (std::size_t i = 0; i < count; ++i)
+                WriteConst(*function->GetConstValue(i));
+
+            count = function->GetLocalVarCount();
+            WriteInt(count);
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                auto var = function->GetLocalVar(i);
+                WriteString(var->name_);
+                WriteInt(var->register_id_);
+                WriteInt(var->begin_pc_);
+                WriteInt(var->end_pc_);
+            }
+
+            count = function->GetUpvalueCount();
+            WriteInt(count);
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                auto upvalue = function->GetUpvalue(i);
+                WriteString(upvalue->name_);
+                WriteByte(upvalue->parent_local_ ? 1 : 0);
+                WriteInt(upvalue->register_index_);
+            }
+
+            count = function->GetChildFunctionCount();
+            WriteInt(count);
+            for (std::size_t i = 0; i < count; ++i)
+                WriteFunction(function->GetChildFunction(i));
+        }
+
+        std::string buffer_;
+    };
+
+    // Instructions are not verified, binary chunks are trusted as source
+    // files, only the layout of chunk is checked
+    class BytecodeReader
+    {
+    public:
+        BytecodeReader(const char *data, std::size_t size,
+                       luna::String *module, luna::State *state, bool shared)
+            : begin_(data), current_(data), end_(data + size),
+              module_(module), state_(state), shared_(shared)
+        {
+        }
+
+        luna::Function * Load()
+        {
+            if (!luna::IsBytecode(current_, end_ - current_))
+                Error("not a binary chunk");
+            current_ += kSignatureSize;
+
+            if (ReadByte() != kVersion ||
+                ReadByte() != kOpTypeCount ||
+                ReadByte() != sizeof(luna::Instruction))
+                Error("binary chunk version mismatch");
+
+            uint32_t check_int = 0;
+            double check_number = 0.0;
+            ReadRaw(&check_int, sizeof(check_int));
+            ReadRaw(&check_number, sizeof(check_number));
+            if (check_int != kCheckInt || check_number != kCheckNumber)
+                Error("binary chunk format mismatch");
+
+            auto function = ReadFunction(nullptr);
+            if (current_ != end_)
+                Error("binary chunk has trailing data");
+            return function;
+        }
+
+    private:
+        void Error(const char *desc)
+        {
+            throw luna::BytecodeException(module_->GetCStr(), desc);
+        }
+
+        void ReadRaw(void *data, std::size_t size)
+        {
+            if (static_cast<std::size_t>(end_ - current_) < size)
+                Error("truncated binary chunk");
+            memcpy(data, current_, size);
+            current_ += size;
+        }
+
+        unsigned char ReadByte()
+        {
+            unsigned char byte = 0;
+            ReadRaw(&byte, sizeof(byte));
+            return byte;
+        }
+
+        int ReadInt()
+        {
+            uint32_t u = 0;
+            ReadRaw(&u, sizeof(u));
+            return static_cast<int>(u);
+        }
+
+        // Read count of elements, each element takes at least 'min_bytes'
+        std::size_t ReadCount(std::size_t min_bytes)
+        {
+            auto count = static_cast<uint32_t>(ReadInt());
+            if (count > (end_ - current_) / min_bytes)
+                Error("truncated binary chunk");
+            return count;
+        }
+
+        luna::String * ReadString()
+        {
+            auto len = ReadCount(1);
+            auto str = state_->GetString(current_, len);
+            current_ += len;
+            return str;
+        }
+
+        void SkipAlignment()
+        {
+            auto offset = static_cast<std::size_t>(current_ - begin_);
+            auto padding = (kAlignment - offset % kAlignment) % kAlignment;
+            if (static_cast<std::size_t>(end_ - current_) < padding)
+                Error("truncated binary chunk");
+            current_ += padding;
+        }
+
+        void ReadOpCodes(luna::Function *function, std::size_t size)
+        {
+            SkipAlignment();
+            if (static_cast<std::size_t>(end_ - current_) < size * sizeof(uint32_t) * 2)
+                Error("truncated binary chunk");
+
+            if (shared_)
+            {
+                // Refer to instructions and lines in place
+                auto opcodes = reinterpret_cast<const luna::Instruction *>(current_);
+                auto lines = reinterpret_cast<const int *>(current_ + size * sizeof(uint32_t));
+                function->SetSharedOpCodes(opcodes, lines, size);
+                current_ += size * sizeof(uint32_t) * 2;
+                return ;
+            }
+
+            std::vector<luna::Instruction> opcodes(size);
+            for (auto &i : opcodes)
+                i.opcode_ = static_cast<unsigned int>(ReadInt());
+            for (const auto &i : opcodes)
+                function->AddInstruction(i, ReadInt());
+        }
+
+        int ReadIndex(std::size_t limit)
+        {
+            auto index = ReadInt();
+            if (index < 0 || static_cast<std::size_t>(index) > limit)
+                Error("bad index in binary chunk");
+            return index;
+        }
+
+        void ReadConst(luna::Function *function)
+        {
+            switch (ReadByte())
+            {
+                case ConstType_Nil:
+                    function->AddConstValue(luna::Value());
+                    break;
+                case ConstType_Bool:
+                    function->AddConstValue(luna::Value(ReadByte() != 0));
+                    break;
+                case ConstType_Number:
+                    {
+                        double num = 0.0;
+                        ReadRaw(&num, sizeof(num));
+                        function->AddConstNumber(num);
+                    }
+                    break;
+                case ConstType_String:
+                    function->AddConstString(ReadString());
+                    break;
+                default:
+                    Error("bad const value in binary chunk");
+                    break;
+            }
+        }
+
+        luna::Function * ReadFunction(luna::Function *superior)
+        {
+            // New function is default on GCGen2, so barrier it
+            auto function = state_->NewFunction();
+            CHECK_BARRIER(state_->GetGC(), function);
+
+            function->SetModuleName(module_);
+            function->SetSuperior(superior);
+            function->SetLine(ReadInt());
+            function->AddFixedArgCount(ReadInt());
+            if (ReadByte())
+                function->SetHasVararg();
+            function->SetMaxRegisterCount(ReadInt());
+
+            // Each instruction takes one word and one line
+            auto size = ReadCount(sizeof(uint32_t) * 2);
+            ReadOpCodes(function, size);
+
+            auto count = ReadCount(1);
+            for (std::size_t i = 0; i < count; ++i)
+                ReadConst(function);
+
+            count = ReadCount(sizeof(uint32_t) * 4);
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                auto name = ReadString();
+                auto register_id = ReadInt();
+                auto begin_pc = ReadIndex(size);
+                auto end_pc = ReadIndex(size);
+                function->AddLocalVar(name, register_id, begin_pc, end_pc);
+            }
+
+            count = ReadCount(sizeof(uint32_t) * 2 + 1);
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                auto name = ReadString();
+                bool parent_local = ReadByte() != 0;
+                function->AddUpvalue(name, parent_local, ReadInt());
+            }
+
+            count = ReadCount(1);
+            for (std::size_t i = 0; i < count; ++i)
+                function->AddChildFunction(ReadFunction(function));
+
+            return function;
+        }
+
+        const char *begin_;
+        const char *current_;
+        const char *end_;
+        luna::String *module_;
+        luna::State *state_;
+        // Functions refer to instructions of chunk in place
+        bool shared_;
+    };
+} // namespace
+
+namespace luna
+{
+    std::string DumpBytecode(Function *function)
+    {
+        BytecodeWriter writer;
+        return writer.Dump(function);
+    }
+
+    bool IsBytecode(const char *data, std::size_t size)
+    {
+        return size >= kHeaderSize &&
+            memcmp(data, kSignature, kSignatureSize) == 0;
+    }
+
+    Function * LoadBytecode(const char *data, std::size_t size,
+                            String *module, State *state, bool shared)
+    {
+        BytecodeReader reader(data, size, module, state, shared);
+        return reader.Load();
+    }
+} // namespace luna
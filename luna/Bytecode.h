@@ -0,0 +1,29 @@
+#ifndef BYTECODE_H
+#define BYTECODE_H
+
+#include <string>
+
+namespace luna
+{
+    class State;
+    class String;
+    class Function;
+
+    // Dump prototype 'function' and all its child functions into a binary
+    // chunk, the chunk is only loadable on the same platform
+    std::string DumpBytecode(Function *function);
+
+    // Check 'data' starts with the header of binary chunk
+    bool IsBytecode(const char *data, std::size_t size);
+
+    // Load binary chunk dumped by DumpBytecode, rebuild prototypes of
+    // 'module' and return the main prototype. Throw BytecodeException
+    // when the chunk is broken or dumped by another version.
+    // When 'shared' is true, instructions are used in place and not
+    // copied, 'data' must be aligned to 4 bytes and outlive prototypes.
+    Function * LoadBytecode(const char *data, std::size_t size,
+                            String *module, State *state,
+                            bool shared = false);
+} // namespace luna
+
+#endif // BYTECODE_H
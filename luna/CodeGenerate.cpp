@@ -4,6 +4,8 @@
 #include "Function.h"
 #include "Exception.h"
 #include "Guard.h"
+#include "Peephole.h"
+#include <algorithm>
 #include <vector>
 #include <stack>
 #include <list>
@@ -16,6 +18,12 @@ namespace luna
 {
 #define MAX_FUNCTION_REGISTER_COUNT 250
 #define MAX_CLOSURE_UPVALUE_COUNT 250
+// Count of array field values in registers before flushing them to table
+#define TABLE_ARRAY_FIELDS_PER_FLUSH 50
+// Max count of operands of one concat instruction
+#define CONCAT_MAX_OPERAND_COUNT 50
+// Max const index which could be encoded into operand C of instruction
+#define MAX_CONST_OPERAND_INDEX 255
 
 #define CHECK_UPVALUE_MAX_COUNT(index, function)                        \
     if (index >= MAX_CLOSURE_UPVALUE_COUNT)                             \
@@ -61,8 +69,12 @@ namespace luna
 
         // Current loop ast info
         LoopInfo current_loop_;
+        // Local names of this block or child blocks are captured by
+        // closures, upvalues need to be closed when leaving block
+        bool has_upvalue_;
 
-        GenerateBlock() : parent_(nullptr), register_start_id_(0) { }
+        GenerateBlock()
+            : parent_(nullptr), register_start_id_(0), has_upvalue_(false) { }
     };
 
     // Jump info for loop AST
@@ -106,11 +118,14 @@ namespace luna
               register_id_(0), register_max_(0) { }
     };
 
+    struct TableFieldData;
+
     class CodeGenerateVisitor : public Visitor
     {
     public:
-        explicit CodeGenerateVisitor(State *state)
-            : state_(state), current_function_(nullptr) { }
+        // Nested functions are compiled on their first call when 'lazy'
+        CodeGenerateVisitor(State *state, bool lazy)
+            : state_(state), current_function_(nullptr), lazy_(lazy) { }
 
         ~CodeGenerateVisitor()
         {
@@ -155,16 +170,18 @@ namespace luna
         virtual void Visit(FuncCallArgs *, void *);
         virtual void Visit(ExpressionList *, void *);
 
-        // Prepare function data when enter each lexical function
-        void EnterFunction()
+        // Prepare function data when enter each lexical function, code is
+        // generated into 'proto' when it is a function compiled lazily
+        void EnterFunction(Function *proto = nullptr)
         {
             auto function = new GenerateFunction;
             auto parent = current_function_;
             function->parent_ = parent;
             current_function_ = function;
 
-            // New function is default on GCGen2, so barrier it
-            current_function_->function_ = state_->NewFunction();
+            // New function is default on GCGen2, and function compiled
+            // lazily may be old, so barrier it
+            current_function_->function_ = proto ? proto : state_->NewFunction();
             CHECK_BARRIER(state_->GetGC(), current_function_->function_);
 
             if (parent)
@@ -179,6 +196,13 @@ namespace luna
         // Clean up when leave lexical function
         void LeaveFunction()
         {
+            // Optimize instructions of the completed function
+            Peephole(current_function_->function_);
+
+            // Record registers count for reserving stack when call it
+            IsRegisterCountOverflow();
+            current_function_->function_->SetMaxRegisterCount(
+                current_function_->register_max_);
             DeleteCurrentFunction();
         }
 
@@ -205,9 +229,16 @@ namespace luna
                                       it->second.begin_pc_, end_pc);
             }
 
-            // add one instruction to close block
-            auto instruction = Instruction::ABCode(OpType_FillNil, block->register_start_id_, current_function_->register_id_);
+            // add one instruction to close block, break jumps over
+            // the closing of child blocks, so parent block closes
+            // upvalues of them too
+            auto instruction = Instruction::ABCCode(OpType_FillNil,
+                                                    block->register_start_id_,
+                                                    current_function_->register_id_,
+                                                    block->has_upvalue_ ? 1 : 0);
             function->AddInstruction(instruction, 0);
+            if (block->has_upvalue_ && block->parent_)
+                block->parent_->has_upvalue_ = true;
 
             current_function_->current_block_ = block->parent_;
             current_function_->register_id_ = block->register_start_id_;
@@ -306,13 +337,22 @@ namespace luna
         // Search name in lexical function
         const LocalNameInfo * SearchFunctionLocalName(GenerateFunction *function,
                                                       String *name) const
+        {
+            auto block = SearchFunctionLocalBlock(function, name);
+            if (block)
+                return &block->names_.find(name)->second;
+            return nullptr;
+        }
+
+        // Search the block which has the name in lexical function
+        GenerateBlock * SearchFunctionLocalBlock(GenerateFunction *function,
+                                                 String *name) const
         {
             auto block = function->current_block_;
             while (block)
             {
-                auto it = block->names_.find(name);
-                if (it != block->names_.end())
-                    return &it->second;
+                if (block->names_.find(name) != block->names_.end())
+                    return block;
                 else
                     block = block->parent_;
             }
@@ -355,11 +395,12 @@ namespace luna
                 else
                 {
                     // Find name from local names
-                    auto name_info = SearchFunctionLocalName(current, name);
-                    if (name_info)
+                    auto block = SearchFunctionLocalBlock(current, name);
+                    if (block)
                     {
                         // Find it, get its register_id and start backtrack
-                        register_index = name_info->register_id_;
+                        register_index = block->names_.find(name)->second.register_id_;
+                        block->has_upvalue_ = true;
                         parent_local = true;
                         parents.pop();
                     }
@@ -432,6 +473,10 @@ namespace luna
             return current_function_->register_max_ > MAX_FUNCTION_REGISTER_COUNT;
         }
 
+        // Generate code of 'func_body' into 'function' which is compiled
+        // lazily, upvalues of the function are prepared already
+        void GenerateLazyFunction(FunctionBody *func_body, Function *function);
+
     private:
         State *state_;
 
@@ -469,23 +514,63 @@ namespace luna
         template<typename StatementType>
         void IfStatementGenerateCode(StatementType *if_stmt);
 
+        // Set value of table field, 'key' is key register for
+        // OpType_SetTable or const index of key for OpType_SetField
         template<typename TableFieldType>
         void SetTableFieldValue(TableFieldType *field,
                                 int table_register,
-                                int key_register,
-                                int line);
+                                int key, int line,
+                                OpType op_type);
+
+        // Flush array values in registers to table
+        void FlushTableArrayFields(TableFieldData *field_data, int line);
+
+        // Generate one concat instruction for chain 'a .. b .. c'
+        void ConcatExpression(BinaryExpression *bin_exp,
+                              int register_id, int end_register);
 
+        // Generate code to jump when condition 'exp' is false, return the
+        // index of instruction which jump diff need to be refilled
+        int JumpFalse(SyntaxTree *exp, int line);
+
+        // When operand2 'exp' of binary operator 'token' is a literal,
+        // add it to const values and get OpType which reads the const,
+        // return false when the literal could not be operand directly
+        bool GetConstOperand(int token, SyntaxTree *exp,
+                             OpType &op_type, int &const_index);
+
+        // Get or set table field, key is the const 'key_index' when it is
+        // not less than 0, otherwise key is loaded into register by
+        // 'load_key'
         template<typename TableAccessorType, typename LoadKey>
         void AccessTableField(TableAccessorType *accessor,
-                              void *data, int line,
+                              void *data, int line, int key_index,
                               const LoadKey &load_key);
 
+        // Get const index of string key which could be encoded into
+        // operand B of OpType_GetField and OpType_SetField, return -1
+        // when the index is too large
+        int GetFieldKeyIndex(String *key);
+
         template<typename FuncCallType, typename CallerArgAdjuster>
         void FunctionCall(FuncCallType *func_call, void *data,
                           const CallerArgAdjuster &adjust_caller_arg);
 
+        // Return statement returns the results of one function call
+        bool IsTailCall(ReturnStatement *ret_stmt) const;
+
+        // Generate code of 'func_body' in current function
+        void GenerateFunctionBody(FunctionBody *func_body);
+
+        // Keep source of 'func_body' in current function, it is compiled
+        // on the first call. Upvalues of it are prepared now while names
+        // of enclosing functions are visible.
+        void PrepareLazyFunction(FunctionBody *func_body);
+
         // Current code generating function
         GenerateFunction *current_function_;
+        // Compile nested functions on their first call or not
+        bool lazy_;
     };
 
 #define CODE_GENERATE_GUARD(enter, leave)                               \
@@ -551,12 +636,21 @@ namespace luna
         // Table register
         int table_register_;
 
-        // Array part index, start from 1
+        // Array part index of the first array value in registers,
+        // start from 1
         unsigned int array_index_;
 
-        explicit TableFieldData(int table_register)
+        // First register of array values which are not flushed
+        int array_register_;
+
+        // Count of array values which are not flushed
+        int array_count_;
+
+        TableFieldData(int table_register, int array_register)
             : table_register_(table_register),
-              array_index_(1) { }
+              array_index_(1),
+              array_register_(array_register),
+              array_count_(0) { }
     };
 
     // For FuncCallArgs AST
@@ -582,13 +676,8 @@ namespace luna
         auto function = GetCurrentFunction();
         int jmp_end_index = 0;
         {
-            REGISTER_GENERATOR_GUARD();
-            auto register_id = GenerateRegisterId();
-            ExpVarData exp_var_data{ register_id, register_id + 1 };
-            if_stmt->exp_->Accept(this, &exp_var_data);
-
-            auto instruction = Instruction::AsBxCode(OpType_JmpFalse, register_id, 0);
-            int jmp_index = function->AddInstruction(instruction, if_stmt->line_);
+            int jmp_index = JumpFalse(if_stmt->exp_.get(), if_stmt->line_);
+            Instruction instruction;
 
             {
                 // True branch block generate code
@@ -600,7 +689,7 @@ namespace luna
             instruction = Instruction::AsBxCode(OpType_Jmp, 0, 0);
             jmp_end_index = function->AddInstruction(instruction, if_stmt->block_end_line_);
 
-            // Refill OpType_JmpFalse instruction
+            // Refill jump of false condition
             int index = function->OpCodeSize();
             function->GetMutableInstruction(jmp_index)->RefillsBx(index - jmp_index);
         }
@@ -616,8 +705,8 @@ namespace luna
     template<typename TableFieldType>
     void CodeGenerateVisitor::SetTableFieldValue(TableFieldType *field,
                                                  int table_register,
-                                                 int key_register,
-                                                 int line)
+                                                 int key, int line,
+                                                 OpType op_type)
     {
         // Load value
         auto value_register = GenerateRegisterId();
@@ -625,14 +714,20 @@ namespace luna
         field->value_->Accept(this, &exp_var_data);
 
         // Set table field
-        auto instruction = Instruction::ABCCode(OpType_SetTable, table_register,
-                                                key_register, value_register);
+        auto instruction = Instruction::ABCCode(op_type, table_register,
+                                                key, value_register);
         GetCurrentFunction()->AddInstruction(instruction, line);
     }
 
+    int CodeGenerateVisitor::GetFieldKeyIndex(String *key)
+    {
+        auto index = GetCurrentFunction()->AddConstString(key);
+        return index <= MAX_CONST_OPERAND_INDEX ? index : -1;
+    }
+
     template<typename TableAccessorType, typename LoadKey>
     void CodeGenerateVisitor::AccessTableField(TableAccessorType *accessor,
-                                               void *data, int line,
+                                               void *data, int line, int key_index,
                                                const LoadKey &load_key)
     {
         auto exp_var_data = static_cast<ExpVarData *>(data);
@@ -650,13 +745,15 @@ namespace luna
             if (end_register != EXP_VALUE_COUNT_ANY && register_id >= end_register)
                 return ;
 
-            if (end_register != EXP_VALUE_COUNT_ANY && register_id + 1 < end_register)
+            if (key_index >= 0)
+                key_register = key_index;
+            else if (end_register != EXP_VALUE_COUNT_ANY && register_id + 1 < end_register)
                 key_register = register_id + 1;
             else
                 key_register = GenerateRegisterId();
             table_register = register_id;
             value_register = register_id;
-            op_type = OpType_GetTable;
+            op_type = key_index >= 0 ? OpType_GetField : OpType_GetTable;
         }
         else
         {
@@ -664,9 +761,9 @@ namespace luna
             assert(register_id + 1 == end_register);
 
             table_register = GenerateRegisterId();
-            key_register = GenerateRegisterId();
+            key_register = key_index >= 0 ? key_index : GenerateRegisterId();
             value_register = register_id;
-            op_type = OpType_SetTable;
+            op_type = key_index >= 0 ? OpType_SetField : OpType_SetTable;
         }
 
         // Load table
@@ -674,7 +771,8 @@ namespace luna
         accessor->table_->Accept(this, &table_exp_var_data);
 
         // Load key
-        load_key(key_register);
+        if (key_index < 0)
+            load_key(key_register);
 
         // Set/Get table value by key
         auto instruction = Instruction::ABCCode(op_type, table_register,
@@ -760,6 +858,7 @@ namespace luna
             closure->SetPrototype(function);
 
             // Put closure on stack
+            state_->ReserveStack(state_->stack_.top_, 1);
             auto top = state_->stack_.top_++;
             top->closure_ = closure;
             top->type_ = ValueT_Closure;
@@ -782,6 +881,19 @@ namespace luna
             register_id = GenerateRegisterId();
             ExpListData exp_list_data{ register_id, EXP_VALUE_COUNT_ANY };
             ret_stmt->exp_list_->Accept(this, &exp_list_data);
+
+            if (IsTailCall(ret_stmt))
+            {
+                // Change the call to tail call, the return instruction
+                // is still needed when callee is c function
+                auto function = GetCurrentFunction();
+                auto call = function->GetMutableInstruction(function->OpCodeSize() - 1);
+                assert(Instruction::GetOpCode(*call) == OpType_Call);
+                *call = Instruction::ABCCode(OpType_TailCall,
+                                             Instruction::GetParamA(*call),
+                                             Instruction::GetParamB(*call),
+                                             Instruction::GetParamC(*call));
+            }
         }
 
         auto function = GetCurrentFunction();
@@ -790,6 +902,21 @@ namespace luna
         function->AddInstruction(instruction, ret_stmt->line_);
     }
 
+    bool CodeGenerateVisitor::IsTailCall(ReturnStatement *ret_stmt) const
+    {
+        // Only 'return f(args)' which returns all results of the call
+        if (ret_stmt->exp_value_count_ != EXP_VALUE_COUNT_ANY)
+            return false;
+
+        auto exp_list = static_cast<ExpressionList *>(ret_stmt->exp_list_.get());
+        if (exp_list->exp_list_.size() != 1)
+            return false;
+
+        auto exp = exp_list->exp_list_[0].get();
+        return dynamic_cast<NormalFuncCall *>(exp) ||
+            dynamic_cast<MemberFuncCall *>(exp);
+    }
+
     void CodeGenerateVisitor::Visit(BreakStatement *break_stmt, void *data)
     {
         assert(break_stmt->loop_);
@@ -810,20 +937,19 @@ namespace luna
         CODE_GENERATE_GUARD(EnterBlock, LeaveBlock);
         LOOP_GUARD(while_stmt);
 
-        auto register_id = GenerateRegisterId();
-        ExpVarData exp_var_data{ register_id, register_id + 1 };
-        while_stmt->exp_->Accept(this, &exp_var_data);
-
         // Jump to loop tail when expression is false
         auto function = GetCurrentFunction();
-        auto instruction = Instruction::AsBxCode(OpType_JmpFalse, register_id, 0);
-        int index = function->AddInstruction(instruction, while_stmt->first_line_);
+        int index = JumpFalse(while_stmt->exp_.get(), while_stmt->first_line_);
         AddLoopJumpInfo(while_stmt, index, LoopJumpInfo::JumpTail);
 
-        while_stmt->block_->Accept(this, nullptr);
+        {
+            // Locals of each iteration are different
+            CODE_GENERATE_GUARD(EnterBlock, LeaveBlock);
+            while_stmt->block_->Accept(this, nullptr);
+        }
 
         // Jump to loop head
-        instruction = Instruction::AsBxCode(OpType_Jmp, 0, 0);
+        auto instruction = Instruction::AsBxCode(OpType_Jmp, 0, 0);
         index = function->AddInstruction(instruction, while_stmt->last_line_);
         AddLoopJumpInfo(while_stmt, index, LoopJumpInfo::JumpHead);
     }
@@ -832,21 +958,37 @@ namespace luna
     {
         CODE_GENERATE_GUARD(EnterBlock, LeaveBlock);
         LOOP_GUARD(repeat_stmt);
+
+        // Locals of block are visible in exp, keep their registers
+        repeat_stmt->block_->Accept(this, nullptr);
+
+        // Jump to head when exp value is false
+        int index = JumpFalse(repeat_stmt->exp_.get(), repeat_stmt->line_);
+        auto block = current_function_->current_block_;
+        if (!block->has_upvalue_)
         {
-            REGISTER_GENERATOR_GUARD();
-            repeat_stmt->block_->Accept(this, nullptr);
+            AddLoopJumpInfo(repeat_stmt, index, LoopJumpInfo::JumpHead);
+            return ;
         }
 
-        // Get exp value
-        auto register_id = GenerateRegisterId();
-        ExpVarData exp_var_data{ register_id, register_id + 1 };
-        repeat_stmt->exp_->Accept(this, &exp_var_data);
-
-        // Jump to head when exp value is true
+        // Locals of each iteration are different, when exp value is true
+        // jump to loop tail, otherwise close upvalues of this iteration
+        // and then jump to head
         auto function = GetCurrentFunction();
-        auto instruction = Instruction::AsBxCode(OpType_JmpFalse, register_id, 0);
-        int index = function->AddInstruction(instruction, repeat_stmt->line_);
-        AddLoopJumpInfo(repeat_stmt, index, LoopJumpInfo::JumpHead);
+        auto instruction = Instruction::AsBxCode(OpType_Jmp, 0, 0);
+        int tail_index = function->AddInstruction(instruction, repeat_stmt->line_);
+        AddLoopJumpInfo(repeat_stmt, tail_index, LoopJumpInfo::JumpTail);
+
+        int close_index = function->OpCodeSize();
+        function->GetMutableInstruction(index)->RefillsBx(close_index - index);
+
+        instruction = Instruction::ABCCode(OpType_FillNil,
+                                           block->register_start_id_,
+                                           current_function_->register_id_, 1);
+        function->AddInstruction(instruction, repeat_stmt->line_);
+        instruction = Instruction::AsBxCode(OpType_Jmp, 0, 0);
+        int head_index = function->AddInstruction(instruction, repeat_stmt->line_);
+        AddLoopJumpInfo(repeat_stmt, head_index, LoopJumpInfo::JumpHead);
     }
 
     void CodeGenerateVisitor::Visit(IfStatement *if_stmt, void *data)
@@ -861,6 +1003,7 @@ namespace luna
 
     void CodeGenerateVisitor::Visit(ElseStatement *else_stmt, void *data)
     {
+        CODE_GENERATE_GUARD(EnterBlock, LeaveBlock);
         else_stmt->block_->Accept(this, nullptr);
     }
 
@@ -871,6 +1014,8 @@ namespace luna
         auto var_register = GenerateRegisterId();
         auto limit_register = GenerateRegisterId();
         auto step_register = GenerateRegisterId();
+        // Loop state register which is filled by ForPrep
+        GenerateRegisterId();
         auto function = GetCurrentFunction();
         auto line = num_for->name_.line_;
 
@@ -903,25 +1048,15 @@ namespace luna
             }
         }
 
-        // Init 'for' var, limit, step value
-        auto instruction = Instruction::ABCCode(OpType_ForInit, var_register,
-                                                limit_register, step_register);
-        function->AddInstruction(instruction, line);
+        // Prepare 'for' loop, skip the loop when the body never runs
+        auto instruction = Instruction::AsBxCode(OpType_ForPrep, var_register, 0);
+        int index = function->AddInstruction(instruction, line);
+        AddLoopJumpInfo(num_for, index, LoopJumpInfo::JumpTail);
 
         LOOP_GUARD(num_for);
         {
             CODE_GENERATE_GUARD(EnterBlock, LeaveBlock);
 
-            // Check 'for', continue loop or not
-            instruction = Instruction::ABCCode(OpType_ForStep, var_register,
-                limit_register, step_register);
-            function->AddInstruction(instruction, line);
-
-            // Break loop, prepare to jump to the end of the loop
-            instruction.opcode_ = 0;
-            int index = function->AddInstruction(instruction, line);
-            AddLoopJumpInfo(num_for, index, LoopJumpInfo::JumpTail);
-
             auto name_register = GenerateRegisterId();
             InsertName(num_for->name_.str_, name_register);
 
@@ -930,15 +1065,10 @@ namespace luna
             function->AddInstruction(instruction, line);
 
             num_for->block_->Accept(this, nullptr);
-
-            // var = var + step
-            instruction = Instruction::ABCCode(OpType_Add, var_register,
-                var_register, step_register);
-            function->AddInstruction(instruction, line);
         }
-        // Jump to the begin of the loop
-        instruction = Instruction::AsBxCode(OpType_Jmp, 0, 0);
-        int index = function->AddInstruction(instruction, line);
+        // Step 'for' var and jump to the begin of the loop body
+        instruction = Instruction::AsBxCode(OpType_ForLoop, var_register, 0);
+        index = function->AddInstruction(instruction, line);
         AddLoopJumpInfo(num_for, index, LoopJumpInfo::JumpHead);
     }
 
@@ -970,6 +1100,10 @@ namespace luna
             auto temp_func = GenerateRegisterId();
             auto temp_state = GenerateRegisterId();
             auto temp_var = GenerateRegisterId();
+            // Results of iterate function are placed from temp_func,
+            // reserve more registers when names are more than temps
+            for (auto i = temp_var + 1; i < temp_func + name_end - name_start; ++i)
+                GenerateRegisterId();
 
             // Call iterate function
             auto move = [=](int dst, int src) {
@@ -1086,29 +1220,38 @@ namespace luna
             auto count = member ? size : size - 1;
             auto key_register = GenerateRegisterId();
 
-            auto load_key = [=](String *name, int line) {
+            // Get or set table field by key 'name', load the key into
+            // register when it could not be const operand
+            auto access_field = [=](String *name, int line, OpType field_op,
+                                    OpType table_op, int value_register) {
+                auto key_index = GetFieldKeyIndex(name);
+                if (key_index >= 0)
+                {
+                    auto instruction = Instruction::ABCCode(field_op, table_register,
+                                                            key_index, value_register);
+                    function->AddInstruction(instruction, line);
+                    return ;
+                }
+
                 auto index = function->AddConstString(name);
                 auto instruction = Instruction::ABxCode(OpType_LoadConst, key_register, index);
                 function->AddInstruction(instruction, line);
+                instruction = Instruction::ABCCode(table_op, table_register,
+                                                   key_register, value_register);
+                function->AddInstruction(instruction, line);
             };
 
             for (std::size_t i = 1; i < count; ++i)
             {
                 // Get value from table by key
-                auto name = func_name->names_[i].str_;
-                auto line = func_name->names_[i].line_;
-                load_key(name, line);
-                instruction = Instruction::ABCCode(OpType_GetTable, table_register,
-                                                   key_register, table_register);
-                function->AddInstruction(instruction, line);
+                access_field(func_name->names_[i].str_, func_name->names_[i].line_,
+                             OpType_GetField, OpType_GetTable, table_register);
             }
 
             // Set function as value of table by key 'token'
             const auto &token = member ? func_name->member_name_ : func_name->names_.back();
-            load_key(token.str_, token.line_);
-            instruction = Instruction::ABCCode(OpType_SetTable, table_register,
-                                               key_register, func_register);
-            function->AddInstruction(instruction, token.line_);
+            access_field(token.str_, token.line_,
+                         OpType_SetField, OpType_SetTable, func_register);
         }
     }
 
@@ -1345,6 +1488,23 @@ namespace luna
             return FillRemainRegisterNil(register_id + 1, end_register, line);
         }
 
+        if (token == Token_Concat)
+            return ConcatExpression(bin_exp, register_id, end_register);
+
+        // Read literal operand2 from const values directly
+        OpType const_op_type;
+        int const_index = 0;
+        if (GetConstOperand(token, bin_exp->right_.get(), const_op_type, const_index))
+        {
+            ExpVarData exp_var_data{ register_id, register_id + 1 };
+            bin_exp->left_->Accept(this, &exp_var_data);
+
+            auto instruction = Instruction::ABCCode(const_op_type, register_id,
+                                                    register_id, const_index);
+            function->AddInstruction(instruction, line);
+            return FillRemainRegisterNil(register_id + 1, end_register, line);
+        }
+
         int left_register = 0;
         // Generate code to calculate left expression
         {
@@ -1386,7 +1546,6 @@ namespace luna
             case '%': op_type = OpType_Mod; break;
             case '<': op_type = OpType_Less; break;
             case '>': op_type = OpType_Greater; break;
-            case Token_Concat: op_type = OpType_Concat; break;
             case Token_Equal: op_type = OpType_Equal; break;
             case Token_NotEqual: op_type = OpType_UnEqual; break;
             case Token_LessEqual: op_type = OpType_LessEqual; break;
@@ -1402,6 +1561,155 @@ namespace luna
         FillRemainRegisterNil(register_id, end_register, line);
     }
 
+    void CodeGenerateVisitor::ConcatExpression(BinaryExpression *bin_exp,
+                                               int register_id, int end_register)
+    {
+        // Concat is left associative, collect operands from the left chain,
+        // the remain chain is calculated as one operand.
+        std::vector<SyntaxTree *> operands;
+        SyntaxTree *exp = bin_exp;
+        while (operands.size() + 1 < CONCAT_MAX_OPERAND_COUNT)
+        {
+            auto concat = dynamic_cast<BinaryExpression *>(exp);
+            if (!concat || concat->op_token_.token_ != Token_Concat)
+                break;
+            operands.push_back(concat->right_.get());
+            exp = concat->left_.get();
+        }
+        operands.push_back(exp);
+        std::reverse(operands.begin(), operands.end());
+
+        // Calculate operands into continuous new registers
+        REGISTER_GENERATOR_GUARD();
+        int count = operands.size();
+        int first_register = GenerateRegisterId();
+        for (int i = 1; i < count; ++i)
+            GenerateRegisterId();
+
+        for (int i = 0; i < count; ++i)
+        {
+            ExpVarData exp_var_data{ first_register + i, first_register + i + 1 };
+            operands[i]->Accept(this, &exp_var_data);
+        }
+
+        auto line = bin_exp->op_token_.line_;
+        auto instruction = Instruction::ABCCode(OpType_Concat, register_id,
+                                                first_register, count);
+        GetCurrentFunction()->AddInstruction(instruction, line);
+
+        FillRemainRegisterNil(register_id + 1, end_register, line);
+    }
+
+    int CodeGenerateVisitor::JumpFalse(SyntaxTree *exp, int line)
+    {
+        auto function = GetCurrentFunction();
+        REGISTER_GENERATOR_GUARD();
+
+        // Comparison is fused with jump, and it does not store the result
+        auto bin_exp = dynamic_cast<BinaryExpression *>(exp);
+        OpType op_type = OpType_JmpFalse;
+        if (bin_exp)
+        {
+            switch (bin_exp->op_token_.token_)
+            {
+                case '<': op_type = OpType_JmpLess; break;
+                case '>': op_type = OpType_JmpGreater; break;
+                case Token_Equal: op_type = OpType_JmpEqual; break;
+                case Token_NotEqual: op_type = OpType_JmpUnEqual; break;
+                case Token_LessEqual: op_type = OpType_JmpLessEqual; break;
+                case Token_GreaterEqual: op_type = OpType_JmpGreaterEqual; break;
+                default: break;
+            }
+        }
+
+        if (op_type == OpType_JmpFalse)
+        {
+            auto register_id = GenerateRegisterId();
+            ExpVarData exp_var_data{ register_id, register_id + 1 };
+            exp->Accept(this, &exp_var_data);
+
+            auto instruction = Instruction::AsBxCode(OpType_JmpFalse, register_id, 0);
+            return function->AddInstruction(instruction, line);
+        }
+
+        auto left_register = GenerateRegisterId();
+        ExpVarData left_data{ left_register, left_register + 1 };
+        bin_exp->left_->Accept(this, &left_data);
+
+        // Operand2 is const or register
+        OpType const_op_type;
+        int operand2 = 0;
+        int is_const = 1;
+        if (!GetConstOperand(bin_exp->op_token_.token_, bin_exp->right_.get(),
+                             const_op_type, operand2))
+        {
+            operand2 = GenerateRegisterId();
+            ExpVarData right_data{ operand2, operand2 + 1 };
+            bin_exp->right_->Accept(this, &right_data);
+            is_const = 0;
+        }
+
+        auto instruction = Instruction::ABCCode(op_type, left_register,
+                                                operand2, is_const);
+        function->AddInstruction(instruction, line);
+
+        // Jump diff of comparison
+        return function->AddInstruction(Instruction(), line);
+    }
+
+    bool CodeGenerateVisitor::GetConstOperand(int token, SyntaxTree *exp,
+                                              OpType &op_type, int &const_index)
+    {
+        auto term = dynamic_cast<Terminator *>(exp);
+        if (!term)
+            return false;
+
+        bool is_number = term->token_.token_ == Token_Number;
+        bool is_string = term->token_.token_ == Token_String;
+        if (!is_number && !is_string)
+            return false;
+
+        bool arithmetic = true;
+        switch (token)
+        {
+            case '+': op_type = OpType_AddK; break;
+            case '-': op_type = OpType_SubK; break;
+            case '*': op_type = OpType_MulK; break;
+            case '/': op_type = OpType_DivK; break;
+            case '^': op_type = OpType_PowK; break;
+            case '%': op_type = OpType_ModK; break;
+            default: arithmetic = false; break;
+        }
+
+        if (!arithmetic)
+        {
+            switch (token)
+            {
+                case '<': op_type = OpType_LessK; break;
+                case '>': op_type = OpType_GreaterK; break;
+                case Token_Equal: op_type = OpType_EqualK; break;
+                case Token_NotEqual: op_type = OpType_UnEqualK; break;
+                case Token_LessEqual: op_type = OpType_LessEqualK; break;
+                case Token_GreaterEqual: op_type = OpType_GreaterEqualK; break;
+                default: return false;
+            }
+        }
+
+        // Arithmetic operators only accept number literal
+        if (arithmetic && !is_number)
+            return false;
+
+        auto function = GetCurrentFunction();
+        if (function->GetConstValueCount() > MAX_CONST_OPERAND_INDEX)
+            return false;
+
+        if (term->token_.token_ == Token_Number)
+            const_index = function->AddConstNumber(term->token_.number_);
+        else
+            const_index = function->AddConstString(term->token_.str_);
+        return true;
+    }
+
     void CodeGenerateVisitor::Visit(UnaryExpression *unexp, void *data)
     {
         auto exp_var_data = static_cast<ExpVarData *>(data);
@@ -1440,22 +1748,12 @@ namespace luna
             function->SetLine(func_body->line_);
             child_index = current_function_->func_index_;
 
+            if (lazy_)
+                PrepareLazyFunction(func_body);
+            else
             {
                 CODE_GENERATE_GUARD(EnterBlock, LeaveBlock);
-                // Child function generate code
-                if (func_body->has_self_)
-                {
-                    auto register_id = GenerateRegisterId();
-                    auto self = state_->GetString("self");
-                    InsertName(self, register_id);
-
-                    auto function = GetCurrentFunction();
-                    function->AddFixedArgCount(1);
-                }
-
-                if (func_body->param_list_)
-                    func_body->param_list_->Accept(this, nullptr);
-                func_body->block_->Accept(this, nullptr);
+                GenerateFunctionBody(func_body);
             }
         }
 
@@ -1475,6 +1773,44 @@ namespace luna
         FillRemainRegisterNil(register_id, end_register, func_body->line_);
     }
 
+    void CodeGenerateVisitor::GenerateFunctionBody(FunctionBody *func_body)
+    {
+        // Child function generate code
+        if (func_body->has_self_)
+        {
+            auto register_id = GenerateRegisterId();
+            auto self = state_->GetString("self");
+            InsertName(self, register_id);
+
+            auto function = GetCurrentFunction();
+            function->AddFixedArgCount(1);
+        }
+
+        if (func_body->param_list_)
+            func_body->param_list_->Accept(this, nullptr);
+        func_body->block_->Accept(this, nullptr);
+    }
+
+    void CodeGenerateVisitor::PrepareLazyFunction(FunctionBody *func_body)
+    {
+        for (auto name : func_body->upvalue_names_)
+            PrepareUpvalue(name);
+
+        std::string source(func_body->source_begin_, func_body->source_end_);
+        std::unique_ptr<Function::LazySource> lazy_source(
+            new Function::LazySource(std::move(source), func_body->has_self_));
+        GetCurrentFunction()->SetLazySource(std::move(lazy_source));
+    }
+
+    void CodeGenerateVisitor::GenerateLazyFunction(FunctionBody *func_body,
+                                                   Function *function)
+    {
+        Guard f([=]() { this->EnterFunction(function); },
+                [this]() { this->LeaveFunction(); });
+        CODE_GENERATE_GUARD(EnterBlock, LeaveBlock);
+        GenerateFunctionBody(func_body);
+    }
+
     void CodeGenerateVisitor::Visit(ParamList *param_list, void *data)
     {
         auto function = GetCurrentFunction();
@@ -1518,20 +1854,28 @@ namespace luna
         if (end_register != EXP_VALUE_COUNT_ANY && register_id >= end_register)
             return ;
 
-        // New table
+        // New table with size hints, then the table can be allocated once
         auto function = GetCurrentFunction();
-        auto instruction = Instruction::ACode(OpType_NewTable, register_id);
+        auto array_size = Instruction::SizeToByte(table->array_field_count_);
+        auto hash_size = Instruction::SizeToByte(table->hash_field_count_);
+        auto instruction = Instruction::ABCCode(OpType_NewTable, register_id,
+                                                array_size, hash_size);
         function->AddInstruction(instruction, table->line_);
 
         if (!table->fields_.empty())
         {
-            // Init table value
-            TableFieldData field_data{ register_id };
+            // Init table value, array values are kept in registers which
+            // start from 'r', and flushed to table in batch
+            REGISTER_GENERATOR_GUARD();
+            TableFieldData field_data{ register_id, r };
             for (auto &field : table->fields_)
             {
-                REGISTER_GENERATOR_GUARD();
                 field->Accept(this, &field_data);
+                ResetRegisterIdGenerator(r + field_data.array_count_);
             }
+
+            if (field_data.array_count_ > 0)
+                FlushTableArrayFields(&field_data, table->line_);
         }
 
         FillRemainRegisterNil(register_id + 1, end_register, table->line_);
@@ -1547,7 +1891,8 @@ namespace luna
         ExpVarData exp_var_data{ key_register, key_register + 1 };
         field->index_->Accept(this, &exp_var_data);
 
-        SetTableFieldValue(field, table_register, key_register, field->line_);
+        SetTableFieldValue(field, table_register, key_register, field->line_,
+                           OpType_SetTable);
     }
 
     void CodeGenerateVisitor::Visit(TableNameField *field, void *data)
@@ -1555,35 +1900,59 @@ namespace luna
         auto field_data = static_cast<TableFieldData *>(data);
         auto table_register = field_data->table_register_;
 
+        auto key_index = GetFieldKeyIndex(field->name_.str_);
+        if (key_index >= 0)
+        {
+            SetTableFieldValue(field, table_register, key_index,
+                               field->name_.line_, OpType_SetField);
+            return ;
+        }
+
         // Load key
         auto function = GetCurrentFunction();
-        auto key_index = function->AddConstString(field->name_.str_);
+        key_index = function->AddConstString(field->name_.str_);
         auto key_register = GenerateRegisterId();
         auto instruction = Instruction::ABxCode(OpType_LoadConst, key_register, key_index);
         function->AddInstruction(instruction, field->name_.line_);
 
-        SetTableFieldValue(field, table_register, key_register, field->name_.line_);
+        SetTableFieldValue(field, table_register, key_register,
+                           field->name_.line_, OpType_SetTable);
     }
 
     void CodeGenerateVisitor::Visit(TableArrayField *field, void *data)
     {
         auto field_data = static_cast<TableFieldData *>(data);
-        auto table_register = field_data->table_register_;
 
-        // Load key
+        // Load value to the register after the array values in registers
+        auto value_register = GenerateRegisterId();
+        assert(value_register == field_data->array_register_ +
+                                 field_data->array_count_);
+        ExpVarData exp_var_data{ value_register, value_register + 1 };
+        field->value_->Accept(this, &exp_var_data);
+
+        if (++field_data->array_count_ == TABLE_ARRAY_FIELDS_PER_FLUSH)
+            FlushTableArrayFields(field_data, field->line_);
+    }
+
+    void CodeGenerateVisitor::FlushTableArrayFields(TableFieldData *field_data,
+                                                    int line)
+    {
         auto function = GetCurrentFunction();
-        auto key_register = GenerateRegisterId();
-        auto instruction = Instruction::ACode(OpType_LoadInt, key_register);
-        function->AddInstruction(instruction, field->line_);
-        instruction.opcode_ = field_data->array_index_++;
-        function->AddInstruction(instruction, field->line_);
+        auto instruction = Instruction::ABCCode(OpType_SetList,
+                                                field_data->table_register_,
+                                                field_data->array_register_,
+                                                field_data->array_count_);
+        function->AddInstruction(instruction, line);
+        instruction.opcode_ = field_data->array_index_;
+        function->AddInstruction(instruction, line);
 
-        SetTableFieldValue(field, table_register, key_register, field->line_);
+        field_data->array_index_ += field_data->array_count_;
+        field_data->array_count_ = 0;
     }
 
     void CodeGenerateVisitor::Visit(IndexAccessor *accessor, void *data)
     {
-        AccessTableField(accessor, data, accessor->line_,
+        AccessTableField(accessor, data, accessor->line_, -1,
                          [=](int key_register) {
                              ExpVarData data{ key_register, key_register + 1 };
                              accessor->index_->Accept(this, &data);
@@ -1592,7 +1961,8 @@ namespace luna
 
     void CodeGenerateVisitor::Visit(MemberAccessor *accessor, void *data)
     {
-        AccessTableField(accessor, data, accessor->member_.line_,
+        auto key_index = GetFieldKeyIndex(accessor->member_.str_);
+        AccessTableField(accessor, data, accessor->member_.line_, key_index,
                          [=](int key_register) {
                              auto function = GetCurrentFunction();
                              auto key_index = function->
@@ -1618,6 +1988,15 @@ namespace luna
             auto instruction = Instruction::ABCode(OpType_Move, arg_register, caller_register);
             function->AddInstruction(instruction, func_call->member_.line_);
 
+            // Get caller function from table by const key
+            auto key_index = GetFieldKeyIndex(func_call->member_.str_);
+            if (key_index >= 0)
+            {
+                instruction = Instruction::ABCCode(OpType_GetField, caller_register,
+                                                   key_index, caller_register);
+                function->AddInstruction(instruction, func_call->member_.line_);
+            }
+            else
             {
                 REGISTER_GENERATOR_GUARD();
                 // Get key
@@ -1709,10 +2088,28 @@ namespace luna
         exp_list->exp_list_.back()->Accept(this, &exp_var_data);
     }
 
-    void CodeGenerate(SyntaxTree *root, State *state)
+    void CodeGenerate(SyntaxTree *root, State *state, bool lazy)
     {
         assert(root && state);
-        CodeGenerateVisitor code_generator(state);
+        CodeGenerateVisitor code_generator(state, lazy);
         root->Accept(&code_generator, nullptr);
     }
+
+    void CodeGenerate(SyntaxTree *body, Function *function, State *state)
+    {
+        assert(body && function && state);
+        CodeGenerateVisitor code_generator(state, true);
+        try
+        {
+            code_generator.GenerateLazyFunction(static_cast<FunctionBody *>(body),
+                                                function);
+        }
+        catch (...)
+        {
+            // Drop the code generated partly, the source is kept
+            function->ClearCode();
+            throw;
+        }
+        function->SetLazySource(nullptr);
+    }
 } // namespace luna
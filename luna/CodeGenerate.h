@@ -7,8 +7,15 @@
 namespace luna
 {
     class State;
+    class Function;
 
-    void CodeGenerate(SyntaxTree *root, State *state);
+    // Generate code of module 'root', nested functions of the module are
+    // compiled on their first call when 'lazy'
+    void CodeGenerate(SyntaxTree *root, State *state, bool lazy = false);
+
+    // Generate code of 'function' which is compiled on its first call,
+    // 'body' is FunctionBody parsed from the source of the function
+    void CodeGenerate(SyntaxTree *body, Function *function, State *state);
 } // namespace luna
 
 #endif // CODE_GENERATE_H
@@ -0,0 +1,283 @@
+#include "EventLoop.h"
+#include "State.h"
+#include "UserData.h"
+#include "Exception.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <unistd.h>
+
+namespace lib {
+namespace io {
+
+    EventLoop::EventLoop(luna::State *state)
+        : state_(state),
+          handle_(nullptr),
+          waited_(false),
+          running_(false)
+    {
+    }
+
+    void EventLoop::Spawn(luna::Coroutine *co)
+    {
+        spawned_.insert(co);
+        if (handle_)
+            CHECK_BARRIER(state_->GetGC(), handle_);
+
+        IOOperation op;
+        op.co_ = co;
+        ready_.push_back(std::move(op));
+    }
+
+    void EventLoop::Run()
+    {
+        if (running_)
+            throw luna::CallCFuncException("event loop is running");
+
+        running_ = true;
+        try
+        {
+            while (!ready_.empty() || !waiting_.empty())
+            {
+                // Coroutines which become ready in this round are resumed
+                // in the next round, after files are polled
+                for (auto count = ready_.size(); count > 0; --count)
+                {
+                    auto op = std::move(ready_.front());
+                    ready_.pop_front();
+                    Resume(op);
+                }
+
+                if (!waiting_.empty())
+                    Poll(ready_.empty() ? -1 : 0);
+            }
+        }
+        catch (...)
+        {
+            running_ = false;
+            throw;
+        }
+        running_ = false;
+    }
+
+    bool EventLoop::Perform(IOOperation &op)
+    {
+        return op.write_ ? PerformWrite(op) : PerformRead(op);
+    }
+
+    bool EventLoop::Wait(IOOperation &op)
+    {
+        auto co = state_->GetRunningCoroutine();
+        if (!co || spawned_.find(co) == spawned_.end())
+            return false;
+
+        state_->Yield();
+        op.co_ = co;
+        waiting_.push_back(std::move(op));
+        waited_ = true;
+        return true;
+    }
+
+    void EventLoop::Forget(int fd)
+    {
+        buffers_.erase(fd);
+    }
+
+    bool EventLoop::PerformRead(IOOperation &op)
+    {
+        auto &buffer = buffers_[op.fd_];
+        auto &formats = op.formats_;
+        while (!formats.empty())
+        {
+            auto format = formats.front();
+            if (format == 0)
+            {
+                op.results_.push_back(IOValue(std::string()));
+            }
+            else if (format > 0)
+            {
+                // Read until there are enough bytes or end of file
+                std::size_t size = static_cast<std::size_t>(format);
+                int bytes = 1;
+                while (buffer.size() < size &&
+                       (bytes = ReadMore(op.fd_, buffer)) > 0)
+                    ;
+                if (bytes < 0)
+                    return SetError(op);
+                if (buffer.empty())
+                    break;
+
+                size = std::min(size, buffer.size());
+                op.results_.push_back(IOValue(buffer.substr(0, size)));
+                buffer.erase(0, size);
+            }
+            else if (format == IOOperation::Format_All)
+            {
+                int bytes = 0;
+                while ((bytes = ReadMore(op.fd_, buffer)) > 0)
+                    ;
+                if (bytes < 0)
+                    return SetError(op);
+
+                op.results_.push_back(IOValue(std::move(buffer)));
+                buffer.clear();
+            }
+            else
+            {
+                auto pos = buffer.find('\n');
+                if (pos == std::string::npos)
+                {
+                    auto bytes = ReadMore(op.fd_, buffer);
+                    if (bytes < 0)
+                        return SetError(op);
+                    if (bytes > 0)
+                        continue;
+
+                    // The last line has no '\n'
+                    if (buffer.empty())
+                        break;
+                    op.results_.push_back(IOValue(std::move(buffer)));
+                    buffer.clear();
+                }
+                else
+                {
+                    auto size = format == IOOperation::Format_LineKeep ?
+                        pos + 1 : pos;
+                    op.results_.push_back(IOValue(buffer.substr(0, size)));
+                    buffer.erase(0, pos + 1);
+                }
+            }
+
+            formats.erase(formats.begin());
+        }
+
+        // End of file before all formats are read
+        if (!formats.empty())
+        {
+            op.results_.push_back(IOValue());
+            formats.clear();
+        }
+        return true;
+    }
+
+    bool EventLoop::PerformWrite(IOOperation &op)
+    {
+        while (op.written_ < op.data_.size())
+        {
+            auto bytes = ::write(op.fd_, op.data_.data() + op.written_,
+                                 op.data_.size() - op.written_);
+            if (bytes < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return SetError(op);
+            }
+            op.written_ += bytes;
+        }
+
+        op.results_.push_back(IOValue(IOValue::Type_File));
+        return true;
+    }
+
+    int EventLoop::ReadMore(int fd, std::string &buffer)
+    {
+        char chunk[4096];
+        for (;;)
+        {
+            auto bytes = ::read(fd, chunk, sizeof(chunk));
+            if (bytes < 0 && errno == EINTR)
+                continue;
+            if (bytes > 0)
+                buffer.append(chunk, bytes);
+            return static_cast<int>(bytes);
+        }
+    }
+
+    bool EventLoop::SetError(IOOperation &op)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return false;
+
+        op.results_.clear();
+        op.results_.push_back(IOValue());
+        op.results_.push_back(IOValue(std::string(std::strerror(errno))));
+        op.formats_.clear();
+        return true;
+    }
+
+    void EventLoop::Resume(const IOOperation &op)
+    {
+        // Values are not rooted until they are copied to coroutine stack,
+        // GC does not run before that
+        std::vector<luna::Value> values;
+        for (const auto &result : op.results_)
+        {
+            if (result.type_ == IOValue::Type_String)
+                values.push_back(luna::Value(state_->GetString(result.str_)));
+            else if (result.type_ == IOValue::Type_File)
+                values.push_back(luna::Value(op.file_));
+            else
+                values.push_back(luna::Value());
+        }
+
+        auto co = op.co_;
+        waited_ = false;
+        std::vector<luna::Value> results;
+        auto ok = state_->Resume(co, values.data(), values.size(), results);
+
+        if (co->GetStatus() == luna::CoroutineStatus_Dead)
+        {
+            spawned_.erase(co);
+        }
+        else if (!waited_)
+        {
+            // Coroutine yields by itself, resume it later
+            IOOperation next;
+            next.co_ = co;
+            ready_.push_back(std::move(next));
+        }
+
+        // Error of coroutine has its position already
+        if (!ok)
+            throw luna::RuntimeException(results[0].str_->GetCStr());
+    }
+
+    void EventLoop::Poll(int timeout)
+    {
+        std::vector<pollfd> fds;
+        for (const auto &op : waiting_)
+        {
+            pollfd fd;
+            fd.fd = op.fd_;
+            fd.events = op.write_ ? POLLOUT : POLLIN;
+            fd.revents = 0;
+            fds.push_back(fd);
+        }
+
+        if (::poll(fds.data(), fds.size(), timeout) < 0)
+        {
+            if (errno == EINTR)
+                return ;
+            throw luna::CallCFuncException("poll: ", std::strerror(errno));
+        }
+
+        std::vector<IOOperation> waiting;
+        for (std::size_t i = 0; i < fds.size(); ++i)
+        {
+            if (fds[i].revents && Perform(waiting_[i]))
+                ready_.push_back(std::move(waiting_[i]));
+            else
+                waiting.push_back(std::move(waiting_[i]));
+        }
+        waiting_.swap(waiting);
+    }
+
+    void EventLoop::Trace(void *loop, luna::GCObjectVisitor *v)
+    {
+        for (auto co : static_cast<EventLoop *>(loop)->spawned_)
+            co->GetHandle()->Accept(v);
+    }
+
+} // namespace io
+} // namespace lib
@@ -0,0 +1,139 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <deque>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace luna
+{
+    class State;
+    class UserData;
+    class Coroutine;
+    class GCObjectVisitor;
+} // namespace luna
+
+namespace lib {
+namespace io {
+
+    // Value produced by I/O operation, it is not a GC object, so it is
+    // safe to be kept while coroutine is waiting
+    struct IOValue
+    {
+        enum Type
+        {
+            Type_Nil,
+            Type_String,
+            Type_File,
+        };
+
+        Type type_;
+        std::string str_;
+
+        explicit IOValue(Type type = Type_Nil) : type_(type) { }
+        explicit IOValue(std::string str)
+            : type_(Type_String), str_(std::move(str)) { }
+    };
+
+    // Read or write of a non-blocking file, it is performed step by step
+    // when the file is ready
+    struct IOOperation
+    {
+        // Read formats
+        enum Format
+        {
+            Format_Line = -1,       // "*l"
+            Format_LineKeep = -2,   // "*L"
+            Format_All = -3,        // "*a"
+        };
+
+        luna::Coroutine *co_ = nullptr;
+        luna::UserData *file_ = nullptr;
+        int fd_ = -1;
+        bool write_ = false;
+        // Read formats, number of bytes when it is not negative
+        std::vector<int> formats_;
+        // Data to write, and bytes written
+        std::string data_;
+        std::size_t written_ = 0;
+        std::vector<IOValue> results_;
+    };
+
+    // Event loop of a State runs coroutines spawned into it, coroutines
+    // which read or write non-blocking files yield when the files are
+    // not ready, and resume with the results when the I/O is done.
+    // Coroutines are traced from the handle of loop until they are dead.
+    class EventLoop
+    {
+    public:
+        explicit EventLoop(luna::State *state);
+
+        EventLoop(const EventLoop&) = delete;
+        void operator = (const EventLoop&) = delete;
+
+        // Set the user data which refers to this loop
+        void SetHandle(luna::UserData *handle)
+        { handle_ = handle; }
+
+        // Tracer of handle user data
+        static void Trace(void *loop, luna::GCObjectVisitor *v);
+
+        // Spawn coroutine into the loop
+        void Spawn(luna::Coroutine *co);
+
+        // Run until all spawned coroutines are dead
+        void Run();
+
+        // Perform the operation as much as possible, return true when it
+        // is done, otherwise it should wait for the file
+        bool Perform(IOOperation &op);
+
+        // Running coroutine waits for the file of 'op', return false when
+        // the running coroutine is not spawned into the loop
+        bool Wait(IOOperation &op);
+
+        // Forget read buffer of the closed file
+        void Forget(int fd);
+
+    private:
+        bool PerformRead(IOOperation &op);
+        bool PerformWrite(IOOperation &op);
+
+        // Read more data into buffer of 'fd', return bytes read, 0 at
+        // the end of file, -1 when error or not ready
+        static int ReadMore(int fd, std::string &buffer);
+
+        // Set error result of 'op', return false when the file is not
+        // ready, then 'op' should wait for it
+        static bool SetError(IOOperation &op);
+
+        // Resume coroutine of 'op' with results of 'op', unroot the
+        // coroutine when it is dead
+        void Resume(const IOOperation &op);
+
+        // Wait files ready at most 'timeout' milliseconds, -1 is infinite,
+        // and make coroutines whose I/O are done ready
+        void Poll(int timeout);
+
+        luna::State *state_;
+        luna::UserData *handle_;
+        // Coroutines ready to resume with results of their operations
+        std::deque<IOOperation> ready_;
+        // Coroutines spawned into the loop and not dead
+        std::unordered_set<luna::Coroutine *> spawned_;
+        // Operations waiting for files
+        std::vector<IOOperation> waiting_;
+        // The resumed coroutine waits for a file
+        bool waited_;
+        // Loop is running
+        bool running_;
+        // Read buffers of non-blocking files
+        std::unordered_map<int, std::string> buffers_;
+    };
+
+} // namespace io
+} // namespace lib
+
+#endif // EVENT_LOOP_H
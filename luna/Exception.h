@@ -95,6 +95,16 @@ namespace luna
         }
     };
 
+    // For bytecode loader report broken binary chunk
+    class BytecodeException : public Exception
+    {
+    public:
+        BytecodeException(const char *module, const char *desc)
+        {
+            SetWhat(module, ": ", desc);
+        }
+    };
+
     // Report error of call c function
     class CallCFuncException : public Exception
     {
@@ -109,9 +119,36 @@ namespace luna
     };
 
     // For VM report runtime error
+    // Stack of State can not grow any more
+    class StackOverflowException : public Exception
+    {
+    public:
+        StackOverflowException()
+        {
+            SetWhat("stack overflow");
+        }
+    };
+
+    // GC heap reaches the limit
+    class MemoryException : public Exception
+    {
+    public:
+        MemoryException()
+        {
+            SetWhat("not enough memory");
+        }
+    };
+
     class RuntimeException : public Exception
     {
     public:
+        // Re-raise error which has its position already, e.g. error
+        // of a coroutine
+        explicit RuntimeException(const char *desc)
+        {
+            SetWhat(desc);
+        }
+
         RuntimeException(const char *module, int line, const char *desc)
         {
             SetWhat(module, ':', line, ' ', desc);
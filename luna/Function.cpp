@@ -1,12 +1,23 @@
 #include "Function.h"
 #include <limits>
+#include <assert.h>
 
 namespace luna
 {
-    Function::Function()
-        : module_(nullptr), line_(0), args_(0),
-          is_vararg_(false), superior_(nullptr)
+    Function::Function(GCMemory *memory)
+        : opcodes_(GCAllocator<Instruction>(memory)),
+          opcode_lines_(GCAllocator<int>(memory)),
+          shared_opcodes_(nullptr), shared_opcode_lines_(nullptr),
+          shared_opcode_size_(0),
+          inline_caches_(GCAllocator<unsigned int>(memory)),
+          const_values_(GCAllocator<Value>(memory)),
+          module_(nullptr), line_(0), args_(0),
+          max_register_count_(0), is_vararg_(false), library_(false),
+          superior_(nullptr)
     {
+#ifdef LUNA_JIT
+        jit_count_ = 0;
+#endif // LUNA_JIT
     }
 
     void Function::Accept(GCObjectVisitor *v)
@@ -32,28 +43,86 @@ namespace luna
         }
     }
 
-    const Instruction * Function::GetOpCodes() const
-    {
-        return opcodes_.empty() ? nullptr : &opcodes_[0];
-    }
-
     std::size_t Function::OpCodeSize() const
     {
-        return opcodes_.size();
+        return shared_opcodes_ ? shared_opcode_size_ : opcodes_.size();
     }
 
     Instruction * Function::GetMutableInstruction(std::size_t index)
     {
+        assert(!shared_opcodes_);
         return &opcodes_[index];
     }
 
     std::size_t Function::AddInstruction(Instruction i, int line)
     {
+        assert(!shared_opcodes_);
         opcodes_.push_back(i);
         opcode_lines_.push_back(line);
+        inline_caches_.push_back(0);
         return opcodes_.size() - 1;
     }
 
+    void Function::SetSharedOpCodes(const Instruction *opcodes,
+                                    const int *lines, std::size_t size)
+    {
+        assert(opcodes_.empty());
+        shared_opcodes_ = opcodes;
+        shared_opcode_lines_ = lines;
+        shared_opcode_size_ = size;
+
+        // Inline caches are written at runtime, they are owned by function
+        inline_caches_.assign(size, 0);
+    }
+
+    void Function::RemoveInstructions(const std::vector<bool> &removed)
+    {
+        assert(!shared_opcodes_);
+        assert(removed.size() == opcodes_.size());
+
+        // New index of each old instruction index, removed instruction
+        // maps to the next instruction which is not removed
+        std::size_t size = opcodes_.size();
+        std::vector<int> new_index(size + 1);
+        std::size_t count = 0;
+        for (std::size_t i = 0; i < size; ++i)
+        {
+            new_index[i] = count;
+            if (!removed[i])
+            {
+                opcodes_[count] = opcodes_[i];
+                opcode_lines_[count] = opcode_lines_[i];
+                inline_caches_[count] = inline_caches_[i];
+                ++count;
+            }
+        }
+        new_index[size] = count;
+
+        opcodes_.resize(count);
+        opcode_lines_.resize(count);
+        inline_caches_.resize(count);
+
+        for (auto &var : local_vars_)
+        {
+            var.begin_pc_ = new_index[var.begin_pc_];
+            var.end_pc_ = new_index[var.end_pc_];
+        }
+    }
+
+    void Function::ClearCode()
+    {
+        assert(!shared_opcodes_);
+        opcodes_.clear();
+        opcode_lines_.clear();
+        inline_caches_.clear();
+        const_values_.clear();
+        local_vars_.clear();
+        child_funcs_.clear();
+        args_ = 0;
+        max_register_count_ = 0;
+        is_vararg_ = false;
+    }
+
     void Function::SetHasVararg()
     {
         is_vararg_ = true;
@@ -74,6 +143,16 @@ namespace luna
         return args_;
     }
 
+    void Function::SetMaxRegisterCount(int count)
+    {
+        max_register_count_ = count;
+    }
+
+    int Function::GetMaxRegisterCount() const
+    {
+        return max_register_count_;
+    }
+
     void Function::SetModuleName(String *module)
     {
         module_ = module;
@@ -89,6 +168,19 @@ namespace luna
         superior_ = superior;
     }
 
+    void Function::SetLibrary()
+    {
+        library_ = true;
+    }
+
+    bool Function::IsLibrary() const
+    {
+        auto f = this;
+        while (f->superior_)
+            f = f->superior_;
+        return f->library_;
+    }
+
     int Function::AddConstNumber(double num)
     {
         Value v;
@@ -176,6 +268,8 @@ namespace luna
 
     int Function::GetInstructionLine(int i) const
     {
+        if (shared_opcode_lines_)
+            return shared_opcode_lines_[i];
         return opcode_lines_[i];
     }
 
@@ -195,11 +289,6 @@ namespace luna
         }
     }
 
-    Function * Closure::GetPrototype() const
-    {
-        return prototype_;
-    }
-
     void Closure::SetPrototype(Function *prototype)
     {
         prototype_ = prototype;
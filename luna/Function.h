@@ -6,6 +6,9 @@
 #include "OpCode.h"
 #include "String.h"
 #include "Upvalue.h"
+#include "Jit.h"
+#include <memory>
+#include <string>
 #include <vector>
 
 namespace luna
@@ -37,12 +40,71 @@ namespace luna
             register_index_(register_index) { }
         };
 
-        Function();
+        // Local variable debug info
+        struct LocalVarInfo
+        {
+            // Local variable name
+            String *name_;
+            // Register id in function
+            int register_id_;
+            // Begin instruction index of variable
+            int begin_pc_;
+            // The past-the-end instruction index
+            int end_pc_;
+
+            LocalVarInfo(String *name, int register_id,
+                         int begin_pc, int end_pc)
+                : name_(name), register_id_(register_id),
+                  begin_pc_(begin_pc), end_pc_(end_pc) { }
+        };
+
+        // Source of a function which is compiled on its first call
+        struct LazySource
+        {
+            // Function body from '(' of params to 'end'
+            std::string source_;
+            // Has 'self' param or not
+            bool has_self_;
+
+            LazySource(std::string source, bool has_self)
+                : source_(std::move(source)), has_self_(has_self) { }
+        };
+
+        // Memory of instructions and const values is accounted into 'memory'
+        explicit Function(GCMemory *memory = nullptr);
 
         virtual void Accept(GCObjectVisitor *v);
 
-        // Get function instructions and size
-        const Instruction * GetOpCodes() const;
+        // Pass all member GC objects to 'marker' of GC
+        template<typename Marker>
+        void Trace(Marker &marker) const
+        {
+            if (module_)
+                marker.MarkObject(module_);
+            if (superior_)
+                marker.MarkObject(superior_);
+
+            for (const auto &value : const_values_)
+                marker.MarkValue(value);
+
+            for (const auto &var : local_vars_)
+                marker.MarkObject(var.name_);
+
+            for (auto child : child_funcs_)
+                marker.MarkObject(child);
+
+            for (const auto &upvalue : upvalues_)
+                marker.MarkObject(upvalue.name_);
+        }
+
+        // Get function instructions and size, instructions are got when
+        // every frame is entered, so it is inline
+        const Instruction * GetOpCodes() const
+        {
+            if (shared_opcodes_)
+                return shared_opcodes_;
+            return opcodes_.empty() ? nullptr : &opcodes_[0];
+        }
         std::size_t OpCodeSize() const;
         // Get instruction pointer, then it can be changed
         Instruction * GetMutableInstruction(std::size_t index);
@@ -51,6 +113,27 @@ namespace luna
         // return index of the new instruction
         std::size_t AddInstruction(Instruction i, int line);
 
+        // Use instructions and their lines in read only memory which is
+        // shared with other functions, the memory must outlive this
+        // function. Instructions can not be changed any more.
+        void SetSharedOpCodes(const Instruction *opcodes,
+                              const int *lines, std::size_t size);
+
+        // Get inline cache of instruction by index, instructions which
+        // access table by constant key remember the hash node of the key
+        unsigned int * GetInlineCache(std::size_t index)
+        { return &inline_caches_[index]; }
+
+        // Remove the instructions which 'removed' flag is true, line numbers,
+        // inline caches and pc ranges of local variables are moved with the
+        // instructions, but jump offsets are not changed
+        void RemoveInstructions(const std::vector<bool> &removed);
+
+        // Clear instructions, const values, local variables, child
+        // functions and args generated by compiling lazily, upvalues are
+        // kept, then the function could be compiled again
+        void ClearCode();
+
         // Set and get this function has vararg
         void SetHasVararg();
         bool HasVararg() const;
@@ -59,6 +142,10 @@ namespace luna
         void AddFixedArgCount(int count);
         int FixedArgCount() const;
 
+        // Set and get max count of registers used by this function
+        void SetMaxRegisterCount(int count);
+        int GetMaxRegisterCount() const;
+
         // Set module and function define start line
         void SetModuleName(String *module);
         void SetLine(int line);
@@ -66,6 +153,16 @@ namespace luna
         // Set superior function
         void SetSuperior(Function *superior);
 
+        // Set module function is defined by script of library, and get
+        // this function is in such module, errors of c functions called
+        // by library functions are reported at their callers
+        void SetLibrary();
+        bool IsLibrary() const;
+
+        // Get superior function, nullptr when it is module function
+        Function * GetSuperior() const
+        { return superior_; }
+
         // Add const number and return index of the const value
         int AddConstNumber(double num);
 
@@ -75,6 +172,10 @@ namespace luna
         // Add const Value and return index of the const value
         int AddConstValue(const Value &v);
 
+        // Get count of const values
+        std::size_t GetConstValueCount() const
+        { return const_values_.size(); }
+
         // Add local variable debug info
         void AddLocalVar(String *name, int register_id,
                          int begin_pc, int end_pc);
@@ -91,6 +192,17 @@ namespace luna
         // Get child function by index
         Function * GetChildFunction(int index) const;
 
+        // Get child function count
+        std::size_t GetChildFunctionCount() const
+        { return child_funcs_.size(); }
+
+        // Get local variable debug info count and info by index
+        std::size_t GetLocalVarCount() const
+        { return local_vars_.size(); }
+
+        const LocalVarInfo * GetLocalVar(std::size_t index) const
+        { return &local_vars_[index]; }
+
         // Search local variable name from local variable list
         String * SearchLocalVar(int register_id, int pc) const;
 
@@ -116,31 +228,42 @@ namespace luna
         int GetLine() const
         { return line_; }
 
-    private:
-        // For debug
-        struct LocalVarInfo
-        {
-            // Local variable name
-            String *name_;
-            // Register id in function
-            int register_id_;
-            // Begin instruction index of variable
-            int begin_pc_;
-            // The past-the-end instruction index
-            int end_pc_;
+        // Set and get source of function compiled lazily, the source is
+        // nullptr when the function is compiled
+        void SetLazySource(std::unique_ptr<LazySource> source)
+        { lazy_source_ = std::move(source); }
 
-            LocalVarInfo(String *name, int register_id,
-                         int begin_pc, int end_pc)
-                : name_(name), register_id_(register_id),
-                  begin_pc_(begin_pc), end_pc_(end_pc) { }
-        };
+        const LazySource * GetLazySource() const
+        { return lazy_source_.get(); }
 
+#ifdef LUNA_JIT
+        // Get machine code of this function, nullptr when not compiled
+        JitCode * GetJitCode() const
+        { return jit_code_.get(); }
+
+        void SetJitCode(std::unique_ptr<JitCode> code)
+        { jit_code_ = std::move(code); }
+
+        // Count calls and backward jumps run by the interpreter before
+        // compiling, return the count
+        unsigned int AddJitCount()
+        { return ++jit_count_; }
+#endif // LUNA_JIT
+
+    private:
         // function instruction opcodes
-        std::vector<Instruction> opcodes_;
+        std::vector<Instruction, GCAllocator<Instruction>> opcodes_;
         // opcodes' line number
-        std::vector<int> opcode_lines_;
+        std::vector<int, GCAllocator<int>> opcode_lines_;
+        // shared read only opcodes and their line numbers, they are used
+        // instead of 'opcodes_' and 'opcode_lines_' when not null
+        const Instruction *shared_opcodes_;
+        const int *shared_opcode_lines_;
+        std::size_t shared_opcode_size_;
+        // opcodes' inline cache
+        std::vector<unsigned int, GCAllocator<unsigned int>> inline_caches_;
         // const values in function
-        std::vector<Value> const_values_;
+        std::vector<Value, GCAllocator<Value>> const_values_;
         // debug info
         std::vector<LocalVarInfo> local_vars_;
         // child functions
@@ -153,10 +276,21 @@ namespace luna
         int line_;
         // count of args
         int args_;
+        // max count of registers
+        int max_register_count_;
         // has '...' param or not
         bool is_vararg_;
+        // module is script of library
+        bool library_;
         // superior function pointer
         Function *superior_;
+        // source of function body before it is compiled
+        std::unique_ptr<LazySource> lazy_source_;
+#ifdef LUNA_JIT
+        // machine code and count of calls and backward jumps
+        std::unique_ptr<JitCode> jit_code_;
+        unsigned int jit_count_;
+#endif // LUNA_JIT
     };
 
     // All runtime function are closures, this class object pointer to a
@@ -168,8 +302,18 @@ namespace luna
 
         virtual void Accept(GCObjectVisitor *v);
 
+        // Pass all member GC objects to 'marker' of GC
+        template<typename Marker>
+        void Trace(Marker &marker) const
+        {
+            marker.MarkObject(prototype_);
+
+            for (auto upvalue : upvalues_)
+                marker.MarkObject(upvalue);
+        }
+
         // Get and set closure prototype Function
-        Function * GetPrototype() const;
+        Function * GetPrototype() const { return prototype_; }
         void SetPrototype(Function *prototype);
 
         // Add upvalue
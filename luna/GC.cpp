@@ -1,16 +1,123 @@
 #include "GC.h"
 #include "Table.h"
+#include "Shape.h"
 #include "Function.h"
 #include "Upvalue.h"
 #include "String.h"
 #include "UserData.h"
+#include "Exception.h"
 #include <assert.h>
-#include <time.h>
+#include <string.h>
+#include <algorithm>
+#include <limits>
+#include <new>
+#include <unordered_set>
+
+namespace
+{
+    std::size_t GetObjectSize(unsigned int type)
+    {
+        switch (type)
+        {
+            case luna::GCObjectType_Table: return sizeof(luna::Table);
+            case luna::GCObjectType_Function: return sizeof(luna::Function);
+            case luna::GCObjectType_Closure: return sizeof(luna::Closure);
+            case luna::GCObjectType_Upvalue: return sizeof(luna::Upvalue);
+            case luna::GCObjectType_String: return sizeof(luna::String);
+            case luna::GCObjectType_UserData: return sizeof(luna::UserData);
+            default: assert(!"unknown GC object type"); return 0;
+        }
+    }
+
+    unsigned int MicrosecondsSince(std::chrono::steady_clock::time_point start)
+    {
+        auto duration = std::chrono::steady_clock::now() - start;
+        return std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+    }
+
+    const char *kind_names[] = {
+        "minor",
+        "major start",
+        "major propagate",
+        "major sweep",
+        "full",
+    };
+    static_assert(sizeof(kind_names) / sizeof(kind_names[0]) ==
+                  luna::GCKind_Count, "kind names is not match GCKind");
+
+    // Names of GCObjectType, indexed by GCObjectType
+    const char *type_names[] = {
+        "",
+        "table",
+        "function",
+        "closure",
+        "upvalue",
+        "string",
+        "userdata",
+    };
+    static_assert(sizeof(type_names) / sizeof(type_names[0]) ==
+                  luna::GCObjectType_UserData + 1, "type names is not match GCObjectType");
+} // namespace
 
 namespace luna
 {
+    const char * GetGCKindName(GCKind kind)
+    {
+        return kind < GCKind_Count ? kind_names[kind] : "";
+    }
+
+    const char * GetGCObjectTypeName(unsigned int type)
+    {
+        return type <= GCObjectType_UserData ? type_names[type] : "";
+    }
+
+    GCObjectCounts::GCObjectCounts()
+    {
+        memset(count_, 0, sizeof(count_));
+        memset(bytes_, 0, sizeof(bytes_));
+    }
+
+    std::size_t GCObjectCounts::TotalCount() const
+    {
+        std::size_t total = 0;
+        for (auto count : count_)
+            total += count;
+        return total;
+    }
+
+    std::size_t GCObjectCounts::TotalBytes() const
+    {
+        std::size_t total = 0;
+        for (auto bytes : bytes_)
+            total += bytes;
+        return total;
+    }
+
+    GCConfig::GCConfig()
+        : gen0_init_threshold_bytes_(256 * 1024),
+          gen0_max_threshold_bytes_(1024 * 1024),
+          gen0_grow_factor_(2),
+          gen0_shrink_factor_(4),
+          major_min_threshold_bytes_(1024 * 1024),
+          major_pause_(200),
+          major_step_multiplier_(100),
+          major_step_object_count_(8192),
+          major_step_microseconds_(500),
+          heap_limit_bytes_(0),
+          background_sweep_(false)
+    {
+    }
+
+    void GCMemory::CheckLimit(std::size_t bytes) const
+    {
+        auto total = TotalBytes();
+        if (total > limit_bytes_ || bytes > limit_bytes_ - total)
+            throw MemoryException();
+    }
+
     GCObject::GCObject()
-        : next_(nullptr), generation_(GCGen0), gc_(0), gc_obj_type_(0)
+        : next_(nullptr), generation_(GCGen0), gc_(0), gc_obj_type_(0),
+          in_barriered_(0)
     {
     }
 
@@ -18,83 +125,215 @@ namespace luna
     {
     }
 
-    class MinorMarkVisitor : public GCObjectVisitor
+    // Mark all members of 'obj' by 'marker'
+    template<typename Marker>
+    void TraceMembers(GCObject *obj, unsigned int type, Marker &marker)
+    {
+        switch (type)
+        {
+            case GCObjectType_Table:
+                static_cast<Table *>(obj)->Trace(marker);
+                break;
+            case GCObjectType_Function:
+                static_cast<Function *>(obj)->Trace(marker);
+                break;
+            case GCObjectType_Closure:
+                static_cast<Closure *>(obj)->Trace(marker);
+                break;
+            case GCObjectType_Upvalue:
+                static_cast<Upvalue *>(obj)->Trace(marker);
+                break;
+            case GCObjectType_UserData:
+                static_cast<UserData *>(obj)->Trace(marker);
+                break;
+            default:
+                break;
+        }
+    }
+
+    // Mark white objects to gray and push them into gray stack, then
+    // members of gray objects are traced by switching on the object type,
+    // so marking is not recursive and could be divided into steps.
+    class GCMarker
     {
     public:
-        virtual bool Visit(Table *t) { return VisitObj(t); }
-        virtual bool Visit(Function *f) { return VisitObj(f); }
-        virtual bool Visit(Closure *c) { return VisitObj(c); }
-        virtual bool Visit(Upvalue *u) { return VisitObj(u); }
-        virtual bool Visit(String *s) { return VisitObj(s); }
-        virtual bool Visit(UserData *u) { return VisitObj(u); }
+        // Minor GC marker only marks objects of GCGen0, weak tables which
+        // are traced are recorded into 'weak' for clearing
+        GCMarker(unsigned int white, bool minor, std::vector<GCObject *> &gray,
+                 std::vector<Table *> &weak)
+            : white_(white), minor_(minor), gray_(gray), weak_(weak),
+              visited_(0) { }
 
-    private:
-        bool VisitObj(GCObject *obj)
+        void MarkValue(const Value &value)
         {
-            if (obj->generation_ == GCGen0 && obj->gc_ == GCFlag_White)
+            if (value.IsGCObject())
+                MarkObject(value.obj_);
+        }
+
+        void MarkObject(GCObject *obj)
+        {
+            ++visited_;
+            if (obj->gc_ != white_ || (minor_ && obj->generation_ != GCGen0))
+                return ;
+
+            // String has no member, so it is black directly
+            if (obj->gc_obj_type_ == GCObjectType_String)
             {
                 obj->gc_ = GCFlag_Black;
-                return true;
             }
-            return false;
+            else
+            {
+                obj->gc_ = GCFlag_Gray;
+                gray_.push_back(obj);
+            }
         }
-    };
 
-    class BarrieredMarkVisitor : public GCObjectVisitor
-    {
-    public:
-        virtual bool Visit(Table *t) { return VisitObj(t); }
-        virtual bool Visit(Function *f) { return VisitObj(f); }
-        virtual bool Visit(Closure *c) { return VisitObj(c); }
-        virtual bool Visit(Upvalue *u) { return VisitObj(u); }
-        virtual bool Visit(String *s) { return VisitObj(s); }
-        virtual bool Visit(UserData *u) { return VisitObj(u); }
+        // Return true when 'value' is an object which is not marked and
+        // would be collected, strings are never dead for weak tables
+        bool IsDead(const Value &value) const
+        {
+            if (!value.IsGCObject() || value.type_ == ValueT_String)
+                return false;
+            GCObject *obj = value.obj_;
+            return obj->gc_ == white_ && (!minor_ || obj->generation_ == GCGen0);
+        }
 
-    private:
-        bool VisitObj(GCObject *obj)
+        // Mark all members of 'obj', return the count of visited members
+        unsigned int Trace(GCObject *obj)
         {
-            // Visit member GC objects of obj when it is barriered object
-            if (obj->generation_ != GCGen0 && obj->gc_ == GCFlag_Black)
+            visited_ = 0;
+            if (obj->gc_obj_type_ == GCObjectType_Table &&
+                static_cast<Table *>(obj)->GetWeakMode() != WeakMode_None)
             {
-                obj->gc_ = GCFlag_White;
-                return true;
+                auto t = static_cast<Table *>(obj);
+                t->TraceWeak(*this);
+                weak_.push_back(t);
             }
+            else
+            {
+                TraceMembers(obj, obj->gc_obj_type_, *this);
+            }
+            return visited_;
+        }
 
-            // Visit GCGen0 generation object
-            if (obj->generation_ == GCGen0 && obj->gc_ == GCFlag_White)
+        // Make gray object 'obj' black and mark all members of it,
+        // return the count of visited members. Gray object may become
+        // permanent object which is black.
+        unsigned int Scan(GCObject *obj)
+        {
+            assert(obj->gc_ == GCFlag_Gray || obj->generation_ == GCGenPermanent);
+            obj->gc_ = GCFlag_Black;
+            return Trace(obj);
+        }
+
+        // Scan all gray objects
+        void Propagate()
+        {
+            while (!gray_.empty())
             {
-                obj->gc_ = GCFlag_Black;
-                return true;
+                auto obj = gray_.back();
+                gray_.pop_back();
+                Scan(obj);
             }
-            return false;
         }
+
+    private:
+        unsigned int white_;
+        bool minor_;
+        std::vector<GCObject *> &gray_;
+        std::vector<Table *> &weak_;
+        unsigned int visited_;
     };
 
-    class MajorMarkVisitor : public GCObjectVisitor
+    // Move all reachable objects to permanent generation
+    class PermanentMarker
     {
     public:
-        virtual bool Visit(Table *t) { return VisitObj(t); }
-        virtual bool Visit(Function *f) { return VisitObj(f); }
-        virtual bool Visit(Closure *c) { return VisitObj(c); }
-        virtual bool Visit(Upvalue *u) { return VisitObj(u); }
-        virtual bool Visit(String *s) { return VisitObj(s); }
-        virtual bool Visit(UserData *u) { return VisitObj(u); }
+        explicit PermanentMarker(std::vector<GCObject *> &stored)
+            : stored_(stored)
+        {
+        }
 
-    private:
-        bool VisitObj(GCObject *obj)
+        void MarkValue(const Value &value)
+        {
+            if (value.IsGCObject())
+                MarkObject(value.obj_);
+        }
+
+        void MarkObject(GCObject *obj)
         {
-            if (obj->gc_ == GCFlag_White)
+            if (obj->generation_ == GCGenPermanent)
+                return ;
+
+            // Object stays in its generation list until it is swept,
+            // then it is moved into permanent generation list
+            obj->generation_ = GCGenPermanent;
+            obj->gc_ = GCFlag_Black;
+            objects_.push_back(obj);
+
+            // Barriered object may point to young objects
+            if (obj->in_barriered_)
+                stored_.push_back(obj);
+        }
+
+        void Propagate()
+        {
+            while (!objects_.empty())
             {
-                obj->gc_ = GCFlag_Black;
-                return true;
+                auto obj = objects_.back();
+                objects_.pop_back();
+                TraceMembers(obj, obj->gc_obj_type_, *this);
             }
-            else
+        }
+
+    private:
+        std::vector<GCObject *> objects_;
+        std::vector<GCObject *> &stored_;
+    };
+
+    // Count objects reachable from roots by type
+    class ReachableCounter
+    {
+    public:
+        explicit ReachableCounter(GCObjectCounts &counts) : counts_(counts) { }
+
+        void MarkValue(const Value &value)
+        {
+            if (value.IsGCObject())
+                MarkObject(value.obj_);
+        }
+
+        void MarkObject(GCObject *obj)
+        {
+            if (!visited_.insert(obj).second)
+                return ;
+
+            auto type = obj->gc_obj_type_;
+            counts_.count_[type]++;
+            counts_.bytes_[type] += GetObjectSize(type);
+            objects_.push_back(obj);
+        }
+
+        void Propagate()
+        {
+            while (!objects_.empty())
             {
-                return false;
+                auto obj = objects_.back();
+                objects_.pop_back();
+                TraceMembers(obj, obj->gc_obj_type_, *this);
             }
         }
+
+    private:
+        GCObjectCounts &counts_;
+        std::unordered_set<GCObject *> visited_;
+        std::vector<GCObject *> objects_;
     };
 
+    // Mark root objects by GCMarker, members of root objects are
+    // not visited by root traveller
+    typedef MarkVisitor<GCMarker> RootMarkVisitor;
+
 #define GC_LOG(log)                             \
     do                                          \
     {                                           \
@@ -104,12 +343,25 @@ namespace luna
         }                                       \
     } while (0)
 
-    GC::GC(const GCObjectDeleter &obj_deleter, bool log)
-        : obj_deleter_(obj_deleter)
+    GC::GC(const GCObjectDeleter &obj_deleter, bool log, Allocator *allocator)
+        : white_(GCFlag_White0),
+          major_state_(MajorState_Pause),
+          sweep_gen0_(nullptr),
+          sweep_gen1_(nullptr),
+          sweep_gen2_(nullptr),
+          step_bytes_(0),
+          step_clock_work_(0),
+          gen0_threshold_bytes_(config_.gen0_init_threshold_bytes_),
+          major_threshold_bytes_(config_.major_min_threshold_bytes_),
+          stopped_(false),
+          obj_deleter_(obj_deleter),
+          arena_(allocator)
     {
-        gen0_.threshold_count_ = kGen0InitThresholdCount;
-        gen1_.threshold_count_ = kGen1InitThresholdCount;
-
+        if (allocator)
+            memory_.allocator_ = allocator;
+        shapes_.reset(new ShapeTree(&memory_));
+        memset(&stats_, 0, sizeof(stats_));
+        memset(&run_, 0, sizeof(run_));
         if (log)
         {
             log_stream_.open("gc.log");
@@ -118,9 +370,16 @@ namespace luna
 
     GC::~GC()
     {
+        if (sweeper_)
+            StopSweeper();
+
         DestroyGeneration(gen0_);
         DestroyGeneration(gen1_);
         DestroyGeneration(gen2_);
+        DestroyList(sweep_gen0_);
+        DestroyList(sweep_gen1_);
+        DestroyList(sweep_gen2_);
+        DestroyGeneration(permanent_);
     }
 
     void GC::SetRootTraveller(const RootTravelType &minor, const RootTravelType &major)
@@ -129,94 +388,364 @@ namespace luna
         major_traveller_ = major;
     }
 
+    template<typename T, typename... Args>
+    T * GC::NewObject(GCObjectType type, GCGeneration gen, Args&&... args)
+    {
+        memory_.Alloc(sizeof(T));
+        auto obj = new (arena_.Alloc(sizeof(T))) T(std::forward<Args>(args)...);
+        obj->gc_obj_type_ = type;
+        SetObjectGen(obj, gen);
+        return obj;
+    }
+
+    void GC::DeleteObject(GCObject *obj)
+    {
+        auto type = obj->gc_obj_type_;
+        if (obj_deleter_)
+            obj_deleter_(obj, type);
+
+        auto size = GetObjectSize(type);
+        memory_.Free(size);
+        if (sweeper_ && type != GCObjectType_UserData)
+        {
+            dead_objects_.push_back(DeadObject{ obj, size });
+            return ;
+        }
+
+        obj->~GCObject();
+        arena_.Free(obj, size);
+    }
+
+    void GC::HandOverDeadObjects()
+    {
+        if (!sweeper_)
+            return ;
+
+        sweeper_->TakeDestroyed(destroyed_objects_);
+        for (const auto &dead : destroyed_objects_)
+            arena_.Free(dead.obj_, dead.size_);
+        destroyed_objects_.clear();
+
+        if (!dead_objects_.empty())
+            sweeper_->Destroy(dead_objects_);
+    }
+
+    void GC::StopSweeper()
+    {
+        HandOverDeadObjects();
+        sweeper_->Join();
+        HandOverDeadObjects();
+        sweeper_.reset();
+    }
+
+    void GC::SetBackgroundSweep(bool enable)
+    {
+        if (enable && !sweeper_)
+            sweeper_.reset(new Sweeper);
+        else if (!enable && sweeper_)
+            StopSweeper();
+    }
+
     Table * GC::NewTable(GCGeneration gen)
     {
-        auto t = new Table;
-        t->gc_obj_type_ = GCObjectType_Table;
-        SetObjectGen(t, gen);
-        return t;
+        return NewObject<Table>(GCObjectType_Table, gen, &memory_, shapes_.get());
     }
 
     Function * GC::NewFunction(GCGeneration gen)
     {
-        auto f = new Function;
-        f->gc_obj_type_ = GCObjectType_Function;
-        SetObjectGen(f, gen);
-        return f;
+        return NewObject<Function>(GCObjectType_Function, gen, &memory_);
     }
 
     Closure * GC::NewClosure(GCGeneration gen)
     {
-        auto c = new Closure;
-        c->gc_obj_type_ = GCObjectType_Closure;
-        SetObjectGen(c, gen);
-        return c;
+        return NewObject<Closure>(GCObjectType_Closure, gen);
     }
 
     Upvalue * GC::NewUpvalue(GCGeneration gen)
     {
-        auto u = new Upvalue;
-        u->gc_obj_type_ = GCObjectType_Upvalue;
-        SetObjectGen(u, gen);
-        return u;
+        return NewObject<Upvalue>(GCObjectType_Upvalue, gen);
     }
 
     String * GC::NewString(GCGeneration gen)
     {
-        auto s = new String;
-        s->gc_obj_type_ = GCObjectType_String;
-        SetObjectGen(s, gen);
-        return s;
+        return NewObject<String>(GCObjectType_String, gen, &memory_);
     }
 
     UserData * GC::NewUserData(GCGeneration gen)
     {
-        auto u = new UserData;
-        u->gc_obj_type_ = GCObjectType_UserData;
-        SetObjectGen(u, gen);
-        return u;
+        return NewObject<UserData>(GCObjectType_UserData, gen);
     }
 
     void GC::SetBarrier(GCObject *obj)
     {
-        assert(obj->generation_ != GCGen0);
-        barriered_.push_back(obj);
+        // Permanent objects are not marked, members of them are marked
+        // by minor and major GC after they are stored
+        if (obj->generation_ == GCGenPermanent)
+        {
+            if (!obj->in_barriered_)
+            {
+                obj->in_barriered_ = 1;
+                permanent_stored_.push_back(obj);
+            }
+            return ;
+        }
+
+        // Black object need be scanned again when major GC is marking,
+        // scan it in atomic step, then the object which is stored
+        // frequently would not be scanned many times
+        if (obj->gc_ == GCFlag_Black && major_state_ == MajorState_Propagate)
+        {
+            obj->gc_ = GCFlag_Gray;
+            gray_again_.push_back(obj);
+        }
+
+        // Old objects are barriered for minor GC, also the black objects
+        // of GCGen0 when major GC is sweeping, which will be moved to
+        // GCGen1 by sweeping. Each object is barriered once.
+        if ((obj->generation_ != GCGen0 || major_state_ == MajorState_Sweep) &&
+            !obj->in_barriered_)
+        {
+            obj->in_barriered_ = 1;
+            barriered_.push_back(obj);
+        }
+    }
+
+    void GC::SetMajorStepBudget(unsigned int object_count,
+                                unsigned int microseconds)
+    {
+        config_.major_step_object_count_ = object_count > 0 ? object_count : 1;
+        config_.major_step_microseconds_ = microseconds;
     }
 
-    void GC::CheckGC()
+    void GC::SetMajorPause(unsigned int percent)
     {
-        if (gen0_.count_ >= gen0_.threshold_count_)
-        {
-            unsigned int gen0_count = gen0_.count_;
-            unsigned int gen0_threshold = gen0_.threshold_count_;
-            unsigned int gen1_count = gen1_.count_;
-            unsigned int gen1_threshold = gen1_.threshold_count_;
-            unsigned int gen2_count = gen2_.count_;
-            unsigned int gen2_threshold = gen2_.threshold_count_;
+        config_.major_pause_ = percent > 100 ? percent : 100;
+    }
 
-            const char *gc_name = "";
-            clock_t start = clock();
-            if (gen1_.count_ >= gen1_.threshold_count_)
+    void GC::SetMajorStepMultiplier(unsigned int percent)
+    {
+        config_.major_step_multiplier_ = percent > 0 ? percent : 1;
+    }
+
+    void GC::SetConfig(const GCConfig &config)
+    {
+        config_ = config;
+        memory_.limit_bytes_ = config_.heap_limit_bytes_;
+        config_.gen0_init_threshold_bytes_ =
+            std::max<std::size_t>(config_.gen0_init_threshold_bytes_, 1);
+        config_.gen0_max_threshold_bytes_ = std::max(
+            config_.gen0_max_threshold_bytes_, config_.gen0_init_threshold_bytes_);
+        config_.gen0_grow_factor_ = std::max(config_.gen0_grow_factor_, 1u);
+        config_.gen0_shrink_factor_ = std::max(config_.gen0_shrink_factor_,
+                                               2 * config_.gen0_grow_factor_);
+        SetMajorPause(config_.major_pause_);
+        SetMajorStepMultiplier(config_.major_step_multiplier_);
+        SetMajorStepBudget(config_.major_step_object_count_,
+                           config_.major_step_microseconds_);
+        SetBackgroundSweep(config_.background_sweep_);
+
+        AdjustGen0Threshold(0);
+        major_threshold_bytes_ = std::max(major_threshold_bytes_,
+                                          config_.major_min_threshold_bytes_);
+    }
+
+    void GC::FullGC()
+    {
+        BeginRun(GCKind_Full);
+
+        // Remove the step budget, finish the running major GC first
+        auto object_count = config_.major_step_object_count_;
+        auto microseconds = config_.major_step_microseconds_;
+        config_.major_step_object_count_ = std::numeric_limits<unsigned int>::max();
+        config_.major_step_microseconds_ = 0;
+
+        while (major_state_ != MajorState_Pause)
+            MajorGCStep();
+
+        StartMajorGC();
+        while (major_state_ != MajorState_Pause)
+            MajorGCStep();
+
+        config_.major_step_object_count_ = object_count;
+        config_.major_step_microseconds_ = microseconds;
+        EndRun();
+    }
+
+    void GC::SetPermanent(GCObject *obj)
+    {
+        PermanentMarker marker(permanent_stored_);
+        marker.MarkObject(obj);
+        marker.Propagate();
+    }
+
+    void GC::ReleasePermanent(GCObject *obj)
+    {
+        if (obj->generation_ != GCGenPermanent)
+            return ;
+
+        // Unlink object when it is in permanent generation list, or it
+        // is in other generation list which is not swept yet
+        for (GCObject **link = &permanent_.gen_; *link; link = &(*link)->next_)
+        {
+            if (*link == obj)
             {
-                gc_name = "major";
-                MajorGC();
+                *link = obj->next_;
+                permanent_.count_--;
+                LinkObject(obj, gen2_);
+                break;
             }
-            else
+        }
+
+        if (obj->in_barriered_)
+        {
+            obj->in_barriered_ = 0;
+            permanent_stored_.erase(std::find(permanent_stored_.begin(),
+                                              permanent_stored_.end(), obj));
+        }
+
+        // Object may point to young objects, and it is alive in the
+        // current major GC
+        obj->generation_ = GCGen2;
+        obj->gc_ = white_;
+        SetBarrier(obj);
+        if (major_state_ == MajorState_Propagate)
+        {
+            obj->gc_ = GCFlag_Gray;
+            gray_.push_back(obj);
+        }
+    }
+
+    void GC::CheckGC()
+    {
+        auto limit = config_.heap_limit_bytes_;
+        if (limit != 0)
+        {
+            limit -= limit / kHeapLimitHeadroom;
+            if (memory_.TotalBytes() >= limit)
             {
-                gc_name = "minor";
-                MinorGC();
+                FullGC();
+                if (memory_.TotalBytes() >= limit)
+                    throw MemoryException();
+                return ;
             }
+        }
+
+        if (stopped_)
+            return ;
+
+        // Major GC is running, run one step after some new bytes
+        auto threshold = major_state_ != MajorState_Pause ?
+            step_bytes_ : gen0_threshold_bytes_;
+        if (memory_.alloc_bytes_ >= threshold)
+            Step();
+    }
 
-            clock_t duration = clock() - start;
-            unsigned int microseconds = duration * 1000000 / CLOCKS_PER_SEC;
-            GC_LOG(gc_name << "[" << microseconds << " microseconds]: " <<
-                   gen0_count << " " << gen0_threshold << " | " <<
-                   gen1_count << " " << gen1_threshold << " | " <<
-                   gen2_count << " " << gen2_threshold << " - " <<
-                   gen0_.count_ << " " << gen0_.threshold_count_ << " | " <<
-                   gen1_.count_ << " " << gen1_.threshold_count_ << " | " <<
-                   gen2_.count_ << " " << gen2_.threshold_count_);
+    bool GC::Step()
+    {
+        if (major_state_ != MajorState_Pause)
+        {
+            BeginRun(major_state_ == MajorState_Propagate ?
+                     GCKind_MajorPropagate : GCKind_MajorSweep);
+            MajorGCStep();
+        }
+        else if (memory_.TotalBytes() >= major_threshold_bytes_)
+        {
+            BeginRun(GCKind_MajorStart);
+            StartMajorGC();
+        }
+        else
+        {
+            BeginRun(GCKind_Minor);
+            MinorGC();
+        }
+
+        EndRun();
+        return major_state_ == MajorState_Pause;
+    }
+
+    void GC::BeginRun(GCKind kind)
+    {
+        memset(&run_, 0, sizeof(run_));
+        run_.kind_ = kind;
+        run_.total_bytes_before_ = memory_.TotalBytes();
+        run_.barriered_count_ = barriered_.size();
+        run_.gen0_threshold_before_ = gen0_threshold_bytes_;
+        run_.major_threshold_before_ = major_threshold_bytes_;
+
+        step_start_ = std::chrono::steady_clock::now();
+        step_clock_work_ = kMajorStepClockInterval;
+    }
+
+    void GC::EndRun()
+    {
+        run_.microseconds_ = MicrosecondsSince(step_start_);
+        run_.total_bytes_after_ = memory_.TotalBytes();
+        run_.gen0_threshold_after_ = gen0_threshold_bytes_;
+        run_.major_threshold_after_ = major_threshold_bytes_;
+        run_.gen_objects_[GCGen0] = gen0_.count_;
+        run_.gen_objects_[GCGen1] = gen1_.count_;
+        run_.gen_objects_[GCGen2] = gen2_.count_;
+
+        auto kind = run_.kind_;
+        stats_.runs_[kind]++;
+        stats_.microseconds_[kind] += run_.microseconds_;
+        stats_.max_microseconds_[kind] =
+            std::max(stats_.max_microseconds_[kind], run_.microseconds_);
+        for (std::size_t gen = 0; gen < kGCGenCount; ++gen)
+        {
+            stats_.freed_objects_[gen] += run_.freed_objects_[gen];
+            stats_.freed_bytes_[gen] += run_.freed_bytes_[gen];
         }
+        stats_.promoted_objects_ += run_.promoted_objects_;
+        stats_.promoted_bytes_ += run_.promoted_bytes_;
+
+        GC_LOG(GetGCKindName(kind) << "[" << run_.microseconds_ << " microseconds]: " <<
+               run_.total_bytes_before_ << " -> " << run_.total_bytes_after_ << " | " <<
+               run_.gen0_threshold_after_ << " " << run_.major_threshold_after_ << " | " <<
+               gen0_.count_ << " " << gen1_.count_ << " " << gen2_.count_);
+
+        if (callback_)
+            callback_(run_);
+    }
+
+    void GC::CountFreed(GCObject *obj)
+    {
+        auto gen = obj->generation_;
+        assert(gen < kGCGenCount);
+        run_.freed_objects_[gen]++;
+        run_.freed_bytes_[gen] += GetObjectSize(obj->gc_obj_type_);
+    }
+
+    void GC::CountPromoted(GCObject *obj)
+    {
+        run_.promoted_objects_++;
+        run_.promoted_bytes_ += GetObjectSize(obj->gc_obj_type_);
+    }
+
+    void GC::CountObjects(GCObjectCounts &counts) const
+    {
+        auto count_list = [&counts](const GCObject *list) {
+            for (auto obj = list; obj; obj = obj->next_)
+            {
+                counts.count_[obj->gc_obj_type_]++;
+                counts.bytes_[obj->gc_obj_type_] += GetObjectSize(obj->gc_obj_type_);
+            }
+        };
+
+        count_list(gen0_.gen_);
+        count_list(gen1_.gen_);
+        count_list(gen2_.gen_);
+        count_list(permanent_.gen_);
+        count_list(sweep_gen0_);
+        count_list(sweep_gen1_);
+        count_list(sweep_gen2_);
+    }
+
+    void GC::CountReachable(GCObject *root, GCObjectCounts &counts) const
+    {
+        ReachableCounter counter(counts);
+        counter.MarkObject(root);
+        counter.Propagate();
     }
 
     void GC::SetObjectGen(GCObject *obj, GCGeneration gen)
@@ -234,11 +763,15 @@ namespace luna
             case GCGen2:
                 gen_info = &gen2_;
                 break;
+            case GCGenPermanent:
+                gen_info = &permanent_;
+                break;
         }
 
         assert(gen_info);
 
         obj->generation_ = gen;
+        obj->gc_ = gen == GCGenPermanent ? static_cast<unsigned int>(GCFlag_Black) : white_;
         obj->next_ = gen_info->gen_;
         gen_info->gen_ = obj;
         gen_info->count_++;
@@ -246,49 +779,43 @@ namespace luna
 
     void GC::MinorGC()
     {
-        unsigned int old_gen1_count = gen1_.count_;
+        std::size_t alloc_bytes = memory_.alloc_bytes_;
+        std::size_t total_bytes = memory_.TotalBytes();
 
         MinorGCMark();
         MinorGCSweep();
 
-        barriered_.clear();
+        ClearBarriered();
 
-        // Caculate objects count from gen0_ to gen1_, which is how
-        // many alived objects in gen0_ after mark-sweep, and adjust
-        // gen0_'s threshold count by the alived_gen0_count
-        unsigned int alived_gen0_count = gen1_.count_ - old_gen1_count;
-        AdjustThreshold(alived_gen0_count, gen0_, kGen0InitThresholdCount,
-                        kGen0MaxThresholdCount);
-    }
-
-    void GC::MajorGC()
-    {
-        MajorGCMark();
-        MajorGCSweep();
-
-        barriered_.clear();
+        // Alived bytes of new objects are about the new bytes minus the
+        // freed bytes, adjust threshold of minor GC by the alived bytes
+        std::size_t freed_bytes = total_bytes - memory_.TotalBytes();
+        AdjustGen0Threshold(alloc_bytes > freed_bytes ?
+                            alloc_bytes - freed_bytes : 0);
+        memory_.alloc_bytes_ = 0;
     }
 
     void GC::MinorGCMark()
     {
         assert(minor_traveller_);
+        assert(gray_.empty());
 
-        // Visit all minor GC root objects
-        MinorMarkVisitor marker;
-        minor_traveller_(&marker);
+        // Mark all minor GC root objects
+        GCMarker marker(white_, true, gray_, weak_tables_);
+        RootMarkVisitor root_marker(marker);
+        minor_traveller_(&root_marker);
 
-        // Visit all barriered GC objects
-        BarrieredMarkVisitor barriered_maker;
+        // Mark members of all barriered GC objects
         for (auto obj : barriered_)
         {
             // All barriered objects must be GCGen1 or GCGen2.
             assert(obj->generation_ != GCGen0);
-
-            // Mark barriered objects, and visitor can visit
-            // member GC objects of barriered objects.
-            obj->gc_ = GCFlag_Black;
-            obj->Accept(&barriered_maker);
+            marker.Trace(obj);
         }
+
+        MarkPermanentStored(marker);
+        marker.Propagate();
+        ClearWeakTables(marker);
     }
 
     void GC::MinorGCSweep()
@@ -299,118 +826,256 @@ namespace luna
             GCObject *obj = gen0_.gen_;
             gen0_.gen_ = gen0_.gen_->next_;
 
-            // Move object to GCGen1 generation when object is black
-            if (obj->gc_ == GCFlag_Black)
+            if (obj->generation_ == GCGenPermanent)
+            {
+                LinkObject(obj, permanent_);
+            }
+            // Move object to GCGen1 generation when object is black, or
+            // it is released from permanent generation
+            else if (obj->gc_ == GCFlag_Black || obj->generation_ != GCGen0)
             {
-                obj->gc_ = GCFlag_White;
+                if (obj->generation_ == GCGen0)
+                    CountPromoted(obj);
+                obj->gc_ = white_;
                 obj->generation_ = GCGen1;
-                obj->next_ = gen1_.gen_;
-                gen1_.gen_ = obj;
-                gen1_.count_++;
+                LinkObject(obj, gen1_);
             }
             else
             {
-                obj_deleter_(obj, obj->gc_obj_type_);
+                CountFreed(obj);
+                DeleteObject(obj);
             }
         }
 
         gen0_.count_ = 0;
+        HandOverDeadObjects();
     }
 
-    void GC::MajorGCMark()
+    void GC::StartMajorGC()
     {
         assert(major_traveller_);
+        assert(gray_.empty());
+
+        // Mark all major GC root objects to gray
+        major_state_ = MajorState_Propagate;
+        GCMarker marker(white_, false, gray_, weak_tables_);
+        RootMarkVisitor root_marker(marker);
+        major_traveller_(&root_marker);
+        MarkPermanentStored(marker);
 
-        // Visit all major GC root objects
-        MajorMarkVisitor marker;
-        major_traveller_(&marker);
+        MajorGCStep();
     }
 
-    void GC::MajorGCSweep()
+    void GC::MajorGCStep()
     {
-        // Sweep all generations
-        SweepGeneration(gen2_);
-        SweepGeneration(gen1_);
-        SweepGeneration(gen0_);
+        if (major_state_ == MajorState_Propagate)
+        {
+            if (PropagateMark(true))
+                AtomicMark();
+        }
+        else if (major_state_ == MajorState_Sweep)
+        {
+            if (SweepStep())
+                FinishMajorGC();
+        }
 
-        // Move all GCGen0 objects to GCGen1
-        while (gen0_.gen_)
+        step_bytes_ = memory_.alloc_bytes_ +
+            kMajorStepAllocBytes * 100 / config_.major_step_multiplier_;
+    }
+
+    bool GC::PropagateMark(bool limited)
+    {
+        GCMarker marker(white_, false, gray_, weak_tables_);
+        unsigned int work = 0;
+        while (!gray_.empty())
         {
-            GCObject *obj = gen0_.gen_;
-            gen0_.gen_ = gen0_.gen_->next_;
+            if (limited && IsStepOver(work))
+                return false;
 
-            obj->generation_ = GCGen1;
-            obj->next_ = gen1_.gen_;
-            gen1_.gen_ = obj;
+            // Big object takes more work
+            auto obj = gray_.back();
+            gray_.pop_back();
+            work += 1 + marker.Scan(obj);
         }
+        return true;
+    }
 
-        // Adjust GCGen0 threshold count
-        AdjustThreshold(gen0_.count_, gen0_, kGen0InitThresholdCount,
-                        kGen0MaxThresholdCount);
+    void GC::AtomicMark()
+    {
+        // Mark roots again, since storing values to roots(e.g. stack)
+        // has no barrier, then mark all gray objects
+        GCMarker marker(white_, false, gray_, weak_tables_);
+        RootMarkVisitor root_marker(marker);
+        major_traveller_(&root_marker);
+        MarkPermanentStored(marker);
+        gray_.insert(gray_.end(), gray_again_.begin(), gray_again_.end());
+        gray_again_.clear();
+        PropagateMark(false);
+        ClearWeakTables(marker);
 
-        gen1_.count_ += gen0_.count_;
-        gen0_.count_ = 0;
+        // All alive objects are black, flip the current white, then
+        // objects of the other white are dead
+        white_ = OtherWhite();
 
-        // Adjust GCGen1 threshold count
-        AdjustThreshold(gen1_.count_, gen1_, kGen1InitThresholdCount,
-                        kGen1MaxThresholdCount);
-        if (gen1_.count_ >= kGen1MaxThresholdCount)
-        {
-            gen1_.threshold_count_ = gen1_.count_ + kGen1MaxThresholdCount;
-        }
+        // Detach all generations for sweeping, new objects and alive
+        // objects after sweeping would be in new generation lists
+        sweep_gen0_ = gen0_.gen_;
+        sweep_gen1_ = gen1_.gen_;
+        sweep_gen2_ = gen2_.gen_;
+        gen0_.gen_ = gen1_.gen_ = gen2_.gen_ = nullptr;
+        gen0_.count_ = gen1_.count_ = gen2_.count_ = 0;
+        memory_.alloc_bytes_ = 0;
+
+        // All objects of GCGen0 would be moved to GCGen1, so there are
+        // no old objects pointing to young objects
+        ClearBarriered();
+
+        major_state_ = MajorState_Sweep;
     }
 
-    void GC::SweepGeneration(GenInfo &gen)
+    bool GC::SweepStep()
     {
-        GCObject *alived = nullptr;
+        unsigned int work = 0;
+
+        // Move alive objects of GCGen0 to GCGen1
+        bool done = SweepList(sweep_gen0_, gen1_, GCGen1, work) &&
+                    SweepList(sweep_gen1_, gen1_, GCGen1, work) &&
+                    SweepList(sweep_gen2_, gen2_, GCGen2, work);
+
+        HandOverDeadObjects();
+        return done;
+    }
 
-        while (gen.gen_)
+    bool GC::SweepList(GCObject *&list, GenInfo &gen,
+                       GCGeneration generation, unsigned int &work)
+    {
+        auto dead = OtherWhite();
+        while (list)
         {
-            GCObject *obj = gen.gen_;
-            gen.gen_ = obj->next_;
+            if (IsStepOver(work))
+                return false;
 
-            if (obj->gc_ == GCFlag_Black)
+            GCObject *obj = list;
+            list = obj->next_;
+            ++work;
+
+            if (obj->generation_ == GCGenPermanent)
+            {
+                LinkObject(obj, permanent_);
+            }
+            else if (obj->gc_ == dead)
             {
-                obj->gc_ = GCFlag_White;
-                obj->next_ = alived;
-                alived = obj;
+                CountFreed(obj);
+                DeleteObject(obj);
             }
             else
             {
-                obj_deleter_(obj, obj->gc_obj_type_);
-                gen.count_--;
+                if (obj->generation_ < generation)
+                    CountPromoted(obj);
+                obj->gc_ = white_;
+                obj->generation_ = generation;
+                LinkObject(obj, gen);
             }
         }
+        return true;
+    }
 
-        gen.gen_ = alived;
+    void GC::FinishMajorGC()
+    {
+        // Start the next major GC when bytes of all objects reach the
+        // pause percent of alive bytes
+        major_threshold_bytes_ = memory_.TotalBytes() / 100 * config_.major_pause_;
+        if (major_threshold_bytes_ < config_.major_min_threshold_bytes_)
+            major_threshold_bytes_ = config_.major_min_threshold_bytes_;
+
+        major_state_ = MajorState_Pause;
     }
 
-    void GC::AdjustThreshold(unsigned int alived_count, GenInfo &gen,
-                             unsigned int min_threshold,
-                             unsigned int max_threshold)
+    bool GC::IsStepOver(unsigned int work)
     {
-        if (alived_count != 0)
+        if (work >= config_.major_step_object_count_)
+            return true;
+
+        // Check time after some work, and do some work at least
+        if (config_.major_step_microseconds_ != 0 && work >= step_clock_work_)
         {
-            while (gen.threshold_count_ < 2 * alived_count)
-                gen.threshold_count_ *= 2;
-            while (gen.threshold_count_ >= 4 * alived_count)
-                gen.threshold_count_ /= 2;
+            step_clock_work_ = work + kMajorStepClockInterval;
+            return MicrosecondsSince(step_start_) >= config_.major_step_microseconds_;
         }
 
-        if (gen.threshold_count_ < min_threshold)
-            gen.threshold_count_ = min_threshold;
-        else if (gen.threshold_count_ > max_threshold)
-            gen.threshold_count_ = max_threshold;
+        return false;
     }
 
-    void GC::DestroyGeneration(GenInfo &gen)
+    void GC::AdjustGen0Threshold(std::size_t alived_bytes)
     {
-        while (gen.gen_)
+        auto &threshold = gen0_threshold_bytes_;
+        if (alived_bytes != 0)
         {
-            GCObject *obj = gen.gen_;
-            gen.gen_ = gen.gen_->next_;
-            obj_deleter_(obj, obj->gc_obj_type_);
+            while (threshold < config_.gen0_grow_factor_ * alived_bytes)
+                threshold *= 2;
+            while (threshold >= config_.gen0_shrink_factor_ * alived_bytes)
+                threshold /= 2;
         }
+
+        if (threshold < config_.gen0_init_threshold_bytes_)
+            threshold = config_.gen0_init_threshold_bytes_;
+        else if (threshold > config_.gen0_max_threshold_bytes_)
+            threshold = config_.gen0_max_threshold_bytes_;
+    }
+
+    void GC::DestroyGeneration(GenInfo &gen)
+    {
+        DestroyList(gen.gen_);
         gen.count_ = 0;
     }
+
+    void GC::MarkPermanentStored(GCMarker &marker)
+    {
+        for (auto obj : permanent_stored_)
+            marker.Trace(obj);
+    }
+
+    void GC::ClearWeakTables(GCMarker &marker)
+    {
+        // Values of weak keys which are marked may mark keys of other
+        // entries, trace weak keys tables again until nothing is marked
+        for (;;)
+        {
+            for (std::size_t i = 0, count = weak_tables_.size(); i < count; ++i)
+            {
+                auto t = weak_tables_[i];
+                if (t->GetWeakMode() == WeakMode_Key)
+                    t->TraceWeak(marker);
+            }
+
+            if (gray_.empty())
+                break;
+            marker.Propagate();
+        }
+
+        for (auto t : weak_tables_)
+            t->ClearWeak(marker);
+        weak_tables_.clear();
+    }
+
+    void GC::ClearBarriered()
+    {
+        // Permanent objects keep the flag, they are in permanent_stored_
+        for (auto obj : barriered_)
+        {
+            if (obj->generation_ != GCGenPermanent)
+                obj->in_barriered_ = 0;
+        }
+        barriered_.clear();
+    }
+
+    void GC::DestroyList(GCObject *&list)
+    {
+        while (list)
+        {
+            GCObject *obj = list;
+            list = list->next_;
+            DeleteObject(obj);
+        }
+    }
 } // namespace luna
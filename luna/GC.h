@@ -1,9 +1,15 @@
 #ifndef GC_OBJECT_H
 #define GC_OBJECT_H
 
+#include "Arena.h"
+#include "Sweeper.h"
+#include <atomic>
+#include <chrono>
 #include <functional>
 #include <deque>
+#include <vector>
 #include <fstream>
+#include <new>
 
 namespace luna
 {
@@ -13,12 +19,17 @@ namespace luna
         GCGen0,         // Youngest generation
         GCGen1,         // Mesozoic generation
         GCGen2,         // Oldest generation
+        GCGenPermanent, // Permanent objects, which are never collected
     };
 
-    // GC flag for mark GC object
+    // GC flag for mark GC object, there are two whites, major GC flips
+    // the current white after marking, then objects which are the other
+    // white are dead until they are swept.
     enum GCFlag
     {
-        GCFlag_White,
+        GCFlag_White0,
+        GCFlag_White1,
+        GCFlag_Gray,
         GCFlag_Black,
     };
 
@@ -33,12 +44,228 @@ namespace luna
         GCObjectType_UserData,
     };
 
+    // Kind of GC work which is run at once
+    enum GCKind
+    {
+        GCKind_Minor,           // Minor GC
+        GCKind_MajorStart,      // Mark roots and run the first step of major GC
+        GCKind_MajorPropagate,  // One marking step of major GC
+        GCKind_MajorSweep,      // One sweeping step of major GC
+        GCKind_Full,            // Full major GC without step budget
+        GCKind_Count,
+    };
+
+    // Get name of 'kind', e.g. "minor"
+    const char * GetGCKindName(GCKind kind);
+
+    // Get name of GCObjectType 'type', e.g. "table"
+    const char * GetGCObjectTypeName(unsigned int type);
+
+    // Count of generations which are collected
+    const std::size_t kGCGenCount = GCGenPermanent;
+
+    // Statistics of one GC run. Bytes of objects are the sizes of GC
+    // objects themselves, total bytes include memory owned by them, which
+    // may be freed later by background sweeper.
+    struct GCRunStats
+    {
+        GCKind kind_;
+        // Pause of the run
+        unsigned int microseconds_;
+        // Bytes of all GC objects before and after the run
+        std::size_t total_bytes_before_;
+        std::size_t total_bytes_after_;
+        // Objects freed in the run, indexed by their generation
+        std::size_t freed_objects_[kGCGenCount];
+        std::size_t freed_bytes_[kGCGenCount];
+        // Objects promoted from GCGen0 to GCGen1 in the run
+        std::size_t promoted_objects_;
+        std::size_t promoted_bytes_;
+        // Count of barriered old objects before the run
+        std::size_t barriered_count_;
+        // Thresholds of minor GC and major GC before and after the run
+        std::size_t gen0_threshold_before_;
+        std::size_t gen0_threshold_after_;
+        std::size_t major_threshold_before_;
+        std::size_t major_threshold_after_;
+        // Count of objects of each generation after the run
+        std::size_t gen_objects_[kGCGenCount];
+    };
+
+    // Statistics of all GC runs, indexed by GCKind
+    struct GCStats
+    {
+        std::size_t runs_[GCKind_Count];
+        unsigned long long microseconds_[GCKind_Count];
+        unsigned int max_microseconds_[GCKind_Count];
+        // Objects freed, indexed by their generation
+        unsigned long long freed_objects_[kGCGenCount];
+        unsigned long long freed_bytes_[kGCGenCount];
+        unsigned long long promoted_objects_;
+        unsigned long long promoted_bytes_;
+    };
+
+    // Count and bytes of GC objects, indexed by GCObjectType, bytes are
+    // the sizes of GC objects without memory owned by them
+    struct GCObjectCounts
+    {
+        static const std::size_t kTypeCount = GCObjectType_UserData + 1;
+
+        std::size_t count_[kTypeCount];
+        std::size_t bytes_[kTypeCount];
+
+        GCObjectCounts();
+
+        std::size_t TotalCount() const;
+        std::size_t TotalBytes() const;
+    };
+
+    // Configuration of GC, default values fit general scripts. Larger
+    // thresholds and step budget favor throughput, smaller ones favor
+    // short pauses.
+    struct GCConfig
+    {
+        // Bytes of new objects to run minor GC, the threshold adapts to
+        // alive bytes of new objects within [init, max]
+        std::size_t gen0_init_threshold_bytes_;
+        std::size_t gen0_max_threshold_bytes_;
+        // Threshold of minor GC doubles when it is less than 'grow' times
+        // of alive bytes of new objects, and halves when it is not less
+        // than 'shrink' times, 'shrink' is 2 times of 'grow' at least
+        unsigned int gen0_grow_factor_;
+        unsigned int gen0_shrink_factor_;
+        // Min bytes of all objects to start major GC
+        std::size_t major_min_threshold_bytes_;
+        // Major GC starts when bytes of all objects reach 'pause' percent
+        // of alive bytes after the last major GC
+        unsigned int major_pause_;
+        // Speed of major GC relative to allocation in percent
+        unsigned int major_step_multiplier_;
+        // Budget of one step of major GC, 0 microseconds is unlimited
+        unsigned int major_step_object_count_;
+        unsigned int major_step_microseconds_;
+        // Hard limit of bytes of all GC objects, 0 is unlimited
+        std::size_t heap_limit_bytes_;
+        // Destroy dead objects in a background sweeper thread
+        bool background_sweep_;
+
+        GCConfig();
+    };
+
     class Table;
     class Function;
     class Closure;
     class Upvalue;
     class String;
     class UserData;
+    class GCMarker;
+    class ShapeTree;
+
+    // Memory usage of GC objects, includes the memory of GC objects and
+    // the memory owned by GC objects. Memory is allocated by the owner
+    // thread, and may be freed by the background sweeper thread.
+    struct GCMemory
+    {
+        // Bytes allocated and freed of all GC objects
+        std::size_t allocated_bytes_;
+        std::atomic<std::size_t> freed_bytes_;
+        // Bytes allocated since the last minor GC
+        std::size_t alloc_bytes_;
+        // Max bytes of all GC objects ever reached
+        std::size_t peak_bytes_;
+        // Hard limit of bytes of all GC objects, 0 is unlimited
+        std::size_t limit_bytes_;
+        // Allocator of memory owned by GC objects
+        Allocator *allocator_;
+
+        GCMemory()
+            : allocated_bytes_(0), freed_bytes_(0), alloc_bytes_(0),
+              peak_bytes_(0), limit_bytes_(0),
+              allocator_(Allocator::GetDefault()) { }
+
+        // Bytes of all GC objects
+        std::size_t TotalBytes() const
+        { return allocated_bytes_ - freed_bytes_.load(std::memory_order_relaxed); }
+
+        // Account 'bytes' allocated, throw MemoryException before it when
+        // the bytes exceed the hard limit
+        void Alloc(std::size_t bytes)
+        {
+            if (limit_bytes_ != 0)
+                CheckLimit(bytes);
+            allocated_bytes_ += bytes;
+            alloc_bytes_ += bytes;
+            auto total = TotalBytes();
+            if (total > peak_bytes_)
+                peak_bytes_ = total;
+        }
+
+        void Free(std::size_t bytes)
+        { freed_bytes_.fetch_add(bytes, std::memory_order_relaxed); }
+
+        // Alloc and account memory owned by GC objects
+        void * AllocMemory(std::size_t bytes)
+        {
+            Alloc(bytes);
+            try
+            {
+                return allocator_->Alloc(bytes);
+            } catch (...)
+            {
+                Free(bytes);
+                throw;
+            }
+        }
+
+        void FreeMemory(void *ptr, std::size_t bytes)
+        {
+            Free(bytes);
+            allocator_->Free(ptr, bytes);
+        }
+
+        // Throw MemoryException when allocating 'bytes' more exceeds the
+        // hard limit
+        void CheckLimit(std::size_t bytes) const;
+    };
+
+    // STL allocator for memory owned by GC objects, which allocates and
+    // accounts the memory by GCMemory when it is not null.
+    template<typename T>
+    class GCAllocator
+    {
+    public:
+        typedef T value_type;
+
+        explicit GCAllocator(GCMemory *memory = nullptr) : memory_(memory) { }
+
+        template<typename U>
+        GCAllocator(const GCAllocator<U> &other) : memory_(other.memory_) { }
+
+        T * allocate(std::size_t n)
+        {
+            if (memory_)
+                return static_cast<T *>(memory_->AllocMemory(n * sizeof(T)));
+            return static_cast<T *>(::operator new(n * sizeof(T)));
+        }
+
+        void deallocate(T *p, std::size_t n)
+        {
+            if (memory_)
+                memory_->FreeMemory(p, n * sizeof(T));
+            else
+                ::operator delete(p);
+        }
+
+        GCMemory *memory_;
+    };
+
+    template<typename T, typename U>
+    inline bool operator == (const GCAllocator<T> &l, const GCAllocator<U> &r)
+    { return l.memory_ == r.memory_; }
+
+    template<typename T, typename U>
+    inline bool operator != (const GCAllocator<T> &l, const GCAllocator<U> &r)
+    { return l.memory_ != r.memory_; }
 
     // Visitor for visit all GC objects
     class GCObjectVisitor
@@ -53,15 +280,42 @@ namespace luna
         virtual bool Visit(UserData *) = 0;
     };
 
+    // Mark visited objects by 'marker' of GC, members of visited objects
+    // are not visited, they are traced by the marker
+    template<typename Marker>
+    class MarkVisitor : public GCObjectVisitor
+    {
+    public:
+        explicit MarkVisitor(Marker &marker) : marker_(marker) { }
+
+        virtual bool Visit(Table *t) { return VisitObj(t); }
+        virtual bool Visit(Function *f) { return VisitObj(f); }
+        virtual bool Visit(Closure *c) { return VisitObj(c); }
+        virtual bool Visit(Upvalue *u) { return VisitObj(u); }
+        virtual bool Visit(String *s) { return VisitObj(s); }
+        virtual bool Visit(UserData *u) { return VisitObj(u); }
+
+    private:
+        template<typename T>
+        bool VisitObj(T *obj)
+        {
+            marker_.MarkObject(obj);
+            return false;
+        }
+
+        Marker &marker_;
+    };
+
     // Base class of GC objects, GC use this class to manipulate
     // all GC objects
     class GCObject
     {
         friend class GC;
-        friend class MinorMarkVisitor;
-        friend class BarrieredMarkVisitor;
-        friend class MajorMarkVisitor;
+        friend class GCMarker;
+        friend class PermanentMarker;
+        friend class ReachableCounter;
         friend bool CheckBarrier(GCObject *);
+        friend bool CheckBarrier(GCObject *, GCObject *);
     public:
         GCObject();
         virtual ~GCObject() = 0;
@@ -77,10 +331,24 @@ namespace luna
         unsigned int gc_ : 2;
         // GCObjectType
         unsigned int gc_obj_type_ : 4;
+        // Whether object is in barriered list of GC
+        unsigned int in_barriered_ : 1;
     };
 
-    // GC object barrier checker
-    inline bool CheckBarrier(GCObject *obj) { return obj->generation_ != GCGen0; }
+    // GC object barrier checker, old objects need barrier for minor GC,
+    // and black objects need barrier for incremental marking of major GC.
+    inline bool CheckBarrier(GCObject *obj)
+    { return obj->generation_ != GCGen0 || obj->gc_ == GCFlag_Black; }
+
+    // Check barrier when 'value' is stored into 'obj', only old object
+    // which is pointing to young object needs barrier for minor GC.
+    // Permanent objects are black, so they are always barriered.
+    inline bool CheckBarrier(GCObject *obj, GCObject *value)
+    {
+        return (obj->generation_ != GCGen0 && value->generation_ == GCGen0) ||
+               obj->gc_ == GCFlag_Black;
+    }
+
     #define CHECK_BARRIER(gc, obj) \
         do { if (luna::CheckBarrier(obj)) gc.SetBarrier(obj); } while (0)
 
@@ -88,21 +356,22 @@ namespace luna
     {
     public:
         typedef std::function<void (GCObjectVisitor *)> RootTravelType;
+        // Deleter is called before GC object is destroyed, GC object is
+        // destroyed and freed to arena by GC itself
         typedef std::function<void (GCObject *, unsigned int)> GCObjectDeleter;
+        // Callback is called after each GC run, it must not run GC
+        typedef std::function<void (const GCRunStats &)> GCCallback;
 
-        struct DefaultDeleter
-        {
-            inline void operator () (GCObject *obj, unsigned int) const
-            { delete obj; }
-        };
-
-        explicit GC(const GCObjectDeleter &obj_deleter = DefaultDeleter(), bool log = false);
+        // All memory of GC heap is from 'allocator', the default allocator
+        // when it is nullptr
+        explicit GC(const GCObjectDeleter &obj_deleter = GCObjectDeleter(), bool log = false,
+                    Allocator *allocator = nullptr);
         ~GC();
 
         GC(const GC&) = delete;
         void operator = (const GC&) = delete;
 
-        void ResetDeleter(const GCObjectDeleter &obj_deleter = DefaultDeleter())
+        void ResetDeleter(const GCObjectDeleter &obj_deleter = GCObjectDeleter())
         { obj_deleter_ = obj_deleter; }
 
         // Set minor and major root travel functions
@@ -119,9 +388,113 @@ namespace luna
         // Set GC object barrier
         void SetBarrier(GCObject *obj);
 
+        // Make 'obj' alive again when it is dead but not swept yet, e.g.
+        // string which is got from string pool when major GC is sweeping.
+        void Resurrect(GCObject *obj)
+        { if (obj->gc_ == OtherWhite()) obj->gc_ = white_; }
+
+        // Set work budget of each step of major GC, major GC sweeps
+        // 'object_count' GC objects or visits 'object_count' members of
+        // GC objects at most in one step, and one step takes
+        // 'microseconds' at most when it is not 0.
+        void SetMajorStepBudget(unsigned int object_count,
+                                unsigned int microseconds);
+
+        // Major GC starts when bytes of all GC objects reach 'percent'
+        // of alive bytes after the last major GC.
+        void SetMajorPause(unsigned int percent);
+
+        // Set speed of major GC relative to allocation in percent, major
+        // GC runs one step after less new bytes when it is greater.
+        void SetMajorStepMultiplier(unsigned int percent);
+
+        // Set hard limit of bytes of all GC objects, 0 is unlimited.
+        // Allocation which exceeds the limit throws MemoryException. When
+        // the heap is near the limit, GC check runs a full major GC, and
+        // throws MemoryException when the heap is still near the limit,
+        // the rest of the limit is headroom for allocations before the
+        // next GC check.
+        void SetHeapLimit(std::size_t bytes)
+        {
+            config_.heap_limit_bytes_ = bytes;
+            memory_.limit_bytes_ = bytes;
+        }
+
+        // Throw MemoryException when allocating 'bytes' more exceeds the
+        // heap limit, check big allocation before preparing it
+        void CheckHeapLimit(std::size_t bytes) const
+        {
+            if (memory_.limit_bytes_ != 0)
+                memory_.CheckLimit(bytes);
+        }
+
+        // Set all configuration, values out of range are adjusted
+        void SetConfig(const GCConfig &config);
+
+        const GCConfig & GetConfig() const
+        { return config_; }
+
+        // Get bytes of all GC objects
+        std::size_t GetTotalBytes() const
+        { return memory_.TotalBytes(); }
+
+        // Get max bytes of all GC objects ever reached
+        std::size_t GetPeakBytes() const
+        { return memory_.peak_bytes_; }
+
+        // Destroy dead objects in a background sweeper thread or not,
+        // UserData objects are always destroyed in the owner thread.
+        void SetBackgroundSweep(bool enable);
+
+        // Run a full major GC without step budget
+        void FullGC();
+
+        // Run one step of GC work regardless of thresholds, which is a
+        // minor GC, or a step of major GC when it is due or running.
+        // Return true when no major GC is running after the step.
+        bool Step();
+
+        // Stop and restart automatic GC run by CheckGC, heap limit is
+        // still checked when GC is stopped
+        void Stop() { stopped_ = true; }
+        void Restart() { stopped_ = false; }
+
+        bool IsStopped() const
+        { return stopped_; }
+
+        // Move 'obj' and all objects referenced by it to permanent
+        // generation, permanent objects are not marked or swept by GC.
+        // Objects stored into permanent objects later are marked
+        // through them.
+        void SetPermanent(GCObject *obj);
+
+        // Release 'obj' from permanent generation, then it could be
+        // collected. Objects moved to permanent generation together
+        // with 'obj' are still permanent, and 'obj' must not be
+        // referenced by other permanent objects.
+        void ReleasePermanent(GCObject *obj);
+
         // Check run GC
         void CheckGC();
 
+        // Set callback which is called after each GC run
+        void SetCallback(const GCCallback &callback)
+        { callback_ = callback; }
+
+        // Get statistics of all GC runs and the last GC run
+        const GCStats & GetStats() const
+        { return stats_; }
+
+        const GCRunStats & GetLastRunStats() const
+        { return run_; }
+
+        // Count all objects, objects which are dead but not swept yet
+        // are included when major GC is sweeping
+        void CountObjects(GCObjectCounts &counts) const;
+
+        // Count objects reachable from 'root', 'root' included
+        void CountReachable(GCObject *root, GCObjectCounts &counts) const;
+
     private:
         struct GenInfo
         {
@@ -129,38 +502,112 @@ namespace luna
             GCObject *gen_;
             // Count of GC objects
             unsigned int count_;
-            // Current threshold count of GC objects
-            unsigned int threshold_count_;
 
-            GenInfo() : gen_(nullptr), count_(0), threshold_count_(0) { }
+            GenInfo() : gen_(nullptr), count_(0) { }
+        };
+
+        // States of major GC, major GC runs step by step incrementally
+        enum MajorState
+        {
+            MajorState_Pause,       // Major GC is not running
+            MajorState_Propagate,   // Marking gray objects
+            MajorState_Sweep,       // Sweeping dead objects
         };
 
+        unsigned int OtherWhite() const { return white_ ^ 1; }
+
         void SetObjectGen(GCObject *obj, GCGeneration gen);
 
-        // Run minor and major GC
+        // Start and finish statistics of GC run of 'kind'
+        void BeginRun(GCKind kind);
+        void EndRun();
+
+        // Count 'obj' which is freed or promoted into statistics of run
+        void CountFreed(GCObject *obj);
+        void CountPromoted(GCObject *obj);
+
+        // Run minor GC
         void MinorGC();
-        void MajorGC();
 
         void MinorGCMark();
         void MinorGCSweep();
 
-        void MajorGCMark();
-        void MajorGCSweep();
+        // Start major GC, and run one step of major GC
+        void StartMajorGC();
+        void MajorGCStep();
+
+        // Mark gray objects until there is no gray object, return false
+        // when step budget is over before that if 'limited' is true.
+        bool PropagateMark(bool limited);
+
+        // Finish marking in one step, and prepare for sweeping
+        void AtomicMark();
 
-        void SweepGeneration(GenInfo &gen);
+        // Sweep dead objects, return false when step budget is over
+        // before all objects are swept.
+        bool SweepStep();
 
-        // Adjust GenInfo's threshold_count_ by alived_count
-        void AdjustThreshold(unsigned int alived_count, GenInfo &gen,
-                             unsigned int min_threshold,
-                             unsigned int max_threshold);
+        // Sweep objects in 'list' and move alive objects to 'gen',
+        // return false when step budget is over before list is empty.
+        bool SweepList(GCObject *&list, GenInfo &gen,
+                       GCGeneration generation, unsigned int &work);
+
+        // Adjust threshold of major GC, and pause major GC
+        void FinishMajorGC();
+
+        // Return true when the 'work' of current step is over budget
+        bool IsStepOver(unsigned int work);
+
+        // Adjust threshold of minor GC by alived bytes of new objects
+        void AdjustGen0Threshold(std::size_t alived_bytes);
 
         // Delete generation all objects
         void DestroyGeneration(GenInfo &gen);
 
-        static const unsigned int kGen0InitThresholdCount = 512;
-        static const unsigned int kGen1InitThresholdCount = 512;
-        static const unsigned int kGen0MaxThresholdCount = 2048;
-        static const unsigned int kGen1MaxThresholdCount = 102400;
+        // Delete all objects of list
+        void DestroyList(GCObject *&list);
+
+        // Alloc GC object from arena
+        template<typename T, typename... Args>
+        T * NewObject(GCObjectType type, GCGeneration gen, Args&&... args);
+
+        // Destroy GC object and free it to arena, or hand it over to
+        // background sweeper
+        void DeleteObject(GCObject *obj);
+
+        // Free memory of objects destroyed by background sweeper to arena,
+        // and hand over dead objects to background sweeper
+        void HandOverDeadObjects();
+
+        // Destroy all dead objects and stop background sweeper
+        void StopSweeper();
+
+        // Clear barriered objects
+        void ClearBarriered();
+
+        // Mark members of permanent objects which have been stored
+        void MarkPermanentStored(GCMarker &marker);
+
+        // Mark values of alive weak keys until nothing is marked, then
+        // remove dead entries of weak tables traced by 'marker'
+        void ClearWeakTables(GCMarker &marker);
+
+        // Link object into generation list
+        static void LinkObject(GCObject *obj, GenInfo &gen)
+        {
+            obj->next_ = gen.gen_;
+            gen.gen_ = obj;
+            gen.count_++;
+        }
+
+        // Bytes of new objects between two steps of major GC when step
+        // multiplier is 100
+        static const std::size_t kMajorStepAllocBytes = 32 * 1024;
+        // Check time of the step after each count of work
+        static const unsigned int kMajorStepClockInterval = 256;
+        // GC check runs full major GC when heap reaches (1 - 1/8) of the
+        // limit, 1/8 of the limit is headroom
+        static const std::size_t kHeapLimitHeadroom = 8;
 
         // Youngest generation
         GenInfo gen0_;
@@ -168,6 +615,8 @@ namespace luna
         GenInfo gen1_;
         // Oldest generation
         GenInfo gen2_;
+        // Permanent generation
+        GenInfo permanent_;
 
         // Minor root traveller
         RootTravelType minor_traveller_;
@@ -176,9 +625,57 @@ namespace luna
 
         // Barriered GC objects
         std::deque<GCObject *> barriered_;
+        // Permanent objects which have been stored, they are never
+        // removed until released
+        std::vector<GCObject *> permanent_stored_;
+
+        // Current white
+        unsigned int white_;
+        // Current state of major GC
+        MajorState major_state_;
+        // Gray objects of major GC
+        std::vector<GCObject *> gray_;
+        // Barriered black objects which are gray again when marking
+        std::vector<GCObject *> gray_again_;
+        // Weak tables traced by marking, cleared after marking
+        std::vector<Table *> weak_tables_;
+        // Objects of generations which are not swept by major GC yet
+        GCObject *sweep_gen0_;
+        GCObject *sweep_gen1_;
+        GCObject *sweep_gen2_;
+        // New bytes to run the next step of major GC
+        std::size_t step_bytes_;
+        // Start time of current step
+        std::chrono::steady_clock::time_point step_start_;
+        // Check time of current step when work reaches this count
+        unsigned int step_clock_work_;
+
+        // Memory usage of all GC objects
+        GCMemory memory_;
+        // Configuration of GC, thresholds below are initialized by it
+        GCConfig config_;
+        // New bytes to run minor GC
+        std::size_t gen0_threshold_bytes_;
+        // Bytes of all GC objects to start major GC
+        std::size_t major_threshold_bytes_;
+        // Automatic GC is stopped
+        bool stopped_;
 
         // GC object Deleter
         GCObjectDeleter obj_deleter_;
+        // Memory of all GC objects
+        Arena arena_;
+        // Shapes of record-like tables
+        std::unique_ptr<ShapeTree> shapes_;
+        // Background sweeper and objects handed over to it
+        std::unique_ptr<Sweeper> sweeper_;
+        std::vector<DeadObject> dead_objects_;
+        std::vector<DeadObject> destroyed_objects_;
+        // Statistics of all GC runs and the current or last GC run
+        GCStats stats_;
+        GCRunStats run_;
+        // Callback after each GC run
+        GCCallback callback_;
         // Log file
         std::ofstream log_stream_;
     };
@@ -0,0 +1,174 @@
+#include "Host.h"
+#include "State.h"
+#include "String.h"
+#include <algorithm>
+#include <assert.h>
+
+namespace luna
+{
+    SharedStringTable::SharedStringTable(const std::vector<std::string> &strings)
+        : strings_(strings)
+    {
+    }
+
+    void SharedStringTable::Intern(State *state) const
+    {
+        for (const auto &str : strings_)
+            state->GetGC().SetPermanent(state->GetInternedString(str));
+    }
+
+    Host::Host(unsigned int thread_count, Initializer init,
+               const std::vector<std::string> &shared_strings)
+        : init_(init),
+          shared_strings_(shared_strings),
+          next_worker_(0),
+          queued_(0),
+          unfinished_(0),
+          failed_(0),
+          stop_(false)
+    {
+        if (thread_count == 0)
+            thread_count = std::max(std::thread::hardware_concurrency(), 1u);
+
+        for (unsigned int i = 0; i < thread_count; ++i)
+            workers_.push_back(std::unique_ptr<Worker>(new Worker));
+
+        // Start threads after all queues are ready for stealing
+        for (std::size_t i = 0; i < workers_.size(); ++i)
+            workers_[i]->thread_ = std::thread(&Host::Run, this, i);
+    }
+
+    Host::~Host()
+    {
+        Join();
+    }
+
+    void Host::Submit(Job job)
+    {
+        auto index = next_worker_++ % workers_.size();
+        auto &worker = *workers_[index];
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            assert(!stop_);
+            {
+                std::lock_guard<std::mutex> worker_lock(worker.mutex_);
+                worker.jobs_.push_back(std::move(job));
+            }
+            ++queued_;
+            ++unfinished_;
+        }
+
+        job_cond_.notify_one();
+    }
+
+    std::size_t Host::Wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_cond_.wait(lock, [this] { return unfinished_ == 0; });
+
+        auto failed = failed_;
+        failed_ = 0;
+        return failed;
+    }
+
+    void Host::Join()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (stop_)
+                return ;
+            stop_ = true;
+        }
+
+        job_cond_.notify_all();
+        for (auto &worker : workers_)
+            worker->thread_.join();
+    }
+
+    void Host::Run(std::size_t index)
+    {
+        auto state = NewState();
+        for (;;)
+        {
+            Job job;
+            if (TakeJob(index, job))
+            {
+                bool failed = false;
+                try
+                {
+                    job(state.get());
+                }
+                catch (...)
+                {
+                    failed = true;
+                }
+
+                // Stack and calls of state are broken by exception
+                if (failed)
+                    state = NewState();
+
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (failed)
+                    ++failed_;
+                if (--unfinished_ == 0)
+                    done_cond_.notify_all();
+                continue;
+            }
+
+            // Stop after all jobs are taken
+            std::unique_lock<std::mutex> lock(mutex_);
+            job_cond_.wait(lock, [this] { return stop_ || queued_ > 0; });
+            if (queued_ == 0)
+                return ;
+        }
+    }
+
+    bool Host::TakeJob(std::size_t index, Job &job)
+    {
+        if (!PopJob(index, job) && !StealJob(index, job))
+            return false;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        --queued_;
+        return true;
+    }
+
+    bool Host::PopJob(std::size_t index, Job &job)
+    {
+        auto &worker = *workers_[index];
+        std::lock_guard<std::mutex> lock(worker.mutex_);
+        if (worker.jobs_.empty())
+            return false;
+
+        job = std::move(worker.jobs_.back());
+        worker.jobs_.pop_back();
+        return true;
+    }
+
+    bool Host::StealJob(std::size_t index, Job &job)
+    {
+        // Steal from the worker next to 'index' first
+        for (std::size_t i = 1; i < workers_.size(); ++i)
+        {
+            auto &victim = *workers_[(index + i) % workers_.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex_);
+            if (victim.jobs_.empty())
+                continue;
+
+            job = std::move(victim.jobs_.front());
+            victim.jobs_.pop_front();
+            return true;
+        }
+        return false;
+    }
+
+    std::unique_ptr<State> Host::NewState() const
+    {
+        std::unique_ptr<State> state(new State);
+        shared_strings_.Intern(state.get());
+        if (init_)
+            init_(state.get());
+        return state;
+    }
+} // namespace luna
@@ -0,0 +1,116 @@
+#ifndef HOST_H
+#define HOST_H
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <string>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+
+namespace luna
+{
+    class State;
+
+    // Frozen table of strings shared by all states of host, it is never
+    // changed after construction, so worker threads read it without lock.
+    // Strings are interned into each state as permanent strings, since
+    // GC marks strings in place, one String object can not be shared by
+    // states on different threads.
+    class SharedStringTable
+    {
+    public:
+        explicit SharedStringTable(const std::vector<std::string> &strings);
+
+        SharedStringTable(const SharedStringTable&) = delete;
+        void operator = (const SharedStringTable&) = delete;
+
+        // Intern all strings into 'state' as permanent strings
+        void Intern(State *state) const;
+
+        std::size_t GetCount() const
+        { return strings_.size(); }
+
+    private:
+        const std::vector<std::string> strings_;
+    };
+
+    // Host runs script jobs on a pool of worker threads, each worker
+    // thread owns its State, so VM never locks. Jobs are submitted to
+    // queues of workers in turn, idle workers steal jobs from others.
+    class Host
+    {
+    public:
+        // Job runs on the state of worker thread which takes it, globals
+        // set by job are seen by later jobs on the same state
+        typedef std::function<void (State *)> Job;
+        // Initializer runs once on each new state, e.g. register libs
+        typedef std::function<void (State *)> Initializer;
+
+        // 0 'thread_count' means count of cores
+        Host(unsigned int thread_count, Initializer init,
+             const std::vector<std::string> &shared_strings =
+                std::vector<std::string>());
+        ~Host();
+
+        Host(const Host&) = delete;
+        void operator = (const Host&) = delete;
+
+        // Submit job to host, it is thread safe
+        void Submit(Job job);
+
+        // Wait all submitted jobs done, return count of jobs which threw
+        // exception since last Wait
+        std::size_t Wait();
+
+        // Finish all submitted jobs, and stop all worker threads
+        void Join();
+
+        std::size_t GetThreadCount() const
+        { return workers_.size(); }
+
+    private:
+        // Jobs of a worker, the owner pops from back, thieves steal
+        // from front
+        struct Worker
+        {
+            std::mutex mutex_;
+            std::deque<Job> jobs_;
+            std::thread thread_;
+        };
+
+        void Run(std::size_t index);
+
+        // Take job from queue of worker 'index', or steal from others
+        bool TakeJob(std::size_t index, Job &job);
+        bool PopJob(std::size_t index, Job &job);
+        bool StealJob(std::size_t index, Job &job);
+
+        // New state of worker thread
+        std::unique_ptr<State> NewState() const;
+
+        std::vector<std::unique_ptr<Worker>> workers_;
+        Initializer init_;
+        const SharedStringTable shared_strings_;
+
+        // Index of worker which next job is submitted to
+        std::atomic<std::size_t> next_worker_;
+
+        std::mutex mutex_;
+        // Workers wait for jobs and Wait waits all jobs done
+        std::condition_variable job_cond_;
+        std::condition_variable done_cond_;
+        // Count of jobs in queues
+        std::size_t queued_;
+        // Count of jobs submitted but not done
+        std::size_t unfinished_;
+        // Count of jobs threw exception
+        std::size_t failed_;
+        bool stop_;
+    };
+} // namespace luna
+
+#endif // HOST_H
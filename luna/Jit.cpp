@@ -0,0 +1,1119 @@
+#include "Jit.h"
+
+#ifdef LUNA_JIT
+#include "VM.h"
+#include "Function.h"
+#include "Upvalue.h"
+#include "Table.h"
+#include <map>
+#include <exception>
+#include <assert.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+namespace
+{
+    using luna::Value;
+
+    const int kValueSize = sizeof(Value);
+    const int kNumOffset = offsetof(Value, num_);
+    const int kTypeOffset = offsetof(Value, type_);
+    static_assert(sizeof(luna::ValueT) == 4, "type of Value is 32 bits");
+
+    // Entry of instruction which is the operand of previous instruction
+    const unsigned int kNoEntry = ~0u;
+
+    enum Reg
+    {
+        RAX = 0, RCX = 1, RDX = 2, RBX = 3, RBP = 5, RSI = 6, RDI = 7,
+        R8 = 8, R9 = 9, R12 = 12, R13 = 13, R14 = 14,
+    };
+
+    enum XmmReg
+    {
+        XMM0 = 0, XMM1 = 1,
+    };
+
+    enum Cond
+    {
+        Cond_B = 0x2, Cond_AE = 0x3, Cond_E = 0x4, Cond_NE = 0x5,
+        Cond_BE = 0x6, Cond_A = 0x7, Cond_S = 0x8, Cond_NP = 0xB,
+    };
+
+    // Value operand of instruction in memory, register of frame or const
+    struct Operand
+    {
+        Reg base_;
+        int disp_;
+
+        int Num() const { return disp_ + kNumOffset; }
+        int Type() const { return disp_ + kTypeOffset; }
+    };
+
+    // Encoder of the few x86-64 instructions used by templates, memory
+    // operands are always [base + disp32]
+    class Assembler
+    {
+    public:
+        int NewLabel()
+        {
+            labels_.push_back(-1);
+            return static_cast<int>(labels_.size() - 1);
+        }
+
+        void Bind(int label)
+        {
+            labels_[label] = static_cast<int>(code_.size());
+        }
+
+        unsigned int Offset() const
+        {
+            return static_cast<unsigned int>(code_.size());
+        }
+
+        // Resolve jumps to labels, return false when a label is unbound
+        bool Finish()
+        {
+            for (const auto &fixup : fixups_)
+            {
+                auto target = labels_[fixup.second];
+                if (target < 0)
+                    return false;
+                int32_t rel = target - static_cast<int32_t>(fixup.first + 4);
+                memcpy(&code_[fixup.first], &rel, sizeof(rel));
+            }
+            return true;
+        }
+
+        const std::vector<unsigned char> & GetCode() const { return code_; }
+
+        void Push(Reg r) { Rex(false, 0, r); Byte(0x50 | (r & 7)); }
+        void Pop(Reg r) { Rex(false, 0, r); Byte(0x58 | (r & 7)); }
+        void Ret() { Byte(0xC3); }
+        void CallRax() { Byte(0xFF); Byte(0xD0); }
+        void JmpRsi() { Byte(0xFF); Byte(0xE6); }
+
+        void MovRegReg(Reg dst, Reg src)
+        { Rex(true, src, dst); Byte(0x89); RegReg(src, dst); }
+
+        void MovRegMem(Reg dst, Reg base, int disp)
+        { Rex(true, dst, base); Byte(0x8B); Mem(dst, base, disp); }
+
+        void MovMemReg(Reg base, int disp, Reg src)
+        { Rex(true, src, base); Byte(0x89); Mem(src, base, disp); }
+
+        void MovRegImm64(Reg r, uint64_t imm)
+        { Rex(true, 0, r); Byte(0xB8 | (r & 7)); Int64(imm); }
+
+        void MovRegImm32(Reg r, uint32_t imm)
+        { Rex(false, 0, r); Byte(0xB8 | (r & 7)); Int32(imm); }
+
+        void MovPtr(Reg r, const void *ptr)
+        { MovRegImm64(r, reinterpret_cast<uintptr_t>(ptr)); }
+
+        void MovMem32Imm(Reg base, int disp, uint32_t imm)
+        { Rex(false, 0, base); Byte(0xC7); Mem(0, base, disp); Int32(imm); }
+
+        void MovMem64Imm(Reg base, int disp, int32_t imm)
+        { Rex(true, 0, base); Byte(0xC7); Mem(0, base, disp); Int32(imm); }
+
+        void LeaRegMem(Reg dst, Reg base, int disp)
+        { Rex(true, dst, base); Byte(0x8D); Mem(dst, base, disp); }
+
+        void CmpMem32Imm8(Reg base, int disp, int8_t imm)
+        { Rex(false, 0, base); Byte(0x83); Mem(7, base, disp); Byte(imm); }
+
+        void CmpMem8Imm8(Reg base, int disp, int8_t imm)
+        { Rex(false, 0, base); Byte(0x80); Mem(7, base, disp); Byte(imm); }
+
+        void XorMem8Imm8(Reg base, int disp, uint8_t imm)
+        { Rex(false, 0, base); Byte(0x80); Mem(6, base, disp); Byte(imm); }
+
+        void CmpEaxImm32(uint32_t imm) { Byte(0x3D); Int32(imm); }
+        void TestEaxEax() { Byte(0x85); Byte(0xC0); }
+        void TestAlAl() { Byte(0x84); Byte(0xC0); }
+        void XorAlImm8(uint8_t imm) { Byte(0x34); Byte(imm); }
+        void AndAlCl() { Byte(0x20); Byte(0xC8); }
+        void MovzxEaxAl() { Byte(0x0F); Byte(0xB6); Byte(0xC0); }
+
+        // Set 8 bits register of 'r' (al or cl) by condition
+        void Setcc(Cond cond, Reg r)
+        { Byte(0x0F); Byte(0x90 | cond); RegReg(0, r); }
+
+        // SSE2 instruction of scalar double with memory operand, e.g.
+        // movsd(F2 0F 10), addsd(F2 0F 58), ucomisd(66 0F 2E)
+        void SseMem(unsigned char prefix, unsigned char op,
+                    XmmReg xmm, Reg base, int disp)
+        {
+            if (prefix)
+                Byte(prefix);
+            Rex(false, xmm, base);
+            Byte(0x0F);
+            Byte(op);
+            Mem(xmm, base, disp);
+        }
+
+        void SseReg(unsigned char prefix, unsigned char op,
+                    XmmReg dst, XmmReg src)
+        {
+            Byte(prefix);
+            Byte(0x0F);
+            Byte(op);
+            RegReg(dst, src);
+        }
+
+        // movq xmm, rax
+        void MovqXmmRax(XmmReg xmm)
+        { Byte(0x66); Byte(0x48); Byte(0x0F); Byte(0x6E); RegReg(xmm, RAX); }
+
+        void Jmp(int label) { Byte(0xE9); Fixup(label); }
+
+        void Jcc(Cond cond, int label)
+        { Byte(0x0F); Byte(0x80 | cond); Fixup(label); }
+
+    private:
+        void Byte(unsigned char b) { code_.push_back(b); }
+
+        void Int32(uint32_t v)
+        {
+            for (int i = 0; i < 4; ++i)
+                Byte((v >> (i * 8)) & 0xFF);
+        }
+
+        void Int64(uint64_t v)
+        {
+            for (int i = 0; i < 8; ++i)
+                Byte((v >> (i * 8)) & 0xFF);
+        }
+
+        void Rex(bool w, int reg, int base)
+        {
+            unsigned char rex = 0x40 | (w ? 8 : 0) |
+                (((reg >> 3) & 1) << 2) | ((base >> 3) & 1);
+            if (rex != 0x40)
+                Byte(rex);
+        }
+
+        void RegReg(int reg, int rm)
+        { Byte(0xC0 | ((reg & 7) << 3) | (rm & 7)); }
+
+        // ModRM of [base + disp32], base of r12 needs SIB byte
+        void Mem(int reg, int base, int disp)
+        {
+            Byte(0x80 | ((reg & 7) << 3) | (base & 7));
+            if ((base & 7) == 4)
+                Byte(0x24);
+            Int32(static_cast<uint32_t>(disp));
+        }
+
+        void Fixup(int label)
+        {
+            fixups_.push_back(std::make_pair(code_.size(), label));
+            Int32(0);
+        }
+
+        std::vector<unsigned char> code_;
+        std::vector<int> labels_;
+        std::vector<std::pair<std::size_t, int>> fixups_;
+    };
+} // namespace
+
+namespace luna
+{
+    // Arguments of compiled code, machine code keeps it in rbx
+    struct JitContext
+    {
+        VM *vm_;
+        GC *gc_;
+        Closure *closure_;
+        Value *registers_;
+        Value *consts_;
+        std::exception_ptr *error_;
+        // Entry of machine code of the new frame, and frames which are
+        // below 'depth_' return to the interpreter
+        const void *entry_;
+        std::size_t depth_;
+    };
+
+    // Addresses of functions called by machine code
+    struct JitCalls
+    {
+        int (*slow_path_)(JitContext *, int);
+        int (*call_path_)(JitContext *, int);
+        int (*jump_back_)(JitContext *, int);
+        int (*get_table_)(JitContext *, int, const Value *, const Value *, Value *);
+        int (*set_table_)(JitContext *, int, const Value *, const Value *,
+                          const Value *);
+        int (*get_field_)(JitContext *, int, const Value *, const Value *,
+                          Value *, unsigned int *);
+        int (*set_field_)(JitContext *, int, const Value *, const Value *,
+                          const Value *, unsigned int *);
+        bool (*equal_)(const Value *, const Value *);
+        void (*get_upvalue_)(JitContext *, int, Value *);
+        void (*set_upvalue_)(JitContext *, int, const Value *);
+    };
+
+    // Generate machine code of templates of all instructions of a function.
+    // Registers of machine code: rbx is JitContext, r12 is the registers
+    // of frame, r13 is the const values, rax, rcx, rdi, rsi, xmm0 and
+    // xmm1 are scratch.
+    class JitCompiler
+    {
+    public:
+        JitCompiler(Function *proto, const JitCalls &calls)
+            : proto_(proto), calls_(calls),
+              opcodes_(proto->GetOpCodes()),
+              size_(static_cast<int>(proto->OpCodeSize())),
+              epilogue_(-1), broken_(false)
+        {
+        }
+
+        // Generate code and entries of instructions, return false when
+        // the instructions are broken, e.g. jump out of the function
+        bool Compile(std::vector<unsigned int> &entries);
+
+        const std::vector<unsigned char> & GetCode() const
+        { return asm_.GetCode(); }
+
+    private:
+        // Compile instruction at index 'pc', return index of next one
+        int CompileInstruction(int pc);
+
+        static Operand Register(int index)
+        { return Operand{ R12, index * kValueSize }; }
+
+        Operand Const(int index) const
+        { return Operand{ R13, index * kValueSize }; }
+
+        bool IsConstNumber(const Operand &v) const
+        {
+            return v.base_ == R13 &&
+                proto_->GetConstValue(v.disp_ / kValueSize)->type_ == ValueT_Number;
+        }
+
+        bool IsConstNotNumber(const Operand &v) const
+        { return v.base_ == R13 && !IsConstNumber(v); }
+
+        // Label of instruction, backward jumps go through the check
+        // of GC and profiler before the instruction
+        int JumpLabel(int pc, int target);
+        int ExitLabel(int pc);
+
+        // Jump to 'label' when 'v' is not a number
+        void GuardNumber(const Operand &v, int label);
+
+        void Copy(const Operand &dst, const Operand &src);
+        void StoreNumberType(const Operand &dst);
+        void StoreBoolFromAl(const Operand &dst);
+
+        // Call slow path of instruction, result is the next instruction
+        void SlowPath(int pc);
+        void CallPath(int pc);
+        // Call 'func' of table access with 'pc' and operands 't', 'key'
+        // and 'value', and inline cache of 'pc' when 'cache' is true
+        void TableAccess(int pc, const void *func, const Operand &t,
+                         const Operand &key, const Operand &value, bool cache);
+        // Call 'func' of upvalue access with upvalue 'index' and 'a'
+        void UpvalueAccess(const void *func, int index, const Operand &a);
+        void CallFunc(const void *func);
+
+        void Arith(int pc, const Operand &a, const Operand &b,
+                   const Operand &c, unsigned char op);
+        void ArithCall(int pc, const Operand &a, const Operand &b,
+                       const Operand &c, double (*func)(double, double));
+        // Compare numbers 'b' and 'c', set flags of 'above' or
+        // 'above or equal' when the result is true
+        bool CompareFlags(int pc, OpType op, const Operand &b,
+                          const Operand &c, Cond &cond);
+        void Compare(int pc, OpType op, const Operand &a,
+                     const Operand &b, const Operand &c);
+        // Set al to 1 when 'b' equals 'c', otherwise 0
+        void EqualToAl(const Operand &b, const Operand &c);
+        void JumpFalse(const Operand &a, int label);
+        void JumpTrue(const Operand &a, int label);
+        void ForLoop(int pc, const Operand &a, int target);
+
+        Function *proto_;
+        JitCalls calls_;
+        const Instruction *opcodes_;
+        int size_;
+        Assembler asm_;
+        int epilogue_;
+        // Jump target is out of the function
+        bool broken_;
+        // Labels of instructions, and the label after the last one
+        std::vector<int> labels_;
+        // Out of line code of exits and backward jumps
+        std::map<int, int> exits_;
+        std::map<int, int> jump_backs_;
+    };
+
+    bool JitCompiler::Compile(std::vector<unsigned int> &entries)
+    {
+        for (int pc = 0; pc <= size_; ++pc)
+            labels_.push_back(asm_.NewLabel());
+        epilogue_ = asm_.NewLabel();
+
+        // int code(JitContext *context, const void *entry), push five
+        // registers to keep the stack aligned to 16 bytes for calls
+        asm_.Push(RBP);
+        asm_.Push(RBX);
+        asm_.Push(R12);
+        asm_.Push(R13);
+        asm_.Push(R14);
+        asm_.MovRegReg(RBX, RDI);
+        asm_.MovRegMem(R12, RBX, offsetof(JitContext, registers_));
+        asm_.MovRegMem(R13, RBX, offsetof(JitContext, consts_));
+        asm_.JmpRsi();
+
+        // Switch to machine code of the new frame
+        auto exit = asm_.NewLabel();
+        asm_.Bind(epilogue_);
+        asm_.CmpEaxImm32(static_cast<uint32_t>(JitExit_Switch));
+        asm_.Jcc(Cond_NE, exit);
+        asm_.MovRegMem(R12, RBX, offsetof(JitContext, registers_));
+        asm_.MovRegMem(R13, RBX, offsetof(JitContext, consts_));
+        asm_.MovRegMem(RSI, RBX, offsetof(JitContext, entry_));
+        asm_.JmpRsi();
+
+        asm_.Bind(exit);
+        asm_.Pop(R14);
+        asm_.Pop(R13);
+        asm_.Pop(R12);
+        asm_.Pop(RBX);
+        asm_.Pop(RBP);
+        asm_.Ret();
+
+        entries.assign(size_ + 1, kNoEntry);
+        int pc = 0;
+        while (pc < size_)
+        {
+            asm_.Bind(labels_[pc]);
+            entries[pc] = asm_.Offset();
+            pc = CompileInstruction(pc);
+            if (pc < 0 || pc > size_)
+                return false;
+        }
+
+        // End of instructions returns in the interpreter
+        asm_.Bind(labels_[size_]);
+        entries[size_] = asm_.Offset();
+        asm_.MovRegImm32(RAX, size_);
+        asm_.Jmp(epilogue_);
+
+        for (const auto &exit : exits_)
+        {
+            asm_.Bind(exit.second);
+            asm_.MovRegImm32(RAX, exit.first);
+            asm_.Jmp(epilogue_);
+        }
+
+        for (const auto &jump : jump_backs_)
+        {
+            asm_.Bind(jump.second);
+            asm_.MovRegReg(RDI, RBX);
+            asm_.MovRegImm32(RSI, jump.first);
+            asm_.MovPtr(RAX, reinterpret_cast<const void *>(calls_.jump_back_));
+            asm_.CallRax();
+            asm_.TestEaxEax();
+            asm_.Jcc(Cond_S, epilogue_);
+            asm_.Jmp(labels_[jump.first]);
+        }
+
+        return !broken_ && asm_.Finish();
+    }
+
+    int JitCompiler::CompileInstruction(int pc)
+    {
+        auto i = opcodes_[pc];
+        auto op = static_cast<OpType>(Instruction::GetOpCode(i));
+        auto a = Register(Instruction::GetParamA(i));
+        auto b = Register(Instruction::GetParamB(i));
+        auto c = Register(Instruction::GetParamC(i));
+        auto const_b = Const(Instruction::GetParamB(i));
+        auto const_c = Const(Instruction::GetParamC(i));
+        auto sbx = Instruction::GetParamsBx(i);
+
+        switch (op)
+        {
+            case OpType_LoadNil:
+                asm_.MovMem64Imm(a.base_, a.Num(), 0);
+                asm_.MovMem32Imm(a.base_, a.Type(), ValueT_Nil);
+                break;
+            case OpType_FillNil:
+                // Closing upvalues is left to the slow path
+                if (Instruction::GetParamC(i))
+                    SlowPath(pc);
+                else
+                {
+                    for (int r = Instruction::GetParamA(i);
+                         r < Instruction::GetParamB(i); ++r)
+                    {
+                        asm_.MovMem64Imm(R12, Register(r).Num(), 0);
+                        asm_.MovMem32Imm(R12, Register(r).Type(), ValueT_Nil);
+                    }
+                }
+                break;
+            case OpType_LoadBool:
+                asm_.MovMem64Imm(a.base_, a.Num(), Instruction::GetParamB(i) ? 1 : 0);
+                asm_.MovMem32Imm(a.base_, a.Type(), ValueT_Bool);
+                break;
+            case OpType_LoadInt:
+                {
+                    if (pc + 1 >= size_)
+                        return -1;
+                    double num = opcodes_[pc + 1].opcode_;
+                    uint64_t bits;
+                    memcpy(&bits, &num, sizeof(bits));
+                    asm_.MovRegImm64(RAX, bits);
+                    asm_.MovMemReg(a.base_, a.Num(), RAX);
+                    StoreNumberType(a);
+                }
+                return pc + 2;
+            case OpType_LoadConst:
+                Copy(a, Const(Instruction::GetParamBx(i)));
+                break;
+            case OpType_Move:
+                Copy(a, b);
+                break;
+            case OpType_JmpFalse:
+                JumpFalse(a, JumpLabel(pc, pc + sbx));
+                break;
+            case OpType_JmpTrue:
+                JumpTrue(a, JumpLabel(pc, pc + sbx));
+                break;
+            case OpType_JmpNil:
+                asm_.CmpMem32Imm8(a.base_, a.Type(), ValueT_Nil);
+                asm_.Jcc(Cond_E, JumpLabel(pc, pc + sbx));
+                break;
+            case OpType_Jmp:
+                asm_.Jmp(JumpLabel(pc, pc + sbx));
+                break;
+            case OpType_Neg:
+                // Flip sign bit of the double
+                GuardNumber(a, ExitLabel(pc));
+                asm_.XorMem8Imm8(a.base_, a.Num() + 7, 0x80);
+                break;
+            case OpType_Not:
+                {
+                    auto is_false = asm_.NewLabel();
+                    auto done = asm_.NewLabel();
+                    JumpFalse(a, is_false);
+                    asm_.MovMem64Imm(a.base_, a.Num(), 0);
+                    asm_.Jmp(done);
+                    asm_.Bind(is_false);
+                    asm_.MovMem64Imm(a.base_, a.Num(), 1);
+                    asm_.Bind(done);
+                    asm_.MovMem32Imm(a.base_, a.Type(), ValueT_Bool);
+                }
+                break;
+            case OpType_Add: Arith(pc, a, b, c, 0x58); break;
+            case OpType_Sub: Arith(pc, a, b, c, 0x5C); break;
+            case OpType_Mul: Arith(pc, a, b, c, 0x59); break;
+            case OpType_Div: Arith(pc, a, b, c, 0x5E); break;
+            case OpType_AddK: Arith(pc, a, b, const_c, 0x58); break;
+            case OpType_SubK: Arith(pc, a, b, const_c, 0x5C); break;
+            case OpType_MulK: Arith(pc, a, b, const_c, 0x59); break;
+            case OpType_DivK: Arith(pc, a, b, const_c, 0x5E); break;
+            case OpType_Pow: ArithCall(pc, a, b, c, ::pow); break;
+            case OpType_Mod: ArithCall(pc, a, b, c, ::fmod); break;
+            case OpType_PowK: ArithCall(pc, a, b, const_c, ::pow); break;
+            case OpType_ModK: ArithCall(pc, a, b, const_c, ::fmod); break;
+            case OpType_Less:
+            case OpType_Greater:
+            case OpType_LessEqual:
+            case OpType_GreaterEqual:
+                Compare(pc, op, a, b, c);
+                break;
+            case OpType_LessK:
+                Compare(pc, OpType_Less, a, b, const_c);
+                break;
+            case OpType_GreaterK:
+                Compare(pc, OpType_Greater, a, b, const_c);
+                break;
+            case OpType_LessEqualK:
+                Compare(pc, OpType_LessEqual, a, b, const_c);
+                break;
+            case OpType_GreaterEqualK:
+                Compare(pc, OpType_GreaterEqual, a, b, const_c);
+                break;
+            case OpType_Equal:
+            case OpType_UnEqual:
+            case OpType_EqualK:
+            case OpType_UnEqualK:
+                EqualToAl(b, op == OpType_Equal || op == OpType_UnEqual ? c : const_c);
+                if (op == OpType_UnEqual || op == OpType_UnEqualK)
+                    asm_.XorAlImm8(1);
+                StoreBoolFromAl(a);
+                break;
+            case OpType_JmpLess:
+            case OpType_JmpGreater:
+            case OpType_JmpEqual:
+            case OpType_JmpUnEqual:
+            case OpType_JmpLessEqual:
+            case OpType_JmpGreaterEqual:
+                {
+                    if (pc + 1 >= size_)
+                        return -1;
+                    // Operand B is const index when operand C is 1
+                    auto operand = Instruction::GetParamC(i) ? const_b : b;
+                    auto label = JumpLabel(pc, pc + 1 +
+                                           Instruction::GetParamsBx(opcodes_[pc + 1]));
+                    if (op == OpType_JmpEqual || op == OpType_JmpUnEqual)
+                    {
+                        EqualToAl(a, operand);
+                        asm_.TestAlAl();
+                        asm_.Jcc(op == OpType_JmpEqual ? Cond_E : Cond_NE, label);
+                    }
+                    else
+                    {
+                        // Jump when the comparison is false
+                        static const OpType compare_ops[] = {
+                            OpType_Less, OpType_Greater, OpType_Equal,
+                            OpType_UnEqual, OpType_LessEqual, OpType_GreaterEqual,
+                        };
+                        Cond cond;
+                        if (CompareFlags(pc, compare_ops[op - OpType_JmpLess],
+                                         a, operand, cond))
+                            asm_.Jcc(cond == Cond_A ? Cond_BE : Cond_B, label);
+                    }
+                }
+                return pc + 2;
+            case OpType_SetTable:
+                TableAccess(pc, reinterpret_cast<const void *>(calls_.set_table_),
+                            a, b, c, false);
+                break;
+            case OpType_GetTable:
+                TableAccess(pc, reinterpret_cast<const void *>(calls_.get_table_),
+                            a, b, c, false);
+                break;
+            case OpType_SetTableK:
+                TableAccess(pc, reinterpret_cast<const void *>(calls_.set_table_),
+                            a, const_b, c, false);
+                break;
+            case OpType_GetTableK:
+                TableAccess(pc, reinterpret_cast<const void *>(calls_.get_table_),
+                            a, const_b, c, false);
+                break;
+            case OpType_SetField:
+                TableAccess(pc, reinterpret_cast<const void *>(calls_.set_field_),
+                            a, const_b, c, true);
+                break;
+            case OpType_GetField:
+                TableAccess(pc, reinterpret_cast<const void *>(calls_.get_field_),
+                            a, const_b, c, true);
+                break;
+            case OpType_ForPrep:
+                SlowPath(pc);
+                asm_.CmpEaxImm32(pc + 1);
+                asm_.Jcc(Cond_NE, JumpLabel(pc, pc + sbx));
+                break;
+            case OpType_ForLoop:
+                ForLoop(pc, a, pc + sbx);
+                break;
+            case OpType_GetUpvalue:
+                UpvalueAccess(reinterpret_cast<const void *>(calls_.get_upvalue_),
+                              Instruction::GetParamB(i), a);
+                break;
+            case OpType_SetUpvalue:
+                UpvalueAccess(reinterpret_cast<const void *>(calls_.set_upvalue_),
+                              Instruction::GetParamB(i), a);
+                break;
+            case OpType_GetGlobal:
+            case OpType_SetGlobal:
+            case OpType_Closure:
+            case OpType_Len:
+            case OpType_Concat:
+            case OpType_NewTable:
+            case OpType_Ret:
+                SlowPath(pc);
+                break;
+            case OpType_Call:
+            case OpType_TailCall:
+            case OpType_VarArg:
+                CallPath(pc);
+                break;
+            case OpType_SetList:
+            case OpType_GetGlobalField:
+                // Next instruction is the operand
+                if (pc + 1 >= size_)
+                    return -1;
+                SlowPath(pc);
+                return pc + 2;
+            default:
+                asm_.Jmp(ExitLabel(pc));
+                break;
+        }
+        return pc + 1;
+    }
+
+    int JitCompiler::JumpLabel(int pc, int target)
+    {
+        if (target < 0 || target > size_)
+        {
+            broken_ = true;
+            return epilogue_;
+        }
+        if (target > pc)
+            return labels_[target];
+
+        auto it = jump_backs_.find(target);
+        if (it != jump_backs_.end())
+            return it->second;
+        auto label = asm_.NewLabel();
+        jump_backs_[target] = label;
+        return label;
+    }
+
+    int JitCompiler::ExitLabel(int pc)
+    {
+        auto it = exits_.find(pc);
+        if (it != exits_.end())
+            return it->second;
+        auto label = asm_.NewLabel();
+        exits_[pc] = label;
+        return label;
+    }
+
+    void JitCompiler::GuardNumber(const Operand &v, int label)
+    {
+        if (IsConstNumber(v))
+            return ;
+        if (IsConstNotNumber(v))
+        {
+            asm_.Jmp(label);
+            return ;
+        }
+        asm_.CmpMem32Imm8(v.base_, v.Type(), ValueT_Number);
+        asm_.Jcc(Cond_NE, label);
+    }
+
+    void JitCompiler::Copy(const Operand &dst, const Operand &src)
+    {
+        // movups xmm0, [src]; movups [dst], xmm0
+        asm_.SseMem(0, 0x10, XMM0, src.base_, src.disp_);
+        asm_.SseMem(0, 0x11, XMM0, dst.base_, dst.disp_);
+    }
+
+    void JitCompiler::StoreNumberType(const Operand &dst)
+    {
+        asm_.MovMem32Imm(dst.base_, dst.Type(), ValueT_Number);
+    }
+
+    void JitCompiler::StoreBoolFromAl(const Operand &dst)
+    {
+        asm_.MovzxEaxAl();
+        asm_.MovMemReg(dst.base_, dst.Num(), RAX);
+        asm_.MovMem32Imm(dst.base_, dst.Type(), ValueT_Bool);
+    }
+
+    void JitCompiler::SlowPath(int pc)
+    {
+        asm_.MovRegReg(RDI, RBX);
+        asm_.MovRegImm32(RSI, pc);
+        CallFunc(reinterpret_cast<const void *>(calls_.slow_path_));
+    }
+
+    void JitCompiler::CallPath(int pc)
+    {
+        asm_.MovRegReg(RDI, RBX);
+        asm_.MovRegImm32(RSI, pc);
+        CallFunc(reinterpret_cast<const void *>(calls_.call_path_));
+        asm_.MovRegMem(R12, RBX, offsetof(JitContext, registers_));
+    }
+
+    void JitCompiler::TableAccess(int pc, const void *func, const Operand &t,
+                                  const Operand &key, const Operand &value,
+                                  bool cache)
+    {
+        asm_.MovRegReg(RDI, RBX);
+        asm_.MovRegImm32(RSI, pc);
+        asm_.LeaRegMem(RDX, t.base_, t.disp_);
+        asm_.LeaRegMem(RCX, key.base_, key.disp_);
+        asm_.LeaRegMem(R8, value.base_, value.disp_);
+        if (cache)
+            asm_.MovPtr(R9, proto_->GetInlineCache(pc));
+        CallFunc(func);
+    }
+
+    void JitCompiler::UpvalueAccess(const void *func, int index,
+                                    const Operand &a)
+    {
+        // Upvalue access never exits
+        asm_.MovRegReg(RDI, RBX);
+        asm_.MovRegImm32(RSI, index);
+        asm_.LeaRegMem(RDX, a.base_, a.disp_);
+        asm_.MovPtr(RAX, func);
+        asm_.CallRax();
+    }
+
+    void JitCompiler::CallFunc(const void *func)
+    {
+        // Negative result exits from machine code
+        asm_.MovPtr(RAX, func);
+        asm_.CallRax();
+        asm_.TestEaxEax();
+        asm_.Jcc(Cond_S, epilogue_);
+    }
+
+    void JitCompiler::Arith(int pc, const Operand &a, const Operand &b,
+                            const Operand &c, unsigned char op)
+    {
+        auto exit = ExitLabel(pc);
+        GuardNumber(b, exit);
+        GuardNumber(c, exit);
+        asm_.SseMem(0xF2, 0x10, XMM0, b.base_, b.Num());
+        asm_.SseMem(0xF2, op, XMM0, c.base_, c.Num());
+        asm_.SseMem(0xF2, 0x11, XMM0, a.base_, a.Num());
+        StoreNumberType(a);
+    }
+
+    void JitCompiler::ArithCall(int pc, const Operand &a, const Operand &b,
+                                const Operand &c, double (*func)(double, double))
+    {
+        auto exit = ExitLabel(pc);
+        GuardNumber(b, exit);
+        GuardNumber(c, exit);
+        asm_.SseMem(0xF2, 0x10, XMM0, b.base_, b.Num());
+        asm_.SseMem(0xF2, 0x10, XMM1, c.base_, c.Num());
+        asm_.MovPtr(RAX, reinterpret_cast<const void *>(func));
+        asm_.CallRax();
+        asm_.SseMem(0xF2, 0x11, XMM0, a.base_, a.Num());
+        StoreNumberType(a);
+    }
+
+    bool JitCompiler::CompareFlags(int pc, OpType op, const Operand &b,
+                                   const Operand &c, Cond &cond)
+    {
+        // Comparison of strings and type errors are left to the
+        // interpreter, unordered NaN is neither above nor equal
+        auto exit = ExitLabel(pc);
+        if (IsConstNotNumber(b) || IsConstNotNumber(c))
+        {
+            asm_.Jmp(exit);
+            return false;
+        }
+        GuardNumber(b, exit);
+        GuardNumber(c, exit);
+
+        // b < c is c above b, b > c is b above c
+        bool swap = op == OpType_Less || op == OpType_LessEqual;
+        const auto &left = swap ? c : b;
+        const auto &right = swap ? b : c;
+        asm_.SseMem(0xF2, 0x10, XMM0, left.base_, left.Num());
+        asm_.SseMem(0x66, 0x2E, XMM0, right.base_, right.Num());
+        cond = op == OpType_Less || op == OpType_Greater ? Cond_A : Cond_AE;
+        return true;
+    }
+
+    void JitCompiler::Compare(int pc, OpType op, const Operand &a,
+                              const Operand &b, const Operand &c)
+    {
+        Cond cond;
+        if (!CompareFlags(pc, op, b, c, cond))
+            return ;
+        asm_.Setcc(cond, RAX);
+        StoreBoolFromAl(a);
+    }
+
+    void JitCompiler::EqualToAl(const Operand &b, const Operand &c)
+    {
+        auto slow = asm_.NewLabel();
+        auto done = asm_.NewLabel();
+        if (!IsConstNotNumber(b) && !IsConstNotNumber(c))
+        {
+            // Numbers are equal when ZF is set and PF is not set
+            GuardNumber(b, slow);
+            GuardNumber(c, slow);
+            asm_.SseMem(0xF2, 0x10, XMM0, b.base_, b.Num());
+            asm_.SseMem(0x66, 0x2E, XMM0, c.base_, c.Num());
+            asm_.Setcc(Cond_E, RAX);
+            asm_.Setcc(Cond_NP, RCX);
+            asm_.AndAlCl();
+            asm_.Jmp(done);
+        }
+        asm_.Bind(slow);
+        asm_.LeaRegMem(RDI, b.base_, b.disp_);
+        asm_.LeaRegMem(RSI, c.base_, c.disp_);
+        asm_.MovPtr(RAX, reinterpret_cast<const void *>(calls_.equal_));
+        asm_.CallRax();
+        asm_.Bind(done);
+    }
+
+    void JitCompiler::JumpFalse(const Operand &a, int label)
+    {
+        auto done = asm_.NewLabel();
+        asm_.CmpMem32Imm8(a.base_, a.Type(), ValueT_Nil);
+        asm_.Jcc(Cond_E, label);
+        asm_.CmpMem32Imm8(a.base_, a.Type(), ValueT_Bool);
+        asm_.Jcc(Cond_NE, done);
+        asm_.CmpMem8Imm8(a.base_, a.Num(), 0);
+        asm_.Jcc(Cond_E, label);
+        asm_.Bind(done);
+    }
+
+    void JitCompiler::JumpTrue(const Operand &a, int label)
+    {
+        auto done = asm_.NewLabel();
+        asm_.CmpMem32Imm8(a.base_, a.Type(), ValueT_Nil);
+        asm_.Jcc(Cond_E, done);
+        asm_.CmpMem32Imm8(a.base_, a.Type(), ValueT_Bool);
+        asm_.Jcc(Cond_NE, label);
+        asm_.CmpMem8Imm8(a.base_, a.Num(), 0);
+        asm_.Jcc(Cond_NE, label);
+        asm_.Bind(done);
+    }
+
+    void JitCompiler::ForLoop(int pc, const Operand &a, int target)
+    {
+        auto var = a;
+        auto limit = Register(a.disp_ / kValueSize + 1);
+        auto step = Register(a.disp_ / kValueSize + 2);
+        auto state = Register(a.disp_ / kValueSize + 3);
+        auto label = JumpLabel(pc, target);
+        auto float_mode = asm_.NewLabel();
+        auto count_down = asm_.NewLabel();
+        auto done = asm_.NewLabel();
+
+        // Loop state is the remaining count in integer mode, otherwise
+        // it is the loop direction
+        asm_.CmpMem32Imm8(state.base_, state.Type(), ValueT_Number);
+        asm_.Jcc(Cond_NE, float_mode);
+        asm_.SseMem(0xF2, 0x10, XMM0, state.base_, state.Num());
+        asm_.SseReg(0x66, 0x57, XMM1, XMM1);            // xorpd
+        asm_.SseReg(0x66, 0x2E, XMM0, XMM1);            // ucomisd
+        asm_.Jcc(Cond_BE, done);
+        double one = 1.0;
+        uint64_t bits;
+        memcpy(&bits, &one, sizeof(bits));
+        asm_.MovRegImm64(RAX, bits);
+        asm_.MovqXmmRax(XMM1);
+        asm_.SseReg(0xF2, 0x5C, XMM0, XMM1);            // subsd
+        asm_.SseMem(0xF2, 0x11, XMM0, state.base_, state.Num());
+        asm_.SseMem(0xF2, 0x10, XMM0, var.base_, var.Num());
+        asm_.SseMem(0xF2, 0x58, XMM0, step.base_, step.Num());
+        asm_.SseMem(0xF2, 0x11, XMM0, var.base_, var.Num());
+        asm_.Jmp(label);
+
+        asm_.Bind(float_mode);
+        asm_.SseMem(0xF2, 0x10, XMM0, var.base_, var.Num());
+        asm_.SseMem(0xF2, 0x58, XMM0, step.base_, step.Num());
+        asm_.SseMem(0xF2, 0x11, XMM0, var.base_, var.Num());
+        asm_.CmpMem8Imm8(state.base_, state.Num(), 0);
+        asm_.Jcc(Cond_E, count_down);
+        // var <= limit
+        asm_.SseMem(0xF2, 0x10, XMM1, limit.base_, limit.Num());
+        asm_.SseReg(0x66, 0x2E, XMM1, XMM0);
+        asm_.Jcc(Cond_AE, label);
+        asm_.Jmp(done);
+        // var >= limit
+        asm_.Bind(count_down);
+        asm_.SseMem(0x66, 0x2E, XMM0, limit.base_, limit.Num());
+        asm_.Jcc(Cond_AE, label);
+        asm_.Bind(done);
+    }
+
+    JitCode::JitCode(void *code, std::size_t size, Value *consts,
+                     std::vector<unsigned int> &&entries)
+        : code_(code), size_(size), consts_(consts),
+          entries_(std::move(entries))
+    {
+    }
+
+    JitCode::~JitCode()
+    {
+        munmap(code_, size_);
+    }
+
+    std::unique_ptr<JitCode> JitCode::Compile(Function *proto)
+    {
+        JitCalls calls = {
+            &JitCode::SlowPath, &JitCode::CallPath, &JitCode::JumpBack,
+            &JitCode::GetTable, &JitCode::SetTable,
+            &JitCode::GetField, &JitCode::SetField, &JitCode::Equal,
+            &JitCode::GetUpvalue, &JitCode::SetUpvalue,
+        };
+        JitCompiler compiler(proto, calls);
+        std::vector<unsigned int> entries;
+        if (!compiler.Compile(entries))
+            return std::unique_ptr<JitCode>();
+
+        // Code is written before the memory becomes executable
+        const auto &code = compiler.GetCode();
+        auto page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+        auto size = (code.size() + page - 1) / page * page;
+        auto memory = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED)
+            return std::unique_ptr<JitCode>();
+
+        memcpy(memory, code.data(), code.size());
+        if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0)
+        {
+            munmap(memory, size);
+            return std::unique_ptr<JitCode>();
+        }
+
+        auto consts = proto->GetConstValueCount() ?
+            proto->GetConstValue(0) : nullptr;
+        return std::unique_ptr<JitCode>(
+            new JitCode(memory, size, consts, std::move(entries)));
+    }
+
+    int JitCode::Run(VM *vm, Closure *closure, Value *registers, int pc,
+                     std::size_t depth) const
+    {
+        assert(pc >= 0 && pc < static_cast<int>(entries_.size()));
+        assert(entries_[pc] != kNoEntry);
+
+        std::exception_ptr error;
+        JitContext context = {
+            vm, &vm->state_->GetGC(), closure, registers, consts_, &error,
+            nullptr, depth
+        };
+
+        typedef int (*Entry)(JitContext *, const void *);
+        auto entry = reinterpret_cast<Entry>(code_);
+        auto result = entry(&context, static_cast<char *>(code_) + entries_[pc]);
+        if (result == JitExit_Error)
+            std::rethrow_exception(error);
+        return result;
+    }
+
+    int JitCode::SlowPath(JitContext *context, int pc)
+    {
+        // Exceptions can not unwind through machine code without unwind
+        // info, so they are caught here and thrown again by Run
+        try
+        {
+            auto result = context->vm_->ExecuteInstruction(pc);
+            return result == JitExit_Frame ? EnterFrame(context) : result;
+        } catch (...)
+        {
+            *context->error_ = std::current_exception();
+            return JitExit_Error;
+        }
+    }
+
+    int JitCode::CallPath(JitContext *context, int pc)
+    {
+        auto result = SlowPath(context, pc);
+        if (result >= 0)
+            context->registers_ = context->vm_->state_->GetCurrentCall()->register_;
+        return result;
+    }
+
+    int JitCode::EnterFrame(JitContext *context)
+    {
+        auto vm = context->vm_;
+        auto code = vm->GetJitCode(context->depth_);
+        if (!code)
+            return JitExit_Frame;
+
+        auto call = vm->state_->GetCurrentCall();
+        auto cl = call->func_->closure_;
+        auto pc = call->instruction_ - cl->GetPrototype()->GetOpCodes();
+        if (code->entries_[pc] == kNoEntry)
+            return JitExit_Frame;
+
+        context->closure_ = cl;
+        context->registers_ = call->register_;
+        context->consts_ = code->consts_;
+        context->entry_ = static_cast<char *>(code->code_) + code->entries_[pc];
+        return JitExit_Switch;
+    }
+
+    int JitCode::GetTable(JitContext *context, int pc, const Value *t,
+                          const Value *key, Value *dst)
+    {
+        // Table never raises errors of getting
+        if (t->type_ != ValueT_Table)
+            return SlowPath(context, pc);
+        *dst = t->table_->GetValue(*key);
+        return 0;
+    }
+
+    int JitCode::SetTable(JitContext *context, int pc, const Value *t,
+                          const Value *key, const Value *value)
+    {
+        if (t->type_ != ValueT_Table)
+            return SlowPath(context, pc);
+        // Growing table may raise memory error
+        try
+        {
+            t->table_->SetValue(*key, *value);
+        } catch (...)
+        {
+            *context->error_ = std::current_exception();
+            return JitExit_Error;
+        }
+        auto &gc = *context->gc_;
+        CHECK_BARRIER_KEY_VALUE(gc, t->table_, *key, *value);
+        return 0;
+    }
+
+    int JitCode::GetField(JitContext *context, int pc, const Value *t,
+                          const Value *key, Value *dst, unsigned int *cache)
+    {
+        if (t->type_ != ValueT_Table)
+            return SlowPath(context, pc);
+        *dst = t->table_->GetValueBySlot(*key, *cache);
+        return 0;
+    }
+
+    int JitCode::SetField(JitContext *context, int pc, const Value *t,
+                          const Value *key, const Value *value,
+                          unsigned int *cache)
+    {
+        if (t->type_ != ValueT_Table)
+            return SlowPath(context, pc);
+        try
+        {
+            t->table_->SetValueBySlot(*key, *value, *cache);
+        } catch (...)
+        {
+            *context->error_ = std::current_exception();
+            return JitExit_Error;
+        }
+        auto &gc = *context->gc_;
+        CHECK_BARRIER_KEY_VALUE(gc, t->table_, *key, *value);
+        return 0;
+    }
+
+    int JitCode::JumpBack(JitContext *context, int pc)
+    {
+        try
+        {
+            context->vm_->JumpBack(pc);
+            return 0;
+        } catch (...)
+        {
+            *context->error_ = std::current_exception();
+            return JitExit_Error;
+        }
+    }
+
+    bool JitCode::Equal(const Value *left, const Value *right)
+    {
+        return *left == *right;
+    }
+
+    void JitCode::GetUpvalue(JitContext *context, int index, Value *dst)
+    {
+        *dst = *context->closure_->GetUpvalue(index)->GetValue();
+    }
+
+    void JitCode::SetUpvalue(JitContext *context, int index,
+                             const Value *value)
+    {
+        auto upvalue = context->closure_->GetUpvalue(index);
+        upvalue->SetValue(*value);
+        auto &gc = *context->gc_;
+        CHECK_BARRIER_VALUE(gc, upvalue, *value);
+    }
+} // namespace luna
+#endif // LUNA_JIT
@@ -0,0 +1,107 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+// Baseline JIT compiles hot functions into machine code of x86-64, code
+// reads and writes registers of frames in the stack like the interpreter,
+// so the interpreter can continue from any instruction where compiled
+// code exits. Other architectures, NaN-boxed Values and opcode stats
+// which count every instruction run by the interpreter only.
+#if defined(LUNA_USE_JIT) && defined(__x86_64__) && \
+    !defined(LUNA_NAN_BOXING) && !defined(LUNA_OPCODE_STATS)
+#define LUNA_JIT
+#endif
+
+#ifdef LUNA_JIT
+namespace luna
+{
+    class Function;
+    class Closure;
+    class VM;
+    struct Value;
+    struct JitContext;
+
+    // Function is compiled after it is called or jumps backward this
+    // many times in the interpreter
+    const unsigned int kJitThreshold = 256;
+
+    // Results of machine code and its calls other than index of
+    // instruction
+    enum JitExit
+    {
+        JitExit_Error = -1,     // Error is raised
+        JitExit_Frame = -2,     // Frame is called, returned or yielded
+        JitExit_Switch = -3,    // Machine code continues in the new frame
+    };
+
+    // Machine code of a Function, each instruction is compiled into a
+    // template: number arithmetic, comparison, moves and jumps are inline
+    // with type guards, table access calls Table directly, others call
+    // the slow path of VM which runs the instruction as the interpreter.
+    // Machine code exits when frame changes, or a type guard fails, then
+    // the interpreter continues.
+    class JitCode
+    {
+    public:
+        ~JitCode();
+
+        JitCode(const JitCode&) = delete;
+        void operator = (const JitCode&) = delete;
+
+        // Compile 'proto', return nullptr when executable memory is not
+        // available, then the function is left to the interpreter
+        static std::unique_ptr<JitCode> Compile(Function *proto);
+
+        // Run current frame of 'vm' which calls 'closure' from instruction
+        // index 'pc', return index of the instruction of current frame
+        // where the interpreter continues, or JitExit_Frame when current
+        // frame is changed. When the new frame is compiled and not below
+        // 'depth', machine code continues in it without exit. Errors
+        // raised by calls of machine code are thrown again from here.
+        int Run(VM *vm, Closure *closure, Value *registers, int pc,
+                std::size_t depth) const;
+
+        // Size of machine code in bytes
+        std::size_t GetCodeSize() const { return size_; }
+
+    private:
+        JitCode(void *code, std::size_t size, Value *consts,
+                std::vector<unsigned int> &&entries);
+
+        // Calls from machine code, they return JitExit_Error when an
+        // error is caught, the error is kept in 'context' and thrown by
+        // Run. 'pc' is the index of instruction which calls them.
+        static int SlowPath(JitContext *context, int pc);
+        // Slow path of calls, c functions may reallocate the stack
+        static int CallPath(JitContext *context, int pc);
+        // Switch 'context' to current frame after the frame is changed
+        static int EnterFrame(JitContext *context);
+        static int JumpBack(JitContext *context, int pc);
+        static int GetTable(JitContext *context, int pc, const Value *t,
+                            const Value *key, Value *dst);
+        static int SetTable(JitContext *context, int pc, const Value *t,
+                            const Value *key, const Value *value);
+        static int GetField(JitContext *context, int pc, const Value *t,
+                            const Value *key, Value *dst, unsigned int *cache);
+        static int SetField(JitContext *context, int pc, const Value *t,
+                            const Value *key, const Value *value,
+                            unsigned int *cache);
+        static bool Equal(const Value *left, const Value *right);
+        static void GetUpvalue(JitContext *context, int index, Value *dst);
+        static void SetUpvalue(JitContext *context, int index,
+                               const Value *value);
+
+        void *code_;
+        std::size_t size_;
+        // Const values of the function
+        Value *consts_;
+        // Code offsets of instructions, indexed by instruction index
+        std::vector<unsigned int> entries_;
+    };
+} // namespace luna
+#endif // LUNA_JIT
+
+#endif // JIT_H
@@ -1,6 +1,8 @@
 #include "Lex.h"
 #include "State.h"
 #include "Exception.h"
+#include "Text.h"
+#include "Number.h"
 #include <assert.h>
 #include <stddef.h>
 #include <stdlib.h>
@@ -36,6 +38,39 @@ namespace
                (c >= 'a' && c <= 'f') ||
                (c >= 'A' && c <= 'F');
     }
+
+    // Character predicates of number lexing, they are inlined into
+    // instances of Lexer::LexNumberX, Scan counts leading number
+    // characters of buffer
+    struct DecimalChar
+    {
+        bool operator () (int c) const
+        { return c >= '0' && c <= '9'; }
+
+        static std::size_t Scan(const char *s, std::size_t len)
+        { return luna::ScanDigits(s, len); }
+    };
+
+    struct DecimalExponent
+    {
+        bool operator () (int c) const
+        { return c == 'e' || c == 'E'; }
+    };
+
+    struct HexChar
+    {
+        bool operator () (int c) const
+        { return IsHexChar(c); }
+
+        static std::size_t Scan(const char *s, std::size_t len)
+        { return luna::ScanHexDigits(s, len); }
+    };
+
+    struct HexExponent
+    {
+        bool operator () (int c) const
+        { return c == 'p' || c == 'P'; }
+    };
 } // namespace
 
 namespace luna
@@ -57,7 +92,7 @@ namespace luna
 
 #define RETURN_TOKEN_DETAIL(detail, string, token)              \
     do {                                                        \
-        detail->str_ = state_->GetString(string);               \
+        detail->str_ = state_->GetInternedString(string);       \
         RETURN_NORMAL_TOKEN_DETAIL(detail, token);              \
     } while (0)
 
@@ -70,12 +105,15 @@ namespace luna
         detail->module_ = module_;                              \
     } while (0)
 
-    Lexer::Lexer(State *state, String *module, CharInStream in)
+    Lexer::Lexer(State *state, String *module, const char *begin, const char *end,
+                 int line)
         : state_(state),
           module_(module),
-          in_stream_(in),
+          begin_(begin),
+          pos_(begin),
+          end_(end),
           current_(EOF),
-          line_(1),
+          line_(line),
           column_(0)
     {
     }
@@ -89,6 +127,8 @@ namespace luna
 
         while (current_ != EOF)
         {
+            // Token starts from 'current_'
+            detail->offset_ = static_cast<int>(pos_ - begin_) - 1;
             switch (current_) {
             case ' ': case '\t': case '\v': case '\f':
                 current_ = Next();
@@ -143,8 +183,7 @@ namespace luna
                         token_buffer_.push_back(current_);
                         current_ = next;
                         return LexNumberXFractional(detail, false, true,
-                                                    [](int c) { return isdigit(c) != 0; },
-                                                    [](int c) { return c == 'e' || c == 'E'; });
+                                                    DecimalChar(), DecimalExponent());
                     }
                     else
                     {
@@ -264,8 +303,7 @@ namespace luna
                 token_buffer_.push_back(next);
                 current_ = Next();
 
-                return LexNumberX(detail, false, IsHexChar,
-                                  [](int c) { return c == 'p' || c == 'P'; });
+                return LexNumberX(detail, false, HexChar(), HexExponent());
             }
             else
             {
@@ -276,20 +314,31 @@ namespace luna
         }
 
         return LexNumberX(detail, integer_part,
-                          [](int c) { return isdigit(c) != 0; },
-                          [](int c) { return c == 'e' || c == 'E'; });
+                          DecimalChar(), DecimalExponent());
     }
 
+    template<typename IsNumberChar>
+    bool Lexer::LexDigits(IsNumberChar is_number_char)
+    {
+        if (!is_number_char(current_))
+            return false;
+
+        // Scan the rest of digits in place
+        token_buffer_.push_back(current_);
+        auto count = is_number_char.Scan(pos_, end_ - pos_);
+        token_buffer_.append(pos_, count);
+        pos_ += count;
+        column_ += count;
+        current_ = Next();
+        return true;
+    }
+
+    template<typename IsNumberChar, typename IsExponent>
     int Lexer::LexNumberX(TokenDetail *detail, bool integer_part,
-                          const std::function<bool (int)> &is_number_char,
-                          const std::function<bool (int)> &is_exponent)
+                          IsNumberChar is_number_char, IsExponent is_exponent)
     {
-        while (is_number_char(current_))
-        {
-            token_buffer_.push_back(current_);
-            current_ = Next();
+        if (LexDigits(is_number_char))
             integer_part = true;
-        }
 
         bool point = false;
         if (current_ == '.')
@@ -303,18 +352,13 @@ namespace luna
                                     is_number_char, is_exponent);
     }
 
+    template<typename IsNumberChar, typename IsExponent>
     int Lexer::LexNumberXFractional(TokenDetail *detail,
                                     bool integer_part, bool point,
-                                    const std::function<bool (int)> &is_number_char,
-                                    const std::function<bool (int)> &is_exponent)
+                                    IsNumberChar is_number_char,
+                                    IsExponent is_exponent)
     {
-        bool fractional_part = false;
-        while (is_number_char(current_))
-        {
-            token_buffer_.push_back(current_);
-            current_ = Next();
-            fractional_part = true;
-        }
+        bool fractional_part = LexDigits(is_number_char);
 
         if (point && !integer_part && !fractional_part)
             throw LexException(module_->GetCStr(), line_, column_,
@@ -344,7 +388,8 @@ namespace luna
             }
         }
 
-        double number = strtod(token_buffer_.c_str(), nullptr);
+        double number = 0.0;
+        ParseNumber(token_buffer_.data(), token_buffer_.size(), number);
         RETURN_NUMBER_TOKEN_DETAIL(detail, number);
     }
 
@@ -514,16 +559,15 @@ namespace luna
             throw LexException(module_->GetCStr(),
                     line_, column_, "unexpect character");
 
+        // Scan the rest of identifier in place
         token_buffer_.clear();
         token_buffer_.push_back(current_);
+        auto count = ScanIdentifier(pos_, end_ - pos_);
+        token_buffer_.append(pos_, count);
+        pos_ += count;
+        column_ += count;
         current_ = Next();
 
-        while (isalnum(current_) || current_ == '_')
-        {
-            token_buffer_.push_back(current_);
-            current_ = Next();
-        }
-
         int token = 0;
         if (!IsKeyWord(token_buffer_, &token))
             token = Token_Id;
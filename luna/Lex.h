@@ -3,7 +3,7 @@
 
 #include "Token.h"
 #include <string>
-#include <functional>
+#include <stdio.h>
 
 namespace luna
 {
@@ -13,9 +13,10 @@ namespace luna
     class Lexer
     {
     public:
-        typedef std::function<int ()> CharInStream;
-
-        Lexer(State *state, String *module, CharInStream in);
+        // Lex characters of contiguous buffer [begin, end), the buffer
+        // must outlive the lexer, 'line' is the line of 'begin' in module
+        Lexer(State *state, String *module, const char *begin, const char *end,
+              int line = 1);
 
         Lexer(const Lexer&) = delete;
         void operator = (const Lexer&) = delete;
@@ -30,12 +31,19 @@ namespace luna
             return module_;
         }
 
+        // Get begin of the buffer, offsets of tokens are relative to it
+        const char * GetBufferBegin() const
+        {
+            return begin_;
+        }
+
     private:
         int Next()
         {
-            auto c = in_stream_();
-            if (c != EOF) ++column_;
-            return c;
+            if (pos_ == end_)
+                return EOF;
+            ++column_;
+            return static_cast<unsigned char>(*pos_++);
         }
 
         void LexNewLine();
@@ -44,13 +52,16 @@ namespace luna
         void LexSingleLineComment();
 
         int LexNumber(TokenDetail *detail);
+        template<typename IsNumberChar>
+        bool LexDigits(IsNumberChar is_number_char);
+        template<typename IsNumberChar, typename IsExponent>
         int LexNumberX(TokenDetail *detail, bool integer_part,
-                       const std::function<bool (int)> &is_number_char,
-                       const std::function<bool (int)> &is_exponent);
+                       IsNumberChar is_number_char, IsExponent is_exponent);
+        template<typename IsNumberChar, typename IsExponent>
         int LexNumberXFractional(TokenDetail *detail,
                                  bool integer_part, bool point,
-                                 const std::function<bool (int)> &is_number_char,
-                                 const std::function<bool (int)> &is_exponent);
+                                 IsNumberChar is_number_char,
+                                 IsExponent is_exponent);
 
         int LexXEqual(TokenDetail *detail, int equal_token);
 
@@ -62,7 +73,11 @@ namespace luna
 
         State *state_;
         String *module_;
-        CharInStream in_stream_;
+        // Begin of the buffer, position of next character and end of
+        // the buffer
+        const char *begin_;
+        const char *pos_;
+        const char *end_;
 
         int current_;
         int line_;
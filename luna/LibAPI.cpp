@@ -2,7 +2,12 @@
 #include "State.h"
 #include "Runtime.h"
 #include "Table.h"
+#include "String.h"
+#include "Function.h"
+#include "VM.h"
+#include "Exception.h"
 #include <assert.h>
+#include <string.h>
 
 namespace luna
 {
@@ -14,7 +19,7 @@ namespace luna
 
     int StackAPI::GetStackSize() const
     {
-        return stack_->top_ - state_->calls_.back().register_;
+        return stack_->top_ - state_->GetCFunctionRegister();
     }
 
     ValueT StackAPI::GetValueType(int index)
@@ -100,14 +105,14 @@ namespace luna
 
     Value * StackAPI::GetValue(int index)
     {
-        assert(!state_->calls_.empty());
+        Value *reg = state_->GetCFunctionRegister();
         Value *v = nullptr;
         if (index < 0)
             v = stack_->top_ + index;
         else
-            v = state_->calls_.back().register_ + index;
+            v = reg + index;
 
-        if (v >= stack_->top_ || v < state_->calls_.back().register_)
+        if (v >= stack_->top_ || v < reg)
             return nullptr;
         else
             return v;
@@ -176,7 +181,45 @@ namespace luna
 
     void StackAPI::PushValue(const Value &value)
     {
-        *PushValue() = value;
+        // Copy it first, 'value' may be in stack which would grow
+        Value v = value;
+        *PushValue() = v;
+    }
+
+    char * StackAPI::NewStringBuffer(std::size_t len, char *buffer)
+    {
+        static_assert(kShortStringSize == String::kMaxShortLength,
+                      "short strings are written into stack buffer");
+        if (len <= kShortStringSize)
+            return buffer;
+
+        char *dst = nullptr;
+        auto v = PushValue();
+        v->type_ = ValueT_String;
+        v->str_ = state_->NewLongString(len, &dst);
+        return dst;
+    }
+
+    void StackAPI::Pop(int count)
+    {
+        assert(count <= GetStackSize());
+        stack_->top_ -= count;
+    }
+
+    void StackAPI::Call(int arg_count, int result_count)
+    {
+        assert(arg_count < GetStackSize());
+        auto f = stack_->top_ - arg_count - 1;
+        if (f->type_ != ValueT_Closure && f->type_ != ValueT_CFunction)
+            throw CallCFuncException("attempt to call a ",
+                                     f->TypeName(), " value");
+
+        // Run the frame of closure until it returns, C function is done
+        if (state_->CallFunction(f, arg_count, result_count))
+        {
+            VM vm(state_);
+            vm.Execute();
+        }
     }
 
     void StackAPI::ArgCountError(int expect_count)
@@ -196,6 +239,7 @@ namespace luna
 
     Value * StackAPI::PushValue()
     {
+        state_->ReserveStack(stack_->top_, 1);
         return stack_->top_++;
     }
 
@@ -222,8 +266,10 @@ namespace luna
         v.type_ = ValueT_Table;
         v.table_ = t;
         global_->SetValue(k, v);
+        CHECK_BARRIER(state_->GetGC(), global_);
 
         RegisterToTable(t, table, size);
+        state_->GetGC().SetPermanent(t);
     }
 
     void Library::RegisterMetatable(const char *name, const TableMemberReg *table,
@@ -231,6 +277,19 @@ namespace luna
     {
         auto t = state_->GetMetatable(name);
         RegisterToTable(t, table, size);
+        state_->GetGC().SetPermanent(t);
+    }
+
+    void Library::RunScript(const char *script, const char *name)
+    {
+        state_->module_manager_->LoadString(script, strlen(script), name);
+        auto f = state_->stack_.top_ - 1;
+        f->closure_->GetPrototype()->SetLibrary();
+        if (state_->CallFunction(f, 0, 0))
+        {
+            VM vm(state_);
+            vm.Execute();
+        }
     }
 
     void Library::RegisterToTable(Table *table, const TableMemberReg *table_reg,
@@ -264,6 +323,7 @@ namespace luna
         v.type_ = ValueT_CFunction;
         v.cfunc_ = func;
         table->SetValue(k, v);
+        CHECK_BARRIER(state_->GetGC(), table);
     }
 
     void Library::RegisterNumber(Table *table, const char *name, double number)
@@ -276,6 +336,7 @@ namespace luna
         v.type_ = ValueT_Number;
         v.num_ = number;
         table->SetValue(k, v);
+        CHECK_BARRIER(state_->GetGC(), table);
     }
 
     void Library::RegisterString(Table *table, const char *name, const char *str)
@@ -288,5 +349,6 @@ namespace luna
         v.type_ = ValueT_String;
         v.str_ = state_->GetString(str);
         table->SetValue(k, v);
+        CHECK_BARRIER(state_->GetGC(), table);
     }
 } // namespace luna
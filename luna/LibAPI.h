@@ -2,7 +2,10 @@
 #define LIB_API_H
 
 #include "Value.h"
+#include "ValueTraits.h"
 #include <string>
+#include <utility>
+#include <type_traits>
 
 namespace luna
 {
@@ -106,11 +109,38 @@ namespace luna
         void PushCFunction(CFunctionType function);
         void PushValue(const Value &value);
 
+        // Push string of 'len' bytes which are written by 'write' into
+        // the buffer of string in place, short string is written into
+        // stack buffer and then interned
+        template<typename Write>
+        void PushNewString(std::size_t len, Write write)
+        {
+            char buffer[kShortStringSize];
+            auto dst = NewStringBuffer(len, buffer);
+            write(dst);
+            if (dst == buffer)
+                PushString(buffer, len);
+        }
+
+        // Pop 'count' values from stack top
+        void Pop(int count);
+
+        // Call the function below 'arg_count' arguments on stack top, the
+        // function and arguments are replaced by 'result_count' results
+        void Call(int arg_count, int result_count);
+
         // For report argument error
         void ArgCountError(int expect_count);
         void ArgTypeError(int arg_index, ValueT expect_type);
 
     private:
+        // Same as String::kMaxShortLength
+        static const std::size_t kShortStringSize = 40;
+
+        // Get buffer to write string of 'len' bytes, long string is new
+        // and pushed, short string is written into 'buffer'
+        char * NewStringBuffer(std::size_t len, char *buffer);
+
         // Push value to stack, and return the value
         Value * PushValue();
 
@@ -118,6 +148,79 @@ namespace luna
         Stack *stack_;
     };
 
+    // C function which calls C++ function 'func', args are checked and
+    // converted by ValueTraits of the parameter types of 'func' which are
+    // known at compile time, the result of 'func' is returned to script.
+    // e.g. lib.RegisterFunc("add", LUNA_FUNCTION(Add));
+    template<typename Func, Func func>
+    struct BoundFunction;
+
+    template<typename R, typename... Args, R (*func)(Args...)>
+    struct BoundFunction<R (*)(Args...), func>
+    {
+        static int Call(State *state)
+        {
+            typedef typename MakeIndexSequence<sizeof...(Args)>::Type Indexes;
+            StackAPI api(state);
+            return Call(state, api, Indexes());
+        }
+
+    private:
+        template<std::size_t... Indexes>
+        static int Call(State *state, StackAPI &api, IndexSequence<Indexes...>)
+        {
+            const int count = sizeof...(Args);
+            if (api.GetStackSize() < count)
+            {
+                api.ArgCountError(count);
+                return 0;
+            }
+
+            // Check args in order, stop at the first wrong one
+            const Value *args = count > 0 ? api.GetValue(0) : nullptr;
+            bool valid = true;
+            bool checked[] = {
+                true, (valid = valid && CheckArg<Args>(api, args, Indexes))...
+            };
+            (void)checked;
+            if (!valid)
+                return 0;
+
+            return Invoke(state, api, std::is_void<R>(),
+                          ArgTraits<Args>::Get(args[Indexes])...);
+        }
+
+        template<typename Arg>
+        static bool CheckArg(StackAPI &api, const Value *args, int index)
+        {
+            if (ArgTraits<Arg>::Is(args[index]))
+                return true;
+            api.ArgTypeError(index, ArgTraits<Arg>::Type());
+            return false;
+        }
+
+        template<typename... Params>
+        static int Invoke(State *state, StackAPI &api, std::false_type,
+                          Params&&... params)
+        {
+            api.PushValue(ValueTraits<R>::Make(
+                state, func(std::forward<Params>(params)...)));
+            return 1;
+        }
+
+        template<typename... Params>
+        static int Invoke(State *, StackAPI &, std::true_type,
+                          Params&&... params)
+        {
+            func(std::forward<Params>(params)...);
+            return 0;
+        }
+    };
+
+    // C function of C++ function 'func' by BoundFunction
+    #define LUNA_FUNCTION(func) \
+        (&luna::BoundFunction<decltype(&func), &func>::Call)
+
     // For register table member
     struct TableMemberReg
     {
@@ -183,6 +286,11 @@ namespace luna
             RegisterMetatable(name, table, N);
         }
 
+        // Run library 'script' as module 'name', errors of c functions
+        // called by functions of the script are reported at the callers
+        // of these functions, e.g. bad pattern in iterator of gmatch
+        void RunScript(const char *script, const char *name);
+
     private:
         void RegisterToTable(Table *table, const TableMemberReg *table_reg, std::size_t size);
         void RegisterFunc(Table *table, const char *name, CFunctionType func);
@@ -0,0 +1,398 @@
+#include "LibArray.h"
+#include "State.h"
+#include "Table.h"
+#include "Exception.h"
+#include <algorithm>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define LUNA_ARRAY_VECTOR
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define LUNA_ARRAY_VECTOR
+#endif
+
+namespace
+{
+    // Number is stored in the first 8 bytes of Value in both layouts, so
+    // numbers of array part are doubles with stride of sizeof(Value),
+    // they are contiguous doubles with NaN-boxing
+    inline const double * NumberPtr(const luna::Value *v)
+    {
+#ifdef LUNA_NAN_BOXING
+        return reinterpret_cast<const double *>(v);
+#else
+        return &v->num_;
+#endif
+    }
+
+#if defined(__SSE2__)
+    typedef __m128d Vector;
+
+    inline Vector Zero() { return _mm_setzero_pd(); }
+    inline Vector Splat(double x) { return _mm_set1_pd(x); }
+    inline Vector Add(Vector a, Vector b) { return _mm_add_pd(a, b); }
+    inline Vector Mul(Vector a, Vector b) { return _mm_mul_pd(a, b); }
+    inline Vector Min(Vector a, Vector b) { return _mm_min_pd(a, b); }
+    inline Vector Max(Vector a, Vector b) { return _mm_max_pd(a, b); }
+    inline double Lane0(Vector v) { return _mm_cvtsd_f64(v); }
+    inline double Lane1(Vector v) { return _mm_cvtsd_f64(_mm_unpackhi_pd(v, v)); }
+
+    inline Vector Load(const double *p) { return _mm_loadu_pd(p); }
+    inline void Store(double *p, Vector v) { _mm_storeu_pd(p, v); }
+
+    inline Vector Load(const double *p0, const double *p1)
+    {
+        return _mm_loadh_pd(_mm_load_sd(p0), p1);
+    }
+#elif defined(LUNA_ARRAY_VECTOR)
+    typedef float64x2_t Vector;
+
+    inline Vector Zero() { return vdupq_n_f64(0.0); }
+    inline Vector Splat(double x) { return vdupq_n_f64(x); }
+    inline Vector Add(Vector a, Vector b) { return vaddq_f64(a, b); }
+    inline Vector Mul(Vector a, Vector b) { return vmulq_f64(a, b); }
+    inline Vector Min(Vector a, Vector b) { return vminq_f64(a, b); }
+    inline Vector Max(Vector a, Vector b) { return vmaxq_f64(a, b); }
+    inline double Lane0(Vector v) { return vgetq_lane_f64(v, 0); }
+    inline double Lane1(Vector v) { return vgetq_lane_f64(v, 1); }
+
+    inline Vector Load(const double *p) { return vld1q_f64(p); }
+    inline void Store(double *p, Vector v) { vst1q_f64(p, v); }
+
+    inline Vector Load(const double *p0, const double *p1)
+    {
+        return vcombine_f64(vld1_f64(p0), vld1_f64(p1));
+    }
+#endif
+
+#ifdef LUNA_ARRAY_VECTOR
+    // Load numbers of two values
+    inline Vector Load2(const luna::Value *v)
+    {
+#ifdef LUNA_NAN_BOXING
+        return Load(NumberPtr(v));
+#else
+        return Load(NumberPtr(v), NumberPtr(v + 1));
+#endif
+    }
+
+    // Store numbers into two values, stored by Value keeps NaN-boxed
+    // NaN canonical
+    inline void Store2(luna::Value *v, Vector x)
+    {
+        v[0].num_ = Lane0(x);
+        v[1].num_ = Lane1(x);
+    }
+#endif
+
+    double Sum(const luna::Value *v, std::size_t n)
+    {
+        std::size_t i = 0;
+        double sum = 0.0;
+#ifdef LUNA_ARRAY_VECTOR
+        // Two vectors of partial sums hide latency of additions
+        auto s0 = Zero();
+        auto s1 = Zero();
+        for (; i + 4 <= n; i += 4)
+        {
+            s0 = Add(s0, Load2(v + i));
+            s1 = Add(s1, Load2(v + i + 2));
+        }
+        s0 = Add(s0, s1);
+        sum = Lane0(s0) + Lane1(s0);
+#endif
+        for (; i < n; ++i)
+            sum += v[i].num_;
+        return sum;
+    }
+
+    double Dot(const luna::Value *a, const luna::Value *b, std::size_t n)
+    {
+        std::size_t i = 0;
+        double sum = 0.0;
+#ifdef LUNA_ARRAY_VECTOR
+        auto s0 = Zero();
+        auto s1 = Zero();
+        for (; i + 4 <= n; i += 4)
+        {
+            s0 = Add(s0, Mul(Load2(a + i), Load2(b + i)));
+            s1 = Add(s1, Mul(Load2(a + i + 2), Load2(b + i + 2)));
+        }
+        s0 = Add(s0, s1);
+        sum = Lane0(s0) + Lane1(s0);
+#endif
+        for (; i < n; ++i)
+            sum += a[i].num_ * b[i].num_;
+        return sum;
+    }
+
+    // Min or max of 'n' numbers, 'n' > 0
+    template<bool IsMax>
+    double MinMax(const luna::Value *v, std::size_t n)
+    {
+        auto pick = [](double l, double r) {
+            return IsMax ? std::max(l, r) : std::min(l, r);
+        };
+
+        std::size_t i = 1;
+        double result = v[0].num_;
+#ifdef LUNA_ARRAY_VECTOR
+        auto m0 = Splat(result);
+        auto m1 = m0;
+        for (; i + 4 <= n; i += 4)
+        {
+            m0 = IsMax ? Max(m0, Load2(v + i)) : Min(m0, Load2(v + i));
+            m1 = IsMax ? Max(m1, Load2(v + i + 2)) : Min(m1, Load2(v + i + 2));
+        }
+        m0 = IsMax ? Max(m0, m1) : Min(m0, m1);
+        result = pick(Lane0(m0), Lane1(m0));
+#endif
+        for (; i < n; ++i)
+            result = pick(result, v[i].num_);
+        return result;
+    }
+
+    void Scale(luna::Value *v, std::size_t n, double k)
+    {
+        std::size_t i = 0;
+#ifdef LUNA_ARRAY_VECTOR
+        auto kv = Splat(k);
+        for (; i + 2 <= n; i += 2)
+            Store2(v + i, Mul(Load2(v + i), kv));
+#endif
+        for (; i < n; ++i)
+            v[i].num_ = v[i].num_ * k;
+    }
+
+    // y += a * x
+    void Axpy(double a, const luna::Value *x, luna::Value *y, std::size_t n)
+    {
+        std::size_t i = 0;
+#ifdef LUNA_ARRAY_VECTOR
+        auto av = Splat(a);
+        for (; i + 2 <= n; i += 2)
+            Store2(y + i, Add(Load2(y + i), Mul(av, Load2(x + i))));
+#endif
+        for (; i < n; ++i)
+            y[i].num_ = y[i].num_ + a * x[i].num_;
+    }
+
+    // out[i .. i + n) += a * x[0 .. n) of contiguous doubles
+    void AxpyDense(double a, const double *x, double *out, std::size_t n)
+    {
+        std::size_t i = 0;
+#ifdef LUNA_ARRAY_VECTOR
+        auto av = Splat(a);
+        for (; i + 2 <= n; i += 2)
+            Store(out + i, Add(Load(out + i), Mul(av, Load(x + i))));
+#endif
+        for (; i < n; ++i)
+            out[i] += a * x[i];
+    }
+} // namespace
+
+namespace lib {
+namespace array {
+
+    // Get array part of table argument 'index', all values of it must be
+    // numbers, kernels run on the values directly
+    luna::Value * GetNumbers(luna::StackAPI &api, int index, std::size_t &size)
+    {
+        auto table = api.GetTable(index);
+        auto values = table->GetArrayValues();
+        size = table->ArraySize();
+        for (std::size_t i = 0; i < size; ++i)
+        {
+            if (values[i].type_ != luna::ValueT_Number)
+                throw luna::CallCFuncException("bad argument #", index + 1,
+                        " (number expected at index ", i + 1,
+                        ", got ", values[i].TypeName(), ")");
+        }
+        return values;
+    }
+
+    void CheckSameSize(std::size_t size1, std::size_t size2)
+    {
+        if (size1 != size2)
+            throw luna::CallCFuncException("arrays have different sizes ",
+                                           size1, " and ", size2);
+    }
+
+    int Sum(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(1, luna::ValueT_Table))
+            return 0;
+
+        std::size_t size = 0;
+        auto values = GetNumbers(api, 0, size);
+        api.PushNumber(::Sum(values, size));
+        return 1;
+    }
+
+    template<bool IsMax>
+    int MinMax(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(1, luna::ValueT_Table))
+            return 0;
+
+        std::size_t size = 0;
+        auto values = GetNumbers(api, 0, size);
+        if (size == 0)
+            api.PushNil();
+        else
+            api.PushNumber(::MinMax<IsMax>(values, size));
+        return 1;
+    }
+
+    int Dot(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(2, luna::ValueT_Table, luna::ValueT_Table))
+            return 0;
+
+        std::size_t size1 = 0;
+        std::size_t size2 = 0;
+        auto a = GetNumbers(api, 0, size1);
+        auto b = GetNumbers(api, 1, size2);
+        CheckSameSize(size1, size2);
+        api.PushNumber(::Dot(a, b, size1));
+        return 1;
+    }
+
+    int Scale(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(2, luna::ValueT_Table, luna::ValueT_Number))
+            return 0;
+
+        std::size_t size = 0;
+        auto values = GetNumbers(api, 0, size);
+        ::Scale(values, size, api.GetNumber(1));
+        api.PushTable(api.GetTable(0));
+        return 1;
+    }
+
+    // axpy(a, x, y): y[i] = y[i] + a * x[i]
+    int Axpy(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(3, luna::ValueT_Number,
+                           luna::ValueT_Table, luna::ValueT_Table))
+            return 0;
+
+        std::size_t size1 = 0;
+        std::size_t size2 = 0;
+        auto x = GetNumbers(api, 1, size1);
+        auto y = GetNumbers(api, 2, size2);
+        CheckSameSize(size1, size2);
+        ::Axpy(api.GetNumber(0), x, y, size1);
+        api.PushTable(api.GetTable(2));
+        return 1;
+    }
+
+    // fill(t, value [, n]): t[1 .. n] = value, 'n' is #t by default
+    int Fill(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(2, luna::ValueT_Table,
+                           luna::ValueT_Number, luna::ValueT_Number))
+            return 0;
+
+        auto table = api.GetTable(0);
+        luna::Value value(api.GetNumber(1));
+        std::size_t count = table->ArraySize();
+        if (api.GetStackSize() > 2)
+            count = static_cast<std::size_t>(std::max(api.GetNumber(2), 0.0));
+
+        auto fill = std::min(count, table->ArraySize());
+        std::fill(table->GetArrayValues(), table->GetArrayValues() + fill, value);
+        if (count > fill)
+        {
+            // Append the remain values at once
+            std::vector<luna::Value> values(count - fill, value);
+            table->SetArrayValues(fill + 1, values.data(), values.size());
+        }
+
+        api.PushTable(table);
+        return 1;
+    }
+
+    // prefixsum(t): t[i] = t[1] + ... + t[i]
+    int PrefixSum(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(1, luna::ValueT_Table))
+            return 0;
+
+        // Each sum depends on the previous one, so it is scalar
+        std::size_t size = 0;
+        auto values = GetNumbers(api, 0, size);
+        double sum = 0.0;
+        for (std::size_t i = 0; i < size; ++i)
+        {
+            sum += values[i].num_;
+            values[i].num_ = sum;
+        }
+
+        api.PushTable(api.GetTable(0));
+        return 1;
+    }
+
+    // convolve(a, k): full 1-D convolution of size #a + #k - 1
+    int Convolve(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(2, luna::ValueT_Table, luna::ValueT_Table))
+            return 0;
+
+        std::size_t size1 = 0;
+        std::size_t size2 = 0;
+        auto a = GetNumbers(api, 0, size1);
+        auto k = GetNumbers(api, 1, size2);
+
+        auto result = state->NewTable();
+        api.PushTable(result);
+        if (size1 == 0 || size2 == 0)
+            return 1;
+
+        // Signal is copied into contiguous doubles, then each element of
+        // kernel adds the scaled signal to output
+        std::vector<double> signal(size1);
+        for (std::size_t i = 0; i < size1; ++i)
+            signal[i] = a[i].num_;
+
+        std::vector<double> output(size1 + size2 - 1, 0.0);
+        for (std::size_t j = 0; j < size2; ++j)
+            AxpyDense(k[j].num_, signal.data(), output.data() + j, size1);
+
+        std::vector<luna::Value> values(output.size());
+        for (std::size_t i = 0; i < output.size(); ++i)
+            values[i] = luna::Value(output[i]);
+        result->SetArrayValues(1, values.data(), values.size());
+        return 1;
+    }
+
+    void RegisterLibArray(luna::State *state)
+    {
+        luna::Library lib(state);
+        luna::TableMemberReg array[] = {
+            { "axpy", Axpy },
+            { "convolve", Convolve },
+            { "dot", Dot },
+            { "fill", Fill },
+            { "max", MinMax<true> },
+            { "min", MinMax<false> },
+            { "prefixsum", PrefixSum },
+            { "scale", Scale },
+            { "sum", Sum }
+        };
+
+        lib.RegisterTableFunction("array", array);
+    }
+
+} // namespace array
+} // namespace lib
@@ -0,0 +1,14 @@
+#ifndef LIB_ARRAY_H
+#define LIB_ARRAY_H
+
+#include "LibAPI.h"
+
+namespace lib {
+namespace array {
+
+    void RegisterLibArray(luna::State *state);
+
+} // namespace array
+} // namespace lib
+
+#endif // LIB_ARRAY_H
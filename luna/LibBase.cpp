@@ -1,8 +1,9 @@
 #include "LibBase.h"
 #include "Table.h"
-#include "Upvalue.h"
 #include "State.h"
 #include "String.h"
+#include "Number.h"
+#include "Exception.h"
 #include <string>
 #include <iostream>
 #include <assert.h>
@@ -28,7 +29,11 @@ namespace base {
                     printf("%s", api.GetBool(i) ? "true" : "false");
                     break;
                 case luna::ValueT_Number:
-                    printf("%.14g", api.GetNumber(i));
+                    {
+                        char buffer[luna::kNumberBufferSize];
+                        auto len = luna::FormatNumber(api.GetNumber(i), buffer);
+                        fwrite(buffer, 1, len, stdout);
+                    }
                     break;
                 case luna::ValueT_String:
                     printf("%s", api.GetCString(i));
@@ -74,10 +79,7 @@ namespace base {
             return 0;
 
         const luna::Value *v = api.GetValue(0);
-        luna::ValueT type = v->type_ == luna::ValueT_Upvalue ?
-            v->upvalue_->GetValue()->type_ : v->type_;
-
-        switch (type) {
+        switch (v->type_) {
             case luna::ValueT_Nil:
                 api.PushString("nil");
                 break;
@@ -191,13 +193,71 @@ namespace base {
         if (!api.CheckArgs(1, luna::ValueT_String))
             return 0;
 
-        auto module = api.GetString(0)->GetStdString();
+        auto module = api.GetString(0);
         if (!state->IsModuleLoaded(module))
-            state->DoModule(module);
+            state->DoModule(module->GetStdString());
 
         return 0;
     }
 
+    int CollectGarbage(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(0, luna::ValueT_String, luna::ValueT_Number))
+            return 0;
+
+        std::string option = "collect";
+        if (api.GetStackSize() > 0)
+            option = api.GetCString(0);
+        auto arg = api.GetStackSize() > 1 ? api.GetNumber(1) : 0.0;
+        auto percent = static_cast<unsigned int>(arg > 0.0 ? arg : 0.0);
+
+        auto &gc = state->GetGC();
+        if (option == "collect")
+        {
+            gc.FullGC();
+            api.PushNumber(0);
+        }
+        else if (option == "step")
+        {
+            api.PushBool(gc.Step());
+        }
+        else if (option == "stop")
+        {
+            gc.Stop();
+            api.PushNumber(0);
+        }
+        else if (option == "restart")
+        {
+            gc.Restart();
+            api.PushNumber(0);
+        }
+        else if (option == "isrunning")
+        {
+            api.PushBool(!gc.IsStopped());
+        }
+        else if (option == "count")
+        {
+            api.PushNumber(gc.GetTotalBytes() / 1024.0);
+        }
+        else if (option == "setpause")
+        {
+            api.PushNumber(gc.GetConfig().major_pause_);
+            gc.SetMajorPause(percent);
+        }
+        else if (option == "setstepmul")
+        {
+            api.PushNumber(gc.GetConfig().major_step_multiplier_);
+            gc.SetMajorStepMultiplier(percent);
+        }
+        else
+        {
+            throw luna::CallCFuncException("bad argument #1 to 'collectgarbage' "
+                                           "(invalid option '", option, "')");
+        }
+        return 1;
+    }
+
     void RegisterLibBase(luna::State *state)
     {
         luna::Library lib(state);
@@ -208,6 +268,7 @@ namespace base {
         lib.RegisterFunc("type", Type);
         lib.RegisterFunc("getline", GetLine);
         lib.RegisterFunc("require", Require);
+        lib.RegisterFunc("collectgarbage", CollectGarbage);
     }
 
 } // namespace base
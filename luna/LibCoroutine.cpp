@@ -0,0 +1,171 @@
+#include "LibCoroutine.h"
+#include "State.h"
+#include "UserData.h"
+#include "Exception.h"
+#include <vector>
+
+namespace lib {
+namespace coroutine {
+
+#define METATABLE_COROUTINE "coroutine"
+
+    // Get coroutine from user data argument, throw when it is other
+    // user data
+    luna::Coroutine * GetCoroutine(luna::StackAPI &api, luna::State *state,
+                                   int index)
+    {
+        auto user_data = api.GetUserData(index);
+        if (user_data->GetMetatable() != state->GetMetatable(METATABLE_COROUTINE))
+            throw luna::CallCFuncException("argument #", index + 1,
+                                           " is not a coroutine");
+        return static_cast<luna::Coroutine *>(user_data->GetData());
+    }
+
+    luna::Coroutine * NewCoroutine(luna::State *state, const luna::Value &function)
+    {
+        auto co = state->NewCoroutine(function);
+        auto user_data = state->NewUserData();
+        auto metatable = state->GetMetatable(METATABLE_COROUTINE);
+        user_data->Set(co, metatable);
+        user_data->SetDestroyer(luna::Coroutine::Collect);
+        user_data->SetTracer(luna::Coroutine::Trace);
+        co->SetHandle(user_data);
+        return co;
+    }
+
+    int Create(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(1))
+            return 0;
+
+        if (!api.IsClosure(0) && !api.IsCFunction(0))
+        {
+            api.ArgTypeError(0, luna::ValueT_Closure);
+            return 0;
+        }
+
+        auto co = NewCoroutine(state, *api.GetValue(0));
+        api.PushUserData(co->GetHandle());
+        return 1;
+    }
+
+    int Resume(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(1, luna::ValueT_UserData))
+            return 0;
+
+        auto co = GetCoroutine(api, state, 0);
+        if (co->GetStatus() != luna::CoroutineStatus_Suspended)
+        {
+            api.PushBool(false);
+            if (co->GetStatus() == luna::CoroutineStatus_Dead)
+                api.PushString("cannot resume dead coroutine");
+            else
+                api.PushString("cannot resume non-suspended coroutine");
+            return 2;
+        }
+
+        std::vector<luna::Value> results;
+        auto args = api.GetValue(0) + 1;
+        auto ok = state->Resume(co, args, api.GetStackSize() - 1, results);
+
+        api.PushBool(ok);
+        for (const auto &value : results)
+            api.PushValue(value);
+        return results.size() + 1;
+    }
+
+    int Yield(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        state->Yield();
+        return api.GetStackSize();
+    }
+
+    int Status(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(1, luna::ValueT_UserData))
+            return 0;
+
+        auto co = GetCoroutine(api, state, 0);
+        switch (co->GetStatus())
+        {
+            case luna::CoroutineStatus_Suspended:
+                api.PushString("suspended");
+                break;
+            case luna::CoroutineStatus_Running:
+                api.PushString("running");
+                break;
+            case luna::CoroutineStatus_Normal:
+                api.PushString("normal");
+                break;
+            case luna::CoroutineStatus_Dead:
+                api.PushString("dead");
+                break;
+        }
+        return 1;
+    }
+
+    int Running(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        auto co = state->GetRunningCoroutine();
+        if (co)
+            api.PushUserData(co->GetHandle());
+        else
+            api.PushNil();
+        return 1;
+    }
+
+    // Return results of resume in wrap, raise error when it fails, the
+    // error is raised as it is, without position of the wrap function
+    int WrapResults(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(1, luna::ValueT_Bool))
+            return 0;
+
+        if (!api.GetBool(0))
+        {
+            auto error = api.GetStackSize() > 1 && api.IsString(1) ?
+                api.GetCString(1) : "error in coroutine";
+            throw luna::RuntimeException(error);
+        }
+
+        return api.GetStackSize() - 1;
+    }
+
+    // Functions returned by wrap need upvalues, so wrap is a closure
+    const char *kWrap =
+        "local create = coroutine.create\n"
+        "local resume = coroutine.resume\n"
+        "local results = coroutine.__wrapresults\n"
+        "coroutine.__wrapresults = nil\n"
+        "coroutine.wrap = function(f)\n"
+        "    local co = create(f)\n"
+        "    return function(...)\n"
+        "        return results(resume(co, ...))\n"
+        "    end\n"
+        "end\n";
+
+    void RegisterLibCoroutine(luna::State *state)
+    {
+        luna::Library lib(state);
+        luna::TableMemberReg coroutine[] = {
+            { "create", Create },
+            { "resume", Resume },
+            { "running", Running },
+            { "status", Status },
+            { "yield", Yield },
+            { "__wrapresults", WrapResults }
+        };
+
+        lib.RegisterTableFunction("coroutine", coroutine);
+        lib.RunScript(kWrap, "coroutine");
+    }
+
+} // namespace coroutine
+} // namespace lib
@@ -0,0 +1,22 @@
+#ifndef LIB_COROUTINE_H
+#define LIB_COROUTINE_H
+
+#include "LibAPI.h"
+
+namespace luna
+{
+    class Coroutine;
+} // namespace luna
+
+namespace lib {
+namespace coroutine {
+
+    // New coroutine which calls 'function', and its handle user data
+    luna::Coroutine * NewCoroutine(luna::State *state, const luna::Value &function);
+
+    void RegisterLibCoroutine(luna::State *state);
+
+} // namespace coroutine
+} // namespace lib
+
+#endif // LIB_COROUTINE_H
@@ -1,15 +1,26 @@
 #include "LibIO.h"
 #include "State.h"
 #include "String.h"
+#include "Number.h"
 #include "UserData.h"
+#include "Exception.h"
+#include "EventLoop.h"
+#include "LibCoroutine.h"
+#include <cctype>
 #include <cerrno>
 #include <cstring>
 #include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 namespace lib {
 namespace io {
 
 #define METATABLE_FILE "file"
+#define METATABLE_ASYNC_FILE "async_file"
+#define METATABLE_EVENT_LOOP "event_loop"
 
     // For close userdata file
     void CloseFile(void *data)
@@ -17,6 +28,15 @@ namespace io {
         std::fclose(reinterpret_cast<std::FILE *>(data));
     }
 
+    // Get FILE of user data at 'index', throw when the file is closed
+    std::FILE * GetOpenFile(luna::StackAPI &api, int index)
+    {
+        auto user_data = api.GetUserData(index);
+        if (user_data->IsDestroyed())
+            throw luna::CallCFuncException("attempt to use a closed file");
+        return reinterpret_cast<std::FILE *>(user_data->GetData());
+    }
+
     // Helper function for report strerror
     int PushError(luna::StackAPI &api)
     {
@@ -25,6 +45,69 @@ namespace io {
         return 2;
     }
 
+    // Buffer size of opened files, larger buffer means less read calls
+    // when reading large files line by line
+    const std::size_t kFileBufferSize = 64 * 1024;
+
+    // Line buffer reused by all reads of lines in the thread
+    struct LineBuffer
+    {
+        char *data_ = nullptr;
+        std::size_t capacity_ = 0;
+
+        ~LineBuffer() { std::free(data_); }
+    };
+
+    thread_local LineBuffer line_buffer;
+
+    // Read a line, the line is split in the buffer of FILE by getline,
+    // and copied once into string
+    void ReadLine(luna::StackAPI &api, std::FILE *file, bool keep_newline)
+    {
+        auto &buffer = line_buffer;
+        auto len = getline(&buffer.data_, &buffer.capacity_, file);
+        if (len < 0)
+        {
+            api.PushNil();
+            return ;
+        }
+
+        if (len > 0 && buffer.data_[len - 1] == '\n' && !keep_newline)
+            --len;
+        api.PushString(buffer.data_, len);
+    }
+
+    // Read the rest of regular file by mapping it, the content is copied
+    // once into string. Return false when the file can not be mapped.
+    bool ReadAllMapped(luna::StackAPI &api, std::FILE *file)
+    {
+        struct stat st;
+        auto fd = fileno(file);
+        if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+            return false;
+
+        // Seek flushes pending writes, and discards buffer of FILE
+        auto cur = std::ftell(file);
+        if (cur < 0 || std::fseek(file, cur, SEEK_SET) != 0)
+            return false;
+
+        auto size = static_cast<std::size_t>(st.st_size);
+        if (static_cast<std::size_t>(cur) >= size)
+        {
+            api.PushString("");
+            return true;
+        }
+
+        auto data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+            return false;
+
+        api.PushString(static_cast<const char *>(data) + cur, size - cur);
+        munmap(data, size);
+        std::fseek(file, 0, SEEK_END);
+        return true;
+    }
+
     // Read by bytes for userdata file
     void ReadBytes(luna::StackAPI &api, std::FILE *file, int bytes)
     {
@@ -41,78 +124,80 @@ namespace io {
         }
     }
 
+    // Read the longest prefix of a number after white spaces, the
+    // number is nil when the prefix is not a complete number
+    bool ReadNumber(std::FILE *file, double &num)
+    {
+        const std::size_t kMaxLength = 200;
+        char buffer[kMaxLength];
+        std::size_t len = 0;
+
+        int c = 0;
+        do
+        {
+            c = std::getc(file);
+        } while (std::isspace(c));
+
+        auto accept = [&](const char *set) {
+            if (c == EOF || len == kMaxLength || !std::strchr(set, c))
+                return false;
+            buffer[len++] = static_cast<char>(c);
+            c = std::getc(file);
+            return true;
+        };
+
+        auto digits = "0123456789";
+        auto hex_digits = "0123456789abcdefABCDEF";
+        accept("+-");
+        bool hex = accept("0") && accept("xX");
+        auto number_chars = hex ? hex_digits : digits;
+        while (accept(number_chars))
+            ;
+        if (accept("."))
+        {
+            while (accept(number_chars))
+                ;
+        }
+        if (accept(hex ? "pP" : "eE"))
+        {
+            accept("+-");
+            while (accept(digits))
+                ;
+        }
+
+        if (c != EOF)
+            std::ungetc(c, file);
+        return len > 0 && luna::ParseNumber(buffer, len, num) == len;
+    }
+
     // Read by format for userdata file
     void ReadByFormat(luna::StackAPI &api, std::FILE *file,
-                      const std::string format)
+                      const luna::String *format)
     {
-        if (format == "*n")
+        if (format->Equal("*n"))
         {
-            // Read a number
             double num = 0.0;
-            if (std::fscanf(file, "%lg", &num) == 1)
+            if (ReadNumber(file, num))
                 api.PushNumber(num);
             else
                 api.PushNil();
         }
-        else if (format == "*a")
+        else if (format->Equal("*a"))
         {
-            // Read total content of file
-            auto cur = std::ftell(file);
-            std::fseek(file, 0, SEEK_END);
-            auto bytes = std::ftell(file) - cur;
-            std::fseek(file, cur, SEEK_SET);
-            if (bytes == 0)
-                api.PushString("");
-            else
-            {
-                std::vector<char> buf(bytes);
-                bytes = std::fread(&buf[0], sizeof(buf[0]), bytes, file);
-                api.PushString(&buf[0], bytes);
-            }
+            if (ReadAllMapped(api, file))
+                return ;
+
+            // Read total content of pipe or file which can not be mapped
+            std::string content;
+            char buf[4096];
+            std::size_t bytes = 0;
+            while ((bytes = std::fread(buf, 1, sizeof(buf), file)) > 0)
+                content.append(buf, bytes);
+            api.PushString(content);
         }
-        else if (format == "*l" || format == "*L")
+        else if (format->Equal("*l") || format->Equal("*L"))
         {
-            // Read line
-            const std::size_t part = 128;
-            const std::size_t part_count = part + 1;
-
-            std::size_t count = 0;
-            std::vector<char> buf(part_count);
-            do
-            {
-                if (!std::fgets(&buf[count], part_count, file))
-                {
-                    // EOF or an error occured
-                    // if count is 0, push a nil as end of file
-                    // otherwise, push the buf as string
-                    if (count == 0)
-                        api.PushNil();
-                    else
-                        api.PushString(&buf[0], count);
-                    break;
-                }
-                else
-                {
-                    auto size = buf.size();
-                    while (count < size - 1 &&
-                            buf[count] != '\n' && buf[count] != '\0')
-                        ++count;
-                    // buf[size - 1] must be '\0'
-                    if (count == size - 1)
-                    {
-                        // '\n' is not exist, extend buf to continue read
-                        buf.resize(size + part);
-                    }
-                    else
-                    {
-                        // If buf[count] is '\n', keep '\n' when
-                        // format is "*L"
-                        if (buf[count] == '\n' && format == "*L") ++count;
-                        api.PushString(&buf[0], count);
-                        break;
-                    }
-                }
-            } while (true);
+            ReadLine(api, file, format->Equal("*L"));
         }
         else
             api.PushNil();
@@ -161,8 +246,7 @@ namespace io {
             }
             else if (type == luna::ValueT_String)
             {
-                auto format = api.GetString(i)->GetStdString();
-                ReadByFormat(api, file, format);
+                ReadByFormat(api, file, api.GetString(i));
             }
             else
                 api.PushNil();
@@ -171,6 +255,47 @@ namespace io {
         return params - 1;
     }
 
+    // Iterator of lines, format is parsed once by Lines
+    int DoLines(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        auto file = GetOpenFile(api, 0);
+        ReadLine(api, file, false);
+        return 1;
+    }
+
+    int DoLinesKeepNewline(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        auto file = GetOpenFile(api, 0);
+        ReadLine(api, file, true);
+        return 1;
+    }
+
+    // for line in file:lines([format]) do ... end
+    int Lines(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(1, luna::ValueT_UserData, luna::ValueT_String))
+            return 0;
+
+        GetOpenFile(api, 0);
+        auto keep_newline = false;
+        if (api.GetStackSize() > 1)
+        {
+            auto format = api.GetString(1);
+            if (format->Equal("*L"))
+                keep_newline = true;
+            else if (!format->Equal("*l"))
+                throw luna::CallCFuncException("bad argument #2 to 'lines' "
+                                               "(invalid format)");
+        }
+        api.PushCFunction(keep_newline ? DoLinesKeepNewline : DoLines);
+        api.PushUserData(api.GetUserData(0));
+        api.PushNil();
+        return 3;
+    }
+
     int Seek(luna::State *state)
     {
         luna::StackAPI api(state);
@@ -184,17 +309,17 @@ namespace io {
         auto params = api.GetStackSize();
         if (params > 1)
         {
-            auto whence = api.GetString(1)->GetStdString();
+            auto whence = api.GetString(1);
             long offset = 0;
             if (params > 2)
                 offset = static_cast<long>(api.GetNumber(2));
 
             int res = 0;
-            if (whence == "set")
+            if (whence->Equal("set"))
                 res = std::fseek(file, offset, SEEK_SET);
-            else if (whence == "cur")
+            else if (whence->Equal("cur"))
                 res = std::fseek(file, offset, SEEK_CUR);
-            else if (whence == "end")
+            else if (whence->Equal("end"))
                 res = std::fseek(file, offset, SEEK_END);
 
             if (res != 0)
@@ -217,18 +342,18 @@ namespace io {
             return 0;
 
         auto user_data = api.GetUserData(0);
-        auto mode = api.GetString(1)->GetStdString();
+        auto mode = api.GetString(1);
 
         std::size_t size = BUFSIZ;
         if (api.GetStackSize() > 2)
             size = static_cast<std::size_t>(api.GetNumber(2));
 
         auto file = reinterpret_cast<std::FILE *>(user_data->GetData());
-        if (mode == "no")
+        if (mode->Equal("no"))
             std::setvbuf(file, nullptr, _IONBF, 0);
-        else if (mode == "full")
+        else if (mode->Equal("full"))
             std::setvbuf(file, nullptr, _IOFBF, size);
-        else if (mode == "line")
+        else if (mode->Equal("line"))
             std::setvbuf(file, nullptr, _IOLBF, size);
 
         return 0;
@@ -256,7 +381,9 @@ namespace io {
             }
             else if (type == luna::ValueT_Number)
             {
-                if (std::fprintf(file, "%.14g", api.GetNumber(i)) < 0)
+                char buffer[luna::kNumberBufferSize];
+                auto len = luna::FormatNumber(api.GetNumber(i), buffer);
+                if (std::fwrite(buffer, len, 1, file) != 1)
                     return PushError(api);
             }
             else
@@ -270,6 +397,197 @@ namespace io {
         return 1;
     }
 
+    // For delete event loop of state
+    void DeleteEventLoop(void *data)
+    {
+        delete reinterpret_cast<EventLoop *>(data);
+    }
+
+    // Get event loop of state, new one when it is not existed. The loop
+    // is stored in a registry table, and it traces coroutines spawned
+    // into it.
+    EventLoop * GetEventLoop(luna::State *state)
+    {
+        auto registry = state->GetMetatable(METATABLE_EVENT_LOOP);
+        luna::Value key(state->GetString("loop"));
+        auto value = registry->GetValue(key);
+        if (value.type_ == luna::ValueT_UserData)
+            return reinterpret_cast<EventLoop *>(value.user_data_->GetData());
+
+        auto loop = new EventLoop(state);
+        auto user_data = state->NewUserData();
+        user_data->Set(loop, nullptr);
+        user_data->SetDestroyer(DeleteEventLoop);
+        user_data->SetTracer(EventLoop::Trace);
+        loop->SetHandle(user_data);
+        registry->SetValue(key, luna::Value(user_data));
+        CHECK_BARRIER(state->GetGC(), registry);
+        return loop;
+    }
+
+    // Push results of I/O operation
+    int PushResults(luna::StackAPI &api, const IOOperation &op)
+    {
+        for (const auto &result : op.results_)
+        {
+            if (result.type_ == IOValue::Type_String)
+                api.PushString(result.str_);
+            else if (result.type_ == IOValue::Type_File)
+                api.PushUserData(op.file_);
+            else
+                api.PushNil();
+        }
+        return op.results_.size();
+    }
+
+    // Perform I/O operation of non-blocking file, coroutine spawned into
+    // event loop waits when the file is not ready, others get an error
+    int PerformAsync(luna::StackAPI &api, luna::State *state, IOOperation &op)
+    {
+        auto loop = GetEventLoop(state);
+        if (loop->Perform(op))
+            return PushResults(api, op);
+
+        // Results are set when coroutine resumes
+        if (loop->Wait(op))
+            return 0;
+
+        errno = EAGAIN;
+        return PushError(api);
+    }
+
+    int AsyncRead(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(1, luna::ValueT_UserData))
+            return 0;
+
+        IOOperation op;
+        op.file_ = api.GetUserData(0);
+        op.fd_ = fileno(reinterpret_cast<std::FILE *>(op.file_->GetData()));
+
+        auto params = api.GetStackSize();
+        for (int i = 1; i < params; ++i)
+        {
+            auto type = api.GetValueType(i);
+            if (type == luna::ValueT_Number)
+            {
+                auto bytes = static_cast<int>(api.GetNumber(i));
+                op.formats_.push_back(bytes > 0 ? bytes : 0);
+            }
+            else if (type == luna::ValueT_String && api.GetString(i)->Equal("*a"))
+                op.formats_.push_back(IOOperation::Format_All);
+            else if (type == luna::ValueT_String && api.GetString(i)->Equal("*l"))
+                op.formats_.push_back(IOOperation::Format_Line);
+            else if (type == luna::ValueT_String && api.GetString(i)->Equal("*L"))
+                op.formats_.push_back(IOOperation::Format_LineKeep);
+            else
+            {
+                // "*n" is not supported for non-blocking file
+                api.ArgTypeError(i, luna::ValueT_String);
+                return 0;
+            }
+        }
+
+        if (op.formats_.empty())
+            return 0;
+        return PerformAsync(api, state, op);
+    }
+
+    int AsyncWrite(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(1, luna::ValueT_UserData))
+            return 0;
+
+        IOOperation op;
+        op.file_ = api.GetUserData(0);
+        op.fd_ = fileno(reinterpret_cast<std::FILE *>(op.file_->GetData()));
+        op.write_ = true;
+
+        auto params = api.GetStackSize();
+        for (int i = 1; i < params; ++i)
+        {
+            auto type = api.GetValueType(i);
+            if (type == luna::ValueT_String)
+            {
+                auto str = api.GetString(i);
+                op.data_.append(str->GetCStr(), str->GetLength());
+            }
+            else if (type == luna::ValueT_Number)
+            {
+                char buffer[luna::kNumberBufferSize];
+                auto len = luna::FormatNumber(api.GetNumber(i), buffer);
+                op.data_.append(buffer, len);
+            }
+            else
+            {
+                api.ArgTypeError(i, luna::ValueT_String);
+                return 0;
+            }
+        }
+
+        return PerformAsync(api, state, op);
+    }
+
+    int AsyncClose(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(1, luna::ValueT_UserData))
+            return 0;
+
+        auto file = reinterpret_cast<std::FILE *>(api.GetUserData(0)->GetData());
+        GetEventLoop(state)->Forget(fileno(file));
+        return Close(state);
+    }
+
+    // Set file non-blocking, then read and write of the file bypass the
+    // buffer of FILE, and yield in coroutines spawned into event loop
+    int SetNonBlocking(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(1, luna::ValueT_UserData))
+            return 0;
+
+        auto user_data = api.GetUserData(0);
+        auto file = reinterpret_cast<std::FILE *>(user_data->GetData());
+        auto fd = fileno(file);
+        auto flags = fcntl(fd, F_GETFL);
+        if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+            return PushError(api);
+
+        user_data->Set(file, state->GetMetatable(METATABLE_ASYNC_FILE));
+        CHECK_BARRIER(state->GetGC(), user_data);
+        api.PushUserData(user_data);
+        return 1;
+    }
+
+    // Spawn function into event loop as a coroutine
+    int Spawn(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(1))
+            return 0;
+
+        if (!api.IsClosure(0) && !api.IsCFunction(0))
+        {
+            api.ArgTypeError(0, luna::ValueT_Closure);
+            return 0;
+        }
+
+        auto co = coroutine::NewCoroutine(state, *api.GetValue(0));
+        GetEventLoop(state)->Spawn(co);
+        api.PushUserData(co->GetHandle());
+        return 1;
+    }
+
+    // Run event loop until all spawned coroutines are dead
+    int Run(luna::State *state)
+    {
+        GetEventLoop(state)->Run();
+        return 0;
+    }
+
     int Open(luna::State *state)
     {
         luna::StackAPI api(state);
@@ -285,6 +603,7 @@ namespace io {
         auto file = std::fopen(file_name->GetCStr(), mode);
         if (!file)
             return PushError(api);
+        std::setvbuf(file, nullptr, _IOFBF, kFileBufferSize);
 
         auto user_data = state->NewUserData();
         auto metatable = state->GetMetatable(METATABLE_FILE);
@@ -330,16 +649,29 @@ namespace io {
         luna::TableMemberReg file[] = {
             { "close", Close },
             { "flush", Flush },
+            { "lines", Lines },
             { "read", Read },
             { "seek", Seek },
+            { "setnonblocking", SetNonBlocking },
             { "setvbuf", Setvbuf },
             { "write", Write }
         };
 
         lib.RegisterMetatable(METATABLE_FILE, file);
 
+        luna::TableMemberReg async_file[] = {
+            { "close", AsyncClose },
+            { "flush", Flush },
+            { "read", AsyncRead },
+            { "write", AsyncWrite }
+        };
+
+        lib.RegisterMetatable(METATABLE_ASYNC_FILE, async_file);
+
         luna::TableMemberReg io[] = {
             { "open", Open },
+            { "run", Run },
+            { "spawn", Spawn },
             { "stdin", Stdin },
             { "stdout", Stdout },
             { "stderr", Stderr }
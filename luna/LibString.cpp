@@ -1,9 +1,21 @@
 #include "LibString.h"
+#include "Number.h"
+#include "Pack.h"
+#include "Pattern.h"
+#include "State.h"
 #include "String.h"
+#include "Text.h"
+#include "Table.h"
+#include "Exception.h"
 #include <algorithm>
+#include <memory>
 #include <string>
+#include <unordered_map>
 #include <cctype>
 #include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <climits>
 
 namespace lib {
 namespace string {
@@ -84,15 +96,9 @@ namespace string {
             return 0;
 
         auto str = api.GetString(0);
-        auto size = str->GetLength();
-        auto c_str = reinterpret_cast<const unsigned char *>(str->GetCStr());
-
-        std::string lower;
-        lower.reserve(size);
-        for (std::size_t i = 0; i < size; ++i)
-            lower.push_back(std::tolower(c_str[i]));
-
-        api.PushString(lower);
+        api.PushNewString(str->GetLength(), [str](char *buffer) {
+            luna::LowerCase(buffer, str->GetCStr(), str->GetLength());
+        });
         return 1;
     }
 
@@ -103,15 +109,9 @@ namespace string {
             return 0;
 
         auto str = api.GetString(0);
-        auto size = str->GetLength();
-        auto c_str = str->GetCStr();
-
-        std::string reverse;
-        reverse.reserve(size);
-        for (; size > 0; --size)
-            reverse.push_back(c_str[size - 1]);
-
-        api.PushString(reverse);
+        api.PushNewString(str->GetLength(), [str](char *buffer) {
+            luna::Reverse(buffer, str->GetCStr(), str->GetLength());
+        });
         return 1;
     }
 
@@ -148,11 +148,11 @@ namespace string {
             end = std::min(end, size);
         }
 
-        std::string sub;
-        for (int i = start; i <= end; ++i)
-            sub.push_back(c_str[i - 1]);
-
-        api.PushString(sub);
+        // Push substring from the buffer of string directly
+        if (start <= end)
+            api.PushString(c_str + start - 1, end - start + 1);
+        else
+            api.PushString("");
         return 1;
     }
 
@@ -163,31 +163,850 @@ namespace string {
             return 0;
 
         auto str = api.GetString(0);
-        auto size = str->GetLength();
-        auto c_str = reinterpret_cast<const unsigned char *>(str->GetCStr());
+        api.PushNewString(str->GetLength(), [str](char *buffer) {
+            luna::UpperCase(buffer, str->GetCStr(), str->GetLength());
+        });
+        return 1;
+    }
+
+    // Compiled patterns are cached by interned pattern string, source of
+    // pattern is compared on hit since a collected string may leave its
+    // address to another string
+    class PatternCache
+    {
+    public:
+        std::shared_ptr<const Pattern> Get(const luna::String *pattern)
+        {
+            auto it = patterns_.find(pattern);
+            if (it != patterns_.end())
+            {
+                const auto &source = it->second->GetSource();
+                if (source.size() == pattern->GetLength() &&
+                    std::memcmp(source.data(), pattern->GetCStr(), source.size()) == 0)
+                    return it->second;
+            }
+
+            std::shared_ptr<const Pattern> compiled =
+                std::make_shared<Pattern>(pattern->GetCStr(), pattern->GetLength());
+            if (patterns_.size() >= kMaxPatterns)
+                patterns_.clear();
+            patterns_[pattern] = compiled;
+            return compiled;
+        }
+
+    private:
+        static const std::size_t kMaxPatterns = 256;
+
+        std::unordered_map<const luna::String *,
+                           std::shared_ptr<const Pattern>> patterns_;
+    };
+
+    // Patterns are not GC objects, States of one thread share them
+    thread_local PatternCache pattern_cache;
+
+    std::string NumberToString(double num)
+    {
+        char buffer[luna::kNumberBufferSize];
+        auto len = luna::FormatNumber(num, buffer);
+        return std::string(buffer, len);
+    }
+
+    // Offset of optional 1-based position argument 'index' in string of
+    // 'len', negative position counts from the end, position past the
+    // end is offset len + 1
+    std::size_t GetInitOffset(luna::StackAPI &api, int index, std::size_t len)
+    {
+        if (api.GetStackSize() <= index)
+            return 0;
+
+        // Clamp as double, converting huge or NaN number is undefined
+        auto init = api.GetNumber(index);
+        if (init < 0)
+            init += len + 1;
+        if (!(init >= 1))
+            return 0;
+        if (init > len + 1)
+            return len + 1;
+        return static_cast<std::size_t>(init) - 1;
+    }
+
+    // Get capture 'index' of match [s, e), the whole match is the only
+    // capture when pattern has no captures
+    Capture GetCapture(const Pattern &pattern, const char *s, const char *e,
+                       const Capture *captures, int index)
+    {
+        if (index < pattern.GetCaptureCount())
+            return captures[index];
+        if (index != 0)
+            throw luna::CallCFuncException("invalid capture index %", index + 1);
+
+        Capture capture = { s, e - s };
+        return capture;
+    }
+
+    void PushCapture(luna::StackAPI &api, const char *subject,
+                     const Capture &capture)
+    {
+        if (capture.IsPosition())
+            api.PushNumber(capture.begin_ - subject + 1);
+        else
+            api.PushString(capture.begin_, capture.len_);
+    }
+
+    int PushCaptures(luna::StackAPI &api, const Pattern &pattern,
+                     const char *subject, const char *s, const char *e,
+                     const Capture *captures)
+    {
+        int count = std::max(pattern.GetCaptureCount(), 1);
+        for (int i = 0; i < count; ++i)
+            PushCapture(api, subject, GetCapture(pattern, s, e, captures, i));
+        return count;
+    }
+
+    // Find or match pattern in string, find returns positions of match
+    // before captures
+    int DoFind(luna::State *state, bool find)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(2, luna::ValueT_String,
+                           luna::ValueT_String, luna::ValueT_Number))
+            return 0;
+
+        auto str = api.GetString(0);
+        auto offset = GetInitOffset(api, 2, str->GetLength());
+        if (offset > str->GetLength())
+        {
+            api.PushNil();
+            return 1;
+        }
+
+        auto subject = str->GetCStr();
+        auto end = subject + str->GetLength();
+        auto init = subject + offset;
+        auto pattern_str = api.GetString(1);
+
+        // Plain text is searched without compiling pattern
+        bool plain = find && api.GetStackSize() > 3 && !api.GetValue(3)->IsFalse();
+        std::shared_ptr<const Pattern> pattern;
+        if (!plain)
+        {
+            pattern = pattern_cache.Get(pattern_str);
+            plain = find && pattern->IsPlain();
+        }
+
+        if (plain)
+        {
+            auto len = pattern_str->GetLength();
+            auto start = FindText(init, end, pattern_str->GetCStr(), len);
+            if (!start)
+            {
+                api.PushNil();
+                return 1;
+            }
+
+            api.PushNumber(start - subject + 1);
+            api.PushNumber(start - subject + len);
+            return 2;
+        }
+
+        Capture captures[Pattern::kMaxCaptures];
+        const char *e = nullptr;
+        auto start = pattern->Search(subject, end, init, &e, captures);
+        if (!start)
+        {
+            api.PushNil();
+            return 1;
+        }
+
+        if (!find)
+            return PushCaptures(api, *pattern, subject, start, e, captures);
+
+        api.PushNumber(start - subject + 1);
+        api.PushNumber(e - subject);
+        if (pattern->GetCaptureCount() == 0)
+            return 2;
+        return 2 + PushCaptures(api, *pattern, subject, start, e, captures);
+    }
+
+    int Find(luna::State *state)
+    {
+        return DoFind(state, true);
+    }
+
+    int Match(luna::State *state)
+    {
+        return DoFind(state, false);
+    }
+
+    // Step of gmatch iterator, return position of the next step and the
+    // captures of the first match from position 'pos'
+    int GMatchStep(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(2, luna::ValueT_String, luna::ValueT_String))
+            return 0;
+
+        // Iteration is finished
+        if (api.GetStackSize() < 3 || !api.IsNumber(2))
+            return 0;
+
+        auto str = api.GetString(0);
+        auto subject = str->GetCStr();
+        auto end = subject + str->GetLength();
+        auto pos = static_cast<std::size_t>(api.GetNumber(2));
+        if (pos < 1 || pos > str->GetLength() + 1)
+            return 0;
+
+        auto pattern = pattern_cache.Get(api.GetString(1));
+        Capture captures[Pattern::kMaxCaptures];
+        const char *e = nullptr;
+        auto start = pattern->Search(subject, end, subject + pos - 1, &e, captures);
+        if (!start)
+            return 0;
+
+        // Step over empty match, or it matches forever
+        auto next = e == start ? e + 1 : e;
+        api.PushNumber(next - subject + 1);
+        return 1 + PushCaptures(api, *pattern, subject, start, e, captures);
+    }
+
+    void AppendValue(std::string *result, const luna::Value &value,
+                     const char *s, const char *e)
+    {
+        if (value.IsFalse())
+            result->append(s, e);
+        else if (value.type_ == luna::ValueT_String)
+            result->append(value.str_->GetCStr(), value.str_->GetLength());
+        else if (value.type_ == luna::ValueT_Number)
+            result->append(NumberToString(value.num_));
+        else
+            throw luna::CallCFuncException("invalid replacement value (a ",
+                                           value.TypeName(), ")");
+    }
+
+    // Append replacement string which refers captures by %0 ~ %9
+    void AppendReplString(std::string *result, const luna::String *repl,
+                          const Pattern &pattern, const char *subject,
+                          const char *s, const char *e, const Capture *captures)
+    {
+        auto r = repl->GetCStr();
+        auto end = r + repl->GetLength();
+        for (;;)
+        {
+            auto percent = static_cast<const char *>(std::memchr(r, '%', end - r));
+            if (!percent)
+            {
+                result->append(r, end);
+                return ;
+            }
+
+            result->append(r, percent);
+            r = percent + 1;
+            if (r != end && *r == '%')
+            {
+                result->push_back('%');
+            }
+            else if (r != end && *r == '0')
+            {
+                result->append(s, e);
+            }
+            else if (r != end && std::isdigit(static_cast<unsigned char>(*r)))
+            {
+                auto capture = GetCapture(pattern, s, e, captures, *r - '1');
+                if (capture.IsPosition())
+                    result->append(NumberToString(capture.begin_ - subject + 1));
+                else
+                    result->append(capture.begin_, capture.len_);
+            }
+            else
+            {
+                throw luna::CallCFuncException("invalid use of '%' in replacement string");
+            }
+            ++r;
+        }
+    }
+
+    // Append replacement of match [s, e) by argument 'repl' of gsub
+    void AppendReplacement(luna::StackAPI &api, std::string *result,
+                           const Pattern &pattern, const char *subject,
+                           const char *s, const char *e, const Capture *captures)
+    {
+        // Get repl every time, stack may grow in function replacement
+        auto repl = api.GetValue(2);
+        if (repl->type_ == luna::ValueT_String)
+        {
+            AppendReplString(result, repl->str_, pattern,
+                             subject, s, e, captures);
+        }
+        else if (repl->type_ == luna::ValueT_Number)
+        {
+            result->append(NumberToString(repl->num_));
+        }
+        else if (repl->type_ == luna::ValueT_Table)
+        {
+            auto table = repl->table_;
+            PushCapture(api, subject, GetCapture(pattern, s, e, captures, 0));
+            auto value = table->GetValue(*api.GetValue(-1));
+            api.Pop(1);
+            AppendValue(result, value, s, e);
+        }
+        else
+        {
+            api.PushValue(*repl);
+            int count = PushCaptures(api, pattern, subject, s, e, captures);
+            api.Call(count, 1);
+            auto value = *api.GetValue(-1);
+            api.Pop(1);
+            AppendValue(result, value, s, e);
+        }
+    }
+
+    int GSub(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(3, luna::ValueT_String, luna::ValueT_String))
+            return 0;
+
+        auto repl_type = api.GetValueType(2);
+        if (repl_type != luna::ValueT_String &&
+            repl_type != luna::ValueT_Number &&
+            repl_type != luna::ValueT_Table &&
+            repl_type != luna::ValueT_Closure &&
+            repl_type != luna::ValueT_CFunction)
+        {
+            api.ArgTypeError(2, luna::ValueT_String);
+            return 0;
+        }
+
+        long long max_count = LLONG_MAX;
+        if (api.GetStackSize() > 3)
+        {
+            if (!api.IsNumber(3))
+            {
+                api.ArgTypeError(3, luna::ValueT_Number);
+                return 0;
+            }
+            max_count = static_cast<long long>(api.GetNumber(3));
+        }
+
+        auto str = api.GetString(0);
+        auto subject = str->GetCStr();
+        auto end = subject + str->GetLength();
+        auto pattern = pattern_cache.Get(api.GetString(1));
+        Capture captures[Pattern::kMaxCaptures];
+
+        // Unmatched text and replacements are appended to one buffer
+        std::string result;
+        result.reserve(str->GetLength());
+
+        long long count = 0;
+        auto s = subject;
+        while (count < max_count)
+        {
+            const char *e = nullptr;
+            auto start = pattern->Search(subject, end, s, &e, captures);
+            if (!start)
+                break;
+
+            result.append(s, start);
+            AppendReplacement(api, &result, *pattern, subject, start, e, captures);
+            ++count;
+
+            if (e > start)
+            {
+                s = e;
+            }
+            else if (start < end)
+            {
+                // Keep the character after empty match
+                result.push_back(*start);
+                s = start + 1;
+            }
+            else
+            {
+                s = end;
+                break;
+            }
+
+            if (pattern->IsAnchored())
+                break;
+        }
+
+        result.append(s, end);
+        api.PushString(result);
+        api.PushNumber(count);
+        return 2;
+    }
 
-        std::string upper;
-        upper.reserve(size);
-        for (std::size_t i = 0; i < size; ++i)
-            upper.push_back(std::toupper(c_str[i]));
+    void AppendQuoted(std::string *result, const luna::String *str)
+    {
+        auto s = str->GetCStr();
+        auto end = s + str->GetLength();
+        result->push_back('"');
+        for (; s != end; ++s)
+        {
+            switch (*s)
+            {
+                case '"': case '\\': case '\n':
+                    result->push_back('\\');
+                    result->push_back(*s);
+                    break;
+                case '\r':
+                    result->append("\\r");
+                    break;
+                case '\0':
+                    result->append("\\000");
+                    break;
+                default:
+                    result->push_back(*s);
+                    break;
+            }
+        }
+        result->push_back('"');
+    }
+
+    int Format(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(1, luna::ValueT_String))
+            return 0;
+
+        auto format = api.GetString(0);
+        auto p = format->GetCStr();
+        auto end = p + format->GetLength();
+        int arg = 1;
+
+        std::string result;
+        result.reserve(format->GetLength());
+
+        for (;;)
+        {
+            auto percent = static_cast<const char *>(std::memchr(p, '%', end - p));
+            if (!percent)
+            {
+                result.append(p, end);
+                break;
+            }
+
+            result.append(p, percent);
+            p = percent + 1;
+            if (p != end && *p == '%')
+            {
+                result.push_back('%');
+                ++p;
+                continue;
+            }
+
+            // Flags, width and precision are passed to snprintf
+            auto spec_begin = p;
+            while (p != end && *p != '\0' && std::strchr("-+ #0", *p))
+                ++p;
+            for (int i = 0; i < 2 && p != end && std::isdigit(static_cast<unsigned char>(*p)); ++i)
+                ++p;
+            if (p != end && *p == '.')
+            {
+                ++p;
+                for (int i = 0; i < 2 && p != end && std::isdigit(static_cast<unsigned char>(*p)); ++i)
+                    ++p;
+            }
+
+            if (p == end || p - spec_begin > 8)
+                throw luna::CallCFuncException("invalid format to 'format'");
+
+            char conversion = *p++;
+            std::string spec = "%" + std::string(spec_begin, p - 1);
+
+            if (arg >= api.GetStackSize())
+                throw luna::CallCFuncException("bad argument #", arg + 1,
+                                               " to 'format' (no value)");
+
+            char buf[512];
+            int len = 0;
+            switch (conversion)
+            {
+                case 'c': case 'd': case 'i':
+                case 'o': case 'u': case 'x': case 'X':
+                    if (!api.IsNumber(arg))
+                    {
+                        api.ArgTypeError(arg, luna::ValueT_Number);
+                        return 0;
+                    }
+                    if (conversion == 'c')
+                    {
+                        spec.push_back('c');
+                        len = snprintf(buf, sizeof(buf), spec.c_str(),
+                                       static_cast<int>(api.GetNumber(arg)));
+                    }
+                    else
+                    {
+                        spec.append("ll");
+                        spec.push_back(conversion);
+                        len = snprintf(buf, sizeof(buf), spec.c_str(),
+                                       static_cast<long long>(api.GetNumber(arg)));
+                    }
+                    break;
+                case 'a': case 'A': case 'e': case 'E':
+                case 'f': case 'g': case 'G':
+                    if (!api.IsNumber(arg))
+                    {
+                        api.ArgTypeError(arg, luna::ValueT_Number);
+                        return 0;
+                    }
+                    spec.push_back(conversion);
+                    len = snprintf(buf, sizeof(buf), spec.c_str(), api.GetNumber(arg));
+                    break;
+                case 'q':
+                    if (!api.IsString(arg))
+                    {
+                        api.ArgTypeError(arg, luna::ValueT_String);
+                        return 0;
+                    }
+                    AppendQuoted(&result, api.GetString(arg));
+                    break;
+                case 's':
+                    {
+                        std::string num;
+                        const char *s = nullptr;
+                        std::size_t size = 0;
+                        if (api.IsNumber(arg))
+                        {
+                            num = NumberToString(api.GetNumber(arg));
+                            s = num.c_str();
+                            size = num.size();
+                        }
+                        else if (api.IsString(arg))
+                        {
+                            s = api.GetString(arg)->GetCStr();
+                            size = api.GetString(arg)->GetLength();
+                        }
+                        else
+                        {
+                            api.ArgTypeError(arg, luna::ValueT_String);
+                            return 0;
+                        }
+
+                        // Plain %s appends string directly
+                        if (spec.size() == 1)
+                        {
+                            result.append(s, size);
+                        }
+                        else
+                        {
+                            spec.push_back('s');
+                            std::string formatted(std::max(size, sizeof(buf)) + 1, '\0');
+                            len = snprintf(&formatted[0], formatted.size(), spec.c_str(), s);
+                            result.append(formatted.data(), len);
+                            len = 0;
+                        }
+                    }
+                    break;
+                default:
+                    throw luna::CallCFuncException("invalid option '%", conversion,
+                                                   "' to 'format'");
+            }
 
-        api.PushString(upper);
+            result.append(buf, len);
+            ++arg;
+        }
+
+        api.PushString(result);
+        return 1;
+    }
+
+    // Get argument 'arg' of 'pack' which type must be 'type'
+    const luna::Value * GetPackArg(luna::StackAPI &api, int arg, luna::ValueT type)
+    {
+        if (arg >= api.GetStackSize())
+            throw luna::CallCFuncException("bad argument #", arg + 1,
+                                           " to 'pack' (no value)");
+
+        auto value = api.GetValue(arg);
+        if (value->type_ != type)
+            throw luna::CallCFuncException("bad argument #", arg + 1,
+                    " to 'pack' (", luna::Value::TypeName(type),
+                    " expected, got ", value->TypeName(), ")");
+        return value;
+    }
+
+    // Integer of number 'num' packed by integer option
+    uint64_t ToPackInt(double num, const PackOption &option, int arg)
+    {
+        if (num != std::floor(num) ||
+            !(num >= -9223372036854775808.0 && num < 18446744073709551616.0))
+            throw luna::CallCFuncException("bad argument #", arg + 1,
+                    " to 'pack' (number has no integer representation)");
+
+        auto is_signed = option.kind_ == PackOption::Int;
+        auto overflow = false;
+        if (option.size_ < 8)
+        {
+            auto limit = std::ldexp(1.0, option.size_ * 8 - (is_signed ? 1 : 0));
+            overflow = num >= limit || num < (is_signed ? -limit : 0.0);
+        }
+        else
+        {
+            overflow = is_signed && num >= 9223372036854775808.0;
+        }
+
+        if (overflow)
+            throw luna::CallCFuncException("bad argument #", arg + 1,
+                    " to 'pack' (integer overflow)");
+
+        if (num < 0.0)
+            return static_cast<uint64_t>(static_cast<int64_t>(num));
+        return static_cast<uint64_t>(num);
+    }
+
+    int Pack(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(1, luna::ValueT_String))
+            return 0;
+
+        auto format = api.GetString(0);
+        PackFormat reader(format->GetCStr(), format->GetLength());
+        PackOption option;
+        std::string result;
+        int arg = 1;
+
+        while (reader.Next(result.size(), option))
+        {
+            result.append(option.padding_, '\0');
+            auto size = result.size();
+            switch (option.kind_)
+            {
+                case PackOption::Int: case PackOption::Uint:
+                    {
+                        auto num = GetPackArg(api, arg, luna::ValueT_Number)->num_;
+                        result.resize(size + option.size_);
+                        PackInt(&result[size], ToPackInt(num, option, arg),
+                                option.size_, option.little_);
+                        ++arg;
+                    }
+                    break;
+                case PackOption::Float:
+                    {
+                        float f = static_cast<float>(
+                            GetPackArg(api, arg++, luna::ValueT_Number)->num_);
+                        uint32_t bits = 0;
+                        std::memcpy(&bits, &f, sizeof(f));
+                        result.resize(size + sizeof(bits));
+                        PackInt(&result[size], bits, sizeof(bits), option.little_);
+                    }
+                    break;
+                case PackOption::Double:
+                    {
+                        double d = GetPackArg(api, arg++, luna::ValueT_Number)->num_;
+                        uint64_t bits = 0;
+                        std::memcpy(&bits, &d, sizeof(d));
+                        result.resize(size + sizeof(bits));
+                        PackInt(&result[size], bits, sizeof(bits), option.little_);
+                    }
+                    break;
+                case PackOption::Char:
+                    {
+                        auto str = GetPackArg(api, arg, luna::ValueT_String)->str_;
+                        if (str->GetLength() > option.size_)
+                            throw luna::CallCFuncException("bad argument #", arg + 1,
+                                    " to 'pack' (string longer than given size)");
+                        result.append(str->GetCStr(), str->GetLength());
+                        result.append(option.size_ - str->GetLength(), '\0');
+                        ++arg;
+                    }
+                    break;
+                case PackOption::String:
+                    {
+                        auto str = GetPackArg(api, arg, luna::ValueT_String)->str_;
+                        uint64_t len = str->GetLength();
+                        if (option.size_ < 8 && len >> (option.size_ * 8) != 0)
+                            throw luna::CallCFuncException("bad argument #", arg + 1,
+                                    " to 'pack' (string length does not fit in given size)");
+                        result.resize(size + option.size_);
+                        PackInt(&result[size], len, option.size_, option.little_);
+                        result.append(str->GetCStr(), str->GetLength());
+                        ++arg;
+                    }
+                    break;
+                case PackOption::ZString:
+                    {
+                        auto str = GetPackArg(api, arg, luna::ValueT_String)->str_;
+                        if (std::memchr(str->GetCStr(), '\0', str->GetLength()))
+                            throw luna::CallCFuncException("bad argument #", arg + 1,
+                                    " to 'pack' (string contains zeros)");
+                        result.append(str->GetCStr(), str->GetLength() + 1);
+                        ++arg;
+                    }
+                    break;
+                case PackOption::Padding:
+                    result.push_back('\0');
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        api.PushString(result);
         return 1;
     }
 
+    int PackSize(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(1, luna::ValueT_String))
+            return 0;
+
+        auto format = api.GetString(0);
+        PackFormat reader(format->GetCStr(), format->GetLength());
+        PackOption option;
+        std::size_t size = 0;
+
+        while (reader.Next(size, option))
+        {
+            if (option.kind_ == PackOption::String ||
+                option.kind_ == PackOption::ZString)
+                throw luna::CallCFuncException("variable-length format in 'packsize'");
+            size += option.padding_ + option.size_;
+        }
+
+        api.PushNumber(size);
+        return 1;
+    }
+
+    // unpack(format, s [, pos]), values are read from the string in
+    // place, return the values and position after them
+    int Unpack(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(2, luna::ValueT_String,
+                           luna::ValueT_String, luna::ValueT_Number))
+            return 0;
+
+        auto format = api.GetString(0);
+        auto data = api.GetString(1);
+        auto s = data->GetCStr();
+        auto len = data->GetLength();
+
+        // Position is in the string or just past its end, negative
+        // position counts from the end
+        double pos = api.GetStackSize() > 2 ? api.GetNumber(2) : 1;
+        if (pos < 0)
+            pos += len + 1;
+        if (!(pos >= 1 && pos <= len + 1))
+            throw luna::CallCFuncException("bad argument #3 to 'unpack' "
+                                           "(initial position out of string)");
+        auto offset = static_cast<std::size_t>(pos) - 1;
+
+        PackFormat reader(format->GetCStr(), format->GetLength());
+        PackOption option;
+        int count = 0;
+
+        while (reader.Next(offset, option))
+        {
+            auto size = option.size_;
+            if (option.padding_ + size > len - offset)
+                throw luna::CallCFuncException("data string too short");
+            offset += option.padding_;
+
+            auto p = s + offset;
+            switch (option.kind_)
+            {
+                case PackOption::Int:
+                    api.PushNumber(static_cast<int64_t>(
+                        UnpackInt(p, size, option.little_, true)));
+                    break;
+                case PackOption::Uint:
+                    api.PushNumber(UnpackInt(p, size, option.little_, false));
+                    break;
+                case PackOption::Float:
+                    {
+                        auto bits = static_cast<uint32_t>(
+                            UnpackInt(p, size, option.little_, false));
+                        float f = 0.0f;
+                        std::memcpy(&f, &bits, sizeof(f));
+                        api.PushNumber(f);
+                    }
+                    break;
+                case PackOption::Double:
+                    {
+                        auto bits = UnpackInt(p, size, option.little_, false);
+                        double d = 0.0;
+                        std::memcpy(&d, &bits, sizeof(d));
+                        api.PushNumber(d);
+                    }
+                    break;
+                case PackOption::Char:
+                    api.PushString(p, size);
+                    break;
+                case PackOption::String:
+                    {
+                        auto str_len = UnpackInt(p, size, option.little_, false);
+                        if (str_len > len - offset - size)
+                            throw luna::CallCFuncException("data string too short");
+                        api.PushString(p + size, str_len);
+                        offset += str_len;
+                    }
+                    break;
+                case PackOption::ZString:
+                    {
+                        auto zero = static_cast<const char *>(
+                            std::memchr(p, '\0', len - offset));
+                        if (!zero)
+                            throw luna::CallCFuncException("unfinished string for format 'z'");
+                        api.PushString(p, zero - p);
+                        offset += zero - p + 1;
+                    }
+                    break;
+                default:
+                    offset += size;
+                    continue;
+            }
+
+            offset += size;
+            ++count;
+        }
+
+        api.PushNumber(offset + 1);
+        return count + 1;
+    }
+
+    // Iterator of gmatch keeps position of next step as upvalue, so
+    // gmatch is a closure
+    const char *kGMatch =
+        "local step = string.__gmatchstep\n"
+        "string.__gmatchstep = nil\n"
+        "string.gmatch = function(s, p)\n"
+        "    local pos = 1\n"
+        "    local function update(n, ...)\n"
+        "        pos = n\n"
+        "        return ...\n"
+        "    end\n"
+        "    return function()\n"
+        "        return update(step(s, p, pos))\n"
+        "    end\n"
+        "end\n";
+
     void RegisterLibString(luna::State *state)
     {
         luna::Library lib(state);
         luna::TableMemberReg string[] = {
             { "byte", Byte },
             { "char", Char },
+            { "find", Find },
+            { "format", Format },
+            { "gsub", GSub },
             { "len", Len },
             { "lower", Lower },
+            { "match", Match },
+            { "pack", Pack },
+            { "packsize", PackSize },
             { "reverse", Reverse },
             { "sub", Sub },
-            { "upper", Upper }
+            { "unpack", Unpack },
+            { "upper", Upper },
+            { "__gmatchstep", GMatchStep }
         };
         lib.RegisterTableFunction("string", string);
+        lib.RunScript(kGMatch, "string");
     }
 
 } // namespace string
@@ -1,7 +1,15 @@
 #include "LibTable.h"
+#include "Pack.h"
 #include "State.h"
 #include "Table.h"
-#include <sstream>
+#include "String.h"
+#include "Exception.h"
+#include "Number.h"
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <string.h>
 
 namespace lib {
 namespace table {
@@ -28,7 +36,7 @@ namespace table {
             return 0;
 
         auto table = api.GetTable(0);
-        const char *sep = "";
+        const luna::String *sep = nullptr;
         std::size_t i = 1;
         std::size_t j = table->ArraySize();
 
@@ -38,7 +46,7 @@ namespace table {
             // If the value of index 1 is string, then get the string as sep
             if (api.IsString(1))
             {
-                sep = api.GetString(1)->GetCStr();
+                sep = api.GetString(1);
 
                 // Try to get the range of table
                 if (params > 2 && !GetNumber(api, 2, i))
@@ -58,25 +66,71 @@ namespace table {
             }
         }
 
-        luna::Value key;
-        key.type_ = luna::ValueT_Number;
+        // Values in array part are read directly
+        auto array = table->GetArrayValues();
+        auto array_size = table->ArraySize();
+        auto get_value = [=](std::size_t index) -> luna::Value {
+            if (index >= 1 && index <= array_size)
+                return array[index - 1];
+
+            luna::Value key;
+            key.type_ = luna::ValueT_Number;
+            key.num_ = index;
+            return table->GetValue(key);
+        };
 
-        // Concat values(number or string) of the range [i, j]
-        std::ostringstream oss;
-        for (; i <= j; ++i)
+        // Calculate length of result, numbers are formatted only once
+        // into 'numbers'
+        std::string numbers;
+        std::vector<unsigned char> number_lengths;
+        std::size_t length = 0;
+        for (auto index = i; index <= j; ++index)
         {
-            key.num_ = i;
-            auto value = table->GetValue(key);
-
+            auto value = get_value(index);
             if (value.type_ == luna::ValueT_Number)
-                oss << value.num_;
+            {
+                char buffer[luna::kNumberBufferSize];
+                auto len = luna::FormatNumber(value.num_, buffer);
+                numbers.append(buffer, len);
+                number_lengths.push_back(static_cast<unsigned char>(len));
+                length += len;
+            }
             else if (value.type_ == luna::ValueT_String)
-                oss << value.str_->GetCStr();
-
-            if (i != j) oss << sep;
+            {
+                length += value.str_->GetLength();
+            }
         }
 
-        api.PushString(oss.str());
+        if (sep && i < j)
+            length += sep->GetLength() * (j - i);
+
+        // Concat values(number or string) of the range [i, j] into the
+        // buffer of result string
+        api.PushNewString(length, [&](char *dst) {
+            auto number = numbers.data();
+            auto number_len = number_lengths.data();
+            for (auto index = i; index <= j; ++index)
+            {
+                auto value = get_value(index);
+                if (value.type_ == luna::ValueT_Number)
+                {
+                    memcpy(dst, number, *number_len);
+                    dst += *number_len;
+                    number += *number_len++;
+                }
+                else if (value.type_ == luna::ValueT_String)
+                {
+                    memcpy(dst, value.str_->GetCStr(), value.str_->GetLength());
+                    dst += value.str_->GetLength();
+                }
+
+                if (index != j && sep)
+                {
+                    memcpy(dst, sep->GetCStr(), sep->GetLength());
+                    dst += sep->GetLength();
+                }
+            }
+        });
         return 1;
     }
 
@@ -99,7 +153,61 @@ namespace table {
             value = 2;
         }
 
-        api.PushBool(table->InsertArrayValue(index, *api.GetValue(value)));
+        auto v = api.GetValue(value);
+        api.PushBool(table->InsertArrayValue(index, *v));
+        CHECK_BARRIER_VALUE(state->GetGC(), table, *v);
+        return 1;
+    }
+
+    int Move(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(4, luna::ValueT_Table, luna::ValueT_Number,
+                           luna::ValueT_Number, luna::ValueT_Number,
+                           luna::ValueT_Table))
+            return 0;
+
+        auto params = api.GetStackSize();
+        auto src = api.GetTable(0);
+        auto dest = params > 4 ? api.GetTable(4) : src;
+        auto first = api.GetNumber(1);
+        auto last = api.GetNumber(2);
+        auto to = api.GetNumber(3);
+
+        // Move in one pass when the ranges are in array part of tables
+        if (first < 1 || last < first || to < 1 ||
+            !src->MoveArrayValues(static_cast<std::size_t>(first),
+                                  static_cast<std::size_t>(last),
+                                  static_cast<std::size_t>(to), dest))
+        {
+            luna::Value src_key;
+            luna::Value dest_key;
+            src_key.type_ = luna::ValueT_Number;
+            dest_key.type_ = luna::ValueT_Number;
+
+            // Move values in proper direction when ranges are overlapped
+            if (dest != src || to <= first || to > last)
+            {
+                for (double i = 0; first + i <= last; ++i)
+                {
+                    src_key.num_ = first + i;
+                    dest_key.num_ = to + i;
+                    dest->SetValue(dest_key, src->GetValue(src_key));
+                }
+            }
+            else
+            {
+                for (double i = last - first; i >= 0; --i)
+                {
+                    src_key.num_ = first + i;
+                    dest_key.num_ = to + i;
+                    dest->SetValue(dest_key, src->GetValue(src_key));
+                }
+            }
+        }
+
+        CHECK_BARRIER(state->GetGC(), dest);
+        api.PushTable(dest);
         return 1;
     }
 
@@ -140,6 +248,253 @@ namespace table {
         return 1;
     }
 
+    // Introsort of 'values' by 'less': quicksort with median of three
+    // pivot, heapsort when partitions get too deep, and insertion sort of
+    // short ranges. Scans are bounded, so an inconsistent 'less' reports
+    // error instead of running out of range.
+    template<typename T, typename Less>
+    class Sorter
+    {
+    public:
+        Sorter(T *values, Less less) : values_(values), less_(less) { }
+
+        void Sort(std::size_t size)
+        {
+            if (size < 2)
+                return ;
+
+            int depth = 0;
+            for (auto n = size; n > 1; n >>= 1)
+                depth += 2;
+            IntroSort(0, size - 1, depth);
+        }
+
+    private:
+        static const std::size_t kInsertionSortSize = 16;
+
+        void Swap(std::size_t i, std::size_t j)
+        {
+            std::swap(values_[i], values_[j]);
+        }
+
+        static void InvalidOrder()
+        {
+            throw luna::CallCFuncException("invalid order function for sorting");
+        }
+
+        void IntroSort(std::size_t lo, std::size_t hi, int depth)
+        {
+            while (hi - lo >= kInsertionSortSize)
+            {
+                if (depth-- == 0)
+                {
+                    HeapSort(lo, hi);
+                    return ;
+                }
+
+                // Recurse into the smaller part, loop on the larger part
+                auto p = Partition(lo, hi);
+                if (p - lo < hi - p)
+                {
+                    IntroSort(lo, p - 1, depth);
+                    lo = p + 1;
+                }
+                else
+                {
+                    IntroSort(p + 1, hi, depth);
+                    hi = p - 1;
+                }
+            }
+            InsertionSort(lo, hi);
+        }
+
+        // Partition [lo, hi] which has more than 3 values, return index
+        // of pivot, which is in (lo, hi)
+        std::size_t Partition(std::size_t lo, std::size_t hi)
+        {
+            auto mid = lo + (hi - lo) / 2;
+            if (less_(values_[mid], values_[lo]))
+                Swap(mid, lo);
+            if (less_(values_[hi], values_[mid]))
+            {
+                Swap(hi, mid);
+                if (less_(values_[mid], values_[lo]))
+                    Swap(mid, lo);
+            }
+
+            // values_[lo] and values_[hi] are sentinels of scans, pivot
+            // is kept at hi - 1
+            Swap(mid, hi - 1);
+            T pivot = values_[hi - 1];
+            auto i = lo;
+            auto j = hi - 1;
+            for (;;)
+            {
+                while (less_(values_[++i], pivot))
+                {
+                    if (i == hi - 1)
+                        InvalidOrder();
+                }
+                while (less_(pivot, values_[--j]))
+                {
+                    if (j == lo)
+                        InvalidOrder();
+                }
+                if (j < i)
+                    break;
+                Swap(i, j);
+            }
+
+            Swap(i, hi - 1);
+            return i;
+        }
+
+        void InsertionSort(std::size_t lo, std::size_t hi)
+        {
+            for (auto i = lo + 1; i <= hi; ++i)
+            {
+                T value = values_[i];
+                auto j = i;
+                for (; j > lo && less_(value, values_[j - 1]); --j)
+                    values_[j] = values_[j - 1];
+                values_[j] = value;
+            }
+        }
+
+        void SiftDown(std::size_t lo, std::size_t root, std::size_t size)
+        {
+            for (;;)
+            {
+                auto child = 2 * root + 1;
+                if (child >= size)
+                    break;
+                if (child + 1 < size &&
+                    less_(values_[lo + child], values_[lo + child + 1]))
+                    ++child;
+                if (!less_(values_[lo + root], values_[lo + child]))
+                    break;
+                Swap(lo + root, lo + child);
+                root = child;
+            }
+        }
+
+        void HeapSort(std::size_t lo, std::size_t hi)
+        {
+            auto size = hi - lo + 1;
+            for (auto i = size / 2; i > 0; --i)
+                SiftDown(lo, i - 1, size);
+            for (auto i = size - 1; i > 0; --i)
+            {
+                Swap(lo, lo + i);
+                SiftDown(lo, 0, i);
+            }
+        }
+
+        T *values_;
+        Less less_;
+    };
+
+    template<typename T, typename Less>
+    void SortValues(T *values, std::size_t size, Less less)
+    {
+        Sorter<T, Less> sorter(values, less);
+        sorter.Sort(size);
+    }
+
+    void CompareError(const luna::Value &left, const luna::Value &right)
+    {
+        throw luna::CallCFuncException("attempt to compare ", left.TypeName(),
+                                       " with ", right.TypeName());
+    }
+
+    // Sort array of numbers or array of strings without comparator
+    void SortArray(luna::Value *values, std::size_t size)
+    {
+        auto type = values[0].type_;
+        for (std::size_t i = 1; i < size; ++i)
+        {
+            if (values[i].type_ != type)
+                CompareError(values[0], values[i]);
+        }
+
+        if (type == luna::ValueT_Number)
+        {
+            // Sort unboxed numbers, which are denser than values
+            std::vector<double> numbers(size);
+            for (std::size_t i = 0; i < size; ++i)
+                numbers[i] = values[i].num_;
+
+            SortValues(numbers.data(), size,
+                       [](double l, double r) { return l < r; });
+
+            for (std::size_t i = 0; i < size; ++i)
+                values[i] = luna::Value(numbers[i]);
+        }
+        else if (type == luna::ValueT_String)
+        {
+            SortValues(values, size,
+                       [](const luna::Value &l, const luna::Value &r) {
+                           return l.str_ != r.str_ && *l.str_ < *r.str_;
+                       });
+        }
+        else
+        {
+            CompareError(values[0], values[0]);
+        }
+    }
+
+    int Sort(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(1, luna::ValueT_Table))
+            return 0;
+
+        auto table = api.GetTable(0);
+        auto size = table->ArraySize();
+        bool has_comparator = api.GetStackSize() > 1 &&
+            api.GetValueType(1) != luna::ValueT_Nil;
+        if (has_comparator && !api.IsClosure(1) && !api.IsCFunction(1))
+        {
+            api.ArgTypeError(1, luna::ValueT_Closure);
+            return 0;
+        }
+
+        if (size < 2)
+            return 0;
+
+        if (!has_comparator)
+        {
+            // No script runs while sorting, so sort array in place
+            SortArray(table->GetArrayValues(), size);
+            return 0;
+        }
+
+        // Comparator may change the table, so sort a copy of the array
+        // in a new table, which keeps the values alive
+        auto sorted = state->NewTable();
+        api.PushTable(sorted);
+        sorted->SetArrayValues(1, table->GetArrayValues(), size);
+
+        SortValues(sorted->GetArrayValues(), size,
+                   [&api](const luna::Value &l, const luna::Value &r) {
+                       api.PushValue(*api.GetValue(1));
+                       api.PushValue(l);
+                       api.PushValue(r);
+                       api.Call(2, 1);
+                       bool less = !api.GetValue(-1)->IsFalse();
+                       api.Pop(1);
+                       return less;
+                   });
+
+        auto values = sorted->GetArrayValues();
+        if (table->ArraySize() >= size)
+            std::copy(values, values + size, table->GetArrayValues());
+        else
+            table->SetArrayValues(1, values, size);
+        CHECK_BARRIER(state->GetGC(), table);
+        return 0;
+    }
+
     int Unpack(luna::State *state)
     {
         luna::StackAPI api(state);
@@ -170,14 +525,319 @@ namespace table {
         return count;
     }
 
+    // Binary encoding of values, each value is a tag byte and the data
+    // of tag. Table is the count and values of array part, and then
+    // key-value pairs of hash part which end with nil.
+    enum SerializeTag
+    {
+        SerializeTag_Nil,
+        SerializeTag_False,
+        SerializeTag_True,
+        SerializeTag_Integer,       // zigzag varint
+        SerializeTag_Number,        // 8 bytes of double in little endian
+        SerializeTag_String,        // varint length and bytes
+        SerializeTag_Table,
+    };
+
+    // Nested levels of tables, cyclic tables reach it
+    const int kMaxSerializeDepth = 200;
+
+    class Serializer
+    {
+    public:
+        explicit Serializer(std::string &out) : out_(out) { }
+
+        void Write(const luna::Value &value, int depth)
+        {
+            switch (value.type_)
+            {
+                case luna::ValueT_Nil:
+                    out_.push_back(SerializeTag_Nil);
+                    break;
+                case luna::ValueT_Bool:
+                    out_.push_back(value.bvalue_ ? SerializeTag_True : SerializeTag_False);
+                    break;
+                case luna::ValueT_Number:
+                    WriteNumber(value.num_);
+                    break;
+                case luna::ValueT_String:
+                    out_.push_back(SerializeTag_String);
+                    WriteVarint(value.str_->GetLength());
+                    out_.append(value.str_->GetCStr(), value.str_->GetLength());
+                    break;
+                case luna::ValueT_Table:
+                    WriteTable(value.table_, depth + 1);
+                    break;
+                default:
+                    throw luna::CallCFuncException("can not serialize ",
+                                                   value.TypeName(), " value");
+            }
+        }
+
+    private:
+        void WriteVarint(uint64_t value)
+        {
+            while (value >= 0x80)
+            {
+                out_.push_back(static_cast<char>(value | 0x80));
+                value >>= 7;
+            }
+            out_.push_back(static_cast<char>(value));
+        }
+
+        void WriteNumber(double num)
+        {
+            // Integers in the exact range of double are varints, -0 keeps
+            // its sign as double
+            if (num == std::floor(num) && std::fabs(num) <= 9007199254740992.0 &&
+                !(num == 0.0 && std::signbit(num)))
+            {
+                auto value = static_cast<int64_t>(num);
+                out_.push_back(SerializeTag_Integer);
+                WriteVarint((static_cast<uint64_t>(value) << 1) ^
+                            static_cast<uint64_t>(value >> 63));
+                return ;
+            }
+
+            uint64_t bits = 0;
+            memcpy(&bits, &num, sizeof(num));
+            out_.push_back(SerializeTag_Number);
+            auto size = out_.size();
+            out_.resize(size + sizeof(bits));
+            lib::string::PackInt(&out_[size], bits, sizeof(bits), true);
+        }
+
+        void WriteTable(luna::Table *table, int depth)
+        {
+            if (depth > kMaxSerializeDepth)
+                throw luna::CallCFuncException("table nested too deep to serialize");
+
+            out_.push_back(SerializeTag_Table);
+
+            // Array part is written directly
+            auto size = table->ArraySize();
+            auto values = table->GetArrayValues();
+            WriteVarint(size);
+            for (std::size_t i = 0; i < size; ++i)
+                Write(values[i], depth);
+
+            // Hash part is iterated from the key after the array part
+            luna::Value key;
+            luna::Value value;
+            luna::Value next_key;
+            bool more = size > 0 ?
+                table->NextKeyValue(luna::Value(static_cast<double>(size)), key, value) :
+                table->FirstKeyValue(key, value);
+            while (more)
+            {
+                if (!value.IsNil())
+                {
+                    Write(key, depth);
+                    Write(value, depth);
+                }
+                more = table->NextKeyValue(key, next_key, value);
+                key = next_key;
+            }
+            out_.push_back(SerializeTag_Nil);
+        }
+
+        std::string &out_;
+    };
+
+    class Deserializer
+    {
+    public:
+        Deserializer(luna::State *state, const char *begin, const char *end)
+            : state_(state), current_(begin), end_(end)
+        {
+        }
+
+        const char * GetCurrent() const { return current_; }
+
+        luna::Value Read(int depth)
+        {
+            switch (ReadByte())
+            {
+                case SerializeTag_Nil:
+                    return luna::Value();
+                case SerializeTag_False:
+                    return luna::Value(false);
+                case SerializeTag_True:
+                    return luna::Value(true);
+                case SerializeTag_Integer:
+                    {
+                        auto value = ReadVarint();
+                        auto num = static_cast<int64_t>(value >> 1) ^
+                            -static_cast<int64_t>(value & 1);
+                        return luna::Value(static_cast<double>(num));
+                    }
+                case SerializeTag_Number:
+                    {
+                        CheckRemain(sizeof(uint64_t));
+                        auto bits = lib::string::UnpackInt(current_, sizeof(uint64_t),
+                                                           true, false);
+                        current_ += sizeof(bits);
+                        double num = 0.0;
+                        memcpy(&num, &bits, sizeof(num));
+                        return luna::Value(num);
+                    }
+                case SerializeTag_String:
+                    {
+                        auto len = ReadVarint();
+                        CheckRemain(len);
+                        auto str = state_->GetString(current_, len);
+                        current_ += len;
+                        return luna::Value(str);
+                    }
+                case SerializeTag_Table:
+                    return luna::Value(ReadTable(depth + 1));
+                default:
+                    throw luna::CallCFuncException("invalid serialized data");
+            }
+        }
+
+    private:
+        unsigned char ReadByte()
+        {
+            CheckRemain(1);
+            return static_cast<unsigned char>(*current_++);
+        }
+
+        uint64_t ReadVarint()
+        {
+            uint64_t value = 0;
+            for (int shift = 0; shift < 64; shift += 7)
+            {
+                auto byte = ReadByte();
+                value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+                if (!(byte & 0x80))
+                    return value;
+            }
+            throw luna::CallCFuncException("invalid serialized data");
+        }
+
+        void CheckRemain(uint64_t len)
+        {
+            if (len > static_cast<uint64_t>(end_ - current_))
+                throw luna::CallCFuncException("serialized data too short");
+        }
+
+        luna::Table * ReadTable(int depth)
+        {
+            if (depth > kMaxSerializeDepth)
+                throw luna::CallCFuncException("table nested too deep to deserialize");
+
+            // Each value takes one byte at least
+            auto size = ReadVarint();
+            CheckRemain(size);
+
+            std::vector<luna::Value> values;
+            values.reserve(size);
+            for (uint64_t i = 0; i < size; ++i)
+                values.push_back(Read(depth));
+
+            auto table = state_->NewTable();
+            if (size > 0)
+                table->SetArrayValues(1, values.data(), values.size());
+
+            for (;;)
+            {
+                auto key = Read(depth);
+                if (key.IsNil())
+                    break;
+                if (key.type_ == luna::ValueT_Number && key.num_ != key.num_)
+                    throw luna::CallCFuncException("invalid serialized data");
+                table->SetValue(key, Read(depth));
+            }
+
+            CHECK_BARRIER(state_->GetGC(), table);
+            return table;
+        }
+
+        luna::State *state_;
+        const char *current_;
+        const char *end_;
+    };
+
+    // serialize(value), encode nil, boolean, number, string and tables of
+    // them into binary string
+    int Serialize(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(1))
+            return 0;
+
+        std::string result;
+        Serializer serializer(result);
+        serializer.Write(*api.GetValue(0), 0);
+        api.PushString(result);
+        return 1;
+    }
+
+    // deserialize(s [, pos]), decode value at position 'pos' of binary
+    // string, return the value and position after it
+    int Deserialize(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(1, luna::ValueT_String, luna::ValueT_Number))
+            return 0;
+
+        auto str = api.GetString(0);
+        std::size_t offset = 0;
+        if (api.GetStackSize() > 1 && api.GetNumber(1) > 1.0)
+            offset = std::min(static_cast<std::size_t>(api.GetNumber(1)) - 1,
+                              str->GetLength());
+
+        Deserializer deserializer(state, str->GetCStr() + offset,
+                                  str->GetCStr() + str->GetLength());
+        auto value = deserializer.Read(0);
+        api.PushValue(value);
+        api.PushNumber(deserializer.GetCurrent() - str->GetCStr() + 1);
+        return 2;
+    }
+
+    // Set weak mode of table by mode string like "k", "v" or "kv", empty
+    // mode makes table not weak, return the table
+    int SetWeak(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(2, luna::ValueT_Table, luna::ValueT_String))
+            return 0;
+
+        auto table = api.GetTable(0);
+        auto mode = api.GetString(1);
+        const char *s = mode->GetCStr();
+        unsigned int weak_mode = luna::WeakMode_None;
+        for (std::size_t i = 0; i < mode->GetLength(); ++i)
+        {
+            if (s[i] == 'k')
+                weak_mode |= luna::WeakMode_Key;
+            else if (s[i] == 'v')
+                weak_mode |= luna::WeakMode_Value;
+            else
+                throw luna::CallCFuncException("invalid weak mode '", s, "'");
+        }
+
+        // Table traced in the old mode is traced again
+        table->SetWeakMode(weak_mode);
+        CHECK_BARRIER(state->GetGC(), table);
+        api.PushTable(table);
+        return 1;
+    }
+
     void RegisterLibTable(luna::State *state)
     {
         luna::Library lib(state);
         luna::TableMemberReg table[] = {
             { "concat", Concat },
+            { "deserialize", Deserialize },
             { "insert", Insert },
+            { "move", Move },
             { "pack", Pack },
             { "remove", Remove },
+            { "serialize", Serialize },
+            { "setweak", SetWeak },
+            { "sort", Sort },
             { "unpack", Unpack }
         };
 
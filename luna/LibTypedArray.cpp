@@ -0,0 +1,281 @@
+#include "LibTypedArray.h"
+#include "State.h"
+#include "String.h"
+#include "Table.h"
+#include "UserData.h"
+#include "TypedArray.h"
+#include "Exception.h"
+#include <algorithm>
+#include <vector>
+#include <string.h>
+
+namespace lib {
+namespace typedarray {
+
+#define METATABLE_TYPED_ARRAY "typed_array"
+
+    luna::TypedArray * PushNewArray(luna::StackAPI &api, luna::State *state,
+                                    luna::TypedArrayT type, std::size_t size)
+    {
+        auto array = new luna::TypedArray(type, size);
+        auto user_data = state->NewUserData();
+        user_data->SetTypedArray(array, state->GetMetatable(METATABLE_TYPED_ARRAY));
+        api.PushUserData(user_data);
+        return array;
+    }
+
+    // Get typed array of argument 'index' which type is user data
+    luna::TypedArray * GetArray(luna::StackAPI &api, int index)
+    {
+        auto array = api.GetUserData(index)->GetTypedArray();
+        if (!array)
+            throw luna::CallCFuncException("bad argument #", index + 1,
+                                           " (typed array expected, got userdata)");
+        return array;
+    }
+
+    // Get range of elements [first, first + count) by optional arguments
+    // 'index' and 'index' + 1 which are the first and last index start
+    // from 1, the range is clamped in array
+    void GetRange(luna::StackAPI &api, int index, const luna::TypedArray *array,
+                  std::size_t &first, std::size_t &count)
+    {
+        auto size = static_cast<double>(array->GetSize());
+        auto i = api.GetStackSize() > index && api.IsNumber(index) ?
+            api.GetNumber(index) : 1.0;
+        auto j = api.GetStackSize() > index + 1 && api.IsNumber(index + 1) ?
+            api.GetNumber(index + 1) : size;
+        i = std::max(i, 1.0);
+        j = std::min(j, size);
+
+        first = 0;
+        count = 0;
+        if (i <= j)
+        {
+            first = static_cast<std::size_t>(i) - 1;
+            count = static_cast<std::size_t>(j) - first;
+        }
+    }
+
+    // Number of elements in 'src' which could be copied into typed array
+    // of 'type', 'src' is a table, string or typed array
+    std::size_t GetSourceCount(const luna::Value &src, luna::TypedArrayT type)
+    {
+        switch (src.type_)
+        {
+            case luna::ValueT_Table:
+                return src.table_->ArraySize();
+            case luna::ValueT_String:
+            {
+                // Bytes are copied as raw elements
+                auto len = src.str_->GetLength();
+                auto element_size = luna::TypedArray::ElementSize(type);
+                if (len % element_size != 0)
+                    throw luna::CallCFuncException("string length ", len,
+                            " is not a multiple of ", element_size);
+                return len / element_size;
+            }
+            default:
+                if (src.type_ == luna::ValueT_UserData &&
+                    src.user_data_->GetTypedArray())
+                    return src.user_data_->GetTypedArray()->GetSize();
+                throw luna::CallCFuncException("can not copy from ",
+                        src.TypeName(), " value");
+        }
+    }
+
+    // Copy all elements of 'src' into 'array' start from 'offset'
+    void CopyFrom(luna::TypedArray *array, std::size_t offset,
+                  const luna::Value &src)
+    {
+        auto count = GetSourceCount(src, array->GetType());
+        if (count > array->GetSize() - offset)
+            throw luna::CallCFuncException("copy ", count, " elements to ",
+                    offset + 1, " overflows typed array of size ",
+                    array->GetSize());
+
+        auto element_size = array->GetElementSize();
+        auto dst = static_cast<char *>(array->GetData()) + offset * element_size;
+        if (src.type_ == luna::ValueT_Table)
+        {
+            auto values = src.table_->GetArrayValues();
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                if (values[i].type_ != luna::ValueT_Number)
+                    throw luna::CallCFuncException("number expected at index ",
+                            i + 1, ", got ", values[i].TypeName());
+                array->SetNumber(offset + i, values[i].num_);
+            }
+        }
+        else if (src.type_ == luna::ValueT_String)
+        {
+            memcpy(dst, src.str_->GetCStr(), count * element_size);
+        }
+        else
+        {
+            auto other = src.user_data_->GetTypedArray();
+            if (other->GetType() == array->GetType())
+            {
+                // Same array may overlap
+                memmove(dst, other->GetData(), count * element_size);
+            }
+            else
+            {
+                for (std::size_t i = 0; i < count; ++i)
+                    array->SetNumber(offset + i, other->GetNumber(i));
+            }
+        }
+    }
+
+    // Constructor of typed array, argument is size of array, or table,
+    // string or typed array which elements are copied from
+    template<luna::TypedArrayT Type>
+    int New(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(1))
+            return 0;
+
+        auto src = *api.GetValue(0);
+        if (src.type_ == luna::ValueT_Number)
+        {
+            auto size = src.num_;
+            if (!(size >= 0.0 && size <= 4294967295.0))
+                throw luna::CallCFuncException("invalid typed array size ", size);
+            PushNewArray(api, state, Type, static_cast<std::size_t>(size));
+        }
+        else
+        {
+            auto array = PushNewArray(api, state, Type,
+                                      GetSourceCount(src, Type));
+            CopyFrom(array, 0, src);
+        }
+        return 1;
+    }
+
+    // a:copy(src [, index]), copy elements of 'src' into 'a' start from
+    // 'index' which is 1 by default, return 'a'
+    int Copy(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(2, luna::ValueT_UserData))
+            return 0;
+
+        auto array = GetArray(api, 0);
+        std::size_t offset = 0;
+        if (api.GetStackSize() > 2)
+        {
+            if (!api.IsNumber(2))
+            {
+                api.ArgTypeError(2, luna::ValueT_Number);
+                return 0;
+            }
+            auto index = api.GetNumber(2);
+            if (!(index >= 1.0 && index <= array->GetSize() + 1.0))
+                throw luna::CallCFuncException("copy index ", index,
+                        " out of range [1, ", array->GetSize() + 1, "]");
+            offset = static_cast<std::size_t>(index) - 1;
+        }
+
+        CopyFrom(array, offset, *api.GetValue(1));
+        api.PushUserData(api.GetUserData(0));
+        return 1;
+    }
+
+    // a:fill(num [, i [, j]]), return 'a'
+    int Fill(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(2, luna::ValueT_UserData, luna::ValueT_Number))
+            return 0;
+
+        auto array = GetArray(api, 0);
+        auto num = api.GetNumber(1);
+        std::size_t first = 0;
+        std::size_t count = 0;
+        GetRange(api, 2, array, first, count);
+        for (std::size_t i = first; i < first + count; ++i)
+            array->SetNumber(i, num);
+
+        api.PushUserData(api.GetUserData(0));
+        return 1;
+    }
+
+    // a:totable([i [, j]]), new table of elements in [i, j]
+    int ToTable(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(1, luna::ValueT_UserData))
+            return 0;
+
+        auto array = GetArray(api, 0);
+        std::size_t first = 0;
+        std::size_t count = 0;
+        GetRange(api, 1, array, first, count);
+
+        std::vector<luna::Value> values(count);
+        for (std::size_t i = 0; i < count; ++i)
+            values[i] = luna::Value(array->GetNumber(first + i));
+
+        auto table = state->NewTable();
+        if (count > 0)
+            table->SetArrayValues(1, values.data(), count);
+        api.PushTable(table);
+        return 1;
+    }
+
+    // a:tostring([i [, j]]), raw bytes of elements in [i, j]
+    int ToString(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(1, luna::ValueT_UserData))
+            return 0;
+
+        auto array = GetArray(api, 0);
+        std::size_t first = 0;
+        std::size_t count = 0;
+        GetRange(api, 1, array, first, count);
+
+        auto element_size = array->GetElementSize();
+        auto src = static_cast<const char *>(array->GetData()) + first * element_size;
+        api.PushNewString(count * element_size, [=](char *dst) {
+            memcpy(dst, src, count * element_size);
+        });
+        return 1;
+    }
+
+    // a:type(), element type name of 'a'
+    int Type(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(1, luna::ValueT_UserData))
+            return 0;
+
+        api.PushString(luna::TypedArray::TypeName(GetArray(api, 0)->GetType()));
+        return 1;
+    }
+
+    void RegisterLibTypedArray(luna::State *state)
+    {
+        luna::Library lib(state);
+        luna::TableMemberReg typed_array[] = {
+            { "copy", Copy },
+            { "fill", Fill },
+            { "totable", ToTable },
+            { "tostring", ToString },
+            { "type", Type }
+        };
+
+        lib.RegisterMetatable(METATABLE_TYPED_ARRAY, typed_array);
+
+        luna::TableMemberReg typedarray[] = {
+            { "byte", New<luna::TypedArrayT_Byte> },
+            { "float64", New<luna::TypedArrayT_Float64> },
+            { "int32", New<luna::TypedArrayT_Int32> }
+        };
+
+        lib.RegisterTableFunction("typedarray", typedarray);
+    }
+
+} // namespace typedarray
+} // namespace lib
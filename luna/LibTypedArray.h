@@ -0,0 +1,14 @@
+#ifndef LIB_TYPED_ARRAY_H
+#define LIB_TYPED_ARRAY_H
+
+#include "LibAPI.h"
+
+namespace lib {
+namespace typedarray {
+
+    void RegisterLibTypedArray(luna::State *state);
+
+} // namespace typedarray
+} // namespace lib
+
+#endif // LIB_TYPED_ARRAY_H
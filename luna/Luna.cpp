@@ -1,27 +1,48 @@
 #include "State.h"
 #include "Exception.h"
+#include "LibArray.h"
 #include "LibBase.h"
+#include "LibCoroutine.h"
 #include "LibIO.h"
 #include "LibMath.h"
 #include "LibString.h"
 #include "LibTable.h"
+#include "LibTypedArray.h"
+#include <string>
 #include <stdio.h>
+#include <string.h>
+
+// Read a line of any length into 'line', return false at the end of input
+bool ReadLine(std::string &line)
+{
+    line.clear();
+    char s[1024];
+    while (fgets(s, sizeof(s), stdin))
+    {
+        line += s;
+        if (line.back() == '\n')
+            return true;
+    }
+    return !line.empty();
+}
 
 void Repl(luna::State &state)
 {
     printf("Luna 2.0 Copyright (C) 2014\n");
 
+    // Lines typed again run without compiling
+    state.SetChunkCacheSize(64);
+
+    std::string line;
     for (;;)
     {
         try
         {
             printf("> ");
 
-            char s[1024] = { 0 };
-            auto input = fgets(s, sizeof(s), stdin);
-            if (!input)
+            if (!ReadLine(line))
                 break;
-            state.DoString(input, "stdin");
+            state.DoString(line.data(), line.size(), "stdin");
         }
         catch (const luna::Exception &exp)
         {
@@ -30,15 +51,15 @@ void Repl(luna::State &state)
     }
 }
 
-void ExecuteFile(const char **argv, luna::State &state)
+void ExecuteFile(const char *program, const char *file, luna::State &state)
 {
     try
     {
-        state.DoModule(argv[1]);
+        state.DoModule(file);
     }
     catch (const luna::OpenFileFail &exp)
     {
-        printf("%s: can not open file %s\n", argv[0], exp.What().c_str());
+        printf("%s: can not open file %s\n", program, exp.What().c_str());
     }
     catch (const luna::Exception &exp)
     {
@@ -46,24 +67,82 @@ void ExecuteFile(const char **argv, luna::State &state)
     }
 }
 
+void CompileFiles(int argc, const char **argv, luna::State &state)
+{
+    for (int i = 2; i < argc; ++i)
+    {
+        try
+        {
+            state.CompileModule(argv[i]);
+        }
+        catch (const luna::OpenFileFail &exp)
+        {
+            printf("%s: can not open file %s\n", argv[0], exp.What().c_str());
+        }
+        catch (const luna::Exception &exp)
+        {
+            printf("%s\n", exp.What().c_str());
+        }
+    }
+}
+
+void ProfileFile(const char **argv, luna::State &state)
+{
+    state.StartProfiler();
+    ExecuteFile(argv[0], argv[3], state);
+    state.StopProfiler();
+
+    // Samples in collapsed stack format for flame graph tools
+    auto profile = state.GetProfile();
+    auto file = fopen(argv[2], "wb");
+    if (!file)
+    {
+        printf("%s: can not open file %s\n", argv[0], argv[2]);
+        return ;
+    }
+
+    fwrite(profile.data(), 1, profile.size(), file);
+    fclose(file);
+}
+
 int main(int argc, const char **argv)
 {
     luna::State state;
 
+    lib::array::RegisterLibArray(&state);
     lib::base::RegisterLibBase(&state);
+    lib::coroutine::RegisterLibCoroutine(&state);
     lib::io::RegisterLibIO(&state);
     lib::math::RegisterLibMath(&state);
     lib::string::RegisterLibString(&state);
     lib::table::RegisterLibTable(&state);
+    lib::typedarray::RegisterLibTypedArray(&state);
 
     if (argc < 2)
     {
         Repl(state);
     }
+    else if (strcmp(argv[1], "-c") == 0)
+    {
+        // Compile files into binary chunk caches
+        CompileFiles(argc, argv, state);
+    }
+    else if (strcmp(argv[1], "-p") == 0)
+    {
+        // Profile file and write samples into output file
+        if (argc < 4)
+            printf("usage: %s -p output file\n", argv[0]);
+        else
+            ProfileFile(argv, state);
+    }
     else
     {
-        ExecuteFile(argv, state);
+        ExecuteFile(argv[0], argv[1], state);
     }
 
+#ifdef LUNA_OPCODE_STATS
+    fputs(state.GetOpcodeStats().c_str(), stderr);
+#endif // LUNA_OPCODE_STATS
+
     return 0;
 }
@@ -0,0 +1,52 @@
+#include "MappedFile.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace io {
+    MappedFile::MappedFile(const std::string &path)
+        : data_(nullptr), size_(0), mapped_(false)
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return ;
+
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+        {
+            auto size = static_cast<std::size_t>(st.st_size);
+            auto data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED)
+            {
+                data_ = static_cast<const char *>(data);
+                size_ = size;
+                mapped_ = true;
+            }
+        }
+
+        // Read empty file, pipe or file which can not be mapped into buffer
+        if (!mapped_)
+        {
+            char buffer[4096];
+            ssize_t size = 0;
+            while ((size = read(fd, buffer, sizeof(buffer))) > 0)
+                buffer_.append(buffer, size);
+
+            if (size == 0)
+            {
+                data_ = buffer_.data();
+                size_ = buffer_.size();
+            }
+        }
+
+        // Mapping is still valid after the file is closed
+        close(fd);
+    }
+
+    MappedFile::~MappedFile()
+    {
+        if (mapped_)
+            munmap(const_cast<char *>(data_), size_);
+    }
+} // namespace io
@@ -0,0 +1,45 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <string>
+
+namespace io {
+
+    // Read only memory mapping of whole file, pages of the mapping are
+    // shared by all processes and states which map the same file. File
+    // which can not be mapped is read into memory.
+    class MappedFile
+    {
+    public:
+        explicit MappedFile(const std::string &path);
+        ~MappedFile();
+
+        MappedFile(const MappedFile&) = delete;
+        void operator = (const MappedFile&) = delete;
+
+        bool IsOpen() const
+        {
+            return data_ != nullptr;
+        }
+
+        const char * GetData() const
+        {
+            return data_;
+        }
+
+        std::size_t GetSize() const
+        {
+            return size_;
+        }
+
+    private:
+        const char *data_;
+        std::size_t size_;
+        // Content is mapped, otherwise it is in 'buffer_'
+        bool mapped_;
+        std::string buffer_;
+    };
+
+} // namespace io
+
+#endif // MAPPED_FILE_H
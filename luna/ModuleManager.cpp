@@ -1,18 +1,40 @@
 #include "ModuleManager.h"
 #include "Lex.h"
 #include "Parser.h"
+#include "SyntaxTree.h"
 #include "State.h"
 #include "Table.h"
+#include "Function.h"
 #include "Exception.h"
 #include "SemanticAnalysis.h"
+#include "Optimize.h"
 #include "CodeGenerate.h"
-#include "TextInStream.h"
+#include "Bytecode.h"
 #include <functional>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <set>
+#include <stdio.h>
+#include <sys/stat.h>
+
+namespace
+{
+    // Get modify time of file, return false when file is not existed
+    bool GetModifyTime(const std::string &path, struct timespec &time)
+    {
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0)
+            return false;
+        time = st.st_mtim;
+        return true;
+    }
+} // namespace
 
 namespace luna
 {
     ModuleManager::ModuleManager(State *state, Table *modules)
-        : state_(state), modules_(modules)
+        : state_(state), modules_(modules), chunk_cache_size_(0)
     {
     }
 
@@ -22,45 +44,356 @@ namespace luna
         return !value.IsNil();
     }
 
+    bool ModuleManager::IsLoaded(const String *module_name) const
+    {
+        auto value = GetModuleClosure(module_name);
+        return !value.IsNil();
+    }
+
     Value ModuleManager::GetModuleClosure(const std::string &module_name) const
     {
-        Value key(state_->GetString(module_name));
+        return GetModuleClosure(state_->GetString(module_name));
+    }
+
+    Value ModuleManager::GetModuleClosure(const String *module_name) const
+    {
+        // Key is only used to look up, it is not modified
+        Value key(const_cast<String *>(module_name));
         return modules_->GetValue(key);
     }
 
     void ModuleManager::LoadModule(const std::string &module_name)
     {
-        io::text::InStream is(module_name);
-        if (!is.IsOpen())
-            throw OpenFileFail(module_name);
+        if (!LoadCache(module_name))
+            LoadSource(module_name, state_->IsLazyCompile());
+        AddModule(module_name);
+    }
 
-        Lexer lexer(state_, state_->GetString(module_name),
-                    [&is] () { return is.GetChar(); });
-        Load(lexer);
+    void ModuleManager::CompileModule(const std::string &module_name)
+    {
+        auto chunk = CompileChunk(module_name);
 
-        // Add to modules' table
+        // Write a temporary file and rename it to the cache, the cache
+        // may be mapped by running states, it can not be overwritten
+        auto cache_name = GetCacheFileName(module_name);
+        auto temp_name = cache_name + ".tmp";
+        auto file = fopen(temp_name.c_str(), "wb");
+        if (!file)
+            throw OpenFileFail(temp_name);
+
+        auto size = fwrite(chunk.data(), 1, chunk.size(), file);
+        bool ok = fclose(file) == 0 && size == chunk.size();
+        if (!ok || rename(temp_name.c_str(), cache_name.c_str()) != 0)
+        {
+            // Do not leave a truncated cache
+            remove(temp_name.c_str());
+            throw OpenFileFail(cache_name);
+        }
+    }
+
+    void ModuleManager::PreloadModules(const std::vector<std::string> &module_names,
+                                       unsigned int thread_count)
+    {
+        // Modules which have up to date cache are loaded directly, others
+        // are compiled in parallel
+        std::vector<std::string> compile_names;
+        std::set<std::string> names;
+        for (const auto &name : module_names)
+        {
+            if (IsLoaded(name) || !names.insert(name).second)
+                continue;
+
+            if (LoadCache(name))
+            {
+                AddModule(name);
+                state_->stack_.top_--;
+            }
+            else
+                compile_names.push_back(name);
+        }
+
+        std::vector<std::string> chunks(compile_names.size());
+        std::vector<std::exception_ptr> errors(compile_names.size());
+        CompileChunks(compile_names, chunks, errors, thread_count);
+
+        // Intern strings and new prototypes on the owner thread
+        std::exception_ptr first_error;
+        for (std::size_t i = 0; i < compile_names.size(); ++i)
+        {
+            if (errors[i])
+            {
+                if (!first_error)
+                    first_error = errors[i];
+                continue;
+            }
+
+            const auto &chunk = chunks[i];
+            auto function = LoadBytecode(chunk.data(), chunk.size(),
+                                         state_->GetString(compile_names[i]),
+                                         state_);
+            auto closure = state_->NewClosure();
+            closure->SetPrototype(function);
+
+            state_->ReserveStack(state_->stack_.top_, 1);
+            auto top = state_->stack_.top_++;
+            top->closure_ = closure;
+            top->type_ = ValueT_Closure;
+            AddModule(compile_names[i]);
+            state_->stack_.top_--;
+        }
+
+        if (first_error)
+            std::rethrow_exception(first_error);
+    }
+
+    void ModuleManager::CompileChunks(const std::vector<std::string> &module_names,
+                                      std::vector<std::string> &chunks,
+                                      std::vector<std::exception_ptr> &errors,
+                                      unsigned int thread_count)
+    {
+        if (thread_count == 0)
+            thread_count = std::max(std::thread::hardware_concurrency(), 1u);
+        if (thread_count > module_names.size())
+            thread_count = module_names.size();
+
+        // Workers take the next module until all modules are taken
+        std::atomic<std::size_t> next(0);
+        auto worker = [&] () {
+            State state;
+            auto manager = state.module_manager_.get();
+            for (std::size_t i = next++; i < module_names.size(); i = next++)
+            {
+                try
+                {
+                    chunks[i] = manager->CompileChunk(module_names[i]);
+                }
+                catch (...)
+                {
+                    errors[i] = std::current_exception();
+                }
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (unsigned int i = 0; i < thread_count; ++i)
+            threads.push_back(std::thread(worker));
+        for (auto &thread : threads)
+            thread.join();
+    }
+
+    std::string ModuleManager::GetCacheFileName(const std::string &module_name)
+    {
+        return module_name + "c";
+    }
+
+    void ModuleManager::LoadString(const std::string &str, const std::string &name)
+    {
+        LoadString(str.data(), str.size(), name);
+    }
+
+    void ModuleManager::LoadString(const char *str, std::size_t size,
+                                   const std::string &name)
+    {
+        std::size_t hash = 0;
+        if (chunk_cache_size_ > 0)
+        {
+            hash = String::Hash(str, size) * 31 +
+                String::Hash(name.data(), name.size());
+            if (LoadChunkCache(hash, str, size, name))
+                return ;
+        }
+
+        Lexer lexer(state_, state_->GetString(name), str, str + size);
+        Load(lexer, state_->IsLazyCompile());
+
+        if (chunk_cache_size_ > 0)
+            AddChunkCache(hash, str, size, name);
+    }
+
+    void ModuleManager::SetChunkCacheSize(std::size_t count)
+    {
+        chunk_cache_size_ = count;
+        while (chunks_.size() > chunk_cache_size_)
+        {
+            chunk_index_.erase(chunks_.back().hash_);
+            chunks_.pop_back();
+        }
+    }
+
+    void ModuleManager::VisitChunkCache(GCObjectVisitor *v) const
+    {
+        for (const auto &chunk : chunks_)
+            chunk.closure_->Accept(v);
+    }
+
+    bool ModuleManager::LoadCache(const std::string &module_name)
+    {
+        // Cache is up to date when it is newer than the source, or the
+        // module is only deployed as cache. Same modify time may come from
+        // the same clock tick, the source may be changed after compiled.
+        auto cache_name = GetCacheFileName(module_name);
+        struct timespec cache_time, source_time;
+        if (!GetModifyTime(cache_name, cache_time))
+            return false;
+
+        bool has_source = GetModifyTime(module_name, source_time);
+        if (has_source &&
+            (cache_time.tv_sec < source_time.tv_sec ||
+             (cache_time.tv_sec == source_time.tv_sec &&
+              cache_time.tv_nsec <= source_time.tv_nsec)))
+            return false;
+
+        // Prototypes use instructions of the mapping in place, so the
+        // mapping lives as long as the prototypes which are permanent
+        std::unique_ptr<io::MappedFile> image(new io::MappedFile(cache_name));
+        if (!image->IsOpen() ||
+            !IsBytecode(image->GetData(), image->GetSize()))
+            return false;
+
+        Function *function = nullptr;
+        try
+        {
+            function = LoadBytecode(image->GetData(), image->GetSize(),
+                                    state_->GetString(module_name),
+                                    state_, true);
+        }
+        catch (const BytecodeException &)
+        {
+            // Compile source when cache is broken or dumped by another
+            // version of luna
+            if (has_source)
+                return false;
+            throw;
+        }
+
+        images_.push_back(std::move(image));
+
+        auto closure = state_->NewClosure();
+        closure->SetPrototype(function);
+
+        // Put closure on stack
+        state_->ReserveStack(state_->stack_.top_, 1);
+        auto top = state_->stack_.top_++;
+        top->closure_ = closure;
+        top->type_ = ValueT_Closure;
+        return true;
+    }
+
+    std::string ModuleManager::CompileChunk(const std::string &module_name)
+    {
+        // Binary chunk has code of all functions
+        LoadSource(module_name, false);
+        auto closure = (state_->stack_.top_ - 1)->closure_;
+        auto chunk = DumpBytecode(closure->GetPrototype());
+        state_->stack_.top_--;
+        return chunk;
+    }
+
+    void ModuleManager::AddModule(const std::string &module_name)
+    {
+        // Prototypes and constants of module live as long as state
         Value key(state_->GetString(module_name));
         Value value = *(state_->stack_.top_ - 1);
+        state_->GetGC().SetPermanent(value.closure_->GetPrototype());
+
+        // Add to modules' table
         modules_->SetValue(key, value);
+        CHECK_BARRIER(state_->GetGC(), modules_);
     }
 
-    void ModuleManager::LoadString(const std::string &str, const std::string &name)
+    bool ModuleManager::LoadChunkCache(std::size_t hash, const char *str,
+                                       std::size_t size, const std::string &name)
     {
-        io::text::InStringStream is(str);
-        Lexer lexer(state_, state_->GetString(name),
-                    [&is] () { return is.GetChar(); });
-        Load(lexer);
+        auto it = chunk_index_.find(hash);
+        if (it == chunk_index_.end())
+            return false;
+
+        const auto &chunk = *it->second;
+        if (chunk.name_ != name || chunk.str_.size() != size ||
+            chunk.str_.compare(0, size, str, size) != 0)
+            return false;
+
+        // Move the chunk to the front as the most recent one
+        chunks_.splice(chunks_.begin(), chunks_, it->second);
+
+        state_->ReserveStack(state_->stack_.top_, 1);
+        auto top = state_->stack_.top_++;
+        top->closure_ = chunk.closure_;
+        top->type_ = ValueT_Closure;
+        return true;
+    }
+
+    void ModuleManager::AddChunkCache(std::size_t hash, const char *str,
+                                      std::size_t size, const std::string &name)
+    {
+        // Chunk of the same hash is replaced
+        auto it = chunk_index_.find(hash);
+        if (it != chunk_index_.end())
+            chunks_.erase(it->second);
+        else if (chunks_.size() >= chunk_cache_size_)
+        {
+            chunk_index_.erase(chunks_.back().hash_);
+            chunks_.pop_back();
+        }
+
+        Chunk chunk = { hash, std::string(str, size), name,
+                        (state_->stack_.top_ - 1)->closure_ };
+        chunks_.push_front(std::move(chunk));
+        chunk_index_[hash] = chunks_.begin();
+    }
+
+    void ModuleManager::LoadSource(const std::string &module_name, bool lazy)
+    {
+        // Lex the source in place of the mapping
+        io::MappedFile source(module_name);
+        if (!source.IsOpen())
+            throw OpenFileFail(module_name);
+
+        auto data = source.GetData();
+        Lexer lexer(state_, state_->GetString(module_name),
+                    data, data + source.GetSize());
+        Load(lexer, lazy);
     }
 
-    void ModuleManager::Load(Lexer &lexer)
+    void ModuleManager::Load(Lexer &lexer, bool lazy)
     {
+        // AST nodes are allocated from arena and released in one go
+        SyntaxTreeArenaGuard arena_guard;
+
         // Parse to AST
         auto ast = Parse(&lexer);
 
         // Semantic analysis
         SemanticAnalysis(ast.get(), state_);
 
+        // Fold constants and remove dead code
+        Optimize(ast.get(), state_);
+
         // Generate code
-        CodeGenerate(ast.get(), state_);
+        CodeGenerate(ast.get(), state_, lazy);
+    }
+
+    void ModuleManager::CompileFunction(Function *function)
+    {
+        auto lazy_source = function->GetLazySource();
+        const auto &source = lazy_source->source_;
+
+        SyntaxTreeArenaGuard arena_guard;
+        Lexer lexer(state_, function->GetModule(), source.data(),
+                    source.data() + source.size(), function->GetLine());
+        auto ast = ParseFunctionBody(&lexer);
+        static_cast<FunctionBody *>(ast.get())->has_self_ = lazy_source->has_self_;
+
+        // Upvalues were prepared when the function was defined, they are
+        // names of enclosing functions for the body
+        std::vector<String *> upvalues;
+        for (std::size_t i = 0; i < function->GetUpvalueCount(); ++i)
+            upvalues.push_back(function->GetUpvalue(i)->name_);
+        SemanticAnalysis(ast.get(), state_, upvalues);
+
+        Optimize(ast.get(), state_);
+
+        // The source is released after code is generated
+        CodeGenerate(ast.get(), function, state_);
     }
 } // namespace luna
@@ -2,12 +2,20 @@
 #define MODULE_MANAGER_H
 
 #include "Value.h"
+#include "MappedFile.h"
 #include <string>
+#include <memory>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <exception>
 
 namespace luna
 {
     class State;
     class Lexer;
+    class Function;
+    class GCObjectVisitor;
 
     // Load and manage all modules or load string
     class ModuleManager
@@ -20,25 +28,105 @@ namespace luna
 
         // Check module loaded or not
         bool IsLoaded(const std::string &module_name) const;
+        bool IsLoaded(const String *module_name) const;
 
         // Get module closure when module loaded,
         // if the module is not loaded, return nil value
         Value GetModuleClosure(const std::string &module_name) const;
+        Value GetModuleClosure(const String *module_name) const;
 
         // Load module, when loaded success, push the closure of the module
-        // onto stack
+        // onto stack. Binary chunk cache of the module is loaded instead of
+        // the source when the cache is up to date.
         void LoadModule(const std::string &module_name);
 
+        // Compile module and dump it into binary chunk cache file
+        void CompileModule(const std::string &module_name);
+
+        // Load modules which are not loaded without running them, modules
+        // are compiled on 'thread_count' worker threads in parallel, then
+        // they are attached to state on the calling thread. The first
+        // exception of modules is rethrown after all other modules are
+        // loaded.
+        void PreloadModules(const std::vector<std::string> &module_names,
+                            unsigned int thread_count);
+
+        // Get binary chunk cache file name of module
+        static std::string GetCacheFileName(const std::string &module_name);
+
         // Load string, when loaded success, push the closure of the string
-        // onto stack
+        // onto stack. 'str' of 'size' bytes is lexed in place, and the
+        // closure is got from chunk cache when the same string with the
+        // same name is loaded recently.
         void LoadString(const std::string &str, const std::string &name);
+        void LoadString(const char *str, std::size_t size,
+                        const std::string &name);
+
+        // Keep closures of the last 'count' different strings loaded, 0
+        // disables the chunk cache and clears it
+        void SetChunkCacheSize(std::size_t count);
+
+        // Visit closures of chunk cache, they are GC roots
+        void VisitChunkCache(GCObjectVisitor *v) const;
+
+        // Compile 'function' which is compiled lazily from its source,
+        // nested functions of it are compiled lazily too
+        void CompileFunction(Function *function);
 
     private:
-        // Load and push the closure onto stack
-        void Load(Lexer &lexer);
+        // Load and push the closure onto stack, nested functions are
+        // compiled on their first call when 'lazy'
+        void Load(Lexer &lexer, bool lazy);
+
+        // Load the closure from cache and push it onto stack, return false
+        // when cache of module is not existed or out of date
+        bool LoadCache(const std::string &module_name);
+
+        // Compile module source and push the closure onto stack
+        void LoadSource(const std::string &module_name, bool lazy);
+
+        // Compile module source into binary chunk
+        std::string CompileChunk(const std::string &module_name);
+
+        // Add the module closure on stack top into modules' table
+        void AddModule(const std::string &module_name);
+
+        // Push closure of string from chunk cache onto stack, return false
+        // when it is not cached
+        bool LoadChunkCache(std::size_t hash, const char *str,
+                            std::size_t size, const std::string &name);
+
+        // Add the string closure on stack top into chunk cache
+        void AddChunkCache(std::size_t hash, const char *str,
+                           std::size_t size, const std::string &name);
+
+        // Compile modules into 'chunks' on worker threads, each worker has
+        // its own State, exception of module is stored into 'errors'
+        static void CompileChunks(const std::vector<std::string> &module_names,
+                                  std::vector<std::string> &chunks,
+                                  std::vector<std::exception_ptr> &errors,
+                                  unsigned int thread_count);
 
         State *state_;
         Table *modules_;
+        // Mapped cache files which prototypes of modules refer to
+        std::vector<std::unique_ptr<io::MappedFile>> images_;
+
+        // Compiled string and its closure of chunk cache
+        struct Chunk
+        {
+            std::size_t hash_;
+            std::string str_;
+            std::string name_;
+            Closure *closure_;
+        };
+        typedef std::list<Chunk> ChunkList;
+
+        // Chunks in order of last used, the most recent one is the first
+        ChunkList chunks_;
+        // Chunks indexed by hash of string and name
+        std::unordered_map<std::size_t, ChunkList::iterator> chunk_index_;
+        std::size_t chunk_cache_size_;
     };
 } // namespace luna
 
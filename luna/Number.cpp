@@ -0,0 +1,607 @@
+#include "Number.h"
+#include <locale.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+namespace
+{
+    const uint64_t kHiddenBit = static_cast<uint64_t>(1) << 52;
+    const uint64_t kFractionMask = kHiddenBit - 1;
+    const int kExponentBias = 1075;
+
+    // Number f * 2^e with 64 bits significand
+    struct DiyFp
+    {
+        uint64_t f_;
+        int e_;
+
+        DiyFp(uint64_t f, int e) : f_(f), e_(e) { }
+
+        // Positive finite 'd'
+        explicit DiyFp(double d)
+        {
+            uint64_t bits = 0;
+            memcpy(&bits, &d, sizeof(d));
+            auto biased_e = static_cast<int>((bits >> 52) & 0x7FF);
+            auto significand = bits & kFractionMask;
+            if (biased_e != 0)
+            {
+                f_ = significand + kHiddenBit;
+                e_ = biased_e - kExponentBias;
+            }
+            else
+            {
+                f_ = significand;
+                e_ = 1 - kExponentBias;
+            }
+        }
+
+        DiyFp operator - (const DiyFp &r) const
+        {
+            return DiyFp(f_ - r.f_, e_);
+        }
+
+        // Product which significand is rounded to 64 bits
+        DiyFp operator * (const DiyFp &r) const
+        {
+#if defined(__SIZEOF_INT128__)
+            auto p = static_cast<unsigned __int128>(f_) * r.f_;
+            auto h = static_cast<uint64_t>(p >> 64);
+            auto l = static_cast<uint64_t>(p);
+            if (l & (static_cast<uint64_t>(1) << 63))
+                ++h;
+            return DiyFp(h, e_ + r.e_ + 64);
+#else
+            const uint64_t kMask32 = 0xFFFFFFFF;
+            auto a = f_ >> 32;
+            auto b = f_ & kMask32;
+            auto c = r.f_ >> 32;
+            auto d = r.f_ & kMask32;
+            auto ac = a * c;
+            auto bc = b * c;
+            auto ad = a * d;
+            auto bd = b * d;
+            auto tmp = (bd >> 32) + (ad & kMask32) + (bc & kMask32);
+            tmp += static_cast<uint64_t>(1) << 31;
+            return DiyFp(ac + (ad >> 32) + (bc >> 32) + (tmp >> 32),
+                         e_ + r.e_ + 64);
+#endif
+        }
+
+        DiyFp Normalize() const
+        {
+            auto s = __builtin_clzll(f_);
+            return DiyFp(f_ << s, e_ - s);
+        }
+
+        // Boundaries of the numbers which are rounded to this number,
+        // they are normalized with the same exponent
+        void NormalizedBoundaries(DiyFp &minus, DiyFp &plus) const
+        {
+            plus = DiyFp((f_ << 1) + 1, e_ - 1).Normalize();
+            minus = f_ == kHiddenBit ? DiyFp((f_ << 2) - 1, e_ - 2) :
+                                       DiyFp((f_ << 1) - 1, e_ - 1);
+            minus.f_ <<= minus.e_ - plus.e_;
+            minus.e_ = plus.e_;
+        }
+    };
+
+    // Normalized 10^(-348 + 8 * i) rounded to 64 bits
+    const struct
+    {
+        uint64_t f_;
+        int e_;
+    } kCachedPowers[] = {
+        { 0xfa8fd5a0081c0288ULL, -1220 },
+        { 0xbaaee17fa23ebf76ULL, -1193 },
+        { 0x8b16fb203055ac76ULL, -1166 },
+        { 0xcf42894a5dce35eaULL, -1140 },
+        { 0x9a6bb0aa55653b2dULL, -1113 },
+        { 0xe61acf033d1a45dfULL, -1087 },
+        { 0xab70fe17c79ac6caULL, -1060 },
+        { 0xff77b1fcbebcdc4fULL, -1034 },
+        { 0xbe5691ef416bd60cULL, -1007 },
+        { 0x8dd01fad907ffc3cULL, -980 },
+        { 0xd3515c2831559a83ULL, -954 },
+        { 0x9d71ac8fada6c9b5ULL, -927 },
+        { 0xea9c227723ee8bcbULL, -901 },
+        { 0xaecc49914078536dULL, -874 },
+        { 0x823c12795db6ce57ULL, -847 },
+        { 0xc21094364dfb5637ULL, -821 },
+        { 0x9096ea6f3848984fULL, -794 },
+        { 0xd77485cb25823ac7ULL, -768 },
+        { 0xa086cfcd97bf97f4ULL, -741 },
+        { 0xef340a98172aace5ULL, -715 },
+        { 0xb23867fb2a35b28eULL, -688 },
+        { 0x84c8d4dfd2c63f3bULL, -661 },
+        { 0xc5dd44271ad3cdbaULL, -635 },
+        { 0x936b9fcebb25c996ULL, -608 },
+        { 0xdbac6c247d62a584ULL, -582 },
+        { 0xa3ab66580d5fdaf6ULL, -555 },
+        { 0xf3e2f893dec3f126ULL, -529 },
+        { 0xb5b5ada8aaff80b8ULL, -502 },
+        { 0x87625f056c7c4a8bULL, -475 },
+        { 0xc9bcff6034c13053ULL, -449 },
+        { 0x964e858c91ba2655ULL, -422 },
+        { 0xdff9772470297ebdULL, -396 },
+        { 0xa6dfbd9fb8e5b88fULL, -369 },
+        { 0xf8a95fcf88747d94ULL, -343 },
+        { 0xb94470938fa89bcfULL, -316 },
+        { 0x8a08f0f8bf0f156bULL, -289 },
+        { 0xcdb02555653131b6ULL, -263 },
+        { 0x993fe2c6d07b7facULL, -236 },
+        { 0xe45c10c42a2b3b06ULL, -210 },
+        { 0xaa242499697392d3ULL, -183 },
+        { 0xfd87b5f28300ca0eULL, -157 },
+        { 0xbce5086492111aebULL, -130 },
+        { 0x8cbccc096f5088ccULL, -103 },
+        { 0xd1b71758e219652cULL, -77 },
+        { 0x9c40000000000000ULL, -50 },
+        { 0xe8d4a51000000000ULL, -24 },
+        { 0xad78ebc5ac620000ULL, 3 },
+        { 0x813f3978f8940984ULL, 30 },
+        { 0xc097ce7bc90715b3ULL, 56 },
+        { 0x8f7e32ce7bea5c70ULL, 83 },
+        { 0xd5d238a4abe98068ULL, 109 },
+        { 0x9f4f2726179a2245ULL, 136 },
+        { 0xed63a231d4c4fb27ULL, 162 },
+        { 0xb0de65388cc8ada8ULL, 189 },
+        { 0x83c7088e1aab65dbULL, 216 },
+        { 0xc45d1df942711d9aULL, 242 },
+        { 0x924d692ca61be758ULL, 269 },
+        { 0xda01ee641a708deaULL, 295 },
+        { 0xa26da3999aef774aULL, 322 },
+        { 0xf209787bb47d6b85ULL, 348 },
+        { 0xb454e4a179dd1877ULL, 375 },
+        { 0x865b86925b9bc5c2ULL, 402 },
+        { 0xc83553c5c8965d3dULL, 428 },
+        { 0x952ab45cfa97a0b3ULL, 455 },
+        { 0xde469fbd99a05fe3ULL, 481 },
+        { 0xa59bc234db398c25ULL, 508 },
+        { 0xf6c69a72a3989f5cULL, 534 },
+        { 0xb7dcbf5354e9beceULL, 561 },
+        { 0x88fcf317f22241e2ULL, 588 },
+        { 0xcc20ce9bd35c78a5ULL, 614 },
+        { 0x98165af37b2153dfULL, 641 },
+        { 0xe2a0b5dc971f303aULL, 667 },
+        { 0xa8d9d1535ce3b396ULL, 694 },
+        { 0xfb9b7cd9a4a7443cULL, 720 },
+        { 0xbb764c4ca7a44410ULL, 747 },
+        { 0x8bab8eefb6409c1aULL, 774 },
+        { 0xd01fef10a657842cULL, 800 },
+        { 0x9b10a4e5e9913129ULL, 827 },
+        { 0xe7109bfba19c0c9dULL, 853 },
+        { 0xac2820d9623bf429ULL, 880 },
+        { 0x80444b5e7aa7cf85ULL, 907 },
+        { 0xbf21e44003acdd2dULL, 933 },
+        { 0x8e679c2f5e44ff8fULL, 960 },
+        { 0xd433179d9c8cb841ULL, 986 },
+        { 0x9e19db92b4e31ba9ULL, 1013 },
+        { 0xeb96bf6ebadf77d9ULL, 1039 },
+        { 0xaf87023b9bf0ee6bULL, 1066 }
+    };
+
+    const uint64_t kPow10[] = {
+        1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+        10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+        100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+        100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+        100000000000000000ULL, 1000000000000000000ULL,
+        10000000000000000000ULL
+    };
+
+    // Doubles of 10^i which are exact
+    const double kExactPow10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+
+    // Cached power c = 10^-k, the product of c and a number of binary
+    // exponent 'e' has binary exponent in [-60, -32]
+    DiyFp GetCachedPower(int e, int &k)
+    {
+        auto dk = (-61 - e) * 0.30102999566398114 + 347;
+        auto ik = static_cast<int>(dk);
+        if (dk - ik > 0.0)
+            ++ik;
+
+        auto index = static_cast<unsigned int>((ik >> 3) + 1);
+        k = -(-348 + static_cast<int>(index << 3));
+        return DiyFp(kCachedPowers[index].f_, kCachedPowers[index].e_);
+    }
+
+    int CountDecimalDigit32(uint32_t n)
+    {
+        int count = 1;
+        while (count < 10 && n >= kPow10[count])
+            ++count;
+        return count;
+    }
+
+    // Move the last digit towards 'w' while the digits stay in range
+    void GrisuRound(char *digits, int len, uint64_t delta, uint64_t rest,
+                    uint64_t ten_kappa, uint64_t wp_w)
+    {
+        while (rest < wp_w && delta - rest >= ten_kappa &&
+               (rest + ten_kappa < wp_w ||
+                wp_w - rest > rest + ten_kappa - wp_w))
+        {
+            digits[len - 1]--;
+            rest += ten_kappa;
+        }
+    }
+
+    // Generate the shortest digits in (mp - delta, mp], 'k' is the
+    // decimal exponent of the digits
+    void DigitGen(const DiyFp &w, const DiyFp &mp, uint64_t delta,
+                  char *digits, int &len, int &k)
+    {
+        const DiyFp one(static_cast<uint64_t>(1) << -mp.e_, mp.e_);
+        const DiyFp wp_w = mp - w;
+        auto p1 = static_cast<uint32_t>(mp.f_ >> -one.e_);
+        auto p2 = mp.f_ & (one.f_ - 1);
+        auto kappa = CountDecimalDigit32(p1);
+        len = 0;
+
+        while (kappa > 0)
+        {
+            auto d = p1 / static_cast<uint32_t>(kPow10[kappa - 1]);
+            p1 %= static_cast<uint32_t>(kPow10[kappa - 1]);
+            if (d || len)
+                digits[len++] = static_cast<char>('0' + d);
+            --kappa;
+
+            auto rest = (static_cast<uint64_t>(p1) << -one.e_) + p2;
+            if (rest <= delta)
+            {
+                k += kappa;
+                GrisuRound(digits, len, delta, rest,
+                           kPow10[kappa] << -one.e_, wp_w.f_);
+                return ;
+            }
+        }
+
+        for (;;)
+        {
+            p2 *= 10;
+            delta *= 10;
+            auto d = static_cast<char>(p2 >> -one.e_);
+            if (d || len)
+                digits[len++] = static_cast<char>('0' + d);
+            p2 &= one.f_ - 1;
+            --kappa;
+
+            if (p2 < delta)
+            {
+                k += kappa;
+                auto index = -kappa;
+                GrisuRound(digits, len, delta, p2, one.f_,
+                           wp_w.f_ * (index < 20 ? kPow10[index] : 0));
+                return ;
+            }
+        }
+    }
+
+    // Grisu2 of positive finite 'num', 'num' is digits * 10^k
+    void Grisu2(double num, char *digits, int &len, int &k)
+    {
+        const DiyFp v(num);
+        DiyFp minus(0, 0);
+        DiyFp plus(0, 0);
+        v.NormalizedBoundaries(minus, plus);
+
+        auto c_mk = GetCachedPower(plus.e_, k);
+        auto w = v.Normalize() * c_mk;
+        auto wp = plus * c_mk;
+        auto wm = minus * c_mk;
+        ++wm.f_;
+        --wp.f_;
+        DigitGen(w, wp, wp.f_ - wm.f_, digits, len, k);
+    }
+
+    std::size_t WriteInteger(uint64_t value, char *buffer)
+    {
+        char digits[20];
+        std::size_t count = 0;
+        do
+        {
+            digits[count++] = static_cast<char>('0' + value % 10);
+            value /= 10;
+        } while (value != 0);
+
+        std::size_t len = 0;
+        while (count > 0)
+            buffer[len++] = digits[--count];
+        return len;
+    }
+
+    // Write 'digits' * 10^k, in exponent form 'd.ddde+xx' like "%g" when
+    // the decimal exponent is out of [-4, 17)
+    std::size_t WriteDigits(const char *digits, int len, int k, char *buffer)
+    {
+        std::size_t size = 0;
+        auto exponent = len + k - 1;
+        if (exponent < -4 || exponent >= 17)
+        {
+            buffer[size++] = digits[0];
+            if (len > 1)
+            {
+                buffer[size++] = '.';
+                memcpy(buffer + size, digits + 1, len - 1);
+                size += len - 1;
+            }
+
+            buffer[size++] = 'e';
+            buffer[size++] = exponent < 0 ? '-' : '+';
+            auto abs_exponent = exponent < 0 ? -exponent : exponent;
+            if (abs_exponent < 10)
+                buffer[size++] = '0';
+            size += WriteInteger(abs_exponent, buffer + size);
+        }
+        else if (exponent < 0)
+        {
+            // 0.000ddd
+            buffer[size++] = '0';
+            buffer[size++] = '.';
+            for (int i = exponent + 1; i < 0; ++i)
+                buffer[size++] = '0';
+            memcpy(buffer + size, digits, len);
+            size += len;
+        }
+        else if (k >= 0)
+        {
+            // ddd000
+            memcpy(buffer, digits, len);
+            size = len;
+            for (int i = 0; i < k; ++i)
+                buffer[size++] = '0';
+        }
+        else
+        {
+            // ddd.ddd
+            auto point = exponent + 1;
+            memcpy(buffer, digits, point);
+            buffer[point] = '.';
+            memcpy(buffer + point + 1, digits + point, len - point);
+            size = len + 1;
+        }
+
+        buffer[size] = 0;
+        return size;
+    }
+
+    bool IsDigit(char c)
+    {
+        return c >= '0' && c <= '9';
+    }
+
+    int HexValue(char c)
+    {
+        if (IsDigit(c))
+            return c - '0';
+        c |= 0x20;
+        if (c >= 'a' && c <= 'f')
+            return c - 'a' + 10;
+        return -1;
+    }
+
+    // Parse exponent digits after 'p' which is the exponent mark, return
+    // 'p' when there is no exponent
+    const char * ParseExponent(const char *p, const char *end, int &exponent)
+    {
+        auto q = p + 1;
+        bool negative = false;
+        if (q != end && (*q == '+' || *q == '-'))
+            negative = *q++ == '-';
+        if (q == end || !IsDigit(*q))
+            return p;
+
+        // Larger exponents are overflow or underflow anyway
+        int value = 0;
+        for (; q != end && IsDigit(*q); ++q)
+        {
+            if (value < 100000)
+                value = value * 10 + (*q - '0');
+        }
+        exponent += negative ? -value : value;
+        return q;
+    }
+
+    // Parse hexadecimal number after '0x', bits of mantissa out of 64
+    // bits are kept as a sticky bit for rounding
+    const char * ParseHex(const char *p, const char *end, double &num)
+    {
+        uint64_t mantissa = 0;
+        int exponent = 0;
+        bool any = false;
+        bool sticky = false;
+
+        for (; p != end && HexValue(*p) >= 0; ++p, any = true)
+        {
+            if ((mantissa >> 60) == 0)
+                mantissa = (mantissa << 4) | HexValue(*p);
+            else
+            {
+                exponent += 4;
+                sticky = sticky || HexValue(*p) != 0;
+            }
+        }
+
+        if (p != end && *p == '.')
+        {
+            for (++p; p != end && HexValue(*p) >= 0; ++p, any = true)
+            {
+                if ((mantissa >> 60) == 0)
+                {
+                    mantissa = (mantissa << 4) | HexValue(*p);
+                    exponent -= 4;
+                }
+                else
+                    sticky = sticky || HexValue(*p) != 0;
+            }
+        }
+
+        if (!any)
+            return nullptr;
+
+        if (p != end && (*p | 0x20) == 'p')
+            p = ParseExponent(p, end, exponent);
+
+        if (sticky)
+            mantissa |= 1;
+        num = ldexp(static_cast<double>(mantissa), exponent);
+        return p;
+    }
+
+    // Parse decimal number, the first 19 significant digits are kept in
+    // integer mantissa, and the number is exact when mantissa and power
+    // of 10 are both exact doubles, other numbers are parsed by strtod
+    const char * ParseDecimal(const char *p, const char *end, double &num)
+    {
+        auto start = p;
+        uint64_t mantissa = 0;
+        int digits = 0;
+        int exponent = 0;
+        bool any = false;
+        bool truncated = false;
+
+        for (; p != end && IsDigit(*p); ++p, any = true)
+        {
+            if (digits < 19)
+            {
+                mantissa = mantissa * 10 + (*p - '0');
+                digits += mantissa != 0;
+            }
+            else
+            {
+                ++exponent;
+                truncated = truncated || *p != '0';
+            }
+        }
+
+        if (p != end && *p == '.')
+        {
+            for (++p; p != end && IsDigit(*p); ++p, any = true)
+            {
+                if (digits < 19)
+                {
+                    mantissa = mantissa * 10 + (*p - '0');
+                    digits += mantissa != 0;
+                    --exponent;
+                }
+                else
+                    truncated = truncated || *p != '0';
+            }
+        }
+
+        if (!any)
+            return nullptr;
+
+        if (p != end && (*p | 0x20) == 'e')
+            p = ParseExponent(p, end, exponent);
+
+        const uint64_t kMaxExact = static_cast<uint64_t>(1) << 53;
+        if (mantissa == 0)
+        {
+            num = 0.0;
+            return p;
+        }
+
+        if (!truncated && mantissa <= kMaxExact)
+        {
+            if (exponent >= -22 && exponent <= 0)
+            {
+                num = static_cast<double>(mantissa) / kExactPow10[-exponent];
+                return p;
+            }
+
+            // Move some power of 10 into mantissa when it is still exact
+            while (exponent > 22 && mantissa <= kMaxExact / 10)
+            {
+                mantissa *= 10;
+                --exponent;
+            }
+
+            if (exponent >= 0 && exponent <= 22)
+            {
+                num = static_cast<double>(mantissa) * kExactPow10[exponent];
+                return p;
+            }
+        }
+
+        // strtod reads decimal point of locale
+        std::string text(start, p);
+        auto point = text.find('.');
+        if (point != std::string::npos)
+            text[point] = localeconv()->decimal_point[0];
+        num = strtod(text.c_str(), nullptr);
+        return p;
+    }
+} // namespace
+
+namespace luna
+{
+    std::size_t FormatNumber(double num, char *buffer)
+    {
+        // Integers which fit in 64 bits are written digit by digit
+        if (floor(num) == num && num > -9.2e18 && num < 9.2e18)
+        {
+            auto value = static_cast<int64_t>(num);
+            std::size_t len = 0;
+            if (value < 0 || (value == 0 && signbit(num)))
+                buffer[len++] = '-';
+            len += WriteInteger(value < 0 ? 0 - static_cast<uint64_t>(value) :
+                                static_cast<uint64_t>(value), buffer + len);
+            buffer[len] = 0;
+            return len;
+        }
+
+        if (isnan(num))
+        {
+            strcpy(buffer, signbit(num) ? "-nan" : "nan");
+            return strlen(buffer);
+        }
+
+        std::size_t len = 0;
+        if (signbit(num))
+        {
+            buffer[len++] = '-';
+            num = -num;
+        }
+
+        if (isinf(num))
+        {
+            strcpy(buffer + len, "inf");
+            return len + 3;
+        }
+
+        char digits[20];
+        int count = 0;
+        int k = 0;
+        Grisu2(num, digits, count, k);
+        return len + WriteDigits(digits, count, k, buffer + len);
+    }
+
+    std::size_t ParseNumber(const char *s, std::size_t len, double &num)
+    {
+        auto p = s;
+        auto end = s + len;
+        bool negative = false;
+        if (p != end && (*p == '+' || *p == '-'))
+            negative = *p++ == '-';
+
+        if (end - p >= 2 && p[0] == '0' && (p[1] | 0x20) == 'x')
+            p = ParseHex(p + 2, end, num);
+        else
+            p = ParseDecimal(p, end, num);
+
+        if (!p)
+            return 0;
+        if (negative)
+            num = -num;
+        return p - s;
+    }
+} // namespace luna
@@ -0,0 +1,28 @@
+#ifndef NUMBER_H
+#define NUMBER_H
+
+#include <cstddef>
+
+namespace luna
+{
+    // Conversion between numbers and text shared by VM, libraries and
+    // lexer, decimal point is always '.' whatever the locale is.
+
+    // Buffer size of FormatNumber
+    const std::size_t kNumberBufferSize = 32;
+
+    // Format 'num' into 'buffer' as number converted to string by script,
+    // return length of the text. Integers are written digit by digit,
+    // other numbers are written by Grisu2 in digits which read back as
+    // the same number, the digits are the shortest in almost all cases.
+    // Exponent form is used when the exponent is less than -4 or not less
+    // than 17.
+    std::size_t FormatNumber(double num, char *buffer);
+
+    // Parse number at the start of 's' of 'len' bytes into 'num', the
+    // number is decimal or hexadecimal with an optional sign, return
+    // count of bytes parsed, or 0 when 's' does not start with a number.
+    std::size_t ParseNumber(const char *s, std::size_t len, double &num);
+} // namespace luna
+
+#endif // NUMBER_H
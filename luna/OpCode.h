@@ -1,12 +1,14 @@
 #ifndef OP_CODE_H
 #define OP_CODE_H
 
+#include <cstddef>
+
 namespace luna
 {
     enum OpType
     {
         OpType_LoadNil = 1,             // A    A: register
-        OpType_FillNil,                 // AB   A: start reg B: end reg [A,B)
+        OpType_FillNil,                 // ABC  A: start reg B: end reg [A,B) C: 1 close upvalues from A
         OpType_LoadBool,                // AB   A: register B: 1 true 0 false
         OpType_LoadInt,                 // A    A: register Next instruction opcode is const unsigned int
         OpType_LoadConst,               // ABx  A: register Bx: const index
@@ -32,18 +34,43 @@ namespace luna
         OpType_Div,                     // ABC  A: dst register B: operand1 register C: operand2 register
         OpType_Pow,                     // ABC  A: dst register B: operand1 register C: operand2 register
         OpType_Mod,                     // ABC  A: dst register B: operand1 register C: operand2 register
-        OpType_Concat,                  // ABC  A: dst register B: operand1 register C: operand2 register
+        OpType_Concat,                  // ABC  A: dst register B: first operand register C: operand count
         OpType_Less,                    // ABC  A: dst register B: operand1 register C: operand2 register
         OpType_Greater,                 // ABC  A: dst register B: operand1 register C: operand2 register
         OpType_Equal,                   // ABC  A: dst register B: operand1 register C: operand2 register
         OpType_UnEqual,                 // ABC  A: dst register B: operand1 register C: operand2 register
         OpType_LessEqual,               // ABC  A: dst register B: operand1 register C: operand2 register
         OpType_GreaterEqual,            // ABC  A: dst register B: operand1 register C: operand2 register
-        OpType_NewTable,                // A    A: register of table
+        OpType_AddK,                    // ABC  A: dst register B: operand1 register C: const index of operand2
+        OpType_SubK,                    // ABC  A: dst register B: operand1 register C: const index of operand2
+        OpType_MulK,                    // ABC  A: dst register B: operand1 register C: const index of operand2
+        OpType_DivK,                    // ABC  A: dst register B: operand1 register C: const index of operand2
+        OpType_PowK,                    // ABC  A: dst register B: operand1 register C: const index of operand2
+        OpType_ModK,                    // ABC  A: dst register B: operand1 register C: const index of operand2
+        OpType_LessK,                   // ABC  A: dst register B: operand1 register C: const index of operand2
+        OpType_GreaterK,                // ABC  A: dst register B: operand1 register C: const index of operand2
+        OpType_EqualK,                  // ABC  A: dst register B: operand1 register C: const index of operand2
+        OpType_UnEqualK,                // ABC  A: dst register B: operand1 register C: const index of operand2
+        OpType_LessEqualK,              // ABC  A: dst register B: operand1 register C: const index of operand2
+        OpType_GreaterEqualK,           // ABC  A: dst register B: operand1 register C: const index of operand2
+        OpType_JmpLess,                 // ABC  A: operand1 register B: operand2 register or const index C: 1 when B is const index, next instruction sBx: diff of instruction index, jump when A < B is false
+        OpType_JmpGreater,              // ABC  A: operand1 register B: operand2 register or const index C: 1 when B is const index, next instruction sBx: diff of instruction index, jump when A > B is false
+        OpType_JmpEqual,                // ABC  A: operand1 register B: operand2 register or const index C: 1 when B is const index, next instruction sBx: diff of instruction index, jump when A == B is false
+        OpType_JmpUnEqual,              // ABC  A: operand1 register B: operand2 register or const index C: 1 when B is const index, next instruction sBx: diff of instruction index, jump when A ~= B is false
+        OpType_JmpLessEqual,            // ABC  A: operand1 register B: operand2 register or const index C: 1 when B is const index, next instruction sBx: diff of instruction index, jump when A <= B is false
+        OpType_JmpGreaterEqual,         // ABC  A: operand1 register B: operand2 register or const index C: 1 when B is const index, next instruction sBx: diff of instruction index, jump when A >= B is false
+        OpType_NewTable,                // ABC  A: register of table B: array size hint C: hash size hint, size hints are encoded by Instruction::SizeToByte
         OpType_SetTable,                // ABC  A: register of table B: key register C: value register
         OpType_GetTable,                // ABC  A: register of table B: key register C: value register
-        OpType_ForInit,                 // ABC  A: var register B: limit register    C: step register
-        OpType_ForStep,                 // ABC  ABC same with OpType_ForInit, next instruction sBx: diff of instruction index
+        OpType_SetField,                // ABC  A: register of table B: const index of key C: value register
+        OpType_GetField,                // ABC  A: register of table B: const index of key C: value register
+        OpType_ForPrep,                 // AsBx A: var register, A+1: limit A+2: step A+3: loop state sBx: diff of instruction index to loop end
+        OpType_ForLoop,                 // AsBx A: same with OpType_ForPrep sBx: diff of instruction index to loop body
+        OpType_SetList,                 // ABC  A: register of table B: first value register C: value count, next instruction opcode is array start index
+        OpType_TailCall,                // ABC  A B C same with OpType_Call, reuse the frame of caller when callee is a closure
+        OpType_GetGlobalField,          // ABx  A: value register Bx: const index of global, next instruction opcode is const index of key, get field of the global table
+        OpType_GetTableK,               // ABC  A: register of table B: const index of key C: value register
+        OpType_SetTableK,               // ABC  A: register of table B: const index of key C: value register
     };
 
     struct Instruction
@@ -72,6 +99,21 @@ namespace luna
             opcode_ = (opcode_ & 0xFFFF0000) | (static_cast<int>(b) & 0xFFFF);
         }
 
+        void RefillA(int a)
+        {
+            opcode_ = (opcode_ & 0xFF00FFFF) | ((a & 0xFF) << 16);
+        }
+
+        void RefillB(int b)
+        {
+            opcode_ = (opcode_ & 0xFFFF00FF) | ((b & 0xFF) << 8);
+        }
+
+        void RefillC(int c)
+        {
+            opcode_ = (opcode_ & 0xFFFFFF00) | (c & 0xFF);
+        }
+
         static int GetOpCode(Instruction i)
         {
             return (i.opcode_ >> 24) & 0xFF;
@@ -126,6 +168,36 @@ namespace luna
         {
             return Instruction(op, a, static_cast<unsigned short>(b));
         }
+
+        // Encode size to one byte 'eeeeexxx' as floating point number,
+        // which value is (1xxx) * 2^(eeeee - 1) when eeeee is not 0,
+        // otherwise the value is xxx. The encoded size is not less than
+        // 'size'.
+        static int SizeToByte(unsigned int size)
+        {
+            int e = 0;
+            if (size < 8)
+                return size;
+            while (size >= (8 << 4))
+            {
+                size = (size + 0xF) >> 4;
+                e += 4;
+            }
+            while (size >= (8 << 1))
+            {
+                size = (size + 1) >> 1;
+                ++e;
+            }
+            return ((e + 1) << 3) | (static_cast<int>(size) - 8);
+        }
+
+        // Decode size from byte which encoded by SizeToByte
+        static std::size_t ByteToSize(int byte)
+        {
+            if (byte < 8)
+                return byte;
+            return static_cast<std::size_t>((byte & 7) + 8) << ((byte >> 3) - 1);
+        }
     };
 } // namespace luna
 
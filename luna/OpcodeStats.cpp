@@ -0,0 +1,195 @@
+#include "OpcodeStats.h"
+#include "Function.h"
+#include "String.h"
+#include <algorithm>
+#include <stdio.h>
+
+namespace
+{
+    // Names of OpType, indexed by OpType
+    const char *op_names[] = {
+        "",
+        "LoadNil",
+        "FillNil",
+        "LoadBool",
+        "LoadInt",
+        "LoadConst",
+        "Move",
+        "GetUpvalue",
+        "SetUpvalue",
+        "GetGlobal",
+        "SetGlobal",
+        "Closure",
+        "Call",
+        "VarArg",
+        "Ret",
+        "JmpFalse",
+        "JmpTrue",
+        "JmpNil",
+        "Jmp",
+        "Neg",
+        "Not",
+        "Len",
+        "Add",
+        "Sub",
+        "Mul",
+        "Div",
+        "Pow",
+        "Mod",
+        "Concat",
+        "Less",
+        "Greater",
+        "Equal",
+        "UnEqual",
+        "LessEqual",
+        "GreaterEqual",
+        "AddK",
+        "SubK",
+        "MulK",
+        "DivK",
+        "PowK",
+        "ModK",
+        "LessK",
+        "GreaterK",
+        "EqualK",
+        "UnEqualK",
+        "LessEqualK",
+        "GreaterEqualK",
+        "JmpLess",
+        "JmpGreater",
+        "JmpEqual",
+        "JmpUnEqual",
+        "JmpLessEqual",
+        "JmpGreaterEqual",
+        "NewTable",
+        "SetTable",
+        "GetTable",
+        "SetField",
+        "GetField",
+        "ForPrep",
+        "ForLoop",
+        "SetList",
+        "TailCall",
+        "GetGlobalField",
+        "GetTableK",
+        "SetTableK",
+    };
+    static_assert(sizeof(op_names) / sizeof(op_names[0]) ==
+                  luna::OpType_SetTableK + 1, "op names do not match OpType");
+
+    // Max count of lines of opcode pairs and functions in report
+    const std::size_t kMaxReportLines = 30;
+
+    std::string Percent(unsigned long long count, unsigned long long total)
+    {
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "%.2f%%",
+                 total ? count * 100.0 / total : 0.0);
+        return buffer;
+    }
+} // namespace
+
+namespace luna
+{
+    const char * GetOpTypeName(OpType op)
+    {
+        return op > 0 && op <= OpType_SetTableK ? op_names[op] : "?";
+    }
+
+    OpcodeStats::OpcodeStats()
+        : function_count_(nullptr), last_op_(0)
+    {
+        Clear();
+    }
+
+    void OpcodeStats::EnterFunction(const Function *proto)
+    {
+        auto it = functions_.find(proto);
+        if (it == functions_.end())
+        {
+            std::string module = proto->GetModule()->GetCStr();
+            auto name = proto->GetSuperior() ?
+                "function <" + module + ":" + std::to_string(proto->GetLine()) + ">" :
+                "main chunk " + module;
+            it = functions_.insert(std::make_pair(
+                proto, FunctionCount{ name, 0 })).first;
+        }
+
+        function_count_ = &it->second.count_;
+        last_op_ = 0;
+    }
+
+    void OpcodeStats::ForgetFunction(const Function *proto)
+    {
+        auto it = functions_.find(proto);
+        if (it == functions_.end())
+            return ;
+
+        forgotten_[it->second.name_] += it->second.count_;
+        if (function_count_ == &it->second.count_)
+            function_count_ = nullptr;
+        functions_.erase(it);
+    }
+
+    std::string OpcodeStats::Report() const
+    {
+        typedef std::pair<std::string, unsigned long long> Line;
+        auto by_count = [](const Line &l, const Line &r) {
+            return l.second > r.second ||
+                (l.second == r.second && l.first < r.first);
+        };
+
+        std::vector<Line> ops;
+        std::vector<Line> pairs;
+        unsigned long long total = 0;
+        for (std::size_t op = 1; op < kOpCount; ++op)
+        {
+            total += op_counts_[op];
+            if (op_counts_[op])
+                ops.push_back(Line(op_names[op], op_counts_[op]));
+
+            for (std::size_t next = 1; next < kOpCount; ++next)
+            {
+                auto count = pair_counts_[op][next];
+                if (count)
+                    pairs.push_back(Line(std::string(op_names[op]) + " " +
+                                         op_names[next], count));
+            }
+        }
+
+        // Counts of functions with the same name are merged
+        std::unordered_map<std::string, unsigned long long> merged(forgotten_);
+        for (const auto &function : functions_)
+            merged[function.second.name_] += function.second.count_;
+        std::vector<Line> functions(merged.begin(), merged.end());
+
+        std::sort(ops.begin(), ops.end(), by_count);
+        std::sort(pairs.begin(), pairs.end(), by_count);
+        std::sort(functions.begin(), functions.end(), by_count);
+
+        std::string report = "opcodes: " + std::to_string(total) + "\n";
+        for (const auto &line : ops)
+            report += "  " + line.first + " " + std::to_string(line.second) +
+                " " + Percent(line.second, total) + "\n";
+
+        report += "opcode pairs:\n";
+        for (std::size_t i = 0; i < pairs.size() && i < kMaxReportLines; ++i)
+            report += "  " + pairs[i].first + " " + std::to_string(pairs[i].second) +
+                " " + Percent(pairs[i].second, total) + "\n";
+
+        report += "functions:\n";
+        for (std::size_t i = 0; i < functions.size() && i < kMaxReportLines; ++i)
+            report += "  " + functions[i].first + " " + std::to_string(functions[i].second) +
+                " " + Percent(functions[i].second, total) + "\n";
+        return report;
+    }
+
+    void OpcodeStats::Clear()
+    {
+        std::fill(&op_counts_[0], &op_counts_[0] + kOpCount, 0);
+        std::fill(&pair_counts_[0][0], &pair_counts_[0][0] + kOpCount * kOpCount, 0);
+        for (auto &function : functions_)
+            function.second.count_ = 0;
+        forgotten_.clear();
+    }
+} // namespace luna
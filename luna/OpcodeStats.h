@@ -0,0 +1,70 @@
+#ifndef OPCODE_STATS_H
+#define OPCODE_STATS_H
+
+#include "OpCode.h"
+#include <string>
+#include <unordered_map>
+
+namespace luna
+{
+    class Function;
+
+    // Get name of 'op' without prefix "OpType_"
+    const char * GetOpTypeName(OpType op);
+
+    // Execution counters of opcodes, pairs of adjacent opcodes in a
+    // function and function prototypes. VM counts every instruction
+    // only when LUNA_OPCODE_STATS is defined.
+    class OpcodeStats
+    {
+    public:
+        static const std::size_t kOpCount = OpType_SetTableK + 1;
+
+        OpcodeStats();
+
+        OpcodeStats(const OpcodeStats&) = delete;
+        void operator = (const OpcodeStats&) = delete;
+
+        // VM starts or resumes executing instructions of 'proto'
+        void EnterFunction(const Function *proto);
+
+        // Count execution of 'op' in the function entered
+        void Count(unsigned int op)
+        {
+            ++op_counts_[op];
+            ++pair_counts_[last_op_][op];
+            ++*function_count_;
+            last_op_ = op;
+        }
+
+        // 'proto' is deleted, its counts are kept by its name
+        void ForgetFunction(const Function *proto);
+
+        // Get counts of opcodes and the most frequent opcode pairs and
+        // functions as text, ordered by count
+        std::string Report() const;
+
+        // Reset all counts to 0
+        void Clear();
+
+    private:
+        struct FunctionCount
+        {
+            // Module and define line of function, or module of main chunk
+            std::string name_;
+            unsigned long long count_;
+        };
+
+        unsigned long long op_counts_[kOpCount];
+        // Indexed by previous opcode and opcode, previous opcode is 0
+        // for the first instruction after entering function
+        unsigned long long pair_counts_[kOpCount][kOpCount];
+        std::unordered_map<const Function *, FunctionCount> functions_;
+        // Counts of deleted functions by name
+        std::unordered_map<std::string, unsigned long long> forgotten_;
+        unsigned long long *function_count_;
+        unsigned int last_op_;
+    };
+} // namespace luna
+
+#endif // OPCODE_STATS_H
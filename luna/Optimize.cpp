@@ -0,0 +1,527 @@
+#include "Optimize.h"
+#include "Visitor.h"
+#include "State.h"
+#include "String.h"
+#include <math.h>
+#include <algorithm>
+#include <string>
+
+namespace luna
+{
+    // Get value of constant AST, return false if AST is not a constant
+    static bool GetConstValue(const SyntaxTree *ast, Value &value)
+    {
+        auto term = dynamic_cast<const Terminator *>(ast);
+        if (!term)
+            return false;
+
+        switch (term->token_.token_)
+        {
+            case Token_Nil:
+                value.SetNil();
+                return true;
+            case Token_True:
+            case Token_False:
+                value.SetBool(term->token_.token_ == Token_True);
+                return true;
+            case Token_Number:
+                value.num_ = term->token_.number_;
+                value.type_ = ValueT_Number;
+                return true;
+            case Token_String:
+                value.str_ = term->token_.str_;
+                value.type_ = ValueT_String;
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // New constant AST of value, it takes the position of token
+    static std::unique_ptr<SyntaxTree> NewConstant(const TokenDetail &token,
+                                                   const Value &value)
+    {
+        TokenDetail detail = token;
+        switch (value.type_)
+        {
+            case ValueT_Bool:
+                detail.token_ = value.bvalue_ ? Token_True : Token_False;
+                break;
+            case ValueT_Number:
+                detail.number_ = value.num_;
+                detail.token_ = Token_Number;
+                break;
+            case ValueT_String:
+                detail.str_ = value.str_;
+                detail.token_ = Token_String;
+                break;
+            default:
+                detail.token_ = Token_Nil;
+                break;
+        }
+
+        auto term = new Terminator(detail);
+        term->semantic_ = SemanticOp_Read;
+        return std::unique_ptr<SyntaxTree>(term);
+    }
+
+    // Expression which is not function call or '...' has exactly one
+    // value, it can replace the and/or expression
+    static bool IsSingleValue(const SyntaxTree *exp)
+    {
+        if (dynamic_cast<const NormalFuncCall *>(exp) ||
+            dynamic_cast<const MemberFuncCall *>(exp))
+            return false;
+
+        auto term = dynamic_cast<const Terminator *>(exp);
+        return !term || term->token_.token_ != Token_VarArg;
+    }
+
+    // Statements after 'break' or a do block which always leaves the
+    // block are unreachable
+    static bool IsLeavingStatement(const SyntaxTree *stmt)
+    {
+        if (dynamic_cast<const BreakStatement *>(stmt))
+            return true;
+
+        auto do_stmt = dynamic_cast<const DoStatement *>(stmt);
+        if (!do_stmt)
+            return false;
+
+        auto block = static_cast<const Block *>(do_stmt->block_.get());
+        return block->return_stmt_ ||
+            (!block->statements_.empty() &&
+             IsLeavingStatement(block->statements_.back().get()));
+    }
+
+    class OptimizeVisitor : public Visitor
+    {
+    public:
+        virtual void Visit(Chunk *, void *);
+        virtual void Visit(Block *, void *);
+        virtual void Visit(ReturnStatement *, void *);
+        virtual void Visit(BreakStatement *, void *);
+        virtual void Visit(DoStatement *, void *);
+        virtual void Visit(WhileStatement *, void *);
+        virtual void Visit(RepeatStatement *, void *);
+        virtual void Visit(IfStatement *, void *);
+        virtual void Visit(ElseIfStatement *, void *);
+        virtual void Visit(ElseStatement *, void *);
+        virtual void Visit(NumericForStatement *, void *);
+        virtual void Visit(GenericForStatement *, void *);
+        virtual void Visit(FunctionStatement *, void *);
+        virtual void Visit(FunctionName *, void *);
+        virtual void Visit(LocalFunctionStatement *, void *);
+        virtual void Visit(LocalNameListStatement *, void *);
+        virtual void Visit(AssignmentStatement *, void *);
+        virtual void Visit(VarList *, void *);
+        virtual void Visit(Terminator *, void *);
+        virtual void Visit(BinaryExpression *, void *);
+        virtual void Visit(UnaryExpression *, void *);
+        virtual void Visit(FunctionBody *, void *);
+        virtual void Visit(ParamList *, void *);
+        virtual void Visit(NameList *, void *);
+        virtual void Visit(TableDefine *, void *);
+        virtual void Visit(TableIndexField *, void *);
+        virtual void Visit(TableNameField *, void *);
+        virtual void Visit(TableArrayField *, void *);
+        virtual void Visit(IndexAccessor *, void *);
+        virtual void Visit(MemberAccessor *, void *);
+        virtual void Visit(NormalFuncCall *, void *);
+        virtual void Visit(MemberFuncCall *, void *);
+        virtual void Visit(FuncCallArgs *, void *);
+        virtual void Visit(ExpressionList *, void *);
+
+        explicit OptimizeVisitor(State *state) : state_(state) { }
+
+    private:
+        // Optimize the AST which owned by 'ast', the data of visit is
+        // the owner, so the AST can replace itself with a new AST
+        void Optimize(std::unique_ptr<SyntaxTree> &ast)
+        {
+            if (ast)
+                ast->Accept(this, &ast);
+        }
+
+        // Replace the AST which owned by owner 'data', replacing destroys
+        // the old AST, so it must be the last thing of the visit
+        void Replace(void *data, std::unique_ptr<SyntaxTree> ast)
+        {
+            *static_cast<std::unique_ptr<SyntaxTree> *>(data) = std::move(ast);
+        }
+
+        // Fold binary operator with constant operands, return false when
+        // it can not be folded at compile time
+        bool FoldBinary(int op, const Value &left,
+                        const Value &right, Value &result);
+
+        // Statement of the remaining branch of if statement
+        std::unique_ptr<SyntaxTree> ElseBranch(std::unique_ptr<SyntaxTree> branch);
+
+        State *state_;
+    };
+
+    bool OptimizeVisitor::FoldBinary(int op, const Value &left,
+                                     const Value &right, Value &result)
+    {
+        if (op == Token_Equal || op == Token_NotEqual)
+        {
+            result.SetBool((left == right) == (op == Token_Equal));
+            return true;
+        }
+
+        if (op == Token_Concat)
+        {
+            if (left.type_ != ValueT_String || right.type_ != ValueT_String)
+                return false;
+
+            std::string str;
+            str.reserve(left.str_->GetLength() + right.str_->GetLength());
+            str.append(left.str_->GetCStr(), left.str_->GetLength());
+            str.append(right.str_->GetCStr(), right.str_->GetLength());
+            result.str_ = state_->GetString(str);
+            result.type_ = ValueT_String;
+            return true;
+        }
+
+        // Compare strings as the VM does
+        if (left.type_ == ValueT_String && right.type_ == ValueT_String)
+        {
+            const String &l = *left.str_;
+            const String &r = *right.str_;
+            switch (op)
+            {
+                case '<': result.SetBool(l < r); return true;
+                case '>': result.SetBool(l > r); return true;
+                case Token_LessEqual: result.SetBool(l <= r); return true;
+                case Token_GreaterEqual: result.SetBool(l >= r); return true;
+                default: return false;
+            }
+        }
+
+        if (left.type_ != ValueT_Number || right.type_ != ValueT_Number)
+            return false;
+
+        double l = left.num_;
+        double r = right.num_;
+        result.type_ = ValueT_Number;
+        switch (op)
+        {
+            case '+': result.num_ = l + r; return true;
+            case '-': result.num_ = l - r; return true;
+            case '*': result.num_ = l * r; return true;
+            case '/': result.num_ = l / r; return true;
+            case '^': result.num_ = pow(l, r); return true;
+            case '%': result.num_ = fmod(l, r); return true;
+            case '<': result.SetBool(l < r); return true;
+            case '>': result.SetBool(l > r); return true;
+            case Token_LessEqual: result.SetBool(l <= r); return true;
+            case Token_GreaterEqual: result.SetBool(l >= r); return true;
+            default: return false;
+        }
+    }
+
+    std::unique_ptr<SyntaxTree>
+    OptimizeVisitor::ElseBranch(std::unique_ptr<SyntaxTree> branch)
+    {
+        // else block becomes do block
+        if (auto else_stmt = dynamic_cast<ElseStatement *>(branch.get()))
+            return std::unique_ptr<SyntaxTree>(
+                new DoStatement(std::move(else_stmt->block_)));
+
+        // elseif statement becomes if statement
+        if (auto elseif_stmt = dynamic_cast<ElseIfStatement *>(branch.get()))
+            return std::unique_ptr<SyntaxTree>(
+                new IfStatement(std::move(elseif_stmt->exp_),
+                                std::move(elseif_stmt->true_branch_),
+                                std::move(elseif_stmt->false_branch_),
+                                elseif_stmt->line_,
+                                elseif_stmt->block_end_line_));
+
+        return branch;
+    }
+
+    void OptimizeVisitor::Visit(Chunk *chunk, void *data)
+    {
+        Optimize(chunk->block_);
+    }
+
+    void OptimizeVisitor::Visit(Block *block, void *data)
+    {
+        auto &statements = block->statements_;
+        for (auto &stmt : statements)
+            Optimize(stmt);
+        Optimize(block->return_stmt_);
+
+        // Remove statements which are optimized out
+        statements.erase(std::remove(statements.begin(), statements.end(), nullptr),
+                         statements.end());
+
+        // Remove unreachable statements
+        auto it = std::find_if(statements.begin(), statements.end(),
+                               [] (const std::unique_ptr<SyntaxTree> &stmt) {
+                                   return IsLeavingStatement(stmt.get());
+                               });
+        if (it != statements.end())
+        {
+            statements.erase(it + 1, statements.end());
+            block->return_stmt_.reset();
+        }
+    }
+
+    void OptimizeVisitor::Visit(ReturnStatement *ret_stmt, void *data)
+    {
+        Optimize(ret_stmt->exp_list_);
+    }
+
+    void OptimizeVisitor::Visit(BreakStatement *break_stmt, void *data)
+    {
+    }
+
+    void OptimizeVisitor::Visit(DoStatement *do_stmt, void *data)
+    {
+        Optimize(do_stmt->block_);
+    }
+
+    void OptimizeVisitor::Visit(WhileStatement *while_stmt, void *data)
+    {
+        Optimize(while_stmt->exp_);
+        Optimize(while_stmt->block_);
+
+        // Loop body never runs when condition is false
+        Value cond;
+        if (GetConstValue(while_stmt->exp_.get(), cond) && cond.IsFalse())
+            Replace(data, nullptr);
+    }
+
+    void OptimizeVisitor::Visit(RepeatStatement *repeat_stmt, void *data)
+    {
+        Optimize(repeat_stmt->block_);
+        Optimize(repeat_stmt->exp_);
+    }
+
+    void OptimizeVisitor::Visit(IfStatement *if_stmt, void *data)
+    {
+        Optimize(if_stmt->exp_);
+        Optimize(if_stmt->true_branch_);
+        Optimize(if_stmt->false_branch_);
+
+        Value cond;
+        if (!GetConstValue(if_stmt->exp_.get(), cond))
+            return ;
+
+        if (cond.IsFalse())
+            Replace(data, ElseBranch(std::move(if_stmt->false_branch_)));
+        else
+            Replace(data, std::unique_ptr<SyntaxTree>(
+                new DoStatement(std::move(if_stmt->true_branch_))));
+    }
+
+    void OptimizeVisitor::Visit(ElseIfStatement *elseif_stmt, void *data)
+    {
+        Optimize(elseif_stmt->exp_);
+        Optimize(elseif_stmt->true_branch_);
+        Optimize(elseif_stmt->false_branch_);
+
+        Value cond;
+        if (!GetConstValue(elseif_stmt->exp_.get(), cond))
+            return ;
+
+        if (cond.IsFalse())
+            Replace(data, std::move(elseif_stmt->false_branch_));
+        else
+            Replace(data, std::unique_ptr<SyntaxTree>(
+                new ElseStatement(std::move(elseif_stmt->true_branch_))));
+    }
+
+    void OptimizeVisitor::Visit(ElseStatement *else_stmt, void *data)
+    {
+        Optimize(else_stmt->block_);
+    }
+
+    void OptimizeVisitor::Visit(NumericForStatement *num_for, void *data)
+    {
+        Optimize(num_for->exp1_);
+        Optimize(num_for->exp2_);
+        Optimize(num_for->exp3_);
+        Optimize(num_for->block_);
+    }
+
+    void OptimizeVisitor::Visit(GenericForStatement *gen_for, void *data)
+    {
+        Optimize(gen_for->exp_list_);
+        Optimize(gen_for->block_);
+    }
+
+    void OptimizeVisitor::Visit(FunctionStatement *func_stmt, void *data)
+    {
+        Optimize(func_stmt->func_body_);
+    }
+
+    void OptimizeVisitor::Visit(FunctionName *func_name, void *data)
+    {
+    }
+
+    void OptimizeVisitor::Visit(LocalFunctionStatement *l_func_stmt, void *data)
+    {
+        Optimize(l_func_stmt->func_body_);
+    }
+
+    void OptimizeVisitor::Visit(LocalNameListStatement *l_namelist_stmt, void *data)
+    {
+        Optimize(l_namelist_stmt->exp_list_);
+    }
+
+    void OptimizeVisitor::Visit(AssignmentStatement *assign_stmt, void *data)
+    {
+        Optimize(assign_stmt->var_list_);
+        Optimize(assign_stmt->exp_list_);
+    }
+
+    void OptimizeVisitor::Visit(VarList *var_list, void *data)
+    {
+        for (auto &var : var_list->var_list_)
+            Optimize(var);
+    }
+
+    void OptimizeVisitor::Visit(Terminator *term, void *data)
+    {
+    }
+
+    void OptimizeVisitor::Visit(BinaryExpression *bin_exp, void *data)
+    {
+        Optimize(bin_exp->left_);
+        Optimize(bin_exp->right_);
+
+        int op = bin_exp->op_token_.token_;
+        Value left;
+        if (!GetConstValue(bin_exp->left_.get(), left))
+            return ;
+
+        if (op == Token_And || op == Token_Or)
+        {
+            // Right expression is the result only when it is one value,
+            // otherwise and/or adjusts it to one value
+            bool left_result = (op == Token_And) == left.IsFalse();
+            if (left_result)
+                Replace(data, std::move(bin_exp->left_));
+            else if (IsSingleValue(bin_exp->right_.get()))
+                Replace(data, std::move(bin_exp->right_));
+            return ;
+        }
+
+        Value right;
+        Value result;
+        if (GetConstValue(bin_exp->right_.get(), right) &&
+            FoldBinary(op, left, right, result))
+            Replace(data, NewConstant(bin_exp->op_token_, result));
+    }
+
+    void OptimizeVisitor::Visit(UnaryExpression *unary_exp, void *data)
+    {
+        Optimize(unary_exp->exp_);
+
+        Value value;
+        if (!GetConstValue(unary_exp->exp_.get(), value))
+            return ;
+
+        Value result;
+        switch (unary_exp->op_token_.token_)
+        {
+            case '-':
+                if (value.type_ != ValueT_Number)
+                    return ;
+                result.num_ = -value.num_;
+                result.type_ = ValueT_Number;
+                break;
+            case '#':
+                if (value.type_ != ValueT_String)
+                    return ;
+                result.num_ = value.str_->GetLength();
+                result.type_ = ValueT_Number;
+                break;
+            case Token_Not:
+                result.SetBool(value.IsFalse());
+                break;
+            default:
+                return ;
+        }
+
+        Replace(data, NewConstant(unary_exp->op_token_, result));
+    }
+
+    void OptimizeVisitor::Visit(FunctionBody *func_body, void *data)
+    {
+        Optimize(func_body->block_);
+    }
+
+    void OptimizeVisitor::Visit(ParamList *par_list, void *data)
+    {
+    }
+
+    void OptimizeVisitor::Visit(NameList *name_list, void *data)
+    {
+    }
+
+    void OptimizeVisitor::Visit(TableDefine *table_def, void *data)
+    {
+        for (auto &field : table_def->fields_)
+            Optimize(field);
+    }
+
+    void OptimizeVisitor::Visit(TableIndexField *field, void *data)
+    {
+        Optimize(field->index_);
+        Optimize(field->value_);
+    }
+
+    void OptimizeVisitor::Visit(TableNameField *field, void *data)
+    {
+        Optimize(field->value_);
+    }
+
+    void OptimizeVisitor::Visit(TableArrayField *field, void *data)
+    {
+        Optimize(field->value_);
+    }
+
+    void OptimizeVisitor::Visit(IndexAccessor *accessor, void *data)
+    {
+        Optimize(accessor->table_);
+        Optimize(accessor->index_);
+    }
+
+    void OptimizeVisitor::Visit(MemberAccessor *accessor, void *data)
+    {
+        Optimize(accessor->table_);
+    }
+
+    void OptimizeVisitor::Visit(NormalFuncCall *func_call, void *data)
+    {
+        Optimize(func_call->caller_);
+        Optimize(func_call->args_);
+    }
+
+    void OptimizeVisitor::Visit(MemberFuncCall *func_call, void *data)
+    {
+        Optimize(func_call->caller_);
+        Optimize(func_call->args_);
+    }
+
+    void OptimizeVisitor::Visit(FuncCallArgs *call_args, void *data)
+    {
+        Optimize(call_args->arg_);
+    }
+
+    void OptimizeVisitor::Visit(ExpressionList *exp_list, void *data)
+    {
+        for (auto &exp : exp_list->exp_list_)
+            Optimize(exp);
+    }
+
+    void Optimize(SyntaxTree *root, State *state)
+    {
+        OptimizeVisitor optimizer(state);
+        root->Accept(&optimizer, nullptr);
+    }
+} // namespace luna
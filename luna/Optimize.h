@@ -0,0 +1,15 @@
+#ifndef OPTIMIZE_H
+#define OPTIMIZE_H
+
+#include "SyntaxTree.h"
+
+namespace luna
+{
+    class State;
+
+    // Fold constant expressions, prune constant condition branches and
+    // remove unreachable statements, AST must pass semantic analysis
+    void Optimize(SyntaxTree *root, State *state);
+}
+
+#endif // OPTIMIZE_H
@@ -0,0 +1,151 @@
+#include "Pack.h"
+#include "Exception.h"
+
+namespace
+{
+    // Alignment of '!' without size
+    const std::size_t kNativeAlign = 8;
+
+    bool IsNativeLittle()
+    {
+        const uint16_t one = 1;
+        return *reinterpret_cast<const unsigned char *>(&one) == 1;
+    }
+
+    bool IsDigit(char c)
+    {
+        return c >= '0' && c <= '9';
+    }
+} // namespace
+
+namespace lib {
+namespace string {
+
+    PackFormat::PackFormat(const char *format, std::size_t len)
+        : current_(format), end_(format + len),
+          little_(IsNativeLittle()), max_align_(1)
+    {
+    }
+
+    std::size_t PackFormat::ReadSize(std::size_t default_size)
+    {
+        if (current_ == end_ || !IsDigit(*current_))
+            return default_size;
+
+        std::size_t size = 0;
+        while (current_ != end_ && IsDigit(*current_))
+        {
+            size = size * 10 + (*current_++ - '0');
+            if (size > 0xFFFFFFFF)
+                throw luna::CallCFuncException("size of format option overflow");
+        }
+        return size;
+    }
+
+    std::size_t PackFormat::ReadIntSize(std::size_t default_size)
+    {
+        auto size = ReadSize(default_size);
+        if (size < 1 || size > 8)
+            throw luna::CallCFuncException("integral size (", size,
+                                           ") out of limits [1,8]");
+        return size;
+    }
+
+    PackOption::Kind PackFormat::ReadOption(std::size_t &size)
+    {
+        auto c = *current_++;
+        size = 0;
+        switch (c)
+        {
+            case 'b': size = sizeof(char); return PackOption::Int;
+            case 'B': size = sizeof(char); return PackOption::Uint;
+            case 'h': size = sizeof(short); return PackOption::Int;
+            case 'H': size = sizeof(short); return PackOption::Uint;
+            case 'l': size = sizeof(long); return PackOption::Int;
+            case 'L': size = sizeof(long); return PackOption::Uint;
+            case 'j': size = sizeof(int64_t); return PackOption::Int;
+            case 'J': size = sizeof(int64_t); return PackOption::Uint;
+            case 'T': size = sizeof(std::size_t); return PackOption::Uint;
+            case 'i': size = ReadIntSize(sizeof(int)); return PackOption::Int;
+            case 'I': size = ReadIntSize(sizeof(int)); return PackOption::Uint;
+            case 'f': size = sizeof(float); return PackOption::Float;
+            case 'd': case 'n': size = sizeof(double); return PackOption::Double;
+            case 's': size = ReadIntSize(sizeof(std::size_t)); return PackOption::String;
+            case 'z': return PackOption::ZString;
+            case 'x': size = 1; return PackOption::Padding;
+            case 'X': return PackOption::PaddingAlign;
+            case 'c':
+                if (current_ == end_ || !IsDigit(*current_))
+                    throw luna::CallCFuncException("missing size for format option 'c'");
+                size = ReadSize(0);
+                return PackOption::Char;
+            case ' ': return PackOption::Nop;
+            case '<': little_ = true; return PackOption::Nop;
+            case '>': little_ = false; return PackOption::Nop;
+            case '=': little_ = IsNativeLittle(); return PackOption::Nop;
+            case '!': max_align_ = ReadIntSize(kNativeAlign); return PackOption::Nop;
+            default:
+                throw luna::CallCFuncException("invalid format option '", c, "'");
+        }
+    }
+
+    bool PackFormat::Next(std::size_t total, PackOption &option)
+    {
+        if (current_ == end_)
+            return false;
+
+        option.kind_ = ReadOption(option.size_);
+        option.padding_ = 0;
+        option.little_ = little_;
+
+        // 'X' aligns as the size of the next option
+        auto align = option.size_;
+        if (option.kind_ == PackOption::PaddingAlign)
+        {
+            PackOption::Kind next = PackOption::Nop;
+            if (current_ != end_)
+                next = ReadOption(align);
+            if (next == PackOption::Char || align == 0)
+                throw luna::CallCFuncException("invalid next option for option 'X'");
+        }
+
+        if (align > 1 && option.kind_ != PackOption::Char)
+        {
+            if (align > max_align_)
+                align = max_align_;
+            if ((align & (align - 1)) != 0)
+                throw luna::CallCFuncException("format asks for alignment not power of 2");
+            option.padding_ = (align - (total & (align - 1))) & (align - 1);
+        }
+        return true;
+    }
+
+    void PackInt(char *dst, uint64_t value, std::size_t size, bool little)
+    {
+        for (std::size_t i = 0; i < size; ++i)
+        {
+            dst[little ? i : size - 1 - i] = static_cast<char>(value & 0xFF);
+            value >>= 8;
+        }
+    }
+
+    uint64_t UnpackInt(const char *src, std::size_t size,
+                       bool little, bool is_signed)
+    {
+        uint64_t value = 0;
+        for (std::size_t i = 0; i < size; ++i)
+        {
+            auto byte = static_cast<unsigned char>(src[little ? size - 1 - i : i]);
+            value = (value << 8) | byte;
+        }
+
+        if (is_signed && size < 8)
+        {
+            auto sign = static_cast<uint64_t>(1) << (size * 8 - 1);
+            value = (value ^ sign) - sign;
+        }
+        return value;
+    }
+
+} // namespace string
+} // namespace lib
@@ -0,0 +1,75 @@
+#ifndef PACK_H
+#define PACK_H
+
+#include <cstddef>
+#include <stdint.h>
+
+namespace lib {
+namespace string {
+
+    // Option of pack format
+    struct PackOption
+    {
+        enum Kind
+        {
+            Int,            // signed integer of 'size_' bytes
+            Uint,           // unsigned integer of 'size_' bytes
+            Float,          // float
+            Double,         // double
+            Char,           // fixed string of 'size_' bytes
+            String,         // string preceded by length of 'size_' bytes
+            ZString,        // zero-terminated string
+            Padding,        // one byte of padding
+            PaddingAlign,   // padding to align as the next option
+            Nop,            // configuration only
+        };
+
+        Kind kind_;
+        // Bytes of value, or bytes of length of String
+        std::size_t size_;
+        // Bytes of padding before the value for alignment
+        std::size_t padding_;
+        // Byte order of value
+        bool little_;
+    };
+
+    // Reader of pack format which has the same syntax as string.pack of
+    // Lua 5.3, except that integers are 1 to 8 bytes. Malformed format
+    // throws CallCFuncException.
+    class PackFormat
+    {
+    public:
+        PackFormat(const char *format, std::size_t len);
+
+        // Read next option into 'option', 'total' is bytes packed before
+        // the option for alignment, return false at end of format
+        bool Next(std::size_t total, PackOption &option);
+
+    private:
+        // Read kind and size of the option, without alignment
+        PackOption::Kind ReadOption(std::size_t &size);
+
+        // Read optional size number, or return 'default_size'
+        std::size_t ReadSize(std::size_t default_size);
+
+        // Read integer size in [1, 8]
+        std::size_t ReadIntSize(std::size_t default_size);
+
+        const char *current_;
+        const char *end_;
+        bool little_;
+        std::size_t max_align_;
+    };
+
+    // Write low 'size' bytes of 'value' into 'dst' in byte order
+    void PackInt(char *dst, uint64_t value, std::size_t size, bool little);
+
+    // Read integer of 'size' bytes from 'src' in byte order, sign bit is
+    // extended when 'is_signed' is true
+    uint64_t UnpackInt(const char *src, std::size_t size,
+                       bool little, bool is_signed);
+
+} // namespace string
+} // namespace lib
+
+#endif // PACK_H
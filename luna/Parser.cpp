@@ -130,6 +130,7 @@ namespace
         std::unique_ptr<SyntaxTree> ParseFunctionBody()
         {
             int line = LookAhead().line_;
+            auto source_begin = lexer_->GetBufferBegin() + LookAhead().offset_;
             if (NextToken().token_ != '(')
                 throw ParseException("unexpect token after 'function', expect '('", current_);
 
@@ -146,8 +147,19 @@ namespace
             if (NextToken().token_ != Token_End)
                 throw ParseException("unexpect token after function body, expect 'end'", current_);
 
+            // Source ends after 'end'
+            auto source_end = lexer_->GetBufferBegin() + current_.offset_ + 3;
             return std::unique_ptr<SyntaxTree>(new FunctionBody(std::move(param_list),
-                                                                std::move(block), line));
+                                                                std::move(block), line,
+                                                                source_begin, source_end));
+        }
+
+        std::unique_ptr<SyntaxTree> ParseLazyFunctionBody()
+        {
+            auto body = ParseFunctionBody();
+            if (NextToken().token_ != Token_EOF)
+                throw ParseException("expect <eof>", current_);
+            return body;
         }
 
         std::unique_ptr<SyntaxTree> ParseParamList()
@@ -762,11 +774,20 @@ namespace
             while (LookAhead().token_ != '}')
             {
                 if (LookAhead().token_ == '[')
+                {
                     table->fields_.push_back(ParseTableIndexField());
+                    ++table->hash_field_count_;
+                }
                 else if (LookAhead().token_ == Token_Id && LookAhead2().token_ == '=')
+                {
                     table->fields_.push_back(ParseTableNameField());
+                    ++table->hash_field_count_;
+                }
                 else
+                {
                     table->fields_.push_back(ParseTableArrayField());
+                    ++table->array_field_count_;
+                }
 
                 if (LookAhead().token_ != '}')
                 {
@@ -912,4 +933,10 @@ namespace luna
         ParserImpl impl(lexer);
         return impl.Parse();
     }
+
+    std::unique_ptr<SyntaxTree> ParseFunctionBody(Lexer *lexer)
+    {
+        ParserImpl impl(lexer);
+        return impl.ParseLazyFunctionBody();
+    }
 } // namespace luna
@@ -10,6 +10,10 @@ namespace luna
     class State;
 
     std::unique_ptr<SyntaxTree> Parse(Lexer *lexer);
+
+    // Parse a function body from '(' of params to 'end', which is the
+    // source of a function compiled lazily
+    std::unique_ptr<SyntaxTree> ParseFunctionBody(Lexer *lexer);
 } // namespace luna
 
 #endif // PARSER_H
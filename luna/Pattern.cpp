@@ -0,0 +1,461 @@
+#include "Pattern.h"
+#include "Exception.h"
+#include <cctype>
+#include <cstring>
+
+namespace
+{
+    // Max depth of recursive matching, deeper pattern is too complex
+    const int kMaxMatchDepth = 200;
+
+    const char kSpecials[] = "^$*+?.([%-";
+
+    inline unsigned char Byte(const char *s)
+    {
+        return static_cast<unsigned char>(*s);
+    }
+} // namespace
+
+namespace lib {
+namespace string {
+
+    Pattern::Pattern(const char *pattern, std::size_t len)
+        : source_(pattern, len),
+          anchored_(false),
+          plain_(false),
+          capture_count_(0),
+          first_char_(-1)
+    {
+        Compile();
+    }
+
+    void Pattern::Compile()
+    {
+        const char *p = source_.data();
+        const char *end = p + source_.size();
+
+        plain_ = true;
+        for (auto c = p; c != end && plain_; ++c)
+            plain_ = !std::strchr(kSpecials, *c) || *c == '\0';
+
+        anchored_ = p != end && *p == '^';
+        if (anchored_)
+            ++p;
+
+        // Index of open captures, and which captures are closed
+        std::vector<int> open;
+        std::vector<bool> closed;
+
+        while (p != end)
+        {
+            if (*p == '(')
+            {
+                if (capture_count_ >= kMaxCaptures)
+                    throw luna::CallCFuncException("too many captures");
+
+                if (p + 1 != end && p[1] == ')')
+                {
+                    items_.emplace_back(ItemType_Position, capture_count_++);
+                    closed.push_back(true);
+                    p += 2;
+                }
+                else
+                {
+                    open.push_back(capture_count_);
+                    closed.push_back(false);
+                    items_.emplace_back(ItemType_Open, capture_count_++);
+                    ++p;
+                }
+                continue;
+            }
+            else if (*p == ')')
+            {
+                if (open.empty())
+                    throw luna::CallCFuncException("invalid pattern capture");
+                closed[open.back()] = true;
+                items_.emplace_back(ItemType_Close, open.back());
+                open.pop_back();
+                ++p;
+                continue;
+            }
+            else if (*p == '$' && p + 1 == end)
+            {
+                items_.emplace_back(ItemType_End);
+                ++p;
+                continue;
+            }
+            else if (*p == '%')
+            {
+                if (p + 1 == end)
+                    throw luna::CallCFuncException("malformed pattern (ends with '%')");
+
+                if (p[1] == 'b')
+                {
+                    if (end - p < 4)
+                        throw luna::CallCFuncException("missing arguments to '%b'");
+                    items_.emplace_back(ItemType_Balance, Byte(p + 2), Byte(p + 3));
+                    p += 4;
+                    continue;
+                }
+                else if (p[1] == 'f')
+                {
+                    p += 2;
+                    if (p == end || *p != '[')
+                        throw luna::CallCFuncException("missing '[' after '%f' in pattern");
+                    Item item(ItemType_Frontier);
+                    p = CompileSet(p + 1, end, &item.set_);
+                    items_.push_back(item);
+                    continue;
+                }
+                else if (std::isdigit(Byte(p + 1)))
+                {
+                    int index = p[1] - '1';
+                    if (index < 0 || index >= capture_count_ || !closed[index])
+                        throw luna::CallCFuncException("invalid capture index %", index + 1);
+                    items_.emplace_back(ItemType_BackRef, index);
+                    p += 2;
+                    continue;
+                }
+            }
+
+            // Single character class with optional quantifier
+            Item item(ItemType_Single);
+            if (*p == '%')
+            {
+                AddClass(Byte(p + 1), &item.set_);
+                p += 2;
+            }
+            else if (*p == '[')
+            {
+                p = CompileSet(p + 1, end, &item.set_);
+            }
+            else if (*p == '.')
+            {
+                item.set_.set();
+                ++p;
+            }
+            else
+            {
+                item.set_.set(Byte(p));
+                ++p;
+            }
+
+            if (p != end)
+            {
+                switch (*p)
+                {
+                    case '?': item.quantifier_ = Quantifier_Optional; ++p; break;
+                    case '*': item.quantifier_ = Quantifier_Star; ++p; break;
+                    case '+': item.quantifier_ = Quantifier_Plus; ++p; break;
+                    case '-': item.quantifier_ = Quantifier_Minus; ++p; break;
+                    default: break;
+                }
+            }
+
+            items_.push_back(item);
+        }
+
+        if (!open.empty())
+            throw luna::CallCFuncException("unfinished capture");
+
+        // A match must start with the only character of first item
+        if (!items_.empty() && items_[0].type_ == ItemType_Single &&
+            (items_[0].quantifier_ == Quantifier_One ||
+             items_[0].quantifier_ == Quantifier_Plus) &&
+            items_[0].set_.count() == 1)
+        {
+            for (int c = 0; c < 256; ++c)
+            {
+                if (items_[0].set_.test(c))
+                    first_char_ = c;
+            }
+        }
+    }
+
+    void Pattern::AddClass(unsigned char c, CharSet *set)
+    {
+        int (*is_class)(int) = nullptr;
+        switch (std::tolower(c))
+        {
+            case 'a': is_class = std::isalpha; break;
+            case 'c': is_class = std::iscntrl; break;
+            case 'd': is_class = std::isdigit; break;
+            case 'g': is_class = std::isgraph; break;
+            case 'l': is_class = std::islower; break;
+            case 'p': is_class = std::ispunct; break;
+            case 's': is_class = std::isspace; break;
+            case 'u': is_class = std::isupper; break;
+            case 'w': is_class = std::isalnum; break;
+            case 'x': is_class = std::isxdigit; break;
+            case 'z':
+                {
+                    CharSet zero;
+                    zero.set(0);
+                    *set |= std::isupper(c) ? ~zero : zero;
+                }
+                return ;
+            default:
+                // Escaped character
+                set->set(c);
+                return ;
+        }
+
+        CharSet cls;
+        for (int i = 0; i < 256; ++i)
+        {
+            if (is_class(i))
+                cls.set(i);
+        }
+        *set |= std::isupper(c) ? ~cls : cls;
+    }
+
+    const char * Pattern::CompileSet(const char *p, const char *end, CharSet *set)
+    {
+        bool complement = p != end && *p == '^';
+        if (complement)
+            ++p;
+
+        // ']' right after '[' or '[^' is a member of set
+        bool first = true;
+        for (;;)
+        {
+            if (p == end)
+                throw luna::CallCFuncException("malformed pattern (missing ']')");
+
+            if (*p == ']' && !first)
+            {
+                ++p;
+                break;
+            }
+            first = false;
+
+            if (*p == '%')
+            {
+                if (++p == end)
+                    throw luna::CallCFuncException("malformed pattern (missing ']')");
+                AddClass(Byte(p), set);
+                ++p;
+            }
+            else if (end - p > 2 && p[1] == '-' && p[2] != ']')
+            {
+                for (int c = Byte(p); c <= Byte(p + 2); ++c)
+                    set->set(c);
+                p += 3;
+            }
+            else
+            {
+                set->set(Byte(p));
+                ++p;
+            }
+        }
+
+        if (complement)
+            set->flip();
+        return p;
+    }
+
+    const char * Pattern::Match(const char *begin, const char *end,
+                                const char *s, Capture *captures) const
+    {
+        MatchState ms = { begin, end, captures, 0 };
+        return DoMatch(&ms, s, 0);
+    }
+
+    const char * Pattern::Search(const char *begin, const char *end,
+                                 const char *s, const char **match_end,
+                                 Capture *captures) const
+    {
+        for (;;)
+        {
+            if (first_char_ >= 0 && !anchored_)
+            {
+                s = static_cast<const char *>(std::memchr(s, first_char_, end - s));
+                if (!s)
+                    return nullptr;
+            }
+
+            auto e = Match(begin, end, s, captures);
+            if (e)
+            {
+                *match_end = e;
+                return s;
+            }
+
+            if (anchored_ || s == end)
+                return nullptr;
+            ++s;
+        }
+    }
+
+    const char * Pattern::DoMatch(MatchState *ms, const char *s,
+                                  std::size_t index) const
+    {
+        if (++ms->depth_ > kMaxMatchDepth)
+            throw luna::CallCFuncException("pattern too complex");
+        auto e = MatchItems(ms, s, index);
+        --ms->depth_;
+        return e;
+    }
+
+    const char * Pattern::MatchItems(MatchState *ms, const char *s,
+                                     std::size_t index) const
+    {
+        // Captures are set again when backtracking matches them again,
+        // so only quantifiers need recursion
+        while (index < items_.size())
+        {
+            const Item &item = items_[index];
+            switch (item.type_)
+            {
+                case ItemType_Single:
+                    {
+                        bool m = s != ms->end_ && item.set_.test(Byte(s));
+                        switch (item.quantifier_)
+                        {
+                            case Quantifier_One:
+                                if (!m)
+                                    return nullptr;
+                                ++s;
+                                break;
+                            case Quantifier_Optional:
+                                if (m)
+                                {
+                                    auto e = DoMatch(ms, s + 1, index + 1);
+                                    if (e)
+                                        return e;
+                                }
+                                break;
+                            case Quantifier_Star:
+                                return MaxExpand(ms, s, index);
+                            case Quantifier_Plus:
+                                return m ? MaxExpand(ms, s + 1, index) : nullptr;
+                            case Quantifier_Minus:
+                                return MinExpand(ms, s, index);
+                        }
+                    }
+                    break;
+                case ItemType_Open:
+                    ms->captures_[item.arg_].begin_ = s;
+                    break;
+                case ItemType_Close:
+                    {
+                        auto &capture = ms->captures_[item.arg_];
+                        capture.len_ = s - capture.begin_;
+                    }
+                    break;
+                case ItemType_Position:
+                    ms->captures_[item.arg_].begin_ = s;
+                    ms->captures_[item.arg_].len_ = Capture::kPosition;
+                    break;
+                case ItemType_BackRef:
+                    {
+                        const auto &capture = ms->captures_[item.arg_];
+                        auto len = capture.IsPosition() ? 0 : capture.len_;
+                        if (ms->end_ - s < len ||
+                            std::memcmp(capture.begin_, s, len) != 0)
+                            return nullptr;
+                        s += len;
+                    }
+                    break;
+                case ItemType_Balance:
+                    s = MatchBalance(ms, s, item);
+                    if (!s)
+                        return nullptr;
+                    break;
+                case ItemType_Frontier:
+                    {
+                        unsigned char prev = s == ms->begin_ ? 0 : Byte(s - 1);
+                        unsigned char cur = s == ms->end_ ? 0 : Byte(s);
+                        if (item.set_.test(prev) || !item.set_.test(cur))
+                            return nullptr;
+                    }
+                    break;
+                case ItemType_End:
+                    return s == ms->end_ ? s : nullptr;
+            }
+            ++index;
+        }
+        return s;
+    }
+
+    const char * Pattern::MaxExpand(MatchState *ms, const char *s,
+                                    std::size_t index) const
+    {
+        const auto &set = items_[index].set_;
+        std::size_t count = 0;
+        while (s + count != ms->end_ && set.test(Byte(s + count)))
+            ++count;
+
+        // The last item matches as many as possible
+        if (index + 1 == items_.size())
+            return s + count;
+
+        for (;;)
+        {
+            auto e = DoMatch(ms, s + count, index + 1);
+            if (e)
+                return e;
+            if (count-- == 0)
+                return nullptr;
+        }
+    }
+
+    const char * Pattern::MinExpand(MatchState *ms, const char *s,
+                                    std::size_t index) const
+    {
+        const auto &set = items_[index].set_;
+        for (;;)
+        {
+            auto e = DoMatch(ms, s, index + 1);
+            if (e)
+                return e;
+            if (s != ms->end_ && set.test(Byte(s)))
+                ++s;
+            else
+                return nullptr;
+        }
+    }
+
+    const char * Pattern::MatchBalance(MatchState *ms, const char *s,
+                                       const Item &item) const
+    {
+        if (s == ms->end_ || Byte(s) != item.arg_)
+            return nullptr;
+
+        int depth = 1;
+        while (++s != ms->end_)
+        {
+            if (Byte(s) == item.arg2_)
+            {
+                if (--depth == 0)
+                    return s + 1;
+            }
+            else if (Byte(s) == item.arg_)
+            {
+                ++depth;
+            }
+        }
+        return nullptr;
+    }
+
+    const char * FindText(const char *s, const char *end,
+                          const char *text, std::size_t len)
+    {
+        if (len == 0)
+            return s;
+
+        while (static_cast<std::size_t>(end - s) >= len)
+        {
+            // memchr scans a word or a vector of bytes each step
+            s = static_cast<const char *>(std::memchr(s, *text, end - s - len + 1));
+            if (!s)
+                return nullptr;
+            if (std::memcmp(s + 1, text + 1, len - 1) == 0)
+                return s;
+            ++s;
+        }
+        return nullptr;
+    }
+
+} // namespace string
+} // namespace lib
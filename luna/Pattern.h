@@ -0,0 +1,141 @@
+#ifndef PATTERN_H
+#define PATTERN_H
+
+#include <bitset>
+#include <string>
+#include <vector>
+#include <cstddef>
+
+namespace lib {
+namespace string {
+
+    // Position of a capture or a whole match in subject
+    struct Capture
+    {
+        // Length of position capture '()'
+        static const std::ptrdiff_t kPosition = -1;
+
+        const char *begin_;
+        std::ptrdiff_t len_;
+
+        bool IsPosition() const { return len_ == kPosition; }
+    };
+
+    // Pattern of string library compiled into a sequence of items, each
+    // character class, set or single character is compiled into a set of
+    // 256 bits, so matching one character is one bit test. Captures are
+    // numbered when compiling, so matching keeps no capture stack.
+    // Malformed pattern throws CallCFuncException.
+    class Pattern
+    {
+    public:
+        static const int kMaxCaptures = 32;
+
+        Pattern(const char *pattern, std::size_t len);
+
+        Pattern(const Pattern&) = delete;
+        void operator = (const Pattern&) = delete;
+
+        // Source string of pattern
+        const std::string & GetSource() const { return source_; }
+
+        // Pattern starts with '^'
+        bool IsAnchored() const { return anchored_; }
+
+        // Pattern has no special characters, it can be searched as text
+        bool IsPlain() const { return plain_; }
+
+        // Count of captures in pattern
+        int GetCaptureCount() const { return capture_count_; }
+
+        // Match pattern at 's' of subject [begin, end), return end of the
+        // match or nullptr, 'captures' stores GetCaptureCount() captures
+        const char * Match(const char *begin, const char *end,
+                           const char *s, Capture *captures) const;
+
+        // Search the first match from 's', return start of the match or
+        // nullptr, the end of match is stored in 'match_end'
+        const char * Search(const char *begin, const char *end,
+                            const char *s, const char **match_end,
+                            Capture *captures) const;
+
+    private:
+        typedef std::bitset<256> CharSet;
+
+        enum ItemType
+        {
+            ItemType_Single,
+            ItemType_Open,
+            ItemType_Close,
+            ItemType_Position,
+            ItemType_BackRef,
+            ItemType_Balance,
+            ItemType_Frontier,
+            ItemType_End,
+        };
+
+        enum Quantifier
+        {
+            Quantifier_One,
+            Quantifier_Optional,
+            Quantifier_Star,
+            Quantifier_Plus,
+            Quantifier_Minus,
+        };
+
+        struct Item
+        {
+            ItemType type_;
+            Quantifier quantifier_;
+            // Capture index or the open character of balance
+            int arg_;
+            // Close character of balance
+            int arg2_;
+            CharSet set_;
+
+            explicit Item(ItemType type, int arg = 0, int arg2 = 0)
+                : type_(type), quantifier_(Quantifier_One),
+                  arg_(arg), arg2_(arg2) { }
+        };
+
+        struct MatchState
+        {
+            const char *begin_;
+            const char *end_;
+            Capture *captures_;
+            int depth_;
+        };
+
+        void Compile();
+        static void AddClass(unsigned char c, CharSet *set);
+        static const char * CompileSet(const char *p, const char *end,
+                                       CharSet *set);
+
+        const char * DoMatch(MatchState *ms, const char *s,
+                             std::size_t index) const;
+        const char * MatchItems(MatchState *ms, const char *s,
+                                std::size_t index) const;
+        const char * MaxExpand(MatchState *ms, const char *s,
+                               std::size_t index) const;
+        const char * MinExpand(MatchState *ms, const char *s,
+                               std::size_t index) const;
+        const char * MatchBalance(MatchState *ms, const char *s,
+                                  const Item &item) const;
+
+        std::string source_;
+        std::vector<Item> items_;
+        bool anchored_;
+        bool plain_;
+        int capture_count_;
+        // The only character which can start a match, or -1
+        int first_char_;
+    };
+
+    // Search 'text' of 'len' in [s, end) by memchr of the first character
+    const char * FindText(const char *s, const char *end,
+                          const char *text, std::size_t len);
+
+} // namespace string
+} // namespace lib
+
+#endif // PATTERN_H
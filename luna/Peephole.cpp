@@ -0,0 +1,732 @@
+#include "Peephole.h"
+#include "Function.h"
+#include <bitset>
+#include <vector>
+#include <algorithm>
+#include <limits>
+
+namespace luna
+{
+    // Rounds of optimization, each round may make new chances for
+    // the next round
+    const int kMaxRounds = 4;
+    // Max count of jumps which are threaded through
+    const int kMaxThreadJumps = 8;
+    // Register count which is enough for every function
+    const int kRegisterCount = 256;
+
+    typedef std::bitset<kRegisterCount> RegisterSet;
+
+    static void AddRegisters(RegisterSet &set, int begin, int end)
+    {
+        for (int r = begin; r < end && r < kRegisterCount; ++r)
+            set.set(r);
+    }
+
+    static bool IsFusedJump(int op)
+    {
+        return op >= OpType_JmpLess && op <= OpType_JmpGreaterEqual;
+    }
+
+    // Instructions followed by one extra instruction word
+    static bool HasExtraWord(int op)
+    {
+        return op == OpType_LoadInt || op == OpType_SetList ||
+            op == OpType_GetGlobalField || IsFusedJump(op);
+    }
+
+    // Index of the instruction word which holds sBx of the jump,
+    // return -1 when the instruction is not a jump
+    static int JumpWordIndex(int op, int index)
+    {
+        switch (op)
+        {
+            case OpType_Jmp:
+            case OpType_JmpFalse:
+            case OpType_JmpTrue:
+            case OpType_JmpNil:
+            case OpType_ForPrep:
+            case OpType_ForLoop:
+                return index;
+            default:
+                return IsFusedJump(op) ? index + 1 : -1;
+        }
+    }
+
+    // Arithmetic and comparison instructions read all operands before
+    // writing dst register
+    static bool IsArithOrCompare(int op)
+    {
+        return (op >= OpType_Add && op <= OpType_Mod) ||
+            (op >= OpType_Less && op <= OpType_GreaterEqualK);
+    }
+
+    class PeepholeOptimizer
+    {
+    public:
+        explicit PeepholeOptimizer(Function *function)
+            : function_(function) { }
+
+        void Optimize()
+        {
+            GetEscapedRegisters();
+            for (int round = 0; round < kMaxRounds; ++round)
+            {
+                Prepare();
+                ComputeLiveness();
+                if (!OptimizeRound())
+                    break;
+                Compact();
+            }
+        }
+
+    private:
+        Instruction & Code(int index)
+        {
+            return *function_->GetMutableInstruction(index);
+        }
+
+        int Op(int index)
+        {
+            return Instruction::GetOpCode(Code(index));
+        }
+
+        int Size(int index)
+        {
+            return HasExtraWord(Op(index)) ? 2 : 1;
+        }
+
+        // Registers captured by closures may be shared with upvalues,
+        // they are never optimized
+        void GetEscapedRegisters();
+
+        // Decode jump targets and jump target flags
+        void Prepare();
+
+        // Registers read and killed by instruction
+        void GetReadsAndKills(int index, RegisterSet &reads, RegisterSet &kills);
+
+        // Compute live registers after each instruction
+        void ComputeLiveness();
+
+        // Live registers after instruction
+        RegisterSet LiveOut(int index);
+
+        // Run one round, return true if any instruction changed
+        bool OptimizeRound();
+
+        // Jump to the next instruction, move to itself and fill dead
+        // registers with nil do nothing
+        bool IsNoOp(int index);
+
+        bool ThreadJump(int index);
+        bool MergeNilFills(int index);
+        bool CoalesceMoveToUse(int index);
+        bool CoalesceDstToMove(int index);
+
+        // Fuse instruction pairs into superinstructions
+        bool FuseGlobalField(int index);
+        bool FuseConstKey(int index);
+
+        // Remove instructions and refill jump offsets
+        void Compact();
+
+        void Remove(int index)
+        {
+            for (int i = 0, size = Size(index); i < size; ++i)
+                removed_[index + i] = true;
+        }
+
+        // Next instruction index which is not removed
+        int Next(int index)
+        {
+            int size = removed_.size();
+            index += Size(index);
+            while (index < size && removed_[index])
+                ++index;
+            return index;
+        }
+
+        Function *function_;
+        RegisterSet escaped_;
+        // Instruction is the first word of an instruction
+        std::vector<bool> is_head_;
+        // Jump target index of instruction, -1 means no jump
+        std::vector<int> targets_;
+        // Instruction is jump target
+        std::vector<bool> is_target_;
+        std::vector<bool> removed_;
+        // Instruction is changed in current round
+        std::vector<bool> changed_;
+        std::vector<RegisterSet> live_in_;
+    };
+
+    void PeepholeOptimizer::GetEscapedRegisters()
+    {
+        int size = function_->OpCodeSize();
+        for (int i = 0; i < size; i += Size(i))
+        {
+            if (Op(i) != OpType_Closure)
+                continue;
+
+            auto child = function_->GetChildFunction(Instruction::GetParamBx(Code(i)));
+            for (std::size_t u = 0; u < child->GetUpvalueCount(); ++u)
+            {
+                auto upvalue = child->GetUpvalue(u);
+                if (upvalue->parent_local_)
+                    escaped_.set(upvalue->register_index_);
+            }
+        }
+    }
+
+    void PeepholeOptimizer::Prepare()
+    {
+        int size = function_->OpCodeSize();
+        is_head_.assign(size, false);
+        targets_.assign(size, -1);
+        is_target_.assign(size + 1, false);
+        removed_.assign(size, false);
+        changed_.assign(size, false);
+
+        for (int i = 0; i < size; i += Size(i))
+        {
+            is_head_[i] = true;
+            int word = JumpWordIndex(Op(i), i);
+            if (word >= 0)
+            {
+                int target = word + Instruction::GetParamsBx(Code(word));
+                targets_[i] = target;
+                is_target_[target] = true;
+            }
+        }
+    }
+
+    void PeepholeOptimizer::GetReadsAndKills(int index, RegisterSet &reads,
+                                           RegisterSet &kills)
+    {
+        auto i = Code(index);
+        int op = Instruction::GetOpCode(i);
+        int a = Instruction::GetParamA(i);
+        int b = Instruction::GetParamB(i);
+        int c = Instruction::GetParamC(i);
+        int sbx = Instruction::GetParamsBx(i);
+
+        switch (op)
+        {
+            case OpType_LoadNil: case OpType_LoadBool: case OpType_LoadInt:
+            case OpType_LoadConst: case OpType_GetUpvalue: case OpType_GetGlobal:
+            case OpType_Closure: case OpType_NewTable: case OpType_GetGlobalField:
+                kills.set(a);
+                break;
+            case OpType_FillNil:
+                AddRegisters(kills, a, b);
+                break;
+            case OpType_Move:
+                reads.set(b);
+                kills.set(a);
+                break;
+            case OpType_SetUpvalue: case OpType_SetGlobal:
+            case OpType_JmpFalse: case OpType_JmpTrue: case OpType_JmpNil:
+            case OpType_Neg: case OpType_Not: case OpType_Len:
+                reads.set(a);
+                break;
+            case OpType_Call: case OpType_TailCall:
+                // Args are the values to stack top when count is any, and
+                // the callee overwrites all registers from 'a'
+                AddRegisters(reads, a, b > 0 ? a + b : kRegisterCount);
+                AddRegisters(kills, a, kRegisterCount);
+                break;
+            case OpType_VarArg:
+                AddRegisters(kills, a, sbx >= 0 ? a + sbx : kRegisterCount);
+                break;
+            case OpType_Ret:
+                AddRegisters(reads, a, sbx >= 0 ? a + sbx : kRegisterCount);
+                break;
+            case OpType_Concat:
+                AddRegisters(reads, b, b + c);
+                kills.set(a);
+                break;
+            case OpType_SetTable:
+                reads.set(a);
+                reads.set(b);
+                reads.set(c);
+                break;
+            case OpType_ForPrep:
+                AddRegisters(reads, a, a + 3);
+                AddRegisters(kills, a + 3, a + 4);
+                break;
+            case OpType_ForLoop:
+                AddRegisters(reads, a, a + 4);
+                break;
+            case OpType_GetTable:
+                reads.set(a);
+                reads.set(b);
+                kills.set(c);
+                break;
+            case OpType_SetField:
+                reads.set(a);
+                reads.set(c);
+                break;
+            case OpType_GetField: case OpType_GetTableK:
+                reads.set(a);
+                kills.set(c);
+                break;
+            case OpType_SetTableK:
+                reads.set(a);
+                reads.set(c);
+                break;
+            case OpType_SetList:
+                reads.set(a);
+                AddRegisters(reads, b, b + c);
+                break;
+            default:
+                if (IsFusedJump(op))
+                {
+                    reads.set(a);
+                    if (c == 0)
+                        reads.set(b);
+                }
+                else if (op >= OpType_AddK && op <= OpType_GreaterEqualK)
+                {
+                    reads.set(b);
+                    kills.set(a);
+                }
+                else if (IsArithOrCompare(op))
+                {
+                    reads.set(b);
+                    reads.set(c);
+                    kills.set(a);
+                }
+                break;
+        }
+    }
+
+    RegisterSet PeepholeOptimizer::LiveOut(int index)
+    {
+        int size = live_in_.size();
+        RegisterSet live = escaped_;
+        int op = Op(index);
+        if (op == OpType_Ret)
+            return live;
+
+        if (op != OpType_Jmp && index + Size(index) < size)
+            live |= live_in_[index + Size(index)];
+        int target = targets_[index];
+        if (target >= 0 && target < size)
+            live |= live_in_[target];
+        return live;
+    }
+
+    void PeepholeOptimizer::ComputeLiveness()
+    {
+        int size = function_->OpCodeSize();
+        live_in_.assign(size, RegisterSet());
+
+        // Iterate backward until no live set changes
+        bool changed = true;
+        while (changed)
+        {
+            changed = false;
+            for (int i = size - 1; i >= 0; --i)
+            {
+                if (!is_head_[i])
+                    continue;
+
+                RegisterSet reads;
+                RegisterSet kills;
+                GetReadsAndKills(i, reads, kills);
+                RegisterSet live = reads | (LiveOut(i) & ~kills);
+                if (live != live_in_[i])
+                {
+                    live_in_[i] = live;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    bool PeepholeOptimizer::IsNoOp(int index)
+    {
+        auto i = Code(index);
+        switch (Instruction::GetOpCode(i))
+        {
+            case OpType_Jmp:
+                return targets_[index] == Next(index);
+            case OpType_Move:
+                return Instruction::GetParamA(i) == Instruction::GetParamB(i);
+            case OpType_FillNil:
+                {
+                    // Fill closing block is useless when all the registers
+                    // are dead and it closes no upvalues
+                    if (Instruction::GetParamC(i))
+                        return false;
+                    RegisterSet fills;
+                    AddRegisters(fills, Instruction::GetParamA(i),
+                                 Instruction::GetParamB(i));
+                    return (fills & LiveOut(index)).none();
+                }
+            default:
+                return false;
+        }
+    }
+
+    bool PeepholeOptimizer::ThreadJump(int index)
+    {
+        int target = targets_[index];
+        int hops = 0;
+        while (target < static_cast<int>(targets_.size()) &&
+               Op(target) == OpType_Jmp &&
+               targets_[target] != target && hops++ < kMaxThreadJumps)
+            target = targets_[target];
+
+        if (target == targets_[index])
+            return false;
+
+        // The new offset must fit in sBx
+        int diff = target - JumpWordIndex(Op(index), index);
+        if (diff < std::numeric_limits<short>::min() ||
+            diff > std::numeric_limits<short>::max())
+            return false;
+
+        targets_[index] = target;
+        return true;
+    }
+
+    bool PeepholeOptimizer::MergeNilFills(int index)
+    {
+        // Get the nil range of instruction, FillNil which closes upvalues
+        // is never merged, since the closed range must not be changed
+        auto nil_range = [this] (int i, int &begin, int &end) -> bool {
+            int op = Op(i);
+            begin = Instruction::GetParamA(Code(i));
+            if (op == OpType_FillNil && !Instruction::GetParamC(Code(i)))
+                end = Instruction::GetParamB(Code(i));
+            else if (op == OpType_LoadNil)
+                end = begin + 1;
+            else
+                return false;
+            return true;
+        };
+
+        int begin = 0;
+        int end = 0;
+        if (!nil_range(index, begin, end))
+            return false;
+
+        bool merged = false;
+        int next = Next(index);
+        int size = removed_.size();
+        while (next < size && !is_target_[next] && !changed_[next])
+        {
+            int next_begin = 0;
+            int next_end = 0;
+            if (!nil_range(next, next_begin, next_end) ||
+                next_begin > end || next_end < begin)
+                break;
+
+            begin = std::min(begin, next_begin);
+            end = std::max(end, next_end);
+            Remove(next);
+            merged = true;
+            next = Next(next);
+        }
+
+        if (merged)
+        {
+            Code(index) = Instruction::ABCode(OpType_FillNil, begin, end);
+            changed_[index] = true;
+        }
+        return merged;
+    }
+
+    bool PeepholeOptimizer::CoalesceMoveToUse(int index)
+    {
+        // Move t, x
+        // Use t    =>  Use x, when t is dead after Use
+        if (Op(index) != OpType_Move)
+            return false;
+
+        int t = Instruction::GetParamA(Code(index));
+        int x = Instruction::GetParamB(Code(index));
+        int use = Next(index);
+        if (use >= static_cast<int>(removed_.size()) ||
+            is_target_[use] || changed_[use] ||
+            t == x || escaped_.test(t) || escaped_.test(x))
+            return false;
+
+        RegisterSet reads;
+        RegisterSet kills;
+        GetReadsAndKills(use, reads, kills);
+        if (!reads.test(t) || (LiveOut(use).test(t) && !kills.test(t)))
+            return false;
+
+        // Replace the register operands which are read only
+        auto &i = Code(use);
+        int op = Instruction::GetOpCode(i);
+        bool replace_a = false;
+        bool replace_b = false;
+        bool replace_c = false;
+        switch (op)
+        {
+            case OpType_Move:
+                // Keep the move from local variable for runtime error
+                if (function_->SearchLocalVar(t, use))
+                    return false;
+                replace_b = true;
+                break;
+            case OpType_SetUpvalue: case OpType_SetGlobal:
+            case OpType_JmpFalse: case OpType_JmpTrue: case OpType_JmpNil:
+                replace_a = true;
+                break;
+            case OpType_SetTable:
+                replace_a = replace_b = replace_c = true;
+                break;
+            case OpType_GetTable:
+                replace_a = replace_b = true;
+                break;
+            case OpType_SetField: case OpType_SetTableK:
+                replace_a = replace_c = true;
+                break;
+            case OpType_GetField: case OpType_GetTableK:
+                replace_a = true;
+                break;
+            default:
+                if (IsFusedJump(op))
+                {
+                    replace_a = true;
+                    replace_b = Instruction::GetParamC(i) == 0;
+                }
+                else if (op >= OpType_AddK && op <= OpType_GreaterEqualK)
+                    replace_b = true;
+                else if (IsArithOrCompare(op))
+                    replace_b = replace_c = true;
+                else
+                    return false;
+                break;
+        }
+
+        if (replace_a && Instruction::GetParamA(i) == t)
+            i.RefillA(x);
+        if (replace_b && Instruction::GetParamB(i) == t)
+            i.RefillB(x);
+        if (replace_c && Instruction::GetParamC(i) == t)
+            i.RefillC(x);
+
+        // Keep the move when t is still read by some operand
+        RegisterSet new_reads;
+        RegisterSet new_kills;
+        GetReadsAndKills(use, new_reads, new_kills);
+        if (new_reads.test(t))
+            return false;
+
+        Remove(index);
+        changed_[use] = true;
+        return true;
+    }
+
+    bool PeepholeOptimizer::CoalesceDstToMove(int index)
+    {
+        // Op t, ...
+        // Move y, t    =>  Op y, ..., when t is dead after Move
+        int op = Op(index);
+        bool dst_c = op == OpType_GetTable || op == OpType_GetField ||
+            op == OpType_GetTableK;
+        switch (op)
+        {
+            case OpType_LoadNil: case OpType_LoadBool: case OpType_LoadInt:
+            case OpType_LoadConst: case OpType_Move: case OpType_GetUpvalue:
+            case OpType_GetGlobal: case OpType_Closure: case OpType_Concat:
+            case OpType_NewTable: case OpType_GetTable: case OpType_GetField:
+            case OpType_GetGlobalField: case OpType_GetTableK:
+                break;
+            default:
+                if (!IsArithOrCompare(op))
+                    return false;
+                break;
+        }
+
+        int t = dst_c ? Instruction::GetParamC(Code(index)) :
+            Instruction::GetParamA(Code(index));
+        int move = Next(index);
+        if (move >= static_cast<int>(removed_.size()) ||
+            is_target_[move] || changed_[move] || Op(move) != OpType_Move ||
+            Instruction::GetParamB(Code(move)) != t)
+            return false;
+
+        // Keep the move from local variable, runtime error finds the
+        // name of the operand by it
+        int y = Instruction::GetParamA(Code(move));
+        if (y == t || escaped_.test(y) || escaped_.test(t) ||
+            LiveOut(move).test(t) || function_->SearchLocalVar(t, move))
+            return false;
+
+        // Only instruction which reads all operands before writing dst
+        // register can write the operand register
+        RegisterSet reads;
+        RegisterSet kills;
+        GetReadsAndKills(index, reads, kills);
+        if (reads.test(y) && op != OpType_Move && !IsArithOrCompare(op))
+            return false;
+
+        if (dst_c)
+            Code(index).RefillC(y);
+        else
+            Code(index).RefillA(y);
+        Remove(move);
+        changed_[index] = true;
+        return true;
+    }
+
+    bool PeepholeOptimizer::FuseGlobalField(int index)
+    {
+        // GetGlobal t, g
+        // GetField t, k, y  =>  GetGlobalField y, g + extra word k,
+        // when t is y or t is dead after GetField
+        if (Op(index) != OpType_GetGlobal)
+            return false;
+
+        // The key is the extra word, so GetField must follow directly
+        int field = index + 1;
+        if (field >= static_cast<int>(removed_.size()) || removed_[field] ||
+            is_target_[field] || changed_[field] || Op(field) != OpType_GetField)
+            return false;
+
+        int t = Instruction::GetParamA(Code(index));
+        int y = Instruction::GetParamC(Code(field));
+        if (Instruction::GetParamA(Code(field)) != t)
+            return false;
+        if (y != t && (LiveOut(field).test(t) ||
+                       function_->SearchLocalVar(t, field)))
+            return false;
+
+        int key = Instruction::GetParamB(Code(field));
+        Code(index) = Instruction::ABxCode(OpType_GetGlobalField, y,
+                                           Instruction::GetParamBx(Code(index)));
+        Code(field).opcode_ = key;
+        changed_[index] = true;
+        changed_[field] = true;
+        return true;
+    }
+
+    bool PeepholeOptimizer::FuseConstKey(int index)
+    {
+        // LoadConst t, k
+        // GetTable x, t, y  =>  GetTableK x, k, y
+        // SetTable x, t, y  =>  SetTableK x, k, y, when t is dead after
+        if (Op(index) != OpType_LoadConst)
+            return false;
+
+        int t = Instruction::GetParamA(Code(index));
+        int k = Instruction::GetParamBx(Code(index));
+        int use = Next(index);
+        if (k >= kRegisterCount || use >= static_cast<int>(removed_.size()) ||
+            is_target_[use] || changed_[use] || escaped_.test(t) ||
+            function_->SearchLocalVar(t, use))
+            return false;
+
+        auto &i = Code(use);
+        int op = Instruction::GetOpCode(i);
+        int x = Instruction::GetParamA(i);
+        int y = Instruction::GetParamC(i);
+        if (Instruction::GetParamB(i) != t || x == t)
+            return false;
+
+        if (op == OpType_GetTable)
+        {
+            if (y != t && LiveOut(use).test(t))
+                return false;
+            i = Instruction::ABCCode(OpType_GetTableK, x, k, y);
+        }
+        else if (op == OpType_SetTable)
+        {
+            if (y == t || LiveOut(use).test(t))
+                return false;
+            i = Instruction::ABCCode(OpType_SetTableK, x, k, y);
+        }
+        else
+            return false;
+
+        Remove(index);
+        changed_[use] = true;
+        return true;
+    }
+
+    bool PeepholeOptimizer::OptimizeRound()
+    {
+        bool changed = false;
+        int size = removed_.size();
+        for (int i = 0; i < size; i += Size(i))
+        {
+            if (removed_[i])
+                continue;
+
+            int op = Op(i);
+
+            // Remove unreachable instructions after jump and return
+            if (op == OpType_Jmp || op == OpType_Ret)
+            {
+                for (int next = i + Size(i); next < size && !is_target_[next];
+                     next += Size(next))
+                {
+                    if (!removed_[next])
+                    {
+                        Remove(next);
+                        changed = true;
+                    }
+                }
+            }
+
+            if (targets_[i] >= 0 && ThreadJump(i))
+                changed = true;
+
+            // Remove instructions which do nothing
+            if (IsNoOp(i))
+            {
+                Remove(i);
+                changed = true;
+                continue;
+            }
+
+            if (changed_[i])
+                continue;
+
+            if (MergeNilFills(i) || CoalesceMoveToUse(i) || CoalesceDstToMove(i) ||
+                FuseGlobalField(i) || FuseConstKey(i))
+                changed = true;
+        }
+
+        return changed;
+    }
+
+    void PeepholeOptimizer::Compact()
+    {
+        int size = removed_.size();
+        std::vector<int> new_index(size + 1);
+        int count = 0;
+        for (int i = 0; i < size; ++i)
+        {
+            new_index[i] = count;
+            if (!removed_[i])
+                ++count;
+        }
+        new_index[size] = count;
+
+        // Refill jump offsets with new indexes
+        for (int i = 0; i < size; i += Size(i))
+        {
+            if (removed_[i] || targets_[i] < 0)
+                continue;
+
+            int word = JumpWordIndex(Op(i), i);
+            Code(word).RefillsBx(new_index[targets_[i]] - new_index[word]);
+        }
+
+        function_->RemoveInstructions(removed_);
+    }
+
+    void Peephole(Function *function)
+    {
+        PeepholeOptimizer optimizer(function);
+        optimizer.Optimize();
+    }
+} // namespace luna
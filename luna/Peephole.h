@@ -0,0 +1,15 @@
+#ifndef PEEPHOLE_H
+#define PEEPHOLE_H
+
+namespace luna
+{
+    class Function;
+
+    // Optimize instructions of function after code generation: thread
+    // jumps, merge nil fills, coalesce moves, fuse common instruction
+    // pairs into superinstructions and remove redundant or unreachable
+    // instructions
+    void Peephole(Function *function);
+}
+
+#endif // PEEPHOLE_H
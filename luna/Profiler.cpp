@@ -0,0 +1,116 @@
+#include "Profiler.h"
+#include "Function.h"
+#include "String.h"
+#include <algorithm>
+#include <chrono>
+
+namespace luna
+{
+    Profiler::Profiler()
+        : sample_count_(0), pending_(false), stop_(false)
+    {
+    }
+
+    Profiler::~Profiler()
+    {
+        Stop();
+    }
+
+    void Profiler::Start(unsigned int interval)
+    {
+        if (IsRunning())
+            Stop();
+
+        stop_ = false;
+        thread_ = std::thread(&Profiler::Run, this, std::max(interval, 1u));
+    }
+
+    void Profiler::Stop()
+    {
+        if (!thread_.joinable())
+            return ;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+
+        cond_.notify_one();
+        thread_.join();
+        pending_.store(false, std::memory_order_relaxed);
+    }
+
+    void Profiler::Run(unsigned int interval)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!cond_.wait_for(lock, std::chrono::microseconds(interval),
+                               [this] { return stop_; }))
+            pending_.store(true, std::memory_order_relaxed);
+    }
+
+    void Profiler::Sample(const std::vector<CallInfo> &calls)
+    {
+        pending_.store(false, std::memory_order_relaxed);
+
+        stack_.clear();
+        auto first = calls.size() > kMaxSampleDepth ?
+            calls.size() - kMaxSampleDepth : 0;
+        if (first > 0)
+            stack_ = "...";
+
+        for (auto i = first; i < calls.size(); ++i)
+        {
+            const auto &call = calls[i];
+            auto proto = call.func_->closure_->GetPrototype();
+
+            // 'instruction_' is next instruction of the frame, callers
+            // are at their call instructions
+            int index = call.instruction_ - proto->GetOpCodes() - 1;
+            int line = proto->GetInstructionLine(std::max(index, 0));
+
+            if (!stack_.empty())
+                stack_.push_back(';');
+            stack_ += proto->GetModule()->GetCStr();
+            stack_ += ":" + std::to_string(line);
+            if (proto->GetSuperior())
+                stack_ += " in function <" + std::string(proto->GetModule()->GetCStr()) +
+                    ":" + std::to_string(proto->GetLine()) + ">";
+            else
+                stack_ += " in main chunk";
+        }
+
+        if (stack_.empty())
+            return ;
+
+        ++stacks_[stack_];
+        ++sample_count_;
+    }
+
+    std::string Profiler::GetCollapsedStacks() const
+    {
+        std::vector<const std::pair<const std::string, std::size_t> *> stacks;
+        for (const auto &stack : stacks_)
+            stacks.push_back(&stack);
+
+        // Sort by stack for stable output
+        std::sort(stacks.begin(), stacks.end(),
+                  [](const std::pair<const std::string, std::size_t> *l,
+                     const std::pair<const std::string, std::size_t> *r) {
+                      return l->first < r->first;
+                  });
+
+        std::string result;
+        for (auto stack : stacks)
+        {
+            result += stack->first;
+            result += " " + std::to_string(stack->second) + "\n";
+        }
+        return result;
+    }
+
+    void Profiler::Clear()
+    {
+        stacks_.clear();
+        sample_count_ = 0;
+    }
+} // namespace luna
@@ -0,0 +1,81 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include "Runtime.h"
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+namespace luna
+{
+    // Sampling profiler, a background thread ticks every interval, and
+    // the stack frames are sampled at the next GC safepoint of VM after
+    // the tick, so the profiler costs nothing between ticks. Each frame
+    // is attributed to its module and current line, samples are output
+    // in collapsed stack format of flame graph tools.
+    class Profiler
+    {
+    public:
+        // Default sampling interval in microseconds
+        static const unsigned int kDefaultInterval = 1000;
+        // Max count of innermost frames recorded in one sample
+        static const std::size_t kMaxSampleDepth = 128;
+
+        Profiler();
+        ~Profiler();
+
+        Profiler(const Profiler&) = delete;
+        void operator = (const Profiler&) = delete;
+
+        // Start ticking every 'interval' microseconds, samples taken
+        // before are kept
+        void Start(unsigned int interval);
+
+        // Stop ticking
+        void Stop();
+
+        bool IsRunning() const
+        { return thread_.joinable(); }
+
+        // A tick is not sampled yet
+        bool IsSamplePending() const
+        { return pending_.load(std::memory_order_relaxed); }
+
+        // Sample stack frames 'calls' of running closures
+        void Sample(const std::vector<CallInfo> &calls);
+
+        // Get count of samples
+        std::size_t GetSampleCount() const
+        { return sample_count_; }
+
+        // Get samples in collapsed stack format, one stack per line which
+        // frames from outermost to innermost are separated by ';' and
+        // followed by count of the samples
+        std::string GetCollapsedStacks() const;
+
+        // Discard all samples
+        void Clear();
+
+    private:
+        void Run(unsigned int interval);
+
+        // Count of samples of each collapsed stack
+        std::unordered_map<std::string, std::size_t> stacks_;
+        std::size_t sample_count_;
+        // Buffer of collapsed stack of the sampling
+        std::string stack_;
+
+        std::atomic<bool> pending_;
+        bool stop_;
+
+        std::mutex mutex_;
+        std::condition_variable cond_;
+        std::thread thread_;
+    };
+} // namespace luna
+
+#endif // PROFILER_H
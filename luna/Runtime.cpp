@@ -1,4 +1,6 @@
 #include "Runtime.h"
+#include "State.h"
+#include "Upvalue.h"
 
 namespace luna
 {
@@ -27,4 +29,42 @@ namespace luna
           expect_result_(0)
     {
     }
+
+    Coroutine::Coroutine(State *state, const Value &function)
+        : state_(state),
+          handle_(nullptr),
+          status_(CoroutineStatus_Suspended),
+          open_upvalues_(nullptr),
+          cfunc_register_(0),
+          cfunc_depth_(0),
+          yield_func_(0),
+          yield_expect_result_(0),
+          yield_count_(0),
+          started_(false),
+          collected_(false)
+    {
+        // Function is called from the bottom of stack when it starts
+        *stack_.top_++ = function;
+    }
+
+    void Coroutine::Collect(void *coroutine)
+    {
+        auto co = static_cast<Coroutine *>(coroutine);
+        co->collected_ = true;
+        co->state_->collected_coroutines_++;
+    }
+
+    void Coroutine::Trace(void *coroutine, GCObjectVisitor *v)
+    {
+        static_cast<Coroutine *>(coroutine)->VisitValues(v);
+    }
+
+    void Coroutine::VisitValues(GCObjectVisitor *v)
+    {
+        for (const auto &value : stack_.stack_)
+            value.Accept(v);
+
+        for (auto u = open_upvalues_; u; u = u->GetNext())
+            u->Accept(v);
+    }
 } // namespace luna
@@ -6,13 +6,19 @@
 
 namespace luna
 {
+    class State;
     class Closure;
+    class Upvalue;
+    class UserData;
     struct Instruction;
 
     // Runtime stack, registers of each function is one part of stack.
+    // Stack grows on demand, so pointers to stack values are invalid
+    // after it grows, State fixes up pointers of top and all CallInfos.
     struct Stack
     {
-        static const int kBaseStackSize = 10000;
+        static const std::size_t kBaseStackSize = 256;
+        static const std::size_t kMaxStackSize = 1000000;
 
         std::vector<Value> stack_;
         Value *top_;
@@ -23,6 +29,13 @@ namespace luna
 
         // Set new top pointer, and [new top, old top) will be set nil
         void SetNewTop(Value *top);
+
+        // Is there 'count' slots from 'base' in stack
+        bool IsEnough(const Value *base, std::size_t count) const
+        {
+            // One more slot after them, SetNewTop sets old top slot nil
+            return base + count < stack_.data() + stack_.size();
+        }
     };
 
     // Function call stack info
@@ -41,6 +54,72 @@ namespace luna
 
         CallInfo();
     };
+
+    enum CoroutineStatus
+    {
+        CoroutineStatus_Suspended,  // Not started or yielded
+        CoroutineStatus_Running,
+        CoroutineStatus_Normal,     // Resumed another coroutine
+        CoroutineStatus_Dead,       // Finished or stopped by error
+    };
+
+    // Coroutine has its own stack and stack frames, State swaps them with
+    // the running ones when coroutine resumes and yields, so VM switches
+    // coroutines without switching native stack. Values of suspended
+    // coroutine are traced from its handle, the running and normal ones
+    // are GC roots of State, coroutine is deleted by State after its
+    // handle is collected.
+    class Coroutine
+    {
+        friend class State;
+    public:
+        Coroutine(State *state, const Value &function);
+
+        Coroutine(const Coroutine&) = delete;
+        void operator = (const Coroutine&) = delete;
+
+        CoroutineStatus GetStatus() const
+        { return status_; }
+
+        // Set the user data which refers to this coroutine
+        void SetHandle(UserData *handle)
+        { handle_ = handle; }
+
+        UserData * GetHandle() const
+        { return handle_; }
+
+        // Destroyer of handle user data
+        static void Collect(void *coroutine);
+
+        // Tracer of handle user data
+        static void Trace(void *coroutine, GCObjectVisitor *v);
+
+    private:
+        // Visit all values of coroutine
+        void VisitValues(GCObjectVisitor *v);
+
+        State *state_;
+        UserData *handle_;
+        CoroutineStatus status_;
+
+        // Stack data and frames, they are the ones of resumer when this
+        // coroutine is running
+        Stack stack_;
+        std::vector<CallInfo> calls_;
+        Upvalue *open_upvalues_;
+        std::size_t cfunc_register_;
+        int cfunc_depth_;
+
+        // Stack index of the yield function whose results are the args
+        // of next resume, and the expect result count of the call
+        std::size_t yield_func_;
+        int yield_expect_result_;
+        // Count of yielded values on stack top
+        int yield_count_;
+
+        bool started_;
+        bool collected_;
+    };
 } // namespace luna
 
 #endif // RUNTIME_H
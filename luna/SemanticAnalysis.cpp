@@ -5,6 +5,7 @@
 #include "String.h"
 #include "Guard.h"
 #include <unordered_set>
+#include <algorithm>
 #include <assert.h>
 
 namespace luna
@@ -27,11 +28,13 @@ namespace luna
         LexicalFunction *parent_;
         LexicalBlock *current_block_;
         const SyntaxTree *current_loop_;
+        // FunctionBody AST of the function, nullptr for module function
+        FunctionBody *body_;
         bool has_vararg;
 
         LexicalFunction()
             : parent_(nullptr), current_block_(nullptr),
-              current_loop_(nullptr), has_vararg(false) { }
+              current_loop_(nullptr), body_(nullptr), has_vararg(false) { }
     };
 
     class SemanticAnalysisVisitor : public Visitor
@@ -122,8 +125,9 @@ namespace luna
             current_function_->current_block_->names_.insert(name);
         }
 
-        // Search LexicalScoping of a name
-        LexicalScoping SearchName(const String *str) const
+        // Search LexicalScoping of a name, upvalue name is recorded in
+        // FunctionBody of all functions which it passes through
+        LexicalScoping SearchName(String *str) const
         {
             assert(current_function_ && current_function_->current_block_);
 
@@ -136,8 +140,10 @@ namespace luna
                     auto it = block->names_.find(str);
                     if (it != block->names_.end())
                     {
-                        return function == current_function_ ?
-                            LexicalScoping_Local : LexicalScoping_Upvalue;
+                        if (function == current_function_)
+                            return LexicalScoping_Local;
+                        AddUpvalueName(function, str);
+                        return LexicalScoping_Upvalue;
                     }
 
                     block = block->parent_;
@@ -173,7 +179,27 @@ namespace luna
             return current_function_->has_vararg;
         }
 
+        // Set FunctionBody AST of current function
+        void SetFunctionBody(FunctionBody *body)
+        {
+            current_function_->body_ = body;
+        }
+
     private:
+        // Record upvalue 'name' for functions which are nested in 'owner'
+        void AddUpvalueName(const LexicalFunction *owner, String *name) const
+        {
+            for (auto function = current_function_; function != owner;
+                 function = function->parent_)
+            {
+                if (!function->body_)
+                    continue;
+                auto &names = function->body_->upvalue_names_;
+                if (std::find(names.begin(), names.end(), name) == names.end())
+                    names.push_back(name);
+            }
+        }
+
         void DeleteCurrentFunction()
         {
             assert(current_function_);
@@ -586,6 +612,7 @@ namespace luna
     void SemanticAnalysisVisitor::Visit(FunctionBody *func_body, void *data)
     {
         SEMANTIC_ANALYSIS_GUARD(EnterFunction, LeaveFunction);
+        SetFunctionBody(func_body);
         {
             SEMANTIC_ANALYSIS_GUARD(EnterBlock, LeaveBlock);
 
@@ -743,4 +770,20 @@ namespace luna
         SemanticAnalysisVisitor semantic_analysis(state);
         root->Accept(&semantic_analysis, nullptr);
     }
+
+    void SemanticAnalysis(SyntaxTree *root, State *state,
+                          const std::vector<String *> &upvalues)
+    {
+        assert(root && state);
+        SemanticAnalysisVisitor semantic_analysis(state);
+
+        // Outer function which has all upvalues as its local names, the
+        // visitor deletes it when destructing
+        semantic_analysis.EnterFunction();
+        semantic_analysis.EnterBlock();
+        for (auto name : upvalues)
+            semantic_analysis.InsertName(name);
+
+        root->Accept(&semantic_analysis, nullptr);
+    }
 } // namespace luna
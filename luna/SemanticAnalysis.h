@@ -2,12 +2,19 @@
 #define SEMANTIC_ANALYSIS_H
 
 #include "SyntaxTree.h"
+#include <vector>
 
 namespace luna
 {
     class State;
+    class String;
 
     void SemanticAnalysis(SyntaxTree *root, State *state);
+
+    // Analyse 'root' which is the body of a function compiled lazily,
+    // names of 'upvalues' are upvalues of the function
+    void SemanticAnalysis(SyntaxTree *root, State *state,
+                          const std::vector<String *> &upvalues);
 }
 
 #endif // SEMANTIC_ANALYSIS_H
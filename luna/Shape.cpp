@@ -0,0 +1,56 @@
+#include "Shape.h"
+
+namespace
+{
+    // Max count of keys of a shape, larger tables are hash tables
+    const std::size_t kMaxShapeKeys = 16;
+    // Max count of transitions of a shape, tables which get various keys
+    // in the same position are not record-like
+    const std::size_t kMaxTransitions = 8;
+    // Max count of shapes of a tree
+    const std::size_t kMaxShapes = 4096;
+} // namespace
+
+namespace luna
+{
+    Shape::Shape(const Shape *parent, String *key, GCMemory *memory)
+        : keys_(GCAllocator<String *>(memory)),
+          transitions_(GCAllocator<Transition>(memory))
+    {
+        if (parent)
+        {
+            keys_.reserve(parent->keys_.size() + 1);
+            keys_.assign(parent->keys_.begin(), parent->keys_.end());
+        }
+        if (key)
+            keys_.push_back(key);
+    }
+
+    ShapeTree::ShapeTree(GCMemory *memory)
+        : memory_(memory), root_(nullptr)
+    {
+        shapes_.emplace_back(new Shape(nullptr, nullptr, memory_));
+        root_ = shapes_.back().get();
+    }
+
+    Shape * ShapeTree::AddKey(Shape *shape, String *key)
+    {
+        for (const auto &transition : shape->transitions_)
+        {
+            if (transition.first == key)
+                return transition.second;
+        }
+
+        if (shape->Size() >= kMaxShapeKeys ||
+            shape->transitions_.size() >= kMaxTransitions ||
+            shapes_.size() >= kMaxShapes)
+            return nullptr;
+
+        std::unique_ptr<Shape> child(new Shape(shape, key, memory_));
+        shape->transitions_.reserve(shape->transitions_.size() + 1);
+        shapes_.reserve(shapes_.size() + 1);
+        shape->transitions_.push_back(Shape::Transition(key, child.get()));
+        shapes_.push_back(std::move(child));
+        return shape->transitions_.back().second;
+    }
+} // namespace luna
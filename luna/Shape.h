@@ -0,0 +1,85 @@
+#ifndef SHAPE_H
+#define SHAPE_H
+
+#include "GC.h"
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace luna
+{
+    class String;
+
+    // Shape is the layout of string keys of record-like tables, tables
+    // which have the same keys added in the same order share one shape,
+    // and store values in slots indexed by the keys' order.
+    class Shape
+    {
+    public:
+        Shape(const Shape *parent, String *key, GCMemory *memory);
+
+        Shape(const Shape&) = delete;
+        void operator = (const Shape&) = delete;
+
+        // Count of keys, which is the count of slots
+        std::size_t Size() const { return keys_.size(); }
+
+        // Key of slot, 'slot' must be less than Size()
+        String * GetKey(std::size_t slot) const { return keys_[slot]; }
+
+        // Return slot of 'key', or -1 when key is not in this shape.
+        // Keys are short strings, so they are compared by pointer.
+        int FindSlot(const String *key) const
+        {
+            for (std::size_t i = 0; i < keys_.size(); ++i)
+            {
+                if (keys_[i] == key)
+                    return static_cast<int>(i);
+            }
+            return -1;
+        }
+
+    private:
+        friend class ShapeTree;
+
+        typedef std::pair<String *, Shape *> Transition;
+
+        // Keys in slot order
+        std::vector<String *, GCAllocator<String *>> keys_;
+        // Child shapes which add one key to this shape
+        std::vector<Transition, GCAllocator<Transition>> transitions_;
+    };
+
+    // ShapeTree owns all shapes of a GC, shapes are shared by tables and
+    // never freed until the tree is destroyed, so tables can be destroyed
+    // in any thread. Keys of a shape are not referenced by the tree, table
+    // marks the keys of its shape, a key of a shape which is not used by
+    // any table may be freed, and the transition to it is reused only by
+    // a new string at the same address, which is the same key by pointer.
+    class ShapeTree
+    {
+    public:
+        explicit ShapeTree(GCMemory *memory);
+
+        ShapeTree(const ShapeTree&) = delete;
+        void operator = (const ShapeTree&) = delete;
+
+        // Shape without keys
+        Shape * GetRoot() { return root_; }
+
+        // Get shape which adds 'key' to 'shape', return nullptr when the
+        // table should store its keys in hash table, since the shape has
+        // too many keys or transitions, or the tree is full.
+        Shape * AddKey(Shape *shape, String *key);
+
+        // Count of all shapes
+        std::size_t GetShapeCount() const { return shapes_.size(); }
+
+    private:
+        GCMemory *memory_;
+        Shape *root_;
+        std::vector<std::unique_ptr<Shape>> shapes_;
+    };
+} // namespace luna
+
+#endif // SHAPE_H
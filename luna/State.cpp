@@ -5,17 +5,37 @@
 #include "String.h"
 #include "Function.h"
 #include "Table.h"
-#include "TextInStream.h"
+#include "UserData.h"
 #include "Exception.h"
 #include <cassert>
+#include <algorithm>
 
 namespace luna
 {
 #define METATABLES "__metatables"
 #define MODULES_TABLE "__modules"
 
-    State::State()
+    State::State(const GCConfig &gc_config, Allocator *allocator)
+        : max_call_depth_(kDefaultMaxCallDepth),
+          open_upvalues_(nullptr),
+          cfunc_register_(0),
+          cfunc_depth_(0),
+          yielding_(false),
+          running_(nullptr),
+          collected_coroutines_(0),
+          jit_enabled_(true),
+          lazy_compile_(false),
+          hook_mask_(0),
+          hook_count_(0),
+          hook_count_left_(0),
+          in_hook_(false)
     {
+        calls_.reserve(kBaseCallDepth);
+
+#ifdef LUNA_OPCODE_STATS
+        opcode_stats_.reset(new OpcodeStats);
+#endif // LUNA_OPCODE_STATS
+
         string_pool_.reset(new StringPool);
 
         // Init GC
@@ -24,10 +44,16 @@ namespace luna
             {
                 string_pool_->DeleteString(static_cast<String *>(obj));
             }
-            delete obj;
-        }));
+#ifdef LUNA_OPCODE_STATS
+            else if (type == GCObjectType_Function)
+            {
+                opcode_stats_->ForgetFunction(static_cast<Function *>(obj));
+            }
+#endif // LUNA_OPCODE_STATS
+        }, false, allocator));
         auto root = std::bind(&State::FullGCRoot, this, std::placeholders::_1);
         gc_->SetRootTraveller(root, root);
+        gc_->SetConfig(gc_config);
 
         // New global table
         global_.table_ = NewTable();
@@ -41,6 +67,7 @@ namespace luna
         v.type_ = ValueT_Table;
         v.table_ = NewTable();
         global_.table_->SetValue(k, v);
+        gc_->SetPermanent(v.table_);
 
         // New table for store modules
         k.type_ = ValueT_String;
@@ -48,6 +75,7 @@ namespace luna
         v.type_ = ValueT_Table;
         v.table_ = NewTable();
         global_.table_->SetValue(k, v);
+        gc_->SetPermanent(v.table_);
 
         // Init module manager
         module_manager_.reset(new ModuleManager(this, v.table_));
@@ -55,6 +83,12 @@ namespace luna
 
     State::~State()
     {
+        // Coroutines are deleted before their handles are destroyed
+        for (const auto &co : coroutines_)
+        {
+            if (!co->collected_ && co->handle_)
+                co->handle_->MarkDestroyed();
+        }
         gc_->ResetDeleter();
     }
 
@@ -63,13 +97,21 @@ namespace luna
         return module_manager_->IsLoaded(module_name);
     }
 
+    bool State::IsModuleLoaded(const String *module_name) const
+    {
+        return module_manager_->IsLoaded(module_name);
+    }
+
     void State::LoadModule(const std::string &module_name)
     {
         auto value = module_manager_->GetModuleClosure(module_name);
         if (value.IsNil())
             module_manager_->LoadModule(module_name);
         else
+        {
+            ReserveStack(stack_.top_, 1);
             *stack_.top_++ = value;
+        }
     }
 
     void State::DoModule(const std::string &module_name)
@@ -82,9 +124,26 @@ namespace luna
         }
     }
 
+    void State::CompileModule(const std::string &module_name)
+    {
+        module_manager_->CompileModule(module_name);
+    }
+
+    void State::PreloadModules(const std::vector<std::string> &module_names,
+                               unsigned int thread_count)
+    {
+        module_manager_->PreloadModules(module_names, thread_count);
+    }
+
     void State::DoString(const std::string &str, const std::string &name)
     {
-        module_manager_->LoadString(str, name);
+        DoString(str.data(), str.size(), name);
+    }
+
+    void State::DoString(const char *str, std::size_t size,
+                         const std::string &name)
+    {
+        module_manager_->LoadString(str, size, name);
         if (CallFunction(stack_.top_ - 1, 0, 0))
         {
             VM vm(this);
@@ -92,10 +151,18 @@ namespace luna
         }
     }
 
+    void State::SetChunkCacheSize(std::size_t count)
+    {
+        module_manager_->SetChunkCacheSize(count);
+    }
+
     bool State::CallFunction(Value *f, int arg_count, int expect_result)
     {
         assert(f->type_ == ValueT_Closure || f->type_ == ValueT_CFunction);
 
+        if (calls_.size() >= max_call_depth_)
+            throw StackOverflowException();
+
         // Set stack top when arg_count is fixed
         if (arg_count != EXP_VALUE_COUNT_ANY)
             stack_.top_ = f + 1 + arg_count;
@@ -109,46 +176,255 @@ namespace luna
         else
         {
             CallCFunction(f, expect_result);
+            return yielding_;
+        }
+    }
+
+    std::size_t State::PrepareCall(const Value &f, int arg_count)
+    {
+        if (f.type_ != ValueT_Closure && f.type_ != ValueT_CFunction)
+            throw CallCFuncException("attempt to call a ", f.TypeName(), " value");
+
+        // Registers of closure start after args at most
+        std::size_t count = 1 + arg_count;
+        if (f.type_ == ValueT_Closure)
+            count += f.closure_->GetPrototype()->GetMaxRegisterCount();
+
+        // 'f' may be in stack which grows
+        Value func = f;
+        auto base = ReserveStack(stack_.top_, count);
+        *base = func;
+        stack_.top_ = base + 1;
+        return base - stack_.stack_.data();
+    }
+
+    void State::RunCall(std::size_t index, int arg_count, int expect_result)
+    {
+        if (CallFunction(stack_.stack_.data() + index, arg_count, expect_result))
+        {
+            VM vm(this);
+            vm.Execute();
+        }
+    }
+
+    std::size_t State::PushBatchRoot()
+    {
+        auto root = ReserveStack(stack_.top_, 1);
+        *root = Value(NewTable());
+        stack_.top_ = root + 1;
+        return root - stack_.stack_.data();
+    }
+
+    void State::RootBatchResult(std::size_t root, std::size_t i, const Value &result)
+    {
+        auto table = stack_.stack_[root].table_;
+        table->SetValue(Value(static_cast<double>(i + 1)), result);
+        CHECK_BARRIER(GetGC(), table);
+    }
+
+    void State::CallResultTypeError(const Value &result, ValueT expect_type)
+    {
+        throw CallCFuncException("result is a ", result.TypeName(),
+                                 " value, expect a ",
+                                 Value::TypeName(expect_type), " value");
+    }
+
+    Coroutine * State::NewCoroutine(const Value &function)
+    {
+        assert(function.type_ == ValueT_Closure ||
+               function.type_ == ValueT_CFunction);
+
+        if (collected_coroutines_ > 0)
+            DeleteCollectedCoroutines();
+
+        coroutines_.push_back(std::unique_ptr<Coroutine>(
+            new Coroutine(this, function)));
+        return coroutines_.back().get();
+    }
+
+    bool State::Resume(Coroutine *co, const Value *args, int arg_count,
+                       std::vector<Value> &results)
+    {
+        assert(co->status_ == CoroutineStatus_Suspended);
+
+        auto resumer = running_;
+        if (resumer)
+            resumer->status_ = CoroutineStatus_Normal;
+        co->status_ = CoroutineStatus_Running;
+        running_ = co;
+        SwapContext(co);
+
+        std::string error;
+        try
+        {
+            RunCoroutine(co, args, arg_count);
+        }
+        catch (const Exception &exp)
+        {
+            error = exp.What();
+            if (error.empty())
+                error = "error in coroutine";
+        }
+        catch (...)
+        {
+            error = "error in coroutine";
+        }
+
+        if (error.empty() && yielding_)
+        {
+            auto first = stack_.top_ - co->yield_count_;
+            results.assign(first, stack_.top_);
+            stack_.SetNewTop(first);
+            co->status_ = CoroutineStatus_Suspended;
+        }
+        else
+        {
+            if (error.empty())
+                results.assign(stack_.stack_.data(), stack_.top_);
+
+            // Coroutine is dead, close all its upvalues
+            CloseUpvalues(stack_.stack_.data());
+            calls_.clear();
+            stack_.SetNewTop(stack_.stack_.data());
+            co->status_ = CoroutineStatus_Dead;
+        }
+
+        yielding_ = false;
+        SwapContext(co);
+        running_ = resumer;
+        if (resumer)
+            resumer->status_ = CoroutineStatus_Running;
+
+        if (!error.empty())
+        {
+            results.clear();
+            results.push_back(Value(GetString(error)));
             return false;
         }
+        return true;
     }
 
-    String * State::GetString(const std::string &str)
+    void State::Yield()
     {
-        auto s = string_pool_->GetString(str);
-        if (!s)
+        if (!running_)
+            throw CallCFuncException("attempt to yield from outside a coroutine");
+
+        // Only the yield function itself is running c function
+        if (cfunc_depth_ > 1)
+            throw CallCFuncException("attempt to yield across a c function call");
+
+        yielding_ = true;
+    }
+
+    void State::SwapContext(Coroutine *co)
+    {
+        stack_.stack_.swap(co->stack_.stack_);
+        std::swap(stack_.top_, co->stack_.top_);
+        calls_.swap(co->calls_);
+        std::swap(open_upvalues_, co->open_upvalues_);
+        std::swap(cfunc_register_, co->cfunc_register_);
+        std::swap(cfunc_depth_, co->cfunc_depth_);
+
+        // Values of coroutine are changed when it runs, trace its
+        // handle again
+        if (co->handle_)
+            CHECK_BARRIER(GetGC(), co->handle_);
+    }
+
+    void State::RunCoroutine(Coroutine *co, const Value *args, int arg_count)
+    {
+        auto first = ReserveStack(stack_.top_, arg_count);
+        for (int i = 0; i < arg_count; ++i)
+            first[i] = args[i];
+        stack_.top_ = first + arg_count;
+
+        if (!co->started_)
         {
-            s = gc_->NewString();
-            s->SetValue(str);
-            string_pool_->AddString(s);
+            co->started_ = true;
+            CallFunction(stack_.stack_.data(), arg_count, EXP_VALUE_COUNT_ANY);
+        }
+        else
+        {
+            // Args are the results of the yield function
+            auto func = stack_.stack_.data() + co->yield_func_;
+            MoveResults(first, arg_count, func, co->yield_expect_result_);
+        }
+
+        // Each VM::Execute runs until the frame which it starts returns
+        while (!calls_.empty() && !yielding_)
+        {
+            VM vm(this);
+            vm.Execute();
         }
-        return s;
+    }
+
+    void State::DeleteCollectedCoroutines()
+    {
+        auto it = std::partition(coroutines_.begin(), coroutines_.end(),
+                                 [](const std::unique_ptr<Coroutine> &co) {
+                                     return !co->collected_;
+                                 });
+
+        // Open upvalues of coroutine keep its handle alive, so they
+        // are collected with the handle
+        coroutines_.erase(it, coroutines_.end());
+        collected_coroutines_ = 0;
+    }
+
+    String * State::GetString(const std::string &str)
+    {
+        return GetString(str.c_str(), str.size());
     }
 
     String * State::GetString(const char *str, std::size_t len)
     {
-        auto s = string_pool_->GetString(str, len);
-        if (!s)
+        if (len > String::kMaxShortLength)
         {
-            s = gc_->NewString();
+            auto s = gc_->NewString();
             s->SetValue(str, len);
-            string_pool_->AddString(s);
+            return s;
         }
-        return s;
+
+        return GetInternedString(str, len);
     }
 
     String * State::GetString(const char *str)
     {
-        auto s = string_pool_->GetString(str);
-        if (!s)
+        return GetString(str, strlen(str));
+    }
+
+    String * State::GetInternedString(const std::string &str)
+    {
+        return GetInternedString(str.c_str(), str.size());
+    }
+
+    String * State::GetInternedString(const char *str, std::size_t len)
+    {
+        std::size_t hash = 0;
+        auto s = string_pool_->GetString(str, len, hash);
+        if (s)
         {
+            // String may be dead when it is got from string pool
+            gc_->Resurrect(s);
+        }
+        else
+        {
+            // Hash string once when it is a new string
             s = gc_->NewString();
-            s->SetValue(str);
+            s->SetValue(str, len, hash);
             string_pool_->AddString(s);
         }
         return s;
     }
 
+    String * State::NewLongString(std::size_t len, char **buffer)
+    {
+        assert(len > String::kMaxShortLength);
+        auto s = gc_->NewString();
+        *buffer = s->SetLength(len);
+        return s;
+    }
+
     Function * State::NewFunction()
     {
         return gc_->NewFunction();
@@ -174,6 +450,40 @@ namespace luna
         return gc_->NewUserData();
     }
 
+    Upvalue * State::GetOpenUpvalue(Value *reg)
+    {
+        // Find the position in the sorted list
+        Upvalue *prev = nullptr;
+        auto next = open_upvalues_;
+        while (next && next->GetValue() > reg)
+        {
+            prev = next;
+            next = next->GetNext();
+        }
+
+        if (next && next->GetValue() == reg)
+            return next;
+
+        auto upvalue = NewUpvalue();
+        upvalue->Open(reg, next, running_ ? running_->handle_ : nullptr);
+        if (prev)
+            prev->SetNext(upvalue);
+        else
+            open_upvalues_ = upvalue;
+        return upvalue;
+    }
+
+    void State::CloseUpvaluesFrom(Value *level)
+    {
+        while (open_upvalues_ && open_upvalues_->GetValue() >= level)
+        {
+            auto upvalue = open_upvalues_;
+            open_upvalues_ = upvalue->GetNext();
+            upvalue->Close();
+            CHECK_BARRIER_VALUE(GetGC(), upvalue, *upvalue->GetValue());
+        }
+    }
+
     CallInfo * State::GetCurrentCall()
     {
         if (calls_.empty())
@@ -181,6 +491,40 @@ namespace luna
         return &calls_.back();
     }
 
+    Value * State::GrowStack(Value *base, std::size_t count)
+    {
+        auto old_stack = stack_.stack_.data();
+        std::size_t need = base - old_stack + count + 1;
+        if (need > Stack::kMaxStackSize)
+            throw StackOverflowException();
+
+        auto size = std::max(stack_.stack_.size() * 2, need);
+        if (size > Stack::kMaxStackSize)
+            size = Stack::kMaxStackSize;
+
+        std::vector<Value> stack(size);
+        std::copy(stack_.stack_.begin(), stack_.stack_.end(), stack.begin());
+
+        // Fix up all pointers to old stack
+        auto new_stack = stack.data();
+        auto fix_up = [=](Value *v) {
+            return v ? new_stack + (v - old_stack) : v;
+        };
+
+        base = fix_up(base);
+        stack_.top_ = fix_up(stack_.top_);
+        for (auto &call : calls_)
+        {
+            call.register_ = fix_up(call.register_);
+            call.func_ = fix_up(call.func_);
+        }
+        for (auto u = open_upvalues_; u; u = u->GetNext())
+            u->Relocate(fix_up(u->GetValue()));
+
+        stack_.stack_.swap(stack);
+        return base;
+    }
+
     Value * State::GetGlobal()
     {
         return &global_;
@@ -201,6 +545,7 @@ namespace luna
             metatable.type_ = ValueT_Table;
             metatable.table_ = NewTable();
             metatables->SetValue(k, metatable);
+            CHECK_BARRIER(GetGC(), metatables);
         }
 
         assert(metatable.type_ == ValueT_Table);
@@ -218,6 +563,120 @@ namespace luna
         metatables->SetValue(k, nil);
     }
 
+    void State::StartProfiler(unsigned int interval)
+    {
+        if (!profiler_)
+            profiler_.reset(new Profiler);
+        profiler_->Start(interval);
+    }
+
+    void State::StopProfiler()
+    {
+        if (profiler_)
+            profiler_->Stop();
+    }
+
+    std::string State::GetProfile() const
+    {
+        return profiler_ ? profiler_->GetCollapsedStacks() : std::string();
+    }
+
+    void State::ClearProfile()
+    {
+        if (profiler_)
+            profiler_->Clear();
+    }
+
+    void State::GetHeapSnapshot(HeapSnapshot &snapshot)
+    {
+        snapshot.total_bytes_ = gc_->GetTotalBytes();
+        snapshot.objects_ = GCObjectCounts();
+        gc_->CountObjects(snapshot.objects_);
+
+        snapshot.modules_.clear();
+        Value k;
+        k.type_ = ValueT_String;
+        k.str_ = GetString(MODULES_TABLE);
+        auto modules = global_.table_->GetValue(k);
+        assert(modules.type_ == ValueT_Table);
+
+        Value name;
+        Value module;
+        bool exist = modules.table_->FirstKeyValue(name, module);
+        while (exist)
+        {
+            if (name.type_ == ValueT_String && module.IsGCObject())
+            {
+                snapshot.modules_.push_back(std::make_pair(
+                    name.str_->GetStdString(), GCObjectCounts()));
+                gc_->CountReachable(module.obj_, snapshot.modules_.back().second);
+            }
+            Value next;
+            exist = modules.table_->NextKeyValue(name, next, module);
+            name = next;
+        }
+    }
+
+    std::string State::GetOpcodeStats() const
+    {
+        return opcode_stats_ ? opcode_stats_->Report() : std::string();
+    }
+
+    void State::ClearOpcodeStats()
+    {
+        if (opcode_stats_)
+            opcode_stats_->Clear();
+    }
+
+    void State::SetHook(int mask, int count, const HookCallback &callback)
+    {
+        if (!callback || count <= 0)
+            mask &= ~HookMask_Count;
+        if (!callback)
+            mask = 0;
+
+        hook_ = mask ? callback : HookCallback();
+        hook_mask_ = mask;
+        hook_count_ = mask & HookMask_Count ? count : 0;
+        hook_count_left_ = hook_count_;
+    }
+
+    void State::CallHook(HookEvent event, const Function *proto, int line)
+    {
+        if (in_hook_)
+            return ;
+
+        // Hook may call functions, keep registers of current frame by
+        // moving stack top above them, and restore it after hook
+        auto top = stack_.top_ - stack_.stack_.data();
+        if (proto)
+        {
+            auto frame_top = calls_.back().register_ + proto->GetMaxRegisterCount();
+            if (stack_.top_ < frame_top)
+                stack_.top_ = frame_top;
+        }
+
+        HookInfo info;
+        info.event_ = event;
+        info.function_ = proto;
+        info.line_ = line;
+
+        // Copy the hook, it could be reset by itself
+        auto hook = hook_;
+        in_hook_ = true;
+        try
+        {
+            hook(this, info);
+        } catch (...)
+        {
+            in_hook_ = false;
+            stack_.top_ = stack_.stack_.data() + top;
+            throw;
+        }
+        in_hook_ = false;
+        stack_.top_ = stack_.stack_.data() + top;
+    }
+
     void State::FullGCRoot(GCObjectVisitor *v)
     {
         // Visit global table
@@ -238,6 +697,29 @@ namespace luna
                 call.func_->Accept(v);
             }
         }
+
+        // Visit open upvalues, they are alive until closed
+        for (auto u = open_upvalues_; u; u = u->GetNext())
+            u->Accept(v);
+
+        // Visit values of running and normal coroutines, including the
+        // stacks of resumers, suspended coroutines are traced from their
+        // handles, except the ones without handle
+        for (const auto &co : coroutines_)
+        {
+            if (co->collected_)
+                continue;
+
+            if (!co->handle_)
+                co->VisitValues(v);
+            else if (co->status_ == CoroutineStatus_Running ||
+                     co->status_ == CoroutineStatus_Normal)
+                co->handle_->Accept(v);
+        }
+
+        // Visit closures of strings cached
+        if (module_manager_)
+            module_manager_->VisitChunkCache(v);
     }
 
     Table * State::GetMetatables()
@@ -255,6 +737,13 @@ namespace luna
     {
         CallInfo callee;
         Function *callee_proto = f->closure_->GetPrototype();
+        if (callee_proto->GetLazySource())
+            module_manager_->CompileFunction(callee_proto);
+
+        // Reserve stack for registers of callee, registers of vararg
+        // function start from stack top
+        auto base = callee_proto->HasVararg() ? stack_.top_ : f + 1;
+        f = ReserveStack(f, base - f + callee_proto->GetMaxRegisterCount());
 
         callee.func_ = f;
         callee.instruction_ = callee_proto->GetOpCodes();
@@ -290,72 +779,74 @@ namespace luna
 
     void State::CallCFunction(Value *f, int expect_result)
     {
-        // Push the c function CallInfo
-        CallInfo callee;
-        callee.register_ = f + 1;
-        callee.func_ = f;
-        callee.expect_result_ = expect_result;
-        calls_.push_back(callee);
+        // C function runs without CallInfo, its registers start after
+        // 'f', keep them as index since stack may grow in c function
+        auto caller_register = cfunc_register_;
+        cfunc_register_ = f + 1 - stack_.stack_.data();
+        ++cfunc_depth_;
+
+        if (hook_mask_ & HookMask_Call)
+            CallHook(HookEvent_Call, nullptr, -1);
 
-        // Call c function
         CFunctionType cfunc = f->cfunc_;
         ClearCFunctionError();
         int res_count = cfunc(this);
-        CheckCFunctionError();
 
-        Value *src = nullptr;
-        if (res_count > 0)
-            src = stack_.top_ - res_count;
+        if (hook_mask_ & HookMask_Return && !yielding_)
+            CallHook(HookEvent_Return, nullptr, -1);
 
-        // Copy c function result to caller stack
-        Value *dst = f;
-        if (expect_result == EXP_VALUE_COUNT_ANY)
-        {
-            for (int i = 0; i < res_count; ++i)
-                *dst++ = *src++;
-        }
-        else
+        --cfunc_depth_;
+        auto reg = GetCFunctionRegister();
+        cfunc_register_ = caller_register;
+
+        // Yielded values stay on stack top, the results of the call are
+        // set by the next resume
+        if (yielding_)
         {
-            int count = std::min(expect_result, res_count);
-            for (int i = 0; i < count; ++i)
-                *dst++ = *src++;
-            // Set all remain expect results to nil
-            count = expect_result - res_count;
-            for (int i = 0; i < count; ++i, ++dst)
-                dst->SetNil();
+            running_->yield_func_ = reg - 1 - stack_.stack_.data();
+            running_->yield_expect_result_ = expect_result;
+            running_->yield_count_ = res_count;
+            return ;
         }
 
+        CheckCFunctionError(reg);
+
+        // Copy c function result to caller stack
+        MoveResults(stack_.top_ - res_count, res_count, reg - 1, expect_result);
+    }
+
+    void State::MoveResults(Value *src, int count, Value *dst, int expect_result)
+    {
+        int n = expect_result == EXP_VALUE_COUNT_ANY ?
+            count : std::min(expect_result, count);
+        dst = std::copy(src, src + n, dst);
+
+        // Set all remain expect results to nil
+        for (int i = count; i < expect_result; ++i, ++dst)
+            dst->SetNil();
+
         // Set registers which after dst to nil
         // and set new stack top pointer
         stack_.SetNewTop(dst);
-
-        // Pop the c function CallInfo
-        calls_.pop_back();
     }
 
-    void State::CheckCFunctionError()
+    void State::CheckCFunctionError(Value *reg)
     {
         auto error = GetCFunctionErrorData();
         if (error->type_ == CFuntionErrorType_NoError)
             return ;
 
-        CallCFuncException exp;
         if (error->type_ == CFuntionErrorType_ArgCount)
         {
-            exp = CallCFuncException("expect ",
+            throw CallCFuncException("expect ",
                     error->expect_arg_count_, " arguments");
         }
-        else if (error->type_ == CFuntionErrorType_ArgType)
+        else
         {
-            auto &call = calls_.back();
-            auto arg = call.register_ + error->arg_index_;
-            exp = CallCFuncException("argument #", error->arg_index_ + 1,
+            auto arg = reg + error->arg_index_;
+            throw CallCFuncException("argument #", error->arg_index_ + 1,
                     " is a ", arg->TypeName(), " value, expect a ",
                     Value::TypeName(error->expect_type_), " value");
         }
-
-        // Pop the c function CallInfo
-        calls_.pop_back();
-        throw exp;
     }
 } // namespace luna
@@ -3,12 +3,18 @@
 
 #include "GC.h"
 #include "Runtime.h"
+#include "Upvalue.h"
 #include "ModuleManager.h"
+#include "Profiler.h"
+#include "OpcodeStats.h"
 #include "StringPool.h"
+#include "ValueTraits.h"
 #include <string>
+#include <tuple>
 #include <memory>
 #include <vector>
-#include <list>
+#include <functional>
+#include <type_traits>
 
 namespace luna
 {
@@ -39,15 +45,69 @@ namespace luna
         CFunctionError() : type_(CFuntionErrorType_NoError) { }
     };
 
+    // Events of debug hook
+    enum HookEvent
+    {
+        HookEvent_Call,     // Enter a function
+        HookEvent_Return,   // Leave a function
+        HookEvent_Line,     // Enter a new line, or jump back in a line
+        HookEvent_Count,    // Execute every 'count' instructions
+    };
+
+    // Mask of events which debug hook is called on
+    enum HookMask
+    {
+        HookMask_Call = 1 << HookEvent_Call,
+        HookMask_Return = 1 << HookEvent_Return,
+        HookMask_Line = 1 << HookEvent_Line,
+        HookMask_Count = 1 << HookEvent_Count,
+    };
+
+    // Event info passed to debug hook
+    struct HookInfo
+    {
+        HookEvent event_;
+        // Function of the event, nullptr when it is a c function
+        const Function *function_;
+        // Line of the instruction, or line of function define for call
+        // and return events, -1 for c function
+        int line_;
+    };
+
+    // Snapshot of GC heap
+    struct HeapSnapshot
+    {
+        // Bytes of all GC objects, includes memory owned by them
+        std::size_t total_bytes_;
+        // All GC objects
+        GCObjectCounts objects_;
+        // Objects reachable from closure of each loaded module, which
+        // are prototypes, constants and upvalues of the module
+        std::vector<std::pair<std::string, GCObjectCounts>> modules_;
+    };
+
     class State
     {
         friend class VM;
         friend class StackAPI;
         friend class Library;
         friend class ModuleManager;
+        friend class Coroutine;
         friend class CodeGenerateVisitor;
     public:
-        State();
+        // Debug hook, it could throw CallCFuncException to stop execution
+        // with runtime error, e.g. when the instruction budget runs out
+        typedef std::function<void (State *, const HookInfo &)> HookCallback;
+
+        // Count of CallInfos reserved for stack frames
+        static const std::size_t kBaseCallDepth = 128;
+        // Default max depth of stack frames
+        static const std::size_t kDefaultMaxCallDepth = 200000;
+
+        // All memory of GC heap is from 'allocator', the default allocator
+        // when it is nullptr
+        explicit State(const GCConfig &gc_config = GCConfig(),
+                       Allocator *allocator = nullptr);
         ~State();
 
         State(const State&) = delete;
@@ -55,6 +115,7 @@ namespace luna
 
         // Check module loaded or not
         bool IsModuleLoaded(const std::string &module_name) const;
+        bool IsModuleLoaded(const String *module_name) const;
 
         // Load module, if load success, then push a module closure on stack,
         // otherwise throw Exception
@@ -64,20 +125,127 @@ namespace luna
         // loaded success.
         void DoModule(const std::string &module_name);
 
+        // Compile module into binary chunk cache, LoadModule prefers
+        // the cache when it is up to date
+        void CompileModule(const std::string &module_name);
+
+        // Load modules without running them, modules are compiled on
+        // 'thread_count' threads in parallel, 0 means count of cores.
+        // Modules loaded are run when DoModule or require them.
+        void PreloadModules(const std::vector<std::string> &module_names,
+                            unsigned int thread_count = 0);
+
         // Load string and call the string function when the string
-        // loaded success.
+        // loaded success. 'str' of 'size' bytes is compiled in place
+        // without copy.
         void DoString(const std::string &str, const std::string &name = "");
+        void DoString(const char *str, std::size_t size,
+                      const std::string &name = "");
+
+        // Keep compiled functions of the last 'count' different strings
+        // run by DoString, then the same string with the same name runs
+        // without compiling again. It is 0 by default, which disables the
+        // chunk cache.
+        void SetChunkCacheSize(std::size_t count);
 
         // Call an in stack function
         // If f is a closure, then create a stack frame and return true,
         // call VM::Execute() to execute the closure instructions.
-        // Return false when f is a c function.
+        // Return false when f is a c function, unless it yields the
+        // running coroutine, then VM::Execute returns to the resumer.
         bool CallFunction(Value *f, int arg_count, int expect_result);
 
+        // Call function 'f' with 'args' from host, return the first result
+        // converted by ValueTraits, or nothing when 'R' is void. Throw
+        // CallCFuncException when 'f' is not callable or the result is
+        // not a 'R', and exceptions thrown by the call.
+        // e.g. double sum = state.Call<double>(f, 1, 2);
+        template<typename R = void, typename... Args>
+        R Call(const Value &f, const Args&... args)
+        {
+            auto index = PrepareCall(f, sizeof...(Args));
+            SetCallArgs(stack_.stack_.data() + index + 1, args...);
+            RunCall(index, sizeof...(Args), std::is_void<R>::value ? 0 : 1);
+            return PopCallResult<R>(index, std::is_void<R>());
+        }
+
+        // Call function 'f' once for each of 'count' argument tuples of
+        // 'args', store the first results into 'results'. 'f' is checked
+        // and stack is reserved for all calls once, each call only moves
+        // its arguments to stack and runs the function. Results which
+        // refer to GC objects are rooted until the batch ends.
+        template<typename R, typename... Args>
+        void CallBatch(const Value &f, const std::tuple<Args...> *args,
+                       std::size_t count, R *results)
+        {
+            typedef typename MakeIndexSequence<sizeof...(Args)>::Type Indexes;
+            Value func = f;
+            bool rooted = IsGCRef<R>::value;
+            auto root = rooted ? PushBatchRoot() : 0;
+            auto index = PrepareCall(func, sizeof...(Args));
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                auto base = stack_.stack_.data() + index;
+                *base = func;
+                SetTupleArgs(base + 1, args[i], Indexes());
+                RunCall(index, sizeof...(Args), 1);
+                if (rooted)
+                    RootBatchResult(root, i, *base);
+                results[i] = PopCallResult<R>(index, std::false_type());
+            }
+
+            if (rooted)
+                stack_.SetNewTop(stack_.stack_.data() + root);
+        }
+
+        // Same as above, results are discarded
+        template<typename... Args>
+        void CallBatch(const Value &f, const std::tuple<Args...> *args,
+                       std::size_t count)
+        {
+            typedef typename MakeIndexSequence<sizeof...(Args)>::Type Indexes;
+            Value func = f;
+            auto index = PrepareCall(func, sizeof...(Args));
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                auto base = stack_.stack_.data() + index;
+                *base = func;
+                SetTupleArgs(base + 1, args[i], Indexes());
+                RunCall(index, sizeof...(Args), 0);
+                stack_.top_ = stack_.stack_.data() + index;
+            }
+        }
+
+        // New coroutine which calls 'function' when it is resumed first
+        Coroutine * NewCoroutine(const Value &function);
+
+        // Resume suspended coroutine 'co' with 'arg_count' args from
+        // 'args'. Return true and output values yielded or returned by
+        // coroutine into 'results', or return false and output the error
+        // message when coroutine raises error, then coroutine is dead.
+        bool Resume(Coroutine *co, const Value *args, int arg_count,
+                    std::vector<Value> &results);
+
+        // Yield the running coroutine in c function, values returned by
+        // the c function are yielded to resumer. Throw CallCFuncException
+        // when it is not in coroutine or called by another c function.
+        void Yield();
+
+        // Get the running coroutine, nullptr when it is the main one
+        Coroutine * GetRunningCoroutine() const
+        { return running_; }
+
         // New GCObjects
+        // Short strings are interned, long strings are new strings
         String * GetString(const std::string &str);
         String * GetString(const char *str, std::size_t len);
         String * GetString(const char *str);
+        // Get string from string pool whether it is long or not, names
+        // are compared by address, so they are interned
+        String * GetInternedString(const std::string &str);
+        // New long string of 'len' bytes which is not interned, caller
+        // writes the contents into 'buffer' before the string is used
+        String * NewLongString(std::size_t len, char **buffer);
         Function * NewFunction();
         Closure * NewClosure();
         Upvalue * NewUpvalue();
@@ -87,6 +255,54 @@ namespace luna
         // Get current CallInfo
         CallInfo * GetCurrentCall();
 
+        // Make sure there are 'count' slots from 'base' in stack, stack
+        // grows when it is not enough, and return new address of 'base'.
+        // Throw StackOverflowException when stack can not grow.
+        Value * ReserveStack(Value *base, std::size_t count)
+        {
+            if (stack_.IsEnough(base, count))
+                return base;
+            return GrowStack(base, count);
+        }
+
+        // Get the open upvalue which refers to register 'reg', new one
+        // when it is not existed
+        Upvalue * GetOpenUpvalue(Value *reg);
+
+        // Close all open upvalues which refer to registers from 'level'
+        void CloseUpvalues(Value *level)
+        {
+            if (open_upvalues_ && open_upvalues_->GetValue() >= level)
+                CloseUpvaluesFrom(level);
+        }
+
+        // Set max depth of stack frames, call a function deeper than
+        // the depth will raise a "stack overflow" runtime error
+        void SetMaxCallDepth(std::size_t depth)
+        { max_call_depth_ = depth; }
+
+        std::size_t GetMaxCallDepth() const
+        { return max_call_depth_; }
+
+        // Enable or disable running hot functions as machine code, it
+        // is enabled by default and works only when the JIT is built in
+        void SetJitEnabled(bool enabled)
+        { jit_enabled_ = enabled; }
+
+        bool IsJitEnabled() const
+        { return jit_enabled_; }
+
+        // Compile nested functions of modules and strings loaded later on
+        // their first call instead of at load time, then functions which
+        // never run cost only their source. Code generation errors of
+        // these functions, e.g. too many registers, are raised by their
+        // first call. It is disabled by default.
+        void SetLazyCompile(bool lazy)
+        { lazy_compile_ = lazy; }
+
+        bool IsLazyCompile() const
+        { return lazy_compile_; }
+
         // Get the global table value
         Value * GetGlobal();
 
@@ -107,17 +323,181 @@ namespace luna
         // Get the GC
         GC& GetGC() { return *gc_; }
 
-        // Check and run GC
-        void CheckRunGC() { gc_->CheckGC(); }
+        // Check and run GC, it is also the sampling point of profiler
+        void CheckRunGC()
+        {
+            gc_->CheckGC();
+            if (profiler_ && profiler_->IsSamplePending())
+                profiler_->Sample(calls_);
+        }
+
+        // Set hard limit of bytes of GC heap, 0 is unlimited. Script
+        // raises MemoryException when the heap is still near the limit
+        // after an emergency full GC, or an allocation exceeds the limit.
+        void SetHeapLimit(std::size_t bytes)
+        { gc_->SetHeapLimit(bytes); }
+
+        // Get bytes of GC heap in use, and the max bytes ever reached
+        std::size_t GetMemoryBytes() const
+        { return gc_->GetTotalBytes(); }
+
+        std::size_t GetPeakMemoryBytes() const
+        { return gc_->GetPeakBytes(); }
+
+        // Set pause and step multiplier of major GC in percent
+        void SetGCPause(unsigned int percent)
+        { gc_->SetMajorPause(percent); }
+
+        void SetGCStepMultiplier(unsigned int percent)
+        { gc_->SetMajorStepMultiplier(percent); }
+
+        // Destroy dead objects in a background thread or not
+        void SetGCBackgroundSweep(bool enable)
+        { gc_->SetBackgroundSweep(enable); }
+
+        // Set callback which is called with statistics after each GC run
+        void SetGCCallback(const GC::GCCallback &callback)
+        { gc_->SetCallback(callback); }
+
+        // Get statistics of all GC runs
+        const GCStats & GetGCStats() const
+        { return gc_->GetStats(); }
+
+        // Take snapshot of GC heap, run full GC before it to exclude
+        // dead objects which are not swept yet
+        void GetHeapSnapshot(HeapSnapshot &snapshot);
+
+        // Start sampling profiler which samples stack frames every
+        // 'interval' microseconds, samples taken before are kept
+        void StartProfiler(unsigned int interval = Profiler::kDefaultInterval);
+
+        // Stop sampling profiler
+        void StopProfiler();
+
+        // Get samples of profiler in collapsed stack format, it is
+        // empty when profiler never started
+        std::string GetProfile() const;
+
+        // Discard samples of profiler
+        void ClearProfile();
+
+        // Get report of opcode execution counters, it is empty unless
+        // luna is built with LUNA_OPCODE_STATS
+        std::string GetOpcodeStats() const;
+
+        // Reset opcode execution counters
+        void ClearOpcodeStats();
+
+        // Set debug hook which is called on events in 'mask', count event
+        // is called every 'count' instructions. Empty callback or 0 mask
+        // removes the hook. Hook is not called while a hook is running.
+        // VM runs hooks checking loop only for frames entered or resumed
+        // when hook is set, so a hook set in c function takes effect on
+        // the next call or return.
+        void SetHook(int mask, int count, const HookCallback &callback);
+
+        // Get mask of debug hook, 0 when no hook
+        int GetHookMask() const
+        { return hook_mask_; }
 
     private:
+        // Check 'f' is callable and place it on stack top, reserve stack
+        // for 'arg_count' args after it and registers of 'f', return
+        // stack index of 'f'
+        std::size_t PrepareCall(const Value &f, int arg_count);
+
+        // Call function at stack index 'index' with 'arg_count' args after
+        // it until it returns, 'expect_result' results replace them
+        void RunCall(std::size_t index, int arg_count, int expect_result);
+
+        // Push a table which roots results of CallBatch, return its
+        // stack index
+        std::size_t PushBatchRoot();
+
+        // Root the 'i'th result of CallBatch by table at stack index 'root'
+        void RootBatchResult(std::size_t root, std::size_t i, const Value &result);
+
+        // Set 'args' converted by ValueTraits to stack from 'dst'
+        void SetCallArgs(Value *) { }
+
+        template<typename Arg, typename... Args>
+        void SetCallArgs(Value *dst, const Arg &arg, const Args&... args)
+        {
+            *dst = ArgTraits<Arg>::Make(this, arg);
+            SetCallArgs(dst + 1, args...);
+        }
+
+        template<typename... Args, std::size_t... Indexes>
+        void SetTupleArgs(Value *dst, const std::tuple<Args...> &args,
+                          IndexSequence<Indexes...>)
+        {
+            SetCallArgs(dst, std::get<Indexes>(args)...);
+        }
+
+        // Pop the result of call at stack index 'index' and convert it to
+        // 'R', or pop nothing when 'R' is void
+        template<typename R>
+        R PopCallResult(std::size_t index, std::false_type)
+        {
+            static_assert(!std::is_same<R, const char *>::value,
+                          "string result may be collected after popped");
+            auto result = stack_.stack_.data() + index;
+            stack_.top_ = result;
+            if (!ValueTraits<R>::Is(*result))
+                CallResultTypeError(*result, ValueTraits<R>::Type());
+            return ValueTraits<R>::Get(*result);
+        }
+
+        template<typename R>
+        void PopCallResult(std::size_t index, std::true_type)
+        {
+            stack_.top_ = stack_.stack_.data() + index;
+        }
+
+        // Throw CallCFuncException for result 'result' of State::Call
+        // which is not 'expect_type'
+        static void CallResultTypeError(const Value &result, ValueT expect_type);
+
+        // Get string from string pool, or new interned string
+        String * GetInternedString(const char *str, std::size_t len);
+
         // Full GC root
         void FullGCRoot(GCObjectVisitor *v);
 
+        // Grow stack and fix up pointers to old stack
+        Value * GrowStack(Value *base, std::size_t count);
+
+        void CloseUpvaluesFrom(Value *level);
+
         // For CallFunction
         void CallClosure(Value *f, int expect_result);
         void CallCFunction(Value *f, int expect_result);
-        void CheckCFunctionError();
+        void CheckCFunctionError(Value *reg);
+
+        // Move 'count' results from 'src' to 'dst' as 'expect_result'
+        // results of a call, and set new stack top after them
+        void MoveResults(Value *src, int count, Value *dst, int expect_result);
+
+        // Hook is set and not running
+        bool IsHookActive() const
+        { return hook_mask_ != 0 && !in_hook_; }
+
+        // Call debug hook, 'proto' is nullptr when it is event of c
+        // function, otherwise registers of current frame are kept
+        void CallHook(HookEvent event, const Function *proto, int line);
+
+        // Swap stack and frames with the ones of coroutine
+        void SwapContext(Coroutine *co);
+
+        // Run coroutine until it yields or returns
+        void RunCoroutine(Coroutine *co, const Value *args, int arg_count);
+
+        // Delete coroutines whose handles are collected
+        void DeleteCollectedCoroutines();
+
+        // Get the first register of running c function
+        Value * GetCFunctionRegister()
+        { return stack_.stack_.data() + cfunc_register_; }
 
         // Get the table which stores all metatables
         Table * GetMetatables();
@@ -134,10 +514,43 @@ namespace luna
 
         // Stack data
         Stack stack_;
-        // Stack frames
-        std::list<CallInfo> calls_;
+        // Stack frames, indexed by call depth
+        std::vector<CallInfo> calls_;
+        // Max depth of stack frames
+        std::size_t max_call_depth_;
+        // Open upvalues list sorted by register address from high to low
+        Upvalue *open_upvalues_;
+        // Stack index of the first register of running c function
+        std::size_t cfunc_register_;
+        // Depth of running c functions of the running coroutine
+        int cfunc_depth_;
+        // The running coroutine is yielding
+        bool yielding_;
+        // The running coroutine, nullptr when it is the main one
+        Coroutine *running_;
+        // All coroutines which are not deleted
+        std::vector<std::unique_ptr<Coroutine>> coroutines_;
+        // Count of coroutines whose handles are collected
+        std::size_t collected_coroutines_;
         // Global table
         Value global_;
+        // Sampling profiler, nullptr when it never started
+        std::unique_ptr<Profiler> profiler_;
+        // Opcode execution counters, nullptr unless LUNA_OPCODE_STATS
+        std::unique_ptr<OpcodeStats> opcode_stats_;
+        // Compile hot functions into machine code
+        bool jit_enabled_;
+        // Compile nested functions on their first call
+        bool lazy_compile_;
+        // Debug hook and its event mask
+        HookCallback hook_;
+        int hook_mask_;
+        // Count of instructions of count event, and instructions left
+        // before the next count event
+        int hook_count_;
+        int hook_count_left_;
+        // Debug hook is running
+        bool in_hook_;
     };
 } // namespace luna
 
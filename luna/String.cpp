@@ -1,9 +1,65 @@
 #include "String.h"
+#include <chrono>
+#include <stdint.h>
+
+namespace
+{
+    const uint64_t kHashMultiplier = 0x9e3779b97f4a7c15ULL;
+    const uint64_t kHashMixer = 0xff51afd7ed558ccdULL;
+
+    // Strings which are not longer than this are hashed on every byte
+    const std::size_t kHashFullLength = 64;
+    // Count of sampled words of long string besides head and tail
+    const std::size_t kHashSampleWords = 16;
+
+    inline uint64_t ReadWord(const char *s)
+    {
+        uint64_t w = 0;
+        memcpy(&w, s, sizeof(w));
+        return w;
+    }
+
+    inline uint64_t MixWord(uint64_t h, uint64_t w)
+    {
+        h ^= w * kHashMultiplier;
+        h ^= h >> 29;
+        h *= kHashMixer;
+        return h;
+    }
+
+    inline uint64_t HashBytes(uint64_t h, const char *s, std::size_t len)
+    {
+        for (; len >= 8; s += 8, len -= 8)
+            h = MixWord(h, ReadWord(s));
+
+        if (len > 0)
+        {
+            uint64_t w = 0;
+            memcpy(&w, s, len);
+            h = MixWord(h, w);
+        }
+        return h;
+    }
+
+    // Seed of string hash, it is different between processes, so hash
+    // collisions could not be prepared
+    uint64_t HashSeed()
+    {
+        static const uint64_t seed = [] () {
+            static const char anchor = 0;
+            auto now = std::chrono::steady_clock::now().time_since_epoch();
+            return MixWord(static_cast<uint64_t>(now.count()),
+                           reinterpret_cast<uintptr_t>(&anchor));
+        }();
+        return seed;
+    }
+} // namespace
 
 namespace luna
 {
-    String::String()
-        : in_heap_(0), str_(nullptr), length_(0), hash_(0)
+    String::String(GCMemory *memory)
+        : in_heap_(0), interned_(0), hash_ready_(0), str_(nullptr),
+          length_(0), hash_(0), memory_(memory)
     {
     }
 
@@ -15,8 +71,7 @@ namespace luna
 
     String::~String()
     {
-        if (in_heap_)
-            delete [] str_;
+        FreeHeapString();
     }
 
     std::string String::GetStdString() const
@@ -39,33 +94,68 @@ namespace luna
 
     void String::SetValue(const char *str, std::size_t len)
     {
-        if (in_heap_)
-            delete [] str_;
+        // Hash lazily until the hash is used
+        SetValue(str, len, 0);
+        hash_ready_ = 0;
+    }
 
-        length_ = len;
+    void String::SetValue(const char *str, std::size_t len, std::size_t hash)
+    {
+        memcpy(SetLength(len), str, len);
+        hash_ = hash;
+        hash_ready_ = 1;
+    }
+
+    char * String::SetLength(std::size_t len)
+    {
         if (len < sizeof(str_buffer_))
         {
-            memcpy(str_buffer_, str, len);
+            FreeHeapString();
+            length_ = len;
+            hash_ready_ = 0;
             str_buffer_[len] = 0;
-            in_heap_ = 0;
-            Hash(str_buffer_);
+            return str_buffer_;
         }
         else
         {
-            str_ = new char[len + 1];
-            memcpy(str_, str, len);
+            // Alloc before free, string is unchanged when alloc throws
+            auto str = GCAllocator<char>(memory_).allocate(len + 1);
+            FreeHeapString();
+            length_ = len;
+            hash_ready_ = 0;
+            str_ = str;
             str_[len] = 0;
             in_heap_ = 1;
-            Hash(str_);
+            return str_;
+        }
+    }
+
+    void String::FreeHeapString()
+    {
+        if (in_heap_)
+        {
+            GCAllocator<char>(memory_).deallocate(str_, length_ + 1);
+            in_heap_ = 0;
         }
     }
 
-    void String::Hash(const char *s)
+    std::size_t String::Hash(const char *s, std::size_t len)
     {
-        hash_ = 5381;
-        int c = 0;
+        uint64_t h = MixWord(HashSeed(), len);
+
+        if (len <= kHashFullLength)
+            return static_cast<std::size_t>(HashBytes(h, s, len));
+
+        // Hash head, tail and words sampled from middle of long string
+        const std::size_t edge = kHashFullLength / 2;
+        h = HashBytes(h, s, edge);
+        h = HashBytes(h, s + len - edge, edge);
+
+        std::size_t step = (len - 2 * edge) / kHashSampleWords;
+        const char *p = s + edge;
+        for (std::size_t i = 0; i < kHashSampleWords; ++i, p += step)
+            h = MixWord(h, ReadWord(p));
 
-        while ((c = *s++))
-            hash_ = ((hash_ << 5) + hash_) + c;
+        return static_cast<std::size_t>(MixWord(h, 0));
     }
 } // namespace luna
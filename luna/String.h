@@ -10,8 +10,14 @@ namespace luna
 {
     class String : public GCObject
     {
+        friend class StringPool;
     public:
-        String();
+        // Strings which are longer than this are long strings, long
+        // strings are not interned and hashed lazily
+        static const std::size_t kMaxShortLength = 40;
+
+        // Memory of long string is accounted into 'memory'
+        explicit String(GCMemory *memory = nullptr);
         explicit String(const char *str);
         ~String();
 
@@ -22,7 +28,21 @@ namespace luna
         { v->Visit(this); }
 
         std::size_t GetHash() const
-        { return hash_; }
+        {
+            if (!hash_ready_)
+            {
+                hash_ = Hash(GetCStr(), length_);
+                hash_ready_ = 1;
+            }
+            return hash_;
+        }
+
+        bool IsLong() const
+        { return length_ > kMaxShortLength; }
+
+        // String is in string pool or not
+        bool IsInterned() const
+        { return interned_ != 0; }
 
         std::size_t GetLength() const
         { return length_; }
@@ -33,17 +53,39 @@ namespace luna
         // Convert to std::string
         std::string GetStdString() const;
 
+        // Compare contents with 'len' bytes of 'str'
+        bool Equal(const char *str, std::size_t len) const
+        {
+            return length_ == len && memcmp(GetCStr(), str, len) == 0;
+        }
+
+        // Compare contents with C string 'str'
+        bool Equal(const char *str) const
+        { return Equal(str, strlen(str)); }
+
         // Change context of string
         void SetValue(const std::string &str);
         void SetValue(const char *str);
         void SetValue(const char *str, std::size_t len);
+        // Change context of string which hash is calculated by Hash
+        void SetValue(const char *str, std::size_t len, std::size_t hash);
+
+        // Change length of string to 'len' and return the buffer of
+        // contents to be written in place, only for string which is not
+        // interned, the hash is calculated lazily
+        char * SetLength(std::size_t len);
+
+        // Calculate seeded hash of 'len' bytes of 's', long string is
+        // hashed by sampling
+        static std::size_t Hash(const char *s, std::size_t len);
 
         friend bool operator == (const String &l, const String &r)
         {
-            return l.hash_ == r.hash_ &&
-                l.length_ == r.length_ &&
-                (l.in_heap_ ? memcmp(l.str_, r.str_, l.length_) :
-                 memcmp(l.str_buffer_, r.str_buffer_, l.length_)) == 0;
+            if (&l == &r)
+                return true;
+            return l.length_ == r.length_ &&
+                (!l.hash_ready_ || !r.hash_ready_ || l.hash_ == r.hash_) &&
+                memcmp(l.GetCStr(), r.GetCStr(), l.length_) == 0;
         }
 
         friend bool operator != (const String &l, const String &r)
@@ -53,10 +95,10 @@ namespace luna
 
         friend bool operator < (const String &l, const String &r)
         {
-            auto *l_s = l.in_heap_ ? l.str_ : l.str_buffer_;
-            auto *r_s = r.in_heap_ ? r.str_ : r.str_buffer_;
+            if (&l == &r)
+                return false;
             auto len = std::min(l.length_, r.length_);
-            auto cmp = memcmp(l_s, r_s, len);
+            auto cmp = memcmp(l.GetCStr(), r.GetCStr(), len);
             if (cmp == 0)
                 return l.length_ < r.length_;
             else
@@ -79,11 +121,15 @@ namespace luna
         }
 
     private:
-        // Calculate hash of string
-        void Hash(const char *s);
+        // Free long string in heap
+        void FreeHeapString();
 
         // String in heap or not
         char in_heap_;
+        // String is in string pool or not
+        char interned_;
+        // Hash value is calculated or not
+        mutable char hash_ready_;
         union
         {
             // Buffer for short string
@@ -95,7 +141,9 @@ namespace luna
         // Length of string
         unsigned int length_;
         // Hash value of string
-        std::size_t hash_;
+        mutable std::size_t hash_;
+        // Memory accounting of GC
+        GCMemory *memory_;
     };
 } // namespace luna
 
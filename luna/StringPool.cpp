@@ -1,48 +1,125 @@
 #include "StringPool.h"
 #include <assert.h>
 
+namespace
+{
+    const std::size_t kMinPoolSize = 64;
+
+    // Tombstone of deleted string, it is never dereferenced
+    luna::String * const kTombstone =
+        reinterpret_cast<luna::String *>(static_cast<uintptr_t>(1));
+} // namespace
+
 namespace luna
 {
     StringPool::StringPool()
+        : slots_(kMinPoolSize, nullptr), count_(0), used_(0)
     {
     }
 
     String * StringPool::GetString(const std::string &str)
     {
-        temp_.SetValue(str);
-        return GetString();
+        return GetString(str.c_str(), str.size());
     }
 
     String * StringPool::GetString(const char *str, std::size_t len)
     {
-        temp_.SetValue(str, len);
-        return GetString();
+        std::size_t hash = 0;
+        return GetString(str, len, hash);
     }
 
     String * StringPool::GetString(const char *str)
     {
-        temp_.SetValue(str);
-        return GetString();
+        return GetString(str, strlen(str));
+    }
+
+    String * StringPool::GetString(const char *str, std::size_t len,
+                                   std::size_t &hash)
+    {
+        hash = String::Hash(str, len);
+        auto index = FindSlot(str, len, hash);
+        return index < slots_.size() ? slots_[index] : nullptr;
     }
 
     void StringPool::AddString(String *str)
     {
-        auto it = strings_.insert(str);
-        assert(it.second);
-        (void)it;
+        assert(FindSlot(str->GetCStr(), str->GetLength(),
+                        str->GetHash()) == slots_.size());
+
+        // Keep load factor no more than 3/4
+        if ((used_ + 1) * 4 > slots_.size() * 3)
+            Resize(count_ + 1);
+
+        std::size_t mask = slots_.size() - 1;
+        std::size_t index = str->GetHash() & mask;
+        while (slots_[index] && slots_[index] != kTombstone)
+            index = (index + 1) & mask;
+
+        if (!slots_[index])
+            ++used_;
+        slots_[index] = str;
+        str->interned_ = 1;
+        ++count_;
     }
 
     void StringPool::DeleteString(String *str)
     {
-        strings_.erase(str);
+        if (!str->interned_)
+            return ;
+
+        std::size_t mask = slots_.size() - 1;
+        std::size_t index = str->GetHash() & mask;
+        while (slots_[index])
+        {
+            if (slots_[index] == str)
+            {
+                slots_[index] = kTombstone;
+                str->interned_ = 0;
+                --count_;
+                return ;
+            }
+            index = (index + 1) & mask;
+        }
     }
 
-    String * StringPool::GetString()
+    std::size_t StringPool::FindSlot(const char *str, std::size_t len,
+                                     std::size_t hash) const
     {
-        auto it = strings_.find(&temp_);
-        if (it == strings_.end())
-            return nullptr;
-        else
-            return *it;
+        std::size_t mask = slots_.size() - 1;
+        std::size_t index = hash & mask;
+
+        // There is one empty slot at least, so the probing will stop
+        while (auto s = slots_[index])
+        {
+            if (s != kTombstone && s->GetHash() == hash &&
+                s->GetLength() == len && memcmp(s->GetCStr(), str, len) == 0)
+                return index;
+            index = (index + 1) & mask;
+        }
+
+        return slots_.size();
+    }
+
+    void StringPool::Resize(std::size_t count)
+    {
+        std::size_t size = kMinPoolSize;
+        while (count * 2 > size)
+            size <<= 1;
+
+        std::vector<String *> slots(size, nullptr);
+        std::size_t mask = size - 1;
+        for (auto s : slots_)
+        {
+            if (!s || s == kTombstone)
+                continue;
+
+            std::size_t index = s->GetHash() & mask;
+            while (slots[index])
+                index = (index + 1) & mask;
+            slots[index] = s;
+        }
+
+        slots_.swap(slots);
+        used_ = count_;
     }
 } // namespace luna
@@ -3,7 +3,6 @@
 
 #include "String.h"
 #include <vector>
-#include <unordered_set>
 
 namespace luna
 {
@@ -21,6 +20,10 @@ namespace luna
         String * GetString(const char *str, std::size_t len);
         String * GetString(const char *str);
 
+        // Get string from pool like above, and output hash of string,
+        // then new string could be set by the hash without rehashing
+        String * GetString(const char *str, std::size_t len, std::size_t &hash);
+
         // Add string to pool
         void AddString(String *str);
 
@@ -28,26 +31,20 @@ namespace luna
         void DeleteString(String *str);
 
     private:
-        struct StringHash
-        {
-            std::size_t operator () (const String *s) const
-            {
-                return s->GetHash();
-            }
-        };
-
-        struct StringEqual
-        {
-            bool operator () (const String *l, const String *r) const
-            {
-                return l == r || *l == *r;
-            }
-        };
-
-        String * GetString();
-
-        String temp_;
-        std::unordered_set<String *, StringHash, StringEqual> strings_;
+        // Find slot index of string, or return the size of slots
+        std::size_t FindSlot(const char *str, std::size_t len,
+                             std::size_t hash) const;
+
+        // Resize slots to hold 'count' strings at least
+        void Resize(std::size_t count);
+
+        // Open addressing hash table with linear probing, deleted slots
+        // are marked by tombstone
+        std::vector<String *> slots_;
+        // Count of strings in pool
+        std::size_t count_;
+        // Count of strings and tombstones in slots
+        std::size_t used_;
     };
 } // namespace luna
 
@@ -0,0 +1,76 @@
+#include "Sweeper.h"
+#include "GC.h"
+#include <assert.h>
+
+namespace luna
+{
+    Sweeper::Sweeper()
+        : stop_(false)
+    {
+        thread_ = std::thread(&Sweeper::Run, this);
+    }
+
+    Sweeper::~Sweeper()
+    {
+        Join();
+    }
+
+    void Sweeper::Destroy(std::vector<DeadObject> &objects)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (pending_.empty())
+                pending_.swap(objects);
+            else
+                pending_.insert(pending_.end(), objects.begin(), objects.end());
+        }
+
+        objects.clear();
+        cond_.notify_one();
+    }
+
+    void Sweeper::TakeDestroyed(std::vector<DeadObject> &objects)
+    {
+        assert(objects.empty());
+        std::lock_guard<std::mutex> lock(mutex_);
+        objects.swap(destroyed_);
+    }
+
+    void Sweeper::Join()
+    {
+        if (!thread_.joinable())
+            return ;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+
+        cond_.notify_one();
+        thread_.join();
+    }
+
+    void Sweeper::Run()
+    {
+        std::vector<DeadObject> objects;
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;)
+        {
+            cond_.wait(lock, [this] { return stop_ || !pending_.empty(); });
+
+            // Stop after all pending objects are destroyed
+            if (pending_.empty())
+                return ;
+
+            objects.swap(pending_);
+            lock.unlock();
+
+            for (const auto &dead : objects)
+                dead.obj_->~GCObject();
+
+            lock.lock();
+            destroyed_.insert(destroyed_.end(), objects.begin(), objects.end());
+            objects.clear();
+        }
+    }
+} // namespace luna
@@ -0,0 +1,56 @@
+#ifndef SWEEPER_H
+#define SWEEPER_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stddef.h>
+
+namespace luna
+{
+    class GCObject;
+
+    // Dead GC object and size of its memory block
+    struct DeadObject
+    {
+        GCObject *obj_;
+        std::size_t size_;
+    };
+
+    // Sweeper destroys dead GC objects in a background thread, memory
+    // blocks of destroyed objects are taken back by the owner thread.
+    class Sweeper
+    {
+    public:
+        Sweeper();
+        ~Sweeper();
+
+        Sweeper(const Sweeper&) = delete;
+        void operator = (const Sweeper&) = delete;
+
+        // Destroy 'objects' in background thread, 'objects' is cleared
+        void Destroy(std::vector<DeadObject> &objects);
+
+        // Take all objects which are destroyed, 'objects' must be empty
+        void TakeDestroyed(std::vector<DeadObject> &objects);
+
+        // Destroy all objects, and stop the background thread
+        void Join();
+
+    private:
+        void Run();
+
+        // Objects to destroy
+        std::vector<DeadObject> pending_;
+        // Objects destroyed
+        std::vector<DeadObject> destroyed_;
+        bool stop_;
+
+        std::mutex mutex_;
+        std::condition_variable cond_;
+        std::thread thread_;
+    };
+} // namespace luna
+
+#endif // SWEEPER_H
@@ -1,8 +1,40 @@
 #include "SyntaxTree.h"
 #include "Visitor.h"
 
+namespace
+{
+    // Arena of the innermost SyntaxTreeArenaGuard of current thread
+    thread_local luna::Arena *current_arena = nullptr;
+} // namespace
+
 namespace luna
 {
+    void * SyntaxTree::operator new (std::size_t size)
+    {
+        if (current_arena)
+            return current_arena->Alloc(size);
+        return ::operator new(size);
+    }
+
+    void SyntaxTree::operator delete (void *ptr, std::size_t size)
+    {
+        if (current_arena)
+            current_arena->Free(ptr, size);
+        else
+            ::operator delete(ptr);
+    }
+
+    SyntaxTreeArenaGuard::SyntaxTreeArenaGuard()
+        : outer_arena_(current_arena)
+    {
+        current_arena = &arena_;
+    }
+
+    SyntaxTreeArenaGuard::~SyntaxTreeArenaGuard()
+    {
+        current_arena = outer_arena_;
+    }
+
 #define SYNTAX_TREE_ACCEPT_VISITOR_IMPL(class_name)         \
     void class_name::Accept(Visitor *v, void *data)         \
     {                                                       \
@@ -2,6 +2,7 @@
 #define SYNTAX_TREE_H
 
 #include "Token.h"
+#include "Arena.h"
 #include <memory>
 #include <vector>
 
@@ -39,6 +40,30 @@ namespace luna
     public:
         virtual ~SyntaxTree() { }
         SYNTAX_TREE_ACCEPT_VISITOR();
+
+        // Nodes are allocated from the arena of SyntaxTreeArenaGuard of
+        // current thread, or from heap when there is no guard
+        static void * operator new (std::size_t size);
+        static void operator delete (void *ptr, std::size_t size);
+    };
+
+    // All AST nodes which are created in the scope of this guard are
+    // allocated from an arena, memory of the nodes is released in one go
+    // when the guard is destroyed. The nodes must be destroyed in the
+    // scope too.
+    class SyntaxTreeArenaGuard
+    {
+    public:
+        SyntaxTreeArenaGuard();
+        ~SyntaxTreeArenaGuard();
+
+        SyntaxTreeArenaGuard(const SyntaxTreeArenaGuard&) = delete;
+        void operator = (const SyntaxTreeArenaGuard&) = delete;
+
+    private:
+        Arena arena_;
+        // Arena of outer guard
+        Arena *outer_arena_;
     };
 
     class Chunk : public SyntaxTree
@@ -424,11 +449,22 @@ namespace luna
 
         int line_;
 
+        // Source of the body from '(' to 'end' in the lexed buffer, the
+        // body is compiled from it later when compiling lazily
+        const char *source_begin_;
+        const char *source_end_;
+
+        // For lazy compile, names of upvalues used by this function and
+        // its nested functions, in order of first use
+        std::vector<String *> upvalue_names_;
+
         FunctionBody() { }
         FunctionBody(std::unique_ptr<SyntaxTree> param_list,
-                     std::unique_ptr<SyntaxTree> block, int line)
+                     std::unique_ptr<SyntaxTree> block, int line,
+                     const char *source_begin, const char *source_end)
             : param_list_(std::move(param_list)),
-              block_(std::move(block)), has_self_(false), line_(line)
+              block_(std::move(block)), has_self_(false), line_(line),
+              source_begin_(source_begin), source_end_(source_end)
         {
         }
 
@@ -468,9 +504,14 @@ namespace luna
     public:
         std::vector<std::unique_ptr<SyntaxTree>> fields_;
 
+        // Count of array fields and count of index and name fields
+        std::size_t array_field_count_;
+        std::size_t hash_field_count_;
+
         int line_;
 
-        explicit TableDefine(int line) : line_(line) { }
+        explicit TableDefine(int line)
+            : array_field_count_(0), hash_field_count_(0), line_(line) { }
 
         SYNTAX_TREE_ACCEPT_VISITOR_DECL();
     };
@@ -1,5 +1,10 @@
 #include "Table.h"
+#include "String.h"
 #include <math.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <algorithm>
 
 namespace
 {
@@ -7,11 +12,84 @@ namespace
     {
         return floor(d) == d;
     }
+
+    // Mix bits of integer, then keys which are different in high bits
+    // distribute in low bits too
+    inline std::size_t MixHash(uint64_t h)
+    {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return static_cast<std::size_t>(h);
+    }
+
+    inline std::size_t HashValue(const luna::Value &key)
+    {
+        switch (key.type_)
+        {
+            case luna::ValueT_String:
+                return key.str_->GetHash();
+            case luna::ValueT_Number:
+                {
+                    // 0.0 and -0.0 are the same key
+                    double num = key.num_ == 0.0 ? 0.0 : key.num_;
+                    uint64_t bits = 0;
+                    memcpy(&bits, &num, sizeof(num));
+                    return MixHash(bits);
+                }
+            case luna::ValueT_Bool:
+                return key.bvalue_ ? 1 : 0;
+            case luna::ValueT_CFunction:
+                return MixHash(reinterpret_cast<uintptr_t>(
+                            static_cast<luna::CFunctionType>(key.cfunc_)));
+            default:
+                return MixHash(reinterpret_cast<uintptr_t>(
+                            static_cast<luna::GCObject *>(key.obj_)));
+        }
+    }
+
+    inline bool IsKeyEqual(const luna::Value &left, const luna::Value &right)
+    {
+        // Fast path for string keys, short strings are unique in string
+        // pool, and long strings compare contents
+        if (right.type_ == luna::ValueT_String)
+            return left.type_ == luna::ValueT_String &&
+                (left.str_ == right.str_ ||
+                 (right.str_->IsLong() && *left.str_ == *right.str_));
+        return left == right;
+    }
+
+    const std::size_t kMinHashSize = 4;
+
+    // Array part never grows larger than 2^kMaxArrayBits by rehash
+    const int kMaxArrayBits = 26;
+
+    // Get i of slice (2^(i-1), 2^i] which key is in, slice of key 1 is 0,
+    // return -1 when key is not an integer in [1, 2^kMaxArrayBits]
+    inline int GetArraySlice(const luna::Value &key)
+    {
+        if (key.type_ != luna::ValueT_Number || !IsInt(key.num_) ||
+            key.num_ < 1 || key.num_ > static_cast<double>(1 << kMaxArrayBits))
+            return -1;
+
+        auto index = static_cast<std::size_t>(key.num_) - 1;
+        int slice = 0;
+        while (index)
+        {
+            index >>= 1;
+            ++slice;
+        }
+        return slice;
+    }
 } // namespace
 
 namespace luna
 {
-    Table::Table()
+    Table::Table(GCMemory *memory, ShapeTree *shapes)
+        : shape_(nullptr), shapes_(shapes), iterate_index_(0),
+          weak_mode_(WeakMode_None), memory_(memory)
     {
     }
 
@@ -29,15 +107,60 @@ namespace luna
             // Visit all keys and values in hash table.
             if (hash_)
             {
-                for (auto it = hash_->begin(); it != hash_->end(); ++it)
+                for (const auto &node : hash_->nodes_)
+                {
+                    if (IsKeyAlive(node))
+                        node.key_.Accept(v);
+                    node.value_.Accept(v);
+                }
+            }
+
+            // Visit all keys and values in shape slots.
+            if (shape_)
+            {
+                for (std::size_t i = 0; i < shape_->Size(); ++i)
                 {
-                    it->first.Accept(v);
-                    it->second.Accept(v);
+                    shape_->GetKey(i)->Accept(v);
+                    (*slots_)[i].Accept(v);
                 }
             }
         }
     }
 
+    void Table::SetWeakMode(unsigned int mode)
+    {
+        // Drop keys of removed entries which may be dead, before they
+        // are marked as keys of table which is not weak
+        if (mode == WeakMode_None && weak_mode_ != WeakMode_None && hash_)
+            ResizeHash(HashKeyCount());
+        weak_mode_ = mode;
+    }
+
+    void Table::Reserve(std::size_t array_size, std::size_t hash_size)
+    {
+        if (array_size > 0)
+        {
+            EnsureArray();
+            array_->reserve(array_size);
+        }
+
+        // String keys of table without hash table may be stored in slots
+        if (hash_size > 0 && shapes_ && !hash_)
+        {
+            if (!slots_)
+                slots_.reset(new Array(GCAllocator<Value>(memory_)));
+            slots_->reserve(hash_size);
+        }
+        else if (hash_size > 0)
+        {
+            std::size_t count = HashKeyCount();
+            if (hash_size < count)
+                hash_size = count;
+            if (!hash_ || hash_size * 4 > hash_->nodes_.size() * 3)
+                ResizeHash(hash_size);
+        }
+    }
+
     bool Table::SetArrayValue(std::size_t index, const Value &value)
     {
         if (index < 1)
@@ -55,6 +178,28 @@ namespace luna
         return true;
     }
 
+    void Table::SetArrayValues(std::size_t index, const Value *values,
+                               std::size_t count)
+    {
+        if (index >= 1 && index == ArraySize() + 1)
+        {
+            EnsureArray();
+            array_->insert(array_->end(), values, values + count);
+
+            EraseHashKeys(index, index + count);
+            MergeFromHashToArray();
+            return ;
+        }
+
+        Value key;
+        key.type_ = ValueT_Number;
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            key.num_ = index + i;
+            SetValue(key, values[i]);
+        }
+    }
+
     bool Table::InsertArrayValue(std::size_t index, const Value &value)
     {
         if (index < 1)
@@ -68,11 +213,8 @@ namespace luna
             AppendAndMergeFromHashToArray(value);
         else
         {
-            // Insert value
-            auto it = array_->begin();
-            std::advance(it, index - 1);
-            array_->insert(it, value);
-            // Try to merge from hash to array
+            // Insert value, and try to merge from hash to array
+            array_->insert(array_->begin() + (index - 1), value);
             MergeFromHashToArray();
         }
 
@@ -81,12 +223,47 @@ namespace luna
 
     bool Table::EraseArrayValue(std::size_t index)
     {
-        if (index < 1 || index > ArraySize())
+        std::size_t array_size = ArraySize();
+        if (index < 1 || index > array_size)
             return false;
 
-        auto it = array_->begin();
-        std::advance(it, index - 1);
-        array_->erase(it);
+        if (index == array_size)
+            array_->pop_back();
+        else
+            array_->erase(array_->begin() + (index - 1));
+        return true;
+    }
+
+    bool Table::MoveArrayValues(std::size_t first, std::size_t last,
+                                std::size_t to, Table *dest)
+    {
+        if (first < 1 || last > ArraySize() || to < 1 ||
+            to > dest->ArraySize() + 1)
+            return false;
+
+        if (first > last)
+            return true;
+
+        std::size_t count = last - first + 1;
+        std::size_t old_size = dest->ArraySize();
+        if (to + count - 1 > old_size)
+        {
+            dest->EnsureArray();
+            dest->array_->resize(to + count - 1);
+        }
+
+        // Source and dest may be the same array, and std::copy and
+        // std::copy_backward handle overlapped ranges in proper direction
+        auto src_begin = array_->begin() + (first - 1);
+        auto src_end = src_begin + count;
+        auto dest_begin = dest->array_->begin() + (to - 1);
+        if (dest != this || to <= first)
+            std::copy(src_begin, src_end, dest_begin);
+        else
+            std::copy_backward(src_begin, src_end, dest_begin + count);
+
+        dest->EraseHashKeys(old_size + 1, dest->array_->size() + 1);
+        dest->MergeFromHashToArray();
         return true;
     }
 
@@ -99,30 +276,23 @@ namespace luna
                 return ;
         }
 
-        // Hash part
-        if (!hash_)
+        // Shape part, other keys make the table a hash table
+        if (shape_)
         {
-            // If value is nil and hash part is not existed, then do nothing
-            if (value.IsNil())
+            int slot = FindSlot(key);
+            if (slot >= 0)
+            {
+                (*slots_)[slot] = value;
                 return ;
-            hash_.reset(new Hash);
-        }
+            }
 
-        auto it = hash_->find(key);
-        if (it != hash_->end())
-        {
-            // If value is nil, then just erase the element
             if (value.IsNil())
-                hash_->erase(it);
-            else
-                it->second = value;
-        }
-        else
-        {
-            // If key is not existed and value is not nil, then insert it
-            if (!value.IsNil())
-                hash_->insert(std::make_pair(key, value));
+                return ;
+            ConvertShapeToHash();
         }
+
+        // Hash part
+        SetHashValue(key, value);
     }
 
     Value Table::GetValue(const Value &key) const
@@ -135,77 +305,161 @@ namespace luna
                 return (*array_)[index - 1];
         }
 
-        // Get from hash table
-        if (hash_)
+        // Get from shape slots
+        if (shape_)
         {
-            auto it = hash_->find(key);
-            if (it != hash_->end())
-                return it->second;
+            int slot = FindSlot(key);
+            return slot >= 0 ? (*slots_)[slot] : Value();
         }
 
+        // Get from hash table
+        auto node = FindNode(key);
+        if (node)
+            return node->value_;
+
         // key not exist
         return Value();
     }
 
-    bool Table::FirstKeyValue(Value &key, Value &value)
+    Value Table::GetValueBySlot(const Value &key, unsigned int &slot) const
     {
-        // array part
-        if (ArraySize() > 0)
+        assert(key.type_ == ValueT_String);
+        if (shape_)
         {
-            key.num_ = 1;           // first element index
-            key.type_ = ValueT_Number;
-            value = (*array_)[0];
-            return true;
+            if (slot < shape_->Size() && shape_->GetKey(slot) == key.str_)
+                return (*slots_)[slot];
+
+            int index = shape_->FindSlot(key.str_);
+            if (index < 0)
+                return Value();
+            slot = index;
+            return (*slots_)[index];
         }
 
-        // hash part
-        if (hash_ && !hash_->empty())
+        auto node = GetSlotNode(key, slot);
+        if (!node)
         {
-            auto first = hash_->begin();
-            key = first->first;
-            value = first->second;
-            return true;
+            node = FindNode(key);
+            if (!node)
+                return Value();
+            slot = node - &hash_->nodes_[0];
         }
-
-        return false;
+        return node->value_;
     }
 
-    bool Table::NextKeyValue(const Value &key, Value &next_key, Value &next_value)
+    void Table::SetValueBySlot(const Value &key, const Value &value,
+                               unsigned int &slot)
     {
-        // array part
-        if (key.type_ == ValueT_Number && IsInt(key.num_))
+        assert(key.type_ == ValueT_String);
+
+        // Empty table gets the shape without keys
+        if (!shape_ && !hash_ && shapes_)
+            shape_ = shapes_->GetRoot();
+
+        if (shape_)
         {
-            std::size_t index = static_cast<std::size_t>(key.num_) + 1;
-            if (index >= 1 && index <= ArraySize())
+            if (slot < shape_->Size() && shape_->GetKey(slot) == key.str_)
             {
-                next_key.num_ = index;
-                next_key.type_ = ValueT_Number;
-                next_value = (*array_)[index - 1];
-                return true;
+                (*slots_)[slot] = value;
+                return ;
+            }
+
+            // Key set to nil keeps its slot, like the node of hash table
+            int index = shape_->FindSlot(key.str_);
+            if (index >= 0)
+                (*slots_)[index] = value;
+            else if (value.IsNil())
+                return ;
+            else
+                index = AddShapeKey(key, value);
+
+            if (index >= 0)
+            {
+                slot = index;
+                return ;
             }
         }
 
-        // hash part
-        if (hash_)
+        auto node = GetSlotNode(key, slot);
+        if (node)
         {
-            auto it = hash_->find(key);
-            if (it == hash_->end() && !hash_->empty())
+            node->value_ = value;
+            return ;
+        }
+
+        node = SetHashValue(key, value);
+        if (node)
+            slot = node - &hash_->nodes_[0];
+    }
+
+    bool Table::FirstKeyValue(Value &key, Value &value)
+    {
+        // array part, nil values are skipped
+        for (std::size_t index = 1; index <= ArraySize(); ++index)
+        {
+            if (!(*array_)[index - 1].IsNil())
             {
-                it = hash_->begin();
-                next_key = it->first;
-                next_value = it->second;
+                key.num_ = index;
+                key.type_ = ValueT_Number;
+                value = (*array_)[index - 1];
                 return true;
             }
+        }
+
+        // shape or hash part
+        return NextIterateNode(0, key, value);
+    }
 
-            if (it != hash_->end() && ++it != hash_->end())
+    bool Table::NextKeyValue(const Value &key, Value &next_key, Value &next_value)
+    {
+        // array part
+        if (key.type_ == ValueT_Number && IsInt(key.num_) &&
+            key.num_ >= 1 && key.num_ <= ArraySize())
+        {
+            std::size_t index = static_cast<std::size_t>(key.num_) + 1;
+            for (; index <= ArraySize(); ++index)
             {
-                next_key = it->first;
-                next_value = it->second;
-                return true;
+                if (!(*array_)[index - 1].IsNil())
+                {
+                    next_key.num_ = index;
+                    next_key.type_ = ValueT_Number;
+                    next_value = (*array_)[index - 1];
+                    return true;
+                }
             }
+
+            // Iterate hash part from the first node
+            return NextIterateNode(0, next_key, next_value);
         }
 
-        return false;
+        // shape part
+        if (shape_)
+        {
+            if (key.type_ == ValueT_String && iterate_index_ < shape_->Size() &&
+                shape_->GetKey(iterate_index_) == key.str_)
+                return NextIterateSlot(iterate_index_ + 1, next_key, next_value);
+
+            int slot = FindSlot(key);
+            if (slot < 0)
+                return false;
+            return NextIterateSlot(slot + 1, next_key, next_value);
+        }
+
+        // hash part
+        if (!hash_)
+            return false;
+
+        // Check the node of the last iterated key first
+        auto &nodes = hash_->nodes_;
+        if (iterate_index_ < nodes.size() &&
+            IsKeyEqual(nodes[iterate_index_].key_, key))
+            return NextIterateNode(iterate_index_ + 1, next_key, next_value);
+
+        auto current = FindNode(key);
+        if (!current)
+            return false;
+
+        return NextIterateNode(current - &nodes[0] + 1, next_key, next_value);
     }
 
     std::size_t Table::ArraySize() const
@@ -221,13 +475,39 @@ namespace luna
 
     void Table::AppendToArray(const Value &value)
     {
-        if (!array_)
-            array_.reset(new Array);
+        EnsureArray();
         array_->push_back(value);
     }
 
+    void Table::EnsureArray()
+    {
+        if (!array_)
+            array_.reset(new Array(GCAllocator<Value>(memory_)));
+    }
+
+    void Table::EraseHashKeys(std::size_t begin, std::size_t end)
+    {
+        if (!HasNumberKeys())
+            return ;
+
+        Value key;
+        key.type_ = ValueT_Number;
+        for (std::size_t i = begin; i < end; ++i)
+        {
+            key.num_ = i;
+            auto node = FindNode(key);
+            if (node)
+                node->value_.SetNil();
+        }
+    }
+
     void Table::MergeFromHashToArray()
     {
+        // Array push and insert are fast when there is no number key in
+        // hash table
+        if (!HasNumberKeys())
+            return ;
+
         auto index = ArraySize();
         Value key;
         key.num_ = ++index;
@@ -239,15 +519,302 @@ namespace luna
 
     bool Table::MoveHashToArray(const Value &key)
     {
-        if (!hash_)
+        auto node = FindNode(key);
+        if (!node || node->value_.IsNil())
             return false;
 
-        auto it = hash_->find(key);
-        if (it == hash_->end())
+        AppendToArray(node->value_);
+        node->value_.SetNil();
+        return true;
+    }
+
+    int Table::AddShapeKey(const Value &key, const Value &value)
+    {
+        // Long strings are compared by contents, they are never in shape
+        auto shape = key.str_->IsLong() ? nullptr : shapes_->AddKey(shape_, key.str_);
+        if (!shape)
+        {
+            ConvertShapeToHash();
+            return -1;
+        }
+
+        if (!slots_)
+            slots_.reset(new Array(GCAllocator<Value>(memory_)));
+        slots_->push_back(value);
+        shape_ = shape;
+        return static_cast<int>(shape_->Size()) - 1;
+    }
+
+    void Table::ConvertShapeToHash()
+    {
+        std::size_t count = 0;
+        for (std::size_t i = 0; i < shape_->Size(); ++i)
+        {
+            if (!(*slots_)[i].IsNil())
+                ++count;
+        }
+
+        // Make the hash table hold all keys and one more new key
+        ResizeHash(count + 1);
+        for (std::size_t i = 0; i < shape_->Size(); ++i)
+            SetHashValue(Value(shape_->GetKey(i)), (*slots_)[i]);
+
+        shape_ = nullptr;
+        slots_.reset();
+    }
+
+    Table::Node * Table::FindNode(const Value &key) const
+    {
+        if (!hash_)
+            return nullptr;
+
+        auto &nodes = hash_->nodes_;
+        std::size_t mask = nodes.size() - 1;
+        std::size_t index = HashValue(key) & mask;
+
+        // There is one empty node at least, so the probing will stop
+        while (!nodes[index].key_.IsNil())
+        {
+            if (IsKeyEqual(nodes[index].key_, key))
+                return const_cast<Node *>(&nodes[index]);
+            index = (index + 1) & mask;
+        }
+
+        return nullptr;
+    }
+
+    Table::Node * Table::SetHashValue(const Value &key, const Value &value)
+    {
+        auto node = FindNode(key);
+        if (node)
+        {
+            node->value_ = value;
+            return node;
+        }
+
+        // If key is not existed and value is nil, then do nothing
+        if (value.IsNil())
+            return nullptr;
+
+        // Keep load factor no more than 3/4
+        if (!hash_ || (hash_->used_ + 1) * 4 > hash_->nodes_.size() * 3)
+        {
+            Rehash(key);
+
+            // Key may fit with the array part grown by rehash
+            if (key.type_ == ValueT_Number && IsInt(key.num_) && key.num_ >= 1 &&
+                SetArrayValue(static_cast<std::size_t>(key.num_), value))
+                return nullptr;
+        }
+
+        // Insert new key into the first empty node, or the first node
+        // which value is nil of the probing sequence
+        auto &nodes = hash_->nodes_;
+        std::size_t mask = nodes.size() - 1;
+        std::size_t index = HashValue(key) & mask;
+        while (!nodes[index].key_.IsNil() && !nodes[index].value_.IsNil())
+            index = (index + 1) & mask;
+
+        if (nodes[index].key_.IsNil())
+            ++hash_->used_;
+        else if (nodes[index].key_.type_ == ValueT_Number)
+            --hash_->number_keys_;
+        if (key.type_ == ValueT_Number)
+            ++hash_->number_keys_;
+        nodes[index].key_ = key;
+        nodes[index].value_ = value;
+        return &nodes[index];
+    }
+
+    void Table::Rehash(const Value &key)
+    {
+        auto array_size = ComputeArraySize(key);
+        if (array_size > ArraySize())
+            GrowArray(array_size);
+
+        // Make the new hash table hold all keys and one more new key
+        ResizeHash(HashKeyCount() + 1);
+    }
+
+    std::size_t Table::ComputeArraySize(const Value &key) const
+    {
+        std::size_t array_size = ArraySize();
+        if (!HasNumberKeys() && GetArraySlice(key) < 0)
+            return array_size;
+
+        // Count non-nil values of integer keys in each slice
+        std::size_t nums[kMaxArrayBits + 1] = { 0 };
+        std::size_t total = 0;
+        std::size_t index = 1;
+        for (int slice = 0; slice <= kMaxArrayBits && index <= array_size; ++slice)
+        {
+            std::size_t bound = static_cast<std::size_t>(1) << slice;
+            for (; index <= bound && index <= array_size; ++index)
+            {
+                if (!(*array_)[index - 1].IsNil())
+                {
+                    ++nums[slice];
+                    ++total;
+                }
+            }
+        }
+
+        if (HasNumberKeys())
+        {
+            for (const auto &node : hash_->nodes_)
+            {
+                int slice = node.value_.IsNil() ? -1 : GetArraySlice(node.key_);
+                if (slice >= 0)
+                {
+                    ++nums[slice];
+                    ++total;
+                }
+            }
+        }
+
+        int key_slice = GetArraySlice(key);
+        if (key_slice >= 0)
+        {
+            ++nums[key_slice];
+            ++total;
+        }
+
+        // The largest size of power of 2 which is more than half used
+        std::size_t optimal = 0;
+        std::size_t count = 0;
+        for (int slice = 0; slice <= kMaxArrayBits; ++slice)
+        {
+            std::size_t size = static_cast<std::size_t>(1) << slice;
+            if (size / 2 >= total)
+                break;
+
+            count += nums[slice];
+            if (count > size / 2)
+                optimal = size;
+        }
+
+        return std::max(optimal, array_size);
+    }
+
+    void Table::GrowArray(std::size_t size)
+    {
+        std::size_t old_size = ArraySize();
+        EnsureArray();
+        array_->resize(size);
+
+        if (HasNumberKeys())
+        {
+            for (auto &node : hash_->nodes_)
+            {
+                if (node.value_.IsNil() || node.key_.type_ != ValueT_Number ||
+                    !IsInt(node.key_.num_) || node.key_.num_ <= old_size ||
+                    node.key_.num_ > size)
+                    continue;
+
+                (*array_)[static_cast<std::size_t>(node.key_.num_) - 1] = node.value_;
+                node.value_.SetNil();
+            }
+        }
+
+        while (array_->size() > old_size && array_->back().IsNil())
+            array_->pop_back();
+
+        // Keys after the array may be in hash table when the new range
+        // is full
+        MergeFromHashToArray();
+    }
+
+    std::size_t Table::HashKeyCount() const
+    {
+        std::size_t count = 0;
+        if (hash_)
+        {
+            for (const auto &node : hash_->nodes_)
+            {
+                if (!node.value_.IsNil())
+                    ++count;
+            }
+        }
+        return count;
+    }
+
+    void Table::ResizeHash(std::size_t count)
+    {
+        std::size_t size = kMinHashSize;
+        while (count * 4 > size * 3)
+            size <<= 1;
+
+        std::unique_ptr<Hash> hash(new Hash(size, memory_));
+        if (hash_)
+        {
+            std::size_t mask = size - 1;
+            auto &nodes = hash->nodes_;
+            for (const auto &node : hash_->nodes_)
+            {
+                if (node.value_.IsNil())
+                    continue;
+
+                std::size_t index = HashValue(node.key_) & mask;
+                while (!nodes[index].key_.IsNil())
+                    index = (index + 1) & mask;
+                nodes[index] = node;
+                ++hash->used_;
+                if (node.key_.type_ == ValueT_Number)
+                    ++hash->number_keys_;
+            }
+        }
+
+        hash_ = std::move(hash);
+        iterate_index_ = 0;
+
+        // Slots reserved for shape are useless for hash table
+        if (!shape_)
+            slots_.reset();
+    }
+
+    Table::Node * Table::NextNode(std::size_t index) const
+    {
+        if (!hash_)
+            return nullptr;
+
+        auto &nodes = hash_->nodes_;
+        for (; index < nodes.size(); ++index)
+        {
+            if (!nodes[index].value_.IsNil())
+                return const_cast<Node *>(&nodes[index]);
+        }
+
+        return nullptr;
+    }
+
+    bool Table::NextIterateNode(std::size_t index, Value &key, Value &value)
+    {
+        if (shape_)
+            return NextIterateSlot(index, key, value);
+
+        auto node = NextNode(index);
+        if (!node)
             return false;
 
-        AppendToArray(it->second);
-        hash_->erase(it);
+        iterate_index_ = node - &hash_->nodes_[0];
+        key = node->key_;
+        value = node->value_;
         return true;
     }
+
+    bool Table::NextIterateSlot(std::size_t index, Value &key, Value &value)
+    {
+        for (; index < shape_->Size(); ++index)
+        {
+            if (!(*slots_)[index].IsNil())
+            {
+                iterate_index_ = index;
+                key = Value(shape_->GetKey(index));
+                value = (*slots_)[index];
+                return true;
+            }
+        }
+
+        return false;
+    }
 } // namespace luna
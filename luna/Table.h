@@ -3,25 +3,170 @@
 
 #include "GC.h"
 #include "Value.h"
+#include "Shape.h"
 #include <memory>
 #include <vector>
-#include <unordered_map>
 
 namespace luna
 {
-    // Table has array part and hash table part.
+    // Weak mode of table, GC removes an entry of weak table when its weak
+    // key or weak value is collected. Strings are values which are never
+    // collected from weak tables, and keys of array part and shape slots
+    // are not weak.
+    enum WeakMode
+    {
+        WeakMode_None = 0,
+        WeakMode_Key = 1,       // ephemeron, value is alive when key is alive
+        WeakMode_Value = 2,
+        WeakMode_KeyValue = WeakMode_Key | WeakMode_Value,
+    };
+
+    // Table has array part and hash table part. String keys which are
+    // set by constant keys are stored in slots of a shape shared with
+    // other tables instead of the hash table, until other keys are set
+    // or the shape can not grow any more.
     class Table : public GCObject
     {
     public:
-        Table();
+        // Memory of array and hash table is accounted into 'memory',
+        // table gets shapes from 'shapes' when it is not null
+        explicit Table(GCMemory *memory = nullptr, ShapeTree *shapes = nullptr);
 
         virtual void Accept(GCObjectVisitor *v);
 
+        // Pass all member values to 'marker' of GC
+        template<typename Marker>
+        void Trace(Marker &marker) const
+        {
+            if (array_)
+            {
+                for (const auto &value : *array_)
+                    marker.MarkValue(value);
+            }
+
+            if (hash_)
+            {
+                for (const auto &node : hash_->nodes_)
+                {
+                    if (IsKeyAlive(node))
+                        marker.MarkValue(node.key_);
+                    marker.MarkValue(node.value_);
+                }
+            }
+
+            if (shape_)
+            {
+                for (std::size_t i = 0; i < shape_->Size(); ++i)
+                {
+                    marker.MarkObject(shape_->GetKey(i));
+                    marker.MarkValue((*slots_)[i]);
+                }
+            }
+        }
+
+        // Pass strong references of weak table to 'marker' of GC, value of
+        // weak key is passed only when 'marker' has marked the key already.
+        template<typename Marker>
+        void TraceWeak(Marker &marker) const
+        {
+            bool weak_key = (weak_mode_ & WeakMode_Key) != 0;
+            bool weak_value = (weak_mode_ & WeakMode_Value) != 0;
+
+            if (array_)
+            {
+                for (const auto &value : *array_)
+                {
+                    if (!weak_value || !IsWeakRef(value))
+                        marker.MarkValue(value);
+                }
+            }
+
+            if (hash_)
+            {
+                for (const auto &node : hash_->nodes_)
+                {
+                    if (node.value_.IsNil())
+                    {
+                        if (IsKeyAlive(node))
+                            marker.MarkValue(node.key_);
+                        continue;
+                    }
+
+                    if (!weak_key || !IsWeakRef(node.key_))
+                        marker.MarkValue(node.key_);
+                    if (weak_value && IsWeakRef(node.value_))
+                        continue;
+                    if (!weak_key || !marker.IsDead(node.key_))
+                        marker.MarkValue(node.value_);
+                }
+            }
+
+            if (shape_)
+            {
+                for (std::size_t i = 0; i < shape_->Size(); ++i)
+                {
+                    marker.MarkObject(shape_->GetKey(i));
+                    if (!weak_value || !IsWeakRef((*slots_)[i]))
+                        marker.MarkValue((*slots_)[i]);
+                }
+            }
+        }
+
+        // Remove entries which key or value is dead after 'marker' has
+        // marked all alive objects, keys stay in nodes like keys which
+        // values are set to nil, they are never dereferenced.
+        template<typename Marker>
+        void ClearWeak(const Marker &marker)
+        {
+            if (array_)
+            {
+                for (auto &value : *array_)
+                {
+                    if (marker.IsDead(value))
+                        value.SetNil();
+                }
+            }
+
+            if (hash_)
+            {
+                for (auto &node : hash_->nodes_)
+                {
+                    if (!node.value_.IsNil() &&
+                        (marker.IsDead(node.key_) || marker.IsDead(node.value_)))
+                        node.value_.SetNil();
+                }
+            }
+
+            if (shape_)
+            {
+                for (std::size_t i = 0; i < shape_->Size(); ++i)
+                {
+                    if (marker.IsDead((*slots_)[i]))
+                        (*slots_)[i].SetNil();
+                }
+            }
+        }
+
+        // Set WeakMode of table
+        void SetWeakMode(unsigned int mode);
+
+        // Return WeakMode of table
+        unsigned int GetWeakMode() const { return weak_mode_; }
+
+        // Reserve memory for 'array_size' values of array part and
+        // 'hash_size' keys of hash table part.
+        void Reserve(std::size_t array_size, std::size_t hash_size);
+
         // Set array value by index, return true if success.
         // 'index' start from 1, if 'index' == ArraySize() + 1,
         // then append value to array.
         bool SetArrayValue(std::size_t index, const Value &value);
 
+        // Set 'count' values to array start from 'index', values are
+        // appended to array at once when 'index' == ArraySize() + 1.
+        void SetArrayValues(std::size_t index, const Value *values,
+                            std::size_t count);
+
         // If 'index' == ArraySize() + 1, then append value to array,
         // otherwise shifting up all values which start from 'index',
         // and insert value to 'index' of array.
@@ -33,6 +178,14 @@ namespace luna
         // Return true when erase success.
         bool EraseArrayValue(std::size_t index);
 
+        // Move array values of range ['first', 'last'] of this table to
+        // 'dest' table start from index 'to' in one pass, the ranges can
+        // overlap when 'dest' is this table.
+        // Return false and move nothing if the source range is not in array
+        // or 'to' is greater than dest->ArraySize() + 1.
+        bool MoveArrayValues(std::size_t first, std::size_t last,
+                             std::size_t to, Table *dest);
+
         // Add key-value into table.
         // If key is number and key fit with array, then insert into array,
         // otherwise insert into hash table.
@@ -44,19 +197,134 @@ namespace luna
         // Return value is 'nil' if 'key' is not existed.
         Value GetValue(const Value &key) const;
 
+        // Get value of string 'key' with inline cache 'slot', which is the
+        // shape slot or hash node index where the key was found last time,
+        // 'slot' is updated when the key is found in another slot or node.
+        Value GetValueBySlot(const Value &key, unsigned int &slot) const;
+
+        // Set value of string 'key' with inline cache 'slot' same as
+        // GetValueBySlot. New short string keys of table without hash
+        // table are added to its shape.
+        void SetValueBySlot(const Value &key, const Value &value,
+                            unsigned int &slot);
+
         // Get first key-value pair of table, return true if table is not empty.
         bool FirstKeyValue(Value &key, Value &value);
 
         // Get the next key-value pair by current 'key', return false if there
-        // is no key-value pair any more.
+        // is no key-value pair any more, or 'key' is not in table.
+        // Iterating the table step by step is O(1) for each step, since
+        // table remembers the node of the last iterated key.
         bool NextKeyValue(const Value &key, Value &next_key, Value &next_value);
 
         // Return the number of array part elements.
         std::size_t ArraySize() const;
 
+        // Return shape of table, or nullptr when table has no shape.
+        const Shape * GetShape() const { return shape_; }
+
+        // Return values of array part, which are ArraySize() values, the
+        // pointer is invalid after array part grows or shrinks.
+        Value * GetArrayValues()
+        { return array_ ? array_->data() : nullptr; }
+        const Value * GetArrayValues() const
+        { return array_ ? array_->data() : nullptr; }
+
     private:
-        typedef std::vector<Value> Array;
-        typedef std::unordered_map<Value, Value> Hash;
+        typedef std::vector<Value, GCAllocator<Value>> Array;
+
+        // Node of hash table, node is empty when key is nil.
+        struct Node
+        {
+            Value key_;
+            Value value_;
+        };
+
+        // Hash table with open addressing and linear probing, a key which
+        // value is set to nil stays in its node until rehash, so keys can
+        // be set to nil while iterating the table.
+        struct Hash
+        {
+            // Size of nodes is power of 2
+            std::vector<Node, GCAllocator<Node>> nodes_;
+            // Count of nodes which key is not nil
+            std::size_t used_;
+            // Count of nodes which key is number
+            std::size_t number_keys_;
+
+            Hash(std::size_t size, GCMemory *memory)
+                : nodes_(size, Node(), GCAllocator<Node>(memory)),
+                  used_(0), number_keys_(0) { }
+        };
+
+        // Find node of key in hash table, return nullptr if not found.
+        Node * FindNode(const Value &key) const;
+
+        // Set the value of the key in hash table, return the node of
+        // the key, or nullptr if the key is not inserted for nil value or
+        // the key is moved to array part when hash table grows.
+        Node * SetHashValue(const Value &key, const Value &value);
+
+        // Get node of string key by inline cache 'slot', return nullptr
+        // if the key is not in the node.
+        Node * GetSlotNode(const Value &key, unsigned int slot) const
+        {
+            if (hash_ && slot < hash_->nodes_.size())
+            {
+                auto node = const_cast<Node *>(&hash_->nodes_[slot]);
+                if (node->key_.type_ == ValueT_String &&
+                    node->key_.str_ == key.str_)
+                    return node;
+            }
+            return nullptr;
+        }
+
+        // Get slot of 'key' in shape, return -1 if key is not in shape.
+        int FindSlot(const Value &key) const
+        {
+            return key.type_ == ValueT_String ? shape_->FindSlot(key.str_) : -1;
+        }
+
+        // Add string 'key' with 'value' to shape, return slot of the key,
+        // or -1 when the key can not be added and table is converted to
+        // hash table.
+        int AddShapeKey(const Value &key, const Value &value);
+
+        // Move keys of shape to hash table, table has no shape any more.
+        void ConvertShapeToHash();
+
+        // Get next slot of shape which value is not nil from slot 'index'
+        // of the iteration, and remember the slot.
+        bool NextIterateSlot(std::size_t index, Value &key, Value &value);
+
+        // Rehash the hash table, make it can hold one more key 'key'.
+        // Array part grows to hold the integer keys in hash table first,
+        // when more than half of the grown array is used.
+        void Rehash(const Value &key);
+
+        // Compute the largest array size of power of 2 which is more
+        // than half used by array part, integer keys in hash table and
+        // 'key', return ArraySize() when array part should not grow.
+        std::size_t ComputeArraySize(const Value &key) const;
+
+        // Grow array part to 'size', and move keys of hash table which fit
+        // with array to it in one pass. Trailing nils of the new range are
+        // not kept.
+        void GrowArray(std::size_t size);
+
+        // Resize the hash table to hold 'count' keys at least, 'count'
+        // must be not less than the count of keys in hash table.
+        void ResizeHash(std::size_t count);
+
+        // Return the count of keys which value is not nil in hash table.
+        std::size_t HashKeyCount() const;
+
+        // Get next node which value is not nil from node 'index', return
+        // nullptr if there is no node any more.
+        Node * NextNode(std::size_t index) const;
+
+        // Get next node of the iteration, and remember the node index.
+        bool NextIterateNode(std::size_t index, Value &key, Value &value);
 
         // Combine AppendToArray and MergeFromHashToArray
         void AppendAndMergeFromHashToArray(const Value &value);
@@ -64,16 +332,44 @@ namespace luna
         // Append value to array.
         void AppendToArray(const Value &value);
 
+        // New array part when it is not existed.
+        void EnsureArray();
+
         // Try to move values from hash to array which keys start from
         // ArraySize() + 1
         void MergeFromHashToArray();
 
+        // Erase number keys of range ['begin', 'end') from hash table, keys
+        // which become array indexes must not be in hash table any more.
+        void EraseHashKeys(std::size_t begin, std::size_t end);
+
+        // Return true when there are number keys in hash table.
+        bool HasNumberKeys() const { return hash_ && hash_->number_keys_ > 0; }
+
+        // Return false when key of 'node' may be dead, which is the key
+        // of removed entry of weak table
+        bool IsKeyAlive(const Node &node) const
+        {
+            return weak_mode_ == WeakMode_None || !node.value_.IsNil() ||
+                   node.key_.type_ == ValueT_String;
+        }
+
+        // Return true when 'value' is a weak reference of weak table
+        static bool IsWeakRef(const Value &value)
+        { return value.IsGCObject() && value.type_ != ValueT_String; }
+
         // Move hash table key-value pair to array which key is number and key
         // fit with array, return true if move success.
         bool MoveHashToArray(const Value &key);
 
         std::unique_ptr<Array> array_;              // array part of table
         std::unique_ptr<Hash> hash_;                // hash table part of table
+        std::unique_ptr<Array> slots_;              // values of shape slots
+        Shape *shape_;                              // shape of slots, no hash table when it is not null
+        ShapeTree *shapes_;                         // shapes shared with other tables
+        std::size_t iterate_index_;                 // node or slot index of last iterated key
+        unsigned int weak_mode_;                    // WeakMode of table
+        GCMemory *memory_;                          // memory accounting of GC
     };
 } // namespace luna
 
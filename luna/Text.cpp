@@ -0,0 +1,245 @@
+#include "Text.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define LUNA_TEXT_VECTOR
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define LUNA_TEXT_VECTOR
+#endif
+
+namespace
+{
+    const std::size_t kVectorSize = 16;
+
+    inline bool InRange(unsigned char c, unsigned char lo, unsigned char hi)
+    {
+        return static_cast<unsigned char>(c - lo) <= hi - lo;
+    }
+
+    inline bool IsDigit(unsigned char c)
+    {
+        return InRange(c, '0', '9');
+    }
+
+    inline bool IsHexDigit(unsigned char c)
+    {
+        return IsDigit(c) || InRange(c | 0x20, 'a', 'f');
+    }
+
+    inline bool IsIdChar(unsigned char c)
+    {
+        return IsDigit(c) || InRange(c | 0x20, 'a', 'z') || c == '_';
+    }
+
+    inline char Lower(char c)
+    {
+        return InRange(c, 'A', 'Z') ? c | 0x20 : c;
+    }
+
+    inline char Upper(char c)
+    {
+        return InRange(c, 'a', 'z') ? c ^ 0x20 : c;
+    }
+
+#if defined(__SSE2__)
+    typedef __m128i Vector;
+
+    inline Vector Load(const char *p)
+    {
+        return _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    }
+
+    inline void Store(char *p, Vector v)
+    {
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(p), v);
+    }
+
+    inline Vector Splat(int c)
+    {
+        return _mm_set1_epi8(static_cast<char>(c));
+    }
+
+    inline Vector Or(Vector a, Vector b) { return _mm_or_si128(a, b); }
+    inline Vector And(Vector a, Vector b) { return _mm_and_si128(a, b); }
+    inline Vector Xor(Vector a, Vector b) { return _mm_xor_si128(a, b); }
+    inline Vector Equal(Vector a, Vector b) { return _mm_cmpeq_epi8(a, b); }
+
+    // Bytes in [lo, hi] are all ones, shift the range to the bottom of
+    // signed bytes, then one signed compare checks both bounds
+    inline Vector InRange(Vector v, int lo, int hi)
+    {
+        auto shifted = _mm_add_epi8(v, Splat(-128 - lo));
+        return _mm_cmplt_epi8(shifted, Splat(-128 + hi - lo + 1));
+    }
+
+    inline Vector ReverseBytes(Vector v)
+    {
+        // Reverse dwords, then words in dwords, then bytes in words
+        v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+        v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    }
+
+    // Index of the first byte of 'mask' which is not all ones, or 16
+    inline std::size_t FirstMiss(Vector mask)
+    {
+        unsigned int misses = ~_mm_movemask_epi8(mask) & 0xFFFF;
+        return misses ? __builtin_ctz(misses) : kVectorSize;
+    }
+#elif defined(__ARM_NEON)
+    typedef uint8x16_t Vector;
+
+    inline Vector Load(const char *p)
+    {
+        return vld1q_u8(reinterpret_cast<const uint8_t *>(p));
+    }
+
+    inline void Store(char *p, Vector v)
+    {
+        vst1q_u8(reinterpret_cast<uint8_t *>(p), v);
+    }
+
+    inline Vector Splat(int c)
+    {
+        return vdupq_n_u8(static_cast<uint8_t>(c));
+    }
+
+    inline Vector Or(Vector a, Vector b) { return vorrq_u8(a, b); }
+    inline Vector And(Vector a, Vector b) { return vandq_u8(a, b); }
+    inline Vector Xor(Vector a, Vector b) { return veorq_u8(a, b); }
+    inline Vector Equal(Vector a, Vector b) { return vceqq_u8(a, b); }
+
+    inline Vector InRange(Vector v, int lo, int hi)
+    {
+        return vcleq_u8(vsubq_u8(v, Splat(lo)), Splat(hi - lo));
+    }
+
+    inline Vector ReverseBytes(Vector v)
+    {
+        v = vrev64q_u8(v);
+        return vextq_u8(v, v, 8);
+    }
+
+    inline std::size_t FirstMiss(Vector mask)
+    {
+        // Narrow each byte of mask into 4 bits
+        auto nibbles = vshrn_n_u16(vreinterpretq_u16_u8(mask), 4);
+        uint64_t misses = ~vget_lane_u64(vreinterpret_u64_u8(nibbles), 0);
+        return misses ? __builtin_ctzll(misses) >> 2 : kVectorSize;
+    }
+#endif
+
+#ifdef LUNA_TEXT_VECTOR
+    inline Vector IsDigit(Vector v)
+    {
+        return InRange(v, '0', '9');
+    }
+
+    inline Vector IsHexDigit(Vector v)
+    {
+        return Or(IsDigit(v), InRange(Or(v, Splat(0x20)), 'a', 'f'));
+    }
+
+    inline Vector IsIdChar(Vector v)
+    {
+        auto alpha = InRange(Or(v, Splat(0x20)), 'a', 'z');
+        return Or(Or(IsDigit(v), alpha), Equal(v, Splat('_')));
+    }
+
+    inline Vector Lower(Vector v)
+    {
+        return Or(v, And(InRange(v, 'A', 'Z'), Splat(0x20)));
+    }
+
+    inline Vector Upper(Vector v)
+    {
+        return Xor(v, And(InRange(v, 'a', 'z'), Splat(0x20)));
+    }
+#endif
+
+    // Count leading bytes of 's' which are accepted by 'is_char', vector
+    // version 'is_chars' checks 16 bytes each step
+    template<typename IsChar, typename IsChars>
+    std::size_t Scan(const char *s, std::size_t len,
+                     IsChar is_char, IsChars is_chars)
+    {
+        std::size_t i = 0;
+#ifdef LUNA_TEXT_VECTOR
+        for (; i + kVectorSize <= len; i += kVectorSize)
+        {
+            auto miss = FirstMiss(is_chars(Load(s + i)));
+            if (miss < kVectorSize)
+                return i + miss;
+        }
+#else
+        (void)is_chars;
+#endif
+        while (i < len && is_char(static_cast<unsigned char>(s[i])))
+            ++i;
+        return i;
+    }
+} // namespace
+
+namespace luna
+{
+    void LowerCase(char *dst, const char *src, std::size_t len)
+    {
+        std::size_t i = 0;
+#ifdef LUNA_TEXT_VECTOR
+        for (; i + kVectorSize <= len; i += kVectorSize)
+            Store(dst + i, Lower(Load(src + i)));
+#endif
+        for (; i < len; ++i)
+            dst[i] = Lower(src[i]);
+    }
+
+    void UpperCase(char *dst, const char *src, std::size_t len)
+    {
+        std::size_t i = 0;
+#ifdef LUNA_TEXT_VECTOR
+        for (; i + kVectorSize <= len; i += kVectorSize)
+            Store(dst + i, Upper(Load(src + i)));
+#endif
+        for (; i < len; ++i)
+            dst[i] = Upper(src[i]);
+    }
+
+    void Reverse(char *dst, const char *src, std::size_t len)
+    {
+        std::size_t i = 0;
+#ifdef LUNA_TEXT_VECTOR
+        for (; i + kVectorSize <= len; i += kVectorSize)
+            Store(dst + i, ReverseBytes(Load(src + len - i - kVectorSize)));
+#endif
+        for (; i < len; ++i)
+            dst[i] = src[len - 1 - i];
+    }
+
+#ifdef LUNA_TEXT_VECTOR
+#define VECTOR_PREDICATE(name) [](Vector v) { return name(v); }
+#else
+#define VECTOR_PREDICATE(name) 0
+#endif
+
+    std::size_t ScanIdentifier(const char *s, std::size_t len)
+    {
+        return Scan(s, len, [](unsigned char c) { return IsIdChar(c); },
+                    VECTOR_PREDICATE(IsIdChar));
+    }
+
+    std::size_t ScanDigits(const char *s, std::size_t len)
+    {
+        return Scan(s, len, [](unsigned char c) { return IsDigit(c); },
+                    VECTOR_PREDICATE(IsDigit));
+    }
+
+    std::size_t ScanHexDigits(const char *s, std::size_t len)
+    {
+        return Scan(s, len, [](unsigned char c) { return IsHexDigit(c); },
+                    VECTOR_PREDICATE(IsHexDigit));
+    }
+
+#undef VECTOR_PREDICATE
+} // namespace luna
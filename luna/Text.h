@@ -0,0 +1,34 @@
+#ifndef TEXT_H
+#define TEXT_H
+
+#include <cstddef>
+
+namespace luna
+{
+    // Byte kernels of ASCII text shared by string library and lexer, they
+    // process 16 bytes each step with SSE2 or NEON when the target has
+    // them, and fall back to scalar loops
+
+    // Convert 'len' bytes of 'src' to lower case into 'dst', 'dst' may
+    // be 'src'
+    void LowerCase(char *dst, const char *src, std::size_t len);
+
+    // Convert 'len' bytes of 'src' to upper case into 'dst', 'dst' may
+    // be 'src'
+    void UpperCase(char *dst, const char *src, std::size_t len);
+
+    // Write 'len' bytes of 'src' into 'dst' in reverse order, 'dst' and
+    // 'src' must not overlap
+    void Reverse(char *dst, const char *src, std::size_t len);
+
+    // Count of leading identifier characters [A-Za-z0-9_] of 's'
+    std::size_t ScanIdentifier(const char *s, std::size_t len);
+
+    // Count of leading decimal digits of 's'
+    std::size_t ScanDigits(const char *s, std::size_t len);
+
+    // Count of leading hexadecimal digits of 's'
+    std::size_t ScanHexDigits(const char *s, std::size_t len);
+} // namespace luna
+
+#endif // TEXT_H
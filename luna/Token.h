@@ -30,8 +30,9 @@ namespace luna
         int line_;                  // token line number in module
         int column_;                // token column number at 'line_'
         int token_;                 // token value
+        int offset_;                // offset of token in lexed buffer
 
-        TokenDetail() : str_(nullptr), module_(nullptr), line_(0), column_(0), token_(Token_EOF) { }
+        TokenDetail() : str_(nullptr), module_(nullptr), line_(0), column_(0), token_(Token_EOF), offset_(0) { }
     };
 
     std::string GetTokenStr(const TokenDetail &t);
@@ -0,0 +1,51 @@
+#include "TypedArray.h"
+#include <math.h>
+#include <stdlib.h>
+#include <new>
+
+namespace luna
+{
+    TypedArray::TypedArray(TypedArrayT type, std::size_t size)
+        : type_(type), size_(size),
+          data_(calloc(size ? size : 1, ElementSize(type)))
+    {
+        if (!data_)
+            throw std::bad_alloc();
+    }
+
+    TypedArray::~TypedArray()
+    {
+        free(data_);
+    }
+
+    std::size_t TypedArray::ElementSize(TypedArrayT type)
+    {
+        switch (type)
+        {
+            case TypedArrayT_Float64: return sizeof(double);
+            case TypedArrayT_Int32: return sizeof(int32_t);
+            default: return sizeof(uint8_t);
+        }
+    }
+
+    const char * TypedArray::TypeName(TypedArrayT type)
+    {
+        switch (type)
+        {
+            case TypedArrayT_Float64: return "float64";
+            case TypedArrayT_Int32: return "int32";
+            default: return "byte";
+        }
+    }
+
+    int32_t TypedArray::WrapInt32(double num)
+    {
+        if (!isfinite(num))
+            return 0;
+
+        auto wrapped = fmod(trunc(num), 4294967296.0);
+        if (wrapped < 0.0)
+            wrapped += 4294967296.0;
+        return static_cast<int32_t>(static_cast<uint32_t>(wrapped));
+    }
+} // namespace luna
@@ -0,0 +1,119 @@
+#ifndef TYPED_ARRAY_H
+#define TYPED_ARRAY_H
+
+#include "Value.h"
+#include <cstddef>
+#include <stdint.h>
+
+namespace luna
+{
+    enum TypedArrayT
+    {
+        TypedArrayT_Float64,
+        TypedArrayT_Int32,
+        TypedArrayT_Byte,
+    };
+
+    // Numbers stored unboxed and contiguous, user data holds it, and VM
+    // indexes it with number keys directly. Elements of Int32 and Byte
+    // arrays wrap around as integers when numbers are stored.
+    class TypedArray
+    {
+    public:
+        // All 'size' elements are 0
+        TypedArray(TypedArrayT type, std::size_t size);
+        ~TypedArray();
+
+        TypedArray(const TypedArray&) = delete;
+        void operator = (const TypedArray&) = delete;
+
+        static std::size_t ElementSize(TypedArrayT type);
+        static const char * TypeName(TypedArrayT type);
+
+        TypedArrayT GetType() const { return type_; }
+        std::size_t GetSize() const { return size_; }
+        std::size_t GetElementSize() const { return ElementSize(type_); }
+
+        // Raw memory of GetSize() * GetElementSize() bytes
+        void * GetData() { return data_; }
+        const void * GetData() const { return data_; }
+
+        // Get number of element 'i' which starts from 0
+        double GetNumber(std::size_t i) const
+        {
+            switch (type_)
+            {
+                case TypedArrayT_Float64: return float64_[i];
+                case TypedArrayT_Int32: return int32_[i];
+                default: return byte_[i];
+            }
+        }
+
+        // Set element 'i' which starts from 0
+        void SetNumber(std::size_t i, double num)
+        {
+            switch (type_)
+            {
+                case TypedArrayT_Float64: float64_[i] = num; break;
+                case TypedArrayT_Int32: int32_[i] = ToInt32(num); break;
+                default: byte_[i] = static_cast<uint8_t>(ToInt32(num)); break;
+            }
+        }
+
+        // Get element by 'index' which starts from 1, return nil when
+        // 'index' is not an integer in [1, GetSize()]
+        Value GetValue(double index) const
+        {
+            std::size_t i = 0;
+            if (ToOffset(index, i))
+                return Value(GetNumber(i));
+            return Value();
+        }
+
+        // Set element by 'index' which starts from 1, return false when
+        // 'index' is not an integer in [1, GetSize()]
+        bool SetValue(double index, double num)
+        {
+            std::size_t i = 0;
+            if (!ToOffset(index, i))
+                return false;
+            SetNumber(i, num);
+            return true;
+        }
+
+        // Convert 'num' to integer modulo 2^32 after truncation, NaN and
+        // infinity are 0
+        static int32_t ToInt32(double num)
+        {
+            if (num > -2147483649.0 && num < 2147483648.0)
+                return static_cast<int32_t>(num);
+            return WrapInt32(num);
+        }
+
+    private:
+        static int32_t WrapInt32(double num);
+
+        bool ToOffset(double index, std::size_t &i) const
+        {
+            if (!(index >= 1.0 && index <= static_cast<double>(size_)))
+                return false;
+            i = static_cast<std::size_t>(index);
+            if (static_cast<double>(i) != index)
+                return false;
+            --i;
+            return true;
+        }
+
+        TypedArrayT type_;
+        std::size_t size_;
+        union
+        {
+            void *data_;
+            double *float64_;
+            int32_t *int32_;
+            uint8_t *byte_;
+        };
+    };
+} // namespace luna
+
+#endif // TYPED_ARRAY_H
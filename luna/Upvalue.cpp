@@ -6,7 +6,9 @@ namespace luna
     {
         if (v->Visit(this))
         {
-            value_.Accept(v);
+            value_->Accept(v);
+            if (owner_)
+                owner_->Accept(v);
         }
     }
 } // namespace luna
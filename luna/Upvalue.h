@@ -6,19 +6,68 @@
 
 namespace luna
 {
+    // Upvalue is open when it refers to a register of a living stack
+    // frame, and it is closed when the scope of the register exits, then
+    // it holds the value of the register by itself.
     class Upvalue : public GCObject
     {
     public:
+        Upvalue() : value_(&closed_value_), next_(nullptr), owner_(nullptr) { }
+
         virtual void Accept(GCObjectVisitor *v);
 
+        // Pass the value and the owner to 'marker' of GC
+        template<typename Marker>
+        void Trace(Marker &marker) const
+        {
+            marker.MarkValue(*value_);
+            if (owner_)
+                marker.MarkObject(owner_);
+        }
+
         void SetValue(const Value &value)
-        { value_ = value; }
+        { *value_ = value; }
 
         Value * GetValue()
-        { return &value_; }
+        { return value_; }
+
+        bool IsOpen() const
+        { return value_ != &closed_value_; }
+
+        // Refer to register 'reg', 'next' is the next open upvalue,
+        // 'owner' is the handle of coroutine which the stack belongs to
+        void Open(Value *reg, Upvalue *next, GCObject *owner)
+        { value_ = reg; next_ = next; owner_ = owner; }
+
+        // Copy the value of register into upvalue
+        void Close()
+        {
+            closed_value_ = *value_;
+            value_ = &closed_value_;
+            next_ = nullptr;
+            owner_ = nullptr;
+        }
+
+        // Refer to the new address of register after stack grows
+        void Relocate(Value *reg)
+        { value_ = reg; }
+
+        Upvalue * GetNext() const
+        { return next_; }
+
+        void SetNext(Upvalue *next)
+        { next_ = next; }
 
     private:
-        Value value_;
+        // Points to register when upvalue is open, otherwise
+        // points to closed_value_
+        Value *value_;
+        Value closed_value_;
+        // Next open upvalue which refers to a lower register
+        Upvalue *next_;
+        // Handle of the suspended coroutine is alive while its open
+        // upvalues are, so they are collected together
+        GCObject *owner_;
     };
 } // namespace luna
 
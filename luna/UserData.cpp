@@ -1,4 +1,13 @@
 #include "UserData.h"
+#include "TypedArray.h"
+
+namespace
+{
+    void DeleteTypedArray(void *data)
+    {
+        delete reinterpret_cast<luna::TypedArray *>(data);
+    }
+} // namespace
 
 namespace luna
 {
@@ -8,11 +17,21 @@ namespace luna
             destroyer_(user_data_);
     }
 
+    void UserData::SetTypedArray(TypedArray *array, Table *metatable)
+    {
+        Set(array, metatable);
+        typed_array_ = array;
+        destroyer_ = DeleteTypedArray;
+    }
+
     void UserData::Accept(GCObjectVisitor *v)
     {
         if (v->Visit(this))
         {
-            metatable_->Accept(v);
+            if (metatable_)
+                metatable_->Accept(v);
+            if (tracer_)
+                tracer_(user_data_, v);
         }
     }
 } // namespace luna
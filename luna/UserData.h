@@ -6,32 +6,62 @@
 
 namespace luna
 {
+    class TypedArray;
+
     class UserData : public GCObject
     {
     public:
         typedef void (*Destroyer)(void *);
+        typedef void (*Tracer)(void *, GCObjectVisitor *);
 
         UserData() = default;
         virtual ~UserData();
 
         virtual void Accept(GCObjectVisitor *v) final;
 
+        // Pass metatable and objects visited by tracer to 'marker' of GC
+        template<typename Marker>
+        void Trace(Marker &marker) const
+        {
+            if (metatable_)
+                marker.MarkObject(metatable_);
+            if (tracer_)
+            {
+                MarkVisitor<Marker> visitor(marker);
+                tracer_(user_data_, &visitor);
+            }
+        }
+
         void Set(void *user_data, Table *metatable)
         {
             user_data_ = user_data;
             metatable_ = metatable;
         }
 
+        // Hold 'array', which is deleted when user data destroy
+        void SetTypedArray(TypedArray *array, Table *metatable);
+
         void SetDestroyer(Destroyer destroyer)
         {
             destroyer_ = destroyer;
         }
 
+        // Tracer visits GC objects referred by user data
+        void SetTracer(Tracer tracer)
+        {
+            tracer_ = tracer;
+        }
+
         void MarkDestroyed()
         {
             destroyed_ = true;
         }
 
+        bool IsDestroyed() const
+        {
+            return destroyed_;
+        }
+
         void * GetData() const
         {
             return user_data_;
@@ -42,13 +72,23 @@ namespace luna
             return metatable_;
         }
 
+        // Typed array held by user data, or nullptr
+        TypedArray * GetTypedArray() const
+        {
+            return typed_array_;
+        }
+
     private:
         // Point to user data
         void *user_data_ = nullptr;
         // Metatable of user data
         Table *metatable_ = nullptr;
+        // Same as 'user_data_' when user data is a typed array
+        TypedArray *typed_array_ = nullptr;
         // User data destroyer, call it when user data destroy
         Destroyer destroyer_ = nullptr;
+        // User data tracer, call it when user data is traced by GC
+        Tracer tracer_ = nullptr;
         // Whether user data destroyed
         bool destroyed_ = false;
     };
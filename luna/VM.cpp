@@ -2,8 +2,10 @@
 #include "State.h"
 #include "Table.h"
 #include "UserData.h"
+#include "TypedArray.h"
 #include "Function.h"
 #include "Exception.h"
+#include "Number.h"
 #include <assert.h>
 #include <math.h>
 
@@ -12,12 +14,9 @@ namespace
     std::string NumberToStr(luna::Value *num)
     {
         assert(num->type_ == luna::ValueT_Number);
-        char temp[64];
-        if (floor(num->num_) == num->num_)
-            snprintf(temp, sizeof(temp), "%lld", static_cast<long long>(num->num_));
-        else
-            snprintf(temp, sizeof(temp), "%g", num->num_);
-        return temp;
+        char temp[luna::kNumberBufferSize];
+        auto len = luna::FormatNumber(num->num_, temp);
+        return std::string(temp, len);
     }
 } // namespace
 
@@ -27,14 +26,88 @@ namespace luna
 #define GET_REGISTER_A(i)       (call->register_ + Instruction::GetParamA(i))
 #define GET_REGISTER_B(i)       (call->register_ + Instruction::GetParamB(i))
 #define GET_REGISTER_C(i)       (call->register_ + Instruction::GetParamC(i))
+#define GET_CONST_B(i)          (proto->GetConstValue(Instruction::GetParamB(i)))
+#define GET_CONST_C(i)          (proto->GetConstValue(Instruction::GetParamC(i)))
 #define GET_UPVALUE_B(i)        (cl->GetUpvalue(Instruction::GetParamB(i)))
-#define GET_REAL_VALUE(a)       (a->type_ == ValueT_Upvalue ? a->upvalue_->GetValue() : a)
-
+#define GET_INLINE_CACHE()                                      \
+    (*proto->GetInlineCache(call->instruction_ - proto->GetOpCodes() - 1))
 #define GET_REGISTER_ABC(i)                                 \
     a = GET_REGISTER_A(i);                                  \
     b = GET_REGISTER_B(i);                                  \
     c = GET_REGISTER_C(i);
 
+#define GET_REGISTER_AB_CONST_C(i)                          \
+    a = GET_REGISTER_A(i);                                  \
+    b = GET_REGISTER_B(i);                                  \
+    c = GET_CONST_C(i);
+
+// Operand B is const index when operand C is 1, otherwise it is register
+#define GET_REGISTER_A_OPERAND_B(i)                         \
+    a = GET_REGISTER_A(i);                                  \
+    b = Instruction::GetParamC(i) ?                         \
+        proto->GetConstValue(Instruction::GetParamB(i)) :   \
+        GET_REGISTER_B(i);
+
+// Threaded dispatch needs the labels as values extension of GCC and clang,
+// other compilers (e.g. MSVC) fall back to the switch dispatch.
+#if defined(LUNA_USE_COMPUTED_GOTO) && (defined(__GNUC__) || defined(__clang__))
+#define LUNA_COMPUTED_GOTO
+#endif
+
+// Frame returns to VM::Execute which enters the machine code of the
+// function from current instruction when the function is compiled
+#ifdef LUNA_JIT
+#define VM_JIT_RETURN()                                     \
+    do {                                                    \
+        if (!Hooked && IsJitReady(proto))                   \
+            return ;                                        \
+    } while (0)
+#else
+#define VM_JIT_RETURN()
+#endif // LUNA_JIT
+
+// GC safepoints are only the instructions which allocate GCObjects,
+// call and return, and backward jumps, so the collection is still bounded
+// by the allocation, and no GC check on the other instructions.
+#define VM_JUMP(i)                                          \
+    do {                                                    \
+        int diff = Instruction::GetParamsBx(i);             \
+        call->instruction_ += -1 + diff;                    \
+        if (diff <= 0)                                      \
+        {                                                   \
+            state_->CheckRunGC();                           \
+            VM_JIT_RETURN();                                \
+        }                                                   \
+    } while (0)
+
+// Call hooks of instruction fetched, hook may call functions which
+// reallocate the stack frames
+#define VM_HOOK_INSTRUCTION()                                       \
+    do {                                                            \
+        if (Hooked && (state_->hook_mask_ &                         \
+                       (HookMask_Line | HookMask_Count)))           \
+        {                                                           \
+            HookInstruction(call->instruction_ - 1, hook_pc, hook_line); \
+            call = &state_->calls_.back();                          \
+        }                                                           \
+    } while (0)
+
+#define VM_HOOK_RETURN()                                            \
+    do {                                                            \
+        if (Hooked)                                                 \
+        {                                                           \
+            HookFrame(HookEvent_Return);                            \
+            call = &state_->calls_.back();                          \
+        }                                                           \
+    } while (0)
+
+// Count every instruction when opcode stats are compiled in
+#ifdef LUNA_OPCODE_STATS
+#define VM_COUNT_OPCODE(i)  state_->opcode_stats_->Count(Instruction::GetOpCode(i))
+#else
+#define VM_COUNT_OPCODE(i)
+#endif // LUNA_OPCODE_STATS
+
 #define GET_CALLINFO_AND_PROTO()                            \
     assert(!state_->calls_.empty());                        \
     auto call = &state_->calls_.back();                     \
@@ -49,16 +122,121 @@ namespace luna
     {
         assert(!state_->calls_.empty());
 
-        while (!state_->calls_.empty())
+        // Execute until the frame which starts execution returns, frames
+        // below it belong to the caller, e.g. c function calls DoModule.
+        // It returns early when the running coroutine yields.
+        auto depth = state_->calls_.size();
+        try
+        {
+            // Hooks are checked when entering each frame, the variant
+            // without hooks runs when no hook is set. Machine code of
+            // compiled functions runs until an instruction which it
+            // leaves to the interpreter, then the interpreter continues.
+            while (state_->calls_.size() >= depth && !state_->yielding_)
+            {
+                if (state_->IsHookActive())
+                    ExecuteFrame<true>();
+#ifdef LUNA_JIT
+                else if (RunJit(depth))
+                    continue;
+#endif // LUNA_JIT
+                else
+                    ExecuteFrame<false>();
+            }
+        } catch (const CallCFuncException &e)
+        {
+            // Get position of the call when error reported, c function
+            // has no frame, so current frame is the caller
+            auto pos = GetCFunctionErrorPos();
+            throw RuntimeException(pos.first, pos.second, e.What().c_str());
+        } catch (const StackOverflowException &e)
+        {
+            auto pos = GetCurrentInstructionPos();
+            throw RuntimeException(pos.first, pos.second, e.What().c_str());
+        }
+    }
+
+    inline void VM::GetTable(const Value *t, const Value *key, Value *dst)
+    {
+        if (t->type_ == ValueT_Table)
+            *dst = t->table_->GetValue(*key);
+        else
+            GetUserData(t, key, dst);
+    }
+
+    inline void VM::SetTable(const Value *t, const Value *key, const Value *value)
+    {
+        if (t->type_ == ValueT_Table)
+        {
+            t->table_->SetValue(*key, *value);
+            CHECK_BARRIER_KEY_VALUE(state_->GetGC(), t->table_, *key, *value);
+        }
+        else
+            SetUserData(t, key, value);
+    }
+
+    inline void VM::GetField(const Value *t, const Value *key, Value *dst,
+                             unsigned int &cache)
+    {
+        if (t->type_ == ValueT_Table)
+            *dst = t->table_->GetValueBySlot(*key, cache);
+        else
+            GetUserDataField(t, key, dst, cache);
+    }
+
+    inline void VM::SetField(const Value *t, const Value *key, const Value *value,
+                             unsigned int &cache)
+    {
+        if (t->type_ == ValueT_Table)
         {
-            // If current stack frame is a frame of a c function,
-            // do not continue execute instructions, just return
-            if (state_->calls_.back().func_->type_ == ValueT_CFunction)
-                return ;
-            ExecuteFrame();
+            t->table_->SetValueBySlot(*key, *value, cache);
+            CHECK_BARRIER_KEY_VALUE(state_->GetGC(), t->table_, *key, *value);
         }
+        else
+            SetUserDataField(t, key, value, cache);
+    }
+
+    inline void VM::NewTable(Value *a, Instruction i)
+    {
+        a->table_ = state_->NewTable();
+        a->type_ = ValueT_Table;
+        if (Instruction::GetParamB(i) || Instruction::GetParamC(i))
+            a->table_->Reserve(
+                Instruction::ByteToSize(Instruction::GetParamB(i)),
+                Instruction::ByteToSize(Instruction::GetParamC(i)));
     }
 
+    inline void VM::Len(Value *a)
+    {
+        if (a->type_ == ValueT_Table)
+            a->num_ = a->table_->ArraySize();
+        else if (a->type_ == ValueT_String)
+            a->num_ = a->str_->GetLength();
+        else if (a->type_ == ValueT_UserData &&
+                 a->user_data_->GetTypedArray())
+            a->num_ = a->user_data_->GetTypedArray()->GetSize();
+        else
+            ReportTypeError(a, "length of");
+        a->type_ = ValueT_Number;
+    }
+
+#ifdef LUNA_JIT
+    inline bool VM::IsJitReady(Function *proto)
+    {
+        if (!state_->jit_enabled_)
+            return false;
+        if (proto->GetJitCode())
+            return true;
+        if (proto->AddJitCount() != kJitThreshold)
+            return false;
+
+        // Function which can not be compiled is not compiled again
+        proto->SetJitCode(JitCode::Compile(proto));
+        return proto->GetJitCode() != nullptr;
+    }
+#endif // LUNA_JIT
+
+    template<bool Hooked>
     void VM::ExecuteFrame()
     {
         CallInfo *call = &state_->calls_.back();
@@ -68,237 +246,557 @@ namespace luna
         Value *b = nullptr;
         Value *c = nullptr;
 
-        while (call->instruction_ < call->end_)
+        Instruction i;
+
+        // Last instruction hooked and its line, line event is called at
+        // the first instruction of new frame, and not called again for
+        // the line of the call instruction when the frame is resumed
+        const Instruction *hook_pc = nullptr;
+        int hook_line = -1;
+        if (Hooked)
         {
-            state_->CheckRunGC();
-            Instruction i = *call->instruction_++;
+            if (call->instruction_ == proto->GetOpCodes())
+            {
+                HookFrame(HookEvent_Call);
+                call = &state_->calls_.back();
+            }
+            else
+            {
+                hook_pc = call->instruction_ - 1;
+                hook_line = proto->GetInstructionLine(hook_pc - proto->GetOpCodes());
+            }
+        }
+
+#ifdef LUNA_OPCODE_STATS
+        state_->opcode_stats_->EnterFunction(proto);
+#endif // LUNA_OPCODE_STATS
 
-            switch (Instruction::GetOpCode(i)) {
-                case OpType_LoadNil:
+#ifdef LUNA_COMPUTED_GOTO
+        // Label table of threaded dispatch, indexed by OpType, so
+        // keep it in the same order as OpType.
+        static const void *const dispatch_table[] = {
+            &&Label_Default,
+            &&Label_OpType_LoadNil,
+            &&Label_OpType_FillNil,
+            &&Label_OpType_LoadBool,
+            &&Label_OpType_LoadInt,
+            &&Label_OpType_LoadConst,
+            &&Label_OpType_Move,
+            &&Label_OpType_GetUpvalue,
+            &&Label_OpType_SetUpvalue,
+            &&Label_OpType_GetGlobal,
+            &&Label_OpType_SetGlobal,
+            &&Label_OpType_Closure,
+            &&Label_OpType_Call,
+            &&Label_OpType_VarArg,
+            &&Label_OpType_Ret,
+            &&Label_OpType_JmpFalse,
+            &&Label_OpType_JmpTrue,
+            &&Label_OpType_JmpNil,
+            &&Label_OpType_Jmp,
+            &&Label_OpType_Neg,
+            &&Label_OpType_Not,
+            &&Label_OpType_Len,
+            &&Label_OpType_Add,
+            &&Label_OpType_Sub,
+            &&Label_OpType_Mul,
+            &&Label_OpType_Div,
+            &&Label_OpType_Pow,
+            &&Label_OpType_Mod,
+            &&Label_OpType_Concat,
+            &&Label_OpType_Less,
+            &&Label_OpType_Greater,
+            &&Label_OpType_Equal,
+            &&Label_OpType_UnEqual,
+            &&Label_OpType_LessEqual,
+            &&Label_OpType_GreaterEqual,
+            &&Label_OpType_AddK,
+            &&Label_OpType_SubK,
+            &&Label_OpType_MulK,
+            &&Label_OpType_DivK,
+            &&Label_OpType_PowK,
+            &&Label_OpType_ModK,
+            &&Label_OpType_LessK,
+            &&Label_OpType_GreaterK,
+            &&Label_OpType_EqualK,
+            &&Label_OpType_UnEqualK,
+            &&Label_OpType_LessEqualK,
+            &&Label_OpType_GreaterEqualK,
+            &&Label_OpType_JmpLess,
+            &&Label_OpType_JmpGreater,
+            &&Label_OpType_JmpEqual,
+            &&Label_OpType_JmpUnEqual,
+            &&Label_OpType_JmpLessEqual,
+            &&Label_OpType_JmpGreaterEqual,
+            &&Label_OpType_NewTable,
+            &&Label_OpType_SetTable,
+            &&Label_OpType_GetTable,
+            &&Label_OpType_SetField,
+            &&Label_OpType_GetField,
+            &&Label_OpType_ForPrep,
+            &&Label_OpType_ForLoop,
+            &&Label_OpType_SetList,
+            &&Label_OpType_TailCall,
+            &&Label_OpType_GetGlobalField,
+            &&Label_OpType_GetTableK,
+            &&Label_OpType_SetTableK,
+        };
+        static_assert(sizeof(dispatch_table) / sizeof(dispatch_table[0]) ==
+                      OpType_SetTableK + 1, "dispatch table does not match OpType");
+#define VM_CASE(op)         Label_##op
+#define VM_DEFAULT          Label_Default
+#define VM_BREAK                                                    \
+    do {                                                            \
+        if (call->instruction_ >= call->end_)                       \
+            goto frame_end;                                         \
+        i = *call->instruction_++;                                  \
+        assert(Instruction::GetOpCode(i) <= OpType_SetTableK);       \
+        VM_COUNT_OPCODE(i);                                         \
+        VM_HOOK_INSTRUCTION();                                      \
+        goto *dispatch_table[Instruction::GetOpCode(i)];            \
+    } while (0)
+#define VM_DISPATCH_BEGIN() VM_BREAK;
+#define VM_DISPATCH_END()
+#else
+#define VM_CASE(op)         case op
+#define VM_DEFAULT          default
+#define VM_BREAK            break
+#define VM_DISPATCH_BEGIN()                                         \
+    while (call->instruction_ < call->end_)                         \
+    {                                                               \
+        i = *call->instruction_++;                                  \
+        VM_COUNT_OPCODE(i);                                         \
+        VM_HOOK_INSTRUCTION();                                      \
+        switch (Instruction::GetOpCode(i)) {
+#define VM_DISPATCH_END()   } }
+#endif // LUNA_COMPUTED_GOTO
+
+            VM_DISPATCH_BEGIN()
+                VM_CASE(OpType_LoadNil):
                     a = GET_REGISTER_A(i);
-                    GET_REAL_VALUE(a)->SetNil();
-                    break;
-                case OpType_FillNil:
+                    a->SetNil();
+                    VM_BREAK;
+                VM_CASE(OpType_FillNil):
                     a = GET_REGISTER_A(i);
                     b = GET_REGISTER_B(i);
+                    if (Instruction::GetParamC(i))
+                        state_->CloseUpvalues(a);
                     while (a < b)
                     {
                         a->SetNil();
                         ++a;
                     }
-                    break;
-                case OpType_LoadBool:
+                    VM_BREAK;
+                VM_CASE(OpType_LoadBool):
                     a = GET_REGISTER_A(i);
-                    GET_REAL_VALUE(a)->SetBool(Instruction::GetParamB(i) ? true : false);
-                    break;
-                case OpType_LoadInt:
+                    a->SetBool(Instruction::GetParamB(i) ? true : false);
+                    VM_BREAK;
+                VM_CASE(OpType_LoadInt):
                     a = GET_REGISTER_A(i);
                     assert(call->instruction_ < call->end_);
                     a->num_ = (*call->instruction_++).opcode_;
                     a->type_ = ValueT_Number;
-                    break;
-                case OpType_LoadConst:
+                    VM_BREAK;
+                VM_CASE(OpType_LoadConst):
                     a = GET_REGISTER_A(i);
                     b = GET_CONST_VALUE(i);
-                    *GET_REAL_VALUE(a) = *b;
-                    break;
-                case OpType_Move:
+                    *a = *b;
+                    VM_BREAK;
+                VM_CASE(OpType_Move):
                     a = GET_REGISTER_A(i);
                     b = GET_REGISTER_B(i);
-                    *GET_REAL_VALUE(a) = *GET_REAL_VALUE(b);
-                    break;
-                case OpType_Call:
+                    *a = *b;
+                    VM_BREAK;
+                VM_CASE(OpType_Call):
                     a = GET_REGISTER_A(i);
+                    state_->CheckRunGC();
                     if (Call(a, i)) return ;
-                    break;
-                case OpType_GetUpvalue:
+                    // c function may call more functions, which would
+                    // reallocate the stack frames
+                    call = &state_->calls_.back();
+                    VM_JIT_RETURN();
+                    VM_BREAK;
+                VM_CASE(OpType_GetUpvalue):
                     a = GET_REGISTER_A(i);
                     b = GET_UPVALUE_B(i)->GetValue();
-                    *GET_REAL_VALUE(a) = *b;
-                    break;
-                case OpType_SetUpvalue:
-                    a = GET_REGISTER_A(i);
-                    b = GET_UPVALUE_B(i)->GetValue();
-                    *b = *a;
-                    break;
-                case OpType_GetGlobal:
+                    *a = *b;
+                    VM_BREAK;
+                VM_CASE(OpType_SetUpvalue):
+                    {
+                        a = GET_REGISTER_A(i);
+                        auto upvalue = GET_UPVALUE_B(i);
+                        upvalue->SetValue(*a);
+                        CHECK_BARRIER_VALUE(state_->GetGC(), upvalue, *a);
+                    }
+                    VM_BREAK;
+                VM_CASE(OpType_GetGlobal):
                     a = GET_REGISTER_A(i);
                     b = GET_CONST_VALUE(i);
-                    *GET_REAL_VALUE(a) = state_->global_.table_->GetValue(*b);
-                    break;
-                case OpType_SetGlobal:
+                    *a = state_->global_.table_->GetValueBySlot(
+                        *b, GET_INLINE_CACHE());
+                    VM_BREAK;
+                VM_CASE(OpType_SetGlobal):
                     a = GET_REGISTER_A(i);
                     b = GET_CONST_VALUE(i);
-                    state_->global_.table_->SetValue(*b, *a);
-                    break;
-                case OpType_Closure:
+                    state_->global_.table_->SetValueBySlot(*b, *a,
+                                                           GET_INLINE_CACHE());
+                    CHECK_BARRIER_KEY_VALUE(state_->GetGC(),
+                                            state_->global_.table_, *b, *a);
+                    VM_BREAK;
+                VM_CASE(OpType_Closure):
                     a = GET_REGISTER_A(i);
                     GenerateClosure(a, i);
-                    break;
-                case OpType_VarArg:
+                    state_->CheckRunGC();
+                    VM_BREAK;
+                VM_CASE(OpType_VarArg):
                     a = GET_REGISTER_A(i);
                     CopyVarArg(a, i);
-                    break;
-                case OpType_Ret:
+                    VM_BREAK;
+                VM_CASE(OpType_Ret):
+                    VM_HOOK_RETURN();
                     a = GET_REGISTER_A(i);
+                    state_->CheckRunGC();
                     return Return(a, i);
-                case OpType_JmpFalse:
+                VM_CASE(OpType_JmpFalse):
                     a = GET_REGISTER_A(i);
-                    if (GET_REAL_VALUE(a)->IsFalse())
-                        call->instruction_ += -1 + Instruction::GetParamsBx(i);
-                    break;
-                case OpType_JmpTrue:
+                    if (a->IsFalse())
+                        VM_JUMP(i);
+                    VM_BREAK;
+                VM_CASE(OpType_JmpTrue):
                     a = GET_REGISTER_A(i);
-                    if (!GET_REAL_VALUE(a)->IsFalse())
-                        call->instruction_ += -1 + Instruction::GetParamsBx(i);
-                    break;
-                case OpType_JmpNil:
+                    if (!a->IsFalse())
+                        VM_JUMP(i);
+                    VM_BREAK;
+                VM_CASE(OpType_JmpNil):
                     a = GET_REGISTER_A(i);
                     if (a->type_ == ValueT_Nil)
                         call->instruction_ += -1 + Instruction::GetParamsBx(i);
-                    break;
-                case OpType_Jmp:
-                    call->instruction_ += -1 + Instruction::GetParamsBx(i);
-                    break;
-                case OpType_Neg:
+                    VM_BREAK;
+                VM_CASE(OpType_Jmp):
+                    VM_JUMP(i);
+                    VM_BREAK;
+                VM_CASE(OpType_Neg):
                     a = GET_REGISTER_A(i);
                     CheckType(a, ValueT_Number, "neg");
                     a->num_ = -a->num_;
-                    break;
-                case OpType_Not:
+                    VM_BREAK;
+                VM_CASE(OpType_Not):
                     a = GET_REGISTER_A(i);
                     a->SetBool(a->IsFalse() ? true : false);
-                    break;
-                case OpType_Len:
+                    VM_BREAK;
+                VM_CASE(OpType_Len):
                     a = GET_REGISTER_A(i);
-                    if (a->type_ == ValueT_Table)
-                        a->num_ = a->table_->ArraySize();
-                    else if (a->type_ == ValueT_String)
-                        a->num_ = a->str_->GetLength();
-                    else
-                        ReportTypeError(a, "length of");
-                    a->type_ = ValueT_Number;
-                    break;
-                case OpType_Add:
+                    Len(a);
+                    VM_BREAK;
+                VM_CASE(OpType_Add):
                     GET_REGISTER_ABC(i);
                     CheckArithType(b, c, "add");
                     a->num_ = b->num_ + c->num_;
                     a->type_ = ValueT_Number;
-                    break;
-                case OpType_Sub:
+                    VM_BREAK;
+                VM_CASE(OpType_Sub):
                     GET_REGISTER_ABC(i);
                     CheckArithType(b, c, "sub");
                     a->num_ = b->num_ - c->num_;
                     a->type_ = ValueT_Number;
-                    break;
-                case OpType_Mul:
+                    VM_BREAK;
+                VM_CASE(OpType_Mul):
                     GET_REGISTER_ABC(i);
                     CheckArithType(b, c, "multiply");
                     a->num_ = b->num_ * c->num_;
                     a->type_ = ValueT_Number;
-                    break;
-                case OpType_Div:
+                    VM_BREAK;
+                VM_CASE(OpType_Div):
                     GET_REGISTER_ABC(i);
                     CheckArithType(b, c, "div");
                     a->num_ = b->num_ / c->num_;
                     a->type_ = ValueT_Number;
-                    break;
-                case OpType_Pow:
+                    VM_BREAK;
+                VM_CASE(OpType_Pow):
                     GET_REGISTER_ABC(i);
                     CheckArithType(b, c, "power");
                     a->num_ = pow(b->num_, c->num_);
                     a->type_ = ValueT_Number;
-                    break;
-                case OpType_Mod:
+                    VM_BREAK;
+                VM_CASE(OpType_Mod):
                     GET_REGISTER_ABC(i);
                     CheckArithType(b, c, "mod");
                     a->num_ = fmod(b->num_, c->num_);
                     a->type_ = ValueT_Number;
-                    break;
-                case OpType_Concat:
-                    GET_REGISTER_ABC(i);
-                    Concat(a, b, c);
-                    break;
-                case OpType_Less:
+                    VM_BREAK;
+                VM_CASE(OpType_Concat):
+                    a = GET_REGISTER_A(i);
+                    b = GET_REGISTER_B(i);
+                    Concat(a, b, Instruction::GetParamC(i));
+                    state_->CheckRunGC();
+                    VM_BREAK;
+                VM_CASE(OpType_Less):
                     GET_REGISTER_ABC(i);
                     CheckInequalityType(b, c, "compare(<)");
                     if (b->type_ == ValueT_Number)
                         a->SetBool(b->num_ < c->num_);
                     else
                         a->SetBool(*b->str_ < *c->str_);
-                    break;
-                case OpType_Greater:
+                    VM_BREAK;
+                VM_CASE(OpType_Greater):
                     GET_REGISTER_ABC(i);
                     CheckInequalityType(b, c, "compare(>)");
                     if (b->type_ == ValueT_Number)
                         a->SetBool(b->num_ > c->num_);
                     else
                         a->SetBool(*b->str_ > *c->str_);
-                    break;
-                case OpType_Equal:
+                    VM_BREAK;
+                VM_CASE(OpType_Equal):
                     GET_REGISTER_ABC(i);
                     a->SetBool(*b == *c);
-                    break;
-                case OpType_UnEqual:
+                    VM_BREAK;
+                VM_CASE(OpType_UnEqual):
                     GET_REGISTER_ABC(i);
                     a->SetBool(*b != *c);
-                    break;
-                case OpType_LessEqual:
+                    VM_BREAK;
+                VM_CASE(OpType_LessEqual):
                     GET_REGISTER_ABC(i);
                     CheckInequalityType(b, c, "compare(<=)");
                     if (b->type_ == ValueT_Number)
                         a->SetBool(b->num_ <= c->num_);
                     else
                         a->SetBool(*b->str_ <= *c->str_);
-                    break;
-                case OpType_GreaterEqual:
+                    VM_BREAK;
+                VM_CASE(OpType_GreaterEqual):
                     GET_REGISTER_ABC(i);
                     CheckInequalityType(b, c, "compare(>=)");
                     if (b->type_ == ValueT_Number)
                         a->SetBool(b->num_ >= c->num_);
                     else
                         a->SetBool(*b->str_ >= *c->str_);
-                    break;
-                case OpType_NewTable:
-                    a = GET_REGISTER_A(i);
-                    a->table_ = state_->NewTable();
-                    a->type_ = ValueT_Table;
-                    break;
-                case OpType_SetTable:
-                    GET_REGISTER_ABC(i);
-                    CheckTableType(a, b, "set", "to");
-                    if (a->type_ == ValueT_Table)
-                        a->table_->SetValue(*b, *c);
-                    else if (a->type_ == ValueT_UserData)
-                        a->user_data_->GetMetatable()->SetValue(*b, *c);
+                    VM_BREAK;
+                VM_CASE(OpType_AddK):
+                    GET_REGISTER_AB_CONST_C(i);
+                    CheckArithType(b, c, "add");
+                    a->num_ = b->num_ + c->num_;
+                    a->type_ = ValueT_Number;
+                    VM_BREAK;
+                VM_CASE(OpType_SubK):
+                    GET_REGISTER_AB_CONST_C(i);
+                    CheckArithType(b, c, "sub");
+                    a->num_ = b->num_ - c->num_;
+                    a->type_ = ValueT_Number;
+                    VM_BREAK;
+                VM_CASE(OpType_MulK):
+                    GET_REGISTER_AB_CONST_C(i);
+                    CheckArithType(b, c, "multiply");
+                    a->num_ = b->num_ * c->num_;
+                    a->type_ = ValueT_Number;
+                    VM_BREAK;
+                VM_CASE(OpType_DivK):
+                    GET_REGISTER_AB_CONST_C(i);
+                    CheckArithType(b, c, "div");
+                    a->num_ = b->num_ / c->num_;
+                    a->type_ = ValueT_Number;
+                    VM_BREAK;
+                VM_CASE(OpType_PowK):
+                    GET_REGISTER_AB_CONST_C(i);
+                    CheckArithType(b, c, "power");
+                    a->num_ = pow(b->num_, c->num_);
+                    a->type_ = ValueT_Number;
+                    VM_BREAK;
+                VM_CASE(OpType_ModK):
+                    GET_REGISTER_AB_CONST_C(i);
+                    CheckArithType(b, c, "mod");
+                    a->num_ = fmod(b->num_, c->num_);
+                    a->type_ = ValueT_Number;
+                    VM_BREAK;
+                VM_CASE(OpType_LessK):
+                    GET_REGISTER_AB_CONST_C(i);
+                    CheckInequalityType(b, c, "compare(<)");
+                    if (b->type_ == ValueT_Number)
+                        a->SetBool(b->num_ < c->num_);
                     else
-                        assert(0);
-                    break;
-                case OpType_GetTable:
-                    GET_REGISTER_ABC(i);
-                    CheckTableType(a, b, "get", "from");
-                    if (a->type_ == ValueT_Table)
-                        *c = a->table_->GetValue(*b);
-                    else if (a->type_ == ValueT_UserData)
-                        *c = a->user_data_->GetMetatable()->GetValue(*b);
+                        a->SetBool(*b->str_ < *c->str_);
+                    VM_BREAK;
+                VM_CASE(OpType_GreaterK):
+                    GET_REGISTER_AB_CONST_C(i);
+                    CheckInequalityType(b, c, "compare(>)");
+                    if (b->type_ == ValueT_Number)
+                        a->SetBool(b->num_ > c->num_);
                     else
-                        assert(0);
-                    break;
-                case OpType_ForInit:
+                        a->SetBool(*b->str_ > *c->str_);
+                    VM_BREAK;
+                VM_CASE(OpType_EqualK):
+                    GET_REGISTER_AB_CONST_C(i);
+                    a->SetBool(*b == *c);
+                    VM_BREAK;
+                VM_CASE(OpType_UnEqualK):
+                    GET_REGISTER_AB_CONST_C(i);
+                    a->SetBool(*b != *c);
+                    VM_BREAK;
+                VM_CASE(OpType_LessEqualK):
+                    GET_REGISTER_AB_CONST_C(i);
+                    CheckInequalityType(b, c, "compare(<=)");
+                    if (b->type_ == ValueT_Number)
+                        a->SetBool(b->num_ <= c->num_);
+                    else
+                        a->SetBool(*b->str_ <= *c->str_);
+                    VM_BREAK;
+                VM_CASE(OpType_GreaterEqualK):
+                    GET_REGISTER_AB_CONST_C(i);
+                    CheckInequalityType(b, c, "compare(>=)");
+                    if (b->type_ == ValueT_Number)
+                        a->SetBool(b->num_ >= c->num_);
+                    else
+                        a->SetBool(*b->str_ >= *c->str_);
+                    VM_BREAK;
+                VM_CASE(OpType_JmpLess):
+                    GET_REGISTER_A_OPERAND_B(i);
+                    CheckInequalityType(a, b, "compare(<)");
+                    i = *call->instruction_++;
+                    if (a->type_ == ValueT_Number ? !(a->num_ < b->num_) :
+                        !(*a->str_ < *b->str_))
+                        VM_JUMP(i);
+                    VM_BREAK;
+                VM_CASE(OpType_JmpGreater):
+                    GET_REGISTER_A_OPERAND_B(i);
+                    CheckInequalityType(a, b, "compare(>)");
+                    i = *call->instruction_++;
+                    if (a->type_ == ValueT_Number ? !(a->num_ > b->num_) :
+                        !(*a->str_ > *b->str_))
+                        VM_JUMP(i);
+                    VM_BREAK;
+                VM_CASE(OpType_JmpEqual):
+                    GET_REGISTER_A_OPERAND_B(i);
+                    i = *call->instruction_++;
+                    if (*a != *b)
+                        VM_JUMP(i);
+                    VM_BREAK;
+                VM_CASE(OpType_JmpUnEqual):
+                    GET_REGISTER_A_OPERAND_B(i);
+                    i = *call->instruction_++;
+                    if (*a == *b)
+                        VM_JUMP(i);
+                    VM_BREAK;
+                VM_CASE(OpType_JmpLessEqual):
+                    GET_REGISTER_A_OPERAND_B(i);
+                    CheckInequalityType(a, b, "compare(<=)");
+                    i = *call->instruction_++;
+                    if (a->type_ == ValueT_Number ? !(a->num_ <= b->num_) :
+                        !(*a->str_ <= *b->str_))
+                        VM_JUMP(i);
+                    VM_BREAK;
+                VM_CASE(OpType_JmpGreaterEqual):
+                    GET_REGISTER_A_OPERAND_B(i);
+                    CheckInequalityType(a, b, "compare(>=)");
+                    i = *call->instruction_++;
+                    if (a->type_ == ValueT_Number ? !(a->num_ >= b->num_) :
+                        !(*a->str_ >= *b->str_))
+                        VM_JUMP(i);
+                    VM_BREAK;
+                VM_CASE(OpType_NewTable):
+                    a = GET_REGISTER_A(i);
+                    NewTable(a, i);
+                    state_->CheckRunGC();
+                    VM_BREAK;
+                VM_CASE(OpType_SetTable):
                     GET_REGISTER_ABC(i);
-                    ForInit(a, b, c);
-                    break;
-                case OpType_ForStep:
+                    SetTable(a, b, c);
+                    VM_BREAK;
+                VM_CASE(OpType_GetTable):
                     GET_REGISTER_ABC(i);
-                    i = *call->instruction_++;
-                    if ((c->num_ > 0.0 && a->num_ > b->num_) ||
-                        (c->num_ <= 0.0 && a->num_ < b->num_))
+                    GetTable(a, b, c);
+                    VM_BREAK;
+                VM_CASE(OpType_SetField):
+                    a = GET_REGISTER_A(i);
+                    b = GET_CONST_B(i);
+                    c = GET_REGISTER_C(i);
+                    SetField(a, b, c, GET_INLINE_CACHE());
+                    VM_BREAK;
+                VM_CASE(OpType_GetField):
+                    a = GET_REGISTER_A(i);
+                    b = GET_CONST_B(i);
+                    c = GET_REGISTER_C(i);
+                    GetField(a, b, c, GET_INLINE_CACHE());
+                    VM_BREAK;
+                VM_CASE(OpType_ForPrep):
+                    a = GET_REGISTER_A(i);
+                    if (!ForPrep(a))
                         call->instruction_ += -1 + Instruction::GetParamsBx(i);
-                    break;
-                default:
-                    break;
-            }
-        }
+                    VM_BREAK;
+                VM_CASE(OpType_ForLoop):
+                    a = GET_REGISTER_A(i);
+                    // Loop state is the remaining count in integer mode,
+                    // otherwise it is the loop direction
+                    if (a[3].type_ == ValueT_Number)
+                    {
+                        if (a[3].num_ > 0.0)
+                        {
+                            a[3].num_ -= 1.0;
+                            a->num_ += a[2].num_;
+                            VM_JUMP(i);
+                        }
+                    }
+                    else
+                    {
+                        a->num_ += a[2].num_;
+                        if (a[3].bvalue_ ? a->num_ <= a[1].num_ : a->num_ >= a[1].num_)
+                            VM_JUMP(i);
+                    }
+                    VM_BREAK;
+                VM_CASE(OpType_SetList):
+                    a = GET_REGISTER_A(i);
+                    b = GET_REGISTER_B(i);
+                    assert(a->type_ == ValueT_Table);
+                    assert(call->instruction_ < call->end_);
+                    a->table_->SetArrayValues((*call->instruction_++).opcode_,
+                                              b, Instruction::GetParamC(i));
+                    CHECK_BARRIER(state_->GetGC(), a->table_);
+                    VM_BREAK;
+                VM_CASE(OpType_TailCall):
+                    a = GET_REGISTER_A(i);
+                    state_->CheckRunGC();
+                    if (TailCall(a, i)) return ;
+                    call = &state_->calls_.back();
+                    VM_BREAK;
+                VM_CASE(OpType_GetGlobalField):
+                    {
+                        // Global and field use the inline caches of this
+                        // instruction and the next one which is the key
+                        auto cache = proto->GetInlineCache(
+                            call->instruction_ - proto->GetOpCodes() - 1);
+                        a = GET_REGISTER_A(i);
+                        b = GET_CONST_VALUE(i);
+                        assert(call->instruction_ < call->end_);
+                        c = proto->GetConstValue(call->instruction_->opcode_);
+                        *a = state_->global_.table_->GetValueBySlot(*b, cache[0]);
+                        GetField(a, c, a, cache[1]);
+                        ++call->instruction_;
+                    }
+                    VM_BREAK;
+                VM_CASE(OpType_GetTableK):
+                    a = GET_REGISTER_A(i);
+                    b = GET_CONST_B(i);
+                    c = GET_REGISTER_C(i);
+                    GetTable(a, b, c);
+                    VM_BREAK;
+                VM_CASE(OpType_SetTableK):
+                    a = GET_REGISTER_A(i);
+                    b = GET_CONST_B(i);
+                    c = GET_REGISTER_C(i);
+                    SetTable(a, b, c);
+                    VM_BREAK;
+                VM_DEFAULT:
+                    VM_BREAK;
+            VM_DISPATCH_END()
+
+#ifdef LUNA_COMPUTED_GOTO
+    frame_end:
+#endif
+#undef VM_CASE
+#undef VM_DEFAULT
+#undef VM_BREAK
+#undef VM_DISPATCH_BEGIN
+#undef VM_DISPATCH_END
+
+        VM_HOOK_RETURN();
+        state_->CloseUpvalues(call->register_);
 
         Value *new_top = call->func_;
         // Reset top value
@@ -311,6 +809,230 @@ namespace luna
         state_->calls_.pop_back();
     }
 
+#ifdef LUNA_JIT
+    bool VM::RunJit(std::size_t depth)
+    {
+        auto call = &state_->calls_.back();
+        auto cl = call->func_->closure_;
+        auto proto = cl->GetPrototype();
+        if (!IsJitReady(proto))
+            return false;
+
+        auto opcodes = proto->GetOpCodes();
+        auto pc = proto->GetJitCode()->Run(this, cl, call->register_,
+                                           call->instruction_ - opcodes,
+                                           depth);
+        if (pc == JitExit_Frame)
+            return true;
+
+        // Machine code may exit from another frame, and c functions
+        // called by machine code may reallocate the frames
+        call = &state_->calls_.back();
+        opcodes = call->func_->closure_->GetPrototype()->GetOpCodes();
+        call->instruction_ = opcodes + pc;
+        return false;
+    }
+
+    const JitCode * VM::GetJitCode(std::size_t depth) const
+    {
+        if (state_->calls_.size() < depth || state_->yielding_ ||
+            state_->IsHookActive() || !state_->jit_enabled_)
+            return nullptr;
+        return state_->calls_.back().func_->closure_->GetPrototype()->GetJitCode();
+    }
+
+    int VM::ExecuteInstruction(int pc)
+    {
+        GET_CALLINFO_AND_PROTO();
+        Closure *cl = call->func_->closure_;
+        Value *a = nullptr;
+        Value *b = nullptr;
+        Value *c = nullptr;
+
+        // Errors are reported at the instruction like the interpreter
+        auto opcodes = proto->GetOpCodes();
+        call->instruction_ = opcodes + pc + 1;
+        auto i = opcodes[pc];
+        switch (Instruction::GetOpCode(i))
+        {
+            case OpType_Call:
+                a = GET_REGISTER_A(i);
+                state_->CheckRunGC();
+                if (Call(a, i))
+                    return JitExit_Frame;
+                break;
+            case OpType_TailCall:
+                a = GET_REGISTER_A(i);
+                state_->CheckRunGC();
+                if (TailCall(a, i))
+                    return JitExit_Frame;
+                break;
+            case OpType_Ret:
+                a = GET_REGISTER_A(i);
+                state_->CheckRunGC();
+                Return(a, i);
+                return JitExit_Frame;
+            case OpType_VarArg:
+                a = GET_REGISTER_A(i);
+                CopyVarArg(a, i);
+                break;
+            case OpType_FillNil:
+                a = GET_REGISTER_A(i);
+                b = GET_REGISTER_B(i);
+                if (Instruction::GetParamC(i))
+                    state_->CloseUpvalues(a);
+                while (a < b)
+                {
+                    a->SetNil();
+                    ++a;
+                }
+                break;
+            case OpType_GetUpvalue:
+                a = GET_REGISTER_A(i);
+                *a = *GET_UPVALUE_B(i)->GetValue();
+                break;
+            case OpType_SetUpvalue:
+                {
+                    a = GET_REGISTER_A(i);
+                    auto upvalue = GET_UPVALUE_B(i);
+                    upvalue->SetValue(*a);
+                    CHECK_BARRIER_VALUE(state_->GetGC(), upvalue, *a);
+                }
+                break;
+            case OpType_GetGlobal:
+                a = GET_REGISTER_A(i);
+                b = GET_CONST_VALUE(i);
+                *a = state_->global_.table_->GetValueBySlot(
+                    *b, GET_INLINE_CACHE());
+                break;
+            case OpType_SetGlobal:
+                a = GET_REGISTER_A(i);
+                b = GET_CONST_VALUE(i);
+                state_->global_.table_->SetValueBySlot(*b, *a,
+                                                       GET_INLINE_CACHE());
+                CHECK_BARRIER_KEY_VALUE(state_->GetGC(),
+                                        state_->global_.table_, *b, *a);
+                break;
+            case OpType_Closure:
+                a = GET_REGISTER_A(i);
+                GenerateClosure(a, i);
+                state_->CheckRunGC();
+                break;
+            case OpType_Len:
+                a = GET_REGISTER_A(i);
+                Len(a);
+                break;
+            case OpType_Concat:
+                a = GET_REGISTER_A(i);
+                b = GET_REGISTER_B(i);
+                Concat(a, b, Instruction::GetParamC(i));
+                state_->CheckRunGC();
+                break;
+            case OpType_NewTable:
+                a = GET_REGISTER_A(i);
+                NewTable(a, i);
+                state_->CheckRunGC();
+                break;
+            case OpType_SetTable:
+                GET_REGISTER_ABC(i);
+                SetTable(a, b, c);
+                break;
+            case OpType_GetTable:
+                GET_REGISTER_ABC(i);
+                GetTable(a, b, c);
+                break;
+            case OpType_SetField:
+                a = GET_REGISTER_A(i);
+                b = GET_CONST_B(i);
+                c = GET_REGISTER_C(i);
+                SetField(a, b, c, GET_INLINE_CACHE());
+                break;
+            case OpType_GetField:
+                a = GET_REGISTER_A(i);
+                b = GET_CONST_B(i);
+                c = GET_REGISTER_C(i);
+                GetField(a, b, c, GET_INLINE_CACHE());
+                break;
+            case OpType_GetTableK:
+                a = GET_REGISTER_A(i);
+                b = GET_CONST_B(i);
+                c = GET_REGISTER_C(i);
+                GetTable(a, b, c);
+                break;
+            case OpType_SetTableK:
+                a = GET_REGISTER_A(i);
+                b = GET_CONST_B(i);
+                c = GET_REGISTER_C(i);
+                SetTable(a, b, c);
+                break;
+            case OpType_ForPrep:
+                a = GET_REGISTER_A(i);
+                if (!ForPrep(a))
+                    return pc + Instruction::GetParamsBx(i);
+                break;
+            case OpType_SetList:
+                a = GET_REGISTER_A(i);
+                b = GET_REGISTER_B(i);
+                assert(a->type_ == ValueT_Table);
+                a->table_->SetArrayValues(call->instruction_->opcode_,
+                                          b, Instruction::GetParamC(i));
+                CHECK_BARRIER(state_->GetGC(), a->table_);
+                return pc + 2;
+            case OpType_GetGlobalField:
+                {
+                    auto cache = proto->GetInlineCache(pc);
+                    a = GET_REGISTER_A(i);
+                    b = GET_CONST_VALUE(i);
+                    c = proto->GetConstValue(call->instruction_->opcode_);
+                    *a = state_->global_.table_->GetValueBySlot(*b, cache[0]);
+                    GetField(a, c, a, cache[1]);
+                }
+                return pc + 2;
+            default:
+                assert(0);
+                break;
+        }
+        return pc + 1;
+    }
+
+    void VM::JumpBack(int pc)
+    {
+        GET_CALLINFO_AND_PROTO();
+        call->instruction_ = proto->GetOpCodes() + pc;
+        state_->CheckRunGC();
+    }
+#endif // LUNA_JIT
+
+    void VM::HookInstruction(const Instruction *pc,
+                             const Instruction *&last_pc, int &last_line)
+    {
+        GET_CALLINFO_AND_PROTO();
+        auto line = proto->GetInstructionLine(pc - proto->GetOpCodes());
+        auto mask = state_->hook_mask_;
+
+        if (mask & HookMask_Count && --state_->hook_count_left_ <= 0)
+        {
+            state_->hook_count_left_ = state_->hook_count_;
+            state_->CallHook(HookEvent_Count, proto, line);
+        }
+
+        // Jump back in the same line is a new line event, e.g. loop in
+        // one line
+        if (mask & HookMask_Line && (line != last_line || pc <= last_pc))
+            state_->CallHook(HookEvent_Line, proto, line);
+
+        last_pc = pc;
+        last_line = line;
+    }
+
+    void VM::HookFrame(HookEvent event)
+    {
+        GET_CALLINFO_AND_PROTO();
+        auto mask = event == HookEvent_Call ? HookMask_Call : HookMask_Return;
+        if (state_->hook_mask_ & mask)
+            state_->CallHook(event, proto, proto->GetLine());
+    }
+
     bool VM::Call(Value *a, Instruction i)
     {
         if (a->type_ != ValueT_Closure &&
@@ -320,16 +1042,47 @@ namespace luna
             return true;
         }
 
+        // Errors of the call are reported with position in Execute
+        int arg_count = Instruction::GetParamB(i) - 1;
+        int expect_result = Instruction::GetParamC(i) - 1;
+        return state_->CallFunction(a, arg_count, expect_result);
+    }
+
+    bool VM::TailCall(Value *a, Instruction i)
+    {
+        // Call c function as normal call, the next return instruction
+        // returns its results
+        if (a->type_ != ValueT_Closure)
+            return Call(a, i);
+
+        auto call = &state_->calls_.back();
+        auto expect_result = call->expect_result_;
+        state_->CloseUpvalues(call->register_);
+
+        // Keep position of the call for error, the frame will be replaced
+        auto proto = call->func_->closure_->GetPrototype();
+        auto pc = call->instruction_ - 1 - proto->GetOpCodes();
+
+        // Move callee and args to the position of current function
+        int arg_count = Instruction::GetParamB(i) - 1;
+        auto end = arg_count == EXP_VALUE_COUNT_ANY ?
+            state_->stack_.top_ : a + 1 + arg_count;
+        auto dst = call->func_;
+        for (auto src = a; src < end; ++src, ++dst)
+            *dst = *src;
+        state_->stack_.SetNewTop(dst);
+
+        // Replace the CallInfo of current function with callee's
+        auto f = call->func_;
+        state_->calls_.pop_back();
         try
         {
-            int arg_count = Instruction::GetParamB(i) - 1;
-            int expect_result = Instruction::GetParamC(i) - 1;
-            return state_->CallFunction(a, arg_count, expect_result);
-        } catch (const CallCFuncException &e)
+            return state_->CallFunction(f, EXP_VALUE_COUNT_ANY, expect_result);
+        } catch (const StackOverflowException &e)
         {
-            // Calculate line number of the call
-            auto pos = GetCurrentInstructionPos();
-            throw RuntimeException(pos.first, pos.second, e.What().c_str());
+            throw RuntimeException(proto->GetModule()->GetCStr(),
+                                   proto->GetInstructionLine(pc),
+                                   e.What().c_str());
         }
     }
 
@@ -350,20 +1103,10 @@ namespace luna
             auto upvalue_info = a_proto->GetUpvalue(i);
             if (upvalue_info->parent_local_)
             {
-                // Transform local variable to upvalue
+                // Local variable is shared by open upvalue until
+                // its scope exits
                 auto reg = call->register_ + upvalue_info->register_index_;
-                if (reg->type_ != ValueT_Upvalue)
-                {
-                    auto upvalue = state_->NewUpvalue();
-                    upvalue->SetValue(*reg);
-                    reg->type_ = ValueT_Upvalue;
-                    reg->upvalue_ = upvalue;
-                    new_closure->AddUpvalue(upvalue);
-                }
-                else
-                {
-                    new_closure->AddUpvalue(reg->upvalue_);
-                }
+                new_closure->AddUpvalue(state_->GetOpenUpvalue(reg));
             }
             else
             {
@@ -377,13 +1120,24 @@ namespace luna
     void VM::CopyVarArg(Value *a, Instruction i)
     {
         GET_CALLINFO_AND_PROTO();
-        auto arg = call->func_ + 1;
-        int total_args = call->register_ - arg;
+        int total_args = call->register_ - call->func_ - 1;
         int vararg_count = total_args - proto->FixedArgCount();
 
-        arg += proto->FixedArgCount();
         int expect_count = Instruction::GetParamsBx(i);
         if (expect_count == EXP_VALUE_COUNT_ANY)
+        {
+            try
+            {
+                a = state_->ReserveStack(a, vararg_count);
+            } catch (const StackOverflowException &e)
+            {
+                auto pos = GetCurrentInstructionPos();
+                throw RuntimeException(pos.first, pos.second, e.What().c_str());
+            }
+        }
+
+        auto arg = call->func_ + 1 + proto->FixedArgCount();
+        if (expect_count == EXP_VALUE_COUNT_ANY)
         {
             for (int i = 0; i < vararg_count; ++i)
                 *a++ = *arg++;
@@ -408,6 +1162,7 @@ namespace luna
 
         assert(!state_->calls_.empty());
         auto call = &state_->calls_.back();
+        state_->CloseUpvalues(call->register_);
 
         auto src = a;
         auto dst = call->func_;
@@ -435,34 +1190,57 @@ namespace luna
         state_->calls_.pop_back();
     }
 
-    void VM::Concat(Value *dst, Value *op1, Value *op2)
+    void VM::Concat(Value *dst, Value *first, int count)
     {
-        if (op1->type_ == ValueT_String && op2->type_ == ValueT_String)
-        {
-            dst->str_ = state_->GetString(op1->str_->GetStdString() +
-                                          op2->str_->GetCStr());
-        }
-        else if (op1->type_ == ValueT_String && op2->type_ == ValueT_Number)
+        // Check operands and calculate length of result
+        std::size_t length = 0;
+        for (int i = 0; i < count; ++i)
         {
-            dst->str_ = state_->GetString(op1->str_->GetCStr() +
-                                          NumberToStr(op2));
-        }
-        else if (op1->type_ == ValueT_Number && op2->type_ == ValueT_String)
-        {
-            dst->str_ = state_->GetString(NumberToStr(op1) +
-                                          op2->str_->GetCStr());
+            auto value = first + i;
+            if (value->type_ == ValueT_String)
+                length += value->str_->GetLength();
+            else if (value->type_ == ValueT_Number)
+                length += 24;
+            else
+            {
+                // Operands are concatenated from left to right, the left
+                // operand is a string when more than one operand are
+                // concatenated before
+                Value left;
+                left.type_ = ValueT_String;
+                auto op1 = i > 1 ? &left : (i > 0 ? value - 1 : value);
+                auto op2 = i > 0 ? value : value + 1;
+                auto pos = GetCurrentInstructionPos();
+                throw RuntimeException(pos.first, pos.second, op1, op2, "concat");
+            }
         }
-        else
+
+        // Check heap limit before building the string in a buffer which
+        // is not accounted
+        state_->GetGC().CheckHeapLimit(length);
+
+        // Concat all operands into one buffer
+        std::string result;
+        result.reserve(length);
+        for (int i = 0; i < count; ++i)
         {
-            auto pos = GetCurrentInstructionPos();
-            throw RuntimeException(pos.first, pos.second, op1, op2, "concat");
+            auto value = first + i;
+            if (value->type_ == ValueT_String)
+                result.append(value->str_->GetCStr(), value->str_->GetLength());
+            else
+                result += NumberToStr(value);
         }
 
+        dst->str_ = state_->GetString(result);
         dst->type_ = ValueT_String;
     }
 
-    void VM::ForInit(Value *var, Value *limit, Value *step)
+    bool VM::ForPrep(Value *var)
     {
+        auto limit = var + 1;
+        auto step = var + 2;
+        auto state = var + 3;
+
         if (var->type_ != ValueT_Number)
         {
             auto pos = GetCurrentInstructionPos();
@@ -483,6 +1261,40 @@ namespace luna
             throw RuntimeException(pos.first, pos.second,
                                    step, "'for' step", "number");
         }
+
+        // Integer mode when all operands are integers which are exact in
+        // double, then the loop runs by a precomputed iteration count.
+        // 'limit + step' bounds every value which accumulating var would
+        // reach, so it must be exact too, otherwise accumulation rounds
+        // and runs a different count of iterations.
+        const double max_int = 9007199254740992.0;   // 2^53
+        auto is_int = [=](double d) {
+            return floor(d) == d && d >= -max_int && d <= max_int;
+        };
+
+        if (step->num_ != 0.0 &&
+            is_int(var->num_) && is_int(limit->num_) && is_int(step->num_))
+        {
+            auto v = static_cast<long long>(var->num_);
+            auto l = static_cast<long long>(limit->num_);
+            auto s = static_cast<long long>(step->num_);
+            auto max = static_cast<long long>(max_int);
+            if (l + s >= -max && l + s <= max)
+            {
+                if (s > 0 ? v > l : v < l)
+                    return false;
+
+                auto count = s > 0 ? (l - v) / s : (v - l) / -s;
+                state->num_ = static_cast<double>(count);
+                state->type_ = ValueT_Number;
+                return true;
+            }
+        }
+
+        // Float mode decides the direction once, zero step counts down
+        bool up = step->num_ > 0.0;
+        state->SetBool(up);
+        return up ? var->num_ <= limit->num_ : var->num_ >= limit->num_;
     }
 
     std::pair<const char *, const char *> VM::GetOperandNameAndScope(const Value *a) const
@@ -500,6 +1312,20 @@ namespace luna
         const char *scope_table = "table member";
         const char *scope_null = "";
 
+        // Fused global field instruction gets the global into its dst
+        // register before indexing it
+        if (Instruction::GetOpCode(*instruction) == OpType_GetGlobalField &&
+            reg == Instruction::GetParamA(*instruction))
+        {
+            auto key = proto->GetConstValue(Instruction::GetParamBx(*instruction));
+            return { key->str_->GetCStr(), scope_global };
+        }
+
+        // Register of local variable, instructions may read it directly
+        auto local_name = proto->SearchLocalVar(reg, pc);
+        if (local_name)
+            return { local_name->GetCStr(), scope_local };
+
         // Search last instruction which dst register is reg,
         // and get the name base on the instruction
         while (instruction > base)
@@ -536,6 +1362,32 @@ namespace luna
                         return { upvalue_info->name_->GetCStr(), scope_upvalue };
                     }
                     break;
+                case OpType_GetField:
+                    if (reg == Instruction::GetParamC(*instruction))
+                    {
+                        auto index = Instruction::GetParamB(*instruction);
+                        auto key = proto->GetConstValue(index);
+                        return { key->str_->GetCStr(), scope_table };
+                    }
+                    break;
+                case OpType_GetGlobalField:
+                    if (reg == Instruction::GetParamA(*instruction))
+                    {
+                        auto key = proto->GetConstValue(instruction[1].opcode_);
+                        return { key->str_->GetCStr(), scope_table };
+                    }
+                    break;
+                case OpType_GetTableK:
+                    if (reg == Instruction::GetParamC(*instruction))
+                    {
+                        auto key = proto->GetConstValue(
+                            Instruction::GetParamB(*instruction));
+                        if (key->type_ == ValueT_String)
+                            return { key->str_->GetCStr(), scope_table };
+                        else
+                            return { unknown_name, scope_table };
+                    }
+                    break;
                 case OpType_GetTable:
                     if (reg == Instruction::GetParamC(*instruction))
                     {
@@ -561,6 +1413,23 @@ namespace luna
                  proto->GetInstructionLine(index) };
     }
 
+    std::pair<const char *, int> VM::GetCFunctionErrorPos() const
+    {
+        // Skip frames of library functions, report at their caller
+        assert(!state_->calls_.empty());
+        auto call = state_->calls_.rbegin();
+        auto proto = call->func_->closure_->GetPrototype();
+        while (proto->IsLibrary() && call + 1 != state_->calls_.rend())
+        {
+            ++call;
+            proto = call->func_->closure_->GetPrototype();
+        }
+
+        auto index = call->instruction_ - 1 - proto->GetOpCodes();
+        return { proto->GetModule()->GetCStr(),
+                 proto->GetInstructionLine(index) };
+    }
+
     void VM::CheckType(const Value *v, ValueT type, const char *op) const
     {
         if (v->type_ != type)
@@ -587,6 +1456,51 @@ namespace luna
         }
     }
 
+    void VM::GetUserData(const Value *t, const Value *key, Value *dst)
+    {
+        CheckTableType(t, key, "get", "from");
+        auto array = t->user_data_->GetTypedArray();
+        if (array && key->type_ == ValueT_Number)
+            *dst = array->GetValue(key->num_);
+        else
+            *dst = t->user_data_->GetMetatable()->GetValue(*key);
+    }
+
+    void VM::SetUserData(const Value *t, const Value *key, const Value *value)
+    {
+        CheckTableType(t, key, "set", "to");
+        // Elements of typed array are indexed directly
+        auto array = t->user_data_->GetTypedArray();
+        if (array && key->type_ == ValueT_Number)
+        {
+            if (value->type_ != ValueT_Number ||
+                !array->SetValue(key->num_, value->num_))
+                ReportTypedArrayError(array, key, value);
+        }
+        else
+        {
+            auto metatable = t->user_data_->GetMetatable();
+            metatable->SetValue(*key, *value);
+            CHECK_BARRIER_KEY_VALUE(state_->GetGC(), metatable, *key, *value);
+        }
+    }
+
+    void VM::GetUserDataField(const Value *t, const Value *key, Value *dst,
+                              unsigned int &cache)
+    {
+        CheckTableType(t, key, "get", "from");
+        *dst = t->user_data_->GetMetatable()->GetValueBySlot(*key, cache);
+    }
+
+    void VM::SetUserDataField(const Value *t, const Value *key,
+                              const Value *value, unsigned int &cache)
+    {
+        CheckTableType(t, key, "set", "to");
+        auto metatable = t->user_data_->GetMetatable();
+        metatable->SetValueBySlot(*key, *value, cache);
+        CHECK_BARRIER_KEY_VALUE(state_->GetGC(), metatable, *key, *value);
+    }
+
     void VM::CheckTableType(const Value *t, const Value *k,
                             const char *op, const char *desc) const
     {
@@ -603,6 +1517,21 @@ namespace luna
                 ns.first, ns.second, op_desc.c_str());
     }
 
+    void VM::ReportTypedArrayError(const TypedArray *array, const Value *k,
+                                   const Value *v) const
+    {
+        auto pos = GetCurrentInstructionPos();
+        if (v->type_ != ValueT_Number)
+            throw RuntimeException(pos.first, pos.second, v,
+                    "typed array element", "number");
+
+        char index[kNumberBufferSize];
+        FormatNumber(k->num_, index);
+        auto desc = std::string("typed array index ") + index +
+            " out of range [1, " + std::to_string(array->GetSize()) + "]";
+        throw RuntimeException(pos.first, pos.second, desc.c_str());
+    }
+
     void VM::ReportTypeError(const Value *v, const char *op) const
     {
         auto ns = GetOperandNameAndScope(v);
@@ -3,11 +3,14 @@
 
 #include "Value.h"
 #include "OpCode.h"
+#include "State.h"
+#include "Jit.h"
 #include <utility>
 
 namespace luna
 {
     class State;
+    class TypedArray;
 
     class VM
     {
@@ -17,23 +20,88 @@ namespace luna
         void Execute();
 
     private:
+        // Execute current frame, debug hooks are called only in the
+        // 'Hooked' variant, so the dispatch loop without hooks pays
+        // nothing for them
+        template<bool Hooked>
         void ExecuteFrame();
 
+        // Call hooks of line and count events before the instruction
+        // which 'pc' points to, 'last_pc' and 'last_line' are of the
+        // last instruction hooked in current frame
+        void HookInstruction(const Instruction *pc,
+                             const Instruction *&last_pc, int &last_line);
+
+        // Call hook of call or return event of current frame
+        void HookFrame(HookEvent event);
+
         // Execute next frame if return true
         bool Call(Value *a, Instruction i);
 
+        // Call closure with the frame of current function, execute next
+        // frame if return true
+        bool TailCall(Value *a, Instruction i);
+
+        // Instructions which access table 't' by 'key', they are shared
+        // by the interpreter and the slow paths of compiled code. Tables
+        // are accessed inline, others by the out of line functions.
+        void GetTable(const Value *t, const Value *key, Value *dst);
+        void SetTable(const Value *t, const Value *key, const Value *value);
+        void GetField(const Value *t, const Value *key, Value *dst,
+                      unsigned int &cache);
+        void SetField(const Value *t, const Value *key, const Value *value,
+                      unsigned int &cache);
+        void GetUserData(const Value *t, const Value *key, Value *dst);
+        void SetUserData(const Value *t, const Value *key, const Value *value);
+        void GetUserDataField(const Value *t, const Value *key, Value *dst,
+                              unsigned int &cache);
+        void SetUserDataField(const Value *t, const Value *key,
+                              const Value *value, unsigned int &cache);
+        void NewTable(Value *a, Instruction i);
+        void Len(Value *a);
+
         void GenerateClosure(Value *a, Instruction i);
         void CopyVarArg(Value *a, Instruction i);
         void Return(Value *a, Instruction i);
 
-        void Concat(Value *dst, Value *op1, Value *op2);
-        void ForInit(Value *var, Value *limit, Value *step);
+        // Concat 'count' values which start from 'first' into 'dst'
+        void Concat(Value *dst, Value *first, int count);
+
+        // Prepare numeric 'for' loop which registers start from 'var',
+        // return true when the loop body runs at least once
+        bool ForPrep(Value *var);
+
+#ifdef LUNA_JIT
+        friend class JitCode;
+
+        // Count a call or backward jump of 'proto', return true when
+        // 'proto' is compiled, it is compiled when it becomes hot
+        bool IsJitReady(Function *proto);
+
+        // Run machine code of current frame from its current instruction
+        // when its function is compiled, return true when the frame is
+        // changed, otherwise the interpreter continues from the
+        // instruction where machine code exits. Frames below 'depth'
+        // return to the caller of Execute.
+        bool RunJit(std::size_t depth);
+        // Machine code of current frame which machine code of the last
+        // frame continues in, or nullptr
+        const JitCode * GetJitCode(std::size_t depth) const;
+
+        // Slow path of compiled code, execute the instruction at index
+        // 'pc' of current frame, return index of the next instruction
+        int ExecuteInstruction(int pc);
+
+        // Backward jump of compiled code to instruction index 'pc'
+        void JumpBack(int pc);
+#endif // LUNA_JIT
 
         // Debug help functions
         std::pair<const char *, const char *>
         GetOperandNameAndScope(const Value *a) const;
 
         std::pair<const char *, int> GetCurrentInstructionPos() const;
+        std::pair<const char *, int> GetCFunctionErrorPos() const;
 
         void CheckType(const Value *v, ValueT type, const char *op) const;
 
@@ -46,6 +114,10 @@ namespace luna
         void CheckTableType(const Value *t, const Value *k,
                             const char *op, const char *desc) const;
 
+        // Report error of setting 'v' to element 'k' of typed array
+        void ReportTypedArrayError(const TypedArray *array, const Value *k,
+                                   const Value *v) const;
+
         void ReportTypeError(const Value *v, const char *op) const;
 
         State *state_;
@@ -2,7 +2,6 @@
 #include "Function.h"
 #include "Table.h"
 #include "String.h"
-#include "Upvalue.h"
 #include "UserData.h"
 
 namespace luna
@@ -25,9 +24,6 @@ namespace luna
             case ValueT_Closure:
                 closure_->Accept(v);
                 break;
-            case ValueT_Upvalue:
-                upvalue_->Accept(v);
-                break;
             case ValueT_Table:
                 table_->Accept(v);
                 break;
@@ -52,7 +48,6 @@ namespace luna
             case ValueT_CFunction: return "C-Function";
             case ValueT_String: return "string";
             case ValueT_Closure: return "function";
-            case ValueT_Upvalue: return "upvalue";
             case ValueT_Table: return "table";
             case ValueT_UserData: return "userdata";
             default: return "unknown type";
@@ -2,15 +2,16 @@
 #define VALUE_H
 
 #include "GC.h"
+#include "String.h"
 #include <functional>
+#include <stdint.h>
+#include <string.h>
 
 namespace luna
 {
 #define EXP_VALUE_COUNT_ANY -1
 
-    class String;
     class Closure;
-    class Upvalue;
     class Table;
     class UserData;
     class State;
@@ -25,12 +26,209 @@ namespace luna
         ValueT_Obj,
         ValueT_String,
         ValueT_Closure,
-        ValueT_Upvalue,
         ValueT_Table,
         ValueT_UserData,
         ValueT_CFunction,
     };
 
+#ifdef LUNA_NAN_BOXING
+    // NaN-boxing: a Value is a single 64-bit word. Numbers are stored as
+    // plain doubles, every other type is stored in the otherwise unused
+    // negative quiet NaN space: bits [47, 64) hold the tag and bits
+    // [0, 47) hold the payload (pointer or bool), so pointers must fit
+    // in 47 bits which holds for user space of x86-64 and AArch64.
+    // The fields below are views of the word which keep the member
+    // syntax 'value.type_', 'value.num_', 'value.str_' etc. of the
+    // plain union representation. The views alias each other, so they
+    // are 'may_alias' types to keep type based alias analysis away.
+    namespace nan_box
+    {
+#define NAN_BOX_FIELD struct __attribute__((__may_alias__))
+
+        const uint64_t kTagShift = 47;
+        const uint64_t kNumberTagMax = 0x1FFF0;
+        const uint64_t kPayloadMask = (1ULL << kTagShift) - 1;
+        const uint64_t kCanonicalNaN = 0x7FF8000000000000ULL;
+
+        inline bool IsNumber(uint64_t bits)
+        { return (bits >> kTagShift) <= kNumberTagMax; }
+
+        inline uint64_t Tag(ValueT type)
+        { return (kNumberTagMax + 1 + type) << kTagShift; }
+
+        inline uint64_t ToBits(double num)
+        {
+            uint64_t bits = kCanonicalNaN;
+            if (num == num)
+                memcpy(&bits, &num, sizeof(num));
+            return bits;
+        }
+
+        inline double ToNumber(uint64_t bits)
+        {
+            double num;
+            memcpy(&num, &bits, sizeof(num));
+            return num;
+        }
+
+        // Store payload, keep the tag when bits is a boxed value,
+        // otherwise the value becomes a boxed value with tag 'type'
+        inline uint64_t SetPayload(uint64_t bits, uint64_t payload, ValueT type)
+        {
+            uint64_t tag = IsNumber(bits) ? Tag(type) : bits & ~kPayloadMask;
+            return tag | (payload & kPayloadMask);
+        }
+
+        NAN_BOX_FIELD TypeField
+        {
+            uint64_t bits_;
+
+            operator ValueT () const
+            {
+                return IsNumber(bits_) ? ValueT_Number :
+                    static_cast<ValueT>((bits_ >> kTagShift) - kNumberTagMax - 1);
+            }
+
+            TypeField & operator = (ValueT type)
+            {
+                if (type == ValueT_Number)
+                {
+                    if (!IsNumber(bits_))
+                        bits_ = 0;
+                }
+                else
+                {
+                    uint64_t payload = IsNumber(bits_) ? 0 : bits_ & kPayloadMask;
+                    bits_ = Tag(type) | payload;
+                }
+                return *this;
+            }
+        };
+
+        NAN_BOX_FIELD NumField
+        {
+            uint64_t bits_;
+
+            operator double () const
+            { return ToNumber(bits_); }
+
+            NumField & operator = (double num)
+            { bits_ = ToBits(num); return *this; }
+
+            NumField & operator += (double num)
+            { return *this = ToNumber(bits_) + num; }
+
+            NumField & operator -= (double num)
+            { return *this = ToNumber(bits_) - num; }
+        };
+
+        NAN_BOX_FIELD BoolField
+        {
+            uint64_t bits_;
+
+            operator bool () const
+            { return (bits_ & kPayloadMask) != 0; }
+
+            BoolField & operator = (bool bvalue)
+            { bits_ = SetPayload(bits_, bvalue ? 1 : 0, ValueT_Bool); return *this; }
+        };
+
+        template<typename T>
+        NAN_BOX_FIELD PtrField
+        {
+            uint64_t bits_;
+
+            T * Get() const
+            { return reinterpret_cast<T *>(static_cast<uintptr_t>(bits_ & kPayloadMask)); }
+
+            operator T * () const
+            { return Get(); }
+
+            T * operator -> () const
+            { return Get(); }
+
+            T & operator * () const
+            { return *Get(); }
+
+            PtrField & operator = (T *ptr)
+            {
+                bits_ = SetPayload(bits_, reinterpret_cast<uintptr_t>(ptr), ValueT_Obj);
+                return *this;
+            }
+        };
+
+        NAN_BOX_FIELD CFuncField
+        {
+            uint64_t bits_;
+
+            operator CFunctionType () const
+            { return reinterpret_cast<CFunctionType>(static_cast<uintptr_t>(bits_ & kPayloadMask)); }
+
+            CFuncField & operator = (CFunctionType cfunc)
+            {
+                bits_ = SetPayload(bits_, reinterpret_cast<uintptr_t>(cfunc), ValueT_CFunction);
+                return *this;
+            }
+        };
+#undef NAN_BOX_FIELD
+    } // namespace nan_box
+
+    // Value type of luna
+    struct Value
+    {
+        union
+        {
+            uint64_t bits_;
+            nan_box::TypeField type_;
+            nan_box::PtrField<GCObject> obj_;
+            nan_box::PtrField<String> str_;
+            nan_box::PtrField<Closure> closure_;
+            nan_box::PtrField<Table> table_;
+            nan_box::PtrField<UserData> user_data_;
+            nan_box::CFuncField cfunc_;
+            nan_box::NumField num_;
+            nan_box::BoolField bvalue_;
+        };
+
+        Value() : bits_(nan_box::Tag(ValueT_Nil)) { }
+        explicit Value(bool bvalue)
+            : bits_(nan_box::Tag(ValueT_Bool) | (bvalue ? 1 : 0)) { }
+        explicit Value(double num) : bits_(nan_box::ToBits(num)) { }
+        explicit Value(String *str) : bits_(Box(ValueT_String, str)) { }
+        explicit Value(Closure *closure) : bits_(Box(ValueT_Closure, closure)) { }
+        explicit Value(Table *table) : bits_(Box(ValueT_Table, table)) { }
+        explicit Value(UserData *user_data) : bits_(Box(ValueT_UserData, user_data)) { }
+        explicit Value(CFunctionType cfunc)
+            : bits_(nan_box::Tag(ValueT_CFunction) | reinterpret_cast<uintptr_t>(cfunc)) { }
+
+        void SetNil()
+        { bits_ = nan_box::Tag(ValueT_Nil); }
+
+        void SetBool(bool bvalue)
+        { bits_ = nan_box::Tag(ValueT_Bool) | (bvalue ? 1 : 0); }
+
+        bool IsNil() const
+        { return bits_ == nan_box::Tag(ValueT_Nil); }
+
+        bool IsFalse() const
+        { return IsNil() || bits_ == nan_box::Tag(ValueT_Bool); }
+
+        // All GC object types share the pointer 'obj_'
+        bool IsGCObject() const
+        { return type_ >= ValueT_Obj && type_ <= ValueT_UserData; }
+
+        void Accept(GCObjectVisitor *v) const;
+        const char * TypeName() const;
+
+        static const char * TypeName(ValueT type);
+
+    private:
+        static uint64_t Box(ValueT type, const void *ptr)
+        { return nan_box::Tag(type) | reinterpret_cast<uintptr_t>(ptr); }
+    };
+
+    static_assert(sizeof(Value) == sizeof(uint64_t), "NaN-boxed Value is one word");
+#else
     // Value type of luna
     struct Value
     {
@@ -39,7 +237,6 @@ namespace luna
             GCObject *obj_;
             String *str_;
             Closure *closure_;
-            Upvalue *upvalue_;
             Table *table_;
             UserData *user_data_;
             CFunctionType cfunc_;
@@ -54,7 +251,6 @@ namespace luna
         explicit Value(double num) : num_(num), type_(ValueT_Number) { }
         explicit Value(String *str) : str_(str), type_(ValueT_String) { }
         explicit Value(Closure *closure) : closure_(closure), type_(ValueT_Closure) { }
-        explicit Value(Upvalue *upvalue) : upvalue_(upvalue), type_(ValueT_Upvalue) { }
         explicit Value(Table *table) : table_(table), type_(ValueT_Table) { }
         explicit Value(UserData *user_data) : user_data_(user_data), type_(ValueT_UserData) { }
         explicit Value(CFunctionType cfunc) : cfunc_(cfunc), type_(ValueT_CFunction) { }
@@ -71,11 +267,16 @@ namespace luna
         bool IsFalse() const
         { return type_ == ValueT_Nil || (type_ == ValueT_Bool && !bvalue_); }
 
+        // All GC object types share the pointer 'obj_'
+        bool IsGCObject() const
+        { return type_ >= ValueT_Obj && type_ <= ValueT_UserData; }
+
         void Accept(GCObjectVisitor *v) const;
         const char * TypeName() const;
 
         static const char * TypeName(ValueT type);
     };
+#endif // LUNA_NAN_BOXING
 
     inline bool operator == (const Value &left, const Value &right)
     {
@@ -85,15 +286,17 @@ namespace luna
         switch (left.type_)
         {
             case ValueT_Nil: return true;
-            case ValueT_Bool: return left.bvalue_ == right.bvalue_;
-            case ValueT_Number: return left.num_ == right.num_;
-            case ValueT_Obj: return left.obj_ == right.obj_;
-            case ValueT_String: return left.str_ == right.str_;
-            case ValueT_Closure: return left.closure_ == right.closure_;
-            case ValueT_Upvalue: return left.upvalue_ == right.upvalue_;
-            case ValueT_Table: return left.table_ == right.table_;
-            case ValueT_UserData: return left.user_data_ == right.user_data_;
-            case ValueT_CFunction: return left.cfunc_ == right.cfunc_;
+            case ValueT_Bool: return static_cast<bool>(left.bvalue_) == right.bvalue_;
+            case ValueT_Number: return static_cast<double>(left.num_) == right.num_;
+            case ValueT_Obj: return static_cast<GCObject *>(left.obj_) == right.obj_;
+            // Short strings are interned, long strings compare contents
+            case ValueT_String:
+                return left.str_ == right.str_ ||
+                    (left.str_->IsLong() && *left.str_ == *right.str_);
+            case ValueT_Closure: return static_cast<Closure *>(left.closure_) == right.closure_;
+            case ValueT_Table: return static_cast<Table *>(left.table_) == right.table_;
+            case ValueT_UserData: return static_cast<UserData *>(left.user_data_) == right.user_data_;
+            case ValueT_CFunction: return static_cast<CFunctionType>(left.cfunc_) == right.cfunc_;
         }
 
         return false;
@@ -103,6 +306,24 @@ namespace luna
     {
         return !(left == right);
     }
+
+    // Barrier 'obj' when 'value' is stored into 'obj' and 'value' is a GC
+    // object which needs barrier
+    #define CHECK_BARRIER_VALUE(gc, obj, value)                         \
+        do                                                              \
+        {                                                               \
+            if ((value).IsGCObject() &&                                 \
+                luna::CheckBarrier(obj, (value).obj_))                  \
+                gc.SetBarrier(obj);                                     \
+        } while (0)
+
+    // Barrier table when 'key' and 'value' are stored into table
+    #define CHECK_BARRIER_KEY_VALUE(gc, table, key, value)              \
+        do                                                              \
+        {                                                               \
+            CHECK_BARRIER_VALUE(gc, table, key);                        \
+            CHECK_BARRIER_VALUE(gc, table, value);                      \
+        } while (0)
 } // namespace luna
 
 namespace std
@@ -121,17 +342,15 @@ namespace std
                 case luna::ValueT_Number:
                     return hash<double>()(t.num_);
                 case luna::ValueT_String:
-                    return hash<void *>()(t.str_);
+                    return t.str_->GetHash();
                 case luna::ValueT_Closure:
                     return hash<void *>()(t.closure_);
-                case luna::ValueT_Upvalue:
-                    return hash<void *>()(t.upvalue_);
                 case luna::ValueT_Table:
                     return hash<void *>()(t.table_);
                 case luna::ValueT_UserData:
                     return hash<void *>()(t.user_data_);
                 case luna::ValueT_CFunction:
-                    return hash<void *>()(reinterpret_cast<void *>(t.cfunc_));
+                    return hash<void *>()(reinterpret_cast<void *>(static_cast<luna::CFunctionType>(t.cfunc_)));
                 default:
                     return hash<void *>()(t.obj_);
             }
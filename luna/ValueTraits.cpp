@@ -0,0 +1,15 @@
+#include "ValueTraits.h"
+#include "State.h"
+
+namespace luna
+{
+    Value ValueTraits<std::string>::Make(State *state, const std::string &str)
+    {
+        return Value(state->GetString(str));
+    }
+
+    Value ValueTraits<const char *>::Make(State *state, const char *str)
+    {
+        return Value(state->GetString(str));
+    }
+} // namespace luna
@@ -0,0 +1,128 @@
+#ifndef VALUE_TRAITS_H
+#define VALUE_TRAITS_H
+
+#include "Value.h"
+#include "String.h"
+#include <string>
+#include <cstddef>
+#include <type_traits>
+
+namespace luna
+{
+    class State;
+
+    // Conversion between C++ type 'T' and Value for typed calls between
+    // host and script, each specialization provides:
+    //   static ValueT Type();                    expected type for errors
+    //   static bool Is(const Value &v);          'v' converts to 'T'
+    //   static T Get(const Value &v);            convert 'v' which Is 'T'
+    //   static Value Make(State *state, T t);    convert 't' to Value
+    template<typename T, typename Enable = void>
+    struct ValueTraits;
+
+    // Numbers convert to all arithmetic types except bool
+    template<typename T>
+    struct ValueTraits<T, typename std::enable_if<
+        std::is_arithmetic<T>::value && !std::is_same<T, bool>::value>::type>
+    {
+        static ValueT Type() { return ValueT_Number; }
+        static bool Is(const Value &v) { return v.type_ == ValueT_Number; }
+        static T Get(const Value &v) { return static_cast<T>(v.num_); }
+        static Value Make(State *, T t) { return Value(static_cast<double>(t)); }
+    };
+
+    template<>
+    struct ValueTraits<bool>
+    {
+        static ValueT Type() { return ValueT_Bool; }
+        static bool Is(const Value &v) { return v.type_ == ValueT_Bool; }
+        static bool Get(const Value &v) { return v.bvalue_; }
+        static Value Make(State *, bool b) { return Value(b); }
+    };
+
+    template<>
+    struct ValueTraits<std::string>
+    {
+        static ValueT Type() { return ValueT_String; }
+        static bool Is(const Value &v) { return v.type_ == ValueT_String; }
+        static std::string Get(const Value &v) { return v.str_->GetStdString(); }
+        static Value Make(State *state, const std::string &str);
+    };
+
+    // C string of Value is valid while the string is alive, e.g. args of
+    // bound function, it is not a result type of State::Call
+    template<>
+    struct ValueTraits<const char *>
+    {
+        static ValueT Type() { return ValueT_String; }
+        static bool Is(const Value &v) { return v.type_ == ValueT_String; }
+        static const char * Get(const Value &v) { return v.str_->GetCStr(); }
+        static Value Make(State *state, const char *str);
+    };
+
+    // String literal args of State::Call decay to 'char *'
+    template<>
+    struct ValueTraits<char *> : ValueTraits<const char *> { };
+
+    template<>
+    struct ValueTraits<Table *>
+    {
+        static ValueT Type() { return ValueT_Table; }
+        static bool Is(const Value &v) { return v.type_ == ValueT_Table; }
+        static Table * Get(const Value &v) { return v.table_; }
+        static Value Make(State *, Table *t) { return Value(t); }
+    };
+
+    template<>
+    struct ValueTraits<UserData *>
+    {
+        static ValueT Type() { return ValueT_UserData; }
+        static bool Is(const Value &v) { return v.type_ == ValueT_UserData; }
+        static UserData * Get(const Value &v) { return v.user_data_; }
+        static Value Make(State *, UserData *u) { return Value(u); }
+    };
+
+    template<>
+    struct ValueTraits<Closure *>
+    {
+        static ValueT Type() { return ValueT_Closure; }
+        static bool Is(const Value &v) { return v.type_ == ValueT_Closure; }
+        static Closure * Get(const Value &v) { return v.closure_; }
+        static Value Make(State *, Closure *c) { return Value(c); }
+    };
+
+    // Value is passed as it is
+    template<>
+    struct ValueTraits<Value>
+    {
+        static ValueT Type() { return ValueT_Nil; }
+        static bool Is(const Value &) { return true; }
+        static Value Get(const Value &v) { return v; }
+        static Value Make(State *, const Value &v) { return v; }
+    };
+
+    // Traits of parameter type, e.g. 'const std::string &'
+    template<typename T>
+    struct ArgTraits : ValueTraits<typename std::decay<T>::type> { };
+
+    // 'T' converted from Value may refer to a GC object, which is not
+    // rooted after it leaves stack
+    template<typename T>
+    struct IsGCRef : std::integral_constant<bool,
+        std::is_pointer<T>::value || std::is_same<T, Value>::value> { };
+
+    // Compile time index sequence 0 ... N-1 to unpack arguments
+    template<std::size_t... Indexes>
+    struct IndexSequence { };
+
+    template<std::size_t N, std::size_t... Indexes>
+    struct MakeIndexSequence : MakeIndexSequence<N - 1, N - 1, Indexes...> { };
+
+    template<std::size_t... Indexes>
+    struct MakeIndexSequence<0, Indexes...>
+    {
+        typedef IndexSequence<Indexes...> Type;
+    };
+} // namespace luna
+
+#endif // VALUE_TRAITS_H
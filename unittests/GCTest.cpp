@@ -15,7 +15,7 @@
 #include <deque>
 #include <string>
 
-luna::GC g_gc(luna::GC::DefaultDeleter(), true);
+luna::GC g_gc(luna::GC::GCObjectDeleter(), true);
 std::deque<luna::Table *> g_globalTable;
 std::deque<luna::Function *> g_globalFunction;
 std::deque<luna::Closure *> g_globalClosure;
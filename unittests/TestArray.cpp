@@ -0,0 +1,55 @@
+#include "UnitTest.h"
+#include "TestCommon.h"
+#include "luna/State.h"
+#include "luna/LibAPI.h"
+#include "luna/LibArray.h"
+#include "luna/Exception.h"
+#include <vector>
+
+TEST_CASE(array1)
+{
+    luna::State state;
+    RegisterRecord(&state);
+    lib::array::RegisterLibArray(&state);
+
+    // Sizes cover both vector and tail loops
+    state.DoString(
+        "local a = {} "
+        "for i = 1, 11 do a[i] = i end "
+        "record(array.sum(a), array.min(a), array.max(a), array.dot(a, a)) "
+        "array.scale(a, 2) "
+        "record(a[1], a[11]) "
+        "local b = array.fill({}, 1, 11) "
+        "array.axpy(3, b, a) "
+        "record(#b, a[1], a[11]) "
+        "array.prefixsum(b) "
+        "record(b[1], b[11]) "
+        "local c = array.convolve({ 1, 2, 3 }, { 0, 1, 0.5 }) "
+        "record(#c, c[1], c[2], c[3], c[4], c[5]) "
+        "record(array.sum({}), array.min({}))");
+
+    std::vector<double> expect = {
+        66, 1, 11, 506,
+        2, 22,
+        11, 5, 25,
+        1, 11,
+        5, 0, 1, 2.5, 4, 1.5,
+        0, -1
+    };
+    EXPECT_TRUE(GetRecords().numbers_ == expect);
+}
+
+TEST_CASE(array2)
+{
+    luna::State state;
+    lib::array::RegisterLibArray(&state);
+
+    // Every value of array part must be a number
+    EXPECT_EXCEPTION(luna::RuntimeException, {
+        state.DoString("array.sum({ 1, 2, 'x' })");
+    });
+
+    EXPECT_EXCEPTION(luna::RuntimeException, {
+        state.DoString("array.dot({ 1, 2 }, { 1, 2, 3 })");
+    });
+}
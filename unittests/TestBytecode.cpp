@@ -0,0 +1,136 @@
+#include "UnitTest.h"
+#include "luna/State.h"
+#include "luna/Function.h"
+#include "luna/Bytecode.h"
+#include "luna/Exception.h"
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstdio>
+
+namespace
+{
+    luna::State g_state;
+
+    luna::Function * NewChunk()
+    {
+        auto module = g_state.GetString("chunk");
+        auto f = g_state.NewFunction();
+        f->SetModuleName(module);
+        f->SetLine(1);
+        f->SetHasVararg();
+        f->SetMaxRegisterCount(3);
+        f->AddInstruction(luna::Instruction::ABxCode(luna::OpType_LoadConst, 0, 0), 1);
+        f->AddInstruction(luna::Instruction::ABxCode(luna::OpType_Closure, 1, 0), 2);
+        f->AddInstruction(luna::Instruction::AsBxCode(luna::OpType_Ret, 0, 1), 3);
+        f->AddConstNumber(1.5);
+        f->AddConstString(g_state.GetString("name"));
+        f->AddLocalVar(g_state.GetString("x"), 0, 1, 3);
+
+        auto child = g_state.NewFunction();
+        child->SetModuleName(module);
+        child->SetLine(2);
+        child->SetSuperior(f);
+        child->AddFixedArgCount(2);
+        child->AddInstruction(luna::Instruction::AsBxCode(luna::OpType_Ret, 0, 1), 2);
+        child->AddUpvalue(g_state.GetString("x"), true, 0);
+        f->AddChildFunction(child);
+        return f;
+    }
+
+    luna::Function * Load(const std::string &chunk)
+    {
+        return luna::LoadBytecode(chunk.data(), chunk.size(),
+                                  g_state.GetString("chunk"), &g_state);
+    }
+} // namespace
+
+TEST_CASE(bytecode1)
+{
+    auto f = Load(luna::DumpBytecode(NewChunk()));
+
+    EXPECT_TRUE(f->HasVararg());
+    EXPECT_TRUE(f->GetMaxRegisterCount() == 3);
+    EXPECT_TRUE(f->OpCodeSize() == 3);
+    EXPECT_TRUE(luna::Instruction::GetOpCode(f->GetOpCodes()[1]) == luna::OpType_Closure);
+    EXPECT_TRUE(f->GetInstructionLine(2) == 3);
+    EXPECT_TRUE(f->GetConstValueCount() == 2);
+    EXPECT_TRUE(f->GetConstValue(0)->num_ == 1.5);
+    EXPECT_TRUE(f->GetConstValue(1)->str_ == g_state.GetString("name"));
+    EXPECT_TRUE(f->SearchLocalVar(0, 2) == g_state.GetString("x"));
+    EXPECT_TRUE(f->GetChildFunctionCount() == 1);
+
+    auto child = f->GetChildFunction(0);
+    EXPECT_TRUE(child->FixedArgCount() == 2);
+    EXPECT_TRUE(child->GetLine() == 2);
+    EXPECT_TRUE(child->GetModule() == g_state.GetString("chunk"));
+    EXPECT_TRUE(child->GetUpvalueCount() == 1);
+    EXPECT_TRUE(child->GetUpvalue(0)->parent_local_);
+    EXPECT_TRUE(child->SearchUpvalue(g_state.GetString("x")) == 0);
+}
+
+TEST_CASE(bytecode2)
+{
+    auto chunk = luna::DumpBytecode(NewChunk());
+    EXPECT_TRUE(luna::IsBytecode(chunk.data(), chunk.size()));
+    EXPECT_TRUE(!luna::IsBytecode("print(1)", 8));
+
+    // Truncated chunk and chunk of other version are rejected
+    EXPECT_EXCEPTION(luna::BytecodeException, {
+        Load(chunk.substr(0, chunk.size() - 1));
+    });
+
+    chunk[5] = chunk[5] + 1;
+    EXPECT_EXCEPTION(luna::BytecodeException, {
+        Load(chunk);
+    });
+}
+
+TEST_CASE(bytecode3)
+{
+    // Shared prototypes use instructions of chunk in place
+    auto chunk = luna::DumpBytecode(NewChunk());
+    auto f = luna::LoadBytecode(chunk.data(), chunk.size(),
+                                g_state.GetString("chunk"), &g_state, true);
+
+    auto opcodes = reinterpret_cast<const char *>(f->GetOpCodes());
+    EXPECT_TRUE(opcodes > chunk.data() && opcodes < chunk.data() + chunk.size());
+    EXPECT_TRUE(f->OpCodeSize() == 3);
+    EXPECT_TRUE(luna::Instruction::GetOpCode(f->GetOpCodes()[2]) == luna::OpType_Ret);
+    EXPECT_TRUE(f->GetInstructionLine(1) == 2);
+    EXPECT_TRUE(*f->GetInlineCache(2) == 0);
+    EXPECT_TRUE(f->GetChildFunction(0)->OpCodeSize() == 1);
+}
+
+TEST_CASE(bytecode4)
+{
+    // Modules are compiled on worker threads and attached to state
+    std::vector<std::string> names;
+    for (int i = 0; i < 4; ++i)
+    {
+        auto name = "preload" + std::to_string(i) + ".lua";
+        std::ofstream(name) << "return " << i << " + 1";
+        names.push_back(name);
+    }
+
+    luna::State state;
+    state.PreloadModules(names, 2);
+    for (const auto &name : names)
+        EXPECT_TRUE(state.IsModuleLoaded(name));
+
+    // Other modules are loaded when one module fails
+    std::ofstream("preload4.lua") << "return )";
+    names.push_back("preload4.lua");
+    names.push_back("preload5.lua");
+
+    luna::State state2;
+    EXPECT_EXCEPTION(luna::ParseException, {
+        state2.PreloadModules(names);
+    });
+    EXPECT_TRUE(state2.IsModuleLoaded(names[3]));
+    EXPECT_TRUE(!state2.IsModuleLoaded(names[4]));
+    EXPECT_TRUE(!state2.IsModuleLoaded(names[5]));
+
+    for (std::size_t i = 0; i < names.size(); ++i)
+        std::remove(names[i].c_str());
+}
@@ -0,0 +1,319 @@
+#include "UnitTest.h"
+#include "luna/State.h"
+#include "luna/Table.h"
+#include "luna/String.h"
+#include "luna/Function.h"
+#include "luna/LibAPI.h"
+#include "luna/LibBase.h"
+#include "luna/Exception.h"
+#include <string>
+#include <tuple>
+#include <vector>
+
+namespace
+{
+    std::vector<std::string> g_records;
+
+    luna::Value GetGlobal(luna::State &state, const char *name)
+    {
+        luna::Value key(state.GetString(name));
+        return state.GetGlobal()->table_->GetValue(key);
+    }
+
+    double Add(double a, double b)
+    {
+        return a + b;
+    }
+
+    std::string Repeat(const std::string &str, int count)
+    {
+        std::string result;
+        for (int i = 0; i < count; ++i)
+            result += str;
+        return result;
+    }
+
+    void Record(const char *str)
+    {
+        g_records.push_back(str);
+    }
+
+    bool HasKey(luna::Table *table, luna::Value key)
+    {
+        return !table->GetValue(key).IsNil();
+    }
+} // namespace
+
+TEST_CASE(call1)
+{
+    luna::State state;
+    state.DoString("function add(a, b) return a + b end "
+                   "function cat(a, b) return a .. b end "
+                   "function set(v) value = v end "
+                   "function get() return value end "
+                   "function fail() local t = nil return t.x end");
+
+    auto add = GetGlobal(state, "add");
+    EXPECT_TRUE(state.Call<double>(add, 1, 2.5) == 3.5);
+    EXPECT_TRUE(state.Call<int>(add, 1, 2) == 3);
+    EXPECT_TRUE(state.Call<std::string>(GetGlobal(state, "cat"),
+                                        "a", std::string("b")) == "ab");
+
+    // Results are discarded for void, missing result is nil
+    state.Call(GetGlobal(state, "set"), true);
+    EXPECT_TRUE(state.Call<bool>(GetGlobal(state, "get")));
+    state.Call(GetGlobal(state, "set"));
+    EXPECT_TRUE(state.Call<luna::Value>(GetGlobal(state, "get")).IsNil());
+
+    // Wrong function or result type is reported without calling script
+    EXPECT_EXCEPTION(luna::CallCFuncException, {
+        state.Call(GetGlobal(state, "none"));
+    });
+    EXPECT_EXCEPTION(luna::CallCFuncException, {
+        state.Call<double>(GetGlobal(state, "cat"), "a", "b");
+    });
+    EXPECT_TRUE(state.Call<double>(add, 2, 2) == 4);
+
+    EXPECT_EXCEPTION(luna::RuntimeException, {
+        state.Call(GetGlobal(state, "fail"));
+    });
+}
+
+TEST_CASE(call2)
+{
+    luna::State state;
+    luna::Library lib(&state);
+    lib.RegisterFunc("add", LUNA_FUNCTION(Add));
+    lib.RegisterFunc("rep", LUNA_FUNCTION(Repeat));
+    lib.RegisterFunc("record", LUNA_FUNCTION(Record));
+    lib.RegisterFunc("haskey", LUNA_FUNCTION(HasKey));
+    g_records.clear();
+
+    state.DoString("record(rep('ab', add(1, 2))) "
+                   "if haskey({ x = 1 }, 'x') then record('x') end "
+                   "if not haskey({}, 'x') then record('none') end");
+    std::vector<std::string> expect = { "ababab", "x", "none" };
+    EXPECT_TRUE(g_records == expect);
+
+    // Bound function is also called by host directly
+    EXPECT_TRUE(state.Call<double>(GetGlobal(state, "add"), 3, 4) == 7);
+
+    const char *errors[] = {
+        "add(1)",
+        "add(1, 'x')",
+        "record(1)",
+    };
+    const char *messages[] = {
+        "expect 2 arguments",
+        "argument #2 is a string value, expect a number value",
+        "argument #1 is a number value, expect a string value",
+    };
+    for (int i = 0; i < 3; ++i)
+    {
+        luna::State state;
+        luna::Library lib(&state);
+        lib.RegisterFunc("add", LUNA_FUNCTION(Add));
+        lib.RegisterFunc("record", LUNA_FUNCTION(Record));
+        std::string what;
+        try
+        {
+            state.DoString(errors[i], "error");
+        }
+        catch (const luna::RuntimeException &e)
+        {
+            what = e.What();
+        }
+        EXPECT_TRUE(what.find(messages[i]) != std::string::npos);
+    }
+}
+
+TEST_CASE(call3)
+{
+    luna::State state;
+    state.DoString("count = 0 "
+                   "function scale(x, name) count = count + 1 return x * #name end");
+
+    std::vector<std::tuple<double, std::string>> args;
+    for (int i = 0; i < 1000; ++i)
+        args.push_back(std::make_tuple(i, std::string(i % 3 + 1, 'a')));
+
+    auto scale = GetGlobal(state, "scale");
+    std::vector<double> results(args.size());
+    state.CallBatch(scale, args.data(), args.size(), results.data());
+    for (int i = 0; i < 1000; ++i)
+        EXPECT_TRUE(results[i] == i * (i % 3 + 1));
+
+    state.CallBatch(scale, args.data(), args.size());
+    EXPECT_TRUE(state.Call<double>(GetGlobal(state, "scale"), 1, "") == 0);
+    EXPECT_TRUE(GetGlobal(state, "count").num_ == 2001);
+}
+
+TEST_CASE(call4)
+{
+    luna::State state;
+    state.SetChunkCacheSize(2);
+    state.DoString("count = 0");
+
+    // Strings are run again from the cache, chunks which are not used
+    // recently are dropped
+    std::string add = "count = count + 1";
+    for (int i = 0; i < 3; ++i)
+        state.DoString(add.data(), add.size(), "add");
+    state.DoString("count = count * 10", "mul");
+    state.DoString("local t = {} count = count + #t", "len");
+    state.GetGC().FullGC();
+    state.DoString(add.data(), add.size(), "add");
+    state.DoString("count = count * 10", "mul");
+    EXPECT_TRUE(GetGlobal(state, "count").num_ == 310);
+
+    // Strings are not cached after the cache is disabled
+    state.SetChunkCacheSize(0);
+    const char *prefix = "x = 1 + 2";
+    state.DoString(prefix, 5, "prefix");
+    EXPECT_TRUE(GetGlobal(state, "x").num_ == 1);
+    EXPECT_EXCEPTION(luna::ParseException, {
+        state.DoString(prefix, 7, "prefix");
+    });
+
+    // Errors are reported with the name of string
+    state.SetChunkCacheSize(1);
+    std::string what;
+    for (int i = 0; i < 2; ++i)
+    {
+        try
+        {
+            state.DoString("local t = nil return t.x", "fail");
+        }
+        catch (const luna::RuntimeException &e)
+        {
+            what = e.What();
+        }
+        EXPECT_TRUE(what.find("fail:1") != std::string::npos);
+    }
+}
+
+TEST_CASE(call5)
+{
+    const char *script =
+        "local base = 10\n"
+        "local obj = { n = 1 }\n"
+        "function obj:add(x) self.n = self.n + x + base return self.n end\n"
+        "local function counter()\n"
+        "    local c = 0\n"
+        "    return function(...) c = c + #{...} base = base + 1 return c end\n"
+        "end\n"
+        "function run()\n"
+        "    local f = counter()\n"
+        "    f(1, 2) f(3)\n"
+        "    return obj:add(f()) .. ',' .. base\n"
+        "end\n"
+        "function unused() return undefined.x end\n"
+        "function fail(t)\n"
+        "    local x = 1\n"
+        "    return t.x + x\n"
+        "end";
+
+    // Functions compiled on the first call run as functions compiled at
+    // load time, and report errors at the same lines
+    std::string results[2];
+    std::string errors[2];
+    for (int lazy = 0; lazy < 2; ++lazy)
+    {
+        luna::State state;
+        state.SetLazyCompile(lazy != 0);
+        state.DoString(script, "lazy");
+
+        auto unused = GetGlobal(state, "unused").closure_->GetPrototype();
+        EXPECT_TRUE((unused->GetLazySource() != nullptr) == (lazy != 0));
+
+        auto run = GetGlobal(state, "run");
+        results[lazy] = state.Call<std::string>(run);
+        EXPECT_TRUE(!run.closure_->GetPrototype()->GetLazySource());
+        state.GetGC().FullGC();
+        EXPECT_TRUE(state.Call<std::string>(run) == "36,16");
+
+        try
+        {
+            state.Call(GetGlobal(state, "fail"), luna::Value());
+        }
+        catch (const luna::RuntimeException &e)
+        {
+            errors[lazy] = e.What();
+        }
+    }
+
+    EXPECT_TRUE(results[0] == "17,13");
+    EXPECT_TRUE(results[1] == results[0]);
+    EXPECT_TRUE(errors[0].find("lazy:16") != std::string::npos);
+    EXPECT_TRUE(errors[1] == errors[0]);
+}
+
+TEST_CASE(call6)
+{
+    luna::State state;
+    lib::base::RegisterLibBase(&state);
+    state.DoString("function make(i) collectgarbage('collect') return { i } end");
+
+    auto tables = [&state]() {
+        luna::GCObjectCounts counts;
+        state.GetGC().FullGC();
+        state.GetGC().CountObjects(counts);
+        return counts.count_[luna::GCObjectType_Table];
+    };
+    auto before = tables();
+
+    // Tables returned are alive while later calls collect garbage
+    std::vector<std::tuple<int>> args;
+    for (int i = 0; i < 100; ++i)
+        args.push_back(std::make_tuple(i));
+
+    std::vector<luna::Table *> results(args.size());
+    state.CallBatch(GetGlobal(state, "make"), args.data(), args.size(),
+                    results.data());
+    for (int i = 0; i < 100; ++i)
+        EXPECT_TRUE(results[i]->GetValue(luna::Value(1.0)).num_ == i);
+
+    // Results are not rooted after the batch
+    EXPECT_TRUE(tables() == before);
+}
+
+TEST_CASE(call7)
+{
+    luna::State state;
+    state.SetLazyCompile(true);
+
+    // Function fails to compile on its first call after some code and
+    // child functions are generated
+    std::string script = "function big(x) local f = function() return x end ";
+    for (int i = 0; i < 300; ++i)
+        script += "local a" + std::to_string(i) + " = " + std::to_string(i) + " ";
+    script += "return f() end";
+    state.DoString(script, "big");
+
+    auto big = GetGlobal(state, "big");
+    auto proto = big.closure_->GetPrototype();
+    std::string errors[2];
+    for (int i = 0; i < 2; ++i)
+    {
+        try
+        {
+            state.Call(big, 1);
+        }
+        catch (const luna::CodeGenerateException &e)
+        {
+            errors[i] = e.What();
+        }
+
+        // Code generated partly is dropped, the function is compiled
+        // again on the next call
+        EXPECT_TRUE(proto->GetLazySource());
+        EXPECT_TRUE(proto->OpCodeSize() == 0);
+        EXPECT_TRUE(proto->GetConstValueCount() == 0);
+        EXPECT_TRUE(proto->GetChildFunctionCount() == 0);
+        EXPECT_TRUE(proto->GetLocalVarCount() == 0);
+        EXPECT_TRUE(proto->FixedArgCount() == 0);
+    }
+
+    EXPECT_TRUE(errors[0].find("big:1 ") == 0);
+    EXPECT_TRUE(errors[1] == errors[0]);
+}
@@ -5,35 +5,40 @@
 #include "luna/Parser.h"
 #include "luna/State.h"
 #include "luna/String.h"
-#include "luna/TextInStream.h"
 #include "luna/Exception.h"
 #include "luna/Visitor.h"
-#include <functional>
+#include "luna/LibAPI.h"
+#include <memory>
+#include <string>
+#include <vector>
 #include <type_traits>
+#include <stdio.h>
 
 class ParserWrapper
 {
 public:
     explicit ParserWrapper(const std::string &str = "")
-        : iss_(str), state_(), name_("parser"),
-          lexer_(&state_, &name_, std::bind(&io::text::InStringStream::GetChar, &iss_))
+        : state_(), name_("parser")
     {
+        SetInput(str);
     }
 
     void SetInput(const std::string &input)
     {
-        iss_.SetInputString(input);
+        str_ = input;
+        lexer_.reset(new luna::Lexer(&state_, &name_, str_.data(),
+                                     str_.data() + str_.size()));
     }
 
     bool IsEOF()
     {
         luna::TokenDetail detail;
-        return lexer_.GetToken(&detail) == luna::Token_EOF;
+        return lexer_->GetToken(&detail) == luna::Token_EOF;
     }
 
     std::unique_ptr<luna::SyntaxTree> Parse()
     {
-        return luna::Parse(&lexer_);
+        return luna::Parse(lexer_.get());
     }
 
     luna::State * GetState()
@@ -42,10 +47,10 @@ public:
     }
 
 private:
-    io::text::InStringStream iss_;
+    std::string str_;
     luna::State state_;
     luna::String name_;
-    luna::Lexer lexer_;
+    std::unique_ptr<luna::Lexer> lexer_;
 };
 
 #define MATCH_AST_TYPE(ast, not_match_stmt)                             \
@@ -384,4 +389,59 @@ struct AcceptAST
     { return true; }
 };
 
+// Args of script function 'record(...)' registered by RegisterRecord,
+// each arg is appended to both lists
+struct Records
+{
+    // Number of arg, -1 when arg is not a number
+    std::vector<double> numbers_;
+    // String of arg, numbers are formatted by "%.14g", other values
+    // are their type names
+    std::vector<std::string> strings_;
+
+    void Clear()
+    {
+        numbers_.clear();
+        strings_.clear();
+    }
+};
+
+inline Records & GetRecords()
+{
+    static Records records;
+    return records;
+}
+
+inline int Record(luna::State *state)
+{
+    luna::StackAPI api(state);
+    auto &records = GetRecords();
+    for (int i = 0; i < api.GetStackSize(); ++i)
+    {
+        auto type = api.GetValueType(i);
+        if (type == luna::ValueT_Number)
+        {
+            char buffer[32];
+            snprintf(buffer, sizeof(buffer), "%.14g", api.GetNumber(i));
+            records.numbers_.push_back(api.GetNumber(i));
+            records.strings_.push_back(buffer);
+        }
+        else
+        {
+            records.numbers_.push_back(-1);
+            records.strings_.push_back(type == luna::ValueT_String ?
+                api.GetCString(i) : luna::Value::TypeName(type));
+        }
+    }
+    return 0;
+}
+
+// Register 'record' function into 'state' and clear records
+inline void RegisterRecord(luna::State *state)
+{
+    luna::Library lib(state);
+    lib.RegisterFunc("record", Record);
+    GetRecords().Clear();
+}
+
 #endif // TEST_COMMON_H
@@ -0,0 +1,145 @@
+#include "UnitTest.h"
+#include "TestCommon.h"
+#include "luna/State.h"
+#include "luna/LibAPI.h"
+#include "luna/LibCoroutine.h"
+#include "luna/Exception.h"
+#include <string>
+#include <vector>
+
+namespace
+{
+    void Init(luna::State *state)
+    {
+        RegisterRecord(state);
+        lib::coroutine::RegisterLibCoroutine(state);
+    }
+} // namespace
+
+TEST_CASE(coroutine1)
+{
+    luna::State state;
+    Init(&state);
+
+    state.DoString(
+        "local co = coroutine.create(function(a) "
+        "    local b = coroutine.yield(a + 1) "
+        "    local c, d = coroutine.yield(b * 2) "
+        "    return c + d "
+        "end) "
+        "record(coroutine.resume(co, 1)) "
+        "record(coroutine.resume(co, 5)) "
+        "record(coroutine.resume(co, 3, 4)) "
+        "local ok = coroutine.resume(co) "
+        "if not ok then record(0) end");
+
+    // Bool results of resume are recorded as -1
+    std::vector<double> expect = { -1, 2, -1, 10, -1, 7, 0 };
+    EXPECT_TRUE(GetRecords().numbers_ == expect);
+}
+
+TEST_CASE(coroutine2)
+{
+    luna::State state;
+    Init(&state);
+
+    // Generator keeps its frames between resumes
+    state.DoString(
+        "local gen = coroutine.wrap(function() "
+        "    for i = 1, 3 do coroutine.yield(i) end "
+        "end) "
+        "record(gen(), gen(), gen())");
+
+    std::vector<double> expect = { 1, 2, 3 };
+    EXPECT_TRUE(GetRecords().numbers_ == expect);
+
+    // Yield outside coroutine is an error
+    EXPECT_EXCEPTION(luna::RuntimeException, {
+        state.DoString("coroutine.yield(1)");
+    });
+}
+
+TEST_CASE(coroutine3)
+{
+    luna::State state;
+    Init(&state);
+
+    // Suspended coroutines which refer to themselves are collected
+    state.DoString(
+        "for i = 1, 1000 do "
+        "    local co = coroutine.create(function() "
+        "        local me = coroutine.running() "
+        "        coroutine.yield() "
+        "    end) "
+        "    coroutine.resume(co) "
+        "    local co2 "
+        "    co2 = coroutine.create(function() coroutine.yield(co2) end) "
+        "    coroutine.resume(co2) "
+        "end");
+
+    auto &gc = state.GetGC();
+    gc.FullGC();
+    luna::GCObjectCounts counts;
+    gc.CountObjects(counts);
+    EXPECT_TRUE(counts.count_[luna::GCObjectType_UserData] == 0);
+
+    // Open upvalues keep suspended coroutine alive, new coroutines
+    // delete the ones whose handles are collected
+    state.DoString(
+        "local co = coroutine.create(function() "
+        "    local t = { 1 } "
+        "    get = function() return t[1] end "
+        "    set = function(v) t[1] = v end "
+        "    coroutine.yield() "
+        "end) "
+        "coroutine.resume(co)");
+    gc.FullGC();
+    state.DoString("coroutine.create(function() end) set(2) record(get())");
+
+    counts = luna::GCObjectCounts();
+    gc.FullGC();
+    gc.CountObjects(counts);
+    EXPECT_TRUE(counts.count_[luna::GCObjectType_UserData] == 1);
+
+    state.DoString("get = nil set = nil");
+    gc.FullGC();
+    state.DoString("coroutine.create(function() end)");
+
+    counts = luna::GCObjectCounts();
+    gc.FullGC();
+    gc.CountObjects(counts);
+    EXPECT_TRUE(counts.count_[luna::GCObjectType_UserData] == 0);
+
+    std::vector<double> expect = { 2 };
+    EXPECT_TRUE(GetRecords().numbers_ == expect);
+}
+
+TEST_CASE(coroutine4)
+{
+    luna::State state;
+    Init(&state);
+
+    // Errors of wrapped coroutines are raised as they are, without
+    // position of the wrap function
+    std::string scripts[] = {
+        "local f = coroutine.wrap(function() local x = {} x.y.z = 1 end) f()",
+        "local f = coroutine.wrap(function() end) f() f()"
+    };
+    std::string expect[] = {
+        "wrap1:1 attempt to set table key 'z' to table member 'y' (a nil value)",
+        "cannot resume dead coroutine"
+    };
+    for (int i = 0; i < 2; ++i)
+    {
+        std::string what;
+        try
+        {
+            state.DoString(scripts[i], "wrap" + std::to_string(i + 1));
+        }
+        catch (const luna::RuntimeException &e)
+        {
+            what = e.What();
+        }
+        EXPECT_TRUE(what == expect[i]);
+    }
+}
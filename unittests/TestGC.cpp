@@ -0,0 +1,503 @@
+#include "UnitTest.h"
+#include "TestCommon.h"
+#include "luna/GC.h"
+#include "luna/State.h"
+#include "luna/LibBase.h"
+#include "luna/LibTable.h"
+#include "luna/Table.h"
+#include "luna/Value.h"
+#include "luna/Exception.h"
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+namespace
+{
+    // Count deleted objects which are expected alive
+    struct CheckDeleter
+    {
+        std::unordered_set<luna::GCObject *> *alive_;
+        int *error_count_;
+
+        void operator () (luna::GCObject *obj, unsigned int) const
+        {
+            if (alive_->count(obj) != 0)
+                ++*error_count_;
+        }
+    };
+
+    luna::Value TableValue(luna::Table *table)
+    {
+        luna::Value value;
+        value.type_ = luna::ValueT_Table;
+        value.table_ = table;
+        return value;
+    }
+
+    void StoreTable(luna::GC &gc, luna::Table *table,
+                    luna::Table *key, luna::Table *value)
+    {
+        table->SetValue(TableValue(key), TableValue(value));
+        CHECK_BARRIER(gc, table);
+    }
+
+    luna::Value NumberValue(double num)
+    {
+        luna::Value value;
+        value.type_ = luna::ValueT_Number;
+        value.num_ = num;
+        return value;
+    }
+
+    void StoreTable(luna::GC &gc, luna::Table *table,
+                    double key, luna::Table *value_table)
+    {
+        luna::Value key_value;
+        key_value.type_ = luna::ValueT_Number;
+        key_value.num_ = key;
+
+        luna::Value value;
+        value.type_ = luna::ValueT_Table;
+        value.table_ = value_table;
+
+        table->SetValue(key_value, value);
+        CHECK_BARRIER_VALUE(gc, table, value);
+    }
+
+    // Count bytes allocated and not freed yet
+    class CountAllocator : public luna::Allocator
+    {
+    public:
+        CountAllocator() : bytes_(0) { }
+
+        virtual void * Alloc(std::size_t size)
+        {
+            bytes_ += size;
+            return ::operator new(size);
+        }
+
+        virtual void Free(void *ptr, std::size_t size)
+        {
+            bytes_ -= size;
+            ::operator delete(ptr);
+        }
+
+        std::size_t bytes_;
+    };
+
+    // Return count of alive tables which are deleted
+    int StoreYoungTables(bool background_sweep)
+    {
+        std::unordered_set<luna::GCObject *> alive;
+        int error_count = 0;
+        luna::GC gc(CheckDeleter{ &alive, &error_count });
+        gc.SetMajorStepBudget(64, 0);
+        gc.SetBackgroundSweep(background_sweep);
+
+        auto old = gc.NewTable(luna::GCGen2);
+        auto root = [old](luna::GCObjectVisitor *v) { old->Accept(v); };
+        gc.SetRootTraveller(root, root);
+        alive.insert(old);
+
+        // Store young tables into old table and the tables stored before,
+        // all tables are alive through minor and major GCs
+        luna::Table *last = old;
+        for (int i = 0; i < 300000; ++i)
+        {
+            auto table = gc.NewTable();
+            if (i % 3 == 0)
+            {
+                StoreTable(gc, old, i / 3 + 1, table);
+                alive.insert(table);
+                last = table;
+            }
+            else if (i % 3 == 1)
+            {
+                StoreTable(gc, last, 1, table);
+                alive.insert(table);
+            }
+            gc.CheckGC();
+        }
+
+        alive.clear();
+        return error_count;
+    }
+} // namespace
+
+TEST_CASE(gc1)
+{
+    std::unordered_set<luna::GCObject *> alive;
+    int error_count = 0;
+    luna::GC gc(CheckDeleter{ &alive, &error_count });
+
+    auto old = gc.NewTable(luna::GCGen2);
+    auto young = gc.NewTable();
+    auto root = [old](luna::GCObjectVisitor *v) { old->Accept(v); };
+    gc.SetRootTraveller(root, root);
+
+    EXPECT_TRUE(luna::CheckBarrier(old, young));
+    EXPECT_TRUE(!luna::CheckBarrier(young, old));
+
+    // Young table is only referenced by old table
+    StoreTable(gc, old, 1, young);
+    alive.insert(old);
+    alive.insert(young);
+
+    for (int i = 0; i < 10000; ++i)
+    {
+        gc.NewTable();
+        gc.CheckGC();
+    }
+
+    EXPECT_TRUE(error_count == 0);
+    alive.clear();
+}
+
+TEST_CASE(gc3)
+{
+    luna::GC gc;
+    auto old = gc.NewTable(luna::GCGen2);
+    auto root = [old](luna::GCObjectVisitor *v) { old->Accept(v); };
+    gc.SetRootTraveller(root, root);
+
+    // Memory of array part is accounted
+    auto bytes = gc.GetTotalBytes();
+    auto garbage = gc.NewTable();
+    for (int i = 0; i < 1000; ++i)
+        StoreTable(gc, garbage, i + 1, old);
+    EXPECT_TRUE(gc.GetTotalBytes() >= bytes + 1000 * sizeof(luna::Value));
+
+    gc.FullGC();
+    EXPECT_TRUE(gc.GetTotalBytes() == bytes);
+
+    // Alive objects reach the heap limit
+    gc.SetHeapLimit(bytes + 64 * 1024);
+    bool memory_error = false;
+    try
+    {
+        for (int i = 0; i < 100000; ++i)
+        {
+            StoreTable(gc, old, i + 1, gc.NewTable());
+            gc.CheckGC();
+        }
+    }
+    catch (const luna::MemoryException &)
+    {
+        memory_error = true;
+    }
+    EXPECT_TRUE(memory_error);
+    EXPECT_TRUE(gc.GetTotalBytes() < bytes + 128 * 1024);
+}
+
+TEST_CASE(gc2)
+{
+    EXPECT_TRUE(StoreYoungTables(false) == 0);
+}
+
+TEST_CASE(gc4)
+{
+    EXPECT_TRUE(StoreYoungTables(true) == 0);
+}
+
+TEST_CASE(gc5)
+{
+    std::unordered_set<luna::GCObject *> alive;
+    int error_count = 0;
+    luna::GC gc(CheckDeleter{ &alive, &error_count });
+
+    auto old = gc.NewTable(luna::GCGen2);
+    auto root = [old](luna::GCObjectVisitor *v) { old->Accept(v); };
+    gc.SetRootTraveller(root, root);
+
+    // Marking of deep nested tables does not recurse
+    auto last = old;
+    for (int i = 0; i < 200000; ++i)
+    {
+        auto table = gc.NewTable();
+        StoreTable(gc, last, 1, table);
+        alive.insert(table);
+        last = table;
+    }
+
+    gc.CheckGC();
+    gc.FullGC();
+
+    EXPECT_TRUE(error_count == 0);
+    alive.clear();
+}
+
+TEST_CASE(gc6)
+{
+    std::unordered_set<luna::GCObject *> alive;
+    int error_count = 0;
+    luna::GC gc(CheckDeleter{ &alive, &error_count });
+    auto root = [](luna::GCObjectVisitor *) { };
+    gc.SetRootTraveller(root, root);
+
+    // Permanent tables are alive without roots
+    auto permanent = gc.NewTable();
+    auto member = gc.NewTable();
+    StoreTable(gc, permanent, 1, member);
+    gc.SetPermanent(permanent);
+    alive.insert(permanent);
+    alive.insert(member);
+
+    // Young tables stored into permanent member table are alive
+    for (int i = 0; i < 100000; ++i)
+    {
+        auto table = gc.NewTable();
+        if (i % 100 == 0)
+        {
+            StoreTable(gc, member, i / 100 + 1, table);
+            alive.insert(table);
+        }
+        gc.CheckGC();
+    }
+
+    gc.FullGC();
+    EXPECT_TRUE(error_count == 0);
+
+    // Released table could be collected, member is still permanent
+    auto bytes = gc.GetTotalBytes();
+    alive.erase(permanent);
+    gc.ReleasePermanent(permanent);
+    gc.FullGC();
+    EXPECT_TRUE(error_count == 0);
+    EXPECT_TRUE(gc.GetTotalBytes() < bytes);
+    alive.clear();
+}
+
+TEST_CASE(gc7)
+{
+    luna::GC gc;
+    auto old = gc.NewTable(luna::GCGen2);
+    auto root = [old](luna::GCObjectVisitor *v) { old->Accept(v); };
+    gc.SetRootTraveller(root, root);
+
+    std::size_t callbacks = 0;
+    std::size_t freed = 0;
+    gc.SetCallback([&](const luna::GCRunStats &run) {
+        ++callbacks;
+        freed += run.freed_objects_[luna::GCGen0];
+    });
+
+    // 10 tables are alive and others are garbage
+    for (int i = 0; i < 100000; ++i)
+    {
+        auto table = gc.NewTable();
+        if (i % 10000 == 0)
+            StoreTable(gc, old, i / 10000 + 1, table);
+        gc.CheckGC();
+    }
+    gc.FullGC();
+
+    const auto &stats = gc.GetStats();
+    std::size_t runs = 0;
+    for (auto count : stats.runs_)
+        runs += count;
+    EXPECT_TRUE(runs == callbacks);
+    EXPECT_TRUE(stats.runs_[luna::GCKind_Minor] > 0);
+    EXPECT_TRUE(stats.runs_[luna::GCKind_Full] == 1);
+    EXPECT_TRUE(stats.freed_objects_[luna::GCGen0] == freed);
+    EXPECT_TRUE(stats.promoted_objects_ >= 10);
+    EXPECT_TRUE(gc.GetLastRunStats().kind_ == luna::GCKind_Full);
+    EXPECT_TRUE(gc.GetLastRunStats().gen0_threshold_after_ > 0);
+
+    // Dead tables are freed by the full GC
+    luna::GCObjectCounts counts;
+    gc.CountObjects(counts);
+    EXPECT_TRUE(counts.count_[luna::GCObjectType_Table] == 11);
+    EXPECT_TRUE(counts.TotalBytes() == counts.bytes_[luna::GCObjectType_Table]);
+
+    luna::GCObjectCounts reachable;
+    gc.CountReachable(old, reachable);
+    EXPECT_TRUE(reachable.TotalCount() == 11);
+    EXPECT_TRUE(std::string(luna::GetGCObjectTypeName(luna::GCObjectType_Table)) == "table");
+}
+
+TEST_CASE(gc8)
+{
+    luna::State state;
+    state.DoString("t = {} for i = 1, 100 do t[i] = {} end");
+    state.GetGC().FullGC();
+
+    luna::HeapSnapshot snapshot;
+    state.GetHeapSnapshot(snapshot);
+    EXPECT_TRUE(snapshot.objects_.count_[luna::GCObjectType_Table] >= 101);
+    EXPECT_TRUE(snapshot.total_bytes_ >= snapshot.objects_.TotalBytes());
+    EXPECT_TRUE(snapshot.modules_.empty());
+    EXPECT_TRUE(state.GetGCStats().runs_[luna::GCKind_Full] == 1);
+}
+
+TEST_CASE(gc9)
+{
+    // Small threshold of minor GC runs more minor GCs
+    auto count_minor = [](const luna::GCConfig &config) {
+        luna::State state(config);
+        state.DoString("for i = 1, 100000 do local t = {} end");
+        return state.GetGCStats().runs_[luna::GCKind_Minor];
+    };
+
+    luna::GCConfig config;
+    auto default_runs = count_minor(config);
+    config.gen0_init_threshold_bytes_ = 16 * 1024;
+    config.gen0_max_threshold_bytes_ = 16 * 1024;
+    EXPECT_TRUE(count_minor(config) > default_runs);
+
+    // Factors out of range are adjusted
+    config.gen0_grow_factor_ = 0;
+    config.gen0_shrink_factor_ = 0;
+    luna::State state(config);
+    EXPECT_TRUE(state.GetGC().GetConfig().gen0_grow_factor_ == 1);
+    EXPECT_TRUE(state.GetGC().GetConfig().gen0_shrink_factor_ == 2);
+
+    // GC does not run when it is stopped by script
+    lib::base::RegisterLibBase(&state);
+    state.DoString("collectgarbage('stop')");
+    auto runs = state.GetGCStats().runs_[luna::GCKind_Minor];
+    state.DoString("for i = 1, 100000 do local t = {} end");
+    EXPECT_TRUE(state.GetGCStats().runs_[luna::GCKind_Minor] == runs);
+    EXPECT_TRUE(state.GetGC().IsStopped());
+
+    state.DoString("collectgarbage('restart') collectgarbage()");
+    EXPECT_TRUE(!state.GetGC().IsStopped());
+    EXPECT_TRUE(state.GetGCStats().runs_[luna::GCKind_Full] == 1);
+
+    EXPECT_EXCEPTION(luna::RuntimeException, {
+        state.DoString("collectgarbage('unknown')");
+    });
+}
+
+TEST_CASE(gc10)
+{
+    CountAllocator allocator;
+    const std::size_t limit = 1024 * 1024;
+    const char *scripts[] = {
+        "t = {} for i = 1, 1000000 do t[i] = {} end",
+        "local s = 'string' while true do s = s .. s end",
+    };
+
+    for (auto script : scripts)
+    {
+        luna::State state(luna::GCConfig(), &allocator);
+        lib::base::RegisterLibBase(&state);
+        state.SetHeapLimit(limit);
+        EXPECT_TRUE(allocator.bytes_ > 0);
+
+        // Garbage does not reach the limit
+        state.DoString("for i = 1, 100000 do local t = {} end");
+
+        // Alive objects reach the limit, heap never exceeds it
+        EXPECT_EXCEPTION(luna::MemoryException, {
+            state.DoString(script);
+        });
+        EXPECT_TRUE(state.GetPeakMemoryBytes() <= limit);
+        EXPECT_TRUE(state.GetMemoryBytes() <= state.GetPeakMemoryBytes());
+    }
+
+    // All memory is freed to the allocator
+    EXPECT_TRUE(allocator.bytes_ == 0);
+}
+
+TEST_CASE(gc11)
+{
+    std::unordered_set<luna::GCObject *> deleted;
+    luna::GC gc([&deleted](luna::GCObject *obj, unsigned int) {
+        deleted.insert(obj);
+    });
+
+    auto root = gc.NewTable(luna::GCGen2);
+    auto traveller = [root](luna::GCObjectVisitor *v) { root->Accept(v); };
+    gc.SetRootTraveller(traveller, traveller);
+
+    auto values = gc.NewTable();
+    auto keys = gc.NewTable();
+    auto alive = gc.NewTable();
+    values->SetWeakMode(luna::WeakMode_Value);
+    keys->SetWeakMode(luna::WeakMode_Key);
+    StoreTable(gc, root, 1, values);
+    StoreTable(gc, root, 2, keys);
+    StoreTable(gc, root, 3, alive);
+
+    auto dead = gc.NewTable();
+    StoreTable(gc, values, 1, alive);
+    StoreTable(gc, values, 2, dead);
+
+    // Value of alive key is alive, the key in it keeps its value alive,
+    // value which references its own key does not keep the key alive
+    auto kept = gc.NewTable();
+    auto kept_value = gc.NewTable();
+    auto dead_key = gc.NewTable();
+    auto dead_value = gc.NewTable();
+    StoreTable(gc, keys, kept, kept_value);
+    StoreTable(gc, keys, alive, kept);
+    StoreTable(gc, keys, dead_key, dead_value);
+    StoreTable(gc, dead_value, 1, dead_key);
+
+    gc.FullGC();
+    EXPECT_TRUE(values->GetValue(NumberValue(1)) == TableValue(alive));
+    EXPECT_TRUE(values->GetValue(NumberValue(2)).IsNil());
+    EXPECT_TRUE(keys->GetValue(TableValue(alive)) == TableValue(kept));
+    EXPECT_TRUE(keys->GetValue(TableValue(kept)) == TableValue(kept_value));
+    EXPECT_TRUE(keys->GetValue(TableValue(dead_key)).IsNil());
+    EXPECT_TRUE(deleted.size() == 3);
+    EXPECT_TRUE(deleted.count(dead) && deleted.count(dead_key) &&
+                deleted.count(dead_value));
+
+    // Young value of old weak table is removed by minor GC
+    int minor_runs = 0;
+    gc.SetCallback([&minor_runs](const luna::GCRunStats &stats) {
+        if (stats.kind_ == luna::GCKind_Minor)
+            ++minor_runs;
+    });
+
+    auto young = gc.NewTable();
+    StoreTable(gc, values, 3, young);
+    while (minor_runs == 0)
+    {
+        gc.NewTable();
+        gc.CheckGC();
+    }
+    EXPECT_TRUE(values->GetValue(NumberValue(3)).IsNil());
+    EXPECT_TRUE(deleted.count(young) == 1);
+    EXPECT_TRUE(values->GetValue(NumberValue(1)) == TableValue(alive));
+}
+
+TEST_CASE(gc12)
+{
+    luna::State state;
+    RegisterRecord(&state);
+    lib::base::RegisterLibBase(&state);
+    lib::table::RegisterLibTable(&state);
+
+    // Strings are never removed from weak tables, entries of dead keys
+    // and values are removed from array part, shape slots and hash table
+    state.DoString(
+        "local cache = table.setweak({}, 'k') "
+        "local names = table.setweak({}, 'v') "
+        "local function count(t) "
+        "    local n = 0 for k, v in pairs(t) do n = n + 1 end return n "
+        "end "
+        "local function fill(key) "
+        "    cache[key] = { key } cache[{}] = 1 cache['s'] = {} "
+        "    names[1] = {} names[2] = key names.s = 's' .. 1 names.t = {} "
+        "    names[{}] = 1 "
+        "end "
+        "local key = {} "
+        "fill(key) "
+        "record(count(cache) .. ',' .. count(names)) "
+        "collectgarbage() "
+        "record(count(cache) .. ',' .. count(names)) "
+        "key = nil fill(1) fill(2) "
+        "collectgarbage() "
+        "record(count(cache) .. ',' .. count(names)) ");
+
+    std::vector<std::string> expect = { "3,5", "2,3", "3,5" };
+    EXPECT_TRUE(GetRecords().strings_ == expect);
+
+    EXPECT_EXCEPTION(luna::RuntimeException, {
+        luna::State state;
+        lib::table::RegisterLibTable(&state);
+        state.DoString("table.setweak({}, 'x')");
+    });
+}
@@ -0,0 +1,73 @@
+#include "UnitTest.h"
+#include "luna/State.h"
+#include "luna/Function.h"
+#include "luna/Exception.h"
+#include "luna/LibBase.h"
+#include <string>
+#include <vector>
+
+TEST_CASE(hook1)
+{
+    luna::State state;
+    std::vector<int> lines;
+    state.SetHook(luna::HookMask_Line, 0,
+                  [&](luna::State *, const luna::HookInfo &info) {
+                      lines.push_back(info.line_);
+                  });
+
+    // Loop body in one line is a new line event in every iteration
+    state.DoString("local a = 0\n"
+                   "for i = 1, 3 do a = a + i end\n"
+                   "local b = a\n", "lines");
+    std::vector<int> expect = { 1, 2, 2, 2, 3 };
+    EXPECT_TRUE(lines == expect);
+
+    // Hook removed
+    state.SetHook(0, 0, luna::State::HookCallback());
+    lines.clear();
+    state.DoString("local a = 1\n", "lines");
+    EXPECT_TRUE(lines.empty());
+    EXPECT_TRUE(state.GetHookMask() == 0);
+}
+
+TEST_CASE(hook2)
+{
+    luna::State state;
+    lib::base::RegisterLibBase(&state);
+    std::string events;
+    state.SetHook(luna::HookMask_Call | luna::HookMask_Return, 0,
+                  [&](luna::State *, const luna::HookInfo &info) {
+                      events += info.event_ == luna::HookEvent_Call ? "c" : "r";
+                      events += info.function_ ?
+                          std::to_string(info.line_) : std::string("C");
+                  });
+
+    state.DoString("local function f()\n"
+                   "    return type(1)\n"
+                   "end\n"
+                   "f()\n", "calls");
+    EXPECT_TRUE(events == "c1c1cCrCr1r1");
+}
+
+TEST_CASE(hook3)
+{
+    // Count hook stops the script when the instruction budget runs out
+    luna::State state;
+    int budget = 10000;
+    state.SetHook(luna::HookMask_Count, 100,
+                  [&](luna::State *, const luna::HookInfo &) {
+                      budget -= 100;
+                      if (budget <= 0)
+                          throw luna::CallCFuncException("instruction budget exceeded");
+                  });
+
+    EXPECT_EXCEPTION(luna::RuntimeException, {
+        state.DoString("while true do end", "loop");
+    });
+    EXPECT_TRUE(budget <= 0);
+
+    // State is usable after the hook stopped the script
+    budget = 10000;
+    state.DoString("local a = 0 for i = 1, 10 do a = a + i end", "short");
+    EXPECT_TRUE(budget > 0);
+}
@@ -0,0 +1,65 @@
+#include "UnitTest.h"
+#include "luna/Host.h"
+#include "luna/State.h"
+#include "luna/LibAPI.h"
+#include <atomic>
+
+namespace
+{
+    std::atomic<int> g_sum(0);
+
+    int Add(luna::State *state)
+    {
+        luna::StackAPI api(state);
+        if (!api.CheckArgs(1, luna::ValueT_Number))
+            return 0;
+
+        g_sum += static_cast<int>(api.GetNumber(0));
+        return 0;
+    }
+
+    void Init(luna::State *state)
+    {
+        luna::Library lib(state);
+        lib.RegisterFunc("add", Add);
+    }
+} // namespace
+
+TEST_CASE(host1)
+{
+    g_sum = 0;
+    luna::Host host(4, Init);
+    EXPECT_TRUE(host.GetThreadCount() == 4);
+
+    for (int i = 1; i <= 100; ++i)
+    {
+        host.Submit([i](luna::State *state) {
+            state->DoString("local n = 0 for i = 1, " + std::to_string(i) +
+                            " do n = n + i end add(n)");
+        });
+    }
+
+    EXPECT_TRUE(host.Wait() == 0);
+    EXPECT_TRUE(g_sum == 171700);
+}
+
+TEST_CASE(host2)
+{
+    // Failed jobs are counted, workers keep running with new states
+    g_sum = 0;
+    luna::Host host(2, Init, { "add", "print" });
+
+    for (int i = 0; i < 10; ++i)
+    {
+        host.Submit([i](luna::State *state) {
+            state->DoString(i % 2 ? "add(1)" : "add(nil)");
+        });
+    }
+
+    EXPECT_TRUE(host.Wait() == 5);
+    EXPECT_TRUE(g_sum == 5);
+
+    host.Submit([](luna::State *state) { state->DoString("add(2)"); });
+    host.Join();
+    EXPECT_TRUE(g_sum == 7);
+}
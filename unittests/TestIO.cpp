@@ -0,0 +1,218 @@
+#include "UnitTest.h"
+#include "TestCommon.h"
+#include "luna/State.h"
+#include "luna/GC.h"
+#include "luna/Exception.h"
+#include "luna/LibIO.h"
+#include "luna/LibBase.h"
+#include "luna/LibString.h"
+#include "luna/LibTable.h"
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdlib.h>
+#include <unistd.h>
+
+namespace
+{
+    void Init(luna::State *state)
+    {
+        RegisterRecord(state);
+        lib::base::RegisterLibBase(state);
+        lib::io::RegisterLibIO(state);
+        lib::string::RegisterLibString(state);
+        lib::table::RegisterLibTable(state);
+    }
+
+    // Path of 'fd' which could be opened by io.open
+    std::string FdPath(int fd)
+    {
+        return "/dev/fd/" + std::to_string(fd);
+    }
+
+    // Write 'pieces' into 'fd' with delays, and close it, return false
+    // when write failed
+    bool WriteSlowly(int fd, const std::vector<std::string> &pieces)
+    {
+        bool ok = true;
+        for (const auto &piece : pieces)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            ok = ok && write(fd, piece.data(), piece.size()) ==
+                       static_cast<ssize_t>(piece.size());
+        }
+        close(fd);
+        return ok;
+    }
+} // namespace
+
+TEST_CASE(io1)
+{
+    luna::State state;
+    Init(&state);
+
+    // Two pipes are written by another thread slowly, the third one is
+    // written and read by coroutines, data written is larger than the
+    // buffer of pipe
+    int p1[2], p2[2], p3[2];
+    EXPECT_TRUE(pipe(p1) == 0 && pipe(p2) == 0 && pipe(p3) == 0);
+
+    state.DoString(
+        "a = io.open('" + FdPath(p1[0]) + "', 'r'):setnonblocking() "
+        "b = io.open('" + FdPath(p2[0]) + "', 'r'):setnonblocking() "
+        "r = io.open('" + FdPath(p3[0]) + "', 'r'):setnonblocking() "
+        "w = io.open('" + FdPath(p3[1]) + "', 'w'):setnonblocking() "
+        "io.run()");
+
+    // Files of script refer to the pipes, then the pipes are closed
+    // when the files are closed
+    close(p1[0]);
+    close(p2[0]);
+    close(p3[0]);
+    close(p3[1]);
+
+    auto handles = [&state]() {
+        luna::GCObjectCounts counts;
+        state.GetGC().FullGC();
+        state.GetGC().CountObjects(counts);
+        return counts.count_[luna::GCObjectType_UserData];
+    };
+    auto before = handles();
+
+    bool written1 = false, written2 = false;
+    std::thread writer([&]() {
+        written1 = WriteSlowly(p1[1], { "fir", "st\nsec", "ond\n", "ab", "cdef\n", "rest" });
+        written2 = WriteSlowly(p2[1], { "b1", "b2" });
+    });
+
+    state.DoString(
+        "local ra, rb, rr = {}, {}, {} "
+        "io.spawn(function() "
+        "    ra[1], ra[2] = a:read('*l', '*L') "
+        "    ra[3], ra[4] = a:read(3, '*l') "
+        "    ra[5] = a:read('*a') "
+        "    ra[6] = a:read('*l') "
+        "    a:close() "
+        "end) "
+        "io.spawn(function() rb[1] = b:read('*a') b:close() end) "
+        "io.spawn(function() "
+        "    local s = 'x' "
+        "    for i = 1, 17 do s = s .. s end "
+        "    rr[1] = w:write(s, 'y') == w "
+        "    w:close() "
+        "end) "
+        "io.spawn(function() "
+        "    local s = r:read('*a') "
+        "    rr[2], rr[3] = #s, string.sub(s, -2) "
+        "    r:close() "
+        "end) "
+        "io.run() "
+        "record(ra[1], ra[2], ra[3], ra[4], ra[5], ra[6]) "
+        "record(rb[1]) "
+        "record(rr[1] and 'written', rr[2], rr[3])");
+    writer.join();
+    EXPECT_TRUE(written1 && written2);
+
+    std::vector<std::string> expect = {
+        "first", "second\n", "abc", "def", "rest", "nil",
+        "b1b2",
+        "written", "131073", "xy"
+    };
+    EXPECT_TRUE(GetRecords().strings_ == expect);
+
+    // Dead coroutines are not rooted by the event loop
+    EXPECT_TRUE(handles() == before);
+}
+
+TEST_CASE(io2)
+{
+    luna::State state;
+    Init(&state);
+
+    // Lines of files with and without the trailing newline
+    char path[] = "/tmp/luna_test_io_XXXXXX";
+    auto fd = mkstemp(path);
+    EXPECT_TRUE(fd >= 0);
+    close(fd);
+
+    std::string open = std::string("io.open('") + path + "', ";
+    state.DoString(
+        "local function lines(content, ...) "
+        "    local f = " + open + "'w') "
+        "    f:write(content) "
+        "    f:close() "
+        "    f = " + open + "'r') "
+        "    local t = {} "
+        "    for line in f:lines(...) do t[#t + 1] = line end "
+        "    f:close() "
+        "    record(#t, table.unpack(t)) "
+        "end "
+        "lines('a\\nb\\n\\nc') "
+        "lines('a\\nb\\n\\nc\\n') "
+        "lines('a\\nb\\n\\nc', '*L') "
+        "lines('a\\nb\\n\\nc\\n', '*L') "
+        "lines('', '*l')");
+
+    std::vector<std::string> expect = {
+        "4", "a", "b", "", "c",
+        "4", "a", "b", "", "c",
+        "4", "a\n", "b\n", "\n", "c",
+        "4", "a\n", "b\n", "\n", "c\n",
+        "0"
+    };
+    EXPECT_TRUE(GetRecords().strings_ == expect);
+
+    // Other formats are not supported by lines
+    EXPECT_EXCEPTION(luna::RuntimeException, {
+        state.DoString("local f = " + open + "'r') f:lines('*n')");
+    });
+    EXPECT_EXCEPTION(luna::RuntimeException, {
+        state.DoString("local f = " + open + "'r') f:lines('*a')");
+    });
+    EXPECT_EXCEPTION(luna::RuntimeException, {
+        state.DoString("local f = " + open + "'r') f:lines(1)");
+    });
+
+    // Closed file can not be read by lines, nor by the iterator
+    state.DoString("local f = " + open + "'w') f:write('a\\nb\\n') f:close()");
+    std::string closed[] = {
+        "local f = " + open + "'r') f:close() for l in f:lines() do end",
+        "local f = " + open + "'r') for l in f:lines() do f:close() end"
+    };
+    for (const auto &script : closed)
+    {
+        std::string what;
+        try
+        {
+            state.DoString(script);
+        }
+        catch (const luna::RuntimeException &e)
+        {
+            what = e.What();
+        }
+        EXPECT_TRUE(what.find("attempt to use a closed file") != std::string::npos);
+    }
+
+    unlink(path);
+}
+
+TEST_CASE(io3)
+{
+    luna::State state;
+    Init(&state);
+
+    // Error of spawned coroutine is raised by run as it is
+    std::string what;
+    try
+    {
+        state.DoString(
+            "io.spawn(function() local x = {} x.y.z = 1 end)\n"
+            "io.run()", "spawn");
+    }
+    catch (const luna::RuntimeException &e)
+    {
+        what = e.What();
+    }
+    EXPECT_TRUE(what == "spawn:1 attempt to set table key 'z' to table member 'y' (a nil value)");
+}
@@ -0,0 +1,127 @@
+#include "UnitTest.h"
+#include "TestCommon.h"
+#include "luna/State.h"
+#include "luna/LibAPI.h"
+#include "luna/LibCoroutine.h"
+#include "luna/Exception.h"
+#include <string>
+#include <vector>
+
+namespace
+{
+    // Run 'script' with JIT enabled or disabled, return recorded values
+    std::vector<double> RunScript(const char *script, bool jit)
+    {
+        luna::State state;
+        RegisterRecord(&state);
+        lib::coroutine::RegisterLibCoroutine(&state);
+        state.SetJitEnabled(jit);
+
+        state.DoString(script, "jit");
+        return GetRecords().numbers_;
+    }
+
+    // Run 'script' with JIT enabled or disabled, return the error
+    std::string RunError(const char *script, bool jit)
+    {
+        luna::State state;
+        state.SetJitEnabled(jit);
+        try
+        {
+            state.DoString(script, "jit");
+        }
+        catch (const luna::RuntimeException &e)
+        {
+            return e.What();
+        }
+        return std::string();
+    }
+} // namespace
+
+TEST_CASE(jit1)
+{
+    // Hot functions and loops get the same results as the interpreter,
+    // including values which fail type guards of compiled code
+    const char *script =
+        "local function sum(n) "
+        "    local s = 0 "
+        "    for i = 1, n do s = s + i * 0.5 - i % 3 end "
+        "    return s "
+        "end "
+        "local function fib(n) "
+        "    if n < 2 then return n end "
+        "    return fib(n - 1) + fib(n - 2) "
+        "end "
+        "local function lt(a, b) return a < b end "
+        "local function eq(a, b) return a == b end "
+        "local t = {} "
+        "for i = 1, 1000 do t[i] = i * i end "
+        "local x = 0 "
+        "for i = 1, #t do x = x + t[i] end "
+        "local p = { x = 1, y = 2 } "
+        "for i = 1, 500 do p.x = p.x + p.y end "
+        "local n = 0 "
+        "for i = 1, 600 do "
+        "    if lt(i, 300) then n = n + 1 end "
+        "    if eq(i % 2 == 0 and 'a' or i, 'a') then n = n + 2 end "
+        "end "
+        "local up = 0 "
+        "local function inc() up = up + 1 end "
+        "for i = 1, 400 do inc() end "
+        "local function va(...) local a, b = ... return a + b end "
+        "local v = 0 "
+        "for i = 1, 400 do v = v + va(i, 1) end "
+        "for i = 10, 1, -0.5 do v = v + i end "
+        "record(sum(1000), fib(20), x, p.x, n, up, v) "
+        "record(lt('a', 'b') and 1 or 0, -p.x, not eq(1, 2) and 1 or 0)";
+
+    auto interpreted = RunScript(script, false);
+    auto compiled = RunScript(script, true);
+    EXPECT_TRUE(interpreted.size() == 10);
+    EXPECT_TRUE(compiled == interpreted);
+    EXPECT_TRUE(compiled[1] == 6765);
+}
+
+TEST_CASE(jit2)
+{
+    // Errors of compiled code are reported like the interpreter
+    const char *scripts[] = {
+        "local function get(t) return t.x end "
+        "for i = 1, 300 do get({ x = i }) end "
+        "get(nil)",
+        "local function add(a) return a + 1 end "
+        "for i = 1, 300 do add(i) end "
+        "add({})",
+        "local function call(f) return f() end "
+        "for i = 1, 300 do call(function() end) end "
+        "call(1)",
+    };
+
+    for (auto script : scripts)
+    {
+        auto error = RunError(script, true);
+        EXPECT_TRUE(!error.empty());
+        EXPECT_TRUE(error == RunError(script, false));
+    }
+}
+
+TEST_CASE(jit3)
+{
+    // Coroutine yields from a hot loop and resumes in it
+    const char *script =
+        "local co = coroutine.create(function() "
+        "    local s = 0 "
+        "    for i = 1, 1000 do "
+        "        s = s + i "
+        "        if i % 100 == 0 then coroutine.yield(s) end "
+        "    end "
+        "    return -s "
+        "end) "
+        "for i = 1, 11 do record(coroutine.resume(co)) end";
+
+    auto interpreted = RunScript(script, false);
+    auto compiled = RunScript(script, true);
+    EXPECT_TRUE(interpreted.size() == 22);
+    EXPECT_TRUE(compiled == interpreted);
+    EXPECT_TRUE(compiled[21] == -500500);
+}
@@ -2,9 +2,8 @@
 #include "luna/Lex.h"
 #include "luna/State.h"
 #include "luna/String.h"
-#include "luna/TextInStream.h"
 #include "luna/Exception.h"
-#include <functional>
+#include <string>
 
 namespace
 {
@@ -12,10 +11,10 @@ namespace
     {
     public:
         explicit LexerWrapper(const std::string &str)
-            : iss_(str),
+            : str_(str),
               state_(),
               name_("lex"),
-              lexer_(&state_, &name_, std::bind(&io::text::InStringStream::GetChar, &iss_))
+              lexer_(&state_, &name_, str_.data(), str_.data() + str_.size())
         {
         }
 
@@ -26,7 +25,7 @@ namespace
         }
 
     private:
-        io::text::InStringStream iss_;
+        std::string str_;
         luna::State state_;
         luna::String name_;
         luna::Lexer lexer_;
@@ -0,0 +1,81 @@
+#include "UnitTest.h"
+#include "luna/Number.h"
+#include <string>
+#include <random>
+#include <cstring>
+#include <cstdlib>
+
+namespace
+{
+    std::string Format(double num)
+    {
+        char buffer[luna::kNumberBufferSize];
+        auto len = luna::FormatNumber(num, buffer);
+        return std::string(buffer, len);
+    }
+
+    double Parse(const char *s)
+    {
+        double num = 0.0;
+        auto len = luna::ParseNumber(s, std::strlen(s), num);
+        return len == std::strlen(s) ? num : -1.0;
+    }
+} // namespace
+
+TEST_CASE(number1)
+{
+    EXPECT_TRUE(Format(0.0) == "0");
+    EXPECT_TRUE(Format(-0.0) == "-0");
+    EXPECT_TRUE(Format(-123456789.0) == "-123456789");
+    EXPECT_TRUE(Format(0.1) == "0.1");
+    EXPECT_TRUE(Format(0.1 + 0.2) == "0.30000000000000004");
+    EXPECT_TRUE(Format(-2.5) == "-2.5");
+    EXPECT_TRUE(Format(0.0001) == "0.0001");
+    EXPECT_TRUE(Format(1.5e-5) == "1.5e-05");
+    EXPECT_TRUE(Format(1e21) == "1e+21");
+    EXPECT_TRUE(Format(5e-324) == "5e-324");
+    EXPECT_TRUE(Format(1.7976931348623157e308) == "1.7976931348623157e+308");
+    EXPECT_TRUE(Format(1.0 / 0.0) == "inf");
+    EXPECT_TRUE(Format(-1.0 / 0.0) == "-inf");
+
+    // All numbers read back as the same numbers
+    std::mt19937_64 random(1);
+    bool same = true;
+    for (int i = 0; i < 100000; ++i)
+    {
+        uint64_t bits = random();
+        double num = 0.0;
+        std::memcpy(&num, &bits, sizeof(num));
+        if (num != num || num - num != 0.0)
+            continue;
+
+        auto str = Format(num);
+        same = same && std::strtod(str.c_str(), nullptr) == num;
+        same = same && Parse(str.c_str()) == num;
+    }
+    EXPECT_TRUE(same);
+}
+
+TEST_CASE(number2)
+{
+    EXPECT_TRUE(Parse("0") == 0.0);
+    EXPECT_TRUE(Parse("123.25") == 123.25);
+    EXPECT_TRUE(Parse(".5") == 0.5);
+    EXPECT_TRUE(Parse("5.") == 5.0);
+    EXPECT_TRUE(Parse("-1e3") == -1000.0);
+    EXPECT_TRUE(Parse("1E-2") == 0.01);
+    EXPECT_TRUE(Parse("0x1F") == 31.0);
+    EXPECT_TRUE(Parse("0xA.8p1") == 21.0);
+    EXPECT_TRUE(Parse("0.30000000000000004") == 0.1 + 0.2);
+    EXPECT_TRUE(Parse("123456789012345678901234567890") == 123456789012345678901234567890.0);
+    EXPECT_TRUE(Parse("1e400") == 1.0 / 0.0);
+    EXPECT_TRUE(Parse("4.9e-324") == 5e-324);
+
+    // Prefix of number is parsed
+    double num = 0.0;
+    EXPECT_TRUE(luna::ParseNumber("12e", 3, num) == 2 && num == 12.0);
+    EXPECT_TRUE(luna::ParseNumber("7abc", 4, num) == 1 && num == 7.0);
+    EXPECT_TRUE(luna::ParseNumber("abc", 3, num) == 0);
+    EXPECT_TRUE(luna::ParseNumber(".", 1, num) == 0);
+    EXPECT_TRUE(luna::ParseNumber("0x", 2, num) == 0);
+}
@@ -0,0 +1,31 @@
+#include "UnitTest.h"
+#include "luna/State.h"
+#include "luna/OpcodeStats.h"
+#include <string>
+
+TEST_CASE(opcodestats1)
+{
+    EXPECT_TRUE(std::string(luna::GetOpTypeName(luna::OpType_LoadNil)) == "LoadNil");
+    EXPECT_TRUE(std::string(luna::GetOpTypeName(luna::OpType_TailCall)) == "TailCall");
+
+    luna::State state;
+    state.DoString("local function f(n)\n"
+                   "    local s = 0\n"
+                   "    for i = 1, n do s = s + i end\n"
+                   "    return s\n"
+                   "end\n"
+                   "f(1000)\n", "stats");
+    auto stats = state.GetOpcodeStats();
+
+#ifdef LUNA_OPCODE_STATS
+    EXPECT_TRUE(stats.find("  ForLoop 1000 ") != std::string::npos);
+    EXPECT_TRUE(stats.find("  Add ForLoop 1000 ") != std::string::npos);
+    EXPECT_TRUE(stats.find("  function <stats:1> ") != std::string::npos);
+    EXPECT_TRUE(stats.find("  main chunk stats ") != std::string::npos);
+
+    state.ClearOpcodeStats();
+    EXPECT_TRUE(state.GetOpcodeStats().find("  ForLoop") == std::string::npos);
+#else
+    EXPECT_TRUE(stats.empty());
+#endif // LUNA_OPCODE_STATS
+}
@@ -0,0 +1,137 @@
+#include "UnitTest.h"
+#include "TestCommon.h"
+#include "luna/SemanticAnalysis.h"
+#include "luna/Optimize.h"
+
+namespace
+{
+    ParserWrapper g_parser;
+    std::unique_ptr<luna::SyntaxTree> Optimize(const std::string &s)
+    {
+        g_parser.SetInput(s);
+        auto ast = g_parser.Parse();
+        luna::SemanticAnalysis(ast.get(), g_parser.GetState());
+        luna::Optimize(ast.get(), g_parser.GetState());
+        return ast;
+    }
+
+    struct FindNumber
+    {
+        FindNumber(double number) : number_(number) { }
+
+        bool operator () (const luna::Terminator *term) const
+        {
+            return term->token_.token_ == luna::Token_Number &&
+                term->token_.number_ == number_;
+        }
+
+        double number_;
+    };
+
+    struct FindString
+    {
+        FindString(const std::string &str) : str_(str) { }
+
+        bool operator () (const luna::Terminator *term) const
+        {
+            return term->token_.token_ == luna::Token_String &&
+                term->token_.str_->GetStdString() == str_;
+        }
+
+        std::string str_;
+    };
+
+    struct FindToken
+    {
+        FindToken(int token) : token_(token) { }
+
+        bool operator () (const luna::Terminator *term) const
+        {
+            return term->token_.token_ == token_;
+        }
+
+        int token_;
+    };
+
+    std::size_t StatementCount(const std::unique_ptr<luna::SyntaxTree> &ast)
+    {
+        auto block = ASTFind<luna::Block>(ast, AcceptAST());
+        return block->statements_.size();
+    }
+} // namespace
+
+TEST_CASE(optimize1)
+{
+    auto ast = Optimize("a = 2 * 3 + 4 / 2 - 2 ^ 3 % 5");
+    EXPECT_TRUE(!ASTFind<luna::BinaryExpression>(ast, AcceptAST()));
+    EXPECT_TRUE(ASTFind<luna::Terminator>(ast, FindNumber(5)));
+}
+
+TEST_CASE(optimize2)
+{
+    auto ast = Optimize("a = -(1 + 2) b = #\"abc\" c = not nil");
+    EXPECT_TRUE(!ASTFind<luna::UnaryExpression>(ast, AcceptAST()));
+    EXPECT_TRUE(ASTFind<luna::Terminator>(ast, FindNumber(-3)));
+    EXPECT_TRUE(ASTFind<luna::Terminator>(ast, FindNumber(3)));
+    EXPECT_TRUE(ASTFind<luna::Terminator>(ast, FindToken(luna::Token_True)));
+}
+
+TEST_CASE(optimize3)
+{
+    auto ast = Optimize("a = \"a\" .. \"b\" .. \"c\" .. d");
+    auto exp = ASTFind<luna::BinaryExpression>(ast, AcceptAST());
+    EXPECT_TRUE(exp && exp->op_token_.token_ == luna::Token_Concat);
+    EXPECT_TRUE(ASTFind<luna::Terminator>(ast, FindString("abc")));
+}
+
+TEST_CASE(optimize4)
+{
+    auto ast = Optimize("a = 1 < 2 b = \"a\" == \"b\" c = 1 == \"1\"");
+    EXPECT_TRUE(!ASTFind<luna::BinaryExpression>(ast, AcceptAST()));
+    EXPECT_TRUE(ASTFind<luna::Terminator>(ast, FindToken(luna::Token_True)));
+    EXPECT_TRUE(ASTFind<luna::Terminator>(ast, FindToken(luna::Token_False)));
+}
+
+TEST_CASE(optimize5)
+{
+    // and/or keeps adjusting function call results to one value
+    auto ast = Optimize("a = nil or b b = false and f() c = true and f()");
+    auto exp = ASTFind<luna::BinaryExpression>(ast, AcceptAST());
+    EXPECT_TRUE(exp && exp->op_token_.token_ == luna::Token_And);
+    EXPECT_TRUE(ASTFind<luna::Terminator>(exp->left_, FindToken(luna::Token_True)));
+    EXPECT_TRUE(!ASTFind<luna::Terminator>(ast, FindToken(luna::Token_Nil)));
+}
+
+TEST_CASE(optimize6)
+{
+    auto ast = Optimize("if false then a() elseif x then b() else c() end");
+    auto if_stmt = ASTFind<luna::IfStatement>(ast, AcceptAST());
+    EXPECT_TRUE(if_stmt);
+    EXPECT_TRUE(ASTFind<luna::Terminator>(if_stmt->exp_, FindName("x")));
+    EXPECT_TRUE(!ASTFind<luna::Terminator>(ast, FindName("a")));
+    EXPECT_TRUE(ASTFind<luna::ElseStatement>(ast, AcceptAST()));
+
+    ast = Optimize("if x then a() elseif true then b() else c() end");
+    EXPECT_TRUE(ASTFind<luna::Terminator>(ast, FindName("b")));
+    EXPECT_TRUE(!ASTFind<luna::Terminator>(ast, FindName("c")));
+
+    ast = Optimize("if 1 then a() else b() end");
+    EXPECT_TRUE(!ASTFind<luna::IfStatement>(ast, AcceptAST()));
+    EXPECT_TRUE(ASTFind<luna::DoStatement>(ast, AcceptAST()));
+    EXPECT_TRUE(!ASTFind<luna::Terminator>(ast, FindName("b")));
+
+    ast = Optimize("if nil then a() end while false do b() end c()");
+    EXPECT_TRUE(StatementCount(ast) == 1);
+}
+
+TEST_CASE(optimize7)
+{
+    auto ast = Optimize("while x do a() break b() end");
+    EXPECT_TRUE(ASTFind<luna::Terminator>(ast, FindName("a")));
+    EXPECT_TRUE(!ASTFind<luna::Terminator>(ast, FindName("b")));
+
+    ast = Optimize("a() do return end b() return c");
+    EXPECT_TRUE(StatementCount(ast) == 2);
+    EXPECT_TRUE(!ASTFind<luna::Terminator>(ast, FindName("b")));
+    EXPECT_TRUE(!ASTFind<luna::Terminator>(ast, FindName("c")));
+}
@@ -0,0 +1,114 @@
+#include "UnitTest.h"
+#include "TestCommon.h"
+#include "luna/Pack.h"
+#include "luna/State.h"
+#include "luna/LibAPI.h"
+#include "luna/LibString.h"
+#include "luna/Exception.h"
+#include <string>
+#include <vector>
+#include <cstring>
+
+namespace
+{
+    // Sizes and paddings of all options in 'format'
+    std::vector<std::size_t> Layout(const char *format)
+    {
+        lib::string::PackFormat reader(format, std::strlen(format));
+        lib::string::PackOption option;
+        std::vector<std::size_t> layout;
+        std::size_t total = 0;
+        while (reader.Next(total, option))
+        {
+            if (option.kind_ == lib::string::PackOption::Nop)
+                continue;
+            layout.push_back(option.padding_);
+            layout.push_back(option.size_);
+            total += option.padding_ + option.size_;
+        }
+        return layout;
+    }
+} // namespace
+
+TEST_CASE(pack1)
+{
+    std::vector<std::size_t> expect = { 0, 1, 0, 4, 0, 8 };
+    EXPECT_TRUE(Layout("b i4 d") == expect);
+
+    // Alignment is limited by '!'
+    expect = { 0, 1, 3, 4, 0, 2, 2, 0, 0, 8 };
+    EXPECT_TRUE(Layout("!4 b i4 h Xi4 d") == expect);
+
+    const char *malformed[] = { "i9", "i0", "c", "q", "!3 i4", "Xc1" };
+    for (auto format : malformed)
+    {
+        EXPECT_EXCEPTION(luna::CallCFuncException, {
+            Layout(format);
+        });
+    }
+
+    char buffer[8];
+    lib::string::PackInt(buffer, 0x0102, 2, false);
+    EXPECT_TRUE(buffer[0] == 1 && buffer[1] == 2);
+    lib::string::PackInt(buffer, static_cast<uint64_t>(-3), 3, true);
+    EXPECT_TRUE(static_cast<int64_t>(lib::string::UnpackInt(buffer, 3, true, true)) == -3);
+    EXPECT_TRUE(lib::string::UnpackInt(buffer, 3, true, false) == 0xFFFFFD);
+}
+
+TEST_CASE(pack2)
+{
+    luna::State state;
+    RegisterRecord(&state);
+    lib::string::RegisterLibString(&state);
+
+    state.DoString(
+        "local s = string.pack('<i2 >I3 d s1 z c4', -2, 65536, 0.5, 'ab', 'z', 'c') "
+        "record(#s, string.packsize('<i2 >I3 d')) "
+        "record(string.unpack('<i2 >I3 d s1 z c4', s)) "
+        "record(string.unpack('B', s, -1))");
+
+    std::vector<std::string> expect = {
+        "22", "13",
+        "-2", "65536", "0.5", "ab", "z", "c", "23",
+        "0", "23"
+    };
+    EXPECT_TRUE(GetRecords().strings_ == expect);
+
+    EXPECT_EXCEPTION(luna::RuntimeException, {
+        state.DoString("string.pack('i1', 128)");
+    });
+
+    EXPECT_EXCEPTION(luna::RuntimeException, {
+        state.DoString("string.pack('i4', 1.5)");
+    });
+
+    EXPECT_EXCEPTION(luna::RuntimeException, {
+        state.DoString("string.unpack('i4', 'abc')");
+    });
+
+    EXPECT_EXCEPTION(luna::RuntimeException, {
+        state.DoString("string.packsize('s')");
+    });
+
+    // Position must be in the string or just past its end
+    state.DoString(
+        "record(string.unpack('', 'abcd', 5)) "
+        "record(string.unpack('<i2', 'abcd', -2))");
+    expect.insert(expect.end(), { "5", "25699", "5" });
+    EXPECT_TRUE(GetRecords().strings_ == expect);
+
+    const char *positions[] = { "-100", "0", "6", "1e300", "0 / 0" };
+    for (auto pos : positions)
+    {
+        std::string what;
+        try
+        {
+            state.DoString(std::string("string.unpack('i4', 'abcd', ") + pos + ")", "up");
+        }
+        catch (const luna::RuntimeException &e)
+        {
+            what = e.What();
+        }
+        EXPECT_TRUE(what == "up:1 bad argument #3 to 'unpack' (initial position out of string)");
+    }
+}
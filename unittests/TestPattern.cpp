@@ -0,0 +1,164 @@
+#include "UnitTest.h"
+#include "TestCommon.h"
+#include "luna/Pattern.h"
+#include "luna/State.h"
+#include "luna/LibAPI.h"
+#include "luna/LibString.h"
+#include "luna/Exception.h"
+#include <string>
+#include <vector>
+#include <cstring>
+
+namespace
+{
+    // Return the captures of the first match of 'pattern' in 'subject'
+    std::vector<std::string> Search(const char *pattern, const std::string &subject)
+    {
+        lib::string::Pattern p(pattern, std::strlen(pattern));
+        lib::string::Capture captures[lib::string::Pattern::kMaxCaptures];
+        auto begin = subject.data();
+        auto end = begin + subject.size();
+        const char *e = nullptr;
+
+        std::vector<std::string> result;
+        auto s = p.Search(begin, end, begin, &e, captures);
+        if (!s)
+            return result;
+
+        result.push_back(std::string(s, e));
+        for (int i = 0; i < p.GetCaptureCount(); ++i)
+        {
+            if (captures[i].IsPosition())
+                result.push_back(std::to_string(captures[i].begin_ - begin + 1));
+            else
+                result.push_back(std::string(captures[i].begin_, captures[i].len_));
+        }
+        return result;
+    }
+} // namespace
+
+TEST_CASE(pattern1)
+{
+    std::vector<std::string> expect = { "key = value", "key", "value" };
+    EXPECT_TRUE(Search("(%w+)%s*=%s*(%w+)", "  key = value") == expect);
+
+    expect = { "  trim  ", "trim" };
+    EXPECT_TRUE(Search("^%s*(.-)%s*$", "  trim  ") == expect);
+
+    expect = { "ll", "3", "5" };
+    EXPECT_TRUE(Search("()ll()", "hello") == expect);
+
+    expect = { "(a(b)c)" };
+    EXPECT_TRUE(Search("%b()", "f(a(b)c)d") == expect);
+
+    expect = { "abcabc", "abc" };
+    EXPECT_TRUE(Search("(a%a+)%1", "xabcabc") == expect);
+
+    expect = { "quick" };
+    EXPECT_TRUE(Search("%f[%l]%a+", "THE quick") == expect);
+
+    EXPECT_TRUE(Search("^e", "hello").empty());
+    EXPECT_TRUE(Search("[^%a]", "hello").empty());
+
+    lib::string::Pattern plain("a.b", 3);
+    EXPECT_TRUE(!plain.IsPlain());
+    lib::string::Pattern text("world", 5);
+    EXPECT_TRUE(text.IsPlain());
+
+    std::string subject = "hello world";
+    auto end = subject.data() + subject.size();
+    EXPECT_TRUE(lib::string::FindText(subject.data(), end, "wor", 3) == subject.data() + 6);
+    EXPECT_TRUE(lib::string::FindText(subject.data(), end, "word", 4) == nullptr);
+}
+
+TEST_CASE(pattern2)
+{
+    // Malformed patterns are rejected when compiling
+    const char *malformed[] = { "(", ")", "[a", "%", "%b(", "%fa", "(a)%2" };
+    for (auto pattern : malformed)
+    {
+        EXPECT_EXCEPTION(luna::CallCFuncException, {
+            lib::string::Pattern p(pattern, std::strlen(pattern));
+        });
+    }
+}
+
+TEST_CASE(pattern3)
+{
+    luna::State state;
+    RegisterRecord(&state);
+    lib::string::RegisterLibString(&state);
+
+    // Function replacement calls back into VM, gmatch iterates matches
+    state.DoString(
+        "local s = string.gsub('a b c', '%a', function(c) "
+        "    return string.upper(c) .. c "
+        "end) "
+        "record(s) "
+        "record(string.gsub('$x-$y', '%$(%w)', { x = '1', y = '2' })) "
+        "for k, v in string.gmatch('a=1, b=2', '(%w)=(%w)') do "
+        "    record(k, v) "
+        "end "
+        "record(string.format('%d|%5.1f|%-3s|%q', 7, 2.25, 'x', 'a\"b'))");
+
+    std::vector<std::string> expect = {
+        "Aa Bb Cc", "1-2", "2", "a", "1", "b", "2",
+        "7|  2.2|x  |\"a\\\"b\""
+    };
+    EXPECT_TRUE(GetRecords().strings_ == expect);
+}
+
+TEST_CASE(pattern4)
+{
+    luna::State state;
+    lib::string::RegisterLibString(&state);
+
+    // Errors of gmatch iterator are reported at the caller, the same as
+    // errors of find
+    std::string scripts[] = {
+        "for w in string.gmatch('abc', '[a') do end",
+        "local it = string.gmatch('abc', '(')\nit()",
+        "string.find('abc', '[a')"
+    };
+    std::string expect[] = {
+        "gm1:1 malformed pattern (missing ']')",
+        "gm2:2 unfinished capture",
+        "gm3:1 malformed pattern (missing ']')"
+    };
+    for (int i = 0; i < 3; ++i)
+    {
+        std::string what;
+        try
+        {
+            state.DoString(scripts[i], "gm" + std::to_string(i + 1));
+        }
+        catch (const luna::RuntimeException &e)
+        {
+            what = e.What();
+        }
+        EXPECT_TRUE(what == expect[i]);
+    }
+}
+
+TEST_CASE(pattern5)
+{
+    luna::State state;
+    RegisterRecord(&state);
+    lib::string::RegisterLibString(&state);
+
+    // Init position past the end finds nothing, huge and NaN positions
+    // are clamped
+    state.DoString(
+        "record(string.find('abc', '', 4)) "
+        "record(string.find('abc', '', 5)) "
+        "record(string.find('abc', 'b', -100)) "
+        "record(string.find('abc', 'b', 1e300)) "
+        "record(string.find('abc', 'b', -1e300)) "
+        "record(string.find('abc', 'b', 0 / 0)) "
+        "record(string.match('abc', '.', 10))");
+
+    std::vector<std::string> expect = {
+        "4", "3", "nil", "2", "2", "nil", "2", "2", "2", "2", "nil"
+    };
+    EXPECT_TRUE(GetRecords().strings_ == expect);
+}
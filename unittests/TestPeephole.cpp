@@ -0,0 +1,146 @@
+#include "UnitTest.h"
+#include "TestCommon.h"
+#include "luna/State.h"
+#include "luna/Function.h"
+#include "luna/Peephole.h"
+#include "luna/LibAPI.h"
+#include <vector>
+
+namespace
+{
+    luna::State g_state;
+
+    luna::Function * NewFunction(const std::vector<luna::Instruction> &codes)
+    {
+        auto f = g_state.NewFunction();
+        for (std::size_t i = 0; i < codes.size(); ++i)
+            f->AddInstruction(codes[i], static_cast<int>(i) + 1);
+        return f;
+    }
+
+    int GetOp(luna::Function *f, int index)
+    {
+        return luna::Instruction::GetOpCode(f->GetOpCodes()[index]);
+    }
+} // namespace
+
+using luna::Instruction;
+
+TEST_CASE(peephole1)
+{
+    // Jump to jump is threaded, then unreachable code and jump to
+    // the next instruction are removed
+    auto f = NewFunction({
+        Instruction::AsBxCode(luna::OpType_JmpFalse, 0, 2),
+        Instruction::ABxCode(luna::OpType_LoadConst, 1, 0),
+        Instruction::AsBxCode(luna::OpType_Jmp, 0, 2),
+        Instruction::ABxCode(luna::OpType_LoadConst, 1, 1),
+        Instruction::AsBxCode(luna::OpType_Ret, 1, 1),
+    });
+    luna::Peephole(f);
+
+    EXPECT_TRUE(f->OpCodeSize() == 3);
+    EXPECT_TRUE(GetOp(f, 0) == luna::OpType_JmpFalse);
+    EXPECT_TRUE(Instruction::GetParamsBx(f->GetOpCodes()[0]) == 2);
+    EXPECT_TRUE(GetOp(f, 2) == luna::OpType_Ret);
+    EXPECT_TRUE(f->GetInstructionLine(2) == 5);
+}
+
+TEST_CASE(peephole2)
+{
+    // Chain of moves to temporary registers is coalesced
+    auto f = NewFunction({
+        Instruction::ABxCode(luna::OpType_LoadConst, 1, 0),
+        Instruction::ABCode(luna::OpType_Move, 2, 1),
+        Instruction::ABCode(luna::OpType_Move, 3, 2),
+        Instruction::AsBxCode(luna::OpType_Ret, 3, 1),
+    });
+    luna::Peephole(f);
+
+    EXPECT_TRUE(f->OpCodeSize() == 2);
+    EXPECT_TRUE(GetOp(f, 0) == luna::OpType_LoadConst);
+    EXPECT_TRUE(GetOp(f, 1) == luna::OpType_Ret);
+    EXPECT_TRUE(Instruction::GetParamA(f->GetOpCodes()[0]) ==
+                Instruction::GetParamA(f->GetOpCodes()[1]));
+}
+
+TEST_CASE(peephole3)
+{
+    // Adjacent nil fills are merged, fills of dead registers are removed
+    auto f = NewFunction({
+        Instruction::ACode(luna::OpType_LoadNil, 0),
+        Instruction::ABCode(luna::OpType_FillNil, 1, 3),
+        Instruction::AsBxCode(luna::OpType_Ret, 0, 3),
+        Instruction::ABCode(luna::OpType_FillNil, 0, 3),
+    });
+    luna::Peephole(f);
+
+    EXPECT_TRUE(f->OpCodeSize() == 2);
+    EXPECT_TRUE(GetOp(f, 0) == luna::OpType_FillNil);
+    EXPECT_TRUE(Instruction::GetParamA(f->GetOpCodes()[0]) == 0);
+    EXPECT_TRUE(Instruction::GetParamB(f->GetOpCodes()[0]) == 3);
+    EXPECT_TRUE(GetOp(f, 1) == luna::OpType_Ret);
+}
+
+TEST_CASE(peephole4)
+{
+    // Const keys which are loaded into dead registers are fused into
+    // table instructions
+    auto f = NewFunction({
+        Instruction::ABxCode(luna::OpType_LoadConst, 1, 3),
+        Instruction::ABCCode(luna::OpType_GetTable, 0, 1, 2),
+        Instruction::ABxCode(luna::OpType_LoadConst, 1, 4),
+        Instruction::ABCCode(luna::OpType_SetTable, 0, 1, 2),
+        Instruction::ABxCode(luna::OpType_LoadConst, 3, 5),
+        Instruction::ABCCode(luna::OpType_GetTable, 0, 3, 2),
+        Instruction::AsBxCode(luna::OpType_Ret, 2, 2),
+    });
+    luna::Peephole(f);
+
+    EXPECT_TRUE(f->OpCodeSize() == 5);
+    EXPECT_TRUE(GetOp(f, 0) == luna::OpType_GetTableK);
+    EXPECT_TRUE(Instruction::GetParamB(f->GetOpCodes()[0]) == 3);
+    EXPECT_TRUE(Instruction::GetParamC(f->GetOpCodes()[0]) == 2);
+    EXPECT_TRUE(f->GetInstructionLine(0) == 2);
+    EXPECT_TRUE(GetOp(f, 1) == luna::OpType_SetTableK);
+    EXPECT_TRUE(Instruction::GetParamB(f->GetOpCodes()[1]) == 4);
+    // Key register is returned, so it is kept
+    EXPECT_TRUE(GetOp(f, 2) == luna::OpType_LoadConst);
+    EXPECT_TRUE(GetOp(f, 3) == luna::OpType_GetTable);
+}
+
+TEST_CASE(peephole5)
+{
+    // Field of global is fused, the key is the extra word
+    auto f = NewFunction({
+        Instruction::ABxCode(luna::OpType_GetGlobal, 0, 300),
+        Instruction::ABCCode(luna::OpType_GetField, 0, 7, 0),
+        Instruction::ABxCode(luna::OpType_GetGlobal, 1, 301),
+        Instruction::ABCCode(luna::OpType_GetField, 1, 8, 2),
+        Instruction::AsBxCode(luna::OpType_Ret, 0, 3),
+    });
+    luna::Peephole(f);
+
+    EXPECT_TRUE(f->OpCodeSize() == 5);
+    EXPECT_TRUE(GetOp(f, 0) == luna::OpType_GetGlobalField);
+    EXPECT_TRUE(Instruction::GetParamA(f->GetOpCodes()[0]) == 0);
+    EXPECT_TRUE(Instruction::GetParamBx(f->GetOpCodes()[0]) == 300);
+    EXPECT_TRUE(f->GetOpCodes()[1].opcode_ == 7);
+    // Global register is returned, so it is kept
+    EXPECT_TRUE(GetOp(f, 2) == luna::OpType_GetGlobal);
+    EXPECT_TRUE(GetOp(f, 3) == luna::OpType_GetField);
+}
+
+TEST_CASE(peephole6)
+{
+    // Fused instructions run as the instruction pairs
+    luna::State state;
+    RegisterRecord(&state);
+
+    state.DoString("t = { 1, 2, x = { y = 3 } }\n"
+                   "local a = {}\n"
+                   "a[1] = t[2] a[2.5] = t.x.y\n"
+                   "record(a[1], a[2.5], t[3])\n", "fuse");
+    std::vector<double> expect = { 2, 3, -1 };
+    EXPECT_TRUE(GetRecords().numbers_ == expect);
+}
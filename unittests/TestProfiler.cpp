@@ -0,0 +1,33 @@
+#include "UnitTest.h"
+#include "luna/State.h"
+#include <string>
+
+TEST_CASE(profiler1)
+{
+    luna::State state;
+    EXPECT_TRUE(state.GetProfile().empty());
+
+    // Sample every microsecond until samples of the busy function exist
+    const std::string stack = "busy:4 in main chunk;busy:2 in function <busy:1>";
+    state.StartProfiler(1);
+    std::string profile;
+    for (int i = 0; i < 100 && profile.find(stack) == std::string::npos; ++i)
+    {
+        state.DoString("local function f()\n"
+                       "    for i = 1, 100000 do local t = {} end\n"
+                       "end\n"
+                       "f()\n", "busy");
+        profile = state.GetProfile();
+    }
+    state.StopProfiler();
+
+    EXPECT_TRUE(profile.find(stack) != std::string::npos);
+    EXPECT_TRUE(profile.back() == '\n');
+
+    // No samples after profiler stopped
+    state.DoString("for i = 1, 100000 do local t = {} end", "idle");
+    EXPECT_TRUE(state.GetProfile().find("idle") == std::string::npos);
+
+    state.ClearProfile();
+    EXPECT_TRUE(state.GetProfile().empty());
+}
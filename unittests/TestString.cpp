@@ -1,6 +1,9 @@
 #include "UnitTest.h"
 #include "luna/String.h"
 #include "luna/StringPool.h"
+#include <memory>
+#include <string>
+#include <vector>
 
 TEST_CASE(string1)
 {
@@ -70,3 +73,68 @@ TEST_CASE(string2)
     EXPECT_TRUE(!s3);
     EXPECT_TRUE(!s4);
 }
+
+TEST_CASE(string3)
+{
+    // Strings with embedded zero are hashed and compared by length
+    luna::String str1;
+    luna::String str2;
+    str1.SetValue("ab\0cd", 5);
+    str2.SetValue("ab\0ef", 5);
+    EXPECT_TRUE(str1 != str2);
+    EXPECT_TRUE(str1.GetHash() == luna::String::Hash("ab\0cd", 5));
+
+    // Long strings which differ in bytes not sampled by hash
+    std::string long1(1000, 'a');
+    std::string long2 = long1;
+    long2[501] = 'b';
+    luna::String str3;
+    luna::String str4;
+    str3.SetValue(long1);
+    str4.SetValue(long2);
+
+    luna::StringPool pool;
+    pool.AddString(&str1);
+    pool.AddString(&str2);
+    pool.AddString(&str3);
+    pool.AddString(&str4);
+    EXPECT_TRUE(pool.GetString("ab\0cd", 5) == &str1);
+    EXPECT_TRUE(pool.GetString("ab\0ef", 5) == &str2);
+    EXPECT_TRUE(pool.GetString("ab") == nullptr);
+    EXPECT_TRUE(pool.GetString(long1) == &str3);
+    EXPECT_TRUE(pool.GetString(long2) == &str4);
+
+    // Pool grows and keeps strings after deleting
+    std::vector<std::unique_ptr<luna::String>> strings;
+    for (int i = 0; i < 1000; ++i)
+    {
+        strings.emplace_back(new luna::String(std::to_string(i).c_str()));
+        pool.AddString(strings.back().get());
+    }
+    for (int i = 0; i < 1000; i += 2)
+        pool.DeleteString(strings[i].get());
+
+    bool all_found = true;
+    for (int i = 0; i < 1000; ++i)
+    {
+        auto s = pool.GetString(std::to_string(i));
+        if (s != (i % 2 == 0 ? nullptr : strings[i].get()))
+            all_found = false;
+    }
+    EXPECT_TRUE(all_found);
+    EXPECT_TRUE(pool.GetString(long2) == &str4);
+}
+
+TEST_CASE(string4)
+{
+    luna::String str1;
+    str1.SetValue("a\0b", 3);
+    EXPECT_TRUE(str1.Equal("a\0b", 3));
+    EXPECT_TRUE(!str1.Equal("a"));
+    EXPECT_TRUE(str1 == str1);
+    EXPECT_TRUE(!(str1 < str1));
+
+    luna::String str2("abcdefghijklmnopqrst");
+    EXPECT_TRUE(str2.Equal("abcdefghijklmnopqrst"));
+    EXPECT_TRUE(!str2.Equal("abcdefghijklmnopqrsu"));
+}
@@ -1,6 +1,15 @@
 #include "UnitTest.h"
+#include "TestCommon.h"
 #include "luna/Table.h"
 #include "luna/String.h"
+#include "luna/State.h"
+#include "luna/LibAPI.h"
+#include "luna/LibTable.h"
+#include "luna/LibString.h"
+#include "luna/LibBase.h"
+#include "luna/Exception.h"
+#include <string>
+#include <vector>
 
 TEST_CASE(table1)
 {
@@ -162,3 +171,400 @@ TEST_CASE(table5)
     EXPECT_TRUE(value.type_ == luna::ValueT_Number);
     EXPECT_TRUE(value.num_ == 4);
 }
+
+TEST_CASE(table6)
+{
+    luna::Table t;
+    luna::Value key;
+    luna::Value value;
+
+    key.type_ = luna::ValueT_Number;
+    value.type_ = luna::ValueT_Number;
+
+    // Keys are not fit with array, all are in hash table
+    for (int i = 0; i < 1000; ++i)
+    {
+        key.num_ = -i;
+        value.num_ = i;
+        t.SetValue(key, value);
+    }
+
+    EXPECT_TRUE(t.ArraySize() == 0);
+
+    for (int i = 0; i < 1000; ++i)
+    {
+        key.num_ = -i;
+        value = t.GetValue(key);
+        EXPECT_TRUE(value.type_ == luna::ValueT_Number);
+        EXPECT_TRUE(value.num_ == i);
+    }
+
+    // Set odd keys to nil while iterating
+    int count = 0;
+    luna::Value nil;
+    bool has_next = t.FirstKeyValue(key, value);
+    while (has_next)
+    {
+        ++count;
+        if (static_cast<int>(value.num_) % 2)
+            t.SetValue(key, nil);
+        has_next = t.NextKeyValue(key, key, value);
+    }
+
+    EXPECT_TRUE(count == 1000);
+
+    count = 0;
+    has_next = t.FirstKeyValue(key, value);
+    while (has_next)
+    {
+        ++count;
+        EXPECT_TRUE(static_cast<int>(value.num_) % 2 == 0);
+        has_next = t.NextKeyValue(key, key, value);
+    }
+
+    EXPECT_TRUE(count == 500);
+}
+
+TEST_CASE(table7)
+{
+    luna::Table t;
+    luna::Value key;
+    luna::Value value;
+    key.type_ = luna::ValueT_Number;
+    value.type_ = luna::ValueT_Number;
+
+    for (int i = 1; i <= 5; ++i)
+    {
+        value.num_ = i;
+        t.SetArrayValue(i, value);
+    }
+
+    // Overlapped move to higher index
+    EXPECT_TRUE(t.MoveArrayValues(1, 3, 3, &t));
+    EXPECT_TRUE(t.ArraySize() == 5);
+    double expect1[] = { 1, 2, 1, 2, 3 };
+    for (int i = 1; i <= 5; ++i)
+    {
+        key.num_ = i;
+        EXPECT_TRUE(t.GetValue(key).num_ == expect1[i - 1]);
+    }
+
+    // Move to another table, the key in hash part merges into array
+    luna::Table d;
+    key.num_ = 4;
+    value.num_ = 4;
+    d.SetValue(key, value);
+    EXPECT_TRUE(d.ArraySize() == 0);
+    EXPECT_TRUE(t.MoveArrayValues(1, 3, 1, &d));
+    EXPECT_TRUE(d.ArraySize() == 4);
+
+    // Source range is not in array
+    EXPECT_TRUE(!t.MoveArrayValues(4, 6, 1, &d));
+    EXPECT_TRUE(!t.MoveArrayValues(1, 2, 6, &d));
+}
+
+TEST_CASE(table8)
+{
+    luna::Table t;
+    t.Reserve(10, 10);
+    EXPECT_TRUE(t.ArraySize() == 0);
+
+    luna::Value key;
+    luna::Value value;
+    key.type_ = luna::ValueT_Number;
+    value.type_ = luna::ValueT_Number;
+    for (int i = 1; i <= 10; ++i)
+    {
+        key.num_ = i;
+        value.num_ = i;
+        t.SetValue(key, value);
+        key.num_ = -i;
+        t.SetValue(key, value);
+    }
+
+    EXPECT_TRUE(t.ArraySize() == 10);
+
+    // Reserve less keys than table has
+    t.Reserve(0, 1);
+    for (int i = 1; i <= 10; ++i)
+    {
+        key.num_ = -i;
+        EXPECT_TRUE(t.GetValue(key).num_ == i);
+    }
+}
+
+TEST_CASE(table9)
+{
+    // Long strings are not interned, keys with the same contents are the
+    // same key
+    std::string content(100, 'k');
+    luna::String key_str1(content.c_str());
+    luna::String key_str2(content.c_str());
+    luna::Table t;
+
+    luna::Value key1(&key_str1);
+    luna::Value key2(&key_str2);
+    EXPECT_TRUE(key1 == key2);
+
+    luna::Value value;
+    value.type_ = luna::ValueT_Number;
+    value.num_ = 1;
+    t.SetValue(key1, value);
+    EXPECT_TRUE(t.GetValue(key2).num_ == 1);
+
+    value.num_ = 2;
+    t.SetValue(key2, value);
+    EXPECT_TRUE(t.GetValue(key1).num_ == 2);
+
+    luna::Value key;
+    EXPECT_TRUE(t.FirstKeyValue(key, value));
+    EXPECT_TRUE(!t.NextKeyValue(key, key, value));
+}
+
+TEST_CASE(table10)
+{
+    // Inline cache slot follows the key node when the hash table is
+    // rehashed or the slot is shared by another key
+    luna::String key_str1("key1");
+    luna::String key_str2("key2");
+    luna::Value key1(&key_str1);
+    luna::Value key2(&key_str2);
+    luna::Table t;
+
+    unsigned int slot1 = 0;
+    unsigned int slot2 = 0;
+    EXPECT_TRUE(t.GetValueBySlot(key1, slot1).IsNil());
+
+    luna::Value value;
+    value.type_ = luna::ValueT_Number;
+    value.num_ = 1;
+    t.SetValueBySlot(key1, value, slot1);
+    value.num_ = 2;
+    t.SetValueBySlot(key2, value, slot2);
+    EXPECT_TRUE(t.GetValueBySlot(key1, slot1).num_ == 1);
+    EXPECT_TRUE(t.GetValueBySlot(key1, slot2).num_ == 1);
+    EXPECT_TRUE(t.GetValueBySlot(key2, slot2).num_ == 2);
+
+    luna::Value key;
+    key.type_ = luna::ValueT_Number;
+    for (int i = 1; i <= 100; ++i)
+    {
+        key.num_ = -i;
+        t.SetValue(key, value);
+    }
+
+    unsigned int old_slot1 = slot1;
+    EXPECT_TRUE(t.GetValueBySlot(key1, old_slot1).num_ == 1);
+    EXPECT_TRUE(t.GetValueBySlot(key1, slot1).num_ == 1);
+    EXPECT_TRUE(slot1 == old_slot1);
+    value.num_ = 3;
+    t.SetValueBySlot(key2, value, slot2);
+    EXPECT_TRUE(t.GetValue(key2).num_ == 3);
+
+    value.SetNil();
+    t.SetValueBySlot(key1, value, slot1);
+    EXPECT_TRUE(t.GetValue(key1).IsNil());
+    EXPECT_TRUE(t.GetValueBySlot(key1, slot1).IsNil());
+}
+
+TEST_CASE(table11)
+{
+    luna::State state;
+    RegisterRecord(&state);
+    lib::table::RegisterLibTable(&state);
+
+    // Numbers without comparator, and values sorted by comparator
+    state.DoString(
+        "local t = { 5, 3, 9, 1, 7, 2, 8, 6, 4, 0, 12, 11, 15, 14, 13, 10, 16 } "
+        "table.sort(t) "
+        "record(table.unpack(t)) "
+        "local r = {} "
+        "for i = 1, 5 do r[i] = { k = i } end "
+        "table.sort(r, function(a, b) return a.k > b.k end) "
+        "for i = 1, 5 do r[i] = r[i].k end "
+        "record(table.unpack(r))");
+
+    std::vector<double> expect;
+    for (int i = 0; i <= 16; ++i)
+        expect.push_back(i);
+    for (int i = 5; i >= 1; --i)
+        expect.push_back(i);
+    EXPECT_TRUE(GetRecords().numbers_ == expect);
+
+    EXPECT_EXCEPTION(luna::RuntimeException, {
+        state.DoString("table.sort({ 1, 'a' })");
+    });
+
+    // Inconsistent comparator never sorts out of range
+    EXPECT_EXCEPTION(luna::RuntimeException, {
+        state.DoString(
+            "local t = {} "
+            "for i = 1, 100 do t[i] = i % 7 end "
+            "table.sort(t, function(a, b) return true end)");
+    });
+}
+
+TEST_CASE(table12)
+{
+    luna::State state;
+    RegisterRecord(&state);
+    lib::table::RegisterLibTable(&state);
+
+    // Numbers are formatted as concat operator does
+    state.DoString(
+        "record(table.concat({ 1, 2.5, 'x', 1000000, -3 }, ',')) "
+        "record(table.concat({ 'a', 'b', 'c' }, ', ', 2, 3)) "
+        "local t = {} "
+        "for i = 1, 20 do t[i] = 'long string item' end "
+        "t[25] = 'hash' "
+        "record(table.concat(t, '', 18, 20) .. table.concat({}))");
+
+    std::vector<std::string> expect = {
+        "1,2.5,x,1000000,-3", "b, c",
+        "long string itemlong string itemlong string item"
+    };
+    EXPECT_TRUE(GetRecords().strings_ == expect);
+}
+
+TEST_CASE(table13)
+{
+    luna::State state;
+    RegisterRecord(&state);
+    lib::table::RegisterLibTable(&state);
+    lib::string::RegisterLibString(&state);
+
+    // Values are decoded into equal values, strings are concatenated
+    // messages decoded one by one
+    state.DoString(
+        "local t = { 1, -2, 0.5, 'str', true, { x = false }, "
+        "            name = 'n', [2^40] = -0.25 } "
+        "local u, pos = table.deserialize(table.serialize(t)) "
+        "record(table.concat(u, ',', 1, 4)) "
+        "record((u[5] and 'true' or '') .. (u[6].x == false and 'false' or '') .. "
+        "       u.name .. u[2^40]) "
+        "local s = table.serialize('a') .. table.serialize(42) "
+        "local a, next = table.deserialize(s) "
+        "record(a .. table.deserialize(s, next))");
+
+    std::vector<std::string> expect = {
+        "1,-2,0.5,str", "truefalsen-0.25", "a42"
+    };
+    EXPECT_TRUE(GetRecords().strings_ == expect);
+
+    EXPECT_EXCEPTION(luna::RuntimeException, {
+        state.DoString("local t = {} t[1] = t table.serialize(t)");
+    });
+
+    EXPECT_EXCEPTION(luna::RuntimeException, {
+        state.DoString("table.serialize({ table.concat })");
+    });
+
+    // Data ends in the middle of the string
+    EXPECT_EXCEPTION(luna::RuntimeException, {
+        state.DoString("table.deserialize(string.sub(table.serialize('abc'), 1, 3))");
+    });
+}
+
+TEST_CASE(table14)
+{
+    // Tables which get the same keys in the same order share a shape,
+    // keys set to nil keep their slots, other keys make hash tables
+    luna::ShapeTree shapes(nullptr);
+    luna::String key_str1("x");
+    luna::String key_str2("y");
+    luna::String key_str3("z");
+    luna::Value key1(&key_str1);
+    luna::Value key2(&key_str2);
+    luna::Value key3(&key_str3);
+    luna::Table t1(nullptr, &shapes);
+    luna::Table t2(nullptr, &shapes);
+
+    unsigned int slot1 = 0;
+    unsigned int slot2 = 0;
+    luna::Value value(1.0);
+    t1.SetValueBySlot(key1, value, slot1);
+    t1.SetValueBySlot(key2, value, slot2);
+    value = luna::Value(2.0);
+    t2.SetValueBySlot(key1, value, slot1);
+    t2.SetValueBySlot(key2, value, slot2);
+    EXPECT_TRUE(t1.GetShape() && t1.GetShape() == t2.GetShape());
+    EXPECT_TRUE(slot1 == 0 && slot2 == 1);
+    EXPECT_TRUE(t1.GetValueBySlot(key2, slot2).num_ == 1);
+    EXPECT_TRUE(t2.GetValue(key1).num_ == 2);
+
+    // Iteration follows the order of slots
+    t1.SetValueBySlot(key1, luna::Value(), slot1);
+    t1.SetValueBySlot(key3, value, slot1);
+    EXPECT_TRUE(t1.GetShape() != t2.GetShape());
+    luna::Value key;
+    EXPECT_TRUE(t1.FirstKeyValue(key, value));
+    EXPECT_TRUE(key.str_ == &key_str2 && value.num_ == 1);
+    EXPECT_TRUE(t1.NextKeyValue(key, key, value));
+    EXPECT_TRUE(key.str_ == &key_str3 && value.num_ == 2);
+    EXPECT_TRUE(!t1.NextKeyValue(key, key, value));
+
+    luna::Value number_key(0.5);
+    t2.SetValue(number_key, value);
+    EXPECT_TRUE(!t2.GetShape());
+    EXPECT_TRUE(t2.GetValue(key1).num_ == 2);
+    EXPECT_TRUE(t2.GetValueBySlot(key2, slot2).num_ == 2);
+    EXPECT_TRUE(t2.GetValue(number_key).num_ == 2);
+}
+
+TEST_CASE(table15)
+{
+    // Records built by constructors and field assignment
+    luna::State state;
+    RegisterRecord(&state);
+    lib::base::RegisterLibBase(&state);
+
+    state.DoString(
+        "local ps = {} "
+        "for i = 1, 100 do ps[i] = { x = i, y = -i } ps[i].z = i * i end "
+        "ps[50].y = nil ps[60].w = 'w' ps[70][1] = 1 "
+        "local s = '' "
+        "for k, v in pairs(ps[50]) do s = s .. k .. v end "
+        "record(s .. ps[60].w .. ps[70][1] .. ps[100].x + ps[100].z)");
+
+    std::vector<std::string> expect = { "x50z2500w110100" };
+    EXPECT_TRUE(GetRecords().strings_ == expect);
+}
+
+TEST_CASE(table16)
+{
+    // Integer keys in hash table move to array part in bulk when more
+    // than half of the array is used
+    luna::Table t;
+    luna::Value key;
+    luna::Value value(1.0);
+    key.type_ = luna::ValueT_Number;
+    for (int i = 100; i >= 2; --i)
+    {
+        key.num_ = i;
+        t.SetValue(key, value);
+    }
+    EXPECT_TRUE(t.ArraySize() == 100);
+    key.num_ = 1;
+    EXPECT_TRUE(t.GetValue(key).IsNil());
+
+    // Iteration skips nil values of array part
+    int count = 0;
+    luna::Value k;
+    for (bool ok = t.FirstKeyValue(k, value); ok; ok = t.NextKeyValue(k, k, value))
+    {
+        EXPECT_TRUE(!value.IsNil());
+        ++count;
+    }
+    EXPECT_TRUE(count == 99);
+
+    // Keys which use less than half of array stay in hash table
+    luna::Table sparse;
+    for (int i = 1; i <= 100; ++i)
+    {
+        key.num_ = i * 3;
+        sparse.SetValue(key, value);
+    }
+    EXPECT_TRUE(sparse.ArraySize() == 0);
+    key.num_ = 300;
+    EXPECT_TRUE(sparse.GetValue(key).num_ == 1);
+}
@@ -0,0 +1,65 @@
+#include "UnitTest.h"
+#include "luna/Text.h"
+#include <string>
+#include <cctype>
+
+namespace
+{
+    // All bytes repeated, so every length covers vector and tail loops
+    std::string AllBytes(std::size_t len)
+    {
+        std::string str;
+        for (std::size_t i = 0; i < len; ++i)
+            str.push_back(static_cast<char>(i * 7 + 3));
+        return str;
+    }
+} // namespace
+
+TEST_CASE(text1)
+{
+    for (std::size_t len = 0; len < 600; len += 37)
+    {
+        auto src = AllBytes(len);
+        std::string lower(len, '\0');
+        std::string upper(len, '\0');
+        std::string reverse(len, '\0');
+        luna::LowerCase(&lower[0], src.data(), len);
+        luna::UpperCase(&upper[0], src.data(), len);
+        luna::Reverse(&reverse[0], src.data(), len);
+
+        bool same = true;
+        for (std::size_t i = 0; i < len; ++i)
+        {
+            auto c = static_cast<unsigned char>(src[i]);
+            same = same && lower[i] == static_cast<char>(std::tolower(c));
+            same = same && upper[i] == static_cast<char>(std::toupper(c));
+            same = same && reverse[i] == src[len - 1 - i];
+        }
+        EXPECT_TRUE(same);
+
+        // Convert in place
+        luna::LowerCase(&upper[0], upper.data(), len);
+        EXPECT_TRUE(upper == lower);
+    }
+}
+
+TEST_CASE(text2)
+{
+    std::string id = "abc_XYZ_0123456789_abcdefghijklmnopqrstuvwxyz";
+    for (std::size_t len = 0; len <= id.size(); ++len)
+    {
+        auto str = id.substr(0, len) + "+1";
+        EXPECT_TRUE(luna::ScanIdentifier(str.data(), str.size()) == len);
+        EXPECT_TRUE(luna::ScanIdentifier(str.data(), len) == len);
+    }
+
+    std::string digits = "01234567890123456789012345";
+    EXPECT_TRUE(luna::ScanDigits(digits.data(), digits.size()) == digits.size());
+    EXPECT_TRUE(luna::ScanDigits("123.5", 5) == 3);
+    EXPECT_TRUE(luna::ScanDigits("12345678901234567e", 18) == 17);
+    EXPECT_TRUE(luna::ScanHexDigits("0123456789abcdefABCDEFg", 23) == 22);
+    EXPECT_TRUE(luna::ScanHexDigits("ffp1", 4) == 2);
+
+    // Non-ASCII bytes are not identifier characters
+    EXPECT_TRUE(luna::ScanIdentifier("ab\xc1\xe1", 4) == 2);
+}
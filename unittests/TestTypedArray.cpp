@@ -0,0 +1,88 @@
+#include "UnitTest.h"
+#include "TestCommon.h"
+#include "luna/State.h"
+#include "luna/LibAPI.h"
+#include "luna/LibTypedArray.h"
+#include "luna/TypedArray.h"
+#include "luna/Exception.h"
+#include <string>
+#include <vector>
+
+TEST_CASE(typedarray1)
+{
+    luna::TypedArray array(luna::TypedArrayT_Int32, 3);
+    EXPECT_TRUE(array.GetValue(1.0).num_ == 0.0);
+    EXPECT_TRUE(array.GetValue(0.0).type_ == luna::ValueT_Nil);
+    EXPECT_TRUE(array.GetValue(1.5).type_ == luna::ValueT_Nil);
+    EXPECT_TRUE(array.GetValue(4.0).type_ == luna::ValueT_Nil);
+    EXPECT_TRUE(!array.SetValue(4.0, 1.0));
+
+    // Integers wrap around, fractions are truncated
+    EXPECT_TRUE(array.SetValue(1.0, 4294967297.0));
+    EXPECT_TRUE(array.SetValue(2.0, -2.75));
+    EXPECT_TRUE(array.SetValue(3.0, 2147483648.0));
+    EXPECT_TRUE(array.GetNumber(0) == 1.0);
+    EXPECT_TRUE(array.GetNumber(1) == -2.0);
+    EXPECT_TRUE(array.GetNumber(2) == -2147483648.0);
+
+    luna::TypedArray bytes(luna::TypedArrayT_Byte, 1);
+    bytes.SetNumber(0, -1.0);
+    EXPECT_TRUE(bytes.GetNumber(0) == 255.0);
+}
+
+TEST_CASE(typedarray2)
+{
+    luna::State state;
+    RegisterRecord(&state);
+    lib::typedarray::RegisterLibTypedArray(&state);
+
+    state.DoString(
+        "local a = typedarray.float64(4) "
+        "for i = 1, #a do a[i] = i * 1.5 end "
+        "record(#a, a[2] * 2, a[5], a:type()) "
+        "local b = typedarray.int32({ 1, 2, 3 }) "
+        "b[1] = 7.9 "
+        "record(b[1], #b:tostring()) "
+        "local c = typedarray.byte('abc') "
+        "c[2] = 256 + 66 "
+        "record(c:tostring(), c:tostring(2, 10)) "
+        "local t = b:copy(c, 1):totable(2) "
+        "record(#t, t[1], t[2]) "
+        "local d = typedarray.int32(b:tostring()) "
+        "record(d[1], d[3]) "
+        "a:fill(0, 2, 3) "
+        "record(a[1], a[2], a[4])");
+
+    std::vector<std::string> expect = {
+        "4", "6", "nil", "float64",
+        "7", "12",
+        "aBc", "Bc",
+        "2", "66", "99",
+        "97", "99",
+        "1.5", "0", "6"
+    };
+    EXPECT_TRUE(GetRecords().strings_ == expect);
+}
+
+TEST_CASE(typedarray3)
+{
+    luna::State state;
+    lib::typedarray::RegisterLibTypedArray(&state);
+
+    // Elements only accept numbers of index in range
+    EXPECT_EXCEPTION(luna::RuntimeException, {
+        state.DoString("local a = typedarray.byte(2) a[3] = 1");
+    });
+
+    EXPECT_EXCEPTION(luna::RuntimeException, {
+        state.DoString("local a = typedarray.byte(2) a[1] = 'x'");
+    });
+
+    EXPECT_EXCEPTION(luna::RuntimeException, {
+        state.DoString("typedarray.int32('abc')");
+    });
+
+    EXPECT_EXCEPTION(luna::RuntimeException, {
+        state.DoString("typedarray.byte(2):copy({ 1, 2, 3 })");
+    });
+}
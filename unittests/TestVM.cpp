@@ -0,0 +1,131 @@
+#include "UnitTest.h"
+#include "TestCommon.h"
+#include "luna/State.h"
+#include "luna/Exception.h"
+#include "luna/LibBase.h"
+#include "luna/LibTable.h"
+#include <vector>
+
+TEST_CASE(vm1)
+{
+    luna::State state;
+    RegisterRecord(&state);
+
+    // Numeric for loops record count of iterations and the last var,
+    // loops which never end are stopped after 100 iterations
+    state.DoString(
+        "local function run(a, b, c) "
+        "    local n, last = 0, nil "
+        "    for i = a, b, c do "
+        "        n = n + 1 last = i "
+        "        if n > 100 then break end "
+        "    end "
+        "    return n, last "
+        "end "
+        "record(run(1, 10, 3)) "
+        "record(run(10, 1, -3)) "
+        "record(run(1, 2^53, 2^52)) "
+        "record(run(-2^53, -2^53 + 2, 1)) "
+        "record(run(0, 1, 0.1)) "
+        "record(run(1, 0, -0.25)) "
+        "record(run(1, 10, 0)) "
+        "record(run(10, 1, 0)) "
+        "record(run(1, 10, 0/0)) "
+        "record(run(0/0, 10, 1)) "
+        "record(run(1, 0/0, 1))");
+
+    // Float steps accumulate into var
+    double tenth = 0.0;
+    for (int i = 0; i < 10; ++i)
+        tenth += 0.1;
+
+    std::vector<double> expect = {
+        4, 10,
+        4, 1,
+        3, 9007199254740992.0,
+        3, -9007199254740990.0,
+        11, tenth,
+        5, 0,
+        0, -1,
+        101, 10,
+        0, -1,
+        0, -1,
+        0, -1
+    };
+    EXPECT_TRUE(GetRecords().numbers_ == expect);
+
+    EXPECT_EXCEPTION(luna::RuntimeException, {
+        state.DoString("for i = 1, 'x' do end");
+    });
+}
+
+TEST_CASE(vm2)
+{
+    luna::State state;
+    RegisterRecord(&state);
+
+    // Each iteration of loops captures its own locals
+    state.DoString(
+        "local hs = {} "
+        "repeat local r = #hs + 1 hs[r] = function() return r end until #hs == 3 "
+        "record(hs[1](), hs[2](), hs[3]()) "
+        "hs = {} "
+        "while #hs < 3 do local r = #hs + 1 hs[r] = function() return r end end "
+        "record(hs[1](), hs[2](), hs[3]()) "
+        "hs = {} "
+        "repeat local r = #hs + 1 hs[r] = function() return r end "
+        "    if r == 2 then break end "
+        "until false "
+        "record(hs[1](), hs[2]()) "
+        "local n = 0 "
+        "repeat local r = n n = n + 1 until (function() return r end)() == 2 "
+        "record(n)");
+
+    std::vector<double> expect = { 1, 2, 3, 1, 2, 3, 1, 2, 3 };
+    EXPECT_TRUE(GetRecords().numbers_ == expect);
+}
+
+TEST_CASE(vm3)
+{
+    luna::State state;
+    RegisterRecord(&state);
+    lib::base::RegisterLibBase(&state);
+    lib::table::RegisterLibTable(&state);
+    state.SetMaxCallDepth(1000);
+
+    // Tail calls reuse the frame of caller, so the depth of tail
+    // recursion is not limited by max call depth
+    state.DoString(
+        "local function loop(n, acc) "
+        "    if n == 0 then return acc end "
+        "    return loop(n - 1, acc + 1) "
+        "end "
+        "record(loop(100000, 0)) "
+        "local t = {} "
+        "function t:loop(n) "
+        "    if n == 0 then return self end "
+        "    return self:loop(n - 1) "
+        "end "
+        "record(t:loop(100000) == t and 'self' or 'other') "
+        "local function unpack(n, t) "
+        "    if n == 0 then return table.unpack(t) end "
+        "    return unpack(n - 1, t) "
+        "end "
+        "record(unpack(100000, { 1, 2, 3 })) "
+        "local function name(v) return type(v) end "
+        "record(name(1), name('a'))");
+
+    std::vector<std::string> expect = {
+        "100000", "self", "1", "2", "3", "number", "string"
+    };
+    EXPECT_TRUE(GetRecords().strings_ == expect);
+
+    EXPECT_EXCEPTION(luna::RuntimeException, {
+        state.DoString(
+            "local function depth(n) "
+            "    if n == 0 then return 0 end "
+            "    return 1 + depth(n - 1) "
+            "end "
+            "depth(100000)");
+    });
+}